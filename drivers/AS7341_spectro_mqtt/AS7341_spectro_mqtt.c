@@ -21,13 +21,26 @@
 
 #include "inf2004_credentials.h"
 #include "mqtt_Rebuilt.h"
+#include "json_writer.h"
+#include "flash_log.h"
+#include "cbor_writer.h"
 #include "AS7341_Rebuilt.h"
 #include "i2c_tools.h"
 
 // #define DEBUG
 
 #define SENSOR_READ_INTERVAL_MS 3000
+#define I2C_DIAG_INTERVAL_READS 10 // Number of sensor reads between two I2C diagnostics reports (DIAG topic)
 #define MQTT_PUBLISH_WAIT_MS 100
+#define REPLAY_MAX_QUEUED 4 // Samples kept in flash are only replayed while fewer messages than this are queued
+#define SAMPLE_BATCH_MAX_SAMPLES 10   // Samples sent in one message at most (see mqtt_batch_begin)
+#define SAMPLE_BATCH_MAX_AGE_MS 30000 // Time a sample waits for the rest of its batch at most
+#define SAMPLE_FORMAT_JSON 0              // Samples published as JSON text (batched, see mqtt_batch_begin)
+#define SAMPLE_FORMAT_CBOR 1              // Samples published as CBOR (lib/cbor): smaller, and no float formatting, one message per sample
+#define SAMPLE_FORMAT SAMPLE_FORMAT_JSON  // Encoding of the AS7341 samples (subscribers tell them apart from their first byte)
+#define SAMPLE_SCHEMA CBOR_SCHEMA(1)      // Schema byte of the CBOR samples, to be bumped when their fields change
+#define SAMPLE_TAG_JSON 0                 // Tag of the samples kept in flash (see flash_log_append): JSON text
+#define SAMPLE_TAG_CBOR 1                 // CBOR message (schema byte included)
 #pragma region Non-Sensor Related stuff that you probably wouldnt care about
 
 #ifdef DEBUG
@@ -37,27 +50,17 @@
 #endif
 
 #define MQTT_BUFF_SIZE 1025 // 1024 + 1 for null terminator
+#define MQTT_TOPIC_SIZE 128 // Longest topic + 1 for null terminator
+#define MQTT_INBOX_SIZE 256 // Largest incoming payload + 1 for null terminator
 
 // Section for MQTT and Network Utilities.
 #pragma region MQTT and Network Utilities
 
-// Buffer for holding the MQTT publishing topic.
-static char MQTT_PUB_TOPIC_BUFFER[MQTT_BUFF_SIZE];
-
 // Buffer for holding the MQTT publishing payload.
 static char MQTT_PUB_PAYLOAD_BUFFER[MQTT_BUFF_SIZE];
 
-// Total length of the MQTT payload.
-static u32_t payload_total_len = 0;
-
-// Buffer to store MQTT payload data.
-static u8_t payload_buffer[MQTT_BUFF_SIZE];
-
-// Buffer to store MQTT topic data.
-static u8_t topic_buffer[MQTT_BUFF_SIZE];
-
-// Index variable for copying MQTT payload data.
-static u8_t payload_cpy_index = 0;
+// Buffer the MQTT library reassembles the incoming messages into, one at a time.
+static u8_t mqtt_inbox_arena[MQTT_INBOX_SIZE];
 
 // Total number of MQTT subscription topics.
 #define MQTT_TOTAL_SUB_TOPICS 1
@@ -66,90 +69,21 @@ static u8_t payload_cpy_index = 0;
 #define MQTT_TOTAL_PUB_TOPICS 1
 
 // Array of MQTT subscription topics. Here, only one topic exists, formed by the MQTT client ID and "/CMD".
-static char MQTT_SUB_TOPICS[MQTT_TOTAL_SUB_TOPICS][MQTT_BUFF_SIZE] = {MQTT_CLIENT_ID "/CMD"};
+static char MQTT_SUB_TOPICS[MQTT_TOTAL_SUB_TOPICS][MQTT_TOPIC_SIZE] = {MQTT_CLIENT_ID "/CMD"};
 
 // Array of MQTT publishing topics. Here, only one topic exists, based on the MQTT client ID.
-static char MQTT_PUB_TOPICS[MQTT_TOTAL_PUB_TOPICS][MQTT_BUFF_SIZE] = {MQTT_CLIENT_ID};
+static char MQTT_PUB_TOPICS[MQTT_TOTAL_PUB_TOPICS][MQTT_TOPIC_SIZE] = {MQTT_CLIENT_ID};
 
 // Process the new MQTT message received
 #pragma region MQTT incoming data functions
-static void process_incoming_message()
+static void process_incoming_message(const char *topic, const u8_t *payload, u32_t len, void *arg)
 {
     printf("New MQTT message received!\n");
-    printf("%s[%d]: %s\n", topic_buffer, payload_cpy_index, payload_buffer);
+    printf("%s[%u]: %s\n", topic, (unsigned int)len, (const char *)payload);
     // do stuff here. maybe use a switch case to handle different topics,
     // and then based on the topic, do different things based on the payload value
 }
 
-// You'll need 2 functions to handle incoming messages
-// 1. mqtt_incoming_notification_cb
-// 2. mqtt_incoming_payload_cb
-// The first function is called when a new message is received.
-// This function will tell you the topic and the total length of the message.
-// The second function will then be called only if the payload is not empty.
-// This function will be called multiple times until the entire payload is received.
-//
-static void mqtt_notify(void *arg, const char *topic, u32_t tot_len)
-{
-    DEBUG_printf("Incoming topic: '%s', total length: %u\n", topic, (unsigned int)tot_len);
-
-    if (strlen(topic) > MQTT_BUFF_SIZE)
-    {
-        DEBUG_printf("Error: incoming topic does not fit in buffer. Data discarded\n");
-        payload_total_len = 0;
-        return;
-    }
-    if (tot_len > MQTT_BUFF_SIZE)
-    {
-        DEBUG_printf("Error: incoming payload does not fit in buffer. Data discarded\n");
-        payload_total_len = 0;
-        return;
-    }
-    memcpy(topic_buffer, topic, strlen(topic));
-    payload_total_len = tot_len;
-    payload_cpy_index = 0;
-    if (payload_total_len == 0)
-    {
-        // If the payload is empty, then erase the payload buffer
-        // And then call the process_incoming_message() function
-        //  since when there is no payload, the mqtt_read_payload() function will not be called
-        //  and thus the process_incoming_message() function will not be called as well
-        // So we have to call it manually here instead.
-        memset(payload_buffer, 0, MQTT_BUFF_SIZE);
-        process_incoming_message();
-    }
-}
-
-// Function to handle the MQTT payload received.
-static void mqtt_read_payload(void *arg, const u8_t *data, u16_t len, u8_t flags)
-{
-    // Checking if there is still payload data to process.
-    if (payload_total_len > 0)
-    {
-        // Decrementing the remaining length of the payload data by the received length.
-        payload_total_len -= len;
-
-        // Copying the received data into the payload buffer at the appropriate index.
-        memcpy(&payload_buffer[payload_cpy_index], data, len);
-
-        // Incrementing the payload copy index by the received length.
-        payload_cpy_index += len;
-
-        // Checking if the entire payload has been received.
-        if (payload_total_len == 0)
-        {
-            // Null-terminating the payload buffer to indicate the end of the message.
-            payload_buffer[payload_cpy_index] = 0;
-
-            // Displaying a debug message indicating the received payload length and content.
-            DEBUG_printf("Message Received [%d]:%s\n", payload_cpy_index, payload_buffer);
-
-            // Calling the function to process the incoming MQTT message.
-            process_incoming_message();
-        }
-    }
-}
-
 // Function to subscribe to all MQTT topics.
 static void mqtt_subscribe_to_all_topics()
 {
@@ -167,81 +101,273 @@ static void mqtt_subscribe_to_all_topics()
 
 #pragma region MQTT publish section
 
-// Function to format sensor data into JSON and publish it to MQTT
-static void publishSensorDataFormatToJson(const char *sensorName, char *valueNames[], char *sensorValues[], size_t numValues)
+// Time spent reading the sensor since the last I2C diagnostics report, in microseconds.
+static uint64_t sensorReadUs = 0;
+
+// Function to publish sensor data to MQTT
+static void publishSensorData(const char *sensorName, const char *JsonString)
 {
-    char topic[MQTT_BUFF_SIZE];
-    char jsonMessage[MQTT_BUFF_SIZE];
+    char topic[MQTT_TOPIC_SIZE];
 
     // Construct the topic: clientid/sensorname
-    snprintf(topic, MQTT_BUFF_SIZE, "%s/%s", MQTT_CLIENT_ID, sensorName);
+    snprintf(topic, MQTT_TOPIC_SIZE, "%s/%s", MQTT_CLIENT_ID, sensorName);
 
-    // Construct the JSON message
-    snprintf(jsonMessage, MQTT_BUFF_SIZE, "{");
-
-    for (size_t i = 0; i < numValues; ++i)
+    // Publish the JSON message to the MQTT topic
+    if (mqtt_batch_add(topic, JsonString) != ERR_OK)
     {
-        // Add the valueName and sensorValue to the JSON message
-        strcat(jsonMessage, "\"");
-        strcat(jsonMessage, valueNames[i]);
-        strcat(jsonMessage, "\":\"");
-        strcat(jsonMessage, sensorValues[i]);
-        strcat(jsonMessage, "\"");
-
-        // Add a comma if not the last element
-        if (i < numValues - 1)
-        {
-            strcat(jsonMessage, ",");
-        }
+        printf("Failed to queue for topic: %s, message: %s\n", topic, JsonString);
+        return;
     }
+    printf("Queued for topic: %s, message: %s\n", topic, JsonString);
+}
 
-    strcat(jsonMessage, "}");
+/**
+ * @brief Keeps a sample in flash while the MQTT server is unreachable.
+ *
+ * The samples kept in flash are replayed once the connection is back (see replayStoredSample),
+ * so the samples taken during a broker or Wi-Fi outage are not lost.
+ *
+ * @param tag How the sample is encoded (SAMPLE_TAG_JSON or SAMPLE_TAG_CBOR).
+ *
+ * @param sensorName The name of the sensor the sample comes from.
+ *
+ * @param data The sample.
+ *
+ * @param len The length of the sample.
+ *
+ * @return void
+ */
+static void keepSampleInFlash(uint8_t tag, const char *sensorName, const void *data, size_t len)
+{
+    uint8_t record[FLASH_LOG_MAX_DATA];
+    size_t nameLen = strlen(sensorName) + 1;
 
-    // Print or send the JSON message
-    printf("Topic: %s\n", topic);
-    printf("JSON Message: %s\n", jsonMessage);
+    // The record holds the sensor name (null terminated) followed by the sample
+    if (nameLen + len > sizeof(record))
+    {
+        printf("Sample of %s too large to be kept in flash, dropped\n", sensorName);
+        return;
+    }
+    memcpy(record, sensorName, nameLen);
+    memcpy(&record[nameLen], data, len);
 
-    // Publish the JSON message to the MQTT topic
-    if (mqtt_publish_data(topic, jsonMessage) != ERR_OK)
+    // Timestamped with the time since boot in ms, the boot count is kept by the log (see flash_log_getBoot)
+    if (!flash_log_append(tag, (uint32_t)(time_us_64() / 1000), record, nameLen + len))
     {
-        printf("Failed to publish to topic: %s, message: %s\n", topic, jsonMessage);
+        printf("Failed to keep the sample of %s in flash\n", sensorName);
         return;
     }
-    printf("Published to topic: %s, message: %s\n", topic, jsonMessage);
+    printf("Kept in flash until the connection is back: %s, %u bytes\n", sensorName, (unsigned)len);
 }
 
-// Function to publish sensor data to MQTT
-static void publishSensorData(const char *sensorName, const char *JsonString)
+/**
+ * @brief Publishes a sensor sample, or keeps it in flash while the MQTT server is unreachable.
+ *
+ * @param sensorName The name of the sensor for which data is being published.
+ * 
+ * @param JsonString A JSON-formatted string containing the sensor data to be published.
+ * 
+ * @return void
+ */
+static void publishSensorSample(const char *sensorName, const char *JsonString)
+{
+    if (mqtt_is_connected())
+    {
+        publishSensorData(sensorName, JsonString);
+        return;
+    }
+    keepSampleInFlash(SAMPLE_TAG_JSON, sensorName, JsonString, strlen(JsonString));
+}
+
+#if SAMPLE_FORMAT == SAMPLE_FORMAT_CBOR
+/**
+ * @brief Publishes a sensor sample encoded in CBOR, or keeps it in flash while the MQTT server is unreachable.
+ *
+ * The message is queued as is (schema byte and CBOR map, see lib/cbor), one message per sample:
+ * the batches (see mqtt_batch_begin) only hold JSON samples.
+ *
+ * @param sensorName The name of the sensor for which data is being published.
+ *
+ * @param cbor The CBOR message of the sample.
+ *
+ * @return void
+ */
+static void publishSensorSampleCbor(const char *sensorName, const cbor_writer_t *cbor)
 {
-    char topic[MQTT_BUFF_SIZE];
+    char topic[MQTT_TOPIC_SIZE];
 
-    // Construct the topic: clientid/sensorname
-    snprintf(topic, MQTT_BUFF_SIZE, "%s/%s", MQTT_CLIENT_ID, sensorName);
+    if (!cbor_isOk(cbor))
+    {
+        printf("Sample of %s too large for its buffer, dropped\n", sensorName);
+        return;
+    }
+    if (!mqtt_is_connected())
+    {
+        keepSampleInFlash(SAMPLE_TAG_CBOR, sensorName, cbor->buffer, cbor_getLength(cbor));
+        return;
+    }
 
-    // Publish the JSON message to the MQTT topic
-    if (mqtt_publish_data(topic, JsonString) != ERR_OK)
+    // Construct the topic: clientid/sensorname
+    snprintf(topic, MQTT_TOPIC_SIZE, "%s/%s", MQTT_CLIENT_ID, sensorName);
+    if (mqtt_outbox_enqueue_w_len(topic, cbor->buffer, cbor_getLength(cbor)) != ERR_OK)
     {
-        printf("Failed to publish to topic: %s, message: %s\n", topic, JsonString);
+        printf("Failed to queue for topic: %s, %u bytes of CBOR\n", topic, (unsigned)cbor_getLength(cbor));
         return;
     }
-    printf("Published to topic: %s, message: %s\n", topic, JsonString);
+    printf("Queued for topic: %s, %u bytes of CBOR\n", topic, (unsigned)cbor_getLength(cbor));
 }
+#endif
 
-#pragma endregion
+/**
+ * @brief Queues a replayed sample, written into the room reserved for it in the outbound queue (see replayStoredSample).
+ *
+ * @param complete True if the sample fitted in the room reserved.
+ *
+ * @param len The length of the message.
+ *
+ * @return True if the sample is done with (queued, or dropped as it can never fit), False to try again later.
+ */
+static bool commitStoredSample(bool complete, size_t len)
+{
+    if (!complete)
+    {
+        mqtt_outbox_cancel();
+        printf("Replayed sample too large for its message, dropped\n");
+        return true;
+    }
+    return mqtt_outbox_commit(len) == ERR_OK;
+}
 
-// Function to print an IPv4 address
-static void printIPv4Address(unsigned int addr)
+/**
+ * @brief Replays a sample kept in flash to the <sensorName>/LOG topic (callback of flash_log_replay).
+ *
+ * The sample is wrapped with the time it was taken, e.g. {"boot":3,"ms":123456,"data":{...}}
+ * (time since boot in ms, of the boot number "boot"), so it can be told apart from the live samples.
+ * A CBOR sample is wrapped the same way, as a CBOR map under the schema byte of the sample.
+ *
+ * @param record The record of the sample.
+ * 
+ * @param arg Unused.
+ * 
+ * @return True if the sample has been queued, False to try again later (the outbound queue is busy).
+ */
+static bool replayStoredSample(const flash_log_record_t *record, void *arg)
 {
-    // Extracting individual octets
-    unsigned char octet4 = (addr >> 24) & 0xFF;
-    unsigned char octet3 = (addr >> 16) & 0xFF;
-    unsigned char octet2 = (addr >> 8) & 0xFF;
-    unsigned char octet1 = addr & 0xFF;
-
-    // Printing the IPv4 address
-    printf("%u.%u.%u.%u\n", octet1, octet2, octet3, octet4);
+    char topic[MQTT_TOPIC_SIZE];
+    const char *sensorName = (const char *)record->data;
+    size_t nameLen = strnlen(sensorName, record->len);
+    // Room for the sample and its wrapping, written straight into the outbound queue
+    u16_t maxLen = record->len + 64;
+
+    // Leave room in the outbound queue for the live samples
+    if (mqtt_outbox_count() >= REPLAY_MAX_QUEUED)
+    {
+        return false;
+    }
+
+    // Not a sample record (no sensor name), nothing to replay
+    if (nameLen >= record->len)
+    {
+        return true;
+    }
+
+    snprintf(topic, MQTT_TOPIC_SIZE, "%s/%s/LOG", MQTT_CLIENT_ID, sensorName);
+    char *payload = mqtt_outbox_reserve(topic, maxLen);
+    if (payload == NULL)
+    {
+        // Not enough free room in the outbound queue, the reservation never drops the messages queued
+        return false;
+    }
+
+    // CBOR sample (see publishSensorSampleCbor): wrapped the same way, in CBOR, under the schema of the sample
+    if ((record->tag == SAMPLE_TAG_CBOR) && (record->len > nameLen + 2))
+    {
+        const uint8_t *sample = (const uint8_t *)sensorName + nameLen + 1;
+        cbor_writer_t cbor;
+        cbor_begin(&cbor, (uint8_t *)payload, maxLen, sample[0]);
+        cbor_openMap(&cbor, 3);
+        cbor_fieldUint(&cbor, "boot", record->boot);
+        cbor_fieldUint(&cbor, "ms", record->timestamp);
+        cbor_putText(&cbor, "data");
+        cbor_putRaw(&cbor, &sample[1], record->len - nameLen - 2);
+        return commitStoredSample(cbor_isOk(&cbor), cbor_getLength(&cbor));
+    }
+
+    json_writer_t json;
+    json_begin(&json, payload, maxLen + 1);
+    json_openObject(&json);
+    json_fieldUint(&json, "boot", record->boot);
+    json_fieldUint(&json, "ms", record->timestamp);
+    json_key(&json, "data");
+    json_putRaw(&json, sensorName + nameLen + 1, record->len - nameLen - 1);
+    json_closeObject(&json);
+    return commitStoredSample(json_isOk(&json), json_getLength(&json));
 }
 
+/**
+ * @brief Publishes the I2C diagnostics of the last few reads to the DIAG topic, then starts a new trace window.
+ *
+ * The payload holds the time spent reading the sensor (driver delays included) and the I2C trace summary
+ * (time spent on the bus, per-device latency histograms, see i2c_tools_formatDiagnostics), e.g.
+ * {"sensorReadUs":2250,"i2c":{"windowUs":30000000,"busUs":2250,"dev":[...]}}
+ * so the share of each cycle spent on the bus versus in the driver's busy-waits can be told apart.
+ *
+ * @param bus Pointer to the I2C bus handle of the sensor.
+ *
+ * @return void
+ */
+static void publishI2CDiagnostics(i2c_tools_bus_t *bus)
+{
+    char topic[MQTT_TOPIC_SIZE];
+    json_writer_t json;
+    size_t room;
+
+    // Liveness of the MQTT session, measured by the library (keepalive round trip, signal strength)
+    mqtt_liveness_t liveness;
+    mqtt_get_liveness(&liveness);
+
+    // Written straight into the free room of the outbound queue, the unused room is given back on commit.
+    // The report is skipped if the queue is too full: it never pushes the queued samples out.
+    snprintf(topic, MQTT_TOPIC_SIZE, "%s/DIAG", MQTT_CLIENT_ID);
+    char *message = mqtt_outbox_reserve(topic, MQTT_BUFF_SIZE - 1);
+    if (message == NULL)
+    {
+        printf("Outbound queue full, skipped topic: %s\n", topic);
+    }
+    else
+    {
+        json_begin(&json, message, MQTT_BUFF_SIZE);
+        json_openObject(&json);
+        json_fieldUint(&json, "sensorReadUs", sensorReadUs);
+        json_key(&json, "i2c");
+        char *i2cJson = json_beginRaw(&json, &room);
+        json_endRaw(&json, i2c_tools_formatDiagnostics(bus, i2cJson, room));
+        json_fieldInt(&json, "rssi", liveness.rssi);
+        json_fieldUint(&json, "pingRttUs", liveness.ping_rtt_us);
+        json_closeObject(&json);
+
+        if (json_isOk(&json) && (mqtt_outbox_commit(json_getLength(&json)) == ERR_OK))
+        {
+            printf("Queued for topic: %s, message: %s\n", topic, message);
+        }
+        else
+        {
+            mqtt_outbox_cancel();
+            printf("Diagnostics too large for topic: %s, dropped\n", topic);
+        }
+    }
+
+#ifdef DEBUG
+    i2c_tools_dumpTrace(bus);
+#endif
+
+    // Start a new window
+    i2c_tools_clearTrace(bus);
+    sensorReadUs = 0;
+}
+
+#pragma endregion
+
 #pragma endregion
 
 #pragma endregion
@@ -262,53 +388,91 @@ AS7341_sModeTwoData_t getSensor5to8()
     return AS7341_readSpectralDataTwo();
 }
 
-// Function to reconnect to MQTT
-void mqtt_reconnect()
+/**
+ * @brief Called by the MQTT library every time the broker accepts the connection (see mqtt_conn_poll).
+ *
+ * Subscribes to all predefined MQTT topics using `mqtt_subscribe_to_all_topics` (the incoming messages
+ * are handed to `process_incoming_message` by the library). The online status is published once per session by the library.
+ * The connection itself (Wi-Fi, DNS, broker) is made and retried with backoff by `mqtt_conn_poll`, from the main loop.
+ *
+ * @param arg Unused.
+ *
+ * @return void
+ */
+static void mqtt_on_connected(void *arg)
 {
-    // Attempting to connect to the MQTT server continuously until success
-    while (mqtt_begin_connection() != ERR_OK)
-    {
-        printf("Failed to connect to MQTT server. Retrying in 5 seconds...\n");
-        sleep_ms(5000);
-    }
-    printf("Connected to MQTT server.\n");
-
-    // Setting custom callback functions for MQTT
-    set_mqtt_subscribe_callback(mqtt_notify, mqtt_read_payload, NULL);
-
-    // Publishing online status to the MQTT server
-    mqtt_publish_data(MQTT_PUB_TOPICS[0], "ONLINE");
-
     // Subscribing to all MQTT topics
     mqtt_subscribe_to_all_topics();
 }
 
+/**
+ * @brief Called by the MQTT library when the MQTT session ends (see mqtt_conn_set_disconnected_callback).
+ *
+ * The broker publishes the OFFLINE will message on its own, and the library reconnects with backoff.
+ *
+ * @param reason Why the session ended.
+ *
+ * @param arg Unused.
+ *
+ * @return void
+ */
+static void mqtt_on_disconnected(const char *reason, void *arg)
+{
+    printf("MQTT session ended (%s), the samples are kept in flash until it is back.\n", reason);
+}
+
 // Function to read spectral data for sensors 1 to 8 and publish to MQTT based on timer
 void readSensorDataAndPublish()
 {
-    // Checking MQTT connection status by publishing "ONLINE" to the MQTT server
-    if (mqtt_publish_data(MQTT_PUB_TOPICS[0], "ONLINE") != ERR_OK)
-    {
-        printf("MQTT Server disconnected. Reconnecting...\n");
-        mqtt_reconnect();
-    }
-
-    // Reading spectral data for sensors 1 to 4 and 5 to 8
+    // Reading spectral data for sensors 1 to 4 and 5 to 8 (timed, see publishI2CDiagnostics)
+    uint64_t readStart = time_us_64();
     AS7341_sModeOneData_t sensor1to4 = getSensor1to4();
     AS7341_sModeTwoData_t sensor5to8 = getSensor5to8();
+    sensorReadUs += time_us_64() - readStart;
+    json_writer_t json;
+
+#if SAMPLE_FORMAT == SAMPLE_FORMAT_CBOR
+    // Encoding the sensor data in CBOR
+    cbor_writer_t cbor;
+    cbor_begin(&cbor, (uint8_t *)MQTT_PUB_PAYLOAD_BUFFER, MQTT_BUFF_SIZE, SAMPLE_SCHEMA);
+    cbor_openMap(&cbor, 10);
+    cbor_fieldUint(&cbor, "F1", sensor1to4.ADF1);
+    cbor_fieldUint(&cbor, "F2", sensor1to4.ADF2);
+    cbor_fieldUint(&cbor, "F3", sensor1to4.ADF3);
+    cbor_fieldUint(&cbor, "F4", sensor1to4.ADF4);
+    cbor_fieldUint(&cbor, "F5", sensor5to8.ADF5);
+    cbor_fieldUint(&cbor, "F6", sensor5to8.ADF6);
+    cbor_fieldUint(&cbor, "F7", sensor5to8.ADF7);
+    cbor_fieldUint(&cbor, "F8", sensor5to8.ADF8);
+    cbor_fieldUint(&cbor, "Visible", sensor5to8.ADCLEAR);
+    cbor_fieldUint(&cbor, "NIR", sensor5to8.ADNIR);
 
+    // Publishing sensor data for sensors 1 to 8
+    publishSensorSampleCbor("AS7341", &cbor);
+#else
     // Creating a JSON string with the sensor data
-    snprintf(MQTT_PUB_PAYLOAD_BUFFER, MQTT_BUFF_SIZE, "{\"F1\":%d,\"F2\":%d,\"F3\":%d,\"F4\":%d,\"F5\":%d,\"F6\":%d,\"F7\":%d,\"F8\":%d,\"Visible\":%d,\"NIR\":%d}",
-             sensor1to4.ADF1, sensor1to4.ADF2, sensor1to4.ADF3, sensor1to4.ADF4,
-             sensor5to8.ADF5, sensor5to8.ADF6, sensor5to8.ADF7, sensor5to8.ADF8,
-             sensor5to8.ADCLEAR, sensor5to8.ADNIR);
+    json_begin(&json, MQTT_PUB_PAYLOAD_BUFFER, MQTT_BUFF_SIZE);
+    json_openObject(&json);
+    json_fieldUint(&json, "F1", sensor1to4.ADF1);
+    json_fieldUint(&json, "F2", sensor1to4.ADF2);
+    json_fieldUint(&json, "F3", sensor1to4.ADF3);
+    json_fieldUint(&json, "F4", sensor1to4.ADF4);
+    json_fieldUint(&json, "F5", sensor5to8.ADF5);
+    json_fieldUint(&json, "F6", sensor5to8.ADF6);
+    json_fieldUint(&json, "F7", sensor5to8.ADF7);
+    json_fieldUint(&json, "F8", sensor5to8.ADF8);
+    json_fieldUint(&json, "Visible", sensor5to8.ADCLEAR);
+    json_fieldUint(&json, "NIR", sensor5to8.ADNIR);
+    json_closeObject(&json);
 
     // Publishing sensor data for sensors 1 to 8
-    publishSensorData("AS7341", MQTT_PUB_PAYLOAD_BUFFER);
+    publishSensorSample("AS7341", MQTT_PUB_PAYLOAD_BUFFER);
+#endif
 
-    // Formatting and publishing visible light sensor data separately
-    snprintf(MQTT_PUB_PAYLOAD_BUFFER, MQTT_BUFF_SIZE, "%d", sensor1to4.ADCLEAR);
-    publishSensorData("AS7341/visibleLight", MQTT_PUB_PAYLOAD_BUFFER);
+    // Formatting and publishing visible light sensor data separately (always JSON text, the fan node reads it as a number)
+    json_begin(&json, MQTT_PUB_PAYLOAD_BUFFER, MQTT_BUFF_SIZE);
+    json_putUint(&json, sensor1to4.ADCLEAR);
+    publishSensorSample("AS7341/visibleLight", MQTT_PUB_PAYLOAD_BUFFER);
 }
 
 
@@ -321,10 +485,10 @@ int main()
     stdio_init_all();
 
     // Initializing I2C tools
-    i2c_tools_init(i2c0, PICO_DEFAULT_I2C_SDA_PIN, PICO_DEFAULT_I2C_SCL_PIN);
+    i2c_tools_bus_t *bus = i2c_tools_init(i2c0, PICO_DEFAULT_I2C_SDA_PIN, PICO_DEFAULT_I2C_SCL_PIN);
 
     // Initiating AS7341 sensor
-    AS7341_begin(eSpm);
+    AS7341_begin(bus, eSpm);
 
     // Reading sensor ID
     int sensorid = AS7341_readID();
@@ -353,26 +517,13 @@ int main()
     cyw43_arch_enable_sta_mode();
 
     // Connecting to Wi-Fi using specified credentials
-    printf("Connecting to '%s' using '%s' \n", WIFI_SSID, WIFI_PASSWORD);
-    if (cyw43_arch_wifi_connect_timeout_ms(WIFI_SSID, WIFI_PASSWORD, CYW43_AUTH_WPA2_AES_PSK, 30000))
-    {
-        printf("Error connecting to Wi-Fi\n");
-        return 1;
-    }
-    else
-    {
-        printf("Connected to Wi-Fi.\n");
-        // Starting LWIP for network connection
-        cyw43_arch_lwip_begin();
-        printf("Assigned IP address: ");
-        // Printing the assigned IPv4 address
-        printIPv4Address(cyw43_state.netif[0].ip_addr.addr);
-        printf("\n");
-        // Ending LWIP connection
-        cyw43_arch_lwip_end();
-    }
+    // Joined from the main loop by the MQTT library, without waiting for it (see mqtt_conn_poll)
+    mqtt_conn_set_wifi(WIFI_SSID, WIFI_PASSWORD, CYW43_AUTH_WPA2_AES_PSK);
 #pragma endregion
 
+    // Keep the Wi-Fi stack serviced while the sensor's I2C transfers are in flight
+    i2c_tools_setIdleCallback(cyw43_arch_poll);
+
 #pragma region MQTT setup
 
     // Setting up MQTT configuration
@@ -391,10 +542,19 @@ int main()
         MQTT_WILL_RETAIN);
 
     // Initializing MQTT client
+    // Samples taken while the MQTT server is unreachable are kept in flash (see publishSensorSample)
+    printf("%u samples kept in flash waiting to be replayed\n", (unsigned)flash_log_begin());
+
     mqtt_client_init();
+    mqtt_inbox_set_message_callback(mqtt_inbox_arena, sizeof(mqtt_inbox_arena), process_incoming_message, NULL);
 
-    // Reconnecting to MQTT server
-    mqtt_reconnect();
+    // Connected to the MQTT server from the main loop (see mqtt_conn_poll)
+    mqtt_conn_set_connected_callback(mqtt_on_connected, NULL);
+    mqtt_conn_set_disconnected_callback(mqtt_on_disconnected, NULL);
+
+    // The samples go out in batches, one message for up to SAMPLE_BATCH_MAX_SAMPLES samples (see publishSensorData).
+    // The visible light value is not batched, the fan node reads it as a plain number, and neither are the DIAG reports.
+    mqtt_batch_begin(MQTT_CLIENT_ID "/AS7341", SAMPLE_BATCH_MAX_SAMPLES, SAMPLE_BATCH_MAX_AGE_MS, 0);
 
 #pragma endregion
 
@@ -403,6 +563,9 @@ int main()
     // Variable to track the next time to read sensor data
     uint64_t nextTimeToReadSensor = 0;
 
+    // Number of sensor reads since the last I2C diagnostics report
+    int readsSinceDiag = 0;
+
     // Continuous loop for reading sensor data and publishing to MQTT
     while (1)
     {
@@ -411,7 +574,22 @@ int main()
         {
             readSensorDataAndPublish(); // Reading sensor data and publishing to MQTT
             nextTimeToReadSensor = time_us_64() + SENSOR_READ_INTERVAL_MS * 1000; // Updating the next read time
+
+            // Reporting the I2C diagnostics every few reads
+            if (++readsSinceDiag >= I2C_DIAG_INTERVAL_READS)
+            {
+                publishI2CDiagnostics(bus);
+                readsSinceDiag = 0;
+            }
+        }
+        mqtt_conn_poll(); // Connect to the broker, and reconnect with backoff, without blocking the sensor reads
+        // Replay the samples kept in flash during an outage, at the replay rate of the log
+        if (mqtt_is_connected())
+        {
+            flash_log_replay(replayStoredSample, NULL);
         }
+        mqtt_batch_poll();  // Queue the batches whose first sample is SAMPLE_BATCH_MAX_AGE_MS old
+        mqtt_outbox_poll(); // Publish the queued messages, as far as the broker keeps up
         cyw43_arch_poll(); // Polling the Wi-Fi
         sleep_ms(10); // Adding a small delay
     }
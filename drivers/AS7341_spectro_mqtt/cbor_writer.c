@@ -0,0 +1,222 @@
+/** @file cbor_writer.c
+ *
+ * @brief This file contains the source code for the CBOR writer library.
+ * Brief overview of the code:
+ * Encodes the sensor samples as CBOR (RFC 8949), see cbor_writer.h for the message layout.
+ *
+ * Every CBOR item starts with a head: the major type in the top 3 bits, and the argument (a value, a length or a count)
+ * either in the low 5 bits (up to 23) or in the 1, 2, 4 or 8 bytes that follow, big endian (low 5 bits 24 to 27).
+ * Only the definite-length encodings are written, so a message is always in the preferred (shortest) form.
+ */
+
+#include <string.h>
+#include "cbor_writer.h"
+
+// Major types (top 3 bits of the head).
+#define CBOR_MAJOR_UINT 0x00
+#define CBOR_MAJOR_NEGINT 0x20
+#define CBOR_MAJOR_BYTES 0x40
+#define CBOR_MAJOR_TEXT 0x60
+#define CBOR_MAJOR_ARRAY 0x80
+#define CBOR_MAJOR_MAP 0xA0
+
+// Simple values and floats (major type 7).
+#define CBOR_FALSE 0xF4
+#define CBOR_TRUE 0xF5
+#define CBOR_NULL 0xF6
+#define CBOR_FLOAT32 0xFA
+
+/**
+ * @brief Reserves room for len bytes at the end of the message.
+ *
+ * @return A pointer to the room, NULL if it does not fit (the writer is then marked as overflowed).
+ */
+static uint8_t *_reserve(cbor_writer_t *writer, size_t len)
+{
+    if (writer->overflow || (len > writer->size - writer->len))
+    {
+        writer->overflow = true;
+        return NULL;
+    }
+    uint8_t *room = &writer->buffer[writer->len];
+    writer->len += len;
+    return room;
+}
+
+/**
+ * @brief Writes the head of an item: its major type and argument, on as few bytes as the argument allows.
+ */
+static void _putHead(cbor_writer_t *writer, uint8_t major, uint64_t argument)
+{
+    uint8_t *room;
+
+    if (argument < 24)
+    {
+        if ((room = _reserve(writer, 1)) != NULL)
+        {
+            room[0] = major | (uint8_t)argument;
+        }
+        return;
+    }
+
+    // Number of bytes of the argument, and the matching low bits of the head (24 to 27).
+    uint8_t bytes = (argument <= 0xFF) ? 1 : (argument <= 0xFFFF) ? 2 : (argument <= 0xFFFFFFFF) ? 4 : 8;
+    uint8_t info = (bytes == 1) ? 24 : (bytes == 2) ? 25 : (bytes == 4) ? 26 : 27;
+    if ((room = _reserve(writer, 1 + bytes)) != NULL)
+    {
+        room[0] = major | info;
+        for (uint8_t i = 0; i < bytes; i++)
+        {
+            room[bytes - i] = (uint8_t)(argument >> (8 * i));
+        }
+    }
+}
+
+/**
+ * @brief Writes a head followed by a string of bytes (text or byte string).
+ */
+static void _putString(cbor_writer_t *writer, uint8_t major, const void *data, size_t len)
+{
+    uint8_t *room;
+
+    _putHead(writer, major, len);
+    if ((room = _reserve(writer, len)) != NULL)
+    {
+        memcpy(room, data, len);
+    }
+}
+
+void cbor_begin(cbor_writer_t *writer, uint8_t *buffer, size_t size, uint8_t schema)
+{
+    writer->buffer = buffer;
+    writer->size = size;
+    writer->len = 0;
+    writer->overflow = false;
+
+    uint8_t *room;
+    if ((schema != 0) && ((room = _reserve(writer, 1)) != NULL))
+    {
+        room[0] = schema;
+    }
+}
+
+void cbor_openMap(cbor_writer_t *writer, uint32_t pairs)
+{
+    _putHead(writer, CBOR_MAJOR_MAP, pairs);
+}
+
+void cbor_openArray(cbor_writer_t *writer, uint32_t count)
+{
+    _putHead(writer, CBOR_MAJOR_ARRAY, count);
+}
+
+void cbor_putUint(cbor_writer_t *writer, uint64_t value)
+{
+    _putHead(writer, CBOR_MAJOR_UINT, value);
+}
+
+void cbor_putInt(cbor_writer_t *writer, int64_t value)
+{
+    if (value >= 0)
+    {
+        _putHead(writer, CBOR_MAJOR_UINT, (uint64_t)value);
+    }
+    else
+    {
+        // A negative integer n is encoded as -1 - n, computed without overflowing for INT64_MIN.
+        _putHead(writer, CBOR_MAJOR_NEGINT, ~(uint64_t)value);
+    }
+}
+
+void cbor_putFloat(cbor_writer_t *writer, float value)
+{
+    uint32_t bits;
+    uint8_t *room;
+
+    memcpy(&bits, &value, sizeof(bits));
+    if ((room = _reserve(writer, 5)) != NULL)
+    {
+        room[0] = CBOR_FLOAT32;
+        room[1] = (uint8_t)(bits >> 24);
+        room[2] = (uint8_t)(bits >> 16);
+        room[3] = (uint8_t)(bits >> 8);
+        room[4] = (uint8_t)bits;
+    }
+}
+
+void cbor_putBool(cbor_writer_t *writer, bool value)
+{
+    uint8_t *room;
+    if ((room = _reserve(writer, 1)) != NULL)
+    {
+        room[0] = value ? CBOR_TRUE : CBOR_FALSE;
+    }
+}
+
+void cbor_putNull(cbor_writer_t *writer)
+{
+    uint8_t *room;
+    if ((room = _reserve(writer, 1)) != NULL)
+    {
+        room[0] = CBOR_NULL;
+    }
+}
+
+void cbor_putText(cbor_writer_t *writer, const char *text)
+{
+    _putString(writer, CBOR_MAJOR_TEXT, text, strlen(text));
+}
+
+void cbor_putBytes(cbor_writer_t *writer, const void *data, size_t len)
+{
+    _putString(writer, CBOR_MAJOR_BYTES, data, len);
+}
+
+void cbor_putRaw(cbor_writer_t *writer, const void *item, size_t len)
+{
+    uint8_t *room;
+    if ((room = _reserve(writer, len)) != NULL)
+    {
+        memcpy(room, item, len);
+    }
+}
+
+void cbor_fieldUint(cbor_writer_t *writer, const char *key, uint64_t value)
+{
+    cbor_putText(writer, key);
+    cbor_putUint(writer, value);
+}
+
+void cbor_fieldInt(cbor_writer_t *writer, const char *key, int64_t value)
+{
+    cbor_putText(writer, key);
+    cbor_putInt(writer, value);
+}
+
+void cbor_fieldFloat(cbor_writer_t *writer, const char *key, float value)
+{
+    cbor_putText(writer, key);
+    cbor_putFloat(writer, value);
+}
+
+void cbor_fieldBool(cbor_writer_t *writer, const char *key, bool value)
+{
+    cbor_putText(writer, key);
+    cbor_putBool(writer, value);
+}
+
+void cbor_fieldText(cbor_writer_t *writer, const char *key, const char *text)
+{
+    cbor_putText(writer, key);
+    cbor_putText(writer, text);
+}
+
+size_t cbor_getLength(const cbor_writer_t *writer)
+{
+    return writer->len;
+}
+
+bool cbor_isOk(const cbor_writer_t *writer)
+{
+    return !writer->overflow;
+}
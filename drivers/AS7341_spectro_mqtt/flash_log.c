@@ -0,0 +1,524 @@
+/** @file flash_log.c
+ *
+ * @brief This file contains the source code for the flash log library.
+ * Brief overview of the code:
+ * A store-and-forward buffer for the sensor samples taken while the broker (or the access point) is unreachable,
+ * kept as an append-only log in a reserved region at the end of the QSPI flash (see flash_log.h for the layout).
+ *
+ * Flash facts this relies on:
+ * 1. An erase sets a whole 4 KB sector to 0xFF.
+ * 2. Programming can only clear bits, and 0xFF bytes of a programmed page are left untouched,
+ *    so a page can be programmed several times as long as each program only covers bytes still erased.
+ * 3. The flash is read straight through the XIP window (XIP_BASE), which the SDK flushes after every erase/program.
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include <pico/stdlib.h>
+#include <hardware/flash.h>
+#include <hardware/sync.h>
+#include "flash_log.h"
+
+#define FLASH_LOG_SECTOR_MAGIC 0x474F4C46 // "FLOG"
+#define FLASH_LOG_RECORD_MAGIC 0xA5
+#define FLASH_LOG_SENT 0x00    // Value of the sent byte of a record that has been replayed
+#define FLASH_LOG_PENDING 0xFF // Value of the sent byte of a record waiting to be replayed
+
+/**
+ * @brief Header at the start of every sector in use.
+ */
+typedef struct
+{
+    uint32_t magic;  // FLASH_LOG_SECTOR_MAGIC, cleared to retire the sector before erasing it
+    uint32_t seq;    // Incremented every time a sector is opened, the oldest sector has the lowest sequence number
+    uint32_t erases; // Number of times this sector has been erased
+    uint16_t boot;   // Boot count when the sector was opened
+    uint16_t crc;    // CRC of the fields above
+} flash_log_sector_t;
+
+/**
+ * @brief Header of a record, followed by its data.
+ */
+typedef struct
+{
+    uint8_t magic;      // FLASH_LOG_RECORD_MAGIC
+    uint8_t len;        // Length of the data
+    uint8_t tag;        // Tag given to flash_log_append
+    uint8_t sent;       // FLASH_LOG_PENDING, cleared to FLASH_LOG_SENT once replayed (not covered by the CRC)
+    uint16_t boot;      // Boot count when the record was appended
+    uint16_t crc;       // CRC of len, tag, boot, timestamp and data
+    uint32_t timestamp; // Timestamp given to flash_log_append
+} flash_log_header_t;
+
+#define FLASH_LOG_FIRST_RECORD sizeof(flash_log_sector_t) // Offset of the first record of a sector
+
+// State of the sectors found by flash_log_begin, kept up to date as the log is written.
+static bool _valid[FLASH_LOG_SECTORS];         // The sector has a valid header
+static uint32_t _seq[FLASH_LOG_SECTORS];       // Sequence number of the sector (if valid)
+static uint16_t _pendingIn[FLASH_LOG_SECTORS]; // Number of records of the sector waiting to be replayed
+
+static int _writeSector = -1;  // Sector the next record goes to (-1 if no sector is open yet)
+static uint32_t _writeOffset;  // Offset in that sector where the next record goes (FLASH_SECTOR_SIZE once the sector is closed)
+static uint32_t _nextSeq;      // Sequence number of the next sector opened
+static int _readSector = -1;   // Sector of the next record to replay
+static uint32_t _readOffset;   // Offset in that sector of the next record to replay
+static uint16_t _boot;         // Boot count (see flash_log_getBoot)
+
+static uint64_t _replayIntervalUs = 1000000 / FLASH_LOG_DEFAULT_REPLAY_RATE; // Time between two replayed records
+static uint64_t _nextReplayUs = 0;                                          // Time at which the next record can be replayed
+static flash_log_stats_t _stats;
+
+#pragma region Flash access
+
+/**
+ * @brief Gets a pointer to the given offset of a sector of the log, through the XIP window.
+ */
+static const uint8_t *_flashPtr(int sector, uint32_t offset)
+{
+    return (const uint8_t *)(XIP_BASE + FLASH_LOG_OFFSET + sector * FLASH_SECTOR_SIZE + offset);
+}
+
+/**
+ * @brief Programs bytes of the log that are still erased, one page at a time.
+ *
+ * The rest of each page is programmed with 0xFF, which leaves it untouched.
+ *
+ * @param sector The sector to program.
+ * @param offset The offset in the sector of the first byte.
+ * @param data The bytes to program.
+ * @param len The number of bytes to program.
+ */
+static void _program(int sector, uint32_t offset, const void *data, size_t len)
+{
+    uint8_t page[FLASH_PAGE_SIZE];
+    const uint8_t *src = (const uint8_t *)data;
+
+    while (len)
+    {
+        uint32_t pageStart = offset & ~(FLASH_PAGE_SIZE - 1);
+        uint32_t inPage = offset - pageStart;
+        size_t chunk = FLASH_PAGE_SIZE - inPage;
+        if (chunk > len)
+        {
+            chunk = len;
+        }
+
+        memset(page, 0xFF, sizeof(page));
+        memcpy(&page[inPage], src, chunk);
+
+        // Nothing can run from flash while it is being programmed
+        uint32_t ints = save_and_disable_interrupts();
+        flash_range_program(FLASH_LOG_OFFSET + sector * FLASH_SECTOR_SIZE + pageStart, page, FLASH_PAGE_SIZE);
+        restore_interrupts(ints);
+
+        src += chunk;
+        offset += chunk;
+        len -= chunk;
+    }
+}
+
+/**
+ * @brief Erases a sector of the log.
+ */
+static void _erase(int sector)
+{
+    uint32_t ints = save_and_disable_interrupts();
+    flash_range_erase(FLASH_LOG_OFFSET + sector * FLASH_SECTOR_SIZE, FLASH_SECTOR_SIZE);
+    restore_interrupts(ints);
+    _stats.erases++;
+}
+
+/**
+ * @brief Checks that a range of a sector is erased (all 0xFF).
+ */
+static bool _isErased(int sector, uint32_t offset, size_t len)
+{
+    const uint8_t *p = _flashPtr(sector, offset);
+    for (size_t i = 0; i < len; i++)
+    {
+        if (p[i] != 0xFF)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Computes the CRC-16/CCITT of a buffer, continuing from a previous CRC.
+ */
+static uint16_t _crc16(uint16_t crc, const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    while (len--)
+    {
+        crc ^= (uint16_t)(*p++) << 8;
+        for (int i = 0; i < 8; i++)
+        {
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+#pragma endregion
+
+#pragma region Records
+
+/**
+ * @brief Gets the size of a record on flash, header and padding included.
+ */
+static uint32_t _recordSize(uint8_t len)
+{
+    return (sizeof(flash_log_header_t) + len + 3) & ~3u;
+}
+
+/**
+ * @brief Computes the CRC of a record.
+ */
+static uint16_t _recordCrc(const flash_log_header_t *header, const uint8_t *data)
+{
+    uint16_t crc = _crc16(0xFFFF, &header->len, 2); // len and tag
+    crc = _crc16(crc, &header->boot, sizeof(header->boot));
+    crc = _crc16(crc, &header->timestamp, sizeof(header->timestamp));
+    return _crc16(crc, data, header->len);
+}
+
+/**
+ * @brief Computes the CRC of a sector header.
+ */
+static uint16_t _sectorCrc(const flash_log_sector_t *header)
+{
+    return _crc16(0xFFFF, header, offsetof(flash_log_sector_t, crc));
+}
+
+/**
+ * @brief Reads the record at the given offset of a sector.
+ *
+ * @param sector The sector.
+ * @param offset The offset of the record in the sector.
+ * @param header Filled in with the header of the record.
+ * @return 1 if there is a valid record, 0 if the space is still erased (end of the records of the sector),
+ * -1 if the record is torn (cut short by a power loss), in which case the rest of the sector cannot be trusted.
+ */
+static int _readRecord(int sector, uint32_t offset, flash_log_header_t *header)
+{
+    if (offset + sizeof(flash_log_header_t) > FLASH_SECTOR_SIZE)
+    {
+        return 0;
+    }
+    memcpy(header, _flashPtr(sector, offset), sizeof(*header));
+    if (_isErased(sector, offset, sizeof(*header)))
+    {
+        return 0;
+    }
+    if ((header->magic != FLASH_LOG_RECORD_MAGIC) || (header->len > FLASH_LOG_MAX_DATA) ||
+        (offset + _recordSize(header->len) > FLASH_SECTOR_SIZE) ||
+        (header->crc != _recordCrc(header, _flashPtr(sector, offset + sizeof(*header)))))
+    {
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * @brief Reads and checks the header of a sector.
+ *
+ * @return True if the sector holds a valid header.
+ */
+static bool _readSectorHeader(int sector, flash_log_sector_t *header)
+{
+    memcpy(header, _flashPtr(sector, 0), sizeof(*header));
+    return (header->magic == FLASH_LOG_SECTOR_MAGIC) && (header->crc == _sectorCrc(header));
+}
+
+/**
+ * @brief Opens the sector after the current one for writing, erasing it first.
+ *
+ * The sectors are used as a ring, so each one is erased once per lap of the log.
+ * The records of the sector that have not been replayed yet are dropped.
+ */
+static void _openNextSector(void)
+{
+    int sector = (_writeSector + 1) % FLASH_LOG_SECTORS;
+    flash_log_sector_t header;
+    uint32_t erases = 0;
+
+    if (_readSectorHeader(sector, &header))
+    {
+        erases = header.erases;
+
+        // Retire the sector first, so an interrupted erase does not leave a valid header over half erased records
+        uint32_t retired = 0;
+        _program(sector, 0, &retired, sizeof(retired));
+    }
+
+    if (_pendingIn[sector])
+    {
+        _stats.dropped += _pendingIn[sector];
+        _stats.pending -= _pendingIn[sector];
+        _pendingIn[sector] = 0;
+    }
+    _valid[sector] = false;
+
+    // The replay was in the dropped sector: it goes on from the oldest sector left
+    if (_readSector == sector)
+    {
+        _readSector = (sector + 1) % FLASH_LOG_SECTORS;
+        _readOffset = FLASH_LOG_FIRST_RECORD;
+    }
+
+    _erase(sector);
+
+    header.magic = FLASH_LOG_SECTOR_MAGIC;
+    header.seq = _nextSeq++;
+    header.erases = erases + 1;
+    header.boot = _boot;
+    header.crc = _sectorCrc(&header);
+    _program(sector, 0, &header, sizeof(header));
+
+    _valid[sector] = true;
+    _seq[sector] = header.seq;
+    _writeSector = sector;
+    _writeOffset = FLASH_LOG_FIRST_RECORD;
+    if (_readSector < 0)
+    {
+        _readSector = sector;
+        _readOffset = FLASH_LOG_FIRST_RECORD;
+    }
+}
+
+#pragma endregion
+
+#pragma region Public functions
+
+uint32_t flash_log_begin(void)
+{
+    flash_log_sector_t sectorHeader;
+    flash_log_header_t header;
+    uint16_t lastBoot = 0;
+    int newest = -1;
+
+    memset(&_stats, 0, sizeof(_stats));
+    _writeSector = -1;
+    _readSector = -1;
+    _nextSeq = 0;
+
+    // Find the sectors in use, the newest one is where the records go
+    for (int sector = 0; sector < FLASH_LOG_SECTORS; sector++)
+    {
+        _valid[sector] = _readSectorHeader(sector, &sectorHeader);
+        _pendingIn[sector] = 0;
+        if (!_valid[sector])
+        {
+            continue;
+        }
+        _seq[sector] = sectorHeader.seq;
+        if (sectorHeader.boot > lastBoot)
+        {
+            lastBoot = sectorHeader.boot;
+        }
+        if ((newest < 0) || ((int32_t)(sectorHeader.seq - _seq[newest]) > 0))
+        {
+            newest = sector;
+        }
+    }
+
+    // Count the records waiting in every sector, and find the end of the newest one
+    for (int sector = 0; sector < FLASH_LOG_SECTORS; sector++)
+    {
+        if (!_valid[sector])
+        {
+            continue;
+        }
+        uint32_t offset = FLASH_LOG_FIRST_RECORD;
+        int found;
+        while ((found = _readRecord(sector, offset, &header)) > 0)
+        {
+            if (header.sent == FLASH_LOG_PENDING)
+            {
+                _pendingIn[sector]++;
+                _stats.pending++;
+            }
+            if (header.boot > lastBoot)
+            {
+                lastBoot = header.boot;
+            }
+            offset += _recordSize(header.len);
+        }
+        if (found < 0)
+        {
+            // Cut short by a power loss: nothing more is written to this sector
+            _stats.torn++;
+            offset = FLASH_SECTOR_SIZE;
+        }
+        if (sector == newest)
+        {
+            _writeSector = sector;
+            _writeOffset = offset;
+        }
+    }
+
+    // The oldest sector in use is the first valid one after the newest, going round the ring
+    if (newest >= 0)
+    {
+        _nextSeq = _seq[newest] + 1;
+        for (int i = 1; i <= FLASH_LOG_SECTORS; i++)
+        {
+            int sector = (newest + i) % FLASH_LOG_SECTORS;
+            if (_valid[sector])
+            {
+                _readSector = sector;
+                _readOffset = FLASH_LOG_FIRST_RECORD;
+                break;
+            }
+        }
+    }
+
+    _boot = lastBoot + 1;
+    _nextReplayUs = 0;
+    return _stats.pending;
+}
+
+bool flash_log_append(uint8_t tag, uint32_t timestamp, const void *data, uint8_t len)
+{
+    uint8_t record[sizeof(flash_log_header_t) + FLASH_LOG_MAX_DATA];
+    flash_log_header_t *header = (flash_log_header_t *)record;
+    uint32_t size = _recordSize(len);
+
+    if (len > FLASH_LOG_MAX_DATA)
+    {
+        return false;
+    }
+
+    header->magic = FLASH_LOG_RECORD_MAGIC;
+    header->len = len;
+    header->tag = tag;
+    header->sent = FLASH_LOG_PENDING;
+    header->boot = _boot;
+    header->timestamp = timestamp;
+    memcpy(&record[sizeof(*header)], data, len);
+    header->crc = _recordCrc(header, &record[sizeof(*header)]);
+
+    // Move on to the next sector if the record does not fit, or if the space is not cleanly erased (left over by a power loss)
+    for (int attempt = 0; attempt < FLASH_LOG_SECTORS; attempt++)
+    {
+        if ((_writeSector >= 0) && (_writeOffset + size <= FLASH_SECTOR_SIZE))
+        {
+            if (_isErased(_writeSector, _writeOffset, size))
+            {
+                _program(_writeSector, _writeOffset, record, sizeof(*header) + len);
+                _writeOffset += size;
+                _pendingIn[_writeSector]++;
+                _stats.pending++;
+                _stats.appended++;
+                return true;
+            }
+            _writeOffset = FLASH_SECTOR_SIZE;
+        }
+        _openNextSector();
+    }
+    return false;
+}
+
+uint32_t flash_log_replay(flash_log_replay_cb_t cb, void *arg)
+{
+    uint64_t now = time_us_64();
+    flash_log_header_t header;
+    flash_log_record_t record;
+    uint32_t replayed = 0;
+    int sectorsVisited = 0;
+
+    // Allow at most one second worth of records per call
+    if (_nextReplayUs + 1000000 < now)
+    {
+        _nextReplayUs = now - 1000000 + _replayIntervalUs;
+    }
+
+    if (_readSector < 0)
+    {
+        return 0;
+    }
+
+    while (_stats.pending && (_nextReplayUs <= now) && (sectorsVisited <= FLASH_LOG_SECTORS))
+    {
+        int found = _valid[_readSector] ? _readRecord(_readSector, _readOffset, &header) : 0;
+        if (found <= 0)
+        {
+            // End of this sector (or torn record): go on with the next one, unless this is the one being written
+            if (_readSector == _writeSector)
+            {
+                break;
+            }
+            _readSector = (_readSector + 1) % FLASH_LOG_SECTORS;
+            _readOffset = FLASH_LOG_FIRST_RECORD;
+            sectorsVisited++;
+            continue;
+        }
+
+        if (header.sent == FLASH_LOG_PENDING)
+        {
+            record.boot = header.boot;
+            record.timestamp = header.timestamp;
+            record.tag = header.tag;
+            record.len = header.len;
+            record.data = _flashPtr(_readSector, _readOffset + sizeof(header));
+            if (!cb(&record, arg))
+            {
+                break;
+            }
+
+            uint8_t sent = FLASH_LOG_SENT;
+            _program(_readSector, _readOffset + offsetof(flash_log_header_t, sent), &sent, 1);
+            _pendingIn[_readSector]--;
+            _stats.pending--;
+            _stats.replayed++;
+            _nextReplayUs += _replayIntervalUs;
+            replayed++;
+        }
+        _readOffset += _recordSize(header.len);
+    }
+    return replayed;
+}
+
+void flash_log_setReplayRate(uint32_t recordsPerSecond)
+{
+    if (recordsPerSecond < 1)
+    {
+        recordsPerSecond = 1;
+    }
+    _replayIntervalUs = 1000000 / recordsPerSecond;
+}
+
+uint32_t flash_log_getPending(void)
+{
+    return _stats.pending;
+}
+
+uint16_t flash_log_getBoot(void)
+{
+    return _boot;
+}
+
+void flash_log_getStats(flash_log_stats_t *stats)
+{
+    *stats = _stats;
+}
+
+void flash_log_clear(void)
+{
+    for (int sector = 0; sector < FLASH_LOG_SECTORS; sector++)
+    {
+        if (!_isErased(sector, 0, FLASH_SECTOR_SIZE))
+        {
+            _erase(sector);
+        }
+        _valid[sector] = false;
+        _pendingIn[sector] = 0;
+    }
+    _writeSector = -1;
+    _readSector = -1;
+    _stats.pending = 0;
+}
+
+#pragma endregion
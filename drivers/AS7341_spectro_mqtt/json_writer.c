@@ -0,0 +1,396 @@
+/** @file json_writer.c
+ *
+ * @brief This file contains the source code for the JSON writer library.
+ * Brief overview of the code:
+ * Writes JSON text at a cursor in a caller buffer, see json_writer.h.
+ *
+ * The text is kept null terminated after every value, and each value is written with a single bounds check,
+ * so building a message costs one pass over it, however many fields it has (strcat walks the whole text for each piece).
+ * The integers are converted with 32-bit divisions whenever they fit, as the M0+ has no divide instruction
+ * and a 64-bit division is many times slower than a 32-bit one.
+ */
+
+#include <math.h>
+#include <string.h>
+#include "json_writer.h"
+
+// Longest unsigned 64-bit integer, in digits.
+#define JSON_WRITER_MAX_DIGITS 20
+
+// 10^n for every number of decimals.
+static const uint32_t _pow10[JSON_WRITER_MAX_DECIMALS + 1] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000};
+
+/**
+ * @brief Reserves room for len characters at the cursor (and for the null terminator after them).
+ *
+ * @return A pointer to the room, NULL if it does not fit (the writer is then marked as overflowed).
+ */
+static char *_reserve(json_writer_t *writer, size_t len)
+{
+    if (writer->overflow || (writer->size == 0) || (len > writer->size - 1 - writer->len))
+    {
+        writer->overflow = true;
+        return NULL;
+    }
+    char *room = &writer->buffer[writer->len];
+    writer->len += len;
+    writer->buffer[writer->len] = '\0';
+    return room;
+}
+
+/**
+ * @brief Writes a single character.
+ */
+static void _putChar(json_writer_t *writer, char c)
+{
+    char *room = _reserve(writer, 1);
+    if (room != NULL)
+    {
+        room[0] = c;
+    }
+}
+
+/**
+ * @brief Writes characters as they are.
+ */
+static void _putChars(json_writer_t *writer, const char *chars, size_t len)
+{
+    char *room = _reserve(writer, len);
+    if (room != NULL)
+    {
+        memcpy(room, chars, len);
+    }
+}
+
+/**
+ * @brief Writes the comma before a value or a key, unless it is the first one of its object or array, or follows a key.
+ */
+static void _separate(json_writer_t *writer)
+{
+    uint32_t level = 1u << writer->depth;
+
+    if (writer->afterKey)
+    {
+        writer->afterKey = false;
+        return;
+    }
+    if ((writer->depth > 0) && (writer->filled & level))
+    {
+        _putChar(writer, ',');
+    }
+    writer->filled |= level;
+}
+
+/**
+ * @brief Converts an unsigned integer to decimal digits, least significant first.
+ *
+ * @return The number of digits (at least 1).
+ */
+static uint8_t _digits(uint64_t value, char digits[JSON_WRITER_MAX_DIGITS])
+{
+    uint8_t count = 0;
+
+    // 64-bit divisions only for the digits beyond 32 bits.
+    while (value > UINT32_MAX)
+    {
+        digits[count++] = (char)('0' + value % 10);
+        value /= 10;
+    }
+    uint32_t small = (uint32_t)value;
+    do
+    {
+        digits[count++] = (char)('0' + small % 10);
+        small /= 10;
+    } while (small != 0);
+    return count;
+}
+
+/**
+ * @brief Writes a number: sign, integer part, then the last decimals digits after a point.
+ */
+static void _putNumber(json_writer_t *writer, bool negative, uint64_t magnitude, uint8_t decimals)
+{
+    char digits[JSON_WRITER_MAX_DIGITS];
+    uint8_t count = _digits(magnitude, digits);
+
+    // At least one digit before the point (0.05, not .05).
+    while (count < decimals + 1)
+    {
+        digits[count++] = '0';
+    }
+
+    char *room = _reserve(writer, negative + count + (decimals > 0));
+    if (room == NULL)
+    {
+        return;
+    }
+    if (negative)
+    {
+        *room++ = '-';
+    }
+    while (count > 0)
+    {
+        if (count-- == decimals)
+        {
+            *room++ = '.';
+        }
+        *room++ = digits[count];
+    }
+}
+
+void json_begin(json_writer_t *writer, char *buffer, size_t size)
+{
+    writer->buffer = buffer;
+    writer->size = size;
+    writer->len = 0;
+    writer->filled = 0;
+    writer->depth = 0;
+    writer->afterKey = false;
+    writer->overflow = (size == 0);
+    if (size > 0)
+    {
+        buffer[0] = '\0';
+    }
+}
+
+/**
+ * @brief Opens an object or an array.
+ */
+static void _open(json_writer_t *writer, char bracket)
+{
+    _separate(writer);
+    if (writer->depth >= JSON_WRITER_MAX_DEPTH)
+    {
+        writer->overflow = true;
+        return;
+    }
+    _putChar(writer, bracket);
+    writer->depth++;
+    writer->filled &= ~(1u << writer->depth);
+}
+
+/**
+ * @brief Closes the object or array opened last.
+ */
+static void _close(json_writer_t *writer, char bracket)
+{
+    if (writer->depth == 0)
+    {
+        writer->overflow = true;
+        return;
+    }
+    _putChar(writer, bracket);
+    writer->depth--;
+}
+
+void json_openObject(json_writer_t *writer)
+{
+    _open(writer, '{');
+}
+
+void json_closeObject(json_writer_t *writer)
+{
+    _close(writer, '}');
+}
+
+void json_openArray(json_writer_t *writer)
+{
+    _open(writer, '[');
+}
+
+void json_closeArray(json_writer_t *writer)
+{
+    _close(writer, ']');
+}
+
+void json_key(json_writer_t *writer, const char *key)
+{
+    size_t len = strlen(key);
+
+    _separate(writer);
+    char *room = _reserve(writer, len + 3);
+    if (room != NULL)
+    {
+        room[0] = '"';
+        memcpy(&room[1], key, len);
+        room[len + 1] = '"';
+        room[len + 2] = ':';
+    }
+    writer->afterKey = true;
+}
+
+void json_putInt(json_writer_t *writer, int64_t value)
+{
+    _separate(writer);
+    // The magnitude is computed on unsigned 64 bits, so INT64_MIN does not overflow.
+    _putNumber(writer, value < 0, (value < 0) ? (0 - (uint64_t)value) : (uint64_t)value, 0);
+}
+
+void json_putUint(json_writer_t *writer, uint64_t value)
+{
+    _separate(writer);
+    _putNumber(writer, false, value, 0);
+}
+
+void json_putFixed(json_writer_t *writer, int64_t value, uint8_t decimals)
+{
+    if (decimals > JSON_WRITER_MAX_DECIMALS)
+    {
+        decimals = JSON_WRITER_MAX_DECIMALS;
+    }
+    _separate(writer);
+    _putNumber(writer, value < 0, (value < 0) ? (0 - (uint64_t)value) : (uint64_t)value, decimals);
+}
+
+void json_putFloat(json_writer_t *writer, float value, uint8_t decimals)
+{
+    if (decimals > JSON_WRITER_MAX_DECIMALS)
+    {
+        decimals = JSON_WRITER_MAX_DECIMALS;
+    }
+
+    // Scaled to a number of units of the last decimal. A double holds the product of a float and 10^decimals exactly
+    // (24 + 21 bits at most), so the rounding below is done on the exact value, ties to even, as printf does.
+    double magnitude = fabs((double)value * _pow10[decimals]);
+    if (!isfinite(magnitude) || (magnitude >= 9.2e18))
+    {
+        json_putNull(writer);
+        return;
+    }
+    uint64_t units = (uint64_t)magnitude;
+    double rest = magnitude - (double)units;
+    if ((rest > 0.5) || ((rest == 0.5) && (units & 1)))
+    {
+        units++;
+    }
+
+    _separate(writer);
+    // A value rounded to 0 keeps its sign, as with printf (-0.00).
+    _putNumber(writer, signbit(value) != 0, units, decimals);
+}
+
+void json_putString(json_writer_t *writer, const char *text)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    _separate(writer);
+    _putChar(writer, '"');
+    while (*text != '\0')
+    {
+        // Copy the run of characters that need no escaping in one go.
+        size_t run = strcspn(text, "\"\\\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0a\x0b\x0c\x0d\x0e\x0f"
+                                   "\x10\x11\x12\x13\x14\x15\x16\x17\x18\x19\x1a\x1b\x1c\x1d\x1e\x1f");
+        _putChars(writer, text, run);
+        text += run;
+        if (*text == '\0')
+        {
+            break;
+        }
+
+        char *room;
+        if ((*text == '"') || (*text == '\\'))
+        {
+            if ((room = _reserve(writer, 2)) != NULL)
+            {
+                room[0] = '\\';
+                room[1] = *text;
+            }
+        }
+        else if ((room = _reserve(writer, 6)) != NULL)
+        {
+            memcpy(room, "\\u00", 4);
+            room[4] = hex[(uint8_t)*text >> 4];
+            room[5] = hex[*text & 0x0F];
+        }
+        text++;
+    }
+    _putChar(writer, '"');
+}
+
+void json_putBool(json_writer_t *writer, bool value)
+{
+    _separate(writer);
+    if (value)
+    {
+        _putChars(writer, "true", 4);
+    }
+    else
+    {
+        _putChars(writer, "false", 5);
+    }
+}
+
+void json_putNull(json_writer_t *writer)
+{
+    _separate(writer);
+    _putChars(writer, "null", 4);
+}
+
+void json_putRaw(json_writer_t *writer, const char *json, size_t len)
+{
+    _separate(writer);
+    _putChars(writer, json, len);
+}
+
+char *json_beginRaw(json_writer_t *writer, size_t *room)
+{
+    _separate(writer);
+    *room = writer->overflow ? 0 : (writer->size - writer->len);
+    return &writer->buffer[writer->len];
+}
+
+void json_endRaw(json_writer_t *writer, size_t len)
+{
+    if (writer->overflow)
+    {
+        return;
+    }
+    if ((len == 0) || (len > writer->size - 1 - writer->len))
+    {
+        writer->overflow = true;
+        writer->buffer[writer->len] = '\0';
+        return;
+    }
+    writer->len += len;
+    writer->buffer[writer->len] = '\0';
+}
+
+void json_fieldInt(json_writer_t *writer, const char *key, int64_t value)
+{
+    json_key(writer, key);
+    json_putInt(writer, value);
+}
+
+void json_fieldUint(json_writer_t *writer, const char *key, uint64_t value)
+{
+    json_key(writer, key);
+    json_putUint(writer, value);
+}
+
+void json_fieldFixed(json_writer_t *writer, const char *key, int64_t value, uint8_t decimals)
+{
+    json_key(writer, key);
+    json_putFixed(writer, value, decimals);
+}
+
+void json_fieldFloat(json_writer_t *writer, const char *key, float value, uint8_t decimals)
+{
+    json_key(writer, key);
+    json_putFloat(writer, value, decimals);
+}
+
+void json_fieldString(json_writer_t *writer, const char *key, const char *text)
+{
+    json_key(writer, key);
+    json_putString(writer, text);
+}
+
+size_t json_getLength(const json_writer_t *writer)
+{
+    return writer->len;
+}
+
+bool json_isOk(const json_writer_t *writer)
+{
+    return !writer->overflow;
+}
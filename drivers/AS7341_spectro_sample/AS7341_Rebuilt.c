@@ -16,6 +16,7 @@
 #include "i2c_tools.h"
 #include <stdint.h>
 
+static i2c_tools_bus_t *_bus; //Static variable for the I2C bus the sensor is connected to
 static uint8_t _address; //Static variable for I2C address
 static uint8_t _mode; //Static variable for mode 
 static AS7341_eMode_t measureMode; //Enum type variable for measuring mode
@@ -47,13 +48,13 @@ void AS7341_writeReg(uint8_t reg, void *pBuf, size_t size)
         AS7341_debugPrint("pBuf ERROR!! : null pointer"); // Error message if buffer is NULL
     }
     uint8_t *_pBuf = (uint8_t *)pBuf; // Casting the buffer pointer to uint8_t
-    i2c_tools_beginTransmission((uint8_t)_address); // Begin I2C transmission
-    i2c_tools_write(reg); // Write register address
+    i2c_tools_beginTransmission(_bus, (uint8_t)_address); // Begin I2C transmission
+    i2c_tools_write(_bus, reg); // Write register address
     for (uint16_t i = 0; i < size; i++)
     {
-        i2c_tools_write(_pBuf[i]); // Write data to the register
+        i2c_tools_write(_bus, _pBuf[i]); // Write data to the register
     }
-    i2c_tools_endTransmission(); // End I2C transmission
+    i2c_tools_endTransmission(_bus); // End I2C transmission
 }
 
 // Function to write data directly to a register via I2C
@@ -68,22 +69,26 @@ uint8_t AS7341_readReg(uint8_t reg, void *pBuf, size_t size)
 	{
         AS7341_debugPrint("pBuf ERROR!! : null pointer"); // Error message if buffer is NULL
     }
-    uint8_t *_pBuf = (uint8_t *)pBuf; // Casting the buffer pointer to uint8_t
-    i2c_tools_beginTransmission(_address); // Begin I2C transmission
-    i2c_tools_write(reg); // Write register address
-    if (i2c_tools_endTransmission() != 0) 
+    // Write the register address, then read the data straight into the buffer after a repeated start (one bus transaction)
+    if (i2c_tools_write_read(_bus, _address, &reg, 1, (uint8_t *)pBuf, size) != 0) 
 	{
         return 0;
     }
-    busy_wait_ms(10); // Delay for 10 milliseconds
-    i2c_tools_requestFrom(_address, size); // Request data from the register
-    for (uint16_t i = 0; i < size; i++) 
-	{
-        _pBuf[i] = i2c_tools_read(); // Read data from the register
-    }
     return size; // Return size of data read
 }
 
+// Function to read the 6 ADC channels in a single burst (the data registers are contiguous and auto-incremented)
+static void AS7341_readAllChannels(uint16_t channels[6])
+{
+    uint8_t data[12] = {0}; // Low and high bytes of the 6 channels
+
+    AS7341_readReg(REG_AS7341_CH0_DATA_L, data, sizeof(data));
+    for (int i = 0; i < 6; i++)
+    {
+        channels[i] = ((uint16_t)data[i * 2 + 1] << 8) | data[i * 2]; // Combining high and low bytes
+    }
+}
+
 // Function to read data directly from a register via I2C
 uint8_t AS7341_readReg_direct(uint8_t reg) 
 {
@@ -93,30 +98,25 @@ uint8_t AS7341_readReg_direct(uint8_t reg)
 }
 
 // Function to initialize the AS7341 sensor
-int AS7341_begin(AS7341_eMode_t mode) 
+int AS7341_begin(i2c_tools_bus_t *bus, AS7341_eMode_t mode) 
 {
+    _bus = bus; // Store the I2C bus handle
     _address = 0x39; // Set the I2C address
-    i2c_tools_begin(); // Begin I2C communication
-    i2c_tools_beginTransmission(_address); // Begin I2C transmission
-
-    /*  Section commented out due to bugs in the code
-	 *	 Skip this section because it's all bugged all to high hell.
-     *   For some ****ing reason, the i2c_tools library that I've ported over from Wire.h works with the other I2C sensors
-     *   And even after debugging line by line, stepping into each functions and comparing the code and onboard memory,
-     *   They both look the same, but for some reason, _clockStrech returns true on the arduino framework, but false on the pico C SDK
-     *   So as a last resort, I tried skipping this test section and somehow, the rest of the sensor code still works just fine.
-     *   so fk it. I'm leaving it out.
-     */
+    i2c_tools_setDeviceClock(_bus, _address, AS7341_I2C_CLOCK_HZ); // Fast-mode for this sensor, whatever the other devices on the bus
+    i2c_tools_begin(_bus); // Begin I2C communication
 
-    /*
-    if (i2c_tools_endTransmission() != 0)
+    /*  The original probe (a zero-length write) is bit-banged by i2c_tools, and _clockStretch
+     *  returns false on the pico C SDK for this sensor, so it was skipped altogether.
+     *  The presence check is now done by the I2C controller itself (see i2c_tools_isPresent),
+     *  and the answer is cached, so calling begin again does not touch the bus.
+     */
+    if (!i2c_tools_isPresent(_bus, _address))
     {
         AS7341_debugPrint("");
         AS7341_debugPrint("bus data access error");
         AS7341_debugPrint("");
         return ERR_DATA_BUS;
     }
-    */
     AS7341_enableAS7341(true); // Enable AS7341 sensor
     measureMode = mode; // Set the measure mode
     return ERR_OK; // Return OK status
@@ -474,17 +474,13 @@ uint16_t AS7341_getChannelData(uint8_t channel)
     uint8_t data[2]; // Array to store data read from the sensor
     uint16_t channelData = 0x0000; // Variable to hold channel data initialized to 0
 
-    // Reading low byte data for the specified channel
-    AS7341_readReg(REG_AS7341_CH0_DATA_L + channel * 2, data, 1);
-    // Reading high byte data for the specified channel
-    AS7341_readReg(REG_AS7341_CH0_DATA_H + channel * 2, data + 1, 1);
+    // Reading low and high byte data for the specified channel in one transaction
+    AS7341_readReg(REG_AS7341_CH0_DATA_L + channel * 2, data, 2);
 
     // Extracting the channel data by combining high and low bytes
     channelData = data[1];
     channelData = (channelData << 8) | data[0];
 
-    busy_wait_ms(50); // Waiting for 50 milliseconds
-
     return channelData; // Returning the channel data
 }
 
@@ -493,13 +489,15 @@ AS7341_sModeOneData_t AS7341_readSpectralDataOne()
 {
     AS7341_sModeOneData_t data; // Structure to hold spectral data for Mode 1
 
-    // Reading channel data for respective channels and storing in the structure
-    data.ADF1 = AS7341_getChannelData(0);
-    data.ADF2 = AS7341_getChannelData(1);
-    data.ADF3 = AS7341_getChannelData(2);
-    data.ADF4 = AS7341_getChannelData(3);
-    data.ADCLEAR = AS7341_getChannelData(4);
-    data.ADNIR = AS7341_getChannelData(5);
+    // Reading all the channels in one transaction and storing in the structure
+    uint16_t channels[6];
+    AS7341_readAllChannels(channels);
+    data.ADF1 = channels[0];
+    data.ADF2 = channels[1];
+    data.ADF3 = channels[2];
+    data.ADF4 = channels[3];
+    data.ADCLEAR = channels[4];
+    data.ADNIR = channels[5];
 
     return data; // Returning the spectral data structure
 }
@@ -510,13 +508,15 @@ AS7341_sModeTwoData_t AS7341_readSpectralDataTwo()
 {
     AS7341_sModeTwoData_t data; // Structure to hold spectral data for Mode 2
 
-    // Reading channel data for respective channels and storing in the structure
-    data.ADF5 = AS7341_getChannelData(0);
-    data.ADF6 = AS7341_getChannelData(1);
-    data.ADF7 = AS7341_getChannelData(2);
-    data.ADF8 = AS7341_getChannelData(3);
-    data.ADCLEAR = AS7341_getChannelData(4);
-    data.ADNIR = AS7341_getChannelData(5);
+    // Reading all the channels in one transaction and storing in the structure
+    uint16_t channels[6];
+    AS7341_readAllChannels(channels);
+    data.ADF5 = channels[0];
+    data.ADF6 = channels[1];
+    data.ADF7 = channels[2];
+    data.ADF8 = channels[3];
+    data.ADCLEAR = channels[4];
+    data.ADNIR = channels[5];
 
     return data; // Returning the spectral data structure
 }
@@ -783,8 +783,7 @@ float AS7341_getIntegrationTime()
     uint16_t astep; // Variable to store the analog step value
 
     AS7341_readReg(REG_AS7341_ATIME, &data, 1); // Reading integration time register
-    AS7341_readReg(REG_AS7341_ASTEP_L, astepData, 1); // Reading lower bits of analog step
-    AS7341_readReg(REG_AS7341_ASTEP_L, astepData + 1, 1); // Reading higher bits of analog step
+    AS7341_readReg(REG_AS7341_ASTEP_L, astepData, 2); // Reading lower and higher bits of analog step
     astep = astepData[1]; // Storing higher bits of analog step
     astep = (astep << 8) | astepData[0]; // Combining lower and higher bits of analog step
 
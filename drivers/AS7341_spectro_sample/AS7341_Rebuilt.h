@@ -25,6 +25,8 @@
 
 #include <i2c_tools.h>
 
+#define AS7341_I2C_CLOCK_HZ 400000 // The AS7341 supports Fast-mode, registered with i2c_tools by AS7341_begin
+
 #define REG_AS7341_ASTATUS 0X60
 /*
 #define REG_AS7341_CH0_DATA_L  0X61
@@ -191,10 +193,11 @@ void AS7341_init();
 /**
  * @fn begin
  * @brief init function
+ * @param bus I2C bus handle the sensor is connected to (returned by i2c_tools_init).
  * @param mode data read mode. (default: eSpm)
  * @return return 0 if the initialization succeeds, otherwise return non-zero and error code.
  */
-int AS7341_begin(AS7341_eMode_t mode);
+int AS7341_begin(i2c_tools_bus_t *bus, AS7341_eMode_t mode);
 
 /**
  * @fn readID
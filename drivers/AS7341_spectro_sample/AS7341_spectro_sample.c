@@ -8,8 +8,8 @@
 int main()
 {
     stdio_init_all(); // Initializing standard I/O
-    i2c_tools_init(i2c0, PICO_DEFAULT_I2C_SDA_PIN, PICO_DEFAULT_I2C_SCL_PIN); // Initializing I2C communication
-    AS7341_begin(eSpm); // Initializing the AS7341 sensor with specified mode
+    i2c_tools_bus_t *bus = i2c_tools_init(i2c0, PICO_DEFAULT_I2C_SDA_PIN, PICO_DEFAULT_I2C_SCL_PIN); // Initializing I2C communication
+    AS7341_begin(bus, eSpm); // Initializing the AS7341 sensor with specified mode
     int sensorid = AS7341_readID(); // Reading the ID of the AS7341 sensor
 
     while (sensorid == 0) // Loop to check if sensor is connected
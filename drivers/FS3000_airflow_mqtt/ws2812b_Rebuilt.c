@@ -1,10 +1,16 @@
 /** @file ws2812b_Rebuilt.c
  * Original WS2812B LED code by yeahimthatguy @ https://forums.raspberrypi.com/viewtopic.php?t=322218
- * Adapted into standalone library to support both the MakerPico's onboard WS2812B LED and 1 additional external WS2812B LED strip.
+ * Adapted into standalone library to support both the MakerPico's onboard WS2812B LED and 1 additional external WS2812B LED strip,
+ * plus any number of strips registered at runtime (see ws2812b_add_strip), up to the state machines and the DMA channels left.
  *
  */
 #include <stdio.h>
 #include "pico/stdlib.h"
+#include "pico/sync.h"
+#include "hardware/clocks.h"
+#include "hardware/dma.h"
+#include "hardware/pio.h"
+#include "hardware/pio_instructions.h"
 #include "ws2812b_Rebuilt.h"
 #include "string.h"
 
@@ -19,15 +25,103 @@
 #define EXTERNAL_LED_COUNT 8 // Number of external LEDs (Change this to the number of LEDs you have)
 #endif
 
+#ifndef WS2812B_MAX_STRIPS
+#define WS2812B_MAX_STRIPS 8 // Most strips registered at runtime (the PIO blocks have 8 state machines in all)
+#endif
+
+#ifndef WS2812B_ARENA_SIZE
+#define WS2812B_ARENA_SIZE (3 * 3 * 1024) // Memory for the frames of the strips registered at runtime, in bytes (3 frames of 3 bytes per LED: 1024 LEDs)
+#endif
+
 #define WS2812B_USE_100_SCALE // Comment this out if you want to use the 0-255 scale for RGB colours
-#define COOLDOWN_DELAY 10     // Delay in ms between each LED update to allow the LEDs to settle down.
 #define LED_DATA_SIZE 3
 
+// Bit timings of the WS2812B, in ns (see the datasheet: +/-150ns on each).
+#define WS2812B_T0H_NS 400  // High time of a 0 (then low for the rest of the bit)
+#define WS2812B_T1H_NS 800  // High time of a 1
+#define WS2812B_BIT_NS 1250 // Length of a bit (800 kHz)
+#define WS2812B_RESET_US 300 // Low time latching the data into the LEDs, in us (50us in the datasheet, 280us for the newer WS2812B)
+
+// Length of a cycle of the state machines, in ns. Their clock divider is derived from the system clock to get it,
+// whatever the system clock is (see ws2812b_derive_clkdiv), so the timings below, in cycles, do not depend on it.
+#define WS2812B_CYCLE_NS 125
+
+// Bit timings of the PIO program, in cycles (see the program below), rounded to the nearest cycle. A bit lasts T1 + T2 + T3 cycles:
+// high for T1, then high (1) or low (0) for T2, then low for T3. Each must fit in the delay field of an instruction (1 to 16 cycles).
+#define WS2812B_NS_TO_CYCLES(ns) (((ns) + WS2812B_CYCLE_NS / 2) / WS2812B_CYCLE_NS)
+#define WS2812B_T1 WS2812B_NS_TO_CYCLES(WS2812B_T0H_NS)
+#define WS2812B_T2 (WS2812B_NS_TO_CYCLES(WS2812B_T1H_NS) - WS2812B_T1)
+#define WS2812B_T3 (WS2812B_NS_TO_CYCLES(WS2812B_BIT_NS) - WS2812B_T1 - WS2812B_T2)
+#define WS2812B_BIT_CYCLES (WS2812B_T1 + WS2812B_T2 + WS2812B_T3)
+#define WS2812B_BYTE_NS (8 * WS2812B_BIT_CYCLES * WS2812B_CYCLE_NS) // Time to send a byte, in ns
+
+_Static_assert((WS2812B_T1 >= 1) && (WS2812B_T1 <= 16) && (WS2812B_T2 >= 1) && (WS2812B_T2 <= 16) && (WS2812B_T3 >= 1) && (WS2812B_T3 <= 16),
+               "WS2812B timings out of the delay field of the PIO program, change WS2812B_CYCLE_NS");
+
 #define ONBOARD_LED_TOTAL_DATA_SIZE ONBOARD_LED_COUNT *LED_DATA_SIZE
 #define EXTERNAL_LED_TOTAL_DATA_SIZE EXTERNAL_LED_COUNT *LED_DATA_SIZE
 
-uint8_t onboard_led_data[ONBOARD_LED_TOTAL_DATA_SIZE];   // Array to hold the data for the onboard LED (Not that an array is needed for 1 LED, but it makes development easier)
-uint8_t external_led_data[EXTERNAL_LED_TOTAL_DATA_SIZE]; // Array to hold the data for the external LED
+// Frames of the LEDs: the back frame written by the set_* functions, the front frame being sent,
+// and the frame queued by a show_* call made while the front frame was still being sent (see ws2812b_output_show).
+// The strips registered at runtime take theirs from strip_arena.
+// (Not that an array is needed for 1 LED, but it makes development easier)
+static uint8_t onboard_led_frames[3][ONBOARD_LED_TOTAL_DATA_SIZE];
+static uint8_t external_led_frames[3][EXTERNAL_LED_TOTAL_DATA_SIZE];
+
+/**
+ * @brief A LED pin (the onboard LED, the external LEDs, or a strip registered at runtime), driven by a PIO state machine fed by its own DMA channel.
+ *
+ * @note Each pin has its own state machine and DMA channel, so the frames of all the pins are sent in parallel.
+ */
+struct ws2812b_strip
+{
+    ws2812b_led_type_t type; // Which LED(s) the pin drives (passed to the frame done callback)
+    uint pin;                // GPIO of the LED(s)
+    uint32_t size;           // Size of a frame, in bytes
+    uint8_t *back;           // Frame written by the set_* functions, in send order (green, red, blue)
+    uint8_t *front;          // Frame being sent by the DMA channel (left alone until it has been latched)
+    uint8_t *queued;         // Frame waiting for the front frame to be latched, if queued_ready
+    volatile bool busy;      // The front frame is being sent, or latched
+    volatile bool queued_ready; // A frame is queued, it is sent as soon as the front frame has been latched
+    critical_section_t cs;   // Guards the swaps of the frames, between show_* and the timer interrupt
+    PIO pio;                 // PIO block of the state machine
+    uint sm;                 // State machine shifting the bits out
+    uint32_t sys_hz;         // System clock the clock divider of the state machine was set for
+    int dma_channel;         // DMA channel copying the front frame into the TX FIFO of the state machine
+    absolute_time_t idle_at; // Time from which the front frame has been sent and latched, the next one can start
+    bool enabled;            // The output has been initialized
+};
+
+static ws2812b_strip_t onboard_output = {
+    .type = WS2812B_LED_TYPE_MAKERPICO,
+    .pin = ONBOARD_LED_PIN,
+    .size = ONBOARD_LED_TOTAL_DATA_SIZE,
+    .back = onboard_led_frames[0],
+    .front = onboard_led_frames[1],
+    .queued = onboard_led_frames[2],
+};
+static ws2812b_strip_t external_output = {
+    .type = WS2812B_LED_TYPE_EXTERNAL,
+    .pin = EXTERNAL_LED_PIN,
+    .size = EXTERNAL_LED_TOTAL_DATA_SIZE,
+    .back = external_led_frames[0],
+    .front = external_led_frames[1],
+    .queued = external_led_frames[2],
+};
+
+static ws2812b_strip_t strips[WS2812B_MAX_STRIPS]; // Strips registered at runtime
+static uint32_t strip_count = 0;
+
+static uint8_t strip_arena[WS2812B_ARENA_SIZE]; // Frames of the strips registered at runtime, handed out in order
+static uint32_t strip_arena_used = 0;
+
+static ws2812b_frame_done_callback_t frame_done_callback = NULL; // Called once a frame has been sent and latched (see ws2812b_set_frame_done_callback)
+static void *frame_done_callback_arg = NULL;
+
+static int program_offset[NUM_PIOS] = {-1, -1}; // Where the PIO program is loaded in the instruction memory of each PIO block (-1 if it is not loaded yet)
+
+static uint32_t clkdiv_sys_hz = 0; // System clock the clock divider was derived from (0: not derived yet)
+static uint32_t clkdiv = 0;        // Clock divider of the state machines, in 1/256ths (16.8 fixed point)
 
 #pragma region common functions
 /**
@@ -95,6 +189,286 @@ void hexToRGB(const char *hexColor, uint8_t *red, uint8_t *green, uint8_t *blue)
 
 #pragma endregion
 
+#pragma region pio output functions
+
+/**
+ * @brief Derive the clock divider of the state machines from the system clock, for cycles of WS2812B_CYCLE_NS.
+ *
+ * @note The divider has 8 fractional bits, so on average a cycle is within 1/512 of a system clock cycle of WS2812B_CYCLE_NS
+ *       (0.02ns at 125 MHz), each cycle being off by one system clock cycle at most (8ns at 125 MHz), whatever the system clock from 8 MHz.
+ *       Below 8 MHz the LEDs cannot be driven (the divider is at its minimum, 1).
+ *       Only derived again when the system clock has changed.
+ */
+static void ws2812b_derive_clkdiv()
+{
+    uint32_t sys_hz = clock_get_hz(clk_sys);
+    if (sys_hz == clkdiv_sys_hz)
+    {
+        return;
+    }
+
+    uint64_t divider = ((uint64_t)sys_hz * WS2812B_CYCLE_NS * 256 + 500000000) / 1000000000;
+    if (divider < 256)
+    {
+        printf("WS2812B: system clock too slow for the LEDs (%u Hz)\n", sys_hz);
+        divider = 256;
+    }
+    else if (divider > 0xFFFFFF)
+    {
+        divider = 0xFFFFFF;
+    }
+    clkdiv = (uint32_t)divider;
+    clkdiv_sys_hz = sys_hz;
+}
+
+/**
+ * @brief Load the WS2812B PIO program into a PIO block, shared by the state machines of all the LED pins of the block.
+ *
+ * @param pio The PIO block.
+ * @return True if the program is loaded; False if there is no room left for it in the instruction memory of the block.
+ *
+ * @note The program is the WS2812 example of the Pico SDK, encoded here so that no pioasm step is needed in the build:
+ *
+ *       .side_set 1
+ *       .wrap_target
+ *       bitloop:
+ *           out x, 1       side 0 [T3 - 1] ; Side-set still takes place when the instruction stalls (empty FIFO: line low)
+ *           jmp !x do_zero side 1 [T1 - 1] ; Branch on the bit shifted out, with the line high
+ *       do_one:
+ *           jmp bitloop    side 1 [T2 - 1] ; Keep the line high for a 1
+ *       do_zero:
+ *           nop            side 0 [T2 - 1] ; Or low for a 0
+ *       .wrap
+ *
+ *       The jump addresses are relative to the start of the program, pio_add_program relocates them.
+ */
+static bool ws2812b_load_program(PIO pio)
+{
+    static uint16_t instructions[4];
+    uint index = pio_get_index(pio);
+
+    if (program_offset[index] >= 0)
+    {
+        return true;
+    }
+
+    instructions[0] = pio_encode_out(pio_x, 1) | pio_encode_sideset(1, 0) | pio_encode_delay(WS2812B_T3 - 1);
+    instructions[1] = pio_encode_jmp_not_x(3) | pio_encode_sideset(1, 1) | pio_encode_delay(WS2812B_T1 - 1);
+    instructions[2] = pio_encode_jmp(0) | pio_encode_sideset(1, 1) | pio_encode_delay(WS2812B_T2 - 1);
+    instructions[3] = pio_encode_nop() | pio_encode_sideset(1, 0) | pio_encode_delay(WS2812B_T2 - 1);
+
+    const pio_program_t program = {.instructions = instructions, .length = 4, .origin = -1};
+    if (!pio_can_add_program(pio, &program))
+    {
+        return false;
+    }
+    program_offset[index] = (int)pio_add_program(pio, &program);
+    return true;
+}
+
+/**
+ * @brief Claim a state machine for a LED pin, in the first PIO block that has one left (and room for the program).
+ *
+ * @param output The output of the LED pin, its pio and sm set on success.
+ * @return True on success; False if every state machine is taken.
+ */
+static bool ws2812b_claim_sm(ws2812b_strip_t *output)
+{
+    for (uint index = 0; index < NUM_PIOS; index++)
+    {
+        PIO pio = (index == 0) ? pio0 : pio1;
+        int sm = pio_claim_unused_sm(pio, false);
+        if (sm < 0)
+        {
+            continue;
+        }
+        if (!ws2812b_load_program(pio))
+        {
+            pio_sm_unclaim(pio, (uint)sm);
+            continue;
+        }
+        output->pio = pio;
+        output->sm = (uint)sm;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Initialize a LED pin: claims a state machine and a DMA channel for it, and starts the state machine.
+ *
+ * @param output The output of the LED pin.
+ * @return True on success (or if the pin was already initialized); False if no state machine or no DMA channel is left.
+ *
+ * @note The state machine runs at WS2812B_BIT_CYCLES cycles of WS2812B_CYCLE_NS per bit, its clock divider derived from the system clock.
+ *       It shifts out 8 bits per FIFO entry, most significant first: the DMA channel writes the array a byte at a time,
+ *       and a byte written to the FIFO is replicated across its 32 bits, so its bits are the ones shifted out first.
+ *       The line stays low while the FIFO is empty.
+ */
+static bool ws2812b_output_init(ws2812b_strip_t *output)
+{
+    if (output->enabled)
+    {
+        return true;
+    }
+    if (!ws2812b_claim_sm(output))
+    {
+        printf("WS2812B: no PIO state machine left for pin %u\n", output->pin);
+        return false;
+    }
+    output->dma_channel = dma_claim_unused_channel(false);
+    if (output->dma_channel < 0)
+    {
+        printf("WS2812B: no DMA channel left for pin %u\n", output->pin);
+        pio_sm_unclaim(output->pio, output->sm);
+        return false;
+    }
+
+    uint offset = (uint)program_offset[pio_get_index(output->pio)];
+    pio_gpio_init(output->pio, output->pin);
+    pio_sm_set_consecutive_pindirs(output->pio, output->sm, output->pin, 1, true);
+
+    pio_sm_config config = pio_get_default_sm_config();
+    sm_config_set_wrap(&config, offset, offset + 3);
+    sm_config_set_sideset(&config, 1, false, false);
+    sm_config_set_sideset_pins(&config, output->pin);
+    sm_config_set_out_shift(&config, false, true, 8);
+    sm_config_set_fifo_join(&config, PIO_FIFO_JOIN_TX);
+    ws2812b_derive_clkdiv();
+    sm_config_set_clkdiv_int_frac(&config, clkdiv >> 8, clkdiv & 0xFF);
+    output->sys_hz = clkdiv_sys_hz;
+    pio_sm_init(output->pio, output->sm, offset, &config);
+    pio_sm_set_enabled(output->pio, output->sm, true);
+
+    dma_channel_config dma_config = dma_channel_get_default_config(output->dma_channel);
+    channel_config_set_transfer_data_size(&dma_config, DMA_SIZE_8);
+    channel_config_set_read_increment(&dma_config, true);
+    channel_config_set_write_increment(&dma_config, false);
+    channel_config_set_dreq(&dma_config, pio_get_dreq(output->pio, output->sm, true));
+    dma_channel_configure(output->dma_channel, &dma_config, &output->pio->txf[output->sm], output->front, output->size, false);
+
+    critical_section_init(&output->cs);
+    output->idle_at = get_absolute_time();
+    output->enabled = true;
+    return true;
+}
+
+static int64_t ws2812b_output_latched(alarm_id_t id, void *user_data);
+
+/**
+ * @brief Start sending the front frame of a LED pin, and arm the alarm telling when it has been latched.
+ *
+ * @param output The output of the LED pin, busy.
+ *
+ * @note Called with the critical section of the output held (from ws2812b_output_show, or from the alarm itself).
+ */
+static void ws2812b_output_start(ws2812b_strip_t *output)
+{
+    dma_channel_transfer_from_buffer_now(output->dma_channel, output->front, output->size);
+    output->idle_at = make_timeout_time_us((output->size * WS2812B_BYTE_NS + 999) / 1000 + WS2812B_RESET_US);
+
+    // Never fired from here: called with the critical section held, which ws2812b_output_latched enters.
+    // Should idle_at have passed already (e.g. held up by a longer interrupt), the alarm is armed for right away instead.
+    alarm_id_t alarm = add_alarm_at(output->idle_at, ws2812b_output_latched, output, false);
+    while (alarm == 0)
+    {
+        alarm = add_alarm_in_us(1, ws2812b_output_latched, output, false);
+    }
+    if (alarm < 0)
+    {
+        // No alarm left: the frame is sent all the same, the next one waits for idle_at instead.
+        output->busy = false;
+        output->queued_ready = false;
+    }
+}
+
+/**
+ * @brief Alarm of a frame that has been sent and latched: sends the queued frame if there is one, then calls the frame done callback.
+ *
+ * @note Runs in the timer interrupt.
+ */
+static int64_t ws2812b_output_latched(alarm_id_t id, void *user_data)
+{
+    ws2812b_strip_t *output = (ws2812b_strip_t *)user_data;
+
+    critical_section_enter_blocking(&output->cs);
+    if (output->queued_ready)
+    {
+        uint8_t *sent = output->front;
+        output->front = output->queued;
+        output->queued = sent;
+        output->queued_ready = false;
+        ws2812b_output_start(output);
+    }
+    else
+    {
+        output->busy = false;
+    }
+    critical_section_exit(&output->cs);
+
+    if (frame_done_callback != NULL)
+    {
+        frame_done_callback(output->type, output, frame_done_callback_arg);
+    }
+    return 0;
+}
+
+/**
+ * @brief Hand the back frame of a LED pin over to be sent, and return.
+ *
+ * @param output The output of the LED pin.
+ *
+ * @note If the pin is idle, the back frame becomes the front frame and is sent straight away.
+ *       Otherwise it becomes the queued frame (replacing a frame queued before, that has not been sent yet),
+ *       and is sent by the alarm of the front frame once that one has been latched.
+ *       Either way the frame handed over is copied back into the new back frame, so that the set_* functions
+ *       keep changing the LEDs from the colours last shown, while the frame handed over is left alone until it has been sent.
+ *       Nothing is sent if the pin has not been initialized (see ws2812b_init).
+ */
+static void ws2812b_output_show(ws2812b_strip_t *output)
+{
+    if (!output->enabled)
+    {
+        return;
+    }
+    if (!output->busy)
+    {
+        // Only waits if the alarm of the previous frame could not be armed (see ws2812b_output_start).
+        busy_wait_until(output->idle_at);
+
+        // The system clock has changed since the last frame: the clock divider is derived again, while the state machine is idle.
+        ws2812b_derive_clkdiv();
+        if (output->sys_hz != clkdiv_sys_hz)
+        {
+            pio_sm_set_clkdiv_int_frac(output->pio, output->sm, clkdiv >> 8, clkdiv & 0xFF);
+            pio_sm_clkdiv_restart(output->pio, output->sm);
+            output->sys_hz = clkdiv_sys_hz;
+        }
+    }
+
+    critical_section_enter_blocking(&output->cs);
+    uint8_t *shown = output->back;
+    if (output->busy)
+    {
+        output->back = output->queued;
+        output->queued = shown;
+        output->queued_ready = true;
+    }
+    else
+    {
+        output->back = output->front;
+        output->front = shown;
+        output->busy = true;
+        ws2812b_output_start(output);
+    }
+    critical_section_exit(&output->cs);
+
+    // The frame handed over is only read from now on, by the DMA channel or by this copy.
+    memcpy(output->back, shown, output->size);
+}
+
+#pragma endregion
+
 #pragma region onboard led functions
 
 /**
@@ -110,9 +484,7 @@ void hexToRGB(const char *hexColor, uint8_t *red, uint8_t *green, uint8_t *blue)
  */
 void set_onboard_led_rgb(uint8_t r, uint8_t g, uint8_t b)
 {
-    onboard_led_data[0] = g; /* Green */
-    onboard_led_data[1] = r; /* Red */
-    onboard_led_data[2] = b; /* Blue */
+    ws2812b_strip_set_rgb(&onboard_output, 0, r, g, b);
 }
 
 /**
@@ -135,102 +507,17 @@ void set_onboard_led_hex(const char *hexColor)
 }
 
 /**
- * @brief Display RGB data on the onboard LED using a custom bit-banging method.
+ * @brief Display RGB data on the onboard LED.
  *
- * @note The function uses a custom bit-banging method to send RGB data to the onboard LED.
- *       The RGB data is stored in the global array onboard_led_data.
- *       The function sequentially processes each set of RGB values (green, red, blue) in the array
- *       and sends the corresponding bits to the onboard LED pin.
- *       It handles each bit individually, setting and clearing the pin based on the bit value and applying
- *       specific delays as per the datasheet.
- *       After sending all the RGB data, it sets the level low to indicate a reset.
- *       Interrupts are temporarily disabled during the process to ensure precise timing.
- *       A cooldown delay is added after the process to allow things to settle down.
+ * @note The function hands the frame written by the set_onboard_led_* functions over to be sent to the onboard LED, and returns
+ *       straight away: the bits are shifted out by a PIO state machine, fed by DMA, so no interrupt is disabled and no CPU time is spent
+ *       while the LED is updated. The next frame can be written at once, it does not change the one being sent.
+ *       If the previous frame is still being sent, this one is queued and sent right after it (a frame queued before and not sent yet is dropped).
+ *       See ws2812b_set_frame_done_callback and ws2812b_is_frame_in_flight to know when it has been shown.
  */
 void show_onboard_led()
 {
-    /* Disable all interrupts and save the mask */
-    uint32_t interrupt_mask = disable_and_save_interrupts();
-
-    /* Get the pin bit */
-    uint32_t pin = 1UL << ONBOARD_LED_PIN;
-
-    uint8_t red = 0;
-    uint8_t green = 0;
-    uint8_t blue = 0;
-    uint32_t i = 0;
-    int8_t j = 0;
-
-    for (i = 0; i < ONBOARD_LED_TOTAL_DATA_SIZE; i += LED_DATA_SIZE)
-    {
-        /* Send order is green, red, blue  */
-        green = onboard_led_data[i];
-        red = onboard_led_data[i + 1];
-        blue = onboard_led_data[i + 2];
-
-        for (j = 7; j >= 0; j--) /* Handle the 8 green bits */
-        {
-            /* Get Nth bit */
-            if (((green >> j) & 1) == 1) /* The bit is 1 */
-            {
-                sio_hw->gpio_set = pin; /* This sets the specific pin to high */
-                cycle_delay_t1h();      /* Delay by datasheet amount (800ns give or take) */
-                sio_hw->gpio_clr = pin; /* This sets the specific pin to low */
-                cycle_delay_t1l();      /* Delay by datasheet amount (450ns give or take) */
-            }
-            else /* The bit is 0 */
-            {
-                sio_hw->gpio_set = pin;
-                cycle_delay_t0h();
-                sio_hw->gpio_clr = pin;
-                cycle_delay_t0l();
-            }
-        }
-
-        for (j = 7; j >= 0; j--) /* Handle the 8 red bits */
-        {
-            if (((red >> j) & 1) == 1)
-            {
-                sio_hw->gpio_set = pin;
-                cycle_delay_t1h();
-                sio_hw->gpio_clr = pin;
-                cycle_delay_t1l();
-            }
-            else
-            {
-                sio_hw->gpio_set = pin;
-                cycle_delay_t0h();
-                sio_hw->gpio_clr = pin;
-                cycle_delay_t0l();
-            }
-        }
-
-        for (j = 7; j >= 0; j--) /* Handle the 8 blue bits */
-        {
-            if (((blue >> j) & 1) == 1)
-            {
-                sio_hw->gpio_set = pin;
-                cycle_delay_t1h();
-                sio_hw->gpio_clr = pin;
-                cycle_delay_t1l();
-            }
-            else
-            {
-                sio_hw->gpio_set = pin;
-                cycle_delay_t0h();
-                sio_hw->gpio_clr = pin;
-                cycle_delay_t0l();
-            }
-        }
-    }
-    /* Set the level low to indicate a reset is happening */
-    sio_hw->gpio_clr = pin;
-
-    /* Restore the interrupts that got disabled */
-    enable_and_restore_interrupts(interrupt_mask);
-
-    /*Waits for the data sent out to settle down before resuming other operations*/
-    sleep_ms(COOLDOWN_DELAY);
+    ws2812b_output_show(&onboard_output);
 }
 
 #pragma endregion
@@ -250,16 +537,7 @@ void show_onboard_led()
  */
 void set_external_led_rgb(uint32_t ledIndex, uint8_t r, uint8_t g, uint8_t b)
 {
-    if (ledIndex >= EXTERNAL_LED_COUNT)
-    {
-        printf("Invalid LED index: %u\n", ledIndex);
-        return;
-    }
-
-    uint32_t ledDataIndex = ledIndex * LED_DATA_SIZE;
-    external_led_data[ledDataIndex] = g;     /* Green */
-    external_led_data[ledDataIndex + 1] = r; /* Red */
-    external_led_data[ledDataIndex + 2] = b; /* Blue */
+    ws2812b_strip_set_rgb(&external_output, ledIndex, r, g, b);
 }
 /**
  * @brief Set the color of an external LED at a specified index using a hexadecimal color string.
@@ -292,12 +570,7 @@ void set_external_led_hex(uint32_t ledIndex, const char *hexColor)
  */
 void set_all_external_leds_rgb(uint8_t r, uint8_t g, uint8_t b)
 {
-    for (uint32_t i = 0; i < EXTERNAL_LED_TOTAL_DATA_SIZE; i += LED_DATA_SIZE)
-    {
-        external_led_data[i] = g;     /* Green */
-        external_led_data[i + 1] = r; /* Red */
-        external_led_data[i + 2] = b; /* Blue */
-    }
+    ws2812b_strip_set_all_rgb(&external_output, r, g, b);
 }
 /**
  * @brief Set the color of all external LEDs using a hexadecimal color string.
@@ -317,102 +590,17 @@ void set_all_external_leds_hex(const char *hexColor)
     set_all_external_leds_rgb(red, green, blue);
 }
 /**
- * @brief Display RGB data on external LEDs using a custom bit-banging method.
+ * @brief Display RGB data on external LEDs.
  *
- * @note The function uses a custom bit-banging method to send RGB data to external LEDs.
- *       The RGB data is stored in the global array external_led_data.
- *       The function sequentially processes each set of RGB values (green, red, blue) in the array
- *       and sends the corresponding bits to the external LED pin.
- *       It handles each bit individually, setting and clearing the pin based on the bit value and applying
- *       specific delays as per the datasheet.
- *       After sending all RGB data, it sets the level low to indicate a reset.
- *       Interrupts are temporarily disabled during the process to ensure precise timing.
- *       A cooldown delay is added after the process to allow things to settle down.
+ * @note The function hands the frame written by the set_*external_led* functions over to be sent to the external LEDs, and returns
+ *       straight away: the bits are shifted out by a PIO state machine, fed by DMA, so no interrupt is disabled and no CPU time is spent
+ *       while the strip is updated, however many LEDs it has. The next frame can be written at once, it does not change the one being sent.
+ *       If the previous frame is still being sent, this one is queued and sent right after it (a frame queued before and not sent yet is dropped).
+ *       See ws2812b_set_frame_done_callback and ws2812b_is_frame_in_flight to know when it has been shown.
  */
 void show_external_leds()
 {
-    /* Disable all interrupts and save the mask */
-    uint32_t interrupt_mask = disable_and_save_interrupts();
-
-    /* Get the pin bit */
-    uint32_t pin = 1UL << EXTERNAL_LED_PIN;
-
-    /* Declared outside to force optimization if compiler gets any funny ideas */
-    uint8_t red = 0;
-    uint8_t green = 0;
-    uint8_t blue = 0;
-    uint32_t i = 0;
-    int8_t j = 0;
-    for (i = 0; i < EXTERNAL_LED_TOTAL_DATA_SIZE; i += LED_DATA_SIZE)
-    {
-        /* Send order is green, red, blue for the WS2812B. You may wish to change this if you have a different LED type */
-        green = external_led_data[i];
-        red = external_led_data[i + 1];
-        blue = external_led_data[i + 2];
-
-        for (j = 7; j >= 0; j--) /* Handle the 8 green bits */
-        {
-            /* Get Nth bit */
-            if (((green >> j) & 1) == 1) /* The bit is 1 */
-            {
-                sio_hw->gpio_set = pin; /* This sets the specific pin to high */
-                cycle_delay_t1h();      /* Delay by datasheet amount (800ns give or take) */
-                sio_hw->gpio_clr = pin; /* This sets the specific pin to low */
-                cycle_delay_t1l();      /* Delay by datasheet amount (450ns give or take) */
-            }
-            else /* The bit is 0 */
-            {
-                sio_hw->gpio_set = pin;
-                cycle_delay_t0h();
-                sio_hw->gpio_clr = pin;
-                cycle_delay_t0l();
-            }
-        }
-
-        for (j = 7; j >= 0; j--) /* Handle the 8 red bits */
-        {
-            if (((red >> j) & 1) == 1)
-            {
-                sio_hw->gpio_set = pin;
-                cycle_delay_t1h();
-                sio_hw->gpio_clr = pin;
-                cycle_delay_t1l();
-            }
-            else
-            {
-                sio_hw->gpio_set = pin;
-                cycle_delay_t0h();
-                sio_hw->gpio_clr = pin;
-                cycle_delay_t0l();
-            }
-        }
-
-        for (j = 7; j >= 0; j--) /* Handle the 8 blue bits */
-        {
-            if (((blue >> j) & 1) == 1)
-            {
-                sio_hw->gpio_set = pin;
-                cycle_delay_t1h();
-                sio_hw->gpio_clr = pin;
-                cycle_delay_t1l();
-            }
-            else
-            {
-                sio_hw->gpio_set = pin;
-                cycle_delay_t0h();
-                sio_hw->gpio_clr = pin;
-                cycle_delay_t0l();
-            }
-        }
-    }
-    /* Set the level low to indicate a reset is happening */
-    sio_hw->gpio_clr = pin;
-
-    /* Restore the interrupts that got disabled */
-    enable_and_restore_interrupts(interrupt_mask);
-
-    /*Waits for the data sent out to settle down before resuming other operations*/
-    sleep_ms(COOLDOWN_DELAY);
+    ws2812b_output_show(&external_output);
 }
 
 #pragma endregion
@@ -577,6 +765,253 @@ void reset_all_leds()
     sleep_ms(100);
 }
 
+#pragma region frame functions
+
+/**
+ * @brief Set the function called each time a frame has been sent to the LEDs and latched.
+ *
+ * @param callback The function, NULL for none. It gets which LED(s) the frame was sent to (and their strip), and arg.
+ * @param arg Passed to the function as is.
+ *
+ * @note The function is called from the timer interrupt: it must be short. It may call the set_* and show_* functions,
+ *       e.g. to send the next frame of an animation.
+ *       If a frame was queued, it is already being sent when the function is called.
+ */
+void ws2812b_set_frame_done_callback(ws2812b_frame_done_callback_t callback, void *arg)
+{
+    frame_done_callback = NULL;
+    frame_done_callback_arg = arg;
+    frame_done_callback = callback;
+}
+
+/**
+ * @brief Check whether a frame is being sent to LED(s), or queued.
+ *
+ * @param led Which LED(s): WS2812B_LED_TYPE_EXTERNAL, WS2812B_LED_TYPE_MAKERPICO, or WS2812B_LED_TYPE_STRIP for any of the strips registered at runtime.
+ * @return True until every frame handed over by show_* has been sent and latched.
+ */
+bool ws2812b_is_frame_in_flight(ws2812b_led_type_t led)
+{
+    if (led == WS2812B_LED_TYPE_STRIP)
+    {
+        for (uint32_t i = 0; i < strip_count; i++)
+        {
+            if (strips[i].busy)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+    return (led == WS2812B_LED_TYPE_MAKERPICO) ? onboard_output.busy : external_output.busy;
+}
+
+#pragma endregion
+
+#pragma region strip functions
+
+/**
+ * @brief Register a LED strip at runtime, on its own pin and with its own number of LEDs.
+ *
+ * @param pin GPIO the data line of the strip is wired to.
+ * @param led_count Number of LEDs of the strip.
+ * @return The strip, all its LEDs off; NULL if WS2812B_MAX_STRIPS strips are registered already, if its frames do not fit
+ *         in what is left of WS2812B_ARENA_SIZE, or if no PIO state machine or DMA channel is left (a message is printed).
+ *
+ * @note The strip gets its own PIO state machine and DMA channel: the strips are sent in parallel, so refreshing all of them
+ *       takes as long as the longest one (30us per LED, plus 300us of reset), not the sum of them.
+ *       Its 3 frames (back, front and queued, 3 bytes per LED) are taken from a static arena, they are never given back:
+ *       the strips are meant to be registered once, at startup.
+ *       The onboard LED and the external LEDs (see ws2812b_init) take a state machine and a DMA channel each as well.
+ *       Example usage: ws2812b_strip_t *rack = ws2812b_add_strip(16, 144);
+ */
+ws2812b_strip_t *ws2812b_add_strip(uint pin, uint32_t led_count)
+{
+    if ((led_count == 0) || (strip_count >= WS2812B_MAX_STRIPS) ||
+        (led_count > (WS2812B_ARENA_SIZE - strip_arena_used) / (3 * LED_DATA_SIZE)))
+    {
+        printf("WS2812B: no room left for a strip of %u LEDs on pin %u\n", led_count, pin);
+        return NULL;
+    }
+
+    ws2812b_strip_t *strip = &strips[strip_count];
+    uint32_t size = led_count * LED_DATA_SIZE;
+    uint8_t *frames = &strip_arena[strip_arena_used];
+
+    memset(strip, 0, sizeof(*strip));
+    memset(frames, 0, 3 * size);
+    strip->type = WS2812B_LED_TYPE_STRIP;
+    strip->pin = pin;
+    strip->size = size;
+    strip->back = frames;
+    strip->front = frames + size;
+    strip->queued = frames + 2 * size;
+    if (!ws2812b_output_init(strip))
+    {
+        return NULL;
+    }
+
+    strip_arena_used += 3 * size;
+    strip_count++;
+    return strip;
+}
+
+/**
+ * @brief Get the strip of the onboard LED or of the external LEDs, to use them with the ws2812b_strip_* functions.
+ *
+ * @param led WS2812B_LED_TYPE_EXTERNAL or WS2812B_LED_TYPE_MAKERPICO.
+ * @return The strip (NULL for WS2812B_LED_TYPE_STRIP). Nothing is sent to it until it has been initialized (see ws2812b_init).
+ */
+ws2812b_strip_t *ws2812b_get_strip(ws2812b_led_type_t led)
+{
+    switch (led)
+    {
+    case WS2812B_LED_TYPE_EXTERNAL:
+        return &external_output;
+    case WS2812B_LED_TYPE_MAKERPICO:
+        return &onboard_output;
+    default:
+        return NULL;
+    }
+}
+
+/**
+ * @brief Get the number of LEDs of a strip.
+ *
+ * @param strip The strip.
+ * @return The number of LEDs.
+ */
+uint32_t ws2812b_strip_get_led_count(const ws2812b_strip_t *strip)
+{
+    return strip->size / LED_DATA_SIZE;
+}
+
+/**
+ * @brief Set RGB values for a LED of a strip.
+ *
+ * @param strip The strip.
+ * @param ledIndex Index of the LED (0 to the number of LEDs of the strip - 1).
+ * @param r Red color component (0-255).
+ * @param g Green color component (0-255).
+ * @param b Blue color component (0-255).
+ *
+ * @note The LED changes in the back frame of the strip, shown by the next ws2812b_strip_show.
+ *       If the LED index is invalid, an error message is printed, and nothing is changed.
+ */
+void ws2812b_strip_set_rgb(ws2812b_strip_t *strip, uint32_t ledIndex, uint8_t r, uint8_t g, uint8_t b)
+{
+    if (ledIndex >= strip->size / LED_DATA_SIZE)
+    {
+        printf("Invalid LED index: %u\n", ledIndex);
+        return;
+    }
+
+    uint32_t ledDataIndex = ledIndex * LED_DATA_SIZE;
+    uint8_t *frame = strip->back;
+    frame[ledDataIndex] = g;     /* Green */
+    frame[ledDataIndex + 1] = r; /* Red */
+    frame[ledDataIndex + 2] = b; /* Blue */
+}
+
+/**
+ * @brief Set the color of a LED of a strip using a hexadecimal color string.
+ *
+ * @param strip The strip.
+ * @param ledIndex Index of the LED (0 to the number of LEDs of the strip - 1).
+ * @param hexColor Hexadecimal color string (e.g., "FF8800").
+ */
+void ws2812b_strip_set_hex(ws2812b_strip_t *strip, uint32_t ledIndex, const char *hexColor)
+{
+    uint8_t red = 0;
+    uint8_t green = 0;
+    uint8_t blue = 0;
+    hexToRGB(hexColor, &red, &green, &blue);
+    ws2812b_strip_set_rgb(strip, ledIndex, red, green, blue);
+}
+
+/**
+ * @brief Set RGB values for all the LEDs of a strip.
+ *
+ * @param strip The strip.
+ * @param r Red color component (0-255).
+ * @param g Green color component (0-255).
+ * @param b Blue color component (0-255).
+ */
+void ws2812b_strip_set_all_rgb(ws2812b_strip_t *strip, uint8_t r, uint8_t g, uint8_t b)
+{
+    uint8_t *frame = strip->back;
+    for (uint32_t i = 0; i < strip->size; i += LED_DATA_SIZE)
+    {
+        frame[i] = g;     /* Green */
+        frame[i + 1] = r; /* Red */
+        frame[i + 2] = b; /* Blue */
+    }
+}
+
+/**
+ * @brief Set the color of all the LEDs of a strip using a hexadecimal color string.
+ *
+ * @param strip The strip.
+ * @param hexColor Hexadecimal color string (e.g., "FF8800").
+ */
+void ws2812b_strip_set_all_hex(ws2812b_strip_t *strip, const char *hexColor)
+{
+    uint8_t red = 0;
+    uint8_t green = 0;
+    uint8_t blue = 0;
+    hexToRGB(hexColor, &red, &green, &blue);
+    ws2812b_strip_set_all_rgb(strip, red, green, blue);
+}
+
+/**
+ * @brief Get the back frame of a strip, to write many LEDs at once (e.g. an animation).
+ *
+ * @param strip The strip.
+ * @return The frame: 3 bytes per LED, in send order (green, red, blue).
+ *
+ * @note The frame changes with every ws2812b_strip_show (the frame shown is swapped out): get it again after each one.
+ */
+uint8_t *ws2812b_strip_get_frame(ws2812b_strip_t *strip)
+{
+    return strip->back;
+}
+
+/**
+ * @brief Hand the frame of a strip over to be sent, and return straight away (see show_external_leds).
+ *
+ * @param strip The strip.
+ */
+void ws2812b_strip_show(ws2812b_strip_t *strip)
+{
+    ws2812b_output_show(strip);
+}
+
+/**
+ * @brief Hand the frames of all the strips registered at runtime over to be sent, and return straight away.
+ *
+ * @note The strips are sent in parallel, each by its own state machine: they have all been refreshed once the longest one has.
+ */
+void ws2812b_show_all_strips()
+{
+    for (uint32_t i = 0; i < strip_count; i++)
+    {
+        ws2812b_output_show(&strips[i]);
+    }
+}
+
+/**
+ * @brief Check whether a frame is being sent to a strip, or queued.
+ *
+ * @param strip The strip.
+ * @return True until every frame handed over by ws2812b_strip_show has been sent and latched.
+ */
+bool ws2812b_strip_is_frame_in_flight(const ws2812b_strip_t *strip)
+{
+    return strip->busy;
+}
+
+#pragma endregion
+
 #pragma region init functions
 
 /**
@@ -585,24 +1020,22 @@ void reset_all_leds()
  * @param enable_onboard_led Whether to enable initialization for the onboard LED that comes with the Maker Pico Board.
  * @param enable_external_led Whether to enable initialization for external LED strip(s).
  *
- * @note This function initializes the WS2812B LEDs by configuring the GPIO pins for the onboard and external LEDs.
- *       If enable_onboard_led is true, it initializes the onboard LED pin to get ready for output.
- *       If enable_external_led is true, it initializes the external LED pin to get ready for output.
+ * @note This function initializes the WS2812B LEDs by handing the GPIO pins of the onboard and external LEDs to the PIO.
+ *       If enable_onboard_led is true, it claims a PIO state machine and a DMA channel for the onboard LED pin.
+ *       If enable_external_led is true, it claims a PIO state machine and a DMA channel for the external LED pin.
+ *       The clock divider of the state machines is derived from the system clock here, and again by the show_* functions
+ *       whenever the system clock has changed since (e.g. with set_sys_clock_khz), so the bit timings hold at any system clock.
  *       A short delay (100ms) is added after initialization to allow the LEDs to reset.
  */
 void ws2812b_init(bool enable_onboard_led, bool enable_external_led)
 {
     if (enable_onboard_led)
     {
-        gpio_init(ONBOARD_LED_PIN);
-        gpio_set_dir(ONBOARD_LED_PIN, GPIO_OUT);
-        gpio_put(ONBOARD_LED_PIN, false);
+        ws2812b_output_init(&onboard_output);
     }
     if (enable_external_led)
     {
-        gpio_init(EXTERNAL_LED_PIN);
-        gpio_set_dir(EXTERNAL_LED_PIN, GPIO_OUT);
-        gpio_put(EXTERNAL_LED_PIN, false);
+        ws2812b_output_init(&external_output);
     }
     // Wait a little while for the LEDs to reset
     sleep_ms(100);
@@ -3,23 +3,26 @@
 #include "i2c_tools.h"
 #include "FS3000_Rebuilt.h"
 
+static i2c_tools_bus_t *_bus;                                                         //	I2C bus the sensor is connected to
 static uint8_t _buff[FS3000_TO_READ];                                                 //	5 Bytes Buffer
 static uint8_t _range = AIRFLOW_RANGE_7_MPS;                                          // defaults to FS3000-1005 range
 static float _mpsDataPoint[13] = {0, 1.07, 2.01, 3.00, 3.97, 4.96, 5.98, 6.99, 7.23}; // defaults to FS3000-1005 datapoints
 static int _rawDataPoint[13] = {409, 915, 1522, 2066, 2523, 2908, 3256, 3572, 3686};  // defaults to FS3000-1005 datapoints
 
 // Make sure to initialize the I2C bus before calling this function
-// Initializes the sensor (no settings to adjust)
+// Initializes the sensor (no settings to adjust) on the given bus
 // Returns false if sensor is not detected
-bool FS3000_begin()
+bool FS3000_begin(i2c_tools_bus_t *bus)
 {
+    _bus = bus;
+    i2c_tools_setDeviceClock(_bus, FS3000_DEVICE_ADDRESS, FS3000_I2C_CLOCK_HZ);
     return FS3000_isConnected();
 }
 // Returns true if I2C device ack's
+// The answer is looked up in the bus presence cache, the bus is only probed the first time
 bool FS3000_isConnected()
 {
-    i2c_tools_beginTransmission((uint8_t)FS3000_DEVICE_ADDRESS);
-    return (i2c_tools_endTransmission() == 0);
+    return i2c_tools_isPresent(_bus, FS3000_DEVICE_ADDRESS);
 }
 /*************************** SET RANGE OF SENSOR ****************/
 /*  There are two varieties of this sensor (1) FS3000-1005 (0-7.23 m/sec)
@@ -63,11 +66,14 @@ void FS3000_setRange(uint8_t range)
 /*  Read from sensor, checksum, return raw data (409-3686)     */
 uint16_t FS3000_readRaw()
 {
-    FS3000_readData(_buff);
+    if (!FS3000_readData(_buff)) // bus error, even after the retries done by i2c_tools
+    {
+        return FS3000_READ_ERROR;
+    }
     bool checksum_result = FS3000_checksum(_buff, false); // debug off
     if (checksum_result == false)                         // checksum error
     {
-        // return 9999;
+        return FS3000_READ_ERROR;
     }
 
     uint16_t airflowRaw = 0;
@@ -87,11 +93,15 @@ uint16_t FS3000_readRaw()
 }
 
 /*************************** READ METERS PER SECOND****************/
-/*  Read from sensor, checksum, return m/s (0-7.23)               */
+/*  Read from sensor, checksum, return m/s (0-7.23), or -1 on a read error */
 float FS3000_readMetersPerSecond()
 {
     float airflowMps = 0.0;
     int airflowRaw = FS3000_readRaw();
+    if (airflowRaw == FS3000_READ_ERROR)
+    {
+        return -1;
+    }
     uint8_t dataPointsNum = 9; // Default to FS3000_1005 AIRFLOW_RANGE_7_MPS
     if (_range == AIRFLOW_RANGE_7_MPS)
     {
@@ -157,33 +167,34 @@ float FS3000_readMetersPerSecond()
     return airflowMps;
 }
 /*************************** READ MILES PER HOUR****************/
-/*  Read from sensor, checksum, return mph (0-33ish)     */
+/*  Read from sensor, checksum, return mph (0-33ish), or -1 on a read error */
 float FS3000_readMilesPerHour()
 {
-    return (FS3000_readMetersPerSecond() * 2.2369362912);
+    float airflowMps = FS3000_readMetersPerSecond();
+    if (airflowMps < 0)
+    {
+        return -1;
+    }
+    return (airflowMps * 2.2369362912);
 }
 
 /*************************** READ DATA *************************/
 /*                Read 5 bytes from sensor, put it at a pointer (given as argument)                  */
-void FS3000_readData(uint8_t *buffer_in)
+/*                Returns false (and clears the buffer, so no stale data is left in it) on a bus error */
+bool FS3000_readData(uint8_t *buffer_in)
 {
-
-    // i2c_tools_reqeustFrom contains the beginTransmission and endTransmission in it.
-    // LMAO, NO IT DOESN'T. Dug up the original Arduino Wire.cpp code and patched it here:
-    i2c_tools_beginTransmission((uint8_t)FS3000_DEVICE_ADDRESS);
-    i2c_tools_write((uint8_t)FS3000_DEVICE_ADDRESS);
-    i2c_tools_endTransmission();
-    // end of patch
-
-    i2c_tools_requestFrom(FS3000_DEVICE_ADDRESS, FS3000_TO_READ); // Request 5 Bytes
-
-    uint8_t i = 0;
-    while (i2c_tools_available())
+    // Same bus sequence as the original Arduino library (write the address byte, then read 5 bytes),
+    // done as a single transaction with a repeated start, straight into the caller's buffer.
+    const uint8_t cmd = (uint8_t)FS3000_DEVICE_ADDRESS;
+    if (i2c_tools_write_read(_bus, FS3000_DEVICE_ADDRESS, &cmd, 1, buffer_in, FS3000_TO_READ) != 0) // Request 5 Bytes
     {
-        buffer_in[i] = i2c_tools_read(); // Receive Byte
-        i += 1;
+        for (int i = 0; i < FS3000_TO_READ; i++)
+        {
+            buffer_in[i] = 0;
+        }
+        return false;
     }
-    // printf("i:%d\n", i);
+    return true;
 }
 
 /****************************** CHECKSUM *****************************
@@ -10,17 +10,19 @@
                          // [3]generic checksum data, [4]generic checksum data
 
 #define FS3000_DEVICE_ADDRESS 0x28 // Note, the FS3000 does not have an adjustable address.
+#define FS3000_I2C_CLOCK_HZ 100000 // Standard-mode, registered with i2c_tools by FS3000_begin
 #define AIRFLOW_RANGE_7_MPS 0x00   // FS3000-1005 has a range of 0-7.23 meters per second
 #define AIRFLOW_RANGE_15_MPS 0x01  // FS3000-1015 has a range of 0-15 meters per second
+#define FS3000_READ_ERROR 9999     // Returned by FS3000_readRaw on a bus or checksum error (m/s and mph read -1)
 
-bool FS3000_begin(); // Initialize I2C Port in here
+bool FS3000_begin(i2c_tools_bus_t *bus); // Pass in the I2C bus (from i2c_tools_init) the sensor is connected to
 bool FS3000_isConnected();
 uint16_t FS3000_readRaw();
 float FS3000_readMetersPerSecond();
 float FS3000_readMilesPerHour();
 void FS3000_setRange(uint8_t range);
 
-void FS3000_readData(uint8_t *buffer_in);
+bool FS3000_readData(uint8_t *buffer_in); // Returns false on a bus error
 
 /*
  * @param data_in: 5 Bytes Buffer
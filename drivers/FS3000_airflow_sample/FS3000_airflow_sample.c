@@ -5,10 +5,10 @@
 int main()
 {
     stdio_init_all();
-    i2c_tools_init(i2c0, PICO_DEFAULT_I2C_SDA_PIN, PICO_DEFAULT_I2C_SCL_PIN);
-    i2c_tools_begin();
+    i2c_tools_bus_t *bus = i2c_tools_init(i2c0, PICO_DEFAULT_I2C_SDA_PIN, PICO_DEFAULT_I2C_SCL_PIN);
+    i2c_tools_begin(bus);
 
-    if (!FS3000_begin())
+    if (!FS3000_begin(bus))
     {
         printf("FS3000 Not Detected. Please check wiring! Retrying in 3 seconds...\n");
         sleep_ms(1000);
@@ -0,0 +1,582 @@
+/** @file I2C_hub_mqtt.c
+ *
+ * This is the main code for the hub pico, which publishes the samples of several I2C hub nodes through its one MQTT connection.
+ * The nodes are picos with a sensor of their own (see I2C_hub_node_sample), answering on the i2c1 bus of the hub
+ * at I2C_HUB_NODE_ADDR and the following addresses, with the register map of i2c_hub_regs.h.
+ *
+ * The code first initializes the hub bus, and then connects to the MQTT server from the main loop (see mqtt_conn_poll).
+ * Every SENSOR_READ_INTERVAL_MS, the sample block of each node is read in one transaction, and the new samples are published
+ * to the NODE<n> topic of the node, in batches. The sample period of the nodes can be set with "PERIOD=<n>" on the CMD topic.
+ *
+ * Samples taken while the MQTT server is unreachable are kept in flash and replayed to the LOG topics once it is back,
+ * and the I2C diagnostics of the hub bus are published to the DIAG topic every few reads.
+ *
+ */
+
+#include "hardware/structs/rosc.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "pico/stdlib.h"
+#include "pico/cyw43_arch.h"
+
+#include "lwip/pbuf.h"
+#include "lwip/tcp.h"
+#include "lwip/dns.h"
+#include "lwip/apps/mqtt.h"
+#include "lwip/apps/mqtt_priv.h"
+
+#include "inf2004_credentials.h"
+#include "mqtt_Rebuilt.h"
+#include "json_writer.h"
+#include "flash_log.h"
+#include "i2c_tools.h"
+#include "i2c_hub_regs.h"
+
+// #define DEBUG
+
+#define SENSOR_READ_INTERVAL_MS 3000
+#define I2C_HUB_NODES 1              // Number of nodes, at I2C_HUB_NODE_ADDR and the following addresses
+#define I2C_HUB_SDA_PIN 6            // i2c1 SDA, wired to the nodes
+#define I2C_HUB_SCL_PIN 7            // i2c1 SCL, wired to the nodes
+#define I2C_DIAG_INTERVAL_READS 10 // Number of sensor reads between two I2C diagnostics reports (DIAG topic)
+#define REPLAY_MAX_QUEUED 4 // Samples kept in flash are only replayed while fewer messages than this are queued
+#define SAMPLE_BATCH_MAX_SAMPLES 10   // Samples sent in one message at most (see mqtt_batch_begin)
+#define SAMPLE_BATCH_MAX_AGE_MS 30000 // Time a sample waits for the rest of its batch at most
+#pragma region Non-Sensor Related stuff that you probably wouldnt care about
+
+#ifdef DEBUG
+#define DEBUG_printf printf
+#else
+#define DEBUG_printf(...)
+#endif
+
+#define MQTT_BUFF_SIZE 1025 // 1024 + 1 for null terminator
+#define MQTT_TOPIC_SIZE 128 // Longest topic + 1 for null terminator
+#define MQTT_INBOX_SIZE 256 // Largest incoming payload + 1 for null terminator
+
+#pragma region MQTT and Network Utilities
+
+static char MQTT_PUB_PAYLOAD_BUFFER[MQTT_BUFF_SIZE];
+
+static u8_t mqtt_inbox_arena[MQTT_INBOX_SIZE]; // Incoming messages, reassembled by the MQTT library (see process_incoming_message)
+
+#define MQTT_TOTAL_SUB_TOPICS 1
+#define MQTT_TOTAL_PUB_TOPICS 1
+static char MQTT_SUB_TOPICS[MQTT_TOTAL_SUB_TOPICS][MQTT_TOPIC_SIZE] = {MQTT_CLIENT_ID "/CMD"};
+static char MQTT_PUB_TOPICS[MQTT_TOTAL_PUB_TOPICS][MQTT_TOPIC_SIZE] = {MQTT_CLIENT_ID};
+
+#pragma region MQTT incoming data functions
+/**
+ * @brief Processes incoming MQTT messages.
+ *
+ * This function is responsible for handling incoming MQTT messages. It prints
+ * information about the received message, such as the topic, payload index, and payload content.
+ * After printing the message details, additional processing can be implemented based on the
+ * topic and payload values.
+ *
+ * @param topic The topic of the received MQTT message.
+ * @param payload The payload of the received MQTT message (null terminated).
+ * The payload typically contains the actual data associated with the MQTT message.
+ * @param len The length of the payload.
+ * @param arg Unused.
+ *
+ * @return void
+ */
+static void setNodesPeriod(uint8_t period);
+
+static void process_incoming_message(const char *topic, const u8_t *payload, u32_t len, void *arg)
+{
+    printf("New MQTT message received!\n");
+    printf("%s[%u]: %s\n", topic, (unsigned int)len, (const char *)payload);
+
+    // PERIOD=<n> sets the sample period of every node, in units of 100ms (0 for their default period)
+    unsigned int period;
+    if (sscanf((const char *)payload, "PERIOD=%u", &period) == 1)
+    {
+        setNodesPeriod((uint8_t)period);
+    }
+}
+
+/**
+ * @brief Subscribe to all predefined MQTT topics.
+ *
+ * This function iterates through an array of MQTT subscription topics
+ * and subscribes to each one using the `mqtt_subscribe_topic` function.
+ * After each successful subscription, a message is printed to indicate
+ * that the subscription to a specific topic has been completed.
+ *
+ * @return void
+ */
+static void mqtt_subscribe_to_all_topics()
+{
+    for (int i = 0; i < MQTT_TOTAL_SUB_TOPICS; i++)
+    {
+        mqtt_subscribe_topic(MQTT_SUB_TOPICS[i], SUB);
+        printf("Subscribed to topic: %s\n", MQTT_SUB_TOPICS[i]);
+    }
+}
+
+#pragma endregion
+
+#pragma region MQTT publish section
+
+// Time spent polling the nodes since the last I2C diagnostics report, in microseconds.
+static uint64_t sensorReadUs = 0;
+
+/**
+ * @brief Publishes sensor data in JSON format to an MQTT topic.
+ *
+ * This function constructs an MQTT topic based on the MQTT client ID and the
+ * provided sensor name. It then publishes the provided JSON-formatted sensor
+ * data to the constructed topic using the `mqtt_batch_add` function (added to the batch
+ * of the topic if it is batched, see main, and sent from the main loop by `mqtt_outbox_poll`,
+ * so this does not wait for the broker).
+ *
+ * @param sensorName The name of the sensor for which data is being published.
+ * 
+ * @param JsonString A JSON-formatted string containing the sensor data to be published.
+ * 
+ * @return void
+ */
+static void publishSensorData(const char *sensorName, const char *JsonString)
+{
+    char topic[MQTT_TOPIC_SIZE];
+
+    // Construct the topic: clientid/sensorname
+    snprintf(topic, MQTT_TOPIC_SIZE, "%s/%s", MQTT_CLIENT_ID, sensorName);
+    
+    // Publish the JSON-formatted sensor data to the MQTT topic
+    if (mqtt_batch_add(topic, JsonString) != ERR_OK)
+    {
+        printf("Failed to queue for topic: %s, message: %s\n", topic, JsonString);
+        return;
+    }
+    
+    printf("Queued for topic: %s, message: %s\n", topic, JsonString);
+}
+
+/**
+ * @brief Publishes a sensor sample, or keeps it in flash while the MQTT server is unreachable.
+ *
+ * The samples kept in flash are replayed once the connection is back (see replayStoredSample),
+ * so the samples taken during a broker or Wi-Fi outage are not lost.
+ *
+ * @param sensorName The name of the sensor for which data is being published.
+ * 
+ * @param JsonString A JSON-formatted string containing the sensor data to be published.
+ * 
+ * @return void
+ */
+static void publishSensorSample(const char *sensorName, const char *JsonString)
+{
+    uint8_t record[FLASH_LOG_MAX_DATA];
+    size_t nameLen = strlen(sensorName) + 1;
+    size_t jsonLen = strlen(JsonString);
+
+    if (mqtt_is_connected())
+    {
+        publishSensorData(sensorName, JsonString);
+        return;
+    }
+
+    // The record holds the sensor name (null terminated) followed by the JSON string
+    if (nameLen + jsonLen > sizeof(record))
+    {
+        printf("Sample too large to be kept in flash, dropped: %s\n", JsonString);
+        return;
+    }
+    memcpy(record, sensorName, nameLen);
+    memcpy(&record[nameLen], JsonString, jsonLen);
+
+    // Timestamped with the time since boot in ms, the boot count is kept by the log (see flash_log_getBoot)
+    if (!flash_log_append(0, (uint32_t)(time_us_64() / 1000), record, nameLen + jsonLen))
+    {
+        printf("Failed to keep the sample in flash: %s\n", JsonString);
+        return;
+    }
+    printf("Kept in flash until the connection is back: %s, message: %s\n", sensorName, JsonString);
+}
+
+/**
+ * @brief Queues a replayed sample, written into the room reserved for it in the outbound queue (see replayStoredSample).
+ *
+ * @param complete True if the sample fitted in the room reserved.
+ *
+ * @param len The length of the message.
+ *
+ * @return True if the sample is done with (queued, or dropped as it can never fit), False to try again later.
+ */
+static bool commitStoredSample(bool complete, size_t len)
+{
+    if (!complete)
+    {
+        mqtt_outbox_cancel();
+        printf("Replayed sample too large for its message, dropped\n");
+        return true;
+    }
+    return mqtt_outbox_commit(len) == ERR_OK;
+}
+
+/**
+ * @brief Replays a sample kept in flash to the <sensorName>/LOG topic (callback of flash_log_replay).
+ *
+ * The sample is wrapped with the time it was taken, e.g. {"boot":3,"ms":123456,"data":{...}}
+ * (time since boot in ms, of the boot number "boot"), so it can be told apart from the live samples.
+ *
+ * @param record The record of the sample.
+ * 
+ * @param arg Unused.
+ * 
+ * @return True if the sample has been queued, False to try again later (the outbound queue is busy).
+ */
+static bool replayStoredSample(const flash_log_record_t *record, void *arg)
+{
+    char topic[MQTT_TOPIC_SIZE];
+    const char *sensorName = (const char *)record->data;
+    size_t nameLen = strnlen(sensorName, record->len);
+    // Room for the sample and its wrapping, written straight into the outbound queue
+    u16_t maxLen = record->len + 64;
+
+    // Leave room in the outbound queue for the live samples
+    if (mqtt_outbox_count() >= REPLAY_MAX_QUEUED)
+    {
+        return false;
+    }
+
+    // Not a sample record (no sensor name), nothing to replay
+    if (nameLen >= record->len)
+    {
+        return true;
+    }
+
+    snprintf(topic, MQTT_TOPIC_SIZE, "%s/%s/LOG", MQTT_CLIENT_ID, sensorName);
+    char *payload = mqtt_outbox_reserve(topic, maxLen);
+    if (payload == NULL)
+    {
+        // Not enough free room in the outbound queue, the reservation never drops the messages queued
+        return false;
+    }
+    json_writer_t json;
+    json_begin(&json, payload, maxLen + 1);
+    json_openObject(&json);
+    json_fieldUint(&json, "boot", record->boot);
+    json_fieldUint(&json, "ms", record->timestamp);
+    json_key(&json, "data");
+    json_putRaw(&json, sensorName + nameLen + 1, record->len - nameLen - 1);
+    json_closeObject(&json);
+    return commitStoredSample(json_isOk(&json), json_getLength(&json));
+}
+
+/**
+ * @brief Publishes the I2C diagnostics of the last few reads to the DIAG topic, then starts a new trace window.
+ *
+ * The payload holds the time spent polling the nodes and the I2C trace summary
+ * (time spent on the bus, per-device latency histograms, see i2c_tools_formatDiagnostics), e.g.
+ * {"sensorReadUs":2250,"i2c":{"windowUs":30000000,"busUs":2250,"dev":[...]}}
+ * so the share of each cycle spent on the bus can be told apart.
+ *
+ * @param bus Pointer to the I2C bus handle of the nodes.
+ *
+ * @return void
+ */
+static void publishI2CDiagnostics(i2c_tools_bus_t *bus)
+{
+    char topic[MQTT_TOPIC_SIZE];
+    json_writer_t json;
+    size_t room;
+
+    // Liveness of the MQTT session, measured by the library (keepalive round trip, signal strength)
+    mqtt_liveness_t liveness;
+    mqtt_get_liveness(&liveness);
+
+    // Written straight into the free room of the outbound queue, the unused room is given back on commit.
+    // The report is skipped if the queue is too full: it never pushes the queued samples out.
+    snprintf(topic, MQTT_TOPIC_SIZE, "%s/DIAG", MQTT_CLIENT_ID);
+    char *message = mqtt_outbox_reserve(topic, MQTT_BUFF_SIZE - 1);
+    if (message == NULL)
+    {
+        printf("Outbound queue full, skipped topic: %s\n", topic);
+    }
+    else
+    {
+        json_begin(&json, message, MQTT_BUFF_SIZE);
+        json_openObject(&json);
+        json_fieldUint(&json, "sensorReadUs", sensorReadUs);
+        json_key(&json, "i2c");
+        char *i2cJson = json_beginRaw(&json, &room);
+        json_endRaw(&json, i2c_tools_formatDiagnostics(bus, i2cJson, room));
+        json_fieldInt(&json, "rssi", liveness.rssi);
+        json_fieldUint(&json, "pingRttUs", liveness.ping_rtt_us);
+        json_closeObject(&json);
+
+        if (json_isOk(&json) && (mqtt_outbox_commit(json_getLength(&json)) == ERR_OK))
+        {
+            printf("Queued for topic: %s, message: %s\n", topic, message);
+        }
+        else
+        {
+            mqtt_outbox_cancel();
+            printf("Diagnostics too large for topic: %s, dropped\n", topic);
+        }
+    }
+
+#ifdef DEBUG
+    i2c_tools_dumpTrace(bus);
+#endif
+
+    // Start a new window
+    i2c_tools_clearTrace(bus);
+    sensorReadUs = 0;
+}
+#pragma endregion
+#pragma endregion
+
+#pragma endregion
+/**
+ * @brief Called by the MQTT library every time the broker accepts the connection (see mqtt_conn_poll).
+ *
+ * Subscribes to all predefined MQTT topics using `mqtt_subscribe_to_all_topics` (the incoming messages
+ * are handed to `process_incoming_message` by the library). The online status is published once per session by the library.
+ * The connection itself (Wi-Fi, DNS, broker) is made and retried with backoff by `mqtt_conn_poll`, from the main loop.
+ *
+ * @param arg Unused.
+ *
+ * @return void
+ */
+static void mqtt_on_connected(void *arg)
+{
+    // subscribe to all topics
+    mqtt_subscribe_to_all_topics();
+}
+
+/**
+ * @brief Called by the MQTT library when the MQTT session ends (see mqtt_conn_set_disconnected_callback).
+ *
+ * The broker publishes the OFFLINE will message on its own, and the library reconnects with backoff.
+ *
+ * @param reason Why the session ended.
+ *
+ * @param arg Unused.
+ *
+ * @return void
+ */
+static void mqtt_on_disconnected(const char *reason, void *arg)
+{
+    printf("MQTT session ended (%s), the samples are kept in flash until it is back.\n", reason);
+}
+
+// I2C bus the nodes are connected to
+static i2c_tools_bus_t *hubBus;
+
+// Flag per node, set once its WHO_AM_I and VERSION registers have been checked
+static bool nodeOk[I2C_HUB_NODES];
+
+// Sequence number of the last sample published per node
+static uint8_t nodeSeq[I2C_HUB_NODES];
+
+// Topic of the samples of each node (the batches keep a pointer to their topic, see mqtt_batch_begin)
+static char nodeTopic[I2C_HUB_NODES][32];
+
+/**
+ * @brief Checks the identity of a node, so a device that happens to answer at its address is not mistaken for it.
+ *
+ * @param node The index of the node.
+ *
+ * @return True if the node answered with the expected WHO_AM_I and VERSION registers.
+ */
+static bool checkNode(int node)
+{
+    uint8_t reg = I2C_HUB_REG_WHO_AM_I;
+    uint8_t id[2];
+
+    if (i2c_tools_write_read(hubBus, I2C_HUB_NODE_ADDR + node, &reg, 1, id, sizeof(id)) != 0)
+    {
+        return false;
+    }
+    if ((id[0] != I2C_HUB_WHO_AM_I) || (id[1] != I2C_HUB_VERSION))
+    {
+        printf("Node %d: unexpected id %02X, version %d\n", node, id[0], id[1]);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Writes the sample period of every node (PERIOD register).
+ *
+ * @param period The sample period in units of 100ms, 0 for the default period of the nodes.
+ *
+ * @return void
+ */
+static void setNodesPeriod(uint8_t period)
+{
+    for (int node = 0; node < I2C_HUB_NODES; node++)
+    {
+        i2c_tools_beginTransmission(hubBus, I2C_HUB_NODE_ADDR + node);
+        i2c_tools_write(hubBus, I2C_HUB_REG_PERIOD);
+        i2c_tools_write(hubBus, period);
+        if (i2c_tools_endTransmission(hubBus) != 0)
+        {
+            printf("Node %d: failed to set the period\n", node);
+        }
+    }
+}
+
+/**
+ * @brief Polls the latest sample of every node over I2C and publishes the new ones to the MQTT server.
+ *
+ * The connection is kept up, and its liveness monitored, by `mqtt_conn_poll` in the main loop. This function reads the sample block of every node in one transaction
+ * (the node updates it in one go, so it is never half of a sample), and publishes it to the NODE<n> topic
+ * if its sequence number has changed since the last poll.
+ *
+ * @return void
+ */
+void pollNodesAndPublish()
+{
+    for (int node = 0; node < I2C_HUB_NODES; node++)
+    {
+        uint8_t reg = I2C_HUB_REG_SEQ;
+        uint8_t sample[I2C_HUB_SAMPLE_LEN];
+        char nodeName[16];
+
+        // Read the sample block of the node (timed, see publishI2CDiagnostics)
+        uint64_t readStart = time_us_64();
+        if (!nodeOk[node])
+        {
+            nodeOk[node] = checkNode(node);
+        }
+        uint8_t result = nodeOk[node] ? i2c_tools_write_read(hubBus, I2C_HUB_NODE_ADDR + node, &reg, 1, sample, sizeof(sample)) : 2;
+        sensorReadUs += time_us_64() - readStart;
+
+        if (result != 0)
+        {
+            // Check the identity again once it answers, it may have been swapped
+            printf("Node %d not answering, skipping it\n", node);
+            nodeOk[node] = false;
+            continue;
+        }
+
+        // Publish new samples only, the nodes may sample slower than they are polled
+        if ((sample[0] == nodeSeq[node]) || !(sample[1] & I2C_HUB_STATUS_VALID))
+        {
+            continue;
+        }
+        nodeSeq[node] = sample[0];
+
+        uint16_t raw = sample[2] | (sample[3] << 8);
+        uint16_t cmPerSec = sample[4] | (sample[5] << 8);
+
+        // Format the sensor data into a JSON payload (the node sends cm/s, written as m/s with 2 decimals)
+        json_writer_t json;
+        json_begin(&json, MQTT_PUB_PAYLOAD_BUFFER, MQTT_BUFF_SIZE);
+        json_openObject(&json);
+        json_fieldUint(&json, "SEQ", sample[0]);
+        json_fieldUint(&json, "RAW", raw);
+        json_fieldFixed(&json, "metersPerSec", cmPerSec, 2);
+        json_closeObject(&json);
+
+        // Publish the sensor data to the MQTT server
+        snprintf(nodeName, sizeof(nodeName), "NODE%d", node);
+        publishSensorSample(nodeName, MQTT_PUB_PAYLOAD_BUFFER);
+    }
+}
+
+int main()
+{
+
+    stdio_init_all();
+
+    // The nodes are on i2c1, with their own sensors on their own i2c0
+    hubBus = i2c_tools_init(i2c1, I2C_HUB_SDA_PIN, I2C_HUB_SCL_PIN);
+    i2c_tools_setClock(hubBus, I2C_HUB_CLOCK_HZ);
+    i2c_tools_begin(hubBus);
+#pragma region WiFi setup
+
+    if (cyw43_arch_init_with_country(CYW43_COUNTRY_SINGAPORE))
+    {
+        printf("Wi-Fi module failed to initialise\n");
+        return 1;
+    }
+
+    cyw43_arch_enable_sta_mode();
+
+    // Joined from the main loop by the MQTT library, without waiting for it (see mqtt_conn_poll)
+    mqtt_conn_set_wifi(WIFI_SSID, WIFI_PASSWORD, CYW43_AUTH_WPA2_AES_PSK);
+#pragma endregion
+
+    // Keep the Wi-Fi stack serviced while the I2C transfers to the nodes are in flight
+    i2c_tools_setIdleCallback(cyw43_arch_poll);
+
+#pragma region MQTT setup
+    set_mqtt_config(
+        MQTT_SERVER_ADDR,
+        MQTT_SERVER_PORT,
+        MQTT_CLIENT_ID,
+        MQTT_USERNAME,
+        MQTT_PASSWORD,
+        MQTT_RETAIN_ALL_MESSAGES,
+        MQTT_QOS,
+        MQTT_KEEP_ALIVE,
+        MQTT_WILL_TOPIC,
+        MQTT_WILL_MESSAGE,
+        MQTT_WILL_QOS,
+        MQTT_WILL_RETAIN);
+
+    // Samples taken while the MQTT server is unreachable are kept in flash (see publishSensorSample)
+    printf("%u samples kept in flash waiting to be replayed\n", (unsigned)flash_log_begin());
+
+    mqtt_client_init();
+    mqtt_inbox_set_message_callback(mqtt_inbox_arena, sizeof(mqtt_inbox_arena), process_incoming_message, NULL);
+    mqtt_conn_set_connected_callback(mqtt_on_connected, NULL);
+    mqtt_conn_set_disconnected_callback(mqtt_on_disconnected, NULL);
+
+    // The samples of each node go out in batches, one message for up to SAMPLE_BATCH_MAX_SAMPLES samples (see publishSensorData).
+    // Nodes beyond the number of batches of the library (MQTT_BATCH_MAX_TOPICS) send one message per sample, as do the DIAG reports.
+    for (int node = 0; node < I2C_HUB_NODES; node++)
+    {
+        snprintf(nodeTopic[node], sizeof(nodeTopic[node]), "%s/NODE%d", MQTT_CLIENT_ID, node);
+        if (mqtt_batch_begin(nodeTopic[node], SAMPLE_BATCH_MAX_SAMPLES, SAMPLE_BATCH_MAX_AGE_MS, 0) != ERR_OK)
+        {
+            printf("Samples of node %d not batched\n", node);
+        }
+    }
+
+#pragma endregion
+
+#pragma region Main loop
+
+    uint64_t nextTimeToReadSensor = 0;
+    int readsSinceDiag = 0; // Number of sensor reads since the last I2C diagnostics report
+    while (1)
+    {
+        if (nextTimeToReadSensor < time_us_64())
+        {
+            pollNodesAndPublish();
+            nextTimeToReadSensor = time_us_64() + SENSOR_READ_INTERVAL_MS * 1000;
+
+            // Report the I2C diagnostics every few reads
+            if (++readsSinceDiag >= I2C_DIAG_INTERVAL_READS)
+            {
+                publishI2CDiagnostics(hubBus);
+                readsSinceDiag = 0;
+            }
+        }
+        mqtt_conn_poll(); // Connect to the broker, and reconnect with backoff, without blocking the sensor reads
+        // Replay the samples kept in flash during an outage, at the replay rate of the log
+        if (mqtt_is_connected())
+        {
+            flash_log_replay(replayStoredSample, NULL);
+        }
+        mqtt_batch_poll();  // Queue the batches whose first sample is SAMPLE_BATCH_MAX_AGE_MS old
+        mqtt_outbox_poll(); // Publish the queued messages, as far as the broker keeps up
+        cyw43_arch_poll();
+        sleep_ms(10);
+    }
+#pragma endregion
+    cyw43_arch_deinit();
+    printf("Bye!\n");
+    return 0;
+}
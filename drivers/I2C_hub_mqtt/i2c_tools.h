@@ -0,0 +1,1036 @@
+/** @file i2c_tools.h
+ *
+ * @brief This file contains the header file for the I2C tools library.
+ *
+ * Brief overview of the code:
+ * An all in one i2c library for the Raspberry Pi Pico, designed to be a drop-in replacement for the Arduino Wire library.
+ * Based on the arduino-pico wire library written by Earle F. Philhower, III (@earlephilhower) https://github.com/earlephilhower/arduino-pico
+ *
+ * Do note that the slave mode of the Wire library (onReceive/onRequest) has not been ported as-is.
+ * Instead, a bus can act as a slave device exposing a register map (see i2c_tools_begin_w_address),
+ * which is what a Pico needs to share its sensor samples with another Pico.
+ *
+ * This library aims to provide a C version, drop-in replacement for the Arduino Wire library.
+ * Designed to be as close to the original Arduino API as possible, this will allow existing I2C code written for Arduino to work on the Raspberry Pi Pico.
+ * Without the need to rewrite everything from scratch (some rewriting is still required, but nothing too major)
+ *
+ * Do note that as the Arduino Wire library is written in C++, some of the functionalities have been changed to fit the C language.
+ * And because C does not support function overloading, some of the functions have been renamed to avoid conflicts.
+ *
+ * To make things simpler, any code that is called in the I2C library will be prefixed with "i2c_tools_".
+ * e.g. _pWire = TwoWire(0) will become bus = i2c_tools_init(i2c0, PICO_DEFAULT_I2C_SDA_PIN, PICO_DEFAULT_I2C_SCL_PIN) instead.
+ * _pWire->begin() will become i2c_tools_begin(bus) instead.
+ * and _pWire->beginTransmission() will become i2c_tools_beginTransmission(bus) instead.
+ *
+ * Every function takes the bus handle returned by i2c_tools_init, which holds the state of one hardware controller
+ * (pins, clock rate, buffers, DMA channels). This allows i2c0 and i2c1 to be used at the same time,
+ * e.g. slow SMBus devices on one controller and fast devices on the other.
+ * etc, etc. (see the example ported I2C libraries for more details)
+ *
+ * Additionally, the following functions have also been ported from the Arduino wiring API:
+ * 1. digitalWrite()
+ * 2. digitalRead()
+ * 3. pinMode()
+ */
+
+#pragma once
+#ifndef _I2C_TOOLS_H_
+#define _I2C_TOOLS_H_
+
+#include <hardware/i2c.h>
+
+// WIRE_HAS_END means Wire has end()
+#define WIRE_HAS_END 1
+
+#ifndef WIRE_BUFFER_SIZE
+#define WIRE_BUFFER_SIZE 256
+#endif
+
+// Default number of retries of a failed blocking transaction (see i2c_tools_setRetryPolicy).
+#ifndef I2C_TOOLS_DEFAULT_RETRIES
+#define I2C_TOOLS_DEFAULT_RETRIES 2
+#endif
+
+// Default deadline of a whole blocking transaction, retries included, in milliseconds (see i2c_tools_setRetryPolicy).
+#ifndef I2C_TOOLS_DEFAULT_DEADLINE_MS
+#define I2C_TOOLS_DEFAULT_DEADLINE_MS 50
+#endif
+
+// Time allowed for each address probed by i2c_tools_scan / i2c_tools_isPresent, in microseconds.
+#ifndef I2C_TOOLS_SCAN_TIMEOUT_US
+#define I2C_TOOLS_SCAN_TIMEOUT_US 2000
+#endif
+
+// Number of blocking transactions kept in the trace ring of each bus (must be a power of 2, see i2c_tools_getTrace).
+#ifndef I2C_TOOLS_TRACE_SIZE
+#define I2C_TOOLS_TRACE_SIZE 64
+#endif
+
+// Number of devices per bus that get their own latency histogram (see i2c_tools_getLatencyHistograms).
+#ifndef I2C_TOOLS_TRACE_DEVICES
+#define I2C_TOOLS_TRACE_DEVICES 8
+#endif
+
+// Number of buckets of a latency histogram: bucket n counts the transactions that took less than 2^n microseconds
+// (and at least 2^(n-1)), the last bucket also counts everything longer.
+#define I2C_TOOLS_HIST_BUCKETS 16
+
+// Maximum number of registers of the register map of a bus in slave mode (see i2c_tools_setRegisterMap).
+#define I2C_TOOLS_SLAVE_REGS 256
+
+#pragma region Bus and asynchronous transfer types
+
+/**
+ * @brief Handle of one I2C bus (one per hardware controller), returned by i2c_tools_init.
+ *
+ * The contents are private to i2c_tools.c, every function of this library takes a pointer to it.
+ */
+typedef struct i2c_tools_bus i2c_tools_bus_t;
+
+/**
+ * @brief State of an asynchronous (DMA-driven) I2C transfer.
+ */
+typedef enum
+{
+    I2C_TOOLS_XFER_IDLE = 0,  // The handle has not been submitted yet.
+    I2C_TOOLS_XFER_BUSY = 1,  // The transfer is in flight, DMA is still feeding/draining the I2C FIFOs.
+    I2C_TOOLS_XFER_DONE = 2,  // The transfer completed successfully.
+    I2C_TOOLS_XFER_ERROR = 3, // The transfer was rejected or aborted (NACK, timeout, bus busy...), see result.
+} i2c_tools_xfer_state_t;
+
+typedef struct i2c_tools_xfer i2c_tools_xfer_t;
+
+/**
+ * @brief Contention statistics of the transaction queue of a bus (see i2c_tools_lock).
+ */
+typedef struct
+{
+    uint32_t acquisitions; // Number of times the bus lock has been taken (nested calls of the owner are not counted).
+    uint32_t contended;    // Number of times the caller had to queue up behind a transaction of the other core.
+    uint64_t totalWaitUs;  // Total time spent queuing for the bus, in microseconds.
+    uint32_t maxWaitUs;    // Longest time spent queuing for the bus, in microseconds.
+    uint32_t maxQueued;    // Largest number of transactions found waiting in front of a new one.
+} i2c_tools_lock_stats_t;
+
+/**
+ * @brief Completion callback of an asynchronous I2C transfer.
+ *
+ * The callback is invoked exactly once per submitted transfer, from whichever context drives the transfer
+ * to completion (i2c_tools_poll, i2c_tools_transferDone or i2c_tools_waitTransfer), never from an interrupt.
+ *
+ * @param xfer The transfer handle that has just completed, check xfer->result for the outcome.
+ * @param arg The user argument passed when the transfer was submitted.
+ */
+typedef void (*i2c_tools_xfer_cb_t)(i2c_tools_xfer_t *xfer, void *arg);
+
+/**
+ * @brief Handle of an asynchronous I2C transfer.
+ *
+ * The handle is owned by the caller and must stay valid until the transfer has completed.
+ * Its fields are filled in by i2c_tools_writeAsync / i2c_tools_readAsync / i2c_tools_writeReadAsync and should be treated as read-only.
+ */
+struct i2c_tools_xfer
+{
+    volatile i2c_tools_xfer_state_t state; // Current state of the transfer.
+    i2c_tools_bus_t *bus;                  // The bus the transfer has been submitted to.
+    uint8_t result;                        // Error code once completed (same codes as i2c_tools_endTransmission).
+    uint8_t addr;                          // 7-bit address of the target device.
+    bool stopBit;                          // True if a Stop is issued at the end of the transfer.
+    size_t txLen;                          // Number of bytes written during the write phase (0 for a plain read).
+    size_t rxLen;                          // Number of bytes read during the read phase (0 for a plain write).
+    uint8_t *rxBuf;                        // Destination buffer of the read phase (NULL for a plain write).
+    uint64_t deadline;                     // Absolute time (in us) after which the transfer is aborted.
+    i2c_tools_xfer_cb_t callback;          // Optional completion callback.
+    void *callbackArg;                     // User argument passed to the completion callback.
+};
+
+#pragma endregion
+
+#pragma region Transaction trace types
+
+/**
+ * @brief Kind of a traced blocking transaction.
+ */
+typedef enum
+{
+    I2C_TOOLS_TRACE_WRITE = 0,      // i2c_tools_endTransmission with data.
+    I2C_TOOLS_TRACE_READ = 1,       // i2c_tools_requestFrom.
+    I2C_TOOLS_TRACE_WRITE_READ = 2, // i2c_tools_write_read.
+    I2C_TOOLS_TRACE_PROBE = 3,      // i2c_tools_endTransmission without data (zero-length probe).
+} i2c_tools_trace_dir_t;
+
+/**
+ * @brief One blocking transaction, as recorded in the trace ring of the bus.
+ */
+typedef struct
+{
+    uint32_t seq;        // Sequence number of the transaction on the bus (starts at 1).
+    uint64_t startUs;    // Time at which the transaction got the bus, in microseconds since boot (time_us_64).
+    uint32_t durationUs; // Time the transaction took, retries and bus recovery included, in microseconds.
+    uint16_t len;        // Number of bytes written and read.
+    uint8_t addr;        // 7-bit address of the target device.
+    uint8_t dir;         // Kind of transaction (see i2c_tools_trace_dir_t).
+    uint8_t result;      // Error code of the transaction (same codes as i2c_tools_endTransmission).
+    uint8_t attempts;    // Number of attempts made (more than 1 if the transaction was retried).
+} i2c_tools_trace_record_t;
+
+/**
+ * @brief Latency histogram of the blocking transactions with one device.
+ */
+typedef struct
+{
+    uint8_t addr;                             // 7-bit address of the device.
+    uint32_t transactions;                    // Number of transactions with the device.
+    uint32_t errors;                          // Number of transactions that failed (after their retries).
+    uint64_t totalUs;                         // Total time spent in transactions with the device, in microseconds.
+    uint32_t maxUs;                           // Longest transaction with the device, in microseconds.
+    uint32_t buckets[I2C_TOOLS_HIST_BUCKETS]; // Transactions per duration bucket (see I2C_TOOLS_HIST_BUCKETS).
+} i2c_tools_latency_hist_t;
+
+#pragma endregion
+
+#pragma region Slave mode (register map) types
+
+/**
+ * @brief Write callback of the register map of a bus in slave mode.
+ *
+ * Called once at the end of every master write that stored data into the register map (not for a bare register pointer write).
+ * It runs in the I2C interrupt handler, so it must be short: copy the registers out with i2c_tools_getRegisters, or set a flag.
+ *
+ * @param bus The bus in slave mode.
+ * @param reg The first register written.
+ * @param len The number of registers written.
+ * @param arg The user argument passed to i2c_tools_onRegisterWrite.
+ */
+typedef void (*i2c_tools_reg_write_cb_t)(i2c_tools_bus_t *bus, uint8_t reg, size_t len, void *arg);
+
+#pragma endregion
+
+#pragma region custom enums to mimic Arduino wiring API
+typedef enum
+{
+    LOW = 0,
+    HIGH = 1,
+    CHANGE = 2,
+    FALLING = 3,
+    RISING = 4,
+} PinStatus;
+
+typedef enum
+{
+    INPUT = 0x0,
+    OUTPUT = 0x1,
+    INPUT_PULLUP = 0x2,
+    INPUT_PULLDOWN = 0x3,
+    OUTPUT_2MA = 0x4,
+    OUTPUT_4MA = 0x5,
+    OUTPUT_8MA = 0x6,
+    OUTPUT_12MA = 0x7,
+} PinMode;
+#pragma endregion
+
+#pragma region GPIO function calls (from wiring_digital.c)
+
+/**
+ * @brief Sets the digital state of a GPIO pin.
+ *
+ * This function mimics the behavior of Arduino's digitalWrite function.
+ * It configures the pin mode and sets the output value accordingly.
+ *
+ * @param pin The GPIO pin number.
+ * @param val The value to set: HIGH (1) or LOW (0).
+ */
+void digitalWrite(int pin, int val);
+
+/**
+ * @brief Reads the digital state of a GPIO pin.
+ *
+ * This function mimics the behavior of Arduino's digitalRead function.
+ * It retrieves the digital state of the specified GPIO pin.
+ *
+ * @param pin The GPIO pin number.
+ * @return The digital state of the pin: HIGH (1) or LOW (0).
+ */
+bool digitalRead(int pin);
+
+/**
+ * @brief Configures the mode of a GPIO pin.
+ *
+ * This function sets the mode of the specified GPIO pin, such as INPUT, OUTPUT, or INPUT_PULLUP.
+ *
+ * @param pin The GPIO pin number.
+ * @param mode The mode to set for the pin: INPUT, INPUT_PULLUP, INPUT_PULLDOWN, OUTPUT, OUTPUT_2MA, OUTPUT_4MA, OUTPUT_8MA, OUTPUT_12MA.
+ */
+void pinMode(int pin, int mode);
+#pragma endregion
+
+#pragma region I2C init and deinit functions
+
+/**
+ * @brief Initializes I2C tools with the specified parameters.
+ *
+ * This function initializes the bus context of the provided I2C instance with the SDA and SCL pins, and default clock frequency.
+ * There is one context per hardware controller, so calling this function twice with the same instance returns the same handle.
+ * If that bus is already running, it is returned untouched.
+ *
+ * @param i2c Pointer to the I2C instance (i2c0 or i2c1).
+ * @param sda The pin number for the I2C SDA (data) line.
+ * @param scl The pin number for the I2C SCL (clock) line.
+ * @return Pointer to the I2C bus handle, to be passed to every other i2c_tools function.
+ */
+i2c_tools_bus_t *i2c_tools_init(i2c_inst_t *i2c, int sda, int scl);
+
+/**
+ * @brief Initializes I2C communication.
+ *
+ * This function initializes I2C communication, configuring the I2C instance, pins, and related settings.
+ * If I2C is already running, it returns without doing anything further.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ */
+void i2c_tools_begin(i2c_tools_bus_t *bus);
+
+/**
+ * @brief Ends I2C communication.
+ *
+ * This function ends I2C communication, deinitializing the I2C instance and setting pins to INPUT mode.
+ * If I2C is not currently running, it returns without doing anything further.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ */
+void i2c_tools_end(i2c_tools_bus_t *bus);
+
+/**
+ * @brief Sets the I2C SDA (data) pin.
+ *
+ * This function sets the I2C SDA pin to the specified pin number if not currently running.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param pin The pin number to set as the I2C SDA pin.
+ * @return True if the pin is successfully set or is already set; False otherwise.
+ */
+bool i2c_tools_setSDA(i2c_tools_bus_t *bus, int sda);
+
+/**
+ * @brief Sets the I2C SCL (clock) pin.
+ *
+ * This function sets the I2C SCL pin to the specified pin number if not currently running.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param pin The pin number to set as the I2C SCL pin.
+ * @return True if the pin is successfully set or is already set; False otherwise.
+ */
+bool i2c_tools_setSCL(i2c_tools_bus_t *bus, int scl);
+
+/**
+ * @brief Gets the I2C SDA (data) pin of a bus.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @return The pin number of the I2C SDA pin.
+ */
+int i2c_tools_getSDA(i2c_tools_bus_t *bus);
+
+/**
+ * @brief Gets the I2C SCL (clock) pin of a bus.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @return The pin number of the I2C SCL pin.
+ */
+int i2c_tools_getSCL(i2c_tools_bus_t *bus);
+
+/**
+ * @brief Sets the clock frequency for I2C communication.
+ *
+ * This function sets the default clock frequency of the bus, used for every device that has no clock of its own
+ * (see i2c_tools_setDeviceClock). If I2C is currently running, it updates the baud rate accordingly.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param hz The desired clock frequency in Hertz.
+ */
+void i2c_tools_setClock(i2c_tools_bus_t *bus, uint32_t freqHz);
+
+/**
+ * @brief Sets the clock frequency used for the transactions with one device.
+ *
+ * Devices sharing a bus do not all support the same speed (e.g. an SMBus device limited to 100kHz next to
+ * Fast-mode devices), so each driver registers the clock of its device, usually from its begin function.
+ * Before each transfer, the controller is retimed to the clock of the addressed device, only if it differs from
+ * the clock of the previous transfer, so back-to-back transactions with the same device (or with devices sharing a clock)
+ * cost nothing extra. A transfer continuing a transaction without a Stop keeps the clock of that transaction.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param addr The 7-bit I2C address of the device.
+ * @param freqHz The clock frequency for this device in Hertz, or 0 to use the default clock of the bus again.
+ */
+void i2c_tools_setDeviceClock(i2c_tools_bus_t *bus, uint8_t addr, uint32_t freqHz);
+
+/**
+ * @brief Gets the clock frequency used for the transactions with one device.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param addr The 7-bit I2C address of the device.
+ * @return The clock frequency of the device in Hertz, or the default clock of the bus if the device has none.
+ */
+uint32_t i2c_tools_getDeviceClock(i2c_tools_bus_t *bus, uint8_t addr);
+
+#pragma endregion
+
+#pragma region Bus arbitration functions (dual-core transaction queue)
+
+/**
+ * @brief Takes the bus lock, queuing up behind the transactions already waiting for it.
+ *
+ * The bus is shared by both cores, and a transaction is made of several calls (beginTransmission, write, endTransmission...)
+ * that all work on the bus context, so only one core can be in the middle of a transaction at a time.
+ * The blocking functions of this library take the lock by themselves, for the duration of one whole transaction:
+ * from i2c_tools_beginTransmission to i2c_tools_endTransmission, for i2c_tools_requestFrom and i2c_tools_write_read,
+ * and a transfer without a Stop keeps the lock until the transfer that issues the Stop.
+ * Take the lock explicitly to group several transactions (e.g. a command, a delay and a read) or
+ * to read the data received by i2c_tools_requestFrom with i2c_tools_read.
+ *
+ * Waiting transactions are served in the order they asked for the bus (ticket lock), so neither core can starve the other.
+ * The lock is recursive: the owner can take it again (e.g. a driver function calling the blocking functions), and has to
+ * release it as many times as it has taken it. While waiting, the idle callback is serviced (on the core that registered it).
+ * Not to be used from interrupt handlers.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ */
+void i2c_tools_lock(i2c_tools_bus_t *bus);
+
+/**
+ * @brief Releases the bus lock taken by i2c_tools_lock.
+ *
+ * Once the owner has released it as many times as it has taken it, the bus is handed over to the next transaction in the queue.
+ * Does nothing if the calling core does not own the bus.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ */
+void i2c_tools_unlock(i2c_tools_bus_t *bus);
+
+/**
+ * @brief Gets the contention statistics of the transaction queue.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param stats Pointer to the structure receiving a snapshot of the statistics.
+ */
+void i2c_tools_getLockStats(i2c_tools_bus_t *bus, i2c_tools_lock_stats_t *stats);
+
+/**
+ * @brief Resets the contention statistics of the transaction queue.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ */
+void i2c_tools_resetLockStats(i2c_tools_bus_t *bus);
+
+#pragma endregion
+
+#pragma region Asynchronous (DMA) transfer functions
+
+/**
+ * @brief Submits a non-blocking write transfer to the specified address.
+ *
+ * The data is copied into the internal DMA command buffer, so the caller's buffer can be reused as soon as this function returns.
+ * The bytes are then fed into the I2C TX FIFO by a DMA channel paced by the I2C TX DREQ, without any involvement from the CPU.
+ * Only one transfer can be in flight on the bus at a time.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param xfer Pointer to the caller-owned transfer handle.
+ * @param addr The 7-bit I2C address of the target device.
+ * @param data Pointer to the bytes to be written.
+ * @param len The number of bytes to write (1 to WIRE_BUFFER_SIZE).
+ * @param stopBit If false, master retains control of the bus at the end of the transfer (no Stop is issued),
+ *           and the next transfer will begin with a Restart rather than a Start.
+ * @param callback Optional completion callback (can be NULL).
+ * @param arg User argument passed to the completion callback.
+ * @return True if the transfer has been started; False if it was rejected (see xfer->result).
+ */
+bool i2c_tools_writeAsync(i2c_tools_bus_t *bus, i2c_tools_xfer_t *xfer, uint8_t addr, const uint8_t *data, size_t len, bool stopBit, i2c_tools_xfer_cb_t callback, void *arg);
+
+/**
+ * @brief Submits a non-blocking read transfer from the specified address.
+ *
+ * The read commands are fed into the I2C TX FIFO by one DMA channel, while a second DMA channel paced by the I2C RX DREQ
+ * drains the received bytes straight into the caller's buffer.
+ * Only one transfer can be in flight on the bus at a time.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param xfer Pointer to the caller-owned transfer handle.
+ * @param addr The 7-bit I2C address of the target device.
+ * @param data Pointer to the destination buffer, it must stay valid until the transfer has completed.
+ * @param len The number of bytes to read (1 to WIRE_BUFFER_SIZE).
+ * @param stopBit Indicates whether to send a stop bit at the end of the transfer.
+ * @param callback Optional completion callback (can be NULL).
+ * @param arg User argument passed to the completion callback.
+ * @return True if the transfer has been started; False if it was rejected (see xfer->result).
+ */
+bool i2c_tools_readAsync(i2c_tools_bus_t *bus, i2c_tools_xfer_t *xfer, uint8_t addr, uint8_t *data, size_t len, bool stopBit, i2c_tools_xfer_cb_t callback, void *arg);
+
+/**
+ * @brief Submits a non-blocking combined write-then-read transfer to the specified address.
+ *
+ * The bytes of the write phase are sent first, then the read phase begins with a Restart (no Stop in between),
+ * so a register access (write the register address, read its contents) is a single bus transaction.
+ * The received bytes are drained by DMA straight into the caller's buffer, with no intermediate copy.
+ * Either phase can be empty, in which case this is a plain write or a plain read.
+ * Only one transfer can be in flight on the bus at a time.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param xfer Pointer to the caller-owned transfer handle.
+ * @param addr The 7-bit I2C address of the target device.
+ * @param tx Pointer to the bytes to write, copied before this function returns (can be NULL if txLen is 0).
+ * @param txLen The number of bytes to write.
+ * @param rx Pointer to the destination buffer, it must stay valid until the transfer has completed (can be NULL if rxLen is 0).
+ * @param rxLen The number of bytes to read.
+ * @param stopBit If false, master retains control of the bus at the end of the transfer (no Stop is issued),
+ *           and the next transfer will begin with a Restart rather than a Start.
+ * @param callback Optional completion callback (can be NULL).
+ * @param arg User argument passed to the completion callback.
+ * @return True if the transfer has been started; False if it was rejected (see xfer->result).
+ */
+bool i2c_tools_writeReadAsync(i2c_tools_bus_t *bus, i2c_tools_xfer_t *xfer, uint8_t addr, const uint8_t *tx, size_t txLen, uint8_t *rx, size_t rxLen, bool stopBit, i2c_tools_xfer_cb_t callback, void *arg);
+
+/**
+ * @brief Drives the in-flight asynchronous transfer (if any).
+ *
+ * Checks the DMA channels and the I2C abort/stop status, completes the transfer and invokes its callback once it is done.
+ * This should be called regularly from the main loop (e.g. next to cyw43_arch_poll) when using completion callbacks.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @return True if a transfer is still in flight; False if the bus is idle.
+ */
+bool i2c_tools_poll(i2c_tools_bus_t *bus);
+
+/**
+ * @brief Checks whether an asynchronous transfer has completed.
+ *
+ * This function drives the in-flight transfer (see i2c_tools_poll) and then checks the state of the given handle.
+ *
+ * @param xfer Pointer to the transfer handle.
+ * @return True if the transfer is no longer in flight (done, failed or never submitted); False otherwise.
+ */
+bool i2c_tools_transferDone(i2c_tools_xfer_t *xfer);
+
+/**
+ * @brief Blocks until an asynchronous transfer has completed.
+ *
+ * While waiting, the idle callback registered with i2c_tools_setIdleCallback is called repeatedly.
+ *
+ * @param xfer Pointer to the transfer handle.
+ * @return Error code:
+ *         - 0: Success
+ *         - 1: Data too long
+ *         - 2: NACK on transmit of address
+ *         - 3: NACK on transmit of data
+ *         - 4: Other error
+ */
+uint8_t i2c_tools_waitTransfer(i2c_tools_xfer_t *xfer);
+
+/**
+ * @brief Registers a function to be called while the blocking functions are waiting for the bus.
+ *
+ * The blocking functions (i2c_tools_requestFrom, i2c_tools_endTransmission...) are built on top of the asynchronous transfers,
+ * and call this function while the DMA is moving the data, e.g. i2c_tools_setIdleCallback(cyw43_arch_poll) keeps
+ * the network stack serviced during long sensor reads. The callback is never re-entered,
+ * and is only called on the core it was registered from (the other core busy-waits).
+ *
+ * @param idleCallback The function to call while waiting, or NULL to busy-wait.
+ */
+void i2c_tools_setIdleCallback(void (*idleCallback)(void));
+
+#pragma endregion
+
+#pragma region Bus recovery and retry functions
+
+/**
+ * @brief Clears a stuck bus and brings the controller back to a known state.
+ *
+ * A target that was interrupted in the middle of a byte (glitch, brown-out, aborted transfer...) can keep holding SDA low,
+ * waiting for the clock pulses of the bits it still has to send, and the controller cannot issue a Start until it lets go.
+ * This function aborts the transfer in flight (if any), takes the pins away from the controller, clocks out up to 9 SCL pulses
+ * until the target releases SDA, issues a Stop, and then re-initializes the controller with the same clock frequency.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @return Error code:
+ *         - 0: Success, both lines are released
+ *         - 4: I2C is not running, or a line is still held low after the recovery
+ */
+uint8_t i2c_tools_recoverBus(i2c_tools_bus_t *bus);
+
+/**
+ * @brief Sets the retry policy of the blocking transactions.
+ *
+ * A failed blocking transaction (i2c_tools_endTransmission, i2c_tools_requestFrom, i2c_tools_write_read) is retried
+ * up to the given number of times, as long as the deadline has not passed. If the bus looks stuck after a failure,
+ * it is recovered (see i2c_tools_recoverBus) before the next attempt.
+ * A transaction that continues a previous one without a Stop is never retried, as the first half cannot be replayed.
+ * Defaults to I2C_TOOLS_DEFAULT_RETRIES retries within I2C_TOOLS_DEFAULT_DEADLINE_MS.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param retries The number of retries after the first attempt (0 to disable retrying).
+ * @param deadlineMs The deadline of the whole transaction in milliseconds, retries and recovery included.
+ */
+void i2c_tools_setRetryPolicy(i2c_tools_bus_t *bus, uint8_t retries, uint32_t deadlineMs);
+
+/**
+ * @brief Gets the number of failed transactions with the device at the specified address.
+ *
+ * Every failed attempt is counted, including the ones that succeeded after a retry.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param addr The 7-bit I2C address of the device.
+ * @return The number of failed transactions (saturates at 0xFFFF).
+ */
+uint16_t i2c_tools_getErrorCount(i2c_tools_bus_t *bus, uint8_t addr);
+
+/**
+ * @brief Gets the number of times the bus has been recovered.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @return The number of calls to i2c_tools_recoverBus, including the ones made by the retry policy.
+ */
+uint32_t i2c_tools_getRecoveryCount(i2c_tools_bus_t *bus);
+
+/**
+ * @brief Resets the per-address error counters of the bus.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ */
+void i2c_tools_clearErrorCounts(i2c_tools_bus_t *bus);
+
+#pragma endregion
+
+#pragma region I2C transmission functions
+
+/**
+ * @brief Starts a new transmission session to the specified address.
+ *
+ * This function prepares the library to start a transmission session to the specified address.
+ * If I2C is not currently running or transmission session is already in progress, it returns without doing anything further.
+ * The calling core owns the bus (see i2c_tools_lock) until the matching i2c_tools_endTransmission.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param addr The I2C address of the target device.
+ */
+void i2c_tools_beginTransmission(i2c_tools_bus_t *bus, uint8_t addr);
+
+/**
+ * @brief Sends the data in the internal buffer to the target device.
+ *
+ * This function sends the data in the internal buffer to the target device.
+ * And then sets the internal session flag to indicate that the transmission has ended.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param stopBit If false, master retains control of the bus at the end of the transfer (no Stop is issued),
+ *           and the next transfer will begin with a Restart rather than a Start.
+ * @return Error code:
+ *         - 0: Success
+ *         - 1: Data too long
+ *         - 2: NACK on transmit of address
+ *         - 3: NACK on transmit of data
+ *         - 4: Other error
+ */
+uint8_t i2c_tools_endTransmission_w_stopbit(i2c_tools_bus_t *bus, bool stopBit);
+
+/**
+ * @brief Sends the data in the internal buffer to the target device.
+ *
+ * This function sends the data in the internal buffer to the target device.
+ * And then sets the internal session flag to indicate that the transmission has ended.
+ * This function is a wrapper for i2c_tools_endTransmission_w_stopbit with the stopBit parameter set to true.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @return Error code:
+ *         - 0: Success
+ *         - 1: Data too long
+ *         - 2: NACK on transmit of address
+ *         - 3: NACK on transmit of data
+ *         - 4: Other error
+ */
+uint8_t i2c_tools_endTransmission(i2c_tools_bus_t *bus);
+
+/**
+ * @brief Requests data from an I2C device with an optional stop bit.
+ *
+ * This function requests data from an I2C device with the specified address.
+ * It reads the specified quantity of bytes into the internal buffer, blocking until the specified absolute time is reached.
+ * A failed read is retried as per the retry policy of the bus (see i2c_tools_setRetryPolicy).
+ * When both cores use the bus, take the lock (see i2c_tools_lock) around this call and the following i2c_tools_read calls,
+ * so the other core cannot replace the received data in between.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param address The I2C address of the target device.
+ * @param quantity The number of bytes to request and read.
+ * @param stopBit Indicates whether to send a stop bit after the request.
+ * @return The number of bytes read, or 0 if there was an error or invalid parameters.
+ */
+size_t i2c_tools_requestFrom_w_stopbit(i2c_tools_bus_t *bus, uint8_t address, size_t quantity, bool stopBit);
+
+/**
+ * @brief Requests data from an I2C device with a stop bit.
+ *
+ * This function is a wrapper for i2c_tools_requestFrom_w_stopbit with the stopBit parameter set to true.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param address The I2C address of the target device.
+ * @param quantity The number of bytes to request and read.
+ * @return The number of bytes read, or 0 if there was an error or invalid parameters.
+ */
+size_t i2c_tools_requestFrom(i2c_tools_bus_t *bus, uint8_t address, size_t quantity);
+
+/**
+ * @brief Writes to then reads from an I2C device in a single transaction.
+ *
+ * This function sends the bytes in tx, issues a Restart and reads rxLen bytes straight into rx, followed by a Stop.
+ * This is the usual register read (tx holds the register address), done as one bus transaction, without going through
+ * the internal buffer and without any delay between the write and the read.
+ * It blocks until the transfer completes or times out, the idle callback is serviced while waiting.
+ * A failed transaction is retried as per the retry policy of the bus (see i2c_tools_setRetryPolicy).
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param addr The 7-bit I2C address of the target device.
+ * @param tx Pointer to the bytes to write (can be NULL if txLen is 0).
+ * @param txLen The number of bytes to write.
+ * @param rx Pointer to the destination buffer (can be NULL if rxLen is 0).
+ * @param rxLen The number of bytes to read.
+ * @return Error code:
+ *         - 0: Success
+ *         - 1: Data too long
+ *         - 2: NACK on transmit of address
+ *         - 3: NACK on transmit of data
+ *         - 4: Other error
+ */
+uint8_t i2c_tools_write_read(i2c_tools_bus_t *bus, uint8_t addr, const uint8_t *tx, size_t txLen, uint8_t *rx, size_t rxLen);
+
+/**
+ * @brief Writes a byte to the I2C device.
+ *
+ * This function writes a byte to the I2C device.
+ * It adds the byte to the internal buffer if transmission has begun and the buffer is not full.
+ * In slave mode, nothing is written: the master is answered from the register map (see i2c_tools_setRegisters).
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param ucData The byte to be written to the I2C device.
+ * @return Number of bytes written (1 if successful, 0 otherwise).
+ */
+size_t i2c_tools_write(i2c_tools_bus_t *bus, uint8_t data);
+
+/**
+ * @brief Writes multiple bytes to the I2C device.
+ *
+ * This function writes an array of bytes to the I2C device using i2c_tools_write for each byte.
+ * It returns the number of bytes successfully written before encountering an error or reaching the end of the array.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param data Pointer to the array of bytes to be written.
+ * @param quantity The number of bytes to write.
+ * @return Number of bytes successfully written.
+ */
+size_t i2c_tools_write_w_quantity(i2c_tools_bus_t *bus, const uint8_t *data, size_t quantity);
+
+/**
+ * @brief Gets the number of bytes available for reading from the I2C device.
+ *
+ * This function returns the number of bytes available for reading from the I2C device.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @return The number of bytes available for reading.
+ */
+int i2c_tools_available(i2c_tools_bus_t *bus);
+
+/**
+ * @brief Reads a byte from the I2C device.
+ *
+ * This function reads a byte from the internal buffer of the I2C device.
+ * It returns the read byte or -1 if no bytes are available (EOF).
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @return The read byte or -1 if no bytes are available (EOF).
+ */
+int i2c_tools_read(i2c_tools_bus_t *bus);
+
+/**
+ * @brief Peeks at the next byte in the I2C device without consuming it.
+ *
+ * This function returns the next byte in the internal buffer of the I2C device without consuming it.
+ * It returns the peeked byte or -1 if no bytes are available (EOF).
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @return The peeked byte or -1 if no bytes are available (EOF).
+ */
+int i2c_tools_peek(i2c_tools_bus_t *bus);
+
+/**
+ * @brief Flushes the internal buffer of the I2C device.
+ *
+ * This function does nothing, and it is recommended to use endTransmission to force data transfer.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ */
+void i2c_tools_flush(i2c_tools_bus_t *bus);
+
+#pragma endregion
+#pragma region Bus scan functions
+
+/**
+ * @brief Scans the bus for devices.
+ *
+ * Every non-reserved 7-bit address (0x08 to 0x77) is probed through the hardware controller with a short deadline,
+ * and the answers are stored in the presence cache, so the following i2c_tools_isPresent calls are table lookups.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @return The number of devices that acknowledged their address, or -1 if I2C is not running.
+ */
+int i2c_tools_scan(i2c_tools_bus_t *bus);
+
+/**
+ * @brief Checks whether a device is present at the specified address.
+ *
+ * This is a lookup in the presence cache, filled in by i2c_tools_scan, by the zero-length probes of i2c_tools_endTransmission
+ * and by every completed transfer (an acknowledged address marks the device present, an address NACK marks it missing).
+ * If nothing is known about the address yet, it is probed once through the hardware controller.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param addr The 7-bit I2C address of the device.
+ * @return True if the device answered the last time it was addressed; False otherwise (or if I2C is not running).
+ */
+bool i2c_tools_isPresent(i2c_tools_bus_t *bus, uint8_t addr);
+
+/**
+ * @brief Clears the presence cache of the bus.
+ *
+ * Call this after devices have been plugged in or removed, the next i2c_tools_isPresent calls will probe the bus again.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ */
+void i2c_tools_clearScanCache(i2c_tools_bus_t *bus);
+
+#pragma endregion
+
+#pragma region Transaction trace functions
+
+/**
+ * @brief Copies the most recent blocking transactions from the trace ring of the bus.
+ *
+ * Every blocking transaction (i2c_tools_endTransmission, i2c_tools_requestFrom and i2c_tools_write_read) is recorded
+ * once it completes, with its timing and result, into a ring of the last I2C_TOOLS_TRACE_SIZE transactions.
+ * Records are written by the core that owns the bus, and this function does not take the bus lock, so it can be called
+ * at any time (e.g. from the other core); a record overwritten while being copied is left out.
+ * Asynchronous transfers submitted by the caller and the probes of i2c_tools_scan are not recorded.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param records Pointer to the array receiving the records, oldest first.
+ * @param maxRecords The number of records the array can hold.
+ * @return The number of records copied.
+ */
+size_t i2c_tools_getTrace(i2c_tools_bus_t *bus, i2c_tools_trace_record_t *records, size_t maxRecords);
+
+/**
+ * @brief Gets the latency histograms of the devices addressed since the trace was last cleared.
+ *
+ * The first I2C_TOOLS_TRACE_DEVICES devices addressed get a histogram each, the transactions with any other device
+ * are only recorded in the trace ring. The histograms are updated without locking, a snapshot taken while a transaction
+ * completes may be off by that transaction.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param hists Pointer to the array receiving the histograms, in the order the devices were first addressed.
+ * @param maxHists The number of histograms the array can hold.
+ * @return The number of histograms copied.
+ */
+int i2c_tools_getLatencyHistograms(i2c_tools_bus_t *bus, i2c_tools_latency_hist_t *hists, int maxHists);
+
+/**
+ * @brief Clears the trace ring and the latency histograms of the bus, and starts a new trace window.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ */
+void i2c_tools_clearTrace(i2c_tools_bus_t *bus);
+
+/**
+ * @brief Prints the trace ring and the latency histograms of the bus over stdio.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ */
+void i2c_tools_dumpTrace(i2c_tools_bus_t *bus);
+
+/**
+ * @brief Formats a summary of the trace window as a JSON object, e.g. to be published on a diagnostics topic.
+ *
+ * The object holds the length of the trace window and the time spent on the bus in microseconds, and for every device
+ * its transaction and error counts, bus time, longest transaction and latency histogram:
+ * {"windowUs":3000000,"busUs":2250,"dev":[{"addr":40,"n":3,"err":0,"busUs":2250,"maxUs":750,"hist":[0,...]}]}
+ * Devices that do not fit in the buffer are left out, the object is always complete.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param buf Pointer to the buffer receiving the null-terminated JSON object.
+ * @param len The size of the buffer.
+ * @return The length of the JSON object, or 0 if the buffer is too small for an empty summary.
+ */
+size_t i2c_tools_formatDiagnostics(i2c_tools_bus_t *bus, char *buf, size_t len);
+
+#pragma endregion
+
+#pragma region Slave mode (register map) functions
+
+/**
+ * @brief Initializes I2C communication in slave mode, with the specified address.
+ *
+ * Port of Wire.begin(address). The bus answers a master at the specified address from its register map,
+ * the way most I2C sensors do, so another Pico can poll it with the usual master functions (e.g. i2c_tools_write_read):
+ * 1. The first byte of a master write sets the register pointer, the following bytes are stored into the writable registers.
+ * 2. A master read returns the registers from the register pointer on (0xFF past the end of the map).
+ * 3. The register pointer is auto-incremented, and kept from one transaction to the next.
+ *
+ * The transfers are handled in the I2C interrupt handler, enabled on the calling core.
+ * The register map can be set up and filled in before (see i2c_tools_setRegisterMap and i2c_tools_setRegisters).
+ * If I2C is already running, it returns without doing anything further. Call i2c_tools_end to go back to master mode.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param addr The 7-bit I2C address the bus answers to.
+ */
+void i2c_tools_begin_w_address(i2c_tools_bus_t *bus, uint8_t addr);
+
+/**
+ * @brief Sets the size of the register map and the registers the master is allowed to write.
+ *
+ * Writes of the master outside of the writable window are acknowledged but dropped, so the samples exposed
+ * by the application cannot be overwritten.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param size The number of registers (1 to I2C_TOOLS_SLAVE_REGS).
+ * @param writableFirst The first register the master may write.
+ * @param writableCount The number of registers the master may write from writableFirst (0 for a read-only map).
+ * @return True if the register map has been set; False if the parameters do not fit.
+ */
+bool i2c_tools_setRegisterMap(i2c_tools_bus_t *bus, uint16_t size, uint8_t writableFirst, uint16_t writableCount);
+
+/**
+ * @brief Updates registers of the register map, e.g. with a new sensor sample.
+ *
+ * A master read always returns a consistent snapshot: if the master is reading while the registers are updated,
+ * the new values are held back and only exposed at the end of that read, so a multi-byte sample is never torn.
+ * Update a whole sample with a single call for the same reason.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param reg The first register to update.
+ * @param data Pointer to the new values.
+ * @param len The number of registers to update.
+ * @return True if the registers have been updated; False if they do not fit in the register map.
+ */
+bool i2c_tools_setRegisters(i2c_tools_bus_t *bus, uint8_t reg, const void *data, size_t len);
+
+/**
+ * @brief Reads registers of the register map, e.g. the ones written by the master.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param reg The first register to read.
+ * @param data Pointer to the buffer receiving the values.
+ * @param len The number of registers to read.
+ * @return True if the registers have been read; False if they do not fit in the register map.
+ */
+bool i2c_tools_getRegisters(i2c_tools_bus_t *bus, uint8_t reg, void *data, size_t len);
+
+/**
+ * @brief Sets the function called when the master has written to the register map (see i2c_tools_reg_write_cb_t).
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param callback The write callback (can be NULL).
+ * @param arg User argument passed to the write callback.
+ */
+void i2c_tools_onRegisterWrite(i2c_tools_bus_t *bus, i2c_tools_reg_write_cb_t callback, void *arg);
+
+/**
+ * @brief Gets the number of master transactions served by the bus in slave mode.
+ *
+ * Reads and writes are counted separately (a write of the register pointer followed by a read with a Restart counts as two),
+ * a bare address probe is not counted.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @return The number of transactions since i2c_tools_begin_w_address.
+ */
+uint32_t i2c_tools_getSlaveTransactions(i2c_tools_bus_t *bus);
+
+#pragma endregion
+
+#pragma region Miscellaneous functions
+
+/**
+ * @brief Converts a 32-bit hexadecimal number to ASCII representation and prints it.
+ *
+ * This function takes a 32-bit hexadecimal number, converts it to its ASCII representation,
+ * and prints the result using printf.
+ *
+ * @param n The 32-bit hexadecimal number to be converted and printed.
+ */
+void hexToAscii(uint32_t n);
+
+#pragma endregion
+
+#pragma region Inline functions
+
+/**
+ * @brief Writes an unsigned long value to the I2C device.
+ *
+ * This inline function takes an unsigned long value, converts it to an 8-bit value,
+ * and writes it to the I2C device using i2c_tools_write.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param n The unsigned long value to be written to the I2C device.
+ * @return The number of bytes written.
+ */
+inline size_t i2c_tools_write_ulong(i2c_tools_bus_t *bus, unsigned long n)
+{
+    // Convert the unsigned long value to an 8-bit value and write it to the I2C device.
+    return i2c_tools_write(bus, (uint8_t)n);
+}
+
+/**
+ * @brief Writes a long value to the I2C device.
+ *
+ * This inline function takes a long value, converts it to an 8-bit value,
+ * and writes it to the I2C device using i2c_tools_write.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param n The long value to be written to the I2C device.
+ * @return The number of bytes written.
+ */
+inline size_t i2c_tools_write_long(i2c_tools_bus_t *bus, long n)
+{
+    // Convert the long value to an 8-bit value and write it to the I2C device.
+    return i2c_tools_write(bus, (uint8_t)n);
+}
+
+/**
+ * @brief Writes an unsigned int value to the I2C device.
+ *
+ * This inline function takes an unsigned int value, converts it to an 8-bit value,
+ * and writes it to the I2C device using i2c_tools_write.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param n The unsigned int value to be written to the I2C device.
+ * @return The number of bytes written.
+ */
+inline size_t i2c_tools_write_uint(i2c_tools_bus_t *bus, unsigned int n)
+{
+    // Convert the unsigned int value to an 8-bit value and write it to the I2C device.
+    return i2c_tools_write(bus, (uint8_t)n);
+}
+
+/**
+ * @brief Writes an int value to the I2C device.
+ *
+ * This inline function takes an int value, converts it to an 8-bit value,
+ * and writes it to the I2C device using i2c_tools_write.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param n The int value to be written to the I2C device.
+ * @return The number of bytes written.
+ */
+inline size_t i2c_tools_write_int(i2c_tools_bus_t *bus, int n)
+{
+    // Convert the int value to an 8-bit value and write it to the I2C device.
+    return i2c_tools_write(bus, (uint8_t)n);
+}
+
+#pragma endregion
+
+#endif // _I2C_TOOLS_H_
\ No newline at end of file
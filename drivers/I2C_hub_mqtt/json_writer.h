@@ -0,0 +1,240 @@
+/** @file json_writer.h
+ *
+ * @brief This file contains the header file for the JSON writer library.
+ *
+ * Brief overview of the code:
+ * Builds the JSON messages of the apps in one pass, at a cursor in a caller buffer (e.g. a message reserved in the
+ * outbound MQTT queue, see mqtt_outbox_reserve), instead of formatting every field with snprintf and joining them with strcat.
+ * The commas between the fields and the values are added by the writer, and the text is always null terminated.
+ *
+ * The numbers are converted to digits with integer arithmetic: a float is first scaled to a fixed-point number
+ * with a given number of decimals (see json_putFloat), without the float formatting of printf.
+ *
+ * The writer never writes past the end of its buffer: once a value does not fit, the writer is marked as overflowed
+ * and ignores the following values, so the result only has to be checked once, at the end (see json_isOk).
+ */
+
+#pragma once
+#ifndef _JSON_WRITER_H_
+#define _JSON_WRITER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Deepest nesting of objects and arrays.
+#define JSON_WRITER_MAX_DEPTH 16
+
+// Most decimals of a fixed-point or float value.
+#define JSON_WRITER_MAX_DECIMALS 9
+
+/**
+ * @brief A JSON text being written into a buffer.
+ */
+typedef struct
+{
+    char *buffer;     // Buffer the text is written to
+    size_t size;      // Size of the buffer (null terminator included)
+    size_t len;       // Length of the text so far
+    uint32_t filled;  // Bit per nesting level, set once the object or array of that level holds a value (a comma goes before the next)
+    uint8_t depth;    // Nesting level of the cursor (0: top level)
+    bool afterKey;    // A key has just been written, the value that follows takes no comma
+    bool overflow;    // A value did not fit in the buffer (it and the following ones were not written)
+} json_writer_t;
+
+/**
+ * @brief Starts a JSON text.
+ *
+ * @param writer The writer.
+ * @param buffer The buffer the text is written to.
+ * @param size The size of the buffer, null terminator included.
+ */
+void json_begin(json_writer_t *writer, char *buffer, size_t size);
+
+/**
+ * @brief Opens an object ({), as a value.
+ *
+ * @param writer The writer.
+ */
+void json_openObject(json_writer_t *writer);
+
+/**
+ * @brief Closes the object opened last (}).
+ *
+ * @param writer The writer.
+ */
+void json_closeObject(json_writer_t *writer);
+
+/**
+ * @brief Opens an array ([), as a value.
+ *
+ * @param writer The writer.
+ */
+void json_openArray(json_writer_t *writer);
+
+/**
+ * @brief Closes the array opened last (]).
+ *
+ * @param writer The writer.
+ */
+void json_closeArray(json_writer_t *writer);
+
+/**
+ * @brief Writes the key of the next field of an object ("key":), the value is written next.
+ *
+ * @param writer The writer.
+ * @param key The key (written as is, it must not need escaping).
+ */
+void json_key(json_writer_t *writer, const char *key);
+
+/**
+ * @brief Writes a signed integer.
+ *
+ * @param writer The writer.
+ * @param value The value.
+ */
+void json_putInt(json_writer_t *writer, int64_t value);
+
+/**
+ * @brief Writes an unsigned integer.
+ *
+ * @param writer The writer.
+ * @param value The value.
+ */
+void json_putUint(json_writer_t *writer, uint64_t value);
+
+/**
+ * @brief Writes a fixed-point number: value / 10^decimals, with all its decimals (e.g. 1234 with 2 decimals: 12.34).
+ *
+ * @param writer The writer.
+ * @param value The value, in units of 10^-decimals.
+ * @param decimals The number of decimals, up to JSON_WRITER_MAX_DECIMALS.
+ */
+void json_putFixed(json_writer_t *writer, int64_t value, uint8_t decimals);
+
+/**
+ * @brief Writes a float, rounded to the given number of decimals, as a fixed-point number.
+ *
+ * The text is the same as printf "%.<decimals>f" gives, without its float formatting code.
+ * NaN, infinities and values too large for a fixed-point number (beyond +/-9.2e18 units) are written as null.
+ *
+ * @param writer The writer.
+ * @param value The value.
+ * @param decimals The number of decimals, up to JSON_WRITER_MAX_DECIMALS.
+ */
+void json_putFloat(json_writer_t *writer, float value, uint8_t decimals);
+
+/**
+ * @brief Writes a string, escaped (quotes, backslashes and control characters).
+ *
+ * @param writer The writer.
+ * @param text The null-terminated string.
+ */
+void json_putString(json_writer_t *writer, const char *text);
+
+/**
+ * @brief Writes a boolean.
+ *
+ * @param writer The writer.
+ * @param value The value.
+ */
+void json_putBool(json_writer_t *writer, bool value);
+
+/**
+ * @brief Writes a null.
+ *
+ * @param writer The writer.
+ */
+void json_putNull(json_writer_t *writer);
+
+/**
+ * @brief Writes a value that is already JSON text (e.g. a sample kept in flash), as is.
+ *
+ * @param writer The writer.
+ * @param json The JSON text.
+ * @param len The length of the text.
+ */
+void json_putRaw(json_writer_t *writer, const char *json, size_t len);
+
+/**
+ * @brief Gives the rest of the buffer to a function that writes JSON text on its own (e.g. i2c_tools_formatDiagnostics),
+ * as the next value. Must be followed by json_endRaw, with nothing written in between.
+ *
+ * @param writer The writer.
+ * @param room Set to the room left in the buffer, null terminator included (0 if the writer has overflowed).
+ * @return Where the text goes.
+ */
+char *json_beginRaw(json_writer_t *writer, size_t *room);
+
+/**
+ * @brief Ends a value written with json_beginRaw.
+ *
+ * @param writer The writer.
+ * @param len The length of the text written (0 if it did not fit, the writer is then marked as overflowed).
+ */
+void json_endRaw(json_writer_t *writer, size_t len);
+
+/**
+ * @brief Writes a field of an object, with a signed integer value.
+ *
+ * @param writer The writer.
+ * @param key The key.
+ * @param value The value.
+ */
+void json_fieldInt(json_writer_t *writer, const char *key, int64_t value);
+
+/**
+ * @brief Writes a field of an object, with an unsigned integer value.
+ *
+ * @param writer The writer.
+ * @param key The key.
+ * @param value The value.
+ */
+void json_fieldUint(json_writer_t *writer, const char *key, uint64_t value);
+
+/**
+ * @brief Writes a field of an object, with a fixed-point value (see json_putFixed).
+ *
+ * @param writer The writer.
+ * @param key The key.
+ * @param value The value, in units of 10^-decimals.
+ * @param decimals The number of decimals.
+ */
+void json_fieldFixed(json_writer_t *writer, const char *key, int64_t value, uint8_t decimals);
+
+/**
+ * @brief Writes a field of an object, with a float value rounded to the given number of decimals (see json_putFloat).
+ *
+ * @param writer The writer.
+ * @param key The key.
+ * @param value The value.
+ * @param decimals The number of decimals.
+ */
+void json_fieldFloat(json_writer_t *writer, const char *key, float value, uint8_t decimals);
+
+/**
+ * @brief Writes a field of an object, with a string value.
+ *
+ * @param writer The writer.
+ * @param key The key.
+ * @param text The null-terminated string.
+ */
+void json_fieldString(json_writer_t *writer, const char *key, const char *text);
+
+/**
+ * @brief Gets the length of the text so far.
+ *
+ * @param writer The writer.
+ * @return The length of the text, in bytes (null terminator excluded).
+ */
+size_t json_getLength(const json_writer_t *writer);
+
+/**
+ * @brief Checks that every value written so far fitted in the buffer.
+ *
+ * @param writer The writer.
+ * @return True if the text is complete; False if the buffer was too small (the text must not be sent).
+ */
+bool json_isOk(const json_writer_t *writer);
+
+#endif // _JSON_WRITER_H_
@@ -0,0 +1,16 @@
+#ifndef _LWIPOPTS_H
+#define _LWIPOPTS_H
+
+// Generally you would define your own explicit list of lwIP options
+// (see https://www.nongnu.org/lwip/2_1_x/group__lwip__opts.html)
+//
+// This example uses a common include to avoid repetition
+#include "lwipopts_examples_common.h"
+
+#define MEMP_NUM_SYS_TIMEOUT (LWIP_NUM_SYS_TIMEOUT_INTERNAL + 3)
+// Room for a whole batch of samples in the MQTT output buffer (see mqtt_batch_begin), the default (256 bytes) only fits a few
+#define MQTT_OUTPUT_RINGBUF_SIZE 2048
+// #define LWIP_DEBUG_TIMERNAMES 1
+// #define TIMERS_DEBUG LWIP_DBG_ON
+
+#endif
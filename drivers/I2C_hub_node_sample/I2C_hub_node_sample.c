@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <pico/stdlib.h>
+#include "FS3000_Rebuilt.h"
+#include "i2c_hub_regs.h"
+
+#define HUB_SDA_PIN 6             // i2c1 SDA, wired to the hub
+#define HUB_SCL_PIN 7             // i2c1 SCL, wired to the hub
+#define SAMPLE_PERIOD_MS 1000     // Default sample period, the hub can change it through the PERIOD register
+
+static volatile uint32_t samplePeriodMs = SAMPLE_PERIOD_MS;
+
+// Called from the I2C interrupt handler when the hub has written to the register map (only PERIOD is writable)
+static void onHubWrite(i2c_tools_bus_t *hubBus, uint8_t reg, size_t len, void *arg)
+{
+    uint8_t period;
+    i2c_tools_getRegisters(hubBus, I2C_HUB_REG_PERIOD, &period, 1);
+    samplePeriodMs = period ? period * 100 : SAMPLE_PERIOD_MS;
+}
+
+int main()
+{
+    stdio_init_all();
+
+    // The sensor is on i2c0, as in FS3000_airflow_sample
+    i2c_tools_bus_t *bus = i2c_tools_init(i2c0, PICO_DEFAULT_I2C_SDA_PIN, PICO_DEFAULT_I2C_SCL_PIN);
+    i2c_tools_begin(bus);
+
+    if (!FS3000_begin(bus))
+    {
+        printf("FS3000 Not Detected. Please check wiring! Retrying in 3 seconds...\n");
+        sleep_ms(1000);
+    }
+    FS3000_setRange(AIRFLOW_RANGE_15_MPS);
+
+    // i2c1 answers the hub like a register based sensor (see i2c_hub_regs.h)
+    i2c_tools_bus_t *hubBus = i2c_tools_init(i2c1, HUB_SDA_PIN, HUB_SCL_PIN);
+    uint8_t id[2] = {I2C_HUB_WHO_AM_I, I2C_HUB_VERSION};
+    i2c_tools_setRegisterMap(hubBus, I2C_HUB_MAP_SIZE, I2C_HUB_REG_PERIOD, 1);
+    i2c_tools_setRegisters(hubBus, I2C_HUB_REG_WHO_AM_I, id, sizeof(id));
+    i2c_tools_onRegisterWrite(hubBus, onHubWrite, NULL);
+    i2c_tools_begin_w_address(hubBus, I2C_HUB_NODE_ADDR);
+
+    printf("FS3000 Sensor Connected. Serving samples at 0x%02X...\n", I2C_HUB_NODE_ADDR);
+
+    uint8_t seq = 0;
+    while (1)
+    {
+        uint16_t raw = FS3000_readRaw();
+        float metersPerSec = FS3000_readMetersPerSecond();
+        bool valid = (raw != FS3000_READ_ERROR) && (metersPerSec >= 0);
+        uint16_t cmPerSec = valid ? (uint16_t)(metersPerSec * 100 + 0.5f) : 0;
+
+        // SEQ, STATUS, RAW and SPEED, little endian
+        uint8_t sample[I2C_HUB_SAMPLE_LEN] = {
+            ++seq,
+            valid ? I2C_HUB_STATUS_VALID : 0,
+            (uint8_t)(raw & 0xFF), (uint8_t)(raw >> 8),
+            (uint8_t)(cmPerSec & 0xFF), (uint8_t)(cmPerSec >> 8),
+        };
+
+        // The whole block in one call, so the hub never reads half of a sample
+        i2c_tools_setRegisters(hubBus, I2C_HUB_REG_SEQ, sample, sizeof(sample));
+
+        printf("Sample %u\tRaw: %d\tcm/s: %u\t(polled %lu times)\n", seq, raw, cmPerSec, (unsigned long)i2c_tools_getSlaveTransactions(hubBus));
+
+        sleep_ms(samplePeriodMs); // note, reponse time on the sensor is 125ms
+    }
+
+    return 0;
+}
@@ -0,0 +1,46 @@
+/** @file i2c_hub_regs.h
+ *
+ * @brief Register map of an I2C hub node: a Pico exposing its latest sensor sample to a hub Pico over I2C.
+ *
+ * Brief overview of the registers:
+ * The node answers at I2C_HUB_NODE_ADDR like any register based sensor (write the register, then read from it with a Restart),
+ * and the hub (I2C_hub_mqtt) polls every node and publishes all the samples through its one MQTT connection.
+ *
+ * 0x00        WHO_AM_I   (read-only)  I2C_HUB_WHO_AM_I, checked by the hub before trusting the rest of the map.
+ * 0x01        VERSION    (read-only)  I2C_HUB_VERSION, bumped whenever the layout below changes.
+ * 0x02        SEQ        (read-only)  Incremented on every new sample (wraps around), tells the hub if the sample is new.
+ * 0x03        STATUS     (read-only)  Bit 0: the last read of the sensor succeeded.
+ * 0x04 - 0x05 RAW        (read-only)  Raw FS3000 reading, little endian.
+ * 0x06 - 0x07 SPEED      (read-only)  Air velocity in cm/s, little endian.
+ * 0x10        PERIOD     (read/write) Sample period of the node in units of 100ms (0 for the default period).
+ *
+ * The sample block (SEQ to SPEED) is updated in one go by the node, and read in one transaction by the hub,
+ * so the hub never sees half of a sample (see i2c_tools_setRegisters).
+ *
+ * This file is shared by I2C_hub_node_sample and I2C_hub_mqtt, keep both copies in sync.
+ */
+
+#pragma once
+#ifndef _I2C_HUB_REGS_H_
+#define _I2C_HUB_REGS_H_
+
+#define I2C_HUB_NODE_ADDR 0x40 // 7-bit address of the first node, the next nodes take the following addresses
+#define I2C_HUB_CLOCK_HZ 400000 // Fast-mode, a whole sample block takes about 250us on the wire
+
+#define I2C_HUB_WHO_AM_I 0xA5
+#define I2C_HUB_VERSION 1
+
+#define I2C_HUB_REG_WHO_AM_I 0x00
+#define I2C_HUB_REG_VERSION 0x01
+#define I2C_HUB_REG_SEQ 0x02
+#define I2C_HUB_REG_STATUS 0x03
+#define I2C_HUB_REG_RAW 0x04
+#define I2C_HUB_REG_SPEED 0x06
+#define I2C_HUB_REG_PERIOD 0x10
+
+#define I2C_HUB_SAMPLE_LEN 6 // SEQ to SPEED, read in one transaction
+#define I2C_HUB_MAP_SIZE 0x11 // Number of registers of the map
+
+#define I2C_HUB_STATUS_VALID 0x01
+
+#endif // _I2C_HUB_REGS_H_
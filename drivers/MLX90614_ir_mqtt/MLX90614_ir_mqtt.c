@@ -2,6 +2,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
 #include <time.h>
 
 #include "pico/stdlib.h"
@@ -15,13 +16,26 @@
 
 #include "inf2004_credentials.h"
 #include "mqtt_Rebuilt.h"
+#include "json_writer.h"
+#include "flash_log.h"
+#include "cbor_writer.h"
 #include "MLX90614_rebuilt.h"
 #include "i2c_tools.h"
 
 // #define DEBUG
 
 #define SENSOR_READ_INTERVAL_MS 3000
+#define I2C_DIAG_INTERVAL_READS 10 // Number of sensor reads between two I2C diagnostics reports (DIAG topic)
 #define MQTT_PUBLISH_WAIT_MS 100
+#define REPLAY_MAX_QUEUED 4 // Samples kept in flash are only replayed while fewer messages than this are queued
+#define SAMPLE_BATCH_MAX_SAMPLES 10   // Samples sent in one message at most (see mqtt_batch_begin)
+#define SAMPLE_BATCH_MAX_AGE_MS 30000 // Time a sample waits for the rest of its batch at most
+#define SAMPLE_FORMAT_JSON 0              // Samples published as JSON text (batched, see mqtt_batch_begin)
+#define SAMPLE_FORMAT_CBOR 1              // Samples published as CBOR (lib/cbor): smaller, and no float formatting, one message per sample
+#define SAMPLE_FORMAT SAMPLE_FORMAT_JSON  // Encoding of the MLX90614 samples (subscribers tell them apart from their first byte)
+#define SAMPLE_SCHEMA CBOR_SCHEMA(1)      // Schema byte of the CBOR samples, to be bumped when their fields change
+#define SAMPLE_TAG_JSON 0                 // Tag of the samples kept in flash (see flash_log_append): JSON text
+#define SAMPLE_TAG_CBOR 1                 // CBOR message (schema byte included)
 #pragma region Non-Sensor Related stuff that you probably wouldnt care about
 
 #ifdef DEBUG
@@ -31,21 +45,19 @@
 #endif
 
 #define MQTT_BUFF_SIZE 1025 // 1024 + 1 for null terminator
+#define MQTT_TOPIC_SIZE 128 // Longest topic + 1 for null terminator
+#define MQTT_INBOX_SIZE 256 // Largest incoming payload + 1 for null terminator
 
 #pragma region MQTT and Network Utilities
 
-static char MQTT_PUB_TOPIC_BUFFER[MQTT_BUFF_SIZE];
 static char MQTT_PUB_PAYLOAD_BUFFER[MQTT_BUFF_SIZE];
 
-static u32_t payload_total_len = 0;
-static u8_t payload_buffer[MQTT_BUFF_SIZE];
-static u8_t topic_buffer[MQTT_BUFF_SIZE];
-static u8_t payload_cpy_index = 0;
+static u8_t mqtt_inbox_arena[MQTT_INBOX_SIZE]; // Incoming messages, reassembled by the MQTT library (see process_incoming_message)
 
 #define MQTT_TOTAL_SUB_TOPICS 1
 #define MQTT_TOTAL_PUB_TOPICS 1
-static char MQTT_SUB_TOPICS[MQTT_TOTAL_SUB_TOPICS][MQTT_BUFF_SIZE] = {MQTT_CLIENT_ID "/CMD"};
-static char MQTT_PUB_TOPICS[MQTT_TOTAL_PUB_TOPICS][MQTT_BUFF_SIZE] = {MQTT_CLIENT_ID};
+static char MQTT_SUB_TOPICS[MQTT_TOTAL_SUB_TOPICS][MQTT_TOPIC_SIZE] = {MQTT_CLIENT_ID "/CMD"};
+static char MQTT_PUB_TOPICS[MQTT_TOTAL_PUB_TOPICS][MQTT_TOPIC_SIZE] = {MQTT_CLIENT_ID};
 
 #pragma region MQTT incoming data functions
 
@@ -60,91 +72,10 @@ static char MQTT_PUB_TOPICS[MQTT_TOTAL_PUB_TOPICS][MQTT_BUFF_SIZE] = {MQTT_CLIEN
  *
  * @return void
  */
-static void process_incoming_message()
+static void process_incoming_message(const char *topic, const u8_t *payload, u32_t len, void *arg)
 {
     printf("New MQTT message received!\n");
-    printf("%s[%d]: %s\n", topic_buffer, payload_cpy_index, payload_buffer);
-}
-
-// You'll need 2 functions to handle incoming messages
-// 1. mqtt_incoming_notification_cb
-// 2. mqtt_incoming_payload_cb
-// The first function is called when a new message is received.
-// This function will tell you the topic and the total length of the message.
-// The second function will then be called only if the payload is not empty.
-// This function will be called multiple times until the entire payload is received.
-//
-static void mqtt_notify(void *arg, const char *topic, u32_t tot_len)
-{
-    DEBUG_printf("Incoming topic: '%s', total length: %u\n", topic, (unsigned int)tot_len);
-
-    if (strlen(topic) > MQTT_BUFF_SIZE)
-    {
-        DEBUG_printf("Error: incoming topic does not fit in buffer. Data discarded\n");
-        payload_total_len = 0;
-        return;
-    }
-    if (tot_len > MQTT_BUFF_SIZE)
-    {
-        DEBUG_printf("Error: incoming payload does not fit in buffer. Data discarded\n");
-        payload_total_len = 0;
-        return;
-    }
-    memcpy(topic_buffer, topic, strlen(topic));
-    payload_total_len = tot_len;
-    payload_cpy_index = 0;
-    if (payload_total_len == 0)
-    {
-        // If the payload is empty, then erase the payload buffer
-        // And then call the process_incoming_message() function
-        //  since when there is no payload, the mqtt_read_payload() function will not be called
-        //  and thus the process_incoming_message() function will not be called as well
-        // So we have to call it manually here instead.
-        memset(payload_buffer, 0, MQTT_BUFF_SIZE);
-        process_incoming_message();
-    }
-}
-
-/**
- * @brief Callback function for reading MQTT payload data.
- *
- * This function is a callback used by the MQTT client to handle incoming payload data.
- * It checks if there is remaining payload data to be received, updates the payload buffer
- * with the received data, and triggers further processing once the entire payload is received.
- *
- * @param arg A pointer to user-defined data. In most cases, this is used to pass
- * context information to the callback function.
- * 
- * @param data A pointer to the received payload data.
- * 
- * @param len The length of the received payload data.
- * 
- * @param flags Flags providing additional information about the received payload.
- * 
- * @return void
- */
-static void mqtt_read_payload(void *arg, const u8_t *data, u16_t len, u8_t flags)
-{
-    if (payload_total_len > 0)
-    {
-        // Update payload information
-        payload_total_len -= len;
-        memcpy(&payload_buffer[payload_cpy_index], data, len);
-        payload_cpy_index += len;
-
-        // Check if the entire payload is received
-        if (payload_total_len == 0)
-        {
-            // Null-terminate the payload buffer
-            payload_buffer[payload_cpy_index] = 0;
-
-            // Print debug information about the received message
-            DEBUG_printf("Message Received [%d]:%s\n", payload_cpy_index, payload_buffer);
-
-            // Process the incoming message
-            process_incoming_message();
-        }
-    }
+    printf("%s[%u]: %s\n", topic, (unsigned int)len, (const char *)payload);
 }
 
 /**
@@ -172,73 +103,84 @@ static void mqtt_subscribe_to_all_topics()
 
 #pragma region MQTT publish section
 
+// Time spent reading the sensor since the last I2C diagnostics report, in microseconds.
+static uint64_t sensorReadUs = 0;
+
 /**
- * @brief Publishes sensor data formatted as JSON to an MQTT topic.
+ * @brief Publishes sensor data in JSON format to an MQTT topic.
  *
  * This function constructs an MQTT topic based on the MQTT client ID and the provided sensor name.
- * It then formats the sensor data as a JSON message using the provided arrays of value names and sensor values.
- * The resulting JSON message is printed or sent using the `mqtt_publish_data` function.
+ * It then publishes the provided JSON-formatted sensor data to the constructed topic using
+ * the `mqtt_batch_add` function (added to the batch of the topic if it is batched, see main, and sent from the
+ * main loop by `mqtt_outbox_poll`, so this does not wait for the broker). If the message cannot be queued, an error message is printed.
+ * Regardless of success or failure, a message is printed indicating the publication to the MQTT topic.
  *
  * @param sensorName The name of the sensor for which data is being published.
  * 
- * @param valueNames An array containing the names of the sensor values.
- * 
- * @param sensorValues An array containing the corresponding sensor values.
- * 
- * @param numValues The number of values in the `valueNames` and `sensorValues` arrays.
+ * @param JsonString A JSON-formatted string containing the sensor data to be published.
  * 
  * @return void
  */
-static void publishSensorDataFormatToJson(const char *sensorName, char *valueNames[], char *sensorValues[], size_t numValues)
+static void publishSensorData(const char *sensorName, const char *JsonString)
 {
-    char topic[MQTT_BUFF_SIZE];
-    char jsonMessage[MQTT_BUFF_SIZE];
+    char topic[MQTT_TOPIC_SIZE];
 
     // Construct the topic: clientid/sensorname
-    snprintf(topic, MQTT_BUFF_SIZE, "%s/%s", MQTT_CLIENT_ID, sensorName);
-
-    // Construct the JSON message
-    snprintf(jsonMessage, MQTT_BUFF_SIZE, "{");
-
-    for (size_t i = 0; i < numValues; ++i)
+    snprintf(topic, MQTT_TOPIC_SIZE, "%s/%s", MQTT_CLIENT_ID, sensorName);
+    
+    // Publish the JSON-formatted sensor data to the MQTT topic
+    if (mqtt_batch_add(topic, JsonString) != ERR_OK)
     {
-        // Add the valueName and sensorValue to the JSON message
-        strcat(jsonMessage, "\"");
-        strcat(jsonMessage, valueNames[i]);
-        strcat(jsonMessage, "\":\"");
-        strcat(jsonMessage, sensorValues[i]);
-        strcat(jsonMessage, "\"");
-
-        // Add a comma if not the last element
-        if (i < numValues - 1)
-        {
-            strcat(jsonMessage, ",");
-        }
+        // Print an error message if the message could not be queued
+        printf("Failed to queue for topic: %s, message: %s\n", topic, JsonString);
+        return;
     }
+    
+    // Print a success message indicating the message has been queued for the MQTT topic
+    printf("Queued for topic: %s, message: %s\n", topic, JsonString);
+}
 
-    strcat(jsonMessage, "}");
+/**
+ * @brief Keeps a sample in flash while the MQTT server is unreachable.
+ *
+ * The samples kept in flash are replayed once the connection is back (see replayStoredSample),
+ * so the samples taken during a broker or Wi-Fi outage are not lost.
+ *
+ * @param tag How the sample is encoded (SAMPLE_TAG_JSON or SAMPLE_TAG_CBOR).
+ *
+ * @param sensorName The name of the sensor the sample comes from.
+ *
+ * @param data The sample.
+ *
+ * @param len The length of the sample.
+ *
+ * @return void
+ */
+static void keepSampleInFlash(uint8_t tag, const char *sensorName, const void *data, size_t len)
+{
+    uint8_t record[FLASH_LOG_MAX_DATA];
+    size_t nameLen = strlen(sensorName) + 1;
 
-    // Print or send the JSON message
-    printf("Topic: %s\n", topic);
-    printf("JSON Message: %s\n", jsonMessage);
+    // The record holds the sensor name (null terminated) followed by the sample
+    if (nameLen + len > sizeof(record))
+    {
+        printf("Sample of %s too large to be kept in flash, dropped\n", sensorName);
+        return;
+    }
+    memcpy(record, sensorName, nameLen);
+    memcpy(&record[nameLen], data, len);
 
-    // Publish the JSON-formatted sensor data to the MQTT topic
-    if (mqtt_publish_data(topic, jsonMessage) != ERR_OK)
+    // Timestamped with the time since boot in ms, the boot count is kept by the log (see flash_log_getBoot)
+    if (!flash_log_append(tag, (uint32_t)(time_us_64() / 1000), record, nameLen + len))
     {
-        printf("Failed to publish to topic: %s, message: %s\n", topic, jsonMessage);
+        printf("Failed to keep the sample of %s in flash\n", sensorName);
         return;
     }
-    
-    printf("Published to topic: %s, message: %s\n", topic, jsonMessage);
+    printf("Kept in flash until the connection is back: %s, %u bytes\n", sensorName, (unsigned)len);
 }
 
 /**
- * @brief Publishes sensor data in JSON format to an MQTT topic.
- *
- * This function constructs an MQTT topic based on the MQTT client ID and the provided sensor name.
- * It then publishes the provided JSON-formatted sensor data to the constructed topic using
- * the `mqtt_publish_data` function. If the publish operation fails, an error message is printed.
- * Regardless of success or failure, a message is printed indicating the publication to the MQTT topic.
+ * @brief Publishes a sensor sample, or keeps it in flash while the MQTT server is unreachable.
  *
  * @param sensorName The name of the sensor for which data is being published.
  * 
@@ -246,119 +188,295 @@ static void publishSensorDataFormatToJson(const char *sensorName, char *valueNam
  * 
  * @return void
  */
-static void publishSensorData(const char *sensorName, const char *JsonString)
+static void publishSensorSample(const char *sensorName, const char *JsonString)
 {
-    char topic[MQTT_BUFF_SIZE];
+    if (mqtt_is_connected())
+    {
+        publishSensorData(sensorName, JsonString);
+        return;
+    }
+    keepSampleInFlash(SAMPLE_TAG_JSON, sensorName, JsonString, strlen(JsonString));
+}
+
+#if SAMPLE_FORMAT == SAMPLE_FORMAT_CBOR
+/**
+ * @brief Publishes a sensor sample encoded in CBOR, or keeps it in flash while the MQTT server is unreachable.
+ *
+ * The message is queued as is (schema byte and CBOR map, see lib/cbor), one message per sample:
+ * the batches (see mqtt_batch_begin) only hold JSON samples.
+ *
+ * @param sensorName The name of the sensor for which data is being published.
+ *
+ * @param cbor The CBOR message of the sample.
+ *
+ * @return void
+ */
+static void publishSensorSampleCbor(const char *sensorName, const cbor_writer_t *cbor)
+{
+    char topic[MQTT_TOPIC_SIZE];
+
+    if (!cbor_isOk(cbor))
+    {
+        printf("Sample of %s too large for its buffer, dropped\n", sensorName);
+        return;
+    }
+    if (!mqtt_is_connected())
+    {
+        keepSampleInFlash(SAMPLE_TAG_CBOR, sensorName, cbor->buffer, cbor_getLength(cbor));
+        return;
+    }
 
     // Construct the topic: clientid/sensorname
-    snprintf(topic, MQTT_BUFF_SIZE, "%s/%s", MQTT_CLIENT_ID, sensorName);
-    
-    // Publish the JSON-formatted sensor data to the MQTT topic
-    if (mqtt_publish_data(topic, JsonString) != ERR_OK)
+    snprintf(topic, MQTT_TOPIC_SIZE, "%s/%s", MQTT_CLIENT_ID, sensorName);
+    if (mqtt_outbox_enqueue_w_len(topic, cbor->buffer, cbor_getLength(cbor)) != ERR_OK)
     {
-        // Print an error message if the publish operation fails
-        printf("Failed to publish to topic: %s, message: %s\n", topic, JsonString);
+        printf("Failed to queue for topic: %s, %u bytes of CBOR\n", topic, (unsigned)cbor_getLength(cbor));
         return;
     }
-    
-    // Print a success message indicating the publication to the MQTT topic
-    printf("Published to topic: %s, message: %s\n", topic, JsonString);
+    printf("Queued for topic: %s, %u bytes of CBOR\n", topic, (unsigned)cbor_getLength(cbor));
 }
+#endif
 
-#pragma endregion
+/**
+ * @brief Queues a replayed sample, written into the room reserved for it in the outbound queue (see replayStoredSample).
+ *
+ * @param complete True if the sample fitted in the room reserved.
+ *
+ * @param len The length of the message.
+ *
+ * @return True if the sample is done with (queued, or dropped as it can never fit), False to try again later.
+ */
+static bool commitStoredSample(bool complete, size_t len)
+{
+    if (!complete)
+    {
+        mqtt_outbox_cancel();
+        printf("Replayed sample too large for its message, dropped\n");
+        return true;
+    }
+    return mqtt_outbox_commit(len) == ERR_OK;
+}
 
 /**
- * @brief Prints an IPv4 address in human-readable format.
+ * @brief Replays a sample kept in flash to the <sensorName>/LOG topic (callback of flash_log_replay).
  *
- * This function takes a 32-bit unsigned integer representing an IPv4 address
- * and prints it in the standard dot-decimal notation (e.g., "192.168.0.1").
- * The address is divided into individual octets, and each octet is printed
- * in decimal format.
+ * The sample is wrapped with the time it was taken, e.g. {"boot":3,"ms":123456,"data":{...}}
+ * (time since boot in ms, of the boot number "boot"), so it can be told apart from the live samples.
+ * A CBOR sample is wrapped the same way, as a CBOR map under the schema byte of the sample.
  *
- * @param addr The 32-bit unsigned integer representing the IPv4 address.
+ * @param record The record of the sample.
  * 
- * @return void
+ * @param arg Unused.
+ * 
+ * @return True if the sample has been queued, False to try again later (the outbound queue is busy).
  */
-static void printIPv4Address(unsigned int addr)
+static bool replayStoredSample(const flash_log_record_t *record, void *arg)
 {
-    // Extracting individual octets
-    unsigned char octet4 = (addr >> 24) & 0xFF;
-    unsigned char octet3 = (addr >> 16) & 0xFF;
-    unsigned char octet2 = (addr >> 8) & 0xFF;
-    unsigned char octet1 = addr & 0xFF;
-
-    // Printing the IPv4 address
-    printf("%u.%u.%u.%u\n", octet1, octet2, octet3, octet4);
-}
+    char topic[MQTT_TOPIC_SIZE];
+    const char *sensorName = (const char *)record->data;
+    size_t nameLen = strnlen(sensorName, record->len);
+    // Room for the sample and its wrapping, written straight into the outbound queue
+    u16_t maxLen = record->len + 64;
+
+    // Leave room in the outbound queue for the live samples
+    if (mqtt_outbox_count() >= REPLAY_MAX_QUEUED)
+    {
+        return false;
+    }
 
-#pragma endregion
+    // Not a sample record (no sensor name), nothing to replay
+    if (nameLen >= record->len)
+    {
+        return true;
+    }
+
+    snprintf(topic, MQTT_TOPIC_SIZE, "%s/%s/LOG", MQTT_CLIENT_ID, sensorName);
+    char *payload = mqtt_outbox_reserve(topic, maxLen);
+    if (payload == NULL)
+    {
+        // Not enough free room in the outbound queue, the reservation never drops the messages queued
+        return false;
+    }
+
+    // CBOR sample (see publishSensorSampleCbor): wrapped the same way, in CBOR, under the schema of the sample
+    if ((record->tag == SAMPLE_TAG_CBOR) && (record->len > nameLen + 2))
+    {
+        const uint8_t *sample = (const uint8_t *)sensorName + nameLen + 1;
+        cbor_writer_t cbor;
+        cbor_begin(&cbor, (uint8_t *)payload, maxLen, sample[0]);
+        cbor_openMap(&cbor, 3);
+        cbor_fieldUint(&cbor, "boot", record->boot);
+        cbor_fieldUint(&cbor, "ms", record->timestamp);
+        cbor_putText(&cbor, "data");
+        cbor_putRaw(&cbor, &sample[1], record->len - nameLen - 2);
+        return commitStoredSample(cbor_isOk(&cbor), cbor_getLength(&cbor));
+    }
+
+    json_writer_t json;
+    json_begin(&json, payload, maxLen + 1);
+    json_openObject(&json);
+    json_fieldUint(&json, "boot", record->boot);
+    json_fieldUint(&json, "ms", record->timestamp);
+    json_key(&json, "data");
+    json_putRaw(&json, sensorName + nameLen + 1, record->len - nameLen - 1);
+    json_closeObject(&json);
+    return commitStoredSample(json_isOk(&json), json_getLength(&json));
+}
 
-#pragma endregion
 /**
- * @brief Reconnects to the MQTT server, sets custom callbacks, publishes online status, and subscribes to topics.
+ * @brief Publishes the I2C diagnostics of the last few reads to the DIAG topic, then starts a new trace window.
+ *
+ * The payload holds the time spent reading the sensor (driver delays included) and the I2C trace summary
+ * (time spent on the bus, per-device latency histograms, see i2c_tools_formatDiagnostics), e.g.
+ * {"sensorReadUs":2250,"i2c":{"windowUs":30000000,"busUs":2250,"dev":[...]}}
+ * so the share of each cycle spent on the bus versus in the driver's busy-waits can be told apart.
  *
- * This function attempts to establish a connection to the MQTT server using the `mqtt_begin_connection` function.
- * If the connection attempt fails, it retries every 5 seconds until successful. Once connected, it sets custom
- * MQTT callback functions using `set_mqtt_subscribe_callback`, publishes an online status message to a predefined
- * MQTT topic using `mqtt_publish_data`, and subscribes to all predefined MQTT topics using `mqtt_subscribe_to_all_topics`.
+ * @param bus Pointer to the I2C bus handle of the sensor.
  *
  * @return void
  */
-void mqtt_reconnect()
+static void publishI2CDiagnostics(i2c_tools_bus_t *bus)
 {
-    while (mqtt_begin_connection() != ERR_OK)
+    char topic[MQTT_TOPIC_SIZE];
+    json_writer_t json;
+    size_t room;
+
+    // Liveness of the MQTT session, measured by the library (keepalive round trip, signal strength)
+    mqtt_liveness_t liveness;
+    mqtt_get_liveness(&liveness);
+
+    // Written straight into the free room of the outbound queue, the unused room is given back on commit.
+    // The report is skipped if the queue is too full: it never pushes the queued samples out.
+    snprintf(topic, MQTT_TOPIC_SIZE, "%s/DIAG", MQTT_CLIENT_ID);
+    char *message = mqtt_outbox_reserve(topic, MQTT_BUFF_SIZE - 1);
+    if (message == NULL)
     {
-        printf("Failed to connect to MQTT server. Retrying in 5 seconds...\n");
-        sleep_ms(5000);
+        printf("Outbound queue full, skipped topic: %s\n", topic);
+    }
+    else
+    {
+        json_begin(&json, message, MQTT_BUFF_SIZE);
+        json_openObject(&json);
+        json_fieldUint(&json, "sensorReadUs", sensorReadUs);
+        json_key(&json, "i2c");
+        char *i2cJson = json_beginRaw(&json, &room);
+        json_endRaw(&json, i2c_tools_formatDiagnostics(bus, i2cJson, room));
+        json_fieldInt(&json, "rssi", liveness.rssi);
+        json_fieldUint(&json, "pingRttUs", liveness.ping_rtt_us);
+        json_closeObject(&json);
+
+        if (json_isOk(&json) && (mqtt_outbox_commit(json_getLength(&json)) == ERR_OK))
+        {
+            printf("Queued for topic: %s, message: %s\n", topic, message);
+        }
+        else
+        {
+            mqtt_outbox_cancel();
+            printf("Diagnostics too large for topic: %s, dropped\n", topic);
+        }
     }
-    
-    printf("Connected to MQTT server.\n");
 
-    // Set custom callback functions for MQTT subscription
-    set_mqtt_subscribe_callback(mqtt_notify, mqtt_read_payload, NULL);
+#ifdef DEBUG
+    i2c_tools_dumpTrace(bus);
+#endif
+
+    // Start a new window
+    i2c_tools_clearTrace(bus);
+    sensorReadUs = 0;
+}
 
-    // Publish online status to a predefined MQTT topic
-    mqtt_publish_data(MQTT_PUB_TOPICS[0], "ONLINE");
+#pragma endregion
 
+#pragma endregion
+
+#pragma endregion
+/**
+ * @brief Called by the MQTT library every time the broker accepts the connection (see mqtt_conn_poll).
+ *
+ * Subscribes to all predefined MQTT topics using `mqtt_subscribe_to_all_topics` (the incoming messages
+ * are handed to `process_incoming_message` by the library). The online status is published once per session by the library.
+ * The connection itself (Wi-Fi, DNS, broker) is made and retried with backoff by `mqtt_conn_poll`, from the main loop.
+ *
+ * @param arg Unused.
+ *
+ * @return void
+ */
+static void mqtt_on_connected(void *arg)
+{
     // Subscribe to all predefined MQTT topics
     mqtt_subscribe_to_all_topics();
 }
 
+/**
+ * @brief Called by the MQTT library when the MQTT session ends (see mqtt_conn_set_disconnected_callback).
+ *
+ * The broker publishes the OFFLINE will message on its own, and the library reconnects with backoff.
+ *
+ * @param reason Why the session ended.
+ *
+ * @param arg Unused.
+ *
+ * @return void
+ */
+static void mqtt_on_disconnected(const char *reason, void *arg)
+{
+    printf("MQTT session ended (%s), the samples are kept in flash until it is back.\n", reason);
+}
+
 // Function to read spectral data for sensors 1 to 8 and publish to MQTT, based on timer
 /**
- * @brief Reads sensor data, checks MQTT connection, publishes online status, and publishes sensor data.
+ * @brief Reads sensor data, and publishes it to MQTT.
  *
- * This function first checks if the MQTT server is connected by publishing an "ONLINE" status message
- * to a predefined MQTT topic. If the MQTT server is disconnected, it attempts to reconnect using the
- * `mqtt_reconnect` function. After ensuring a connection, it reads sensor data from an MLX90614 sensor,
+ * The connection is kept up, and its liveness monitored, by `mqtt_conn_poll` in the main loop. This function reads sensor data from an MLX90614 sensor,
  * formats it into a JSON payload, and publishes it to a predefined MQTT topic using the `publishSensorData` function.
  *
  * @return void
  */
 void readSensorDataAndPublish()
 {
-    // Check if MQTT is connected by publishing "ONLINE" to the MQTT server
-    if (mqtt_publish_data(MQTT_PUB_TOPICS[0], "ONLINE") != ERR_OK)
+    // Read sensor data from MLX90614 (timed, see publishI2CDiagnostics)
+    uint64_t readStart = time_us_64();
+    float ambientTemp = MLX90614_getAmbientTempCelsius();
+    float objectTemp = MLX90614_getObjectTempCelsius();
+    sensorReadUs += time_us_64() - readStart;
+
+    // Do not publish garbage if the sensor could not be read (the bus has already been retried/recovered by i2c_tools)
+    if (isnan(ambientTemp) || isnan(objectTemp))
     {
-        printf("MQTT Server disconnected. Reconnecting...\n");
-        mqtt_reconnect();
+        printf("MLX90614 read error, skipping this sample\n");
+        return;
     }
 
-    // Read sensor data from MLX90614 and format it into a JSON payload
-    snprintf(MQTT_PUB_PAYLOAD_BUFFER, MQTT_BUFF_SIZE, "{\"ambientTemp\":%.2f,\"objectTemp\":%.2f}",
-             MLX90614_getAmbientTempCelsius(),
-             MLX90614_getObjectTempCelsius());
+#if SAMPLE_FORMAT == SAMPLE_FORMAT_CBOR
+    // Encode the sensor data in CBOR, the floats are copied as they are
+    cbor_writer_t cbor;
+    cbor_begin(&cbor, (uint8_t *)MQTT_PUB_PAYLOAD_BUFFER, MQTT_BUFF_SIZE, SAMPLE_SCHEMA);
+    cbor_openMap(&cbor, 2);
+    cbor_fieldFloat(&cbor, "ambientTemp", ambientTemp);
+    cbor_fieldFloat(&cbor, "objectTemp", objectTemp);
 
     // Publish the sensor data to the MQTT server
-    publishSensorData("MLX90614", MQTT_PUB_PAYLOAD_BUFFER);
+    publishSensorSampleCbor("MLX90614", &cbor);
+#else
+    // Format the sensor data into a JSON payload
+    json_writer_t json;
+    json_begin(&json, MQTT_PUB_PAYLOAD_BUFFER, MQTT_BUFF_SIZE);
+    json_openObject(&json);
+    json_fieldFloat(&json, "ambientTemp", ambientTemp, 2);
+    json_fieldFloat(&json, "objectTemp", objectTemp, 2);
+    json_closeObject(&json);
+
+    // Publish the sensor data to the MQTT server
+    publishSensorSample("MLX90614", MQTT_PUB_PAYLOAD_BUFFER);
+#endif
 }
 
 int main()
 {
 
     stdio_init_all();
-    i2c_tools_init(i2c0, PICO_DEFAULT_I2C_SDA_PIN, PICO_DEFAULT_I2C_SCL_PIN);
-    MLX90614_I2C_init(0x5A);
+    i2c_tools_bus_t *bus = i2c_tools_init(i2c0, PICO_DEFAULT_I2C_SDA_PIN, PICO_DEFAULT_I2C_SCL_PIN);
+    MLX90614_I2C_init(bus, 0x5A);
     while (NO_ERR != MLX90614_I2C_begin())
     {
         printf("Communication with device failed, please check connection\n");
@@ -380,22 +498,13 @@ int main()
 
     cyw43_arch_enable_sta_mode();
 
-    printf("Connecting to '%s' using '%s' \n", WIFI_SSID, WIFI_PASSWORD);
-    if (cyw43_arch_wifi_connect_timeout_ms(WIFI_SSID, WIFI_PASSWORD, CYW43_AUTH_WPA2_AES_PSK, 30000))
-    {
-        printf("Error connecting to Wi-Fi\n");
-        return 1;
-    }
-    else
-    {
-        printf("Connected to Wi-Fi.\n");
-        cyw43_arch_lwip_begin();
-        printf("Assigned IP address: ");
-        printIPv4Address(cyw43_state.netif[0].ip_addr.addr);
-        printf("\n");
-        cyw43_arch_lwip_end();
-    }
+    // Joined from the main loop by the MQTT library, without waiting for it (see mqtt_conn_poll)
+    mqtt_conn_set_wifi(WIFI_SSID, WIFI_PASSWORD, CYW43_AUTH_WPA2_AES_PSK);
 #pragma endregion
+
+    // Keep the Wi-Fi stack serviced while the sensor's I2C transfers are in flight
+    i2c_tools_setIdleCallback(cyw43_arch_poll);
+
 #pragma region MQTT setup
     set_mqtt_config(
         MQTT_SERVER_ADDR,
@@ -411,21 +520,46 @@ int main()
         MQTT_WILL_QOS,
         MQTT_WILL_RETAIN);
 
+    // Samples taken while the MQTT server is unreachable are kept in flash (see publishSensorSample)
+    printf("%u samples kept in flash waiting to be replayed\n", (unsigned)flash_log_begin());
+
     mqtt_client_init();
-    mqtt_reconnect();
+    mqtt_inbox_set_message_callback(mqtt_inbox_arena, sizeof(mqtt_inbox_arena), process_incoming_message, NULL);
+    mqtt_conn_set_connected_callback(mqtt_on_connected, NULL);
+    mqtt_conn_set_disconnected_callback(mqtt_on_disconnected, NULL);
+
+    // The samples go out in batches, one message for up to SAMPLE_BATCH_MAX_SAMPLES samples (see publishSensorData).
+    // The DIAG reports are not batched.
+    mqtt_batch_begin(MQTT_CLIENT_ID "/MLX90614", SAMPLE_BATCH_MAX_SAMPLES, SAMPLE_BATCH_MAX_AGE_MS, 0);
 
 #pragma endregion
 
 #pragma region Main loop
 
     uint64_t nextTimeToReadSensor = 0;
+    int readsSinceDiag = 0; // Number of sensor reads since the last I2C diagnostics report
     while (1)
     {
         if (nextTimeToReadSensor < time_us_64())
         {
             readSensorDataAndPublish();
             nextTimeToReadSensor = time_us_64() + SENSOR_READ_INTERVAL_MS * 1000;
+
+            // Report the I2C diagnostics every few reads
+            if (++readsSinceDiag >= I2C_DIAG_INTERVAL_READS)
+            {
+                publishI2CDiagnostics(bus);
+                readsSinceDiag = 0;
+            }
+        }
+        mqtt_conn_poll(); // Connect to the broker, and reconnect with backoff, without blocking the sensor reads
+        // Replay the samples kept in flash during an outage, at the replay rate of the log
+        if (mqtt_is_connected())
+        {
+            flash_log_replay(replayStoredSample, NULL);
         }
+        mqtt_batch_poll();  // Queue the batches whose first sample is SAMPLE_BATCH_MAX_AGE_MS old
+        mqtt_outbox_poll(); // Publish the queued messages, as far as the broker keeps up
         cyw43_arch_poll();
         sleep_ms(10);
     }
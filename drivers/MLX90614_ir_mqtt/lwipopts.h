@@ -8,6 +8,8 @@
 #include "lwipopts_examples_common.h"
 
 #define MEMP_NUM_SYS_TIMEOUT (LWIP_NUM_SYS_TIMEOUT_INTERNAL + 3)
+// Room for a whole batch of samples in the MQTT output buffer (see mqtt_batch_begin), the default (256 bytes) only fits a few
+#define MQTT_OUTPUT_RINGBUF_SIZE 2048
 // #define LWIP_DEBUG_TIMERNAMES 1
 // #define TIMERS_DEBUG LWIP_DBG_ON
 
@@ -10,6 +10,9 @@
  * When the pico that's connected to the AS7341 infrared sensor publishes the ambient light level to MQTT,
  * this pico will then read the ambient light level and turn on or off the LED strip accordingly.
  *
+ * The LED strip fades between colours instead of switching, and runs lighting effects sent to its lightEffect topic
+ * (e.g. a daily sunrise and sunset, see ws2812b_effect_command), played by the frame scheduler of the LED library.
+ *
  */
 
 #include "hardware/structs/rosc.h"
@@ -32,14 +35,19 @@
 
 #include "inf2004_credentials.h"
 #include "mqtt_Rebuilt.h"
+#include "json_writer.h"
 #include "NFA4X10_Rebuilt.h"
 #include "ws2812b_Rebuilt.h"
+#include "ws2812b_effects.h"
 
 // #define DEBUG
 
 #define SENSOR_READ_INTERVAL_MS 3000
 #define MQTT_PUBLISH_WAIT_MS 100
 
+#define LIGHT_FPS 30       // Frames per second of the lighting effects
+#define LIGHT_FADE_MS 2000 // Time the grow light takes to fade on or off
+
 #define SPECTRO_SENSOR_MQTT_CLIENT_PREFIX "<YourGroupName>/<MqttUsernameOfSpectroSensorPico>"
 
 #pragma region Non-Sensor Related stuff that you probably wouldnt care about
@@ -51,109 +59,37 @@
 #endif
 
 #define MQTT_BUFF_SIZE 1025 // 1024 + 1 for null terminator
+#define MQTT_TOPIC_SIZE 128 // Longest topic + 1 for null terminator
+#define MQTT_INBOX_SIZE 256 // Largest incoming payload + 1 for null terminator
 
 #pragma region MQTT and Network Utilities
 
-static char MQTT_PUB_TOPIC_BUFFER[MQTT_BUFF_SIZE];
 static char MQTT_PUB_PAYLOAD_BUFFER[MQTT_BUFF_SIZE];
 
-static u32_t payload_total_len = 0;
-static u8_t payload_buffer[MQTT_BUFF_SIZE];
-static u8_t topic_buffer[MQTT_BUFF_SIZE];
-static u8_t payload_cpy_index = 0;
+static u8_t mqtt_inbox_arena[MQTT_INBOX_SIZE]; // Incoming messages, reassembled by the MQTT library (see process_incoming_message)
 
 static int fan_speed = 100;
 static int fan_speed_override = -1;
 
-#define MQTT_TOTAL_SUB_TOPICS 4
+static bool light_effect_override = false; // An effect sent to lightEffect runs the grow light, the ambient light readings are ignored until "stop"
+
+#define MQTT_TOTAL_SUB_TOPICS 5
 /*IMPORTANT! REPLACE THIS*/
 
-static char MQTT_SUB_TOPICS[MQTT_TOTAL_SUB_TOPICS][MQTT_BUFF_SIZE] = {
+static char MQTT_SUB_TOPICS[MQTT_TOTAL_SUB_TOPICS][MQTT_TOPIC_SIZE] = {
     MQTT_CLIENT_ID "/CMD",
     MQTT_CLIENT_ID "/DUTYCYCLE_OVERRIDE", // To override fan speed...
     MQTT_CLIENT_ID "/lightStatus",        // Override light status
-    SPECTRO_SENSOR_MQTT_CLIENT_PREFIX "/AS7341/visibleLight"};
+    SPECTRO_SENSOR_MQTT_CLIENT_PREFIX "/AS7341/visibleLight",
+    MQTT_CLIENT_ID "/lightEffect"};       // Lighting effects (see ws2812b_effect_command)
 
 #pragma region MQTT incoming data functions
 
 /**
- * @brief Trigger to process the message on the topic buffer and payload buffer...
- * (Conditional handling based on MQTT topic...)
+ * @brief Applies the fan speed after every incoming message (the override if one is set).
  */
-static void process_incoming_message()
+static void apply_fan_speed()
 {
-    printf("New MQTT message received!\n");
-    printf("%s[%d]: %s\n", topic_buffer, payload_cpy_index, payload_buffer);
-
-    // NOTE: Sometimes there is a bug where the topic's title comes with a random character 't',
-    // this is a 'hack' to just remove the 't' character if it comes with it ....
-    const char *targetTopic = MQTT_CLIENT_ID "/DUTYCYCLE_OVERRIDEt ";
-    if (strcmp(topic_buffer, targetTopic) == 0)
-    {
-        size_t length = strlen(topic_buffer);
-        if (length > 0 && topic_buffer[length - 1] == 't')
-        {
-            topic_buffer[length - 1] = '\0';
-        }
-    }
-
-    if (strcmp(topic_buffer, MQTT_SUB_TOPICS[1]) == 0)
-    {
-        // NOTE: MQTT Command to override fan speed...
-        fan_speed_override = atoi(payload_buffer);
-        printf("Override fan speed: %d\n", fan_speed_override);
-
-        if (fan_speed_override >= 0 && fan_speed_override <= 100)
-        {
-            NFA4X10_set_fan_speed(fan_speed_override);
-        }
-    }
-    else if (strcmp(topic_buffer, MQTT_SUB_TOPICS[2]) == 0)
-    {
-        // NOTE: MQTT Command to override light status...
-        if (strcmp(topic_buffer, MQTT_SUB_TOPICS[2]) == 0)
-        {
-
-            if (strcmp(payload_buffer, "ON") == 0)
-            {
-                printf("Turning on light\n");
-                set_all_external_leds_rgb(255, 255, 255);
-                show_external_leds();
-            }
-            else if (strcmp(payload_buffer, "OFF") == 0)
-            {
-                printf("Turning off light\n");
-                set_all_external_leds_rgb(0, 0, 0);
-                show_external_leds();
-            }
-            else
-            {
-                printf("Invalid light status\n");
-            }
-
-            set_all_external_leds_rgb(255, 255, 255);
-            show_external_leds();
-        }
-    }
-    else if (strcmp(topic_buffer, MQTT_SUB_TOPICS[3]) == 0)
-    {
-        int ambientLightLevel = atoi(payload_buffer);
-        if (ambientLightLevel < 500)
-        {
-            set_all_external_leds_rgb(255, 255, 255);
-            show_external_leds();
-        }
-        else
-        {
-            set_all_external_leds_rgb(0, 0, 0);
-            show_external_leds();
-        }
-    }
-    else
-    {
-        printf("Topic Handler Not Yet Implemented For '%s'\n", topic_buffer);
-    }
-
     /*TO-DO: Auto-calculate fan speed required based on new sensor readings from other clients*/
     // Placeholder code to simulate fan speed override
     if (fan_speed_override >= 0)
@@ -171,135 +107,105 @@ static void process_incoming_message()
 }
 
 /**
-NOTE: You'll need 2 functions to handle incoming messages
-    1. mqtt_incoming_notification_cb
-    This function is called when a new message is received.
-    This function will tell you the topic and the total length of the message.
+ * @brief Handler of the DUTYCYCLE_OVERRIDE topic: overrides the fan speed (0 to 100, or negative to go back to the default).
+ */
+static void on_duty_cycle_override(const char *topic, const u8_t *payload, u32_t len, void *arg)
+{
+    // NOTE: MQTT Command to override fan speed...
+    fan_speed_override = atoi((const char *)payload);
+    printf("Override fan speed: %d\n", fan_speed_override);
 
-    2. mqtt_incoming_payload_cb
-    This function will then be called only if the payload is not empty.
-    This function will be called multiple times until the entire payload is received.
-*/
+    if (fan_speed_override >= 0 && fan_speed_override <= 100)
+    {
+        NFA4X10_set_fan_speed(fan_speed_override);
+    }
+}
 
 /**
- * @brief Subcription function, sends the incoming MQTT Message to 'process_incoming_message'.
- * It will discord topic's messages that have a greater size than the buffer...
+ * @brief Handler of the lightStatus topic: fades the grow light ON or OFF.
  */
-static void mqtt_notify(void *arg, const char *topic, u32_t tot_len)
+static void on_light_status(const char *topic, const u8_t *payload, u32_t len, void *arg)
 {
-    DEBUG_printf("Incoming topic: '%s', total length: %u\n", topic, (unsigned int)tot_len);
+    ws2812b_strip_t *strip = ws2812b_get_strip(WS2812B_LED_TYPE_EXTERNAL);
 
-    if (strlen(topic) > MQTT_BUFF_SIZE)
+    // NOTE: MQTT Command to override light status...
+    if (strcmp((const char *)payload, "ON") == 0)
     {
-        DEBUG_printf("Error: incoming topic does not fit in buffer. Data discarded\n");
-        payload_total_len = 0;
-        return;
+        printf("Turning on light\n");
+        ws2812b_effect_fade(strip, 255, 255, 255, LIGHT_FADE_MS);
     }
-    if (tot_len > MQTT_BUFF_SIZE)
+    else if (strcmp((const char *)payload, "OFF") == 0)
     {
-        DEBUG_printf("Error: incoming payload does not fit in buffer. Data discarded\n");
-        payload_total_len = 0;
-        return;
+        printf("Turning off light\n");
+        ws2812b_effect_fade(strip, 0, 0, 0, LIGHT_FADE_MS);
     }
-
-    memcpy(topic_buffer, topic, strlen(topic));
-    payload_total_len = tot_len;
-    payload_cpy_index = 0;
-    if (payload_total_len == 0)
+    else
     {
-        // If the payload is empty, then erase the payload buffer
-        // And then call the process_incoming_message() function
-        // since when there is no payload, the mqtt_read_payload() function will not be called
-        // and thus the process_incoming_message() function will not be called as well
-        // So we have to call it manually here instead.
-        memset(payload_buffer, 0, MQTT_BUFF_SIZE);
-        process_incoming_message();
+        printf("Invalid light status\n");
     }
 }
 
-static void mqtt_read_payload(void *arg, const u8_t *data, u16_t len, u8_t flags)
+/**
+ * @brief Handler of the visible light readings of the AS7341 node: fades the grow light on when it gets dark.
+ */
+static void on_ambient_light(const char *topic, const u8_t *payload, u32_t len, void *arg)
 {
-    if (payload_total_len > 0)
-    {
-        payload_total_len -= len;
-        memcpy(&payload_buffer[payload_cpy_index], data, len);
-        payload_cpy_index += len;
+    ws2812b_strip_t *strip = ws2812b_get_strip(WS2812B_LED_TYPE_EXTERNAL);
 
-        if (payload_total_len == 0)
-        {
-            payload_buffer[payload_cpy_index] = 0;
-            DEBUG_printf("Message Received [%d]:%s\n", payload_cpy_index, payload_buffer);
-            process_incoming_message();
-        }
+    if (light_effect_override)
+    {
+        return;
+    }
+    int ambientLightLevel = atoi((const char *)payload);
+    if (ambientLightLevel < 500)
+    {
+        ws2812b_effect_fade(strip, 255, 255, 255, LIGHT_FADE_MS);
+    }
+    else
+    {
+        ws2812b_effect_fade(strip, 0, 0, 0, LIGHT_FADE_MS);
     }
 }
 
 /**
- * @brief Subscribes to all predefined MQTT topics.
+ * @brief Handler of the lightEffect topic: starts or stops a lighting effect on the grow light
+ * (e.g. "sunrise 1800000", or a looping timeline for a daily photoperiod, see ws2812b_effect_command).
+ * The ambient light readings are ignored from then on, until the "stop" command.
  */
-static void mqtt_subscribe_to_all_topics()
+static void on_light_effect(const char *topic, const u8_t *payload, u32_t len, void *arg)
 {
-    // Subscribe to all topics
-    for (int i = 0; i < MQTT_TOTAL_SUB_TOPICS; ++i)
+    ws2812b_strip_t *strip = ws2812b_get_strip(WS2812B_LED_TYPE_EXTERNAL);
+
+    if (ws2812b_effect_command(strip, (const char *)payload))
     {
-        if (mqtt_subscribe_topic(MQTT_SUB_TOPICS[i], SUB) != ERR_OK)
-        {
-            printf("Failed to subscribe to topic: %s\n", MQTT_SUB_TOPICS[i]);
-        }
+        light_effect_override = ws2812b_effect_is_playing(strip);
     }
 }
 
-#pragma endregion
-
-#pragma region MQTT publish section
-
 /**
- * @brief Publishes sensor data in JSON format to MQTT.
- * @param sensorName: Name of the sensor.
- * @param valueNames: Array of value names.
- * @param sensorValues: Array of sensor values.
- * @param numValues: Number of values in the arrays.
+ * @brief Handler of the topics without a handler of their own (e.g. CMD).
  */
-static void publishSensorDataFormatToJson(const char *sensorName, char *valueNames[], char *sensorValues[], size_t numValues)
+static void on_unhandled_topic(const char *topic, const u8_t *payload, u32_t len, void *arg)
 {
-    char topic[MQTT_BUFF_SIZE];
-    char jsonMessage[MQTT_BUFF_SIZE];
-
-    // Construct the topic: clientid/sensorname
-    snprintf(topic, MQTT_BUFF_SIZE, "%s/%s", MQTT_CLIENT_ID, sensorName);
-
-    // Construct the JSON message
-    snprintf(jsonMessage, MQTT_BUFF_SIZE, "{");
+    printf("Topic Handler Not Yet Implemented For '%s'\n", topic);
+}
 
-    for (size_t i = 0; i < numValues; ++i)
-    {
-        // Add the valueName and sensorValue to the JSON message
-        strcat(jsonMessage, "\"");
-        strcat(jsonMessage, valueNames[i]);
-        strcat(jsonMessage, "\":\"");
-        strcat(jsonMessage, sensorValues[i]);
-        strcat(jsonMessage, "\"");
-
-        // Add a comma if not the last element
-        if (i < numValues - 1)
-        {
-            strcat(jsonMessage, ",");
-        }
-    }
+/**
+ * @brief Trigger to process a message, once reassembled by the MQTT library (see mqtt_inbox_set_message_callback)...
+ * (Handed to the handler of its topic by the router, see mqtt_router_add in main)
+ */
+static void process_incoming_message(const char *topic, const u8_t *payload, u32_t len, void *arg)
+{
+    printf("New MQTT message received!\n");
+    printf("%s[%u]: %s\n", topic, (unsigned int)len, (const char *)payload);
 
-    strcat(jsonMessage, "}");
+    mqtt_router_dispatch(topic, payload, len, NULL);
+    apply_fan_speed();
+}
 
-    // Print or send the JSON message
-    printf("Topic: %s\n", topic);
-    printf("JSON Message: %s\n", jsonMessage);
+#pragma endregion
 
-    if (mqtt_publish_data(topic, jsonMessage) != ERR_OK)
-    {
-        printf("Failed to publish to topic: %s, message: %s\n", topic, jsonMessage);
-        return;
-    }
-    printf("Published to topic: %s, message: %s\n", topic, jsonMessage);
-}
+#pragma region MQTT publish section
 
 /**
  * @brief Publishes sensor data to MQTT.
@@ -308,62 +214,56 @@ static void publishSensorDataFormatToJson(const char *sensorName, char *valueNam
  */
 static void publishSensorData(const char *sensorName, const char *JsonString)
 {
-    char topic[MQTT_BUFF_SIZE];
+    char topic[MQTT_TOPIC_SIZE];
 
     // Construct the topic: clientid/sensorname
-    snprintf(topic, MQTT_BUFF_SIZE, "%s/%s", MQTT_CLIENT_ID, sensorName);
+    snprintf(topic, MQTT_TOPIC_SIZE, "%s/%s", MQTT_CLIENT_ID, sensorName);
     /*legacy code. Fail safe has been implemented in mqtt_publish_data()
     while (!readyForNextPubSub())
     {
         cyw43_arch_poll();
     }
     */
-    if (mqtt_publish_data(topic, JsonString) != ERR_OK)
+    if (mqtt_outbox_enqueue(topic, JsonString) != ERR_OK)
     {
-        printf("Failed to publish to topic: %s, message: %s\n", topic, JsonString);
+        printf("Failed to queue for topic: %s, message: %s\n", topic, JsonString);
         return;
     }
-    printf("Published to topic: %s, message: %s\n", topic, JsonString);
+    printf("Queued for topic: %s, message: %s\n", topic, JsonString);
 }
 #pragma endregion
 
-/**
- * @brief Attempts to reconnect to the MQTT server.
- */
-static void printIPv4Address(unsigned int addr)
-{
-    // Extracting individual octets
-    unsigned char octet4 = (addr >> 24) & 0xFF;
-    unsigned char octet3 = (addr >> 16) & 0xFF;
-    unsigned char octet2 = (addr >> 8) & 0xFF;
-    unsigned char octet1 = addr & 0xFF;
-
-    // Printing the IPv4 address
-    printf("%u.%u.%u.%u\n", octet1, octet2, octet3, octet4);
-}
-
 #pragma endregion
 
 #pragma endregion
 
 /**
- * @brief Attempts to reconnect to the MQTT server.
+ * @brief Called by the MQTT library every time the broker accepts the connection (see mqtt_conn_poll).
+ * Subscribes to all the topics (the library publishes the online status).
  */
-void mqtt_reconnect()
+static void mqtt_on_connected(void *arg)
 {
-    cyw43_arch_poll();
-    while (mqtt_begin_connection() != ERR_OK)
+    // subscribe to the topics of all the handlers
+    if (mqtt_router_subscribe_all() != ERR_OK)
     {
-        printf("Failed to connect to MQTT server. Retrying in 5 seconds...\n");
-        sleep_ms(5000);
+        printf("Failed to subscribe to all the topics\n");
     }
-    printf("Connected to MQTT server.\n");
-    // set our custom callback functions
-    set_mqtt_subscribe_callback(mqtt_notify, mqtt_read_payload, NULL);
-    // publish our online status
-    mqtt_publish_data(MQTT_CLIENT_ID, "ONLINE");
-    // subscribe to all topics
-    mqtt_subscribe_to_all_topics();
+}
+
+/**
+ * @brief Called by the MQTT library when the MQTT session ends (see mqtt_conn_set_disconnected_callback).
+ *
+ * The broker publishes the OFFLINE will message on its own, and the library reconnects with backoff.
+ *
+ * @param reason Why the session ended.
+ *
+ * @param arg Unused.
+ *
+ * @return void
+ */
+static void mqtt_on_disconnected(const char *reason, void *arg)
+{
+    printf("MQTT session ended (%s), reconnecting.\n", reason);
 }
 
 /**
@@ -371,17 +271,13 @@ void mqtt_reconnect()
  */
 void readSensorDataAndPublish()
 {
-    // Check if MQTT is connected by publishing "ONLINE" to the MQTT server
-    if (mqtt_publish_data(MQTT_CLIENT_ID, "ONLINE") != ERR_OK)
-    {
-        printf("MQTT Server disconnected. Reconnecting...\n");
-        mqtt_reconnect();
-    }
-
-    snprintf(MQTT_PUB_PAYLOAD_BUFFER, MQTT_BUFF_SIZE, "{\"RPM\":%.2f,\"DUTYCYCLE\":%d,\"DUTYCYCLE_OVERRIDE\":%d}",
-             NFA4X10_get_fan_rpm(),
-             NFA4X10_get_fan_duty_cycle(),
-             fan_speed_override);
+    json_writer_t json;
+    json_begin(&json, MQTT_PUB_PAYLOAD_BUFFER, MQTT_BUFF_SIZE);
+    json_openObject(&json);
+    json_fieldFloat(&json, "RPM", NFA4X10_get_fan_rpm(), 2);
+    json_fieldInt(&json, "DUTYCYCLE", NFA4X10_get_fan_duty_cycle());
+    json_fieldInt(&json, "DUTYCYCLE_OVERRIDE", fan_speed_override);
+    json_closeObject(&json);
 
     publishSensorData("NFA4X10", MQTT_PUB_PAYLOAD_BUFFER);
 }
@@ -392,6 +288,7 @@ int main()
     stdio_init_all();
     // Initializes the fan and it's components
     ws2812b_init_all();
+    ws2812b_effects_init(LIGHT_FPS);
 
     NFA4X10_init();
 #pragma region WiFi setup
@@ -404,21 +301,8 @@ int main()
 
     cyw43_arch_enable_sta_mode();
 
-    printf("Connecting to '%s' using '%s' \n", WIFI_SSID, WIFI_PASSWORD);
-    if (cyw43_arch_wifi_connect_timeout_ms(WIFI_SSID, WIFI_PASSWORD, CYW43_AUTH_WPA2_AES_PSK, 30000))
-    {
-        printf("Error connecting to Wi-Fi\n");
-        return 1;
-    }
-    else
-    {
-        printf("Connected to Wi-Fi.\n");
-        cyw43_arch_lwip_begin();
-        printf("Assigned IP address: ");
-        printIPv4Address(cyw43_state.netif[0].ip_addr.addr);
-        printf("\n");
-        cyw43_arch_lwip_end();
-    }
+    // Joined from the main loop by the MQTT library, without waiting for it (see mqtt_conn_poll)
+    mqtt_conn_set_wifi(WIFI_SSID, WIFI_PASSWORD, CYW43_AUTH_WPA2_AES_PSK);
 #pragma endregion
 #pragma region MQTT setup
     set_mqtt_config(
@@ -436,7 +320,16 @@ int main()
         MQTT_WILL_RETAIN);
 
     mqtt_client_init();
-    mqtt_reconnect();
+    mqtt_inbox_set_message_callback(mqtt_inbox_arena, sizeof(mqtt_inbox_arena), process_incoming_message, NULL);
+    // Handlers of the incoming messages, the router subscribes to their topics (see mqtt_on_connected)
+    mqtt_router_add(MQTT_SUB_TOPICS[0], on_unhandled_topic, NULL);
+    mqtt_router_add(MQTT_SUB_TOPICS[1], on_duty_cycle_override, NULL);
+    mqtt_router_add(MQTT_SUB_TOPICS[2], on_light_status, NULL);
+    mqtt_router_add(MQTT_SUB_TOPICS[3], on_ambient_light, NULL);
+    mqtt_router_add(MQTT_SUB_TOPICS[4], on_light_effect, NULL);
+    mqtt_router_set_default(on_unhandled_topic, NULL);
+    mqtt_conn_set_connected_callback(mqtt_on_connected, NULL);
+    mqtt_conn_set_disconnected_callback(mqtt_on_disconnected, NULL);
 
 #pragma endregion
 
@@ -450,6 +343,8 @@ int main()
             readSensorDataAndPublish();
             nextTimeToReadSensor = time_us_64() + SENSOR_READ_INTERVAL_MS * 1000;
         }
+        mqtt_conn_poll();   // Connect to the broker, and reconnect with backoff, without blocking the fan control
+        mqtt_outbox_poll(); // Publish the queued messages, as far as the broker keeps up
         cyw43_arch_poll();
         sleep_ms(10);
     }
@@ -1,6 +1,7 @@
 /** @file ws2812b_Rebuilt.h
  * Original WS2812B LED code by yeahimthatguy @ https://forums.raspberrypi.com/viewtopic.php?t=322218
- * Adapted into standalone library to support both the MakerPico's onboard WS2812B LED and 1 additional external WS2812B LED strip.
+ * Adapted into standalone library to support both the MakerPico's onboard WS2812B LED and 1 additional external WS2812B LED strip,
+ * plus any number of strips registered at runtime (see ws2812b_add_strip), up to the state machines and the DMA channels left.
  *
  */
 #ifndef WS2812B_REBUILT_H
@@ -13,19 +14,28 @@
 /* For WS2812B */
 /* Datasheet used: https://cdn-shop.adafruit.com/datasheets/WS2812B.pdf */
 
-/* Assembler functions */
-extern void cycle_delay_t0h();
-extern void cycle_delay_t0l();
-extern void cycle_delay_t1h();
-extern void cycle_delay_t1l();
-extern uint32_t disable_and_save_interrupts();       /* Used for disabling all interrupts */
-extern void enable_and_restore_interrupts(uint32_t); /* Used for enabling all interrupts */
+/* The bits are shifted out by a PIO state machine per LED pin, fed by DMA from the LED data (see ws2812b_init) */
 
 typedef enum
 {
     WS2812B_LED_TYPE_EXTERNAL,
-    WS2812B_LED_TYPE_MAKERPICO
+    WS2812B_LED_TYPE_MAKERPICO,
+    WS2812B_LED_TYPE_STRIP // A strip registered at runtime (see ws2812b_add_strip)
 } ws2812b_led_type_t;
+
+/**
+ * @brief A LED strip, on its own pin (see ws2812b_add_strip).
+ */
+typedef struct ws2812b_strip ws2812b_strip_t;
+
+/**
+ * @brief Function called each time a frame has been sent to the LEDs and latched (see ws2812b_set_frame_done_callback).
+ *
+ * @param led Which LED(s) the frame was sent to.
+ * @param strip The strip the frame was sent to (see ws2812b_get_strip for the onboard and external LEDs).
+ * @param arg The argument given with the function.
+ */
+typedef void (*ws2812b_frame_done_callback_t)(ws2812b_led_type_t led, ws2812b_strip_t *strip, void *arg);
 /**
  * @brief Convert a hexadecimal color string to RGB values.
  *
@@ -68,17 +78,13 @@ void set_onboard_led_rgb(uint8_t r, uint8_t g, uint8_t b);
  */
 void set_onboard_led_hex(const char *hexColor);
 /**
- * @brief Display RGB data on the onboard LED using a custom bit-banging method.
+ * @brief Display RGB data on the onboard LED.
  *
- * @note The function uses a custom bit-banging method to send RGB data to the onboard LED.
- *       The RGB data is stored in the global array onboard_led_data.
- *       The function sequentially processes each set of RGB values (green, red, blue) in the array
- *       and sends the corresponding bits to the onboard LED pin.
- *       It handles each bit individually, setting and clearing the pin based on the bit value and applying
- *       specific delays as per the datasheet.
- *       After sending all the RGB data, it sets the level low to indicate a reset.
- *       Interrupts are temporarily disabled during the process to ensure precise timing.
- *       A cooldown delay is added after the process to allow things to settle down.
+ * @note The function hands the frame written by the set_onboard_led_* functions over to be sent to the onboard LED, and returns
+ *       straight away: the bits are shifted out by a PIO state machine, fed by DMA, so no interrupt is disabled and no CPU time is spent
+ *       while the LED is updated. The next frame can be written at once, it does not change the one being sent.
+ *       If the previous frame is still being sent, this one is queued and sent right after it (a frame queued before and not sent yet is dropped).
+ *       See ws2812b_set_frame_done_callback and ws2812b_is_frame_in_flight to know when it has been shown.
  */
 void show_onboard_led();
 #pragma endregion
@@ -135,17 +141,13 @@ void set_all_external_leds_rgb(uint8_t r, uint8_t g, uint8_t b);
 void set_all_external_leds_hex(const char *hexColor);
 
 /**
- * @brief Display RGB data on external LEDs using a custom bit-banging method.
+ * @brief Display RGB data on external LEDs.
  *
- * @note The function uses a custom bit-banging method to send RGB data to external LEDs.
- *       The RGB data is stored in the global array external_led_data.
- *       The function sequentially processes each set of RGB values (green, red, blue) in the array
- *       and sends the corresponding bits to the external LED pin.
- *       It handles each bit individually, setting and clearing the pin based on the bit value and applying
- *       specific delays as per the datasheet.
- *       After sending all RGB data, it sets the level low to indicate a reset.
- *       Interrupts are temporarily disabled during the process to ensure precise timing.
- *       A cooldown delay is added after the process to allow things to settle down.
+ * @note The function hands the frame written by the set_*external_led* functions over to be sent to the external LEDs, and returns
+ *       straight away: the bits are shifted out by a PIO state machine, fed by DMA, so no interrupt is disabled and no CPU time is spent
+ *       while the strip is updated, however many LEDs it has. The next frame can be written at once, it does not change the one being sent.
+ *       If the previous frame is still being sent, this one is queued and sent right after it (a frame queued before and not sent yet is dropped).
+ *       See ws2812b_set_frame_done_callback and ws2812b_is_frame_in_flight to know when it has been shown.
  */
 void show_external_leds();
 #pragma endregion
@@ -264,7 +266,139 @@ void set_and_show_everything_hex(const char *hexColor);
  */
 void reset_all_leds();
 #pragma endregion
-#pragma Initalization functions
+#pragma region Frame functions
+
+/**
+ * @brief Set the function called each time a frame has been sent to the LEDs and latched.
+ *
+ * @param callback The function, NULL for none. It gets which LED(s) the frame was sent to (and their strip), and arg.
+ * @param arg Passed to the function as is.
+ *
+ * @note The function is called from the timer interrupt: it must be short. It may call the set_* and show_* functions,
+ *       e.g. to send the next frame of an animation.
+ *       If a frame was queued, it is already being sent when the function is called.
+ */
+void ws2812b_set_frame_done_callback(ws2812b_frame_done_callback_t callback, void *arg);
+
+/**
+ * @brief Check whether a frame is being sent to LED(s), or queued.
+ *
+ * @param led Which LED(s): WS2812B_LED_TYPE_EXTERNAL, WS2812B_LED_TYPE_MAKERPICO, or WS2812B_LED_TYPE_STRIP for any of the strips registered at runtime.
+ * @return True until every frame handed over by show_* has been sent and latched.
+ */
+bool ws2812b_is_frame_in_flight(ws2812b_led_type_t led);
+#pragma endregion
+
+#pragma region Strip functions
+
+/**
+ * @brief Register a LED strip at runtime, on its own pin and with its own number of LEDs.
+ *
+ * @param pin GPIO the data line of the strip is wired to.
+ * @param led_count Number of LEDs of the strip.
+ * @return The strip, all its LEDs off; NULL if WS2812B_MAX_STRIPS strips are registered already, if its frames do not fit
+ *         in what is left of WS2812B_ARENA_SIZE, or if no PIO state machine or DMA channel is left (a message is printed).
+ *
+ * @note The strip gets its own PIO state machine and DMA channel: the strips are sent in parallel, so refreshing all of them
+ *       takes as long as the longest one (30us per LED, plus 300us of reset), not the sum of them.
+ *       Its 3 frames (back, front and queued, 3 bytes per LED) are taken from a static arena, they are never given back:
+ *       the strips are meant to be registered once, at startup.
+ *       The onboard LED and the external LEDs (see ws2812b_init) take a state machine and a DMA channel each as well.
+ *       Example usage: ws2812b_strip_t *rack = ws2812b_add_strip(16, 144);
+ */
+ws2812b_strip_t *ws2812b_add_strip(uint pin, uint32_t led_count);
+
+/**
+ * @brief Get the strip of the onboard LED or of the external LEDs, to use them with the ws2812b_strip_* functions.
+ *
+ * @param led WS2812B_LED_TYPE_EXTERNAL or WS2812B_LED_TYPE_MAKERPICO.
+ * @return The strip (NULL for WS2812B_LED_TYPE_STRIP). Nothing is sent to it until it has been initialized (see ws2812b_init).
+ */
+ws2812b_strip_t *ws2812b_get_strip(ws2812b_led_type_t led);
+
+/**
+ * @brief Get the number of LEDs of a strip.
+ *
+ * @param strip The strip.
+ * @return The number of LEDs.
+ */
+uint32_t ws2812b_strip_get_led_count(const ws2812b_strip_t *strip);
+
+/**
+ * @brief Set RGB values for a LED of a strip.
+ *
+ * @param strip The strip.
+ * @param ledIndex Index of the LED (0 to the number of LEDs of the strip - 1).
+ * @param r Red color component (0-255).
+ * @param g Green color component (0-255).
+ * @param b Blue color component (0-255).
+ *
+ * @note The LED changes in the back frame of the strip, shown by the next ws2812b_strip_show.
+ *       If the LED index is invalid, an error message is printed, and nothing is changed.
+ */
+void ws2812b_strip_set_rgb(ws2812b_strip_t *strip, uint32_t ledIndex, uint8_t r, uint8_t g, uint8_t b);
+
+/**
+ * @brief Set the color of a LED of a strip using a hexadecimal color string.
+ *
+ * @param strip The strip.
+ * @param ledIndex Index of the LED (0 to the number of LEDs of the strip - 1).
+ * @param hexColor Hexadecimal color string (e.g., "FF8800").
+ */
+void ws2812b_strip_set_hex(ws2812b_strip_t *strip, uint32_t ledIndex, const char *hexColor);
+
+/**
+ * @brief Set RGB values for all the LEDs of a strip.
+ *
+ * @param strip The strip.
+ * @param r Red color component (0-255).
+ * @param g Green color component (0-255).
+ * @param b Blue color component (0-255).
+ */
+void ws2812b_strip_set_all_rgb(ws2812b_strip_t *strip, uint8_t r, uint8_t g, uint8_t b);
+
+/**
+ * @brief Set the color of all the LEDs of a strip using a hexadecimal color string.
+ *
+ * @param strip The strip.
+ * @param hexColor Hexadecimal color string (e.g., "FF8800").
+ */
+void ws2812b_strip_set_all_hex(ws2812b_strip_t *strip, const char *hexColor);
+
+/**
+ * @brief Get the back frame of a strip, to write many LEDs at once (e.g. an animation).
+ *
+ * @param strip The strip.
+ * @return The frame: 3 bytes per LED, in send order (green, red, blue).
+ *
+ * @note The frame changes with every ws2812b_strip_show (the frame shown is swapped out): get it again after each one.
+ */
+uint8_t *ws2812b_strip_get_frame(ws2812b_strip_t *strip);
+
+/**
+ * @brief Hand the frame of a strip over to be sent, and return straight away (see show_external_leds).
+ *
+ * @param strip The strip.
+ */
+void ws2812b_strip_show(ws2812b_strip_t *strip);
+
+/**
+ * @brief Hand the frames of all the strips registered at runtime over to be sent, and return straight away.
+ *
+ * @note The strips are sent in parallel, each by its own state machine: they have all been refreshed once the longest one has.
+ */
+void ws2812b_show_all_strips();
+
+/**
+ * @brief Check whether a frame is being sent to a strip, or queued.
+ *
+ * @param strip The strip.
+ * @return True until every frame handed over by ws2812b_strip_show has been sent and latched.
+ */
+bool ws2812b_strip_is_frame_in_flight(const ws2812b_strip_t *strip);
+#pragma endregion
+
+#pragma region Initalization functions
 
 /**
  * @brief Initialize the WS2812B LEDs.
@@ -272,9 +406,11 @@ void reset_all_leds();
  * @param enable_onboard_led Whether to enable initialization for the onboard LED that comes with the Maker Pico Board.
  * @param enable_external_led Whether to enable initialization for external LED strip(s).
  *
- * @note This function initializes the WS2812B LEDs by configuring the GPIO pins for the onboard and external LEDs.
- *       If enable_onboard_led is true, it initializes the onboard LED pin to get ready for output.
- *       If enable_external_led is true, it initializes the external LED pin to get ready for output.
+ * @note This function initializes the WS2812B LEDs by handing the GPIO pins of the onboard and external LEDs to the PIO.
+ *       If enable_onboard_led is true, it claims a PIO state machine and a DMA channel for the onboard LED pin.
+ *       If enable_external_led is true, it claims a PIO state machine and a DMA channel for the external LED pin.
+ *       The clock divider of the state machines is derived from the system clock here, and again by the show_* functions
+ *       whenever the system clock has changed since (e.g. with set_sys_clock_khz), so the bit timings hold at any system clock.
  *       A short delay (100ms) is added after initialization to allow the LEDs to reset.
  */
 void ws2812b_init(bool enable_onboard_led, bool enable_external_led);
@@ -0,0 +1,729 @@
+/** @file ws2812b_effects.c
+ * Lighting effects of the WS2812B LED library: keyframe timelines played on the strips by a frame scheduler (see ws2812b_effects.h).
+ *
+ * The colours are interpolated in fixed point: the time into a keyframe is turned into a 16-bit fraction with a multiply
+ * by the inverse of its duration (worked out once, when the effect starts), so rendering a frame takes no division and no float,
+ * which the M0+ would emulate. When all the LEDs change together (no phase), the colour is worked out once per frame,
+ * and only copied to the LEDs.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "pico/stdlib.h"
+#include "hardware/sync.h"
+#include "ws2812b_effects.h"
+#include "string.h"
+
+#ifndef WS2812B_MAX_EFFECTS
+#define WS2812B_MAX_EFFECTS 8 // Most strips playing effects (the PIO blocks have 8 state machines in all, so there are 8 strips at most)
+#endif
+
+#ifndef WS2812B_EFFECTS_ARENA_SIZE
+#define WS2812B_EFFECTS_ARENA_SIZE (3 * 1024) // Memory for the colours the strips start their effects from, in bytes (3 bytes per LED: 1024 LEDs)
+#endif
+
+#define WS2812B_EFFECT_COMMAND_SIZE 256 // Longest command + 1 for null terminator (see ws2812b_effect_command)
+#define LED_DATA_SIZE 3
+
+/**
+ * @brief The effect of a strip: its timeline, and when it started.
+ *
+ * @note The slot of a strip is kept for all its effects (see ws2812b_effect_play).
+ *       The timer interrupt only renders an effect while playing is set: ws2812b_effect_play clears it before changing the effect.
+ */
+typedef struct
+{
+    ws2812b_strip_t *strip;                          // Strip the effect is played on
+    uint8_t *from;                                   // Colours of the LEDs when the effect started, in send order (green, red, blue)
+    uint32_t led_count;                              // Number of LEDs of the strip
+    uint8_t colors[WS2812B_EFFECT_MAX_KEYFRAMES][LED_DATA_SIZE]; // Colours of the keyframes, in send order (green, red, blue)
+    uint32_t ends[WS2812B_EFFECT_MAX_KEYFRAMES];     // Time each keyframe is reached, in ms from the start of the timeline
+    uint32_t inverses[WS2812B_EFFECT_MAX_KEYFRAMES]; // 2^32 / duration of each keyframe, turning the time into it into a 16-bit fraction
+    uint32_t count;                                  // Number of keyframes
+    uint32_t total_ms;                               // Length of the timeline, in ms
+    uint32_t phase_ms;                               // Delay of each LED after the one before, in ms
+    uint32_t lag_ms;                                 // Delay of the last LED after the first one, in ms
+    bool loop;                                       // The timeline starts again once it has ended
+    bool lapped;                                     // Every LED has ended its first lap of a looping timeline (it starts again from the last colour)
+    uint64_t start_us;                               // Time the timeline started (moved forward by whole laps once lapped)
+    bool sent;                                       // A frame of the effect has been handed over to be sent
+    volatile bool playing;                           // The effect is being rendered by the frame scheduler
+} ws2812b_effect_t;
+
+static ws2812b_effect_t effects[WS2812B_MAX_EFFECTS]; // Effects of the strips, one slot per strip
+static uint32_t effect_count = 0;
+
+static uint8_t effects_arena[WS2812B_EFFECTS_ARENA_SIZE]; // Starting colours of the effects, handed out in order
+static uint32_t effects_arena_used = 0;
+
+static repeating_timer_t effects_timer; // Timer ticking at the frame rate (see ws2812b_effects_init)
+static bool effects_running = false;
+
+#pragma region interpolation functions
+
+/**
+ * @brief Interpolate a color component between two keyframes.
+ *
+ * @param from The component at the keyframe before.
+ * @param to The component at the keyframe.
+ * @param frac16 How far into the keyframe, in 1/65536ths.
+ * @return The component, rounded to the nearest.
+ */
+static inline uint8_t ws2812b_lerp(uint8_t from, uint8_t to, uint32_t frac16)
+{
+    return (uint8_t)(from + ((((int32_t)to - (int32_t)from) * (int32_t)frac16 + 0x8000) >> 16));
+}
+
+/**
+ * @brief Find the keyframe being reached at a time of the timeline.
+ *
+ * @param effect The effect.
+ * @param t_ms Time into the timeline, in ms (less than its length).
+ * @param frac16 Set to how far into the keyframe, in 1/65536ths.
+ * @return The index of the keyframe.
+ */
+static uint32_t ws2812b_effect_segment(const ws2812b_effect_t *effect, uint32_t t_ms, uint32_t *frac16)
+{
+    uint32_t k = 0;
+    while (t_ms >= effect->ends[k])
+    {
+        k++;
+    }
+    uint32_t into = t_ms - ((k == 0) ? 0 : effect->ends[k - 1]);
+    *frac16 = (uint32_t)(((uint64_t)into * effect->inverses[k]) >> 16);
+    return k;
+}
+
+/**
+ * @brief Work out the colour of a LED at a time of the timeline.
+ *
+ * @param effect The effect.
+ * @param t_ms Time into the timeline, in ms (less than its length).
+ * @param first Colour the first keyframe is reached from (the starting colour of the LED, or the last keyframe once looped).
+ * @param out Set to the colour, in send order (green, red, blue).
+ */
+static void ws2812b_effect_color_at(const ws2812b_effect_t *effect, uint32_t t_ms, const uint8_t *first, uint8_t *out)
+{
+    uint32_t frac16;
+    uint32_t k = ws2812b_effect_segment(effect, t_ms, &frac16);
+    const uint8_t *from = (k == 0) ? first : effect->colors[k - 1];
+    for (uint32_t j = 0; j < LED_DATA_SIZE; j++)
+    {
+        out[j] = ws2812b_lerp(from[j], effect->colors[k][j], frac16);
+    }
+}
+
+#pragma endregion
+
+#pragma region frame scheduler functions
+
+/**
+ * @brief Write the colour of a LED into a frame.
+ *
+ * @param out The LED in the frame.
+ * @param color The colour, in send order (green, red, blue).
+ * @return True if the LED had another colour.
+ */
+static inline bool ws2812b_effect_put(uint8_t *out, const uint8_t *color)
+{
+    bool changed = (out[0] != color[0]) || (out[1] != color[1]) || (out[2] != color[2]);
+    out[0] = color[0];
+    out[1] = color[1];
+    out[2] = color[2];
+    return changed;
+}
+
+/**
+ * @brief Render the frame of an effect with all the LEDs changing together (no phase).
+ *
+ * @param effect The effect.
+ * @param t_ms Time into the timeline, in ms (its length once it has ended).
+ * @param frame The back frame of the strip.
+ * @return True if any LED changed.
+ */
+static bool ws2812b_effect_render_uniform(const ws2812b_effect_t *effect, uint32_t t_ms, uint8_t *frame)
+{
+    const uint8_t *last = effect->colors[effect->count - 1];
+    uint8_t color[LED_DATA_SIZE];
+    bool changed = false;
+
+    if (t_ms >= effect->total_ms)
+    {
+        memcpy(color, last, LED_DATA_SIZE);
+    }
+    else if (effect->lapped)
+    {
+        ws2812b_effect_color_at(effect, t_ms, last, color);
+    }
+    else
+    {
+        uint32_t frac16;
+        if (ws2812b_effect_segment(effect, t_ms, &frac16) == 0)
+        {
+            // Each LED fades from its own starting colour, with the same fraction.
+            const uint8_t *to = effect->colors[0];
+            for (uint32_t i = 0; i < effect->led_count * LED_DATA_SIZE; i += LED_DATA_SIZE)
+            {
+                color[0] = ws2812b_lerp(effect->from[i], to[0], frac16);
+                color[1] = ws2812b_lerp(effect->from[i + 1], to[1], frac16);
+                color[2] = ws2812b_lerp(effect->from[i + 2], to[2], frac16);
+                changed |= ws2812b_effect_put(&frame[i], color);
+            }
+            return changed;
+        }
+        ws2812b_effect_color_at(effect, t_ms, last, color);
+    }
+
+    for (uint32_t i = 0; i < effect->led_count * LED_DATA_SIZE; i += LED_DATA_SIZE)
+    {
+        changed |= ws2812b_effect_put(&frame[i], color);
+    }
+    return changed;
+}
+
+/**
+ * @brief Render the frame of an effect with each LED phase_ms behind the one before.
+ *
+ * @param effect The effect.
+ * @param t_ms Time into the timeline of the first LED, in ms.
+ * @param frame The back frame of the strip.
+ * @return True if any LED changed.
+ */
+static bool ws2812b_effect_render_phased(const ws2812b_effect_t *effect, uint32_t t_ms, uint8_t *frame)
+{
+    const uint8_t *last = effect->colors[effect->count - 1];
+    uint8_t color[LED_DATA_SIZE];
+    uint32_t offset = 0;
+    bool changed = false;
+
+    for (uint32_t i = 0; i < effect->led_count * LED_DATA_SIZE; i += LED_DATA_SIZE, offset += effect->phase_ms)
+    {
+        uint32_t t = t_ms - offset;
+        if (offset > t_ms)
+        {
+            // The timeline has not reached this LED yet.
+            memcpy(color, &effect->from[i], LED_DATA_SIZE);
+        }
+        else if (effect->lapped || (effect->loop && (t >= effect->total_ms)))
+        {
+            ws2812b_effect_color_at(effect, t % effect->total_ms, last, color);
+        }
+        else if (t < effect->total_ms)
+        {
+            ws2812b_effect_color_at(effect, t, &effect->from[i], color);
+        }
+        else
+        {
+            memcpy(color, last, LED_DATA_SIZE);
+        }
+        changed |= ws2812b_effect_put(&frame[i], color);
+    }
+    return changed;
+}
+
+/**
+ * @brief Render the frame of an effect at a time, and hand it over to be sent if any LED changed.
+ *
+ * @param effect The effect.
+ * @param now_us The time, in us since boot.
+ *
+ * @note The back frame holds the frame last shown (see ws2812b_strip_show), so the LEDs are compared with it as they are rendered:
+ *       a frame without any change (e.g. a slow ramp between two steps) is not sent.
+ *       A timeline that has ended renders its last frame, then stops. A looping one is moved forward by whole laps once
+ *       every LED has ended its first one, so the times stay on 32 bits however long it loops.
+ */
+static void ws2812b_effect_render(ws2812b_effect_t *effect, uint64_t now_us)
+{
+    uint8_t *frame = ws2812b_strip_get_frame(effect->strip);
+    uint64_t elapsed_ms = (now_us - effect->start_us) / 1000;
+    uint32_t end_ms = effect->lag_ms + effect->total_ms;
+    bool ended = false;
+    bool changed;
+
+    if (elapsed_ms >= end_ms)
+    {
+        if (effect->loop)
+        {
+            uint64_t laps = (elapsed_ms - effect->lag_ms) / effect->total_ms;
+            effect->start_us += laps * effect->total_ms * 1000;
+            elapsed_ms -= laps * effect->total_ms;
+            effect->lapped = true;
+        }
+        else
+        {
+            elapsed_ms = end_ms;
+            ended = true;
+        }
+    }
+
+    if (effect->phase_ms == 0)
+    {
+        changed = ws2812b_effect_render_uniform(effect, (uint32_t)elapsed_ms, frame);
+    }
+    else
+    {
+        changed = ws2812b_effect_render_phased(effect, (uint32_t)elapsed_ms, frame);
+    }
+
+    // The first frame is always sent: the back frame may have been set and not shown.
+    if (changed || !effect->sent)
+    {
+        effect->sent = true;
+        ws2812b_strip_show(effect->strip);
+    }
+    if (ended)
+    {
+        effect->playing = false;
+    }
+}
+
+/**
+ * @brief Tick of the frame scheduler: renders the next frame of every effect playing (see ws2812b_effects_init).
+ *
+ * @param timer The repeating timer.
+ * @return True, to keep the timer running.
+ *
+ * @note Runs in the timer interrupt. A strip still sending its previous frame is skipped: its next frame is rendered at the next tick,
+ *       where the effect should be by then.
+ */
+static bool ws2812b_effects_tick(repeating_timer_t *timer)
+{
+    (void)timer; // Single scheduler, its state is in the effects
+    uint64_t now_us = time_us_64();
+    for (uint32_t i = 0; i < effect_count; i++)
+    {
+        ws2812b_effect_t *effect = &effects[i];
+        if (effect->playing && !ws2812b_strip_is_frame_in_flight(effect->strip))
+        {
+            ws2812b_effect_render(effect, now_us);
+        }
+    }
+    return true;
+}
+
+#pragma endregion
+
+#pragma region effect functions
+
+/**
+ * @brief Find the effect slot of a strip.
+ *
+ * @param strip The strip.
+ * @return The slot; NULL if the strip has never played an effect.
+ */
+static ws2812b_effect_t *ws2812b_effect_find(const ws2812b_strip_t *strip)
+{
+    for (uint32_t i = 0; i < effect_count; i++)
+    {
+        if (effects[i].strip == strip)
+        {
+            return &effects[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Get the effect slot of a strip, giving it one (and memory for its starting colours) if it has none yet.
+ *
+ * @param strip The strip.
+ * @return The slot; NULL if no slot or memory is left (a message is printed).
+ */
+static ws2812b_effect_t *ws2812b_effect_claim(ws2812b_strip_t *strip)
+{
+    ws2812b_effect_t *effect = ws2812b_effect_find(strip);
+    if (effect != NULL)
+    {
+        return effect;
+    }
+
+    uint32_t led_count = ws2812b_strip_get_led_count(strip);
+    if ((effect_count >= WS2812B_MAX_EFFECTS) || (led_count > (WS2812B_EFFECTS_ARENA_SIZE - effects_arena_used) / LED_DATA_SIZE))
+    {
+        printf("WS2812B: no room left for an effect on a strip of %u LEDs\n", led_count);
+        return NULL;
+    }
+
+    effect = &effects[effect_count];
+    memset(effect, 0, sizeof(*effect));
+    effect->strip = strip;
+    effect->led_count = led_count;
+    effect->from = &effects_arena[effects_arena_used];
+    effects_arena_used += led_count * LED_DATA_SIZE;
+
+    // Only counted once filled in: the timer interrupt may walk the slots at any time.
+    __dmb();
+    effect_count++;
+    return effect;
+}
+
+/**
+ * @brief Play a timeline of keyframes on a strip, starting now from the colours its LEDs have.
+ *
+ * @param strip The strip (see ws2812b_add_strip, and ws2812b_get_strip for the onboard and external LEDs).
+ * @param keyframes The keyframes, in order (copied, they need not be kept).
+ * @param count The number of keyframes (1 to WS2812B_EFFECT_MAX_KEYFRAMES).
+ * @param loop Whether to start the timeline again once it has ended (from the last colour, back to the first keyframe); otherwise the LEDs keep the last colour.
+ * @param phase_ms Delay of each LED after the one before, in ms (0: all the LEDs change together), e.g. for a running light or a wave along the strip.
+ * @return True if the effect is playing; False if the keyframes are invalid, or if no effect slot or memory is left for the strip (a message is printed).
+ *
+ * @note The timer interrupt renders the effects on the core that called ws2812b_effects_init, and cannot run in the middle of it:
+ *       the effect is paused (playing cleared) while it is changed, then started again.
+ */
+bool ws2812b_effect_play(ws2812b_strip_t *strip, const ws2812b_keyframe_t *keyframes, uint32_t count, bool loop, uint32_t phase_ms)
+{
+    if ((strip == NULL) || (keyframes == NULL) || (count == 0) || (count > WS2812B_EFFECT_MAX_KEYFRAMES))
+    {
+        printf("WS2812B: invalid effect (%u keyframes)\n", count);
+        return false;
+    }
+
+    // Every time of the timeline must fit on 32 bits (49 days), and a looping one must last.
+    uint64_t total_ms = 0;
+    for (uint32_t k = 0; k < count; k++)
+    {
+        total_ms += keyframes[k].duration_ms;
+    }
+    uint64_t lag_ms = (uint64_t)(ws2812b_strip_get_led_count(strip) - 1) * phase_ms;
+    if ((total_ms + lag_ms > UINT32_MAX) || (loop && (total_ms == 0)))
+    {
+        printf("WS2812B: invalid effect timeline (%llu ms)\n", (unsigned long long)(total_ms + lag_ms));
+        return false;
+    }
+
+    ws2812b_effect_t *effect = ws2812b_effect_claim(strip);
+    if (effect == NULL)
+    {
+        return false;
+    }
+
+    effect->playing = false;
+    __dmb();
+
+    uint32_t end = 0;
+    for (uint32_t k = 0; k < count; k++)
+    {
+        end += keyframes[k].duration_ms;
+        effect->ends[k] = end;
+        effect->inverses[k] = (keyframes[k].duration_ms == 0) ? 0 : (0xFFFFFFFFu / keyframes[k].duration_ms);
+        effect->colors[k][0] = keyframes[k].g; /* Green */
+        effect->colors[k][1] = keyframes[k].r; /* Red */
+        effect->colors[k][2] = keyframes[k].b; /* Blue */
+    }
+    effect->count = count;
+    effect->total_ms = end;
+    effect->phase_ms = phase_ms;
+    effect->lag_ms = (uint32_t)lag_ms;
+    effect->loop = loop;
+    effect->lapped = false;
+    effect->sent = false;
+    // The back frame holds the colours last shown (or set since), the effect starts from them.
+    memcpy(effect->from, ws2812b_strip_get_frame(strip), effect->led_count * LED_DATA_SIZE);
+    effect->start_us = time_us_64();
+
+    __dmb();
+    effect->playing = true;
+    return true;
+}
+
+/**
+ * @brief Stop the effect playing on a strip, its LEDs keep the colours they had reached.
+ *
+ * @param strip The strip.
+ */
+void ws2812b_effect_stop(ws2812b_strip_t *strip)
+{
+    ws2812b_effect_t *effect = ws2812b_effect_find(strip);
+    if (effect != NULL)
+    {
+        effect->playing = false;
+    }
+}
+
+/**
+ * @brief Check whether an effect is playing on a strip.
+ *
+ * @param strip The strip.
+ * @return True until the effect has been stopped, or has shown its last keyframe (never for a looping effect).
+ */
+bool ws2812b_effect_is_playing(const ws2812b_strip_t *strip)
+{
+    const ws2812b_effect_t *effect = ws2812b_effect_find(strip);
+    return (effect != NULL) && effect->playing;
+}
+
+/**
+ * @brief Cross-fade all the LEDs of a strip to a colour.
+ *
+ * @param strip The strip.
+ * @param r Red color component (0-255).
+ * @param g Green color component (0-255).
+ * @param b Blue color component (0-255).
+ * @param duration_ms Time to reach the colour, in ms.
+ * @return True if the effect is playing (see ws2812b_effect_play).
+ */
+bool ws2812b_effect_fade(ws2812b_strip_t *strip, uint8_t r, uint8_t g, uint8_t b, uint32_t duration_ms)
+{
+    ws2812b_keyframe_t fade[] = {{duration_ms, r, g, b}};
+    return ws2812b_effect_play(strip, fade, 1, false, 0);
+}
+
+/**
+ * @brief Ramp a strip up like a sunrise: from off, through deep red and orange, to a warm white.
+ *
+ * @param strip The strip.
+ * @param duration_ms Length of the ramp, in ms.
+ * @return True if the effect is playing (see ws2812b_effect_play).
+ *
+ * @note The ramp starts from off, whatever the colours of the strip, and ends at full brightness.
+ *       Each of its 4 steps takes a quarter of the time.
+ */
+bool ws2812b_effect_sunrise(ws2812b_strip_t *strip, uint32_t duration_ms)
+{
+    uint32_t step = duration_ms / 4;
+    ws2812b_keyframe_t sunrise[] = {
+        {0, 0, 0, 0},
+        {step, 20, 2, 0},
+        {step, 120, 30, 0},
+        {step, 255, 110, 20},
+        {duration_ms - 3 * step, 255, 220, 170},
+    };
+    return ws2812b_effect_play(strip, sunrise, 5, false, 0);
+}
+
+/**
+ * @brief Ramp a strip down like a sunset: the sunrise colours in reverse, from the current colours down to off.
+ *
+ * @param strip The strip.
+ * @param duration_ms Length of the ramp, in ms.
+ * @return True if the effect is playing (see ws2812b_effect_play).
+ */
+bool ws2812b_effect_sunset(ws2812b_strip_t *strip, uint32_t duration_ms)
+{
+    uint32_t step = duration_ms / 4;
+    ws2812b_keyframe_t sunset[] = {
+        {step, 255, 110, 20},
+        {step, 120, 30, 0},
+        {step, 20, 2, 0},
+        {duration_ms - 3 * step, 0, 0, 0},
+    };
+    return ws2812b_effect_play(strip, sunset, 4, false, 0);
+}
+
+/**
+ * @brief Pulse a strip: fade to a colour and back to off, over and over.
+ *
+ * @param strip The strip.
+ * @param r Red color component (0-255).
+ * @param g Green color component (0-255).
+ * @param b Blue color component (0-255).
+ * @param period_ms Length of a pulse, in ms (half of it up, half of it down).
+ * @param phase_ms Delay of each LED after the one before, in ms (0: all the LEDs pulse together; e.g. period_ms / led count for a running light).
+ * @return True if the effect is playing (see ws2812b_effect_play).
+ */
+bool ws2812b_effect_pulse(ws2812b_strip_t *strip, uint8_t r, uint8_t g, uint8_t b, uint32_t period_ms, uint32_t phase_ms)
+{
+    ws2812b_keyframe_t pulse[] = {
+        {period_ms / 2, r, g, b},
+        {period_ms - period_ms / 2, 0, 0, 0},
+    };
+    return ws2812b_effect_play(strip, pulse, 2, true, phase_ms);
+}
+
+#pragma endregion
+
+#pragma region command functions
+
+/**
+ * @brief Read a time of a command, in ms.
+ *
+ * @param text The token (NULL if the command has no more).
+ * @param ms Set to the time.
+ * @return True if the token is a number of ms.
+ */
+static bool ws2812b_parse_ms(const char *text, uint32_t *ms)
+{
+    if ((text == NULL) || (*text < '0') || (*text > '9'))
+    {
+        return false;
+    }
+    char *end;
+    errno = 0;
+    unsigned long value = strtoul(text, &end, 10);
+    if ((*end != '\0') || (errno == ERANGE) || (value > UINT32_MAX))
+    {
+        return false;
+    }
+    *ms = (uint32_t)value;
+    return true;
+}
+
+/**
+ * @brief Read a colour of a command (RRGGBB), on the 0-255 scale of the keyframes.
+ *
+ * @param text The token (NULL if the command has no more).
+ * @param keyframe Set to the colour.
+ * @return True if the token is 6 hexadecimal digits.
+ *
+ * @note Not read with hexToRGB: with WS2812B_USE_100_SCALE it gives 0-100, and a command colour would then be darker
+ *       than the same colour in a built-in effect (e.g. "fade FFDDAA" against the end of the sunrise).
+ */
+static bool ws2812b_parse_color(const char *text, ws2812b_keyframe_t *keyframe)
+{
+    if ((text == NULL) || (strlen(text) != 6) || (strspn(text, "0123456789abcdefABCDEF") != 6))
+    {
+        return false;
+    }
+    unsigned long rgb = strtoul(text, NULL, 16);
+    keyframe->r = (uint8_t)(rgb >> 16);
+    keyframe->g = (uint8_t)(rgb >> 8);
+    keyframe->b = (uint8_t)rgb;
+    return true;
+}
+
+/**
+ * @brief Start or stop an effect on a strip from a text command (e.g. the payload of an MQTT message).
+ *
+ * @param strip The strip.
+ * @param command The null-terminated command, one of:
+ *        "stop"
+ *        "fade <RRGGBB> <ms>"
+ *        "sunrise <ms>"
+ *        "sunset <ms>"
+ *        "pulse <RRGGBB> <period ms> [<phase ms>]"
+ *        "timeline [loop] [phase <ms>] <ms> <RRGGBB> [<ms> <RRGGBB> ...]" (up to WS2812B_EFFECT_MAX_KEYFRAMES keyframes, see ws2812b_effect_play)
+ * @return True if the command was valid and applied; False otherwise (a message is printed, the effect playing is left alone).
+ *
+ * @note The colours are on the 0-255 scale of the keyframes and the built-in effects, whatever the scale of the set_*_hex functions.
+ */
+bool ws2812b_effect_command(ws2812b_strip_t *strip, const char *command)
+{
+    static const char separators[] = " \t\r\n";
+    char buffer[WS2812B_EFFECT_COMMAND_SIZE];
+    char *saveptr = NULL;
+
+    if ((strip == NULL) || (command == NULL) || (strlen(command) >= sizeof(buffer)))
+    {
+        printf("WS2812B: invalid effect command\n");
+        return false;
+    }
+    strcpy(buffer, command);
+
+    const char *name = strtok_r(buffer, separators, &saveptr);
+    ws2812b_keyframe_t keyframes[WS2812B_EFFECT_MAX_KEYFRAMES];
+    uint32_t count = 0;
+    uint32_t ms = 0;
+    uint32_t phase_ms = 0;
+    bool loop = false;
+    bool valid = false;
+    bool played = false;
+
+    if (name == NULL)
+    {
+        printf("WS2812B: empty effect command\n");
+        return false;
+    }
+
+    if (strcmp(name, "stop") == 0)
+    {
+        valid = (strtok_r(NULL, separators, &saveptr) == NULL);
+        if (valid)
+        {
+            ws2812b_effect_stop(strip);
+            played = true;
+        }
+    }
+    else if (strcmp(name, "fade") == 0)
+    {
+        valid = ws2812b_parse_color(strtok_r(NULL, separators, &saveptr), &keyframes[0]) &&
+                ws2812b_parse_ms(strtok_r(NULL, separators, &saveptr), &ms) &&
+                (strtok_r(NULL, separators, &saveptr) == NULL);
+        played = valid && ws2812b_effect_fade(strip, keyframes[0].r, keyframes[0].g, keyframes[0].b, ms);
+    }
+    else if (strcmp(name, "sunrise") == 0)
+    {
+        valid = ws2812b_parse_ms(strtok_r(NULL, separators, &saveptr), &ms) &&
+                (strtok_r(NULL, separators, &saveptr) == NULL);
+        played = valid && ws2812b_effect_sunrise(strip, ms);
+    }
+    else if (strcmp(name, "sunset") == 0)
+    {
+        valid = ws2812b_parse_ms(strtok_r(NULL, separators, &saveptr), &ms) &&
+                (strtok_r(NULL, separators, &saveptr) == NULL);
+        played = valid && ws2812b_effect_sunset(strip, ms);
+    }
+    else if (strcmp(name, "pulse") == 0)
+    {
+        valid = ws2812b_parse_color(strtok_r(NULL, separators, &saveptr), &keyframes[0]) &&
+                ws2812b_parse_ms(strtok_r(NULL, separators, &saveptr), &ms);
+        const char *phase = strtok_r(NULL, separators, &saveptr);
+        valid = valid && ((phase == NULL) || (ws2812b_parse_ms(phase, &phase_ms) && (strtok_r(NULL, separators, &saveptr) == NULL)));
+        played = valid && ws2812b_effect_pulse(strip, keyframes[0].r, keyframes[0].g, keyframes[0].b, ms, phase_ms);
+    }
+    else if (strcmp(name, "timeline") == 0)
+    {
+        const char *token = strtok_r(NULL, separators, &saveptr);
+        if ((token != NULL) && (strcmp(token, "loop") == 0))
+        {
+            loop = true;
+            token = strtok_r(NULL, separators, &saveptr);
+        }
+        valid = true;
+        if ((token != NULL) && (strcmp(token, "phase") == 0))
+        {
+            valid = ws2812b_parse_ms(strtok_r(NULL, separators, &saveptr), &phase_ms);
+            token = strtok_r(NULL, separators, &saveptr);
+        }
+        // Then the keyframes, as pairs of a time and a colour.
+        while (valid && (token != NULL))
+        {
+            valid = (count < WS2812B_EFFECT_MAX_KEYFRAMES) &&
+                    ws2812b_parse_ms(token, &keyframes[count].duration_ms) &&
+                    ws2812b_parse_color(strtok_r(NULL, separators, &saveptr), &keyframes[count]);
+            count++;
+            token = strtok_r(NULL, separators, &saveptr);
+        }
+        valid = valid && (count > 0);
+        played = valid && ws2812b_effect_play(strip, keyframes, count, loop, phase_ms);
+    }
+
+    if (!valid)
+    {
+        printf("WS2812B: invalid effect command: %s\n", command);
+    }
+    return played;
+}
+
+#pragma endregion
+
+#pragma region initialization functions
+
+/**
+ * @brief Start the frame scheduler of the effects.
+ *
+ * @param fps Frames per second sent to the strips playing an effect (e.g. 30), up to 1000.
+ * @return True if the scheduler is running (or was already); False if fps is invalid or no timer is left (a message is printed).
+ *
+ * @note A negative delay is given to the timer, so the ticks are fps apart from start to start, however long a tick takes.
+ */
+bool ws2812b_effects_init(uint32_t fps)
+{
+    if (effects_running)
+    {
+        return true;
+    }
+    if ((fps == 0) || (fps > 1000))
+    {
+        printf("WS2812B: invalid frame rate: %u\n", fps);
+        return false;
+    }
+    if (!add_repeating_timer_us(-(int64_t)(1000000 / fps), ws2812b_effects_tick, NULL, &effects_timer))
+    {
+        printf("WS2812B: no timer left for the effects\n");
+        return false;
+    }
+    effects_running = true;
+    return true;
+}
+
+#pragma endregion
@@ -16,15 +16,22 @@
 
 #include "inf2004_credentials.h"
 #include "mqtt_Rebuilt.h"
+#include "json_writer.h"
+#include "flash_log.h"
 
 #include "scd4x_i2c.h"
 #include "sensirion_common.h"
 #include "sensirion_i2c_hal.h"
+#include "i2c_tools.h"
 
 // #define DEBUG
 
 #define SENSOR_READ_INTERVAL_MS 3000
+#define I2C_DIAG_INTERVAL_READS 10 // Number of sensor reads between two I2C diagnostics reports (DIAG topic)
 #define MQTT_PUBLISH_WAIT_MS 100
+#define REPLAY_MAX_QUEUED 4 // Samples kept in flash are only replayed while fewer messages than this are queued
+#define SAMPLE_BATCH_MAX_SAMPLES 10   // Samples sent in one message at most (see mqtt_batch_begin)
+#define SAMPLE_BATCH_MAX_AGE_MS 30000 // Time a sample waits for the rest of its batch at most
 #pragma region Non-Sensor Related stuff that you probably wouldnt care about
 
 #ifdef DEBUG
@@ -34,227 +41,293 @@
 #endif
 
 #define MQTT_BUFF_SIZE 1025 // 1024 + 1 for null terminator
+#define MQTT_TOPIC_SIZE 128 // Longest topic + 1 for null terminator
+#define MQTT_INBOX_SIZE 256 // Largest incoming payload + 1 for null terminator
 
 #pragma region MQTT and Network Utilities
 
-static char MQTT_PUB_TOPIC_BUFFER[MQTT_BUFF_SIZE];
 static char MQTT_PUB_PAYLOAD_BUFFER[MQTT_BUFF_SIZE];
 
-static u32_t payload_total_len = 0;
-static u8_t payload_buffer[MQTT_BUFF_SIZE];
-static u8_t topic_buffer[MQTT_BUFF_SIZE];
-static u8_t payload_cpy_index = 0;
+static u8_t mqtt_inbox_arena[MQTT_INBOX_SIZE]; // Incoming messages, reassembled by the MQTT library (see process_incoming_message)
 
 #define MQTT_TOTAL_SUB_TOPICS 1
 #define MQTT_TOTAL_PUB_TOPICS 1
-static char MQTT_SUB_TOPICS[MQTT_TOTAL_SUB_TOPICS][MQTT_BUFF_SIZE] = {MQTT_CLIENT_ID "/CMD"};
-static char MQTT_PUB_TOPICS[MQTT_TOTAL_PUB_TOPICS][MQTT_BUFF_SIZE] = {MQTT_CLIENT_ID};
+static char MQTT_SUB_TOPICS[MQTT_TOTAL_SUB_TOPICS][MQTT_TOPIC_SIZE] = {MQTT_CLIENT_ID "/CMD"};
+static char MQTT_PUB_TOPICS[MQTT_TOTAL_PUB_TOPICS][MQTT_TOPIC_SIZE] = {MQTT_CLIENT_ID};
 
 #pragma region MQTT incoming data functions
 /**
  * @brief Callback function for processing incoming MQTT messages.
  * Prints the received topic and payload.
  */
-static void process_incoming_message()
+static void process_incoming_message(const char *topic, const u8_t *payload, u32_t len, void *arg)
 {
     printf("New MQTT message received!\n");
-    printf("%s[%d]: %s\n", topic_buffer, payload_cpy_index, payload_buffer);
+    printf("%s[%u]: %s\n", topic, (unsigned int)len, (const char *)payload);
     // do stuff here. maybe use a switch case to handle different topics,
     // and then based on the topic, do different things based on the payload value
 }
 
-// You'll need 2 functions to handle incoming messages
-// 1. mqtt_incoming_notification_cb
-// 2. mqtt_incoming_payload_cb
-// The first function is called when a new message is received.
-// This function will tell you the topic and the total length of the message.
-// The second function will then be called only if the payload is not empty.
-// This function will be called multiple times until the entire payload is received.
-//
 /**
- * @brief Callback function for MQTT notifications.
- * Handles the incoming topic and sets up the payload buffers.
+ * @brief Subscribes to all predefined MQTT topics.
  */
-static void mqtt_notify(void *arg, const char *topic, u32_t tot_len)
+static void mqtt_subscribe_to_all_topics()
 {
-    DEBUG_printf("Incoming topic: '%s', total length: %u\n", topic, (unsigned int)tot_len);
-
-    if (strlen(topic) > MQTT_BUFF_SIZE)
+    for (int i = 0; i < MQTT_TOTAL_SUB_TOPICS; i++)
     {
-        DEBUG_printf("Error: incoming topic does not fit in buffer. Data discarded\n");
-        payload_total_len = 0;
-        return;
+        mqtt_subscribe_topic(MQTT_SUB_TOPICS[i], SUB);
+        printf("Subscribed to topic: %s\n", MQTT_SUB_TOPICS[i]);
     }
-    if (tot_len > MQTT_BUFF_SIZE)
+}
+#pragma endregion
+
+#pragma region MQTT publish section
+
+// Time spent reading the sensor since the last I2C diagnostics report, in microseconds.
+static uint64_t sensorReadUs = 0;
+
+/**
+ * @brief Publishes sensor data to MQTT.
+ * Publishes the provided JSON string to the specified topic.
+ */
+static void publishSensorData(const char *sensorName, const char *JsonString)
+{
+    char topic[MQTT_TOPIC_SIZE];
+
+    // Construct the topic: clientid/sensorname
+    snprintf(topic, MQTT_TOPIC_SIZE, "%s/%s", MQTT_CLIENT_ID, sensorName);
+    if (mqtt_batch_add(topic, JsonString) != ERR_OK)
     {
-        DEBUG_printf("Error: incoming payload does not fit in buffer. Data discarded\n");
-        payload_total_len = 0;
+        printf("Failed to queue for topic: %s, message: %s\n", topic, JsonString);
         return;
     }
-    memcpy(topic_buffer, topic, strlen(topic));
-    payload_total_len = tot_len;
-    payload_cpy_index = 0;
-    if (payload_total_len == 0)
-    {
-        // If the payload is empty, then erase the payload buffer
-        // And then call the process_incoming_message() function
-        //  since when there is no payload, the mqtt_read_payload() function will not be called
-        //  and thus the process_incoming_message() function will not be called as well
-        // So we have to call it manually here instead.
-        memset(payload_buffer, 0, MQTT_BUFF_SIZE);
-        process_incoming_message();
-    }
+    printf("Queued for topic: %s, message: %s\n", topic, JsonString);
 }
 
 /**
- * @brief Callback function for reading MQTT payload.
- * Appends payload data to the buffer and processes the message when complete.
+ * @brief Publishes a sensor sample, or keeps it in flash while the MQTT server is unreachable.
+ *
+ * The samples kept in flash are replayed once the connection is back (see replayStoredSample),
+ * so the samples taken during a broker or Wi-Fi outage are not lost.
+ *
+ * @param sensorName The name of the sensor for which data is being published.
+ * 
+ * @param JsonString A JSON-formatted string containing the sensor data to be published.
+ * 
+ * @return void
  */
-static void mqtt_read_payload(void *arg, const u8_t *data, u16_t len, u8_t flags)
+static void publishSensorSample(const char *sensorName, const char *JsonString)
 {
-    if (payload_total_len > 0)
+    uint8_t record[FLASH_LOG_MAX_DATA];
+    size_t nameLen = strlen(sensorName) + 1;
+    size_t jsonLen = strlen(JsonString);
+
+    if (mqtt_is_connected())
+    {
+        publishSensorData(sensorName, JsonString);
+        return;
+    }
+
+    // The record holds the sensor name (null terminated) followed by the JSON string
+    if (nameLen + jsonLen > sizeof(record))
     {
-        payload_total_len -= len;
-        memcpy(&payload_buffer[payload_cpy_index], data, len);
-        payload_cpy_index += len;
+        printf("Sample too large to be kept in flash, dropped: %s\n", JsonString);
+        return;
+    }
+    memcpy(record, sensorName, nameLen);
+    memcpy(&record[nameLen], JsonString, jsonLen);
 
-        if (payload_total_len == 0)
-        {
-            payload_buffer[payload_cpy_index] = 0;
-            DEBUG_printf("Message Received [%d]:%s\n", payload_cpy_index, payload_buffer);
-            process_incoming_message();
-        }
+    // Timestamped with the time since boot in ms, the boot count is kept by the log (see flash_log_getBoot)
+    if (!flash_log_append(0, (uint32_t)(time_us_64() / 1000), record, nameLen + jsonLen))
+    {
+        printf("Failed to keep the sample in flash: %s\n", JsonString);
+        return;
     }
+    printf("Kept in flash until the connection is back: %s, message: %s\n", sensorName, JsonString);
 }
 
 /**
- * @brief Subscribes to all predefined MQTT topics.
+ * @brief Queues a replayed sample, written into the room reserved for it in the outbound queue (see replayStoredSample).
+ *
+ * @param complete True if the sample fitted in the room reserved.
+ *
+ * @param len The length of the message.
+ *
+ * @return True if the sample is done with (queued, or dropped as it can never fit), False to try again later.
  */
-static void mqtt_subscribe_to_all_topics()
+static bool commitStoredSample(bool complete, size_t len)
 {
-    for (int i = 0; i < MQTT_TOTAL_SUB_TOPICS; i++)
+    if (!complete)
     {
-        mqtt_subscribe_topic(MQTT_SUB_TOPICS[i], SUB);
-        printf("Subscribed to topic: %s\n", MQTT_SUB_TOPICS[i]);
+        mqtt_outbox_cancel();
+        printf("Replayed sample too large for its message, dropped\n");
+        return true;
     }
+    return mqtt_outbox_commit(len) == ERR_OK;
 }
-#pragma endregion
-
-#pragma region MQTT publish section
 
 /**
- * @brief Publishes sensor data to MQTT in JSON format.
- * Constructs the JSON message and publishes it to the specified topic.
+ * @brief Replays a sample kept in flash to the <sensorName>/LOG topic (callback of flash_log_replay).
+ *
+ * The sample is wrapped with the time it was taken, e.g. {"boot":3,"ms":123456,"data":{...}}
+ * (time since boot in ms, of the boot number "boot"), so it can be told apart from the live samples.
+ *
+ * @param record The record of the sample.
+ * 
+ * @param arg Unused.
+ * 
+ * @return True if the sample has been queued, False to try again later (the outbound queue is busy).
  */
-static void publishSensorDataFormatToJson(const char *sensorName, char *valueNames[], char *sensorValues[], size_t numValues)
+static bool replayStoredSample(const flash_log_record_t *record, void *arg)
 {
-    char topic[MQTT_BUFF_SIZE];
-    char jsonMessage[MQTT_BUFF_SIZE];
-
-    // Construct the topic: clientid/sensorname
-    snprintf(topic, MQTT_BUFF_SIZE, "%s/%s", MQTT_CLIENT_ID, sensorName);
-
-    // Construct the JSON message
-    snprintf(jsonMessage, MQTT_BUFF_SIZE, "{");
-
-    for (size_t i = 0; i < numValues; ++i)
+    char topic[MQTT_TOPIC_SIZE];
+    const char *sensorName = (const char *)record->data;
+    size_t nameLen = strnlen(sensorName, record->len);
+    // Room for the sample and its wrapping, written straight into the outbound queue
+    u16_t maxLen = record->len + 64;
+
+    // Leave room in the outbound queue for the live samples
+    if (mqtt_outbox_count() >= REPLAY_MAX_QUEUED)
     {
-        // Add the valueName and sensorValue to the JSON message
-        strcat(jsonMessage, "\"");
-        strcat(jsonMessage, valueNames[i]);
-        strcat(jsonMessage, "\":\"");
-        strcat(jsonMessage, sensorValues[i]);
-        strcat(jsonMessage, "\"");
-
-        // Add a comma if not the last element
-        if (i < numValues - 1)
-        {
-            strcat(jsonMessage, ",");
-        }
+        return false;
     }
 
-    strcat(jsonMessage, "}");
-
-    // Print or send the JSON message
-    printf("Topic: %s\n", topic);
-    printf("JSON Message: %s\n", jsonMessage);
+    // Not a sample record (no sensor name), nothing to replay
+    if (nameLen >= record->len)
+    {
+        return true;
+    }
 
-    if (mqtt_publish_data(topic, jsonMessage) != ERR_OK)
+    snprintf(topic, MQTT_TOPIC_SIZE, "%s/%s/LOG", MQTT_CLIENT_ID, sensorName);
+    char *payload = mqtt_outbox_reserve(topic, maxLen);
+    if (payload == NULL)
     {
-        printf("Failed to publish to topic: %s, message: %s\n", topic, jsonMessage);
-        return;
+        // Not enough free room in the outbound queue, the reservation never drops the messages queued
+        return false;
     }
-    printf("Published to topic: %s, message: %s\n", topic, jsonMessage);
+    json_writer_t json;
+    json_begin(&json, payload, maxLen + 1);
+    json_openObject(&json);
+    json_fieldUint(&json, "boot", record->boot);
+    json_fieldUint(&json, "ms", record->timestamp);
+    json_key(&json, "data");
+    json_putRaw(&json, sensorName + nameLen + 1, record->len - nameLen - 1);
+    json_closeObject(&json);
+    return commitStoredSample(json_isOk(&json), json_getLength(&json));
 }
 
 /**
- * @brief Publishes sensor data to MQTT.
- * Publishes the provided JSON string to the specified topic.
+ * @brief Publishes the I2C diagnostics of the last few reads to the DIAG topic, then starts a new trace window.
+ *
+ * The payload holds the time spent reading the sensor (driver delays included) and the I2C trace summary
+ * (time spent on the bus, per-device latency histograms, see i2c_tools_formatDiagnostics), e.g.
+ * {"sensorReadUs":2250,"i2c":{"windowUs":30000000,"busUs":2250,"dev":[...]}}
+ * so the share of each cycle spent on the bus versus in the driver's busy-waits can be told apart.
+ *
+ * @param bus Pointer to the I2C bus handle of the sensor.
+ *
+ * @return void
  */
-static void publishSensorData(const char *sensorName, const char *JsonString)
+static void publishI2CDiagnostics(i2c_tools_bus_t *bus)
 {
-    char topic[MQTT_BUFF_SIZE];
-
-    // Construct the topic: clientid/sensorname
-    snprintf(topic, MQTT_BUFF_SIZE, "%s/%s", MQTT_CLIENT_ID, sensorName);
-    if (mqtt_publish_data(topic, JsonString) != ERR_OK)
+    char topic[MQTT_TOPIC_SIZE];
+    json_writer_t json;
+    size_t room;
+
+    // Liveness of the MQTT session, measured by the library (keepalive round trip, signal strength)
+    mqtt_liveness_t liveness;
+    mqtt_get_liveness(&liveness);
+
+    // Written straight into the free room of the outbound queue, the unused room is given back on commit.
+    // The report is skipped if the queue is too full: it never pushes the queued samples out.
+    snprintf(topic, MQTT_TOPIC_SIZE, "%s/DIAG", MQTT_CLIENT_ID);
+    char *message = mqtt_outbox_reserve(topic, MQTT_BUFF_SIZE - 1);
+    if (message == NULL)
     {
-        printf("Failed to publish to topic: %s, message: %s\n", topic, JsonString);
-        return;
+        printf("Outbound queue full, skipped topic: %s\n", topic);
     }
-    printf("Published to topic: %s, message: %s\n", topic, JsonString);
+    else
+    {
+        json_begin(&json, message, MQTT_BUFF_SIZE);
+        json_openObject(&json);
+        json_fieldUint(&json, "sensorReadUs", sensorReadUs);
+        json_key(&json, "i2c");
+        char *i2cJson = json_beginRaw(&json, &room);
+        json_endRaw(&json, i2c_tools_formatDiagnostics(bus, i2cJson, room));
+        json_fieldInt(&json, "rssi", liveness.rssi);
+        json_fieldUint(&json, "pingRttUs", liveness.ping_rtt_us);
+        json_closeObject(&json);
+
+        if (json_isOk(&json) && (mqtt_outbox_commit(json_getLength(&json)) == ERR_OK))
+        {
+            printf("Queued for topic: %s, message: %s\n", topic, message);
+        }
+        else
+        {
+            mqtt_outbox_cancel();
+            printf("Diagnostics too large for topic: %s, dropped\n", topic);
+        }
+    }
+
+#ifdef DEBUG
+    i2c_tools_dumpTrace(bus);
+#endif
+
+    // Start a new window
+    i2c_tools_clearTrace(bus);
+    sensorReadUs = 0;
 }
 #pragma endregion
-/**
- * @brief Prints the IPv4 address.
- * Extracts and prints individual octets from the provided address.
- */
-static void printIPv4Address(unsigned int addr)
-{
-    // Extracting individual octets
-    unsigned char octet4 = (addr >> 24) & 0xFF;
-    unsigned char octet3 = (addr >> 16) & 0xFF;
-    unsigned char octet2 = (addr >> 8) & 0xFF;
-    unsigned char octet1 = addr & 0xFF;
-
-    // Printing the IPv4 address
-    printf("%u.%u.%u.%u\n", octet1, octet2, octet3, octet4);
-}
-
 #pragma endregion
 
 #pragma endregion
 /**
- * @brief Handles MQTT reconnection.
- * Attempts to reconnect to the MQTT server in case of a failure.
- * Publishes the online status and subscribes to all topics upon successful reconnection.
+ * @brief Called by the MQTT library every time the broker accepts the connection (see mqtt_conn_poll).
+ *
+ * Subscribes to all predefined MQTT topics using `mqtt_subscribe_to_all_topics` (the incoming messages
+ * are handed to `process_incoming_message` by the library). The online status is published once per session by the library.
+ * The connection itself (Wi-Fi, DNS, broker) is made and retried with backoff by `mqtt_conn_poll`, from the main loop.
+ *
+ * @param arg Unused.
+ *
+ * @return void
  */
-void mqtt_reconnect()
+static void mqtt_on_connected(void *arg)
 {
-    while (mqtt_begin_connection() != ERR_OK)
-    {
-        printf("Failed to connect to MQTT server. Retrying in 5 seconds...\n");
-        sleep_ms(5000);
-    }
-    printf("Connected to MQTT server.\n");
-    // set our custom callback functions
-    set_mqtt_subscribe_callback(mqtt_notify, mqtt_read_payload, NULL);
-    // publish our online status
-    mqtt_publish_data(MQTT_PUB_TOPICS[0], "ONLINE");
     // subscribe to all topics
     mqtt_subscribe_to_all_topics();
 }
+
+/**
+ * @brief Called by the MQTT library when the MQTT session ends (see mqtt_conn_set_disconnected_callback).
+ *
+ * The broker publishes the OFFLINE will message on its own, and the library reconnects with backoff.
+ *
+ * @param reason Why the session ended.
+ *
+ * @param arg Unused.
+ *
+ * @return void
+ */
+static void mqtt_on_disconnected(const char *reason, void *arg)
+{
+    printf("MQTT session ended (%s), the samples are kept in flash until it is back.\n", reason);
+}
+
 // Function to read spectral data for sensors 1 to 8 and publish to MQTT, based on timer
 /**
  * @brief Reads sensor data and publishes it to MQTT.
  * Checks if the sensor data is ready, reads the data, and publishes it to MQTT.
- * Handles MQTT reconnection if necessary.
+ * The connection to MQTT is kept up by mqtt_conn_poll, from the main loop.
  */
 void readSensorDataAndPublish()
 {
     bool data_ready_flag = false;
     int16_t error = 0;
+    // The sensor reads are timed, see publishI2CDiagnostics
+    uint64_t readStart = time_us_64();
     error = scd4x_get_data_ready_flag(&data_ready_flag);
+    sensorReadUs += time_us_64() - readStart;
     if (error)
     {
         printf("Error executing scd4x_get_data_ready_flag(): %i\n", error);
@@ -265,7 +338,9 @@ void readSensorDataAndPublish()
         uint16_t co2;
         int32_t temperature;
         int32_t humidity;
+        readStart = time_us_64();
         error = scd4x_read_measurement(&co2, &temperature, &humidity);
+        sensorReadUs += time_us_64() - readStart;
         if (error)
         {
             printf("Error executing scd4x_read_measurement(): %i\n", error);
@@ -276,20 +351,16 @@ void readSensorDataAndPublish()
             printf("Invalid sample detected, skipping.\n");
             return;
         }
-        // Check if MQTT is connected by publishing "ONLINE" to the MQTT server
-        if (mqtt_publish_data(MQTT_PUB_TOPICS[0], "ONLINE") != ERR_OK)
-        {
-            printf("MQTT Server disconnected. Reconnecting...\n");
-            mqtt_reconnect();
-        }
-
         // Publish the CO2, temperature and humidity to MQTT
-        snprintf(MQTT_PUB_PAYLOAD_BUFFER, MQTT_BUFF_SIZE, "{\"CO2\":%u,\"Temperature\":%d,\"Humidity\":%d}",
-                 co2,
-                 temperature,
-                 humidity);
-
-        publishSensorData("SCD41", MQTT_PUB_PAYLOAD_BUFFER);
+        json_writer_t json;
+        json_begin(&json, MQTT_PUB_PAYLOAD_BUFFER, MQTT_BUFF_SIZE);
+        json_openObject(&json);
+        json_fieldUint(&json, "CO2", co2);
+        json_fieldInt(&json, "Temperature", temperature);
+        json_fieldInt(&json, "Humidity", humidity);
+        json_closeObject(&json);
+
+        publishSensorSample("SCD41", MQTT_PUB_PAYLOAD_BUFFER);
     }
 }
 
@@ -303,6 +374,9 @@ int main()
     stdio_init_all();
     sensirion_i2c_hal_init();
 
+    // Same bus handle as the one set up by the Sensirion HAL (i2c_tools keeps one per controller)
+    i2c_tools_bus_t *bus = i2c_tools_init(i2c0, PICO_DEFAULT_I2C_SDA_PIN, PICO_DEFAULT_I2C_SCL_PIN);
+
     // Clean up potential SCD40 states
     scd4x_wake_up();
     scd4x_stop_periodic_measurement();
@@ -339,22 +413,13 @@ int main()
 
     cyw43_arch_enable_sta_mode();
 
-    printf("Connecting to '%s' using '%s' \n", WIFI_SSID, WIFI_PASSWORD);
-    if (cyw43_arch_wifi_connect_timeout_ms(WIFI_SSID, WIFI_PASSWORD, CYW43_AUTH_WPA2_AES_PSK, 30000))
-    {
-        printf("Error connecting to Wi-Fi\n");
-        return 1;
-    }
-    else
-    {
-        printf("Connected to Wi-Fi.\n");
-        cyw43_arch_lwip_begin();
-        printf("Assigned IP address: ");
-        printIPv4Address(cyw43_state.netif[0].ip_addr.addr);
-        printf("\n");
-        cyw43_arch_lwip_end();
-    }
+    // Joined from the main loop by the MQTT library, without waiting for it (see mqtt_conn_poll)
+    mqtt_conn_set_wifi(WIFI_SSID, WIFI_PASSWORD, CYW43_AUTH_WPA2_AES_PSK);
 #pragma endregion
+
+    // Keep the Wi-Fi stack serviced while the sensor's I2C transfers are in flight
+    i2c_tools_setIdleCallback(cyw43_arch_poll);
+
 #pragma region MQTT setup
     set_mqtt_config(
         MQTT_SERVER_ADDR,
@@ -370,21 +435,46 @@ int main()
         MQTT_WILL_QOS,
         MQTT_WILL_RETAIN);
 
+    // Samples taken while the MQTT server is unreachable are kept in flash (see publishSensorSample)
+    printf("%u samples kept in flash waiting to be replayed\n", (unsigned)flash_log_begin());
+
     mqtt_client_init();
-    mqtt_reconnect();
+    mqtt_inbox_set_message_callback(mqtt_inbox_arena, sizeof(mqtt_inbox_arena), process_incoming_message, NULL);
+    mqtt_conn_set_connected_callback(mqtt_on_connected, NULL);
+    mqtt_conn_set_disconnected_callback(mqtt_on_disconnected, NULL);
+
+    // The samples go out in batches, one message for up to SAMPLE_BATCH_MAX_SAMPLES samples (see publishSensorData).
+    // The DIAG reports are not batched.
+    mqtt_batch_begin(MQTT_CLIENT_ID "/SCD41", SAMPLE_BATCH_MAX_SAMPLES, SAMPLE_BATCH_MAX_AGE_MS, 0);
 
 #pragma endregion
 
 #pragma region Main loop
 
     uint64_t nextTimeToReadSensor = 0;
+    int readsSinceDiag = 0; // Number of sensor reads since the last I2C diagnostics report
     while (1)
     {
         if (nextTimeToReadSensor < time_us_64())
         {
             readSensorDataAndPublish();
             nextTimeToReadSensor = time_us_64() + SENSOR_READ_INTERVAL_MS * 1000;
+
+            // Report the I2C diagnostics every few reads
+            if (++readsSinceDiag >= I2C_DIAG_INTERVAL_READS)
+            {
+                publishI2CDiagnostics(bus);
+                readsSinceDiag = 0;
+            }
+        }
+        mqtt_conn_poll(); // Connect to the broker, and reconnect with backoff, without blocking the sensor reads
+        // Replay the samples kept in flash during an outage, at the replay rate of the log
+        if (mqtt_is_connected())
+        {
+            flash_log_replay(replayStoredSample, NULL);
         }
+        mqtt_batch_poll();  // Queue the batches whose first sample is SAMPLE_BATCH_MAX_AGE_MS old
+        mqtt_outbox_poll(); // Publish the queued messages, as far as the broker keeps up
         cyw43_arch_poll();
         sleep_ms(10);
     }
@@ -37,13 +37,19 @@
 #include <stdio.h>
 #include "pico/stdlib.h"
 #include "hardware/i2c.h"
+#include "i2c_tools.h"
 
 #define I2C_PORT i2c0
-#define I2C_FREQ 100000
-#define I2C_TIMEOUT 1000
 #define I2C_SDA_PIN PICO_DEFAULT_I2C_SDA_PIN
 #define I2C_SCL_PIN PICO_DEFAULT_I2C_SCL_PIN
 
+// The SCD4x supports Fast-mode, the other devices on the bus keep their own clock (see i2c_tools_setDeviceClock)
+#define SCD4X_I2C_ADDRESS 0x62
+#define SCD4X_I2C_FREQ 400000
+
+// The I2C bus shared with the other sensors, set up by sensirion_i2c_hal_init
+static i2c_tools_bus_t *_bus;
+
 /*
  * INSTRUCTIONS
  * ============
@@ -64,9 +70,10 @@
  */
 int16_t sensirion_i2c_hal_select_bus(uint8_t bus_idx)
 {
-    /* TODO:IMPLEMENT or leave empty if all sensors are located on one single
-     * bus
+    /* Single-bus build: the SCD4x is always on the bus joined by sensirion_i2c_hal_init,
+     * so there is no other bus to select
      */
+    (void)bus_idx;
     return NOT_IMPLEMENTED_ERROR;
 }
 
@@ -76,12 +83,11 @@ int16_t sensirion_i2c_hal_select_bus(uint8_t bus_idx)
  */
 void sensirion_i2c_hal_init(void)
 {
-    /* TODO:IMPLEMENT */
-    i2c_init(I2C_PORT, I2C_FREQ);
-    gpio_set_function(I2C_SDA_PIN, GPIO_FUNC_I2C);
-    gpio_set_function(I2C_SCL_PIN, GPIO_FUNC_I2C);
-    gpio_pull_up(I2C_SDA_PIN);
-    gpio_pull_up(I2C_SCL_PIN);
+    // Join the bus through i2c_tools (returned untouched if another driver already started it),
+    // so the sensor can share it, and gets its own clock rather than the one of the whole bus
+    _bus = i2c_tools_init(I2C_PORT, I2C_SDA_PIN, I2C_SCL_PIN);
+    i2c_tools_setDeviceClock(_bus, SCD4X_I2C_ADDRESS, SCD4X_I2C_FREQ);
+    i2c_tools_begin(_bus);
 }
 
 /**
@@ -89,7 +95,33 @@ void sensirion_i2c_hal_init(void)
  */
 void sensirion_i2c_hal_free(void)
 {
-    /* TODO:IMPLEMENT or leave empty if no resources need to be freed */
+    /* The bus is shared with the other drivers, it is left running */
+}
+
+/**
+ * Performs one transfer while owning the bus.
+ * A single attempt is made (no retry policy): the Sensirion driver handles the errors itself,
+ * and the wake-up command of the SCD4x is expected to be NACKed.
+ *
+ * @returns 0 on success, PICO_ERROR_GENERIC otherwise
+ */
+static int8_t _transfer(uint8_t address, const uint8_t *tx, uint16_t txLen, uint8_t *rx, uint16_t rxLen)
+{
+    i2c_tools_xfer_t xfer;
+    uint8_t ret;
+
+    i2c_tools_lock(_bus);
+    if (i2c_tools_writeReadAsync(_bus, &xfer, address, tx, txLen, rx, rxLen, true, NULL, NULL))
+    {
+        ret = i2c_tools_waitTransfer(&xfer);
+    }
+    else
+    {
+        ret = xfer.result;
+    }
+    i2c_tools_unlock(_bus);
+
+    return ret ? PICO_ERROR_GENERIC : 0;
 }
 
 /**
@@ -104,12 +136,7 @@ void sensirion_i2c_hal_free(void)
  */
 int8_t sensirion_i2c_hal_read(uint8_t address, uint8_t *data, uint16_t count)
 {
-    /* TODO:IMPLEMENT */
-    if (i2c_read_blocking(I2C_PORT, address, data, count, false) == PICO_ERROR_GENERIC)
-    {
-        return PICO_ERROR_GENERIC;
-    }
-    return 0;
+    return _transfer(address, NULL, 0, data, count);
 }
 
 /**
@@ -125,11 +152,7 @@ int8_t sensirion_i2c_hal_read(uint8_t address, uint8_t *data, uint16_t count)
  */
 int8_t sensirion_i2c_hal_write(uint8_t address, const uint8_t *data, uint16_t count)
 {
-    if (i2c_write_blocking(I2C_PORT, address, data, count, false) == PICO_ERROR_GENERIC)
-    {
-        return PICO_ERROR_GENERIC;
-    }
-    return 0;
+    return _transfer(address, data, count, NULL, 0);
 }
 
 /**
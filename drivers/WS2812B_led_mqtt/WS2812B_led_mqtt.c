@@ -33,141 +33,87 @@
 #endif
 
 #define MQTT_BUFF_SIZE 1025 // 1024 + 1 for null terminator
-#define MQTT_TOTAL_SUBS 2   // Number of topics to subscribe to
+#define MQTT_INBOX_SIZE 256 // Largest incoming payload + 1 for null terminator
 
 #pragma region MQTT and Network Utilities
 
-static u32_t payload_total_len = 0;
-static u8_t payload_buffer[MQTT_BUFF_SIZE];
-static u8_t topic_buffer[MQTT_BUFF_SIZE];
-static u8_t payload_cpy_index = 0;
+static u8_t mqtt_inbox_arena[MQTT_INBOX_SIZE]; // Incoming messages, reassembled by the MQTT library (see process_incoming_message)
 
-static char topic_sub_list[MQTT_TOTAL_SUBS][MQTT_BUFF_SIZE] = {"MKPICO_LED_HEX", "EXTERNAL_LED_HEX"};
+/**
+ * @brief Handler of the MKPICO_LED_HEX topic: sets the Maker Pi Pico LED to the color of the payload (e.g. "FF8000").
+ */
+static void on_makerpico_led_hex(const char *topic, const u8_t *payload, u32_t len, void *arg)
+{
+    set_makerpico_led_hex((const char *)payload);
+    show_makerpico_led();
+}
+
+/**
+ * @brief Handler of the EXTERNAL_LED_HEX topic: sets the whole external strip to the color of the payload.
+ */
+static void on_external_led_hex(const char *topic, const u8_t *payload, u32_t len, void *arg)
+{
+    set_all_external_leds_hex((const char *)payload);
+    show_external_led();
+}
+
+/**
+ * @brief Handler of the messages no other handler takes.
+ */
+static void on_unknown_topic(const char *topic, const u8_t *payload, u32_t len, void *arg)
+{
+    printf("Unknown topic: %s\n", topic);
+}
 
 /**
  * @brief Processes incoming MQTT messages and performs actions based on topics and payloads.
  *
  * This function is responsible for handling incoming MQTT messages. It prints information about
- * the received message, including the topic and payload. Additionally, it performs specific actions
- * based on the topic and payload content. In this example, it checks for specific topics related to LED control
- * and sets the LED accordingly.
+ * the received message, including the topic and payload, and hands it to the handler of its topic
+ * (see the mqtt_router_add calls in main).
  */
-static void process_incoming_message()
+static void process_incoming_message(const char *topic, const u8_t *payload, u32_t len, void *arg)
 {
     printf("New MQTT message received!\n");
-    printf("%s[%d]: %s\n", topic_buffer, payload_cpy_index, payload_buffer);
-    // do stuff here. maybe use a switch case to handle different topics,
-    // and then based on the topic, do different things based on the payload value
-    // Here's an example of setting the onboard LED to a specific color
-
-    if (strcmp(topic_buffer, "MKPICO_LED_HEX") == 0)
-    {
-        set_makerpico_led_hex(payload_buffer);
-        show_makerpico_led();
-    }
-    else if (strcmp(topic_buffer, "EXTERNAL_LED_HEX") == 0)
-    {
-        set_all_external_leds_hex(payload_buffer);
-        show_external_led();
-    }
-    else
-    {
-        printf("Unknown topic: %s\n", topic_buffer);
-    }
+    printf("%s[%u]: %s\n", topic, (unsigned int)len, (const char *)payload);
+    mqtt_router_dispatch(topic, payload, len, NULL);
 }
 
-// You'll need 2 functions to handle incoming messages
-// 1. mqtt_incoming_notification_cb
-// 2. mqtt_incoming_payload_cb
-// The first function is called when a new message is received.
-// This function will tell you the topic and the total length of the message.
-// The second function will then be called only if the payload is not empty.
-// This function will be called multiple times until the entire payload is received.
-//
-static void mqtt_notify(void *arg, const char *topic, u32_t tot_len)
-{
-    DEBUG_printf("Incoming topic: '%s', total length: %u\n", topic, (unsigned int)tot_len);
+#pragma endregion
 
-    if (strlen(topic) > MQTT_BUFF_SIZE)
-    {
-        DEBUG_printf("Error: incoming topic does not fit in buffer. Data discarded\n");
-        payload_total_len = 0;
-        return;
-    }
-    if (tot_len > MQTT_BUFF_SIZE)
-    {
-        DEBUG_printf("Error: incoming payload does not fit in buffer. Data discarded\n");
-        payload_total_len = 0;
-        return;
-    }
-    memcpy(topic_buffer, topic, strlen(topic));
-    payload_total_len = tot_len;
-    payload_cpy_index = 0;
-    if (payload_total_len == 0)
-    {
-        // If the payload is empty, then erase the payload buffer
-        // And then call the process_incoming_message() function
-        //  since when there is no payload, the mqtt_read_payload() function will not be called
-        //  and thus the process_incoming_message() function will not be called as well
-        // So we have to call it manually here instead.
-        memset(payload_buffer, 0, MQTT_BUFF_SIZE);
-        process_incoming_message();
-    }
-}
+#pragma endregion
 
 /**
- * @brief Callback function for handling MQTT payload data.
+ * @brief Called by the MQTT library every time the broker accepts the connection (see mqtt_conn_poll).
  *
- * This function is called when MQTT payload data is received. It appends the received
- * data to a buffer, tracks the total payload length, and processes the complete message
- * once the entire payload is received.
+ * Subscribes to the LED topics (see mqtt_router_subscribe_all),
+ * and turns the Maker Pi Pico LED green.
  *
- * @param arg     Pointer to user-defined argument (may be NULL).
- * @param data    Pointer to the received payload data.
- * @param len     Length of the received payload data.
- * @param flags   Flags indicating additional information about the payload.
+ * @param arg Unused.
  */
-static void mqtt_read_payload(void *arg, const u8_t *data, u16_t len, u8_t flags)
+static void mqtt_on_connected(void *arg)
 {
-    if (payload_total_len > 0)
-    {
-        payload_total_len -= len;
-        memcpy(&payload_buffer[payload_cpy_index], data, len);
-        payload_cpy_index += len;
-
-        if (payload_total_len == 0)
-        {
-            payload_buffer[payload_cpy_index] = 0;
-            DEBUG_printf("Message Received [%d]:%s\n", payload_cpy_index, payload_buffer);
-            process_incoming_message();
-        }
-    }
+    mqtt_router_subscribe_all();
+    set_makerpico_led_hex("00FF00");
+    show_makerpico_led();
 }
 
 /**
- * @brief Prints an IPv4 address in human-readable format.
+ * @brief Called by the MQTT library when the MQTT session ends (see mqtt_conn_set_disconnected_callback).
+ *
+ * The broker publishes the OFFLINE will message on its own, and the library reconnects with backoff.
+ *
+ * @param reason Why the session ended.
  *
- * This function takes a 32-bit IPv4 address as input and prints its individual octets
- * in the format "X.X.X.X", where X represents the decimal value of each octet.
+ * @param arg Unused.
  *
- * @param addr  32-bit unsigned integer representing the IPv4 address.
+ * @return void
  */
-static void printIPv4Address(unsigned int addr)
+static void mqtt_on_disconnected(const char *reason, void *arg)
 {
-    // Extracting individual octets
-    unsigned char octet4 = (addr >> 24) & 0xFF;
-    unsigned char octet3 = (addr >> 16) & 0xFF;
-    unsigned char octet2 = (addr >> 8) & 0xFF;
-    unsigned char octet1 = addr & 0xFF;
-
-    // Printing the IPv4 address
-    printf("%u.%u.%u.%u\n", octet1, octet2, octet3, octet4);
+    printf("MQTT session ended (%s), reconnecting.\n", reason);
 }
 
-#pragma endregion
-
-#pragma endregion
-
 int main()
 {
     stdio_init_all();
@@ -192,25 +138,8 @@ int main()
     set_makerpico_led_hex("FF00FF");
     show_makerpico_led();
 
-    printf("Connecting to '%s' using '%s' \n", WIFI_SSID, WIFI_PASSWORD);
-    if (cyw43_arch_wifi_connect_timeout_ms(WIFI_SSID, WIFI_PASSWORD, CYW43_AUTH_WPA2_AES_PSK, 30000))
-    {
-        printf("Error connecting to Wi-Fi\n");
-        set_makerpico_led_hex("FF0000");
-        show_makerpico_led();
-        return 1;
-    }
-    else
-    {
-        printf("Connected to Wi-Fi.\n");
-        cyw43_arch_lwip_begin();
-        printf("Assigned IP address: ");
-        printIPv4Address(cyw43_state.netif[0].ip_addr.addr);
-        printf("\n");
-        cyw43_arch_lwip_end();
-        set_makerpico_led_hex("FFFF00");
-        show_makerpico_led();
-    }
+    // Joined from the main loop by the MQTT library, without waiting for it (see mqtt_conn_poll)
+    mqtt_conn_set_wifi(WIFI_SSID, WIFI_PASSWORD, CYW43_AUTH_WPA2_AES_PSK);
 #pragma endregion
 #pragma region MQTT setup
     set_mqtt_config(
@@ -228,28 +157,27 @@ int main()
         MQTT_WILL_RETAIN);
 
     mqtt_client_init();
-    while (mqtt_begin_connection() != ERR_OK)
-    {
-        printf("Failed to connect to MQTT server. Retrying in 5 seconds...\n");
-        set_makerpico_led_hex("FF0000");
-        show_makerpico_led();
-        sleep_ms(5000);
-        set_makerpico_led_hex("FFFF00");
-        show_makerpico_led();
-    }
-    printf("Connected to MQTT server.\n");
-    set_mqtt_subscribe_callback(mqtt_notify, mqtt_read_payload, NULL);
-    mqtt_publish_data(MQTT_CLIENT_ID, "ONLINE");
-    for (int i = 0; i < MQTT_TOTAL_SUBS; i++)
-    {
-        mqtt_subscribe_topic(topic_sub_list[i], SUB);
-    }
-    set_makerpico_led_hex("00FF00");
-    show_makerpico_led();
+    mqtt_inbox_set_message_callback(mqtt_inbox_arena, sizeof(mqtt_inbox_arena), process_incoming_message, NULL);
+    mqtt_router_add("MKPICO_LED_HEX", on_makerpico_led_hex, NULL);
+    mqtt_router_add("EXTERNAL_LED_HEX", on_external_led_hex, NULL);
+    mqtt_router_set_default(on_unknown_topic, NULL);
+    mqtt_conn_set_connected_callback(mqtt_on_connected, NULL);
+    mqtt_conn_set_disconnected_callback(mqtt_on_disconnected, NULL);
 #pragma endregion
 #pragma region Main loop
+    eMqttConnState lastState = mqtt_conn_get_state();
     while (1)
     {
+        // Connect to the broker, and reconnect with backoff. The LED is magenta while joining the Wi-Fi,
+        // yellow while connecting to the broker, red while waiting to retry, and green once connected (see mqtt_on_connected).
+        eMqttConnState state = mqtt_conn_poll();
+        if ((state != lastState) && (state != MQTT_CONN_SUBSCRIBING) && (state != MQTT_CONN_SUBSCRIBED))
+        {
+            set_makerpico_led_hex((state == MQTT_CONN_BACKOFF) ? "FF0000" : (state == MQTT_CONN_WIFI) ? "FF00FF" : "FFFF00");
+            show_makerpico_led();
+        }
+        lastState = state;
+        mqtt_outbox_poll(); // Publish the queued messages, as far as the broker keeps up
         cyw43_arch_poll();
         sleep_ms(10);
     }
@@ -18,22 +18,94 @@
 #include "lwip/pbuf.h"
 #include "lwip/tcp.h"
 #include "lwip/dns.h"
+#include "lwip/init.h"
 #include "lwip/apps/mqtt.h"
-#include "lwip/apps/mqtt_priv.h"
 #include "mqtt_Rebuilt.h"
 
+// The state of the lwIP MQTT client is private (mqtt_priv.h), and only read for the lwIP versions known to lay it out this way
+// (see mqtt_conn_lwip_connecting). Everything else goes through the public API of lwIP.
+#if (LWIP_VERSION_MAJOR == 2) && (LWIP_VERSION_MINOR <= 2)
+#define MQTT_LWIP_PRIV_STATE 1
+#include "lwip/apps/mqtt_priv.h"
+#else
+#define MQTT_LWIP_PRIV_STATE 0
+#endif
+
 #define MQTT_MESSAGE_BUFFER_SIZE 1024 // Max size of a single MQTT message
 
 #define MQTT_BUFF_SIZE MQTT_MESSAGE_BUFFER_SIZE + 1 // +1 for null terminator
 
-static u32_t payload_total_len = 0;         // Total length of the incoming payload
-static u8_t payload_buffer[MQTT_BUFF_SIZE]; // Buffer for the incoming payload
-static u8_t payload_cpy_index = 0;          // Index of the payload buffer to copy the next incoming payload byte to
-static bool ready_for_next_pubsub = true;   // Mutex variable to prevent new pub/subs from being called before the previous one is finished. Facilitates Atomicity.
-static mqtt_client_config_t mqtt_config;    // MQTT configuration struct
+#define MQTT_OUTPUT_WAIT_MS 1000 // Max time to wait for room in the lwIP output buffer before giving up on a request
+
+static mqtt_client_config_t mqtt_config; // MQTT configuration struct
 
 static MQTT_CLIENT_T *_mqtt_state = NULL; // current MQTT state struct
 
+/**
+ * @brief A publish/subscribe request waiting for the broker.
+ */
+typedef struct
+{
+    bool busy;                  // The slot holds a request in flight
+    u8_t generation;            // Bumped every time the slot is taken, so a late completion of a previous request is ignored
+    uint64_t queued_us;         // Time at which the request was handed to lwIP
+    mqtt_request_done_cb_t cb;  // Completion callback of the caller (can be NULL)
+    void *cb_arg;               // User argument passed to the completion callback
+} mqtt_inflight_slot_t;
+
+static mqtt_inflight_slot_t inflight_slots[MQTT_INFLIGHT_SLOTS]; // Requests in flight, replaces the single ready_for_next_pubsub flag
+static u8_t inflight_window = MQTT_INFLIGHT_SLOTS;                // Number of slots in use at most (see mqtt_set_inflight_window)
+static volatile u8_t inflight_count = 0;                          // Number of slots currently in use
+static mqtt_inflight_stats_t inflight_stats;                      // Statistics of the in-flight window
+
+// conn_state value of the lwIP MQTT client (private to lwIP's mqtt.c) once the TCP connection is open and the CONNECT sent.
+#define LWIP_MQTT_MQTT_CONNECTING 2
+
+static eMqttConnState conn_state = MQTT_CONN_BACKOFF;        // Stage of the connection (see mqtt_conn_poll)
+static uint64_t conn_deadline_us = 0;                        // End of the current stage (deadline, or end of the backoff delay)
+static u32_t conn_failed_attempts = 0;                       // Number of failed attempts since the connection was last up
+static u32_t conn_backoff_min_ms = MQTT_CONN_BACKOFF_MIN_MS; // Delay before the first retry
+static u32_t conn_backoff_max_ms = MQTT_CONN_BACKOFF_MAX_MS; // Largest delay between two attempts
+static u32_t conn_random = 0;                                // State of the random generator of the backoff jitter
+static volatile err_t conn_dns_status = ERR_OK;              // ERR_INPROGRESS while the DNS query runs, then its result
+static volatile u8_t conn_subs_pending = 0;                  // Subscriptions of the connected callback waiting for the broker
+static volatile bool conn_subs_failed = false;               // A subscription of the connected callback failed
+static volatile int conn_lwip_status = -1;                   // Latest status given to the connection callback of lwIP (-1: none since the connection was started)
+static const char *conn_wifi_ssid = NULL;                    // Access point joined by the Wi-Fi stage (NULL: joined by the application)
+static const char *conn_wifi_password = NULL;                // Password of the access point
+static u32_t conn_wifi_auth = 0;                             // Authentication type of the access point
+static mqtt_conn_connected_cb_t conn_connected_cb = NULL;    // Connected callback of the application
+static void *conn_connected_cb_arg = NULL;                   // User argument of the connected callback
+static mqtt_conn_stats_t conn_stats;                         // Statistics of the connection
+static mqtt_conn_disconnected_cb_t conn_disconnected_cb = NULL; // Disconnected callback of the application
+static void *conn_disconnected_cb_arg = NULL;                // User argument of the disconnected callback
+
+static mqtt_liveness_t liveness;                       // Liveness of the session (see mqtt_get_liveness)
+static bool liveness_online_pending = false;           // The online status of the session is still to be published
+static char liveness_ping_topic[MQTT_INBOX_TOPIC_LEN]; // Topic the pings are sent to, and come back from (<client id>/ping)
+static char liveness_ping_payload[12];                 // Payload of the latest ping, its sequence number
+static volatile bool liveness_ping_enabled = false;    // The pings come back: their topic is subscribed to, and goes through the library
+static bool liveness_ping_out = false;                 // A ping has been sent, and has not come back yet
+static u32_t liveness_ping_seq = 0;                    // Sequence number of the latest ping
+static uint64_t liveness_ping_us = 0;                  // Time at which the latest ping was sent
+static uint64_t liveness_next_ping_us = 0;             // Time of the next ping
+static uint64_t liveness_poll_us = 0;                  // Time of the previous poll
+static volatile bool liveness_echo_incoming = false;   // The incoming message is a ping coming back (see mqtt_incoming_payload_cb)
+static volatile uint64_t liveness_echo_us = 0;         // Time at which the latest ping came back (0: not yet)
+static volatile uint64_t liveness_heard_us = 0;        // Time at which the broker was last heard from
+static uint64_t liveness_rssi_us = 0;                  // Time of the next RSSI reading
+
+static char inbox_topic[MQTT_INBOX_TOPIC_LEN];          // Topic of the incoming message (lwIP only passes it to the notification callback)
+static u32_t inbox_total_len = 0;                       // Total length of the incoming payload
+static u32_t inbox_received = 0;                        // Number of payload bytes received so far
+static bool inbox_active = false;                       // An incoming message is being received (not dropped, not complete yet)
+static mqtt_inbox_chunk_cb_t inbox_chunk_cb = NULL;     // Chunk callback of the application (chunk mode)
+static mqtt_inbox_message_cb_t inbox_message_cb = NULL; // Message callback of the application (reassembly mode)
+static void *inbox_cb_arg = NULL;                       // User argument of the inbox callback
+static u8_t *inbox_arena = NULL;                        // Arena the messages are reassembled into (reassembly mode)
+static u32_t inbox_arena_size = 0;                      // Size of the arena, null terminator included
+static mqtt_inbox_stats_t inbox_stats;                  // Statistics of the inbox
+
 #define DEBUG
 
 // If DEBUG is defined, then printf statements will be enabled
@@ -49,10 +121,11 @@ static MQTT_CLIENT_T *_mqtt_state = NULL; // current MQTT state struct
 /**
  * @brief Callback function for DNS resolution completion.
  *
- * This function is called when DNS resolution is completed.
+ * This function is called when DNS resolution is completed, successfully or not.
+ * The connection state machine picks the result up on its next poll (see mqtt_conn_poll).
  *
  * @param name - The domain name that was resolved.
- * @param ipaddr - Pointer to the resolved IP address structure (ip_addr_t).
+ * @param ipaddr - Pointer to the resolved IP address structure (ip_addr_t), NULL if the name could not be resolved.
  * @param callback_arg - Pointer to user-defined data passed during DNS query initiation.
  *
  * @note As this is a callback function used by dns_gethostbyname(), there is no reason this function
@@ -61,23 +134,35 @@ static MQTT_CLIENT_T *_mqtt_state = NULL; // current MQTT state struct
 static void dns_found(const char *name, const ip_addr_t *ipaddr, void *callback_arg)
 {
     MQTT_CLIENT_T *state = (MQTT_CLIENT_T *)callback_arg;
+
+    if (ipaddr == NULL)
+    {
+        DEBUG_printf("DNS query for %s failed.\n", name);
+        conn_dns_status = ERR_ARG;
+        return;
+    }
     DEBUG_printf("DNS query finished with resolved addr of %s.\n", ip4addr_ntoa(ipaddr));
     state->remote_addr = *ipaddr;
+    conn_dns_status = ERR_OK;
 }
 
 /**
- * @brief Initiates DNS lookup for the given MQTT server domain name.
+ * @brief Starts a DNS lookup for the given MQTT server domain name, without waiting for it.
  *
  * This function runs a DNS query to resolve the IP address of the MQTT server domain name.
- * It utilizes asynchronous DNS resolution and a callback function for handling the result.
+ * It utilizes asynchronous DNS resolution and a callback function for handling the result:
+ * conn_dns_status stays ERR_INPROGRESS until dns_found() is called.
  *
  * @param state - Pointer to the MQTT client state structure.
  * @param mqtt_server_domain_name - The domain name of the MQTT server to look up.
+ * @return err_t - ERR_OK if the address was already known (cached, or an IP address), ERR_INPROGRESS if the query has been sent,
+ * an error code otherwise.
  */
-static void run_dns_lookup(MQTT_CLIENT_T *state, const char *mqtt_server_domain_name)
+static err_t run_dns_lookup(MQTT_CLIENT_T *state, const char *mqtt_server_domain_name)
 {
     DEBUG_printf("Running DNS query for %s.\n", mqtt_server_domain_name);
 
+    conn_dns_status = ERR_INPROGRESS;
     cyw43_arch_lwip_begin();
 
     // Start DNS query, looks up the IP address specified by mqtt_server_domain_name.
@@ -86,20 +171,18 @@ static void run_dns_lookup(MQTT_CLIENT_T *state, const char *mqtt_server_domain_
     // as the callback_arg, so that the state structure can be updated with the resolved IP address within the callback function.
     //
     err_t err = dns_gethostbyname(mqtt_server_domain_name, &(state->remote_addr), dns_found, state);
-    cyw43_arch_lwip_end();
-
-    if (err == ERR_ARG)
+    if (err != ERR_INPROGRESS)
     {
-        DEBUG_printf("failed to start DNS query\n");
-        return;
+        // Already known, or failed to start: dns_found() will not be called.
+        conn_dns_status = err;
     }
+    cyw43_arch_lwip_end();
 
-    // lets the cyw43 driver to do it's thing while waiting for the DNS query to finish.
-    while (state->remote_addr.addr == 0)
+    if ((err != ERR_OK) && (err != ERR_INPROGRESS))
     {
-        cyw43_arch_poll();
-        sleep_ms(1);
+        DEBUG_printf("failed to start DNS query\n");
     }
+    return err;
 }
 /**
  * @brief Prints the IPv4 address in human-readable format.
@@ -127,18 +210,34 @@ static void printIPv4Address(unsigned int addr)
 /**
  * @brief MQTT connection callback function.
  *
- * This function is called when the task of establishing an MQTT connection is completed, whether successful or not.
- * This function is then used to print a connection success or error message, depending on the mqtt_connection_status_t status.
+ * This function is called when the task of establishing an MQTT connection is completed, whether successful or not,
+ * and when the connection is closed. This function is then used to print a connection success or error message,
+ * depending on the mqtt_connection_status_t status, and to release the requests lost with a closed connection.
+ * The status is kept for the connection state machine (see mqtt_conn_poll).
  *
  * @param client - Pointer to the MQTT client structure.
  * @param arg - User-defined argument passed during MQTT client initialization.
  * @param status - MQTT connection status (0 for successful connection, non-zero for errors).
  */
+static void mqtt_inflight_fail_all(err_t err);
+static void mqtt_conn_backoff(u32_t delay_cap_ms);
+static int mqtt_inflight_acquire(mqtt_request_done_cb_t cb, void *cb_arg);
+static void mqtt_inflight_release(int slot, err_t err, bool notify);
+static void *mqtt_slot_arg(int slot);
+static void mqtt_request_done_cb(void *arg, err_t err);
+static err_t mqtt_publish_in_slot(int slot, const char *topic, const void *message, u16_t len, u8_t qos, u8_t retain, u32_t wait_ms);
+
 static void mqtt_connection_cb(mqtt_client_t *client, void *arg, mqtt_connection_status_t status)
 {
+    (void)client;
+    (void)arg;
+    conn_lwip_status = status;
     if (status != 0)
     {
         DEBUG_printf("Error during connection: err %d.\n", status);
+
+        // lwIP drops the pending requests with the connection without calling their callbacks, so release their slots here.
+        mqtt_inflight_fail_all(ERR_CONN);
     }
     else
     {
@@ -156,7 +255,7 @@ static void mqtt_connection_cb(mqtt_client_t *client, void *arg, mqtt_connection
  *
  * @note Before calling this function, please ensure that the following has been performed in the following order:
  * @note 1. WiFi connection is established and the MQTT configuration is set. (see set_mqtt_config())
- * @note 2. mqtt_client_init() called. (for initializing the MQTT client, performing DNS lookup, etc. All the good stuff.)
+ * @note 2. mqtt_client_init() called, and the address of the broker resolved. (mqtt_conn_poll does all of that, and calls this function.)
  */
 err_t mqtt_begin_connection()
 {
@@ -177,6 +276,10 @@ err_t mqtt_begin_connection()
 
     const struct mqtt_connect_client_info_t *client_info = &ci;
 
+    // Nothing sent on a previous connection is going to complete anymore.
+    mqtt_inflight_fail_all(ERR_CONN);
+    conn_lwip_status = -1;
+
     // Connects to the MQTT broker.
     err = mqtt_client_connect(_mqtt_state->mqtt_client, &(_mqtt_state->remote_addr), mqtt_config.server_port, mqtt_connection_cb, _mqtt_state, client_info);
     if (err != ERR_OK)
@@ -254,12 +357,12 @@ void set_mqtt_config(
 }
 
 /**
- * @brief Initializes the MQTT client and performs DNS lookup.
+ * @brief Initializes the MQTT client.
  *
- * This function creates a new MQTT client, allocates memory for the MQTT client state,
- * and performs a DNS lookup to resolve the server address.
+ * This function creates a new MQTT client and allocates memory for the MQTT client state.
+ * It does not wait for the network: the connection is then made by mqtt_conn_poll, called from the main loop.
  *
- * @note requires that Wi-Fi is connected and the MQTT configuration is set before calling.
+ * @note requires that the MQTT configuration is set before calling.
  */
 void mqtt_client_init()
 {
@@ -277,263 +380,2236 @@ void mqtt_client_init()
         DEBUG_printf("failed to allocate memory for MQTT client\n");
         return;
     }
-    DEBUG_printf("MQTT state allocated. Performing DNS Lookup...\n");
-    run_dns_lookup(_mqtt_state, mqtt_config.server_addr);
-    DEBUG_printf("DNS Lookup finished. IP address is: ");
-#ifdef DEBUG
-    printIPv4Address(_mqtt_state->remote_addr.addr);
-#endif
+    DEBUG_printf("MQTT state allocated.\n");
+
+    // The first attempt is also delayed at random, so a fleet of Picos powered up together does not connect in lockstep.
+    mqtt_conn_backoff(conn_backoff_min_ms);
 }
 
 #pragma endregion
 
-#pragma region MQTT publish section
+#pragma region Connection state machine
+
 /**
- * @brief Callback function for MQTT data publishing.
+ * @brief Gets a random number for the backoff jitter (xorshift32, seeded from the ring oscillator).
  *
- * This function is called when the MQTT data publishing task is completed.
- * It sets a flag to indicate readiness for the next publish or subscribe operation.
- *
- * @param arg - Pointer to the MQTT client state structure.
- * @param err - Error code indicating the result of the publishing task.
+ * The ring oscillator differs from one Pico to the next, so two Picos do not draw the same delays.
  */
-static void mqtt_publish_data_cb(void *arg, err_t err)
+static u32_t mqtt_conn_random()
 {
-    MQTT_CLIENT_T *state = (MQTT_CLIENT_T *)arg;
-
-    // Check if the publishing task was successful.
-    if (err == ERR_OK)
+    if (conn_random == 0)
     {
-        // Unlock the ready_for_next_pubsub flag to allow the next pub/sub operation to be called.
-        ready_for_next_pubsub = true;
-    }
-    else
-    {
-        // Print debug information in case of a publishing error.
-        DEBUG_printf("Error Publishing MQTT message. err=%d\n", err);
+        for (int i = 0; i < 32; i++)
+        {
+            conn_random = (conn_random << 1) | (rosc_hw->randombit & 1);
+        }
+        // xorshift never leaves 0, should the oscillator only give zeros.
+        conn_random = conn_random ? conn_random : 0x9E3779B9;
     }
+    conn_random ^= conn_random << 13;
+    conn_random ^= conn_random >> 17;
+    conn_random ^= conn_random << 5;
+    return conn_random;
 }
 
 /**
- * @brief Publishes MQTT data to the specified topic.
+ * @brief Enters a stage of the connection.
  *
- * This function publishes MQTT data to the specified topic using the configured MQTT client.
- * It waits for the previous pubsub operation to finish before initiating a new one.
+ * @param state - The stage entered.
+ * @param timeout_ms - Deadline of the stage, from now, in milliseconds.
+ */
+static void mqtt_conn_enter(eMqttConnState state, u32_t timeout_ms)
+{
+    DEBUG_printf("MQTT connection: %s -> %s\n", mqtt_conn_state_name(conn_state), mqtt_conn_state_name(state));
+    conn_state = state;
+    conn_deadline_us = time_us_64() + (uint64_t)timeout_ms * 1000;
+}
+
+/**
+ * @brief Waits before the next attempt, for a random delay between half and all of delay_cap_ms.
  *
- * @param topic - MQTT topic to which the data will be published.
- * @param message - Message data to be published.
- * @return err_t - ERR_OK if the publishing is successful, an error code otherwise.
+ * @param delay_cap_ms - Largest delay, in milliseconds.
  */
-err_t mqtt_publish_data(const char *topic, const char *message)
+static void mqtt_conn_backoff(u32_t delay_cap_ms)
 {
-    err_t err;
+    u32_t delay_ms = delay_cap_ms / 2 + mqtt_conn_random() % (delay_cap_ms / 2 + 1);
 
-    // Wait for the previous pubsub operation to finish.
-    while (!ready_for_next_pubsub)
-    {
-        cyw43_arch_poll();
-        sleep_ms(1);
-    }
+    conn_stats.last_backoff_ms = delay_ms;
+    mqtt_conn_enter(MQTT_CONN_BACKOFF, delay_ms);
+}
 
-    // Begin LWIP operations related to MQTT.
-    cyw43_arch_lwip_begin();
+/**
+ * @brief Gives up the current stage: closes the connection, and waits before the next attempt.
+ *
+ * The delay doubles with every failed attempt since the connection was last up, up to conn_backoff_max_ms.
+ *
+ * @param reason - Why the stage failed, for the logs.
+ */
+static void mqtt_conn_fail(const char *reason)
+{
+    u32_t delay_cap_ms = conn_backoff_min_ms;
 
-    // locks ready_for_next_pubsub to prevent new pub/subs from being called before this publish transaction is finished.
-    // This facilitates atomicity, and the lock will be released in the callback function on the condition that the publish transaction is successful.
-    ready_for_next_pubsub = false;
+    printf("MQTT connection failed at %s: %s\n", mqtt_conn_state_name(conn_state), reason);
+    conn_stats.failures[conn_state]++;
+
+    // End of the session: the broker publishes the will message (OFFLINE) on its own, let the application know.
+    if (conn_state == MQTT_CONN_SUBSCRIBED)
+    {
+        liveness.connected = false;
+        liveness_online_pending = false;
+        if (conn_disconnected_cb)
+        {
+            conn_disconnected_cb(reason, conn_disconnected_cb_arg);
+        }
+    }
 
-    // Publish MQTT data using the configured parameters and callback function.
-    err = mqtt_publish(_mqtt_state->mqtt_client, topic, message, strlen(message), mqtt_config.message_qos, mqtt_config.retain_messages, mqtt_publish_data_cb, _mqtt_state);
+    // Close the connection to the broker, if it got that far. lwIP does not report the requests dropped with it.
+    if (conn_state >= MQTT_CONN_TCP)
+    {
+        cyw43_arch_lwip_begin();
+        mqtt_disconnect(_mqtt_state->mqtt_client);
+        cyw43_arch_lwip_end();
+        mqtt_inflight_fail_all(ERR_CONN);
+    }
 
-    // End LWIP operations related to MQTT.
-    cyw43_arch_lwip_end();
+    for (u32_t i = 0; (i < conn_failed_attempts) && (delay_cap_ms < conn_backoff_max_ms); i++)
+    {
+        delay_cap_ms *= 2;
+    }
+    if (delay_cap_ms > conn_backoff_max_ms)
+    {
+        delay_cap_ms = conn_backoff_max_ms;
+    }
+    conn_failed_attempts++;
+    mqtt_conn_backoff(delay_cap_ms);
+}
 
-    // Check for errors during publishing.
-    /*Deprecated. This is now handled in the callback function.
+/**
+ * @brief Completion callback of the subscriptions made by the connected callback.
+ */
+static void mqtt_conn_subscribe_done(err_t err, void *arg)
+{
+    (void)arg;
     if (err != ERR_OK)
     {
-        // Print debug information in case of a publishing error.
-        DEBUG_printf("Publish err: %d\n", err);
+        conn_subs_failed = true;
+    }
+    if (conn_subs_pending)
+    {
+        conn_subs_pending--;
     }
-    */
-    // Return the result of the publishing operation.
-    return err;
 }
 
-#pragma endregion
 /**
- * @brief Checks if the MQTT client is ready for the next pub/sub operation.
- *
- * This function returns a boolean value indicating whether the system is ready
- * for the next publish or subscribe operation. It checks the readiness flag.
- *
- * @return `True` if there are no currently running pub/sub operations, `False` otherwise.
+ * @brief Checks if the link to the access point is up (joined, and given an IP address).
  */
-bool readyForNextPubSub()
+static bool mqtt_conn_wifi_up()
 {
-    return ready_for_next_pubsub;
+    return cyw43_tcpip_link_status(&cyw43_state, CYW43_ITF_STA) == CYW43_LINK_UP;
 }
-#pragma region MQTT subscribe section
 
 /**
- * @brief Callback function for incoming MQTT publish notifications.
- *
- * When an incoming publish is received, this function is called to process information about the incoming message.
- * This includes the topic of the message, and as well as the total length of the payload.
- *
- * We then use this information to check if the incoming payload will fit in our processing buffer.
- * and if it does, we set the payload_total_len variable to the total length of the incoming payload,
- * and reset the payload_cpy_index variable to 0, which is the index of the payload buffer to copy the next incoming payload byte to.
- *
- * Otherwise, if the incoming payload does not fit in our processing buffer, we set the payload_total_len variable to 0,
- * and discard the incoming payload.
- *
- * @param arg - Pointer to the MQTT client state structure.
- * @param topic - MQTT topic to which the incoming publish is sent.
- * @param tot_len - Total length of the incoming payload.
+ * @brief Completion callback of the subscription to the topic of the pings.
+ */
+static void mqtt_liveness_subscribe_done(err_t err, void *arg)
+{
+    (void)arg;
+    // Refused (e.g. by the ACL of the broker): the session is watched by the keepalive of lwIP only.
+    if (err != ERR_OK)
+    {
+        liveness_ping_enabled = false;
+    }
+}
+
+/**
+ * @brief Subscribes to the topic of the pings (<client id>/ping), so the broker sends them back (see mqtt_liveness_poll).
  *
- * @note If the incoming message does not contain a payload, mqtt_incoming_payload_cb() will not be called.
- * @note ~~
+ * Not tracked like the subscriptions of the connected callback: a broker refusing it does not keep the connection down.
  */
-static void mqtt_incoming_notification_cb(void *arg, const char *topic, u32_t tot_len)
+static void mqtt_liveness_subscribe()
 {
-    DEBUG_printf("Incoming publish at topic %s with total length %u\n", topic, (unsigned int)tot_len);
-    if (tot_len > MQTT_BUFF_SIZE)
+    int len = snprintf(liveness_ping_topic, sizeof(liveness_ping_topic), "%s/ping", mqtt_config.client_id);
+    err_t err;
+
+    liveness_ping_enabled = false;
+    if ((len < 0) || (len >= (int)sizeof(liveness_ping_topic)))
     {
-        DEBUG_printf("Error: incoming publish does not fit in buffer. Data discarded\n");
-        payload_total_len = 0;
+        return;
     }
-    else
+
+    int slot = mqtt_inflight_acquire(mqtt_liveness_subscribe_done, NULL);
+    liveness_ping_enabled = true;
+    cyw43_arch_lwip_begin();
+    err = mqtt_sub_unsub(_mqtt_state->mqtt_client, liveness_ping_topic, 0, mqtt_request_done_cb, mqtt_slot_arg(slot), 1);
+    cyw43_arch_lwip_end();
+    if (err != ERR_OK)
     {
-        payload_total_len = tot_len;
-        payload_cpy_index = 0;
+        DEBUG_printf("Subscribe err: %d\n", err);
+        mqtt_inflight_release(slot, err, false);
+        liveness_ping_enabled = false;
     }
 }
 
 /**
- * @brief Callback function for incoming MQTT publish payloads.
- *
- * When an incoming message is received, this function is called to process the payload of the incoming message.
- * This function copies the incoming payload byte by byte into the payload buffer.
- *
- * @param arg - Pointer to the MQTT client state structure.
- * @param data - Pointer to the incoming payload data.
- * @param len - Length of the incoming payload.
- * @param flags - Flags indicating the status of the incoming payload.
+ * @brief Starts the liveness monitoring of a new session, and queues its online status.
+ */
+static void mqtt_liveness_start()
+{
+    uint64_t now = time_us_64();
+
+    liveness.connected = true;
+    liveness.sessions++;
+    liveness.session_start_us = now;
+    liveness.ping_rtt_us = 0;
+    liveness.pings = 0;
+    liveness_ping_out = false;
+    liveness_next_ping_us = now;
+    liveness_poll_us = now;
+    liveness_heard_us = now;
+    liveness_rssi_us = 0;
+
+    // The online status is published once per session, the will message takes care of the offline one.
+    liveness_online_pending = (mqtt_config.will_topic != NULL);
+}
+
+/**
+ * @brief Monitors the liveness of the session: online status, ping round trip, and signal strength.
  *
- * @note If the incoming message does not contain a payload, this function will not be called.
- * @note ~~
+ * lwIP keeps the PINGREQ/PINGRESP of the keepalive to itself, so the library sends its own pings: every
+ * MQTT_LIVENESS_PING_INTERVAL_MS, a QoS 0 message with a sequence number to <client id>/ping, which the broker sends back
+ * as the client subscribed to it. The round trip runs from the ping handed to lwIP to its echo received (see
+ * mqtt_incoming_notification_cb), so it includes the time the main loop takes to poll the Wi-Fi driver.
+ * A ping not back within MQTT_LIVENESS_PING_TIMEOUT_MS ends the session, once the deadline has passed at two polls in a row:
+ * the Wi-Fi driver has been polled in between, so a main loop stalled past the deadline does not end a healthy session.
  */
-static void mqtt_incoming_payload_cb(void *arg, const u8_t *data, u16_t len, u8_t flags)
+static void mqtt_liveness_poll()
 {
-    if (payload_total_len > 0)
+    uint64_t now = time_us_64();
+    uint64_t echo_us;
+    uint64_t heard_us;
+
+    // Online status of the session, as soon as a slot is free (never waits).
+    if (liveness_online_pending && readyForNextPubSub())
+    {
+        int slot = mqtt_inflight_acquire(NULL, NULL);
+        err_t err = mqtt_publish_in_slot(slot, mqtt_config.will_topic, MQTT_ONLINE_MESSAGE, strlen(MQTT_ONLINE_MESSAGE), mqtt_config.will_qos, mqtt_config.retain_will, 0);
+        if (err != ERR_MEM)
+        {
+            // Published, or refused for good: either way, not tried again this session.
+            liveness_online_pending = false;
+        }
+    }
+
+    cyw43_arch_lwip_begin();
+    echo_us = liveness_echo_us;
+    heard_us = liveness_heard_us;
+    cyw43_arch_lwip_end();
+
+    liveness.silence_ms = (u32_t)((now - heard_us) / 1000);
+    if (liveness_ping_out && (echo_us != 0))
+    {
+        liveness_ping_out = false;
+        liveness.ping_rtt_us = (u32_t)(echo_us - liveness_ping_us);
+        if (liveness.ping_rtt_us > liveness.max_ping_rtt_us)
+        {
+            liveness.max_ping_rtt_us = liveness.ping_rtt_us;
+        }
+        liveness.pings++;
+    }
+    else if (liveness_ping_out && (liveness_poll_us >= liveness_ping_us + (uint64_t)MQTT_LIVENESS_PING_TIMEOUT_MS * 1000))
+    {
+        // lwIP would only give up after 1.5 keepalive intervals.
+        mqtt_conn_fail("no answer to the ping");
+        return;
+    }
+    else if (!liveness_ping_out && liveness_ping_enabled && (now >= liveness_next_ping_us) && readyForNextPubSub())
     {
-        payload_total_len -= len;
-        memcpy(&payload_buffer[payload_cpy_index], data, len);
-        payload_cpy_index += len;
+        int slot = mqtt_inflight_acquire(NULL, NULL);
+        int len = snprintf(liveness_ping_payload, sizeof(liveness_ping_payload), "%u", (unsigned int)++liveness_ping_seq);
+
+        cyw43_arch_lwip_begin();
+        liveness_echo_us = 0;
+        cyw43_arch_lwip_end();
+        err_t err = mqtt_publish_in_slot(slot, liveness_ping_topic, liveness_ping_payload, (u16_t)len, 0, 0, 0);
+        if (err == ERR_OK)
+        {
+            liveness_ping_out = true;
+            liveness_ping_us = now;
+            liveness_next_ping_us = now + (uint64_t)MQTT_LIVENESS_PING_INTERVAL_MS * 1000;
+        }
+        else if (err != ERR_MEM)
+        {
+            // Refused for good: tried again at the next interval.
+            liveness_next_ping_us = now + (uint64_t)MQTT_LIVENESS_PING_INTERVAL_MS * 1000;
+        }
+    }
+    liveness_poll_us = now;
 
-        if (payload_total_len == 0)
+    // Signal strength of the access point (an ioctl to the Wi-Fi chip, so not on every poll).
+    if (now >= liveness_rssi_us)
+    {
+        int32_t rssi;
+        if (cyw43_wifi_get_rssi(&cyw43_state, &rssi) == 0)
         {
-            payload_buffer[payload_cpy_index] = 0;
-            DEBUG_printf("Message Received [%d]:%s\n", payload_cpy_index, payload_buffer);
+            liveness.rssi = rssi;
         }
+        liveness_rssi_us = now + (uint64_t)MQTT_LIVENESS_RSSI_INTERVAL_MS * 1000;
     }
 }
 
 /**
- * @brief Sets the callback functions for incoming MQTT publish notifications and payloads.
+ * @brief Sets the access point the connection state machine joins (see mqtt_conn_poll).
  *
- * This function allows the user to set custom callback functions for processing incoming MQTT publish notifications and payloads.
- * If not set, the default callback functions will be used instead, which simply prints debug information about the incoming message.
- * Otherwise, if set, the user-defined callback functions will be used instead.
+ * Without it, the Wi-Fi stage only waits for the link to come up (e.g. joined by the application).
  *
- * @param pub_cb - Callback function for processing new incoming message topics and information about it's payload.
- * @param data_cb - Callback function for incoming message payload.
- * @param arg - Any additional arguments to be passed to the callback functions.
+ * @param ssid - SSID of the access point.
+ * @param password - Password of the access point.
+ * @param auth - Authentication type (e.g. CYW43_AUTH_WPA2_AES_PSK).
+ */
+void mqtt_conn_set_wifi(const char *ssid, const char *password, u32_t auth)
+{
+    conn_wifi_ssid = ssid;
+    conn_wifi_password = password;
+    conn_wifi_auth = auth;
+}
+
+/**
+ * @brief Sets the callback called every time the broker accepts the connection (see mqtt_conn_connected_cb_t).
  *
- * @note When a message is recieved, pub_cb is called first followed by data_cb.
- * @note And if there is no payload, (e.g. a topic was published to the broker without any message), only pub_cb will be called but data_cb will not be called.
- * @note ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ * @param cb - Connected callback (can be NULL).
+ * @param arg - User argument passed to the callback.
  */
-void set_mqtt_subscribe_callback(mqtt_incoming_publish_cb_t pub_cb, mqtt_incoming_data_cb_t data_cb, void *arg)
+void mqtt_conn_set_connected_callback(mqtt_conn_connected_cb_t cb, void *arg)
 {
-    mqtt_set_inpub_callback(_mqtt_state->mqtt_client, pub_cb, data_cb, arg);
+    conn_connected_cb = cb;
+    conn_connected_cb_arg = arg;
 }
 
 /**
- * @brief Callback function for MQTT topic subscription and unsubscription.
+ * @brief Sets the callback called when the session ends (see mqtt_conn_disconnected_cb_t).
  *
- * This function is called when the task of subscribing or unsubscribing from an MQTT topic is completed.
- * Also releases the ready_for_next_pubsub flag to allow the next pub/sub operation to be called if the task is successful.
+ * @param cb - Disconnected callback (can be NULL).
+ * @param arg - User argument passed to the callback.
+ */
+void mqtt_conn_set_disconnected_callback(mqtt_conn_disconnected_cb_t cb, void *arg)
+{
+    conn_disconnected_cb = cb;
+    conn_disconnected_cb_arg = arg;
+}
+
+/**
+ * @brief Gets the liveness of the session: whether it is up, the ping round trip, and the signal strength.
  *
- * @param arg - Pointer to the MQTT client state structure.
- * @param err - Error code indicating the result of the subscribe or unsubscribe task.
+ * @param l - Filled in with the liveness of the session.
  */
-static void mqtt_subscribe_topic_error_callback(void *arg, err_t err)
+void mqtt_get_liveness(mqtt_liveness_t *l)
 {
-    if (err == ERR_OK)
-    {
-        ready_for_next_pubsub = true;
-    }
-    else
-    {
-        DEBUG_printf("Subscribe Error Code: %d\n", err);
-    }
+    *l = liveness;
 }
+
 /**
- * @brief Subscribes or unsubscribes from an MQTT topic.
+ * @brief Sets the delays between the connection attempts.
  *
- * This function subscribes or unsubscribes from the specified MQTT topic using the configured MQTT client.
- * It waits for the previous pubsub operation to finish before initiating a new one.
+ * The delay doubles with every failed attempt, from min_ms up to max_ms, and is drawn at random
+ * between half and all of it, so that a fleet of Picos losing the broker at the same time does not reconnect in lockstep.
  *
- * @param topic - MQTT topic to subscribe or unsubscribe from.
- * @param sub_or_unsub - Enumeration specifying whether to subscribe (SUB) or unsubscribe (UNSUB).
- * @return err_t - ERR_OK if the subscribe or unsubscribe operation is successful, an error code otherwise.
+ * @param min_ms - Delay before the first retry, in milliseconds.
+ * @param max_ms - Largest delay between two attempts, in milliseconds.
  */
-err_t mqtt_subscribe_topic(const char *topic, eSubOrUnsub sub_or_unsub)
+void mqtt_conn_set_backoff(u32_t min_ms, u32_t max_ms)
 {
-    err_t err;
-    u8_t qos = mqtt_config.message_qos;
+    conn_backoff_min_ms = (min_ms < 2) ? 2 : min_ms;
+    conn_backoff_max_ms = (max_ms < conn_backoff_min_ms) ? conn_backoff_min_ms : max_ms;
+}
 
-    // Wait for the previous pubsub operation to finish.
-    while (ready_for_next_pubsub == false)
-    {
-        cyw43_arch_poll();
-        sleep_ms(1);
-    }
+/**
+ * @brief Checks if lwIP has opened the TCP connection to the broker, and sent the MQTT CONNECT.
+ *
+ * lwIP only tells this stage apart in the private state of its client: it is read for the lwIP versions known to lay it out
+ * this way (see MQTT_LWIP_PRIV_STATE). With other versions, the TCP stage runs until the broker accepts the connection.
+ *
+ * @return `True` if the CONNECT is on its way to the broker, `False` otherwise.
+ */
+static bool mqtt_conn_lwip_connecting()
+{
+#if MQTT_LWIP_PRIV_STATE
+    u8_t lwip_state;
 
-    // Begin LWIP operations related to MQTT.
     cyw43_arch_lwip_begin();
-
-    // Set the flag to indicate the start of a new pubsub operation.
-    ready_for_next_pubsub = false;
-
-    // Subscribe or unsubscribe from the MQTT topic using the configured parameters and callback function.
-    err = mqtt_sub_unsub(_mqtt_state->mqtt_client, topic, mqtt_config.message_qos, mqtt_subscribe_topic_error_callback, _mqtt_state, sub_or_unsub);
-
-    // End LWIP operations related to MQTT.
+    lwip_state = _mqtt_state->mqtt_client->conn_state;
     cyw43_arch_lwip_end();
+    return lwip_state == LWIP_MQTT_MQTT_CONNECTING;
+#else
+    return false;
+#endif
+}
 
-    // Check for errors during subscribe or unsubscribe operation.
-    if (err != ERR_OK)
+/**
+ * @brief Drives the connection to the broker: Wi-Fi, DNS, TCP, MQTT CONNECT, then the subscriptions.
+ *
+ * This function never waits: call it from the main loop, next to cyw43_arch_poll. Every stage has its deadline
+ * (MQTT_CONN_*_TIMEOUT_MS); a stage that fails or times out, or a connection that is lost, closes the connection
+ * and starts again from the Wi-Fi stage after the backoff delay (see mqtt_conn_set_backoff).
+ *
+ * @return eMqttConnState - The stage of the connection.
+ */
+eMqttConnState mqtt_conn_poll()
+{
+    int link;
+
+    if (_mqtt_state == NULL)
     {
-        // Print debug information in case of an error.
-        DEBUG_printf("Subscribe err: %d\n", err);
-        return err;
+        return conn_state;
     }
-    // Print debug information about successful subscription or unsubscription.
-    if (sub_or_unsub == SUB)
+
+    // Every stage past the Wi-Fi one needs the link to the access point.
+    if ((conn_state > MQTT_CONN_WIFI) && !mqtt_conn_wifi_up())
     {
-        DEBUG_printf("Subscribed to topic: %s\n", topic);
-        return err;
+        mqtt_conn_fail("Wi-Fi link lost");
+        return conn_state;
     }
 
-    if (sub_or_unsub == UNSUB)
+    switch (conn_state)
     {
-        DEBUG_printf("Unsubscribed from topic: %s\n", topic);
-        return err;
-    }
-    return err; // I mean... it shouldn't get here, but just in case the pico gets hit with a bitflip or something by the higher beings...
+    case MQTT_CONN_BACKOFF:
+        if (time_us_64() < conn_deadline_us)
+        {
+            break;
+        }
+        conn_stats.attempts++;
+        mqtt_conn_enter(MQTT_CONN_WIFI, MQTT_CONN_WIFI_TIMEOUT_MS);
+
+        // Join the access point, unless the link is still up (e.g. only the broker was lost).
+        if (!mqtt_conn_wifi_up() && conn_wifi_ssid)
+        {
+            printf("Connecting to '%s'\n", conn_wifi_ssid);
+            if (cyw43_arch_wifi_connect_async(conn_wifi_ssid, conn_wifi_password, conn_wifi_auth))
+            {
+                mqtt_conn_fail("could not start joining the access point");
+            }
+        }
+        break;
+
+    case MQTT_CONN_WIFI:
+        link = cyw43_tcpip_link_status(&cyw43_state, CYW43_ITF_STA);
+        if (link == CYW43_LINK_UP)
+        {
+            printf("Connected to Wi-Fi. Assigned IP address: ");
+            cyw43_arch_lwip_begin();
+            printIPv4Address(cyw43_state.netif[0].ip_addr.addr);
+            cyw43_arch_lwip_end();
+
+            mqtt_conn_enter(MQTT_CONN_DNS, MQTT_CONN_DNS_TIMEOUT_MS);
+            err_t err = run_dns_lookup(_mqtt_state, mqtt_config.server_addr);
+            if ((err != ERR_OK) && (err != ERR_INPROGRESS))
+            {
+                mqtt_conn_fail("could not start the DNS query");
+            }
+        }
+        else if (link < 0)
+        {
+            // CYW43_LINK_FAIL, CYW43_LINK_NONET or CYW43_LINK_BADAUTH
+            mqtt_conn_fail((link == CYW43_LINK_BADAUTH) ? "wrong Wi-Fi password" : "could not join the access point");
+        }
+        else if (time_us_64() >= conn_deadline_us)
+        {
+            mqtt_conn_fail("timed out");
+        }
+        break;
+
+    case MQTT_CONN_DNS:
+        if (conn_dns_status == ERR_OK)
+        {
+            DEBUG_printf("Broker address: ");
+#ifdef DEBUG
+            printIPv4Address(_mqtt_state->remote_addr.addr);
+#endif
+#if MQTT_LWIP_PRIV_STATE
+            mqtt_conn_enter(MQTT_CONN_TCP, MQTT_CONN_TCP_TIMEOUT_MS);
+#else
+            // The TCP stage runs until the broker accepts the connection (see mqtt_conn_lwip_connecting).
+            mqtt_conn_enter(MQTT_CONN_TCP, MQTT_CONN_TCP_TIMEOUT_MS + MQTT_CONN_CONNECT_TIMEOUT_MS);
+#endif
+            if (mqtt_begin_connection() != ERR_OK)
+            {
+                mqtt_conn_fail("could not start the connection");
+            }
+        }
+        else if (conn_dns_status != ERR_INPROGRESS)
+        {
+            mqtt_conn_fail("could not resolve the address of the broker");
+        }
+        else if (time_us_64() >= conn_deadline_us)
+        {
+            mqtt_conn_fail("timed out");
+        }
+        break;
+
+    case MQTT_CONN_TCP:
+    case MQTT_CONN_CONNECT:
+        if (mqtt_is_connected())
+        {
+            printf("Connected to MQTT server.\n");
+            conn_subs_pending = 0;
+            conn_subs_failed = false;
+            mqtt_conn_enter(MQTT_CONN_SUBSCRIBING, MQTT_CONN_SUBSCRIBE_TIMEOUT_MS);
+            mqtt_liveness_subscribe();
+
+            // The subscriptions made by the callback are tracked, see mqtt_subscribe_topic.
+            if (conn_connected_cb)
+            {
+                conn_connected_cb(conn_connected_cb_arg);
+            }
+            break;
+        }
+
+        // Closed by lwIP before the broker accepted it: refused by a CONNACK, or the TCP connection failed or timed out.
+        if ((conn_lwip_status > MQTT_CONNECT_ACCEPTED) && (conn_lwip_status <= MQTT_CONNECT_REFUSED_NOT_AUTHORIZED_))
+        {
+            // Refused by a CONNACK, so the TCP connection was open (lwIP's stage may not have been read).
+            conn_state = MQTT_CONN_CONNECT;
+            mqtt_conn_fail("refused by the broker");
+        }
+        else if (conn_lwip_status > MQTT_CONNECT_ACCEPTED)
+        {
+            mqtt_conn_fail((conn_state == MQTT_CONN_TCP) ? "could not reach the broker" : "connection closed");
+        }
+        else if ((conn_state == MQTT_CONN_TCP) && mqtt_conn_lwip_connecting())
+        {
+            // TCP connection open, the CONNECT is on its way to the broker.
+            mqtt_conn_enter(MQTT_CONN_CONNECT, MQTT_CONN_CONNECT_TIMEOUT_MS);
+        }
+        else if (time_us_64() >= conn_deadline_us)
+        {
+            mqtt_conn_fail("timed out");
+        }
+        break;
+
+    case MQTT_CONN_SUBSCRIBING:
+        if (!mqtt_is_connected())
+        {
+            mqtt_conn_fail("connection closed");
+        }
+        else if (conn_subs_failed)
+        {
+            mqtt_conn_fail("subscription refused");
+        }
+        else if (conn_subs_pending == 0)
+        {
+            printf("MQTT connection up.\n");
+            conn_failed_attempts = 0;
+            conn_stats.connected++;
+            conn_state = MQTT_CONN_SUBSCRIBED;
+            mqtt_liveness_start();
+        }
+        else if (time_us_64() >= conn_deadline_us)
+        {
+            mqtt_conn_fail("timed out");
+        }
+        break;
+
+    case MQTT_CONN_SUBSCRIBED:
+        if (!mqtt_is_connected())
+        {
+            mqtt_conn_fail("connection lost");
+        }
+        else
+        {
+            mqtt_liveness_poll();
+        }
+        break;
+    }
+    return conn_state;
+}
+
+/**
+ * @brief Gets the stage of the connection to the broker.
+ *
+ * @return eMqttConnState - The stage of the connection.
+ */
+eMqttConnState mqtt_conn_get_state()
+{
+    return conn_state;
+}
+
+/**
+ * @brief Gets the name of a stage of the connection, for the logs.
+ *
+ * @param state - The stage of the connection.
+ * @return const char* - The name of the stage.
+ */
+const char *mqtt_conn_state_name(eMqttConnState state)
+{
+    switch (state)
+    {
+    case MQTT_CONN_BACKOFF:
+        return "BACKOFF";
+    case MQTT_CONN_WIFI:
+        return "WIFI";
+    case MQTT_CONN_DNS:
+        return "DNS";
+    case MQTT_CONN_TCP:
+        return "TCP";
+    case MQTT_CONN_CONNECT:
+        return "CONNECT";
+    case MQTT_CONN_SUBSCRIBING:
+        return "SUBSCRIBING";
+    case MQTT_CONN_SUBSCRIBED:
+        return "SUBSCRIBED";
+    }
+    return "UNKNOWN";
+}
+
+/**
+ * @brief Gets the statistics of the connection to the broker since boot.
+ *
+ * @param stats - Filled in with the statistics.
+ */
+void mqtt_conn_get_stats(mqtt_conn_stats_t *stats)
+{
+    *stats = conn_stats;
+}
+
+#pragma endregion
+
+#pragma region In-flight window
+
+/**
+ * @brief Encodes a slot and its generation into the callback argument handed to lwIP.
+ */
+static void *mqtt_slot_arg(int slot)
+{
+    return (void *)(uintptr_t)((slot << 8) | inflight_slots[slot].generation);
+}
+
+/**
+ * @brief Waits for a free slot in the in-flight window, and takes it.
+ *
+ * The slots are released by the completion callbacks, which run from cyw43_arch_poll (polling mode),
+ * so the cyw43 driver is kept serviced while waiting.
+ *
+ * @param cb - Completion callback of the caller (can be NULL).
+ * @param cb_arg - User argument passed to the completion callback.
+ * @return int - Index of the slot taken.
+ */
+static int mqtt_inflight_acquire(mqtt_request_done_cb_t cb, void *cb_arg)
+{
+    // Wait for a request in flight to complete if the window is full.
+    while (inflight_count >= inflight_window)
+    {
+        cyw43_arch_poll();
+        sleep_ms(1);
+    }
+
+    for (int i = 0; i < MQTT_INFLIGHT_SLOTS; i++)
+    {
+        if (!inflight_slots[i].busy)
+        {
+            inflight_slots[i].busy = true;
+            inflight_slots[i].generation++;
+            inflight_slots[i].queued_us = time_us_64();
+            inflight_slots[i].cb = cb;
+            inflight_slots[i].cb_arg = cb_arg;
+            inflight_count++;
+            if (inflight_count > inflight_stats.max_in_flight)
+            {
+                inflight_stats.max_in_flight = inflight_count;
+            }
+            return i;
+        }
+    }
+    return -1; // Not reached, the window is never larger than the number of slots.
+}
+
+/**
+ * @brief Releases a slot, and reports the completion of its request to the caller.
+ *
+ * @param slot - Index of the slot.
+ * @param err - Completion status of the request.
+ * @param notify - True to call the completion callback of the caller.
+ */
+static void mqtt_inflight_release(int slot, err_t err, bool notify)
+{
+    mqtt_inflight_slot_t *s = &inflight_slots[slot];
+    mqtt_request_done_cb_t cb = s->cb;
+    void *cb_arg = s->cb_arg;
+
+    if (err == ERR_OK)
+    {
+        u32_t rtt_us = (u32_t)(time_us_64() - s->queued_us);
+        inflight_stats.completed++;
+        inflight_stats.total_rtt_us += rtt_us;
+        if (rtt_us > inflight_stats.max_rtt_us)
+        {
+            inflight_stats.max_rtt_us = rtt_us;
+        }
+    }
+    else
+    {
+        inflight_stats.failed++;
+    }
+
+    // Free the slot before calling back, so the callback can queue the next request.
+    s->busy = false;
+    s->cb = NULL;
+    inflight_count--;
+
+    if (notify && cb)
+    {
+        cb(err, cb_arg);
+    }
+}
+
+/**
+ * @brief Releases every slot in use, e.g. when the connection has been closed.
+ *
+ * @param err - Completion status reported to the callers.
+ */
+static void mqtt_inflight_fail_all(err_t err)
+{
+    for (int i = 0; i < MQTT_INFLIGHT_SLOTS; i++)
+    {
+        if (inflight_slots[i].busy)
+        {
+            // A late completion from lwIP for this request (if any) no longer matches the generation of the slot.
+            mqtt_inflight_release(i, err, true);
+        }
+    }
+}
+
+/**
+ * @brief Callback function for the completion of a publish/subscribe request.
+ *
+ * This function is called by lwIP when the request is acknowledged by the broker (QoS 1/2), handed to TCP (QoS 0),
+ * or has timed out. It releases the slot of the request, and calls the completion callback of the caller.
+ *
+ * @param arg - Slot and generation of the request (see mqtt_slot_arg).
+ * @param err - Error code indicating the result of the request.
+ */
+static void mqtt_request_done_cb(void *arg, err_t err)
+{
+    int slot = (int)((uintptr_t)arg >> 8);
+    u8_t generation = (u8_t)((uintptr_t)arg & 0xFF);
+
+    // Ignore the completion of a request whose slot has already been released (connection closed in the meantime).
+    if ((slot >= MQTT_INFLIGHT_SLOTS) || !inflight_slots[slot].busy || (inflight_slots[slot].generation != generation))
+    {
+        return;
+    }
+
+    if (err != ERR_OK)
+    {
+        // Print debug information in case of an error.
+        DEBUG_printf("MQTT request failed. err=%d\n", err);
+    }
+    else
+    {
+        // Acknowledged by the broker (by its TCP stack for QoS 0), see mqtt_liveness_poll.
+        liveness_heard_us = time_us_64();
+    }
+    mqtt_inflight_release(slot, err, true);
+}
+
+/**
+ * @brief Sets the number of publish/subscribe requests that can wait for the broker at the same time.
+ *
+ * A window of 1 waits for every message to be acknowledged before sending the next one (one message per round trip).
+ * A larger window sends the next messages straight away, so the throughput scales with the window.
+ *
+ * @param window - Number of requests in flight, from 1 to MQTT_INFLIGHT_SLOTS (clamped).
+ * @return u8_t - The window applied.
+ */
+u8_t mqtt_set_inflight_window(u8_t window)
+{
+    if (window < 1)
+    {
+        window = 1;
+    }
+    if (window > MQTT_INFLIGHT_SLOTS)
+    {
+        window = MQTT_INFLIGHT_SLOTS;
+    }
+    inflight_window = window;
+    return window;
+}
+
+/**
+ * @brief Gets the number of publish/subscribe requests waiting for the broker.
+ *
+ * @return u8_t - Number of requests in flight.
+ */
+u8_t mqtt_get_inflight_count()
+{
+    return inflight_count;
+}
+
+/**
+ * @brief Waits for every publish/subscribe request in flight to complete (e.g. before going to sleep).
+ *
+ * @param timeout_ms - Maximum time to wait, in milliseconds.
+ * @return `True` if no request is in flight anymore, `False` if the timeout expired first.
+ */
+bool mqtt_wait_inflight(u32_t timeout_ms)
+{
+    uint64_t deadline = time_us_64() + (uint64_t)timeout_ms * 1000;
+
+    while (inflight_count && (time_us_64() < deadline))
+    {
+        cyw43_arch_poll();
+        sleep_ms(1);
+    }
+    return inflight_count == 0;
+}
+
+/**
+ * @brief Gets the statistics of the in-flight window since boot.
+ *
+ * @param stats - Filled in with the statistics.
+ */
+void mqtt_get_inflight_stats(mqtt_inflight_stats_t *stats)
+{
+    *stats = inflight_stats;
+}
+
+#pragma endregion
+
+#pragma region MQTT publish section
+
+/**
+ * @brief Hands a message to lwIP, for a slot of the in-flight window already taken.
+ *
+ * If the output buffer of lwIP is full (the previous messages have not been handed to TCP yet), it waits for it to drain,
+ * for up to wait_ms. The slot is released here if lwIP does not take the message.
+ *
+ * @param slot - Slot taken for the message (see mqtt_inflight_acquire).
+ * @param topic - MQTT topic to which the data will be published.
+ * @param message - Message data to be published.
+ * @param len - Length of the message, in bytes (it can hold any byte, e.g. a CBOR payload).
+ * @param qos - Quality of Service level of the message.
+ * @param retain - Retain flag of the message.
+ * @param wait_ms - Max time to wait for room in the lwIP output buffer (0 to give up straight away with ERR_MEM).
+ * @return err_t - ERR_OK if the message has been queued, an error code otherwise.
+ */
+static err_t mqtt_publish_in_slot(int slot, const char *topic, const void *message, u16_t len, u8_t qos, u8_t retain, u32_t wait_ms)
+{
+    err_t err;
+    uint64_t deadline = time_us_64() + (uint64_t)wait_ms * 1000;
+
+    do
+    {
+        // Begin LWIP operations related to MQTT.
+        cyw43_arch_lwip_begin();
+
+        // Publish MQTT data using the configured parameters, the slot is released by the callback function.
+        err = mqtt_publish(_mqtt_state->mqtt_client, topic, message, len, qos, retain, mqtt_request_done_cb, mqtt_slot_arg(slot));
+
+        // End LWIP operations related to MQTT.
+        cyw43_arch_lwip_end();
+
+        if ((err != ERR_MEM) || (wait_ms == 0))
+        {
+            break;
+        }
+
+        // The output buffer is full, let the cyw43 driver send what is already in there.
+        cyw43_arch_poll();
+        sleep_ms(1);
+    } while (time_us_64() < deadline);
+
+    // lwIP did not take the request, so it will never call back: release the slot here.
+    if (err != ERR_OK)
+    {
+        DEBUG_printf("Publish err: %d\n", err);
+        mqtt_inflight_release(slot, err, false);
+    }
+
+    // Return the result of the publishing operation.
+    return err;
+}
+
+/**
+ * @brief Publishes MQTT data to the specified topic, and reports its completion.
+ *
+ * This function takes a slot of the in-flight window (waiting for one if the window is full), then hands the message to lwIP.
+ * If the output buffer of lwIP is full (the previous messages have not been handed to TCP yet), it waits for it to drain,
+ * for up to MQTT_OUTPUT_WAIT_MS.
+ *
+ * @param topic - MQTT topic to which the data will be published.
+ * @param message - Message data to be published.
+ * @param cb - Completion callback (can be NULL), only called if ERR_OK is returned.
+ * @param arg - User argument passed to the completion callback.
+ * @return err_t - ERR_OK if the message has been queued, an error code otherwise.
+ */
+err_t mqtt_publish_data_w_callback(const char *topic, const char *message, mqtt_request_done_cb_t cb, void *arg)
+{
+    int slot = mqtt_inflight_acquire(cb, arg);
+
+    return mqtt_publish_in_slot(slot, topic, message, strlen(message), mqtt_config.message_qos, mqtt_config.retain_messages, MQTT_OUTPUT_WAIT_MS);
+}
+
+/**
+ * @brief Publishes MQTT data to the specified topic.
+ *
+ * This function publishes MQTT data to the specified topic using the configured MQTT client.
+ * It only waits for a free slot in the in-flight window (see mqtt_set_inflight_window), not for the previous messages
+ * to be acknowledged, so several messages can be on their way to the broker at the same time.
+ * The topic and message are copied by lwIP, the buffers can be reused as soon as this function returns.
+ *
+ * @param topic - MQTT topic to which the data will be published.
+ * @param message - Message data to be published.
+ * @return err_t - ERR_OK if the message has been queued, an error code otherwise.
+ */
+err_t mqtt_publish_data(const char *topic, const char *message)
+{
+    return mqtt_publish_data_w_callback(topic, message, NULL, NULL);
+}
+
+#pragma endregion
+/**
+ * @brief Checks if the MQTT client is ready for the next pub/sub operation.
+ *
+ * This function returns a boolean value indicating whether the system is ready
+ * for the next publish or subscribe operation, i.e. whether it would be sent without waiting.
+ *
+ * @return `True` if there is a free slot in the in-flight window, `False` otherwise.
+ */
+bool readyForNextPubSub()
+{
+    return inflight_count < inflight_window;
+}
+
+/**
+ * @brief Checks if the MQTT client is connected to the broker.
+ *
+ * @return `True` if the connection to the broker is up, `False` otherwise.
+ */
+bool mqtt_is_connected()
+{
+    bool connected;
+
+    if (_mqtt_state == NULL)
+    {
+        return false;
+    }
+    cyw43_arch_lwip_begin();
+    connected = mqtt_client_is_connected(_mqtt_state->mqtt_client);
+    cyw43_arch_lwip_end();
+    return connected;
+}
+
+#pragma region Outbound queue
+
+/**
+ * @brief Header of a message in the outbound arena, followed by the topic and the message (both null terminated).
+ */
+typedef struct
+{
+    u16_t size;      // Size of the record, header included (multiple of 4), or of the unused end of the arena for a wrap marker
+    u8_t wrap;       // The record is a wrap marker: the next record is at the start of the arena
+    u8_t superseded; // A more recent message of the same topic has been queued (KEEP_LATEST), skip this one
+    u16_t len;       // Length of the message (it can hold null bytes, see mqtt_outbox_enqueue_w_len)
+} mqtt_outbox_rec_t;
+
+/**
+ * @brief Overflow policy of a topic (see mqtt_outbox_set_policy).
+ */
+typedef struct
+{
+    char topic[MQTT_OUTBOX_TOPIC_LEN]; // Topic the policy applies to (empty if the entry is unused)
+    eOutboxPolicy policy;              // Policy of the topic
+} mqtt_outbox_topic_policy_t;
+
+static u8_t outbox_arena[MQTT_OUTBOX_ARENA_SIZE] __attribute__((aligned(4))); // Ring arena holding the queued messages
+static u32_t outbox_head = 0;                                                    // Offset of the oldest record
+static u32_t outbox_tail = 0;                                                    // Offset at which the next record is written
+static u32_t outbox_used = 0;                                                    // Bytes of the arena in use (records and wrap markers)
+static mqtt_outbox_topic_policy_t outbox_policies[MQTT_OUTBOX_MAX_POLICIES];     // Overflow policies of the topics
+static mqtt_outbox_stats_t outbox_stats;                                         // Statistics of the outbound queue
+static int32_t outbox_reserved = -1;                                             // Offset of the record reserved by mqtt_outbox_reserve, -1 if none
+
+/**
+ * @brief Gets the record at the given offset of the arena.
+ */
+static mqtt_outbox_rec_t *mqtt_outbox_rec(u32_t offset)
+{
+    return (mqtt_outbox_rec_t *)&outbox_arena[offset];
+}
+
+/**
+ * @brief Gets the topic of a record.
+ */
+static const char *mqtt_outbox_rec_topic(mqtt_outbox_rec_t *rec)
+{
+    return (const char *)(rec + 1);
+}
+
+/**
+ * @brief Gets the message of a record (stored right after its topic).
+ */
+static const u8_t *mqtt_outbox_rec_message(mqtt_outbox_rec_t *rec)
+{
+    const char *topic = mqtt_outbox_rec_topic(rec);
+    return (const u8_t *)topic + strlen(topic) + 1;
+}
+
+/**
+ * @brief Removes the oldest record (and the wrap marker before it, if any) from the arena.
+ *
+ * @return The number of messages removed that had not been superseded, i.e. that are lost if not sent (0 or 1).
+ */
+static u32_t mqtt_outbox_pop()
+{
+    mqtt_outbox_rec_t *rec = mqtt_outbox_rec(outbox_head);
+    u32_t live = 0;
+
+    if (rec->wrap)
+    {
+        outbox_used -= rec->size;
+        outbox_head = 0;
+        rec = mqtt_outbox_rec(outbox_head);
+    }
+    if (outbox_used)
+    {
+        live = rec->superseded ? 0 : 1;
+        outbox_used -= rec->size;
+        outbox_head += rec->size;
+        if (outbox_head == MQTT_OUTBOX_ARENA_SIZE)
+        {
+            outbox_head = 0;
+        }
+        outbox_stats.queued -= live;
+    }
+
+    // Start again from the beginning of the arena when it is empty, so large messages find room.
+    if (outbox_used == 0)
+    {
+        outbox_head = 0;
+        outbox_tail = 0;
+    }
+    return live;
+}
+
+/**
+ * @brief Finds room for a record of the given size at the tail of the arena, without evicting anything.
+ *
+ * @param size - Size of the record (multiple of 4).
+ * @return The offset of the room found, or -1 if there is not enough contiguous room.
+ */
+static int32_t mqtt_outbox_find_room(u32_t size)
+{
+    if (outbox_used == 0)
+    {
+        return 0;
+    }
+    if (outbox_tail > outbox_head)
+    {
+        // Free room is [tail, end) and [0, head).
+        if (MQTT_OUTBOX_ARENA_SIZE - outbox_tail >= size)
+        {
+            return outbox_tail;
+        }
+        if (outbox_head >= size)
+        {
+            // Mark the end of the arena as unused, the record goes at the start.
+            mqtt_outbox_rec_t *marker = mqtt_outbox_rec(outbox_tail);
+            marker->size = MQTT_OUTBOX_ARENA_SIZE - outbox_tail;
+            marker->wrap = 1;
+            marker->superseded = 1;
+            outbox_used += marker->size;
+            outbox_tail = 0;
+            return 0;
+        }
+        return -1;
+    }
+    // Free room is [tail, head).
+    if (outbox_head - outbox_tail >= size)
+    {
+        return outbox_tail;
+    }
+    return -1;
+}
+
+/**
+ * @brief Gets the overflow policy of a topic.
+ */
+static eOutboxPolicy mqtt_outbox_get_policy(const char *topic)
+{
+    for (int i = 0; i < MQTT_OUTBOX_MAX_POLICIES; i++)
+    {
+        if (outbox_policies[i].topic[0] && !strcmp(outbox_policies[i].topic, topic))
+        {
+            return outbox_policies[i].policy;
+        }
+    }
+    return OUTBOX_DROP_OLDEST;
+}
+
+/**
+ * @brief Sets the overflow policy of a topic.
+ *
+ * With OUTBOX_DROP_OLDEST (the default), every message of the topic is kept until sent, and the oldest messages
+ * of the queue are dropped when the arena is full. With OUTBOX_KEEP_LATEST, queuing a message of the topic drops
+ * the messages of that topic still waiting in the queue (e.g. a sensor reading, only the latest value matters).
+ *
+ * @param topic - MQTT topic the policy applies to (copied, up to MQTT_OUTBOX_TOPIC_LEN - 1 characters).
+ * @param policy - Overflow policy of the topic.
+ * @return `True` if the policy has been set, `False` if the topic is too long or the policy table is full.
+ */
+bool mqtt_outbox_set_policy(const char *topic, eOutboxPolicy policy)
+{
+    int freeEntry = -1;
+
+    if (strlen(topic) >= MQTT_OUTBOX_TOPIC_LEN)
+    {
+        return false;
+    }
+    for (int i = 0; i < MQTT_OUTBOX_MAX_POLICIES; i++)
+    {
+        if (outbox_policies[i].topic[0] == 0)
+        {
+            if (freeEntry < 0)
+            {
+                freeEntry = i;
+            }
+        }
+        else if (!strcmp(outbox_policies[i].topic, topic))
+        {
+            outbox_policies[i].policy = policy;
+            return true;
+        }
+    }
+    if (freeEntry < 0)
+    {
+        return false;
+    }
+    strcpy(outbox_policies[freeEntry].topic, topic);
+    outbox_policies[freeEntry].policy = policy;
+    return true;
+}
+
+/**
+ * @brief Gets the size of the record of a message (multiple of 4, to keep the records aligned).
+ */
+static u32_t mqtt_outbox_rec_size(size_t topicLen, size_t messageLen)
+{
+    return (sizeof(mqtt_outbox_rec_t) + topicLen + 1 + messageLen + 1 + 3) & ~3u;
+}
+
+/**
+ * @brief Makes room for a message at the tail of the arena, and writes the header and the topic of its record.
+ *
+ * Applies the policy of the topic, and drops the oldest messages if the arena is full (if allowed to).
+ * The message itself is left to the caller.
+ *
+ * @param topic - MQTT topic of the message.
+ * @param len - Length of the message, in bytes.
+ * @param evict - True to drop the oldest messages if the arena is full, False to only take the free room.
+ * @return The record, NULL if the message is larger than the arena, or if the free room is too small and evict is False.
+ */
+static mqtt_outbox_rec_t *mqtt_outbox_place(const char *topic, u16_t len, bool evict)
+{
+    size_t topicLen = strlen(topic);
+    u32_t size = mqtt_outbox_rec_size(topicLen, len);
+    int32_t offset = -1;
+
+    if (size > MQTT_OUTBOX_ARENA_SIZE)
+    {
+        outbox_stats.dropped++;
+        return NULL;
+    }
+
+    // Free room only: checked before the policy, so a message that does not fit leaves the queue as it was.
+    if (!evict && ((offset = mqtt_outbox_find_room(size)) < 0))
+    {
+        return NULL;
+    }
+
+    // Only the latest value of the topic is wanted: drop the ones still waiting.
+    if ((mqtt_outbox_get_policy(topic) == OUTBOX_KEEP_LATEST) && outbox_used)
+    {
+        u32_t offsetScan = outbox_head;
+        u32_t scanned = 0;
+        while (scanned < outbox_used)
+        {
+            mqtt_outbox_rec_t *rec = mqtt_outbox_rec(offsetScan);
+            if (!rec->superseded && !strcmp(mqtt_outbox_rec_topic(rec), topic))
+            {
+                rec->superseded = 1;
+                outbox_stats.queued--;
+                outbox_stats.replaced++;
+            }
+            scanned += rec->size;
+            offsetScan = rec->wrap ? 0 : (offsetScan + rec->size) % MQTT_OUTBOX_ARENA_SIZE;
+        }
+    }
+
+    // Make room by dropping the oldest messages.
+    while ((offset < 0) && ((offset = mqtt_outbox_find_room(size)) < 0))
+    {
+        outbox_stats.dropped += mqtt_outbox_pop();
+    }
+
+    mqtt_outbox_rec_t *rec = mqtt_outbox_rec(offset);
+    rec->size = size;
+    rec->wrap = 0;
+    rec->superseded = 0;
+    rec->len = len;
+    memcpy((char *)(rec + 1), topic, topicLen + 1);
+
+    outbox_tail = offset + size;
+    if (outbox_tail == MQTT_OUTBOX_ARENA_SIZE)
+    {
+        outbox_tail = 0;
+    }
+    outbox_used += size;
+    outbox_stats.queued++;
+    outbox_stats.enqueued++;
+    if (outbox_stats.queued > outbox_stats.max_queued)
+    {
+        outbox_stats.max_queued = outbox_stats.queued;
+    }
+    return rec;
+}
+
+/**
+ * @brief Shrinks the last record of the arena to a shorter message, and gives the room left back to the arena.
+ */
+static void mqtt_outbox_shrink(mqtt_outbox_rec_t *rec, u16_t len)
+{
+    u32_t offset = (u8_t *)rec - outbox_arena;
+    u32_t size = mqtt_outbox_rec_size(strlen(mqtt_outbox_rec_topic(rec)), len);
+
+    outbox_used -= rec->size - size;
+    rec->size = size;
+    rec->len = len;
+    outbox_tail = offset + size;
+    if (outbox_tail == MQTT_OUTBOX_ARENA_SIZE)
+    {
+        outbox_tail = 0;
+    }
+}
+
+/**
+ * @brief Queues an MQTT message to be published by mqtt_outbox_poll, and returns straight away.
+ *
+ * The topic and the message are copied into the outbound arena, so the buffers can be reused as soon as this function returns.
+ * If the arena is full, the oldest messages of the queue are dropped to make room (see mqtt_outbox_set_policy).
+ *
+ * @param topic - MQTT topic to which the data will be published.
+ * @param message - Message data to be published.
+ * @return err_t - ERR_OK if the message has been queued, ERR_MEM if it is larger than the arena.
+ */
+err_t mqtt_outbox_enqueue(const char *topic, const char *message)
+{
+    return mqtt_outbox_enqueue_w_len(topic, message, strlen(message));
+}
+
+/**
+ * @brief Queues a binary MQTT message (e.g. a CBOR payload, which can hold null bytes) to be published by mqtt_outbox_poll.
+ *
+ * Same as mqtt_outbox_enqueue, with the length of the message given instead of taken from a null terminator.
+ *
+ * @param topic - MQTT topic to which the data will be published.
+ * @param message - Message data to be published.
+ * @param len - Length of the message, in bytes.
+ * @return err_t - ERR_OK if the message has been queued, ERR_MEM if it is larger than the arena,
+ * ERR_INPROGRESS if a reservation is open (see mqtt_outbox_reserve).
+ */
+err_t mqtt_outbox_enqueue_w_len(const char *topic, const void *message, u16_t len)
+{
+    if (outbox_reserved >= 0)
+    {
+        return ERR_INPROGRESS;
+    }
+
+    mqtt_outbox_rec_t *rec = mqtt_outbox_place(topic, len, true);
+    if (rec == NULL)
+    {
+        return ERR_MEM;
+    }
+    u8_t *dest = (u8_t *)mqtt_outbox_rec_message(rec);
+    memcpy(dest, message, len);
+    dest[len] = '\0';
+    return ERR_OK;
+}
+
+/**
+ * @brief Reserves room for a message at the tail of the outbound queue, for the app to write it there directly
+ * (e.g. with the JSON writer) instead of building it in a buffer of its own and having it copied by mqtt_outbox_enqueue.
+ *
+ * The message is not sent until mqtt_outbox_commit, and nothing else can be queued or sent in between.
+ * Only the free room of the arena is taken: max_len is a bound, usually well above the message, so dropping the oldest
+ * messages for it would lose more of them than the message needs. If the free room is too small, nothing is reserved.
+ * The policy of the topic applies here: with OUTBOX_KEEP_LATEST, the older messages of the topic are dropped
+ * even if the reservation is cancelled.
+ *
+ * @param topic - MQTT topic to which the data will be published.
+ * @param max_len - Most bytes the message can take (the room reserved holds one more, for a null terminator).
+ * @return char* - Where the message goes, NULL if the free room is too small (try again once mqtt_outbox_poll has sent
+ * some messages), if it is larger than the arena, or if a reservation is already open.
+ */
+char *mqtt_outbox_reserve(const char *topic, u16_t max_len)
+{
+    if (outbox_reserved >= 0)
+    {
+        return NULL;
+    }
+
+    mqtt_outbox_rec_t *rec = mqtt_outbox_place(topic, max_len, false);
+    if (rec == NULL)
+    {
+        return NULL;
+    }
+    outbox_reserved = (u8_t *)rec - outbox_arena;
+    return (char *)mqtt_outbox_rec_message(rec);
+}
+
+/**
+ * @brief Queues the message written in the room reserved by mqtt_outbox_reserve, and gives the unused room back.
+ *
+ * @param len - Length of the message, in bytes (up to the max_len given to mqtt_outbox_reserve).
+ * @return err_t - ERR_OK if the message has been queued, ERR_VAL if no room is reserved or len is larger than it.
+ */
+err_t mqtt_outbox_commit(u16_t len)
+{
+    if (outbox_reserved < 0)
+    {
+        return ERR_VAL;
+    }
+
+    mqtt_outbox_rec_t *rec = mqtt_outbox_rec(outbox_reserved);
+    if (len > rec->len)
+    {
+        return ERR_VAL;
+    }
+    mqtt_outbox_shrink(rec, len);
+    ((u8_t *)mqtt_outbox_rec_message(rec))[len] = '\0';
+    outbox_reserved = -1;
+    return ERR_OK;
+}
+
+/**
+ * @brief Gives back the room reserved by mqtt_outbox_reserve, without queuing anything (e.g. the message did not fit).
+ */
+void mqtt_outbox_cancel()
+{
+    if (outbox_reserved < 0)
+    {
+        return;
+    }
+
+    // The record stays in the arena until popped, as an empty message that is skipped.
+    mqtt_outbox_rec_t *rec = mqtt_outbox_rec(outbox_reserved);
+    mqtt_outbox_shrink(rec, 0);
+    rec->superseded = 1;
+    outbox_stats.queued--;
+    outbox_stats.enqueued--;
+    outbox_reserved = -1;
+}
+
+/**
+ * @brief Publishes the queued messages, as far as the in-flight window and the lwIP output buffer allow.
+ *
+ * This function never waits: it stops at the first message that cannot be handed to lwIP straight away,
+ * and leaves it at the head of the queue for the next call. Call it from the main loop, next to cyw43_arch_poll.
+ * Nothing is sent while the client is disconnected, the messages wait in the queue (or get dropped when it is full).
+ *
+ * @return u32_t - Number of messages handed to lwIP.
+ */
+u32_t mqtt_outbox_poll()
+{
+    u32_t sent = 0;
+
+    // A message is being written into the arena, it goes out once committed.
+    if (outbox_reserved >= 0)
+    {
+        return 0;
+    }
+    while (outbox_used && mqtt_is_connected() && readyForNextPubSub())
+    {
+        mqtt_outbox_rec_t *rec = mqtt_outbox_rec(outbox_head);
+        if (rec->wrap)
+        {
+            // Skip the unused end of the arena, there is always a record after a wrap marker.
+            outbox_used -= rec->size;
+            outbox_head = 0;
+            continue;
+        }
+        if (rec->superseded)
+        {
+            mqtt_outbox_pop();
+            continue;
+        }
+
+        // A slot is free, so this does not wait.
+        int slot = mqtt_inflight_acquire(NULL, NULL);
+        err_t err = mqtt_publish_in_slot(slot, mqtt_outbox_rec_topic(rec), mqtt_outbox_rec_message(rec), rec->len, mqtt_config.message_qos, mqtt_config.retain_messages, 0);
+        if (err == ERR_MEM)
+        {
+            // lwIP output buffer full, try again on the next call.
+            break;
+        }
+        if (err != ERR_OK)
+        {
+            outbox_stats.failed++;
+        }
+        else
+        {
+            outbox_stats.sent++;
+            sent++;
+        }
+        mqtt_outbox_pop();
+    }
+    return sent;
+}
+
+/**
+ * @brief Gets the number of messages waiting in the outbound queue.
+ *
+ * @return u32_t - Number of messages queued.
+ */
+u32_t mqtt_outbox_count()
+{
+    return outbox_stats.queued;
+}
+
+/**
+ * @brief Gets the statistics of the outbound queue since boot.
+ *
+ * @param stats - Filled in with the statistics.
+ */
+void mqtt_outbox_get_stats(mqtt_outbox_stats_t *stats)
+{
+    *stats = outbox_stats;
+}
+
+#pragma endregion
+
+#pragma region Batching
+
+/**
+ * @brief A batched topic, and the message being built for it.
+ */
+typedef struct
+{
+    const char *topic;                     // Batched topic (NULL if the entry is unused)
+    u16_t max_samples;                     // Number of samples per message at most
+    u16_t max_bytes;                       // Size of a message at most, closing brackets included
+    u32_t max_age_ms;                      // Time a sample can wait in the batch at most
+    u16_t count;                           // Number of samples in the batch
+    u16_t len;                             // Length of the message so far (the closing brackets are added by the flush)
+    uint64_t t0_us;                        // Time of the first sample of the batch
+    char buffer[MQTT_BATCH_BUFFER_SIZE];   // The message: {"t0":...,"v":[[dt,sample],... then ]} on flush
+} mqtt_batch_t;
+
+static mqtt_batch_t batches[MQTT_BATCH_MAX_TOPICS]; // Batched topics
+static mqtt_batch_stats_t batch_stats;              // Statistics of the batches
+
+/**
+ * @brief Finds the batch of a topic.
+ *
+ * @param topic - MQTT topic.
+ * @return mqtt_batch_t* - The batch of the topic, NULL if the topic is not batched.
+ */
+static mqtt_batch_t *mqtt_batch_find(const char *topic)
+{
+    for (int i = 0; i < MQTT_BATCH_MAX_TOPICS; i++)
+    {
+        if ((batches[i].topic != NULL) && (strcmp(batches[i].topic, topic) == 0))
+        {
+            return &batches[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Closes the message of a batch and queues it for publishing, then empties the batch.
+ *
+ * @param batch - The batch (not empty).
+ * @return err_t - The result of mqtt_outbox_enqueue.
+ */
+static err_t mqtt_batch_queue(mqtt_batch_t *batch)
+{
+    err_t err;
+
+    // Room for the closing brackets is kept by mqtt_batch_add.
+    memcpy(&batch->buffer[batch->len], "]}", 3);
+    err = mqtt_outbox_enqueue(batch->topic, batch->buffer);
+    if (err == ERR_OK)
+    {
+        batch_stats.messages++;
+    }
+    else
+    {
+        DEBUG_printf("Batch of %u samples for %s dropped: %d\n", batch->count, batch->topic, err);
+        batch_stats.dropped++;
+    }
+    batch->count = 0;
+    batch->len = 0;
+    return err;
+}
+
+/**
+ * @brief Batches the samples published to a topic, so that they go out as one message instead of one message each.
+ *
+ * The samples added to the topic (see mqtt_batch_add) accumulate in a buffer, and are queued for publishing as
+ * {"t0":<time of the first sample>,"v":[[<dt>,<sample>],[<dt>,<sample>],...]}
+ * (t0 in milliseconds since boot, dt in milliseconds since t0) once the batch holds max_samples samples,
+ * once its first sample is max_age_ms old (see mqtt_batch_poll), or when the next sample would not fit in max_bytes.
+ *
+ * @param topic - Topic to batch (not copied, must outlive the batch, e.g. a string literal or a static buffer).
+ * @param max_samples - Number of samples per message at most.
+ * @param max_age_ms - Time a sample can wait in the batch at most, in milliseconds.
+ * @param max_bytes - Size of a message at most, in bytes (up to MQTT_BATCH_BUFFER_SIZE, 0: MQTT_BATCH_BUFFER_SIZE).
+ * @return err_t - ERR_OK if the topic is batched, ERR_ARG if a parameter is not valid,
+ * ERR_MEM if MQTT_BATCH_MAX_TOPICS topics are already batched.
+ */
+err_t mqtt_batch_begin(const char *topic, u16_t max_samples, u32_t max_age_ms, u16_t max_bytes)
+{
+    mqtt_batch_t *batch = NULL;
+
+    if ((topic == NULL) || (max_samples == 0) || (max_bytes > MQTT_BATCH_BUFFER_SIZE) || (mqtt_batch_find(topic) != NULL))
+    {
+        return ERR_ARG;
+    }
+    for (int i = 0; (i < MQTT_BATCH_MAX_TOPICS) && (batch == NULL); i++)
+    {
+        if (batches[i].topic == NULL)
+        {
+            batch = &batches[i];
+        }
+    }
+    if (batch == NULL)
+    {
+        return ERR_MEM;
+    }
+
+    batch->max_samples = max_samples;
+    batch->max_age_ms = max_age_ms;
+    batch->max_bytes = (max_bytes == 0) ? MQTT_BATCH_BUFFER_SIZE : max_bytes;
+    batch->count = 0;
+    batch->len = 0;
+    batch->topic = topic;
+    return ERR_OK;
+}
+
+/**
+ * @brief Adds a sample to the batch of its topic, or queues it as a message of its own if the topic is not batched.
+ *
+ * @param topic - MQTT topic of the sample.
+ * @param sample - The sample, as a JSON value (e.g. {"CO2":412,"Temperature":23}).
+ * @return err_t - ERR_OK if the sample has been added (or queued), ERR_MEM if the outbound queue had no room for it
+ * or for the batch it completed.
+ */
+err_t mqtt_batch_add(const char *topic, const char *sample)
+{
+    mqtt_batch_t *batch = mqtt_batch_find(topic);
+    uint64_t now = time_us_64();
+    char row[32];
+    size_t sample_len = strlen(sample);
+    int row_len;
+    err_t err = ERR_OK;
+
+    if (batch == NULL)
+    {
+        return mqtt_outbox_enqueue(topic, sample);
+    }
+    batch_stats.samples++;
+
+    // Row of the sample: [dt, sample], after the header if it is the first sample of the batch.
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        if (batch->count == 0)
+        {
+            batch->t0_us = now;
+            row_len = snprintf(row, sizeof(row), "{\"t0\":%lu,\"v\":[[0,", (unsigned long)(now / 1000));
+        }
+        else
+        {
+            row_len = snprintf(row, sizeof(row), ",[%lu,", (unsigned long)((now - batch->t0_us) / 1000));
+        }
+
+        // The row, and the closing brackets of the row and of the message: "]" + "]}" + null terminator.
+        if (batch->len + row_len + sample_len + 4 <= batch->max_bytes)
+        {
+            memcpy(&batch->buffer[batch->len], row, row_len);
+            batch->len += row_len;
+            memcpy(&batch->buffer[batch->len], sample, sample_len);
+            batch->len += sample_len;
+            batch->buffer[batch->len++] = ']';
+            batch->count++;
+            break;
+        }
+        if (batch->count == 0)
+        {
+            // Too large for a batch of its own, sent as is.
+            DEBUG_printf("Sample too large to be batched, sent on its own: %s\n", topic);
+            return mqtt_outbox_enqueue(topic, sample);
+        }
+        // No room left: the batch goes out, and the sample starts the next one.
+        batch_stats.flush_size++;
+        err = mqtt_batch_queue(batch);
+    }
+
+    if (batch->count >= batch->max_samples)
+    {
+        batch_stats.flush_count++;
+        err = mqtt_batch_queue(batch);
+    }
+    return err;
+}
+
+/**
+ * @brief Queues the batches whose first sample is max_age_ms old. Call it from the main loop, next to mqtt_outbox_poll.
+ *
+ * @return u32_t - Number of batches queued.
+ */
+u32_t mqtt_batch_poll()
+{
+    uint64_t now = time_us_64();
+    u32_t queued = 0;
+
+    for (int i = 0; i < MQTT_BATCH_MAX_TOPICS; i++)
+    {
+        mqtt_batch_t *batch = &batches[i];
+        if ((batch->topic != NULL) && (batch->count > 0) && (now - batch->t0_us >= (uint64_t)batch->max_age_ms * 1000))
+        {
+            batch_stats.flush_age++;
+            if (mqtt_batch_queue(batch) == ERR_OK)
+            {
+                queued++;
+            }
+        }
+    }
+    return queued;
+}
+
+/**
+ * @brief Queues the batch of a topic straight away, whatever its thresholds (e.g. before going to sleep).
+ *
+ * @param topic - Batched topic (NULL: every batch).
+ * @return err_t - ERR_OK if queued (or empty), ERR_MEM if the outbound queue had no room for it.
+ */
+err_t mqtt_batch_flush(const char *topic)
+{
+    err_t result = ERR_OK;
+
+    for (int i = 0; i < MQTT_BATCH_MAX_TOPICS; i++)
+    {
+        mqtt_batch_t *batch = &batches[i];
+        if ((batch->topic != NULL) && (batch->count > 0) && ((topic == NULL) || (strcmp(batch->topic, topic) == 0)))
+        {
+            err_t err = mqtt_batch_queue(batch);
+            if (err != ERR_OK)
+            {
+                result = err;
+            }
+        }
+    }
+    return result;
+}
+
+/**
+ * @brief Gets the statistics of the batches since boot.
+ *
+ * @param stats - Filled in with the statistics.
+ */
+void mqtt_batch_get_stats(mqtt_batch_stats_t *stats)
+{
+    *stats = batch_stats;
+}
+
+#pragma endregion
+#pragma region MQTT subscribe section
+
+/**
+ * @brief Hands the incoming message to the application, once it is complete.
+ */
+static void mqtt_inbox_complete()
+{
+    inbox_active = false;
+    inbox_stats.messages++;
+    inbox_stats.bytes += inbox_received;
+    if (inbox_message_cb != NULL)
+    {
+        inbox_arena[inbox_received] = 0;
+        DEBUG_printf("Message Received [%u]:%s\n", (unsigned int)inbox_received, inbox_arena);
+        inbox_message_cb(inbox_topic, inbox_arena, inbox_received, inbox_cb_arg);
+    }
+}
+
+/**
+ * @brief Callback function for incoming MQTT publish notifications.
+ *
+ * When an incoming publish is received, this function is called to process information about the incoming message.
+ * This includes the topic of the message, and as well as the total length of the payload.
+ *
+ * The pings of the liveness monitoring coming back are set aside first (see mqtt_liveness_poll).
+ * We then keep a copy of the topic (lwIP only passes it here), and check if the incoming payload will fit in the arena
+ * of the reassembly mode (see mqtt_inbox_set_message_callback). If either does not fit, the message is dropped.
+ * A message without payload is handed to the application straight away.
+ *
+ * @param arg - Pointer to the MQTT client state structure.
+ * @param topic - MQTT topic to which the incoming publish is sent.
+ * @param tot_len - Total length of the incoming payload.
+ *
+ * @note If the incoming message does not contain a payload, mqtt_incoming_payload_cb() may not be called.
+ * @note ~~
+ */
+static void mqtt_incoming_notification_cb(void *arg, const char *topic, u32_t tot_len)
+{
+    (void)arg;
+    size_t topic_len = strnlen(topic, MQTT_INBOX_TOPIC_LEN);
+
+    DEBUG_printf("Incoming publish at topic %s with total length %u\n", topic, (unsigned int)tot_len);
+    inbox_active = false;
+    liveness_heard_us = time_us_64();
+
+    // A ping coming back is checked by the library (see mqtt_incoming_payload_cb), never handed to the application.
+    liveness_echo_incoming = liveness_ping_enabled && !strcmp(topic, liveness_ping_topic);
+    if (liveness_echo_incoming)
+    {
+        return;
+    }
+    inbox_total_len = tot_len;
+    inbox_received = 0;
+    if (tot_len > inbox_stats.largest)
+    {
+        inbox_stats.largest = tot_len;
+    }
+
+    if ((inbox_chunk_cb == NULL) && (inbox_message_cb == NULL))
+    {
+        return;
+    }
+    if (topic_len >= MQTT_INBOX_TOPIC_LEN)
+    {
+        DEBUG_printf("Error: incoming topic does not fit in buffer. Data discarded\n");
+        inbox_stats.topic_too_long++;
+        return;
+    }
+    if ((inbox_message_cb != NULL) && (tot_len >= inbox_arena_size))
+    {
+        DEBUG_printf("Error: incoming publish does not fit in buffer. Data discarded\n");
+        inbox_stats.too_large++;
+        return;
+    }
+
+    // Copied with its null terminator, lwIP reuses its buffer for the payload.
+    memcpy(inbox_topic, topic, topic_len + 1);
+    inbox_active = true;
+    if (tot_len == 0)
+    {
+        if (inbox_chunk_cb != NULL)
+        {
+            inbox_chunk_cb(inbox_topic, 0, NULL, 0, 0, inbox_cb_arg);
+        }
+        mqtt_inbox_complete();
+    }
+}
+
+/**
+ * @brief Callback function for incoming MQTT publish payloads.
+ *
+ * When an incoming message is received, this function is called to process the payload of the incoming message.
+ * This function hands the fragment to the chunk callback, or copies it into the arena of the reassembly mode,
+ * and hands the message to the application once it is complete.
+ *
+ * @param arg - Pointer to the MQTT client state structure.
+ * @param data - Pointer to the incoming payload data.
+ * @param len - Length of the incoming payload.
+ * @param flags - Flags indicating the status of the incoming payload.
+ *
+ * @note If the incoming message does not contain a payload, this function may not be called (the message is complete on notification).
+ * @note ~~
+ */
+static void mqtt_incoming_payload_cb(void *arg, const u8_t *data, u16_t len, u8_t flags)
+{
+    (void)arg;
+    // The latest ping is back if it carries its sequence number (an older one could still be on its way).
+    if (liveness_echo_incoming)
+    {
+        if ((len == strlen(liveness_ping_payload)) && !memcmp(data, liveness_ping_payload, len))
+        {
+            liveness_echo_us = time_us_64();
+        }
+        liveness_echo_incoming = false;
+        return;
+    }
+    if (!inbox_active)
+    {
+        return;
+    }
+    // Never more than announced (the arena was sized from it).
+    if (len > inbox_total_len - inbox_received)
+    {
+        len = inbox_total_len - inbox_received;
+    }
+
+    if (inbox_chunk_cb != NULL)
+    {
+        inbox_chunk_cb(inbox_topic, inbox_received, data, len, inbox_total_len, inbox_cb_arg);
+    }
+    else
+    {
+        memcpy(&inbox_arena[inbox_received], data, len);
+    }
+    inbox_received += len;
+
+    if ((inbox_received == inbox_total_len) || (flags & MQTT_DATA_FLAG_LAST))
+    {
+        mqtt_inbox_complete();
+    }
+}
+
+/**
+ * @brief Sets the callback functions for incoming MQTT publish notifications and payloads.
+ *
+ * This function allows the user to set custom callback functions for processing incoming MQTT publish notifications and payloads.
+ * If not set, the default callback functions will be used instead, which hand the incoming messages to the inbox
+ * (see mqtt_inbox_set_message_callback and mqtt_inbox_set_chunk_callback).
+ * Otherwise, if set, the user-defined callback functions will be used instead, until the next connection to the broker.
+ *
+ * @param pub_cb - Callback function for processing new incoming message topics and information about it's payload.
+ * @param data_cb - Callback function for incoming message payload.
+ * @param arg - Any additional arguments to be passed to the callback functions.
+ *
+ * @note When a message is recieved, pub_cb is called first followed by data_cb.
+ * @note And if there is no payload, (e.g. a topic was published to the broker without any message), only pub_cb will be called but data_cb will not be called.
+ * @note The pings of the liveness monitoring no longer come back through the library: they stop until the next connection (see mqtt_get_liveness).
+ * @note ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+void set_mqtt_subscribe_callback(mqtt_incoming_publish_cb_t pub_cb, mqtt_incoming_data_cb_t data_cb, void *arg)
+{
+    liveness_ping_enabled = false;
+    mqtt_set_inpub_callback(_mqtt_state->mqtt_client, pub_cb, data_cb, arg);
+}
+
+/**
+ * @brief Hands the incoming messages to the application fragment by fragment, without copying them.
+ *
+ * Meant for payloads too large to be held in RAM at once (e.g. streamed to the flash or straight to a LED strip).
+ * Replaces the message callback (see mqtt_inbox_set_message_callback). The callback is called from the lwIP context.
+ *
+ * @param cb - Chunk callback (NULL: incoming messages are dropped).
+ * @param arg - User argument passed to the callback.
+ */
+void mqtt_inbox_set_chunk_callback(mqtt_inbox_chunk_cb_t cb, void *arg)
+{
+    cyw43_arch_lwip_begin();
+    inbox_active = false;
+    inbox_message_cb = NULL;
+    inbox_chunk_cb = cb;
+    inbox_cb_arg = arg;
+    cyw43_arch_lwip_end();
+}
+
+/**
+ * @brief Reassembles the incoming messages into an arena of the caller, and hands each of them to the application once complete.
+ *
+ * The arena holds one message at a time, so its size is the largest payload accepted plus the null terminator:
+ * larger messages are dropped (see mqtt_inbox_get_stats). Replaces the chunk callback (see mqtt_inbox_set_chunk_callback).
+ * The callback is called from the lwIP context.
+ *
+ * @param arena - Buffer the messages are reassembled into (must outlive the client).
+ * @param size - Size of the arena, in bytes.
+ * @param cb - Message callback (NULL: incoming messages are dropped).
+ * @param arg - User argument passed to the callback.
+ */
+void mqtt_inbox_set_message_callback(u8_t *arena, u32_t size, mqtt_inbox_message_cb_t cb, void *arg)
+{
+    cyw43_arch_lwip_begin();
+    inbox_active = false;
+    inbox_chunk_cb = NULL;
+    inbox_arena = arena;
+    inbox_arena_size = (arena != NULL) ? size : 0;
+    inbox_message_cb = (inbox_arena_size > 0) ? cb : NULL;
+    inbox_cb_arg = arg;
+    cyw43_arch_lwip_end();
+}
+
+/**
+ * @brief Gets the statistics of the inbox since boot.
+ *
+ * @param stats - Filled in with the statistics.
+ */
+void mqtt_inbox_get_stats(mqtt_inbox_stats_t *stats)
+{
+    *stats = inbox_stats;
+}
+
+/**
+ * @brief Subscribes or unsubscribes from an MQTT topic.
+ *
+ * This function subscribes or unsubscribes from the specified MQTT topic using the configured MQTT client.
+ * It takes a slot of the in-flight window, like a publish.
+ *
+ * @param topic - MQTT topic to subscribe or unsubscribe from.
+ * @param sub_or_unsub - Enumeration specifying whether to subscribe (SUB) or unsubscribe (UNSUB).
+ * @return err_t - ERR_OK if the subscribe or unsubscribe operation is successful, an error code otherwise.
+ */
+err_t mqtt_subscribe_topic(const char *topic, eSubOrUnsub sub_or_unsub)
+{
+    err_t err;
+
+    // Wait for a free slot in the in-flight window.
+    // The subscriptions made by the connected callback are tracked, the connection is only up once they are acknowledged.
+    bool tracked = (conn_state == MQTT_CONN_SUBSCRIBING);
+    int slot = mqtt_inflight_acquire(tracked ? mqtt_conn_subscribe_done : NULL, NULL);
+    if (tracked)
+    {
+        conn_subs_pending++;
+    }
+
+    // Begin LWIP operations related to MQTT.
+    cyw43_arch_lwip_begin();
+
+    // Subscribe or unsubscribe from the MQTT topic using the configured parameters, the slot is released by the callback function.
+    err = mqtt_sub_unsub(_mqtt_state->mqtt_client, topic, mqtt_config.message_qos, mqtt_request_done_cb, mqtt_slot_arg(slot), sub_or_unsub);
+
+    // End LWIP operations related to MQTT.
+    cyw43_arch_lwip_end();
+
+    // Check for errors during subscribe or unsubscribe operation.
+    if (err != ERR_OK)
+    {
+        // Print debug information in case of an error, lwIP did not take the request so release its slot here.
+        DEBUG_printf("Subscribe err: %d\n", err);
+        mqtt_inflight_release(slot, err, false);
+        if (tracked)
+        {
+            conn_subs_pending--;
+            conn_subs_failed = true;
+        }
+        return err;
+    }
+    // Print debug information about successful subscription or unsubscription.
+    if (sub_or_unsub == SUB)
+    {
+        DEBUG_printf("Subscribed to topic: %s\n", topic);
+        return err;
+    }
+
+    if (sub_or_unsub == UNSUB)
+    {
+        DEBUG_printf("Unsubscribed from topic: %s\n", topic);
+        return err;
+    }
+    return err; // I mean... it shouldn't get here, but just in case the pico gets hit with a bitflip or something by the higher beings...
+}
+
+#pragma endregion
+
+#pragma region Topic router
+
+#define MQTT_ROUTER_HASH_SLOTS (2 * MQTT_ROUTER_MAX_ROUTES) // Slots of the hash table of the exact filters (half full at most)
+#define MQTT_ROUTER_FNV_OFFSET 2166136261u                  // FNV-1a hash, of the topics and of their levels
+#define MQTT_ROUTER_FNV_PRIME 16777619u
+
+/**
+ * @brief A topic filter of the router, and its handler.
+ */
+typedef struct
+{
+    const char *filter;                        // Topic filter (see mqtt_router_add)
+    mqtt_inbox_message_cb_t handler;           // Handler of the matching messages
+    void *arg;                                 // User argument of the handler
+    u32_t hash;                                // Hash of the whole filter (exact filters)
+    u32_t level_hash[MQTT_ROUTER_MAX_LEVELS];  // Hash of each level of the filter (wildcard filters)
+    u32_t plus_mask;                           // Bit n set: level n of the filter is `+`
+    u8_t levels;                               // Number of levels of the filter, the final `#` excluded
+    bool multi_level;                          // The filter ends with `#`
+} mqtt_route_t;
+
+static mqtt_route_t router_routes[MQTT_ROUTER_MAX_ROUTES]; // Filters, in the order they were added
+static u8_t router_count = 0;                              // Number of filters
+static u8_t router_exact[MQTT_ROUTER_HASH_SLOTS];          // Hash table of the exact filters (index in router_routes + 1, 0: free)
+static u8_t router_wild[MQTT_ROUTER_MAX_ROUTES];           // Wildcard filters (index in router_routes), in the order they were added
+static u8_t router_wild_count = 0;                         // Number of wildcard filters
+static mqtt_inbox_message_cb_t router_default = NULL;      // Handler of the messages that match no filter
+static void *router_default_arg = NULL;                    // User argument of the default handler
+
+/**
+ * @brief Hashes a topic (or a filter) in one pass: the whole of it, and each of its levels.
+ *
+ * @param topic - Topic to hash.
+ * @param level_hash - Filled in with the hash of the first MQTT_ROUTER_MAX_LEVELS levels.
+ * @param levels - Set to the number of levels of the topic (can be more than MQTT_ROUTER_MAX_LEVELS).
+ * @return u32_t - Hash of the whole topic.
+ */
+static u32_t mqtt_router_hash(const char *topic, u32_t *level_hash, u32_t *levels)
+{
+    u32_t hash = MQTT_ROUTER_FNV_OFFSET;
+    u32_t level = MQTT_ROUTER_FNV_OFFSET;
+    u32_t n = 0;
+
+    for (const char *c = topic;; c++)
+    {
+        if ((*c == '/') || (*c == 0))
+        {
+            if (n < MQTT_ROUTER_MAX_LEVELS)
+            {
+                level_hash[n] = level;
+            }
+            n++;
+            level = MQTT_ROUTER_FNV_OFFSET;
+            if (*c == 0)
+            {
+                break;
+            }
+        }
+        else
+        {
+            level = (level ^ (u8_t)*c) * MQTT_ROUTER_FNV_PRIME;
+        }
+        hash = (hash ^ (u8_t)*c) * MQTT_ROUTER_FNV_PRIME;
+    }
+    *levels = n;
+    return hash;
+}
+
+/**
+ * @brief Checks a topic against a filter, character by character (rules out the hash collisions).
+ *
+ * @param filter - Topic filter, wildcards included.
+ * @param topic - Topic of the message.
+ * @return `True` if the topic matches the filter, `False` otherwise.
+ */
+static bool mqtt_router_matches(const char *filter, const char *topic)
+{
+    // Wildcards in the first level do not match the topics starting with `$` (e.g. $SYS).
+    if ((topic[0] == '$') && ((filter[0] == '+') || (filter[0] == '#')))
+    {
+        return false;
+    }
+    while (true)
+    {
+        if (*filter == '#')
+        {
+            return true;
+        }
+        if (*filter == '+')
+        {
+            // Skip the level of the topic.
+            while ((*topic != '/') && (*topic != 0))
+            {
+                topic++;
+            }
+            filter++;
+        }
+        else if (*filter == *topic)
+        {
+            if (*filter == 0)
+            {
+                return true;
+            }
+            filter++;
+            topic++;
+        }
+        else
+        {
+            // `a/#` also matches `a`.
+            return (*topic == 0) && (filter[0] == '/') && (filter[1] == '#');
+        }
+    }
+}
+
+/**
+ * @brief Registers a handler for the incoming messages whose topic matches a topic filter.
+ *
+ * The filter follows the MQTT rules: `+` matches exactly one level, and `#` (last level only) matches any number of levels,
+ * none included (e.g. `farm/+/temperature`, `farm/#`). Filters without wildcards are looked up in a hash table,
+ * the others are matched level by level on precomputed hashes of the levels, so a message costs one pass over its topic,
+ * whatever the number of filters. Every matching handler is called: the exact filters first, then the wildcard ones,
+ * each in the order they were added.
+ * The filters are subscribed to by mqtt_router_subscribe_all. Meant to be called at start up.
+ *
+ * @param filter - Topic filter (not copied, must outlive the router, e.g. a string literal or a static buffer).
+ * @param handler - Handler called with the matching messages.
+ * @param arg - User argument passed to the handler.
+ * @return err_t - ERR_OK if registered, ERR_ARG if the filter is not valid (or has more than MQTT_ROUTER_MAX_LEVELS levels),
+ * ERR_MEM if MQTT_ROUTER_MAX_ROUTES handlers are already registered.
+ */
+err_t mqtt_router_add(const char *filter, mqtt_inbox_message_cb_t handler, void *arg)
+{
+    mqtt_route_t route = {.filter = filter, .handler = handler, .arg = arg};
+    u32_t levels;
+    u32_t level = 0;
+    bool wild;
+
+    if ((filter == NULL) || (filter[0] == 0) || (handler == NULL))
+    {
+        return ERR_ARG;
+    }
+    if (router_count >= MQTT_ROUTER_MAX_ROUTES)
+    {
+        DEBUG_printf("Router full, %s not added\n", filter);
+        return ERR_MEM;
+    }
+
+    // A wildcard must fill its level, and `#` must be the last level.
+    for (const char *c = filter; *c != 0; c++)
+    {
+        if ((*c == '+') || (*c == '#'))
+        {
+            bool alone = ((c == filter) || (c[-1] == '/')) && ((c[1] == 0) || (c[1] == '/'));
+            if (!alone || ((*c == '#') && (c[1] != 0)))
+            {
+                DEBUG_printf("Invalid topic filter: %s\n", filter);
+                return ERR_ARG;
+            }
+            if (*c == '#')
+            {
+                route.multi_level = true;
+            }
+            else if (level < MQTT_ROUTER_MAX_LEVELS)
+            {
+                route.plus_mask |= 1u << level;
+            }
+            else
+            {
+                DEBUG_printf("Topic filter %s has too many levels\n", filter);
+                return ERR_ARG;
+            }
+        }
+        else if (*c == '/')
+        {
+            level++;
+        }
+    }
+
+    route.hash = mqtt_router_hash(filter, route.level_hash, &levels);
+    route.levels = route.multi_level ? levels - 1 : levels;
+    if (route.levels > MQTT_ROUTER_MAX_LEVELS)
+    {
+        DEBUG_printf("Topic filter %s has too many levels\n", filter);
+        return ERR_ARG;
+    }
+    wild = route.multi_level || (route.plus_mask != 0);
+
+    cyw43_arch_lwip_begin();
+    router_routes[router_count] = route;
+    if (wild)
+    {
+        router_wild[router_wild_count++] = router_count;
+    }
+    else
+    {
+        // Open addressing: the next free slot after the one of the hash.
+        u32_t slot = route.hash % MQTT_ROUTER_HASH_SLOTS;
+        while (router_exact[slot] != 0)
+        {
+            slot = (slot + 1) % MQTT_ROUTER_HASH_SLOTS;
+        }
+        router_exact[slot] = router_count + 1;
+    }
+    router_count++;
+    cyw43_arch_lwip_end();
+    return ERR_OK;
+}
+
+/**
+ * @brief Sets the handler called with the messages that match no filter (e.g. to log them).
+ *
+ * @param handler - Handler (NULL: those messages are ignored).
+ * @param arg - User argument passed to the handler.
+ */
+void mqtt_router_set_default(mqtt_inbox_message_cb_t handler, void *arg)
+{
+    cyw43_arch_lwip_begin();
+    router_default = handler;
+    router_default_arg = arg;
+    cyw43_arch_lwip_end();
+}
+
+/**
+ * @brief Hands an incoming message to the handlers whose filter matches its topic (see mqtt_router_add).
+ *
+ * Has the signature of a message callback, so it can be given to the inbox as is:
+ * `mqtt_inbox_set_message_callback(arena, sizeof(arena), mqtt_router_dispatch, NULL)`.
+ *
+ * @param topic - Topic of the message.
+ * @param payload - Payload of the message.
+ * @param len - Length of the payload.
+ * @param arg - Unused.
+ */
+void mqtt_router_dispatch(const char *topic, const u8_t *payload, u32_t len, void *arg)
+{
+    (void)arg;
+    u32_t level_hash[MQTT_ROUTER_MAX_LEVELS];
+    u32_t levels;
+    u32_t hash = mqtt_router_hash(topic, level_hash, &levels);
+    u32_t slot = hash % MQTT_ROUTER_HASH_SLOTS;
+    bool handled = false;
+
+    // Exact filters: the slots from the one of the hash up to the first free one.
+    while (router_exact[slot] != 0)
+    {
+        mqtt_route_t *route = &router_routes[router_exact[slot] - 1];
+        if ((route->hash == hash) && (strcmp(route->filter, topic) == 0))
+        {
+            route->handler(topic, payload, len, route->arg);
+            handled = true;
+        }
+        slot = (slot + 1) % MQTT_ROUTER_HASH_SLOTS;
+    }
+
+    // Wildcard filters: compare the hashes of the levels, `+` levels excluded.
+    for (u32_t i = 0; i < router_wild_count; i++)
+    {
+        mqtt_route_t *route = &router_routes[router_wild[i]];
+        bool match = route->multi_level ? (levels >= route->levels) : (levels == route->levels);
+        for (u32_t n = 0; match && (n < route->levels); n++)
+        {
+            match = ((route->plus_mask & (1u << n)) != 0) || (route->level_hash[n] == level_hash[n]);
+        }
+        if (match && mqtt_router_matches(route->filter, topic))
+        {
+            route->handler(topic, payload, len, route->arg);
+            handled = true;
+        }
+    }
+
+    if (!handled)
+    {
+        DEBUG_printf("No route for topic %s\n", topic);
+        if (router_default != NULL)
+        {
+            router_default(topic, payload, len, router_default_arg);
+        }
+    }
+}
+
+/**
+ * @brief Subscribes to every filter of the router (once per filter, even if several handlers share it).
+ *
+ * Call it from the connected callback (see mqtt_conn_set_connected_callback), so the connection only counts as up
+ * once the broker has acknowledged all the subscriptions.
+ *
+ * @return err_t - ERR_OK if every subscribe request has been sent, the error of the last one that failed otherwise.
+ */
+err_t mqtt_router_subscribe_all()
+{
+    err_t result = ERR_OK;
+
+    for (u32_t i = 0; i < router_count; i++)
+    {
+        bool duplicate = false;
+        for (u32_t j = 0; (j < i) && !duplicate; j++)
+        {
+            duplicate = (router_routes[j].hash == router_routes[i].hash) && (strcmp(router_routes[j].filter, router_routes[i].filter) == 0);
+        }
+        if (!duplicate)
+        {
+            err_t err = mqtt_subscribe_topic(router_routes[i].filter, SUB);
+            if (err != ERR_OK)
+            {
+                result = err;
+            }
+        }
+    }
+    return result;
 }
 
 #pragma endregion
@@ -4,9 +4,8 @@
 #include "MLX90614_rebuilt.h"
 #include <math.h>
 
+static i2c_tools_bus_t *_bus; // I2C bus the sensor is connected to
 static uint8_t _deviceAddr; // I2C communication device address
-#define MLX90614_SDA PICO_DEFAULT_I2C_SDA_PIN
-#define MLX90614_SCL PICO_DEFAULT_I2C_SCL_PIN
 #define ENABLE_DBG
 #ifdef ENABLE_DBG
 #define DBG printf
@@ -56,15 +55,15 @@ void MLX90614_I2C_writeReg(uint8_t reg, const void *pBuf)
     }
     uint8_t *_pBuf = (uint8_t *)pBuf;
     unsigned char crc_write[5] = {(uint8_t)(_deviceAddr << 1), reg, _pBuf[0], _pBuf[1], '\0'}; // the array prepared for calculating the check code
-    i2c_tools_beginTransmission(_deviceAddr);
-    i2c_tools_write(reg);
+    i2c_tools_beginTransmission(_bus, _deviceAddr);
+    i2c_tools_write(_bus, reg);
 
     for (size_t i = 0; i < 2; i++)
     {
-        i2c_tools_write(_pBuf[i]);
+        i2c_tools_write(_bus, _pBuf[i]);
     }
-    i2c_tools_write(MLX90614_crc8Polyomial107(crc_write, 4));
-    i2c_tools_endTransmission();
+    i2c_tools_write(_bus, MLX90614_crc8Polyomial107(crc_write, 4));
+    i2c_tools_endTransmission(_bus);
 }
 
 size_t MLX90614_I2C_readReg(uint8_t reg, void *pBuf)
@@ -75,21 +74,17 @@ size_t MLX90614_I2C_readReg(uint8_t reg, void *pBuf)
         DBG("pBuf ERROR!! : null pointer");
     }
     uint8_t *_pBuf = (uint8_t *)pBuf;
-    i2c_tools_beginTransmission(_deviceAddr);
-    i2c_tools_write(reg);
-    if (0 != i2c_tools_endTransmission_w_stopbit(false))
+    // Bus errors are already retried (and the bus recovered) by i2c_tools, a corrupted word (bad PEC) is read once more here
+    for (int attempt = 0; (attempt < 2) && (count == 0); attempt++)
     {
-        DBG("endTransmission ERROR!!");
-    }
-    else
-    {
-        // Master device requests size bytes from slave device, which can be accepted by master device with read() or available()
-        i2c_tools_requestFrom(_deviceAddr, (size_t)3);
-        while (i2c_tools_available())
+        // SMBus read word: write the command, repeated start, read the 2 data bytes and the PEC straight into the buffer
+        if (0 != i2c_tools_write_read(_bus, _deviceAddr, &reg, 1, _pBuf, 3))
         {
-            _pBuf[count++] = (uint8_t)i2c_tools_read(); // Use read() to receive and put into buf
+            DBG("write_read ERROR!!");
+            break;
         }
-        i2c_tools_endTransmission();
+
+        count = 3;
         // the array prepared for calculating the check code
         unsigned char crc_read[6] = {(uint8_t)(_deviceAddr << 1), reg, (uint8_t)((_deviceAddr << 1) | 1), _pBuf[0], _pBuf[1], '\0'};
 
@@ -108,6 +103,12 @@ size_t MLX90614_I2C_readReg(uint8_t reg, void *pBuf)
 int MLX90614_begin()
 {
     uint8_t idBuf[3];
+    // The wake up sequence has just probed the sensor, so this is a lookup in the bus presence cache
+    if (!i2c_tools_isPresent(_bus, _deviceAddr))
+    {
+        DBG("ERR_DATA_BUS");
+        return ERR_DATA_BUS;
+    }
     if (0 == MLX90614_I2C_readReg(MLX90614_ID_NUMBER, idBuf))
     { // Judge whether the data bus is successful
         DBG("ERR_DATA_BUS");
@@ -144,7 +145,7 @@ void MLX90614_setEmissivityCorrectionCoefficient(float calibrationValue)
 
 void MLX90614_setMeasuredParameters(eIIRMode_t IIRMode, eFIRMode_t FIRMode)
 {
-    uint8_t buf[2] = {0};
+    uint8_t buf[3] = {0}; // 2 data bytes + PEC
     MLX90614_I2C_readReg(MLX90614_CONFIG_REG1, buf);
     sleep_ms(10);
 
@@ -160,8 +161,11 @@ void MLX90614_setMeasuredParameters(eIIRMode_t IIRMode, eFIRMode_t FIRMode)
 }
 float MLX90614_getAmbientTempCelsius(void)
 {
-    uint8_t buf[2];
-    MLX90614_I2C_readReg(MLX90614_TA, buf);
+    uint8_t buf[3]; // 2 data bytes + PEC
+    if (0 == MLX90614_I2C_readReg(MLX90614_TA, buf))
+    {
+        return NAN; // The sensor could not be read, do not convert whatever is left in the buffer
+    }
     float temp = ((uint16_t)buf[0] | (uint16_t)(buf[1] << 8)) * 0.02 - 273.15;
 
     return temp; // Get celsius temperature of the ambient
@@ -169,8 +173,11 @@ float MLX90614_getAmbientTempCelsius(void)
 
 float MLX90614_getObjectTempCelsius(void)
 {
-    uint8_t buf[2];
-    MLX90614_I2C_readReg(MLX90614_TOBJ1, buf);
+    uint8_t buf[3]; // 2 data bytes + PEC
+    if (0 == MLX90614_I2C_readReg(MLX90614_TOBJ1, buf))
+    {
+        return NAN; // The sensor could not be read, do not convert whatever is left in the buffer
+    }
     // DBG((buf[0] | buf[1] << 8), HEX);
     float temp = ((uint16_t)buf[0] | (uint16_t)(buf[1] << 8)) * 0.02 - 273.15;
 
@@ -179,8 +186,11 @@ float MLX90614_getObjectTempCelsius(void)
 
 float MLX90614_getObject2TempCelsius(void)
 {
-    uint8_t buf[2];
-    MLX90614_I2C_readReg(MLX90614_TOBJ2, buf);
+    uint8_t buf[3]; // 2 data bytes + PEC
+    if (0 == MLX90614_I2C_readReg(MLX90614_TOBJ2, buf))
+    {
+        return NAN; // The sensor could not be read, do not convert whatever is left in the buffer
+    }
     // DBG((buf[0] | buf[1] << 8), HEX);
     float temp = ((uint16_t)buf[0] | (uint16_t)(buf[1] << 8)) * 0.02 - 273.15;
 
@@ -219,9 +229,13 @@ uint8_t MLX90614_readModuleFlags(void)
 }
 
 /******MLX90614 I2C COMPONENT SECTION******/
-void MLX90614_I2C_init(uint8_t i2cAddr)
+void MLX90614_I2C_init(i2c_tools_bus_t *bus, uint8_t i2cAddr)
 {
+    _bus = bus;
     _deviceAddr = i2cAddr;
+
+    // SMBus device, keep it at 100kHz even if the other devices on the bus run faster
+    i2c_tools_setDeviceClock(_bus, _deviceAddr, MLX90614_I2C_CLOCK_HZ);
 }
 
 int MLX90614_I2C_begin()
@@ -237,10 +251,10 @@ void MLX90614_enterSleepMode(bool mode)
     if (mode)
     {
         // sleep command, refer to the chip datasheet
-        i2c_tools_beginTransmission(_deviceAddr);
-        i2c_tools_write(MLX90614_SLEEP_MODE);
-        i2c_tools_write(MLX90614_SLEEP_MODE_PEC);
-        i2c_tools_endTransmission();
+        i2c_tools_beginTransmission(_bus, _deviceAddr);
+        i2c_tools_write(_bus, MLX90614_SLEEP_MODE);
+        i2c_tools_write(_bus, MLX90614_SLEEP_MODE_PEC);
+        i2c_tools_endTransmission(_bus);
         DBG("enter sleep mode");
     }
     else
@@ -248,19 +262,19 @@ void MLX90614_enterSleepMode(bool mode)
         // end();
 
         // wake up command, refer to the chip datasheet
-        pinMode(MLX90614_SDA, OUTPUT);
-        pinMode(MLX90614_SCL, OUTPUT);
-        digitalWrite(MLX90614_SCL, LOW);
-        digitalWrite(MLX90614_SDA, HIGH);
+        pinMode(i2c_tools_getSDA(_bus), OUTPUT);
+        pinMode(i2c_tools_getSCL(_bus), OUTPUT);
+        digitalWrite(i2c_tools_getSCL(_bus), LOW);
+        digitalWrite(i2c_tools_getSDA(_bus), HIGH);
         sleep_ms(50);
-        digitalWrite(MLX90614_SCL, HIGH);
-        digitalWrite(MLX90614_SDA, LOW);
+        digitalWrite(i2c_tools_getSCL(_bus), HIGH);
+        digitalWrite(i2c_tools_getSDA(_bus), LOW);
         sleep_ms(50);
 
-        i2c_tools_begin(); // Wire.h（I2C）library function initialize wire library
+        i2c_tools_begin(_bus); // Wire.h（I2C）library function initialize wire library
 
-        i2c_tools_beginTransmission(_deviceAddr);
-        i2c_tools_endTransmission();
+        i2c_tools_beginTransmission(_bus, _deviceAddr);
+        i2c_tools_endTransmission(_bus);
         DBG("exit sleep mode");
     }
     sleep_ms(200);
@@ -22,6 +22,8 @@
 #define MLX90614_SLEEP_MODE 0xFF     ///< Enter SLEEP mode
 #define MLX90614_SLEEP_MODE_PEC 0xE8 ///< Enter SLEEP mode PEC
 
+#define MLX90614_I2C_CLOCK_HZ 100000 ///< SMBus is limited to 100kHz, registered with i2c_tools by MLX90614_I2C_init
+
 #define NO_ERR 0            ///< No error
 #define ERR_DATA_BUS (-1)   ///< data bus error
 #define ERR_IC_VERSION (-2) ///< the chip version not match
@@ -83,6 +85,7 @@ void MLX90614_setMeasuredParameters(eIIRMode_t IIRMode, eFIRMode_t FIRMode);
  * @fn getAmbientTempCelsius
  * @brief get ambient temperature, unit is Celsius
  * @return return value range： -40.01 °C ~ 85 °C
+ * @n  NAN if the sensor could not be read
  */
 float MLX90614_getAmbientTempCelsius(void);
 
@@ -92,6 +95,7 @@ float MLX90614_getAmbientTempCelsius(void);
  * @return return value range：
  * @n  -70.01 °C ~ 270 °C(MLX90614ESF-DCI)
  * @n  -70.01 °C ~ 380 °C(MLX90614ESF-DCC)
+ * @n  NAN if the sensor could not be read
  */
 float MLX90614_getObjectTempCelsius(void);
 
@@ -99,6 +103,7 @@ float MLX90614_getObjectTempCelsius(void);
  * @fn getObject2TempCelsius
  * @brief get temperature of object 2, unit is Celsius
  * @return return value range： -40 C ~ 85 C
+ * @n  NAN if the sensor could not be read
  */
 float MLX90614_getObject2TempCelsius(void);
 
@@ -133,11 +138,11 @@ size_t MLX90614_readReg(uint8_t reg, void *pBuf);
 /**
  * @fn DFRobot_MLX90614_I2C
  * @brief constructor, set sensor I2C communication address according to SDO pin wiring
+ * @param bus I2C bus handle returned by i2c_tools_init, the sensor can sit on either i2c0 or i2c1
  * @param i2cAddr mlx9614 I2C communication address (Default: 0x5A)
- * @param pWire Wire object is defined in Wire.h, so just use &Wire and the methods in Wire can be pointed to and used
  * @return None
  */
-void MLX90614_I2C_init(uint8_t i2cAddr);
+void MLX90614_I2C_init(i2c_tools_bus_t *bus, uint8_t i2cAddr);
 
 /**
  * @fn begin
@@ -5,8 +5,9 @@
  * An all in one i2c library for the Raspberry Pi Pico, designed to be a drop-in replacement for the Arduino Wire library.
  * Based on the arduino-pico wire library written by Earle F. Philhower, III (@earlephilhower) https://github.com/earlephilhower/arduino-pico
  *
- * Do note that only the master mode functionalities have been ported, while the slave mode functionalities have been left out.
- * As for our project's purposes, we only need the master mode functionalities.
+ * Do note that the slave mode of the Wire library (onReceive/onRequest) has not been ported as-is.
+ * Instead, a bus can act as a slave device exposing a register map (see i2c_tools_begin_w_address),
+ * which is what a Pico needs to share its sensor samples with another Pico.
  *
  * This library aims to provide a C version, drop-in replacement for the Arduino Wire library.
  * Designed to be as close to the original Arduino API as possible, this will allow existing I2C code written for Arduino to work on the Raspberry Pi Pico.
@@ -17,8 +18,8 @@
  *
  * To make things simpler, any code that is called in the I2C library will be prefixed with "i2c_tools_".
  * e.g. _pWire = TwoWire(0) will become i2c_tools_init(i2c0, PICO_DEFAULT_I2C_SDA_PIN, PICO_DEFAULT_I2C_SCL_PIN) instead.
- * _pWire->begin() will become i2c_tools_begin() instead.
- * and _pWire->beginTransmission() will become i2c_tools_beginTransmission() instead.
+ * _pWire->begin() will become i2c_tools_begin(bus) instead.
+ * and _pWire->beginTransmission() will become i2c_tools_beginTransmission(bus) instead.
  * etc, etc. (see the example ported I2C libraries for more details)
  *
  * Additionally, the following functions have also been ported from the Arduino wiring API:
@@ -28,48 +29,187 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include <pico/stdlib.h>
+#include <pico/sync.h>
 #include <hardware/gpio.h>
 #include <hardware/i2c.h>
+#include <hardware/dma.h>
 #include <hardware/irq.h>
 #include <hardware/regs/intctrl.h>
 #include "i2c_tools.h"
 
-// Timeout value for I2C operations in milliseconds.
-static int _timeout = 500;
+/**
+ * @brief Context of one I2C bus (one per hardware controller).
+ *
+ * Every bus has its own pins, clock rate, transmission buffer and DMA channels,
+ * so i2c0 and i2c1 can be driven independently (and concurrently, using the asynchronous transfers).
+ */
+struct i2c_tools_bus
+{
+    // Timeout value for I2C operations in milliseconds.
+    int _timeout;
+
+    // I2C instance pointer.
+    i2c_inst_t *_i2c;
+
+    // GPIO pin for the I2C data line.
+    int _sda;
+
+    // GPIO pin for the I2C clock line.
+    int _scl;
+
+    // Default clock frequency for the I2C communication (devices without a clock of their own).
+    int _clkHz;
+
+    // Clock frequency the controller is currently timed for, in Hertz (0 if it has to be retimed before the next transfer).
+    uint32_t _appliedHz;
+
+    // Clock frequency of each 7-bit address in Hertz, 0 for the default clock of the bus (see i2c_tools_setDeviceClock).
+    uint32_t _devClkHz[128];
+
+    // Flag indicating whether I2C is currently running/initialized.
+    bool _running;
+
+    // Flag indicating whether the I2C instance is in slave mode (see i2c_tools_begin_w_address).
+    bool _slave;
+
+    // 7-bit I2C address for the target device in master mode.
+    uint8_t _addr;
+
+    // Flag indicating whether a transmission session is in progress.
+    bool _txBegun;
+
+    // Internal buffer for storing data during I2C operations.
+    uint8_t _buff[WIRE_BUFFER_SIZE];
+
+    // Length of data in the internal buffer.
+    int _buffLen;
+
+    // Offset within the internal buffer.
+    int _buffOff;
+
+    // DMA channel feeding the I2C TX FIFO with data/command words (-1 if not claimed).
+    int _txDma;
+
+    // DMA channel draining the I2C RX FIFO into the destination buffer (-1 if not claimed).
+    int _rxDma;
+
+    // Data/command words fed to the I2C controller by the TX DMA channel.
+    uint32_t _cmdBuff[WIRE_BUFFER_SIZE];
+
+    // The asynchronous transfer currently in flight on the bus (NULL if the bus is idle).
+    i2c_tools_xfer_t *_activeXfer;
+
+    // Bitmap of the 7-bit addresses whose presence is known (probed, or seen in a completed transfer).
+    uint32_t _probed[4];
+
+    // Bitmap of the 7-bit addresses that acknowledged their last probe or transfer.
+    uint32_t _present[4];
+
+    // Number of times a failed blocking transaction is retried (the bus is recovered first if it looks stuck).
+    uint8_t _retries;
+
+    // Deadline of a whole blocking transaction in milliseconds, retries and bus recovery included.
+    uint32_t _xferDeadlineMs;
+
+    // Number of failed transactions per 7-bit address (saturates at 0xFFFF).
+    uint16_t _errCount[128];
+
+    // Number of times the bus has been recovered by i2c_tools_recoverBus.
+    uint32_t _recoveries;
+
+    // Guards the transaction queue and the claim of the controller by a transfer (shared by both cores).
+    critical_section_t _cs;
+
+    // Ticket handed out to the next transaction queuing up for the bus.
+    volatile uint32_t _nextTicket;
+
+    // Ticket of the transaction that currently owns the bus.
+    volatile uint32_t _nowServing;
+
+    // Core that owns the bus lock (-1 if the bus is free).
+    volatile int _lockCore;
+
+    // Number of times the owner has taken the lock (the lock is recursive).
+    uint32_t _lockDepth;
 
-// I2C instance pointer.
-static i2c_inst_t *_i2c;
+    // Flag indicating that the owner keeps the lock because its last transfer did not issue a Stop.
+    bool _heldForRestart;
 
-// GPIO pin for the I2C data line.
-static int _sda;
+    // Flag indicating that a core is driving the in-flight transfer in i2c_tools_poll.
+    volatile bool _polling;
 
-// GPIO pin for the I2C clock line.
-static int _scl;
+    // Contention statistics of the transaction queue.
+    i2c_tools_lock_stats_t _lockStats;
 
-// Clock frequency for the I2C communication.
-static int _clkHz;
+    // Ring of the last blocking transactions (see i2c_tools_getTrace), only written by the core that owns the bus.
+    i2c_tools_trace_record_t _trace[I2C_TOOLS_TRACE_SIZE];
 
-// Flag indicating whether I2C is currently running/initialized.
-static bool _running;
+    // Number of transactions recorded since the trace was cleared (the next one goes to _trace[_traceHead % I2C_TOOLS_TRACE_SIZE]).
+    volatile uint32_t _traceHead;
 
-// Flag indicating whether the I2C instance is in slave mode. (Not in use, but kept for compatibility)
-static bool _slave;
+    // Latency histograms of the first devices addressed since the trace was cleared.
+    i2c_tools_latency_hist_t _hists[I2C_TOOLS_TRACE_DEVICES];
 
-// 7-bit I2C address for the target device in master mode.
-static uint8_t _addr;
+    // Number of latency histograms in use.
+    volatile int _histCount;
 
-// Flag indicating whether a transmission session is in progress.
-static bool _txBegun;
+    // Total time spent in blocking transactions since the trace was cleared, in microseconds.
+    uint64_t _traceBusUs;
 
-// Internal buffer for storing data during I2C operations.
-static uint8_t _buff[WIRE_BUFFER_SIZE];
+    // Time at which the trace was last cleared (start of the trace window), in microseconds.
+    uint64_t _traceSince;
 
-// Length of data in the internal buffer.
-static int _buffLen;
+    // Register map answered to the master in slave mode.
+    uint8_t _slaveRegs[I2C_TOOLS_SLAVE_REGS];
 
-// Offset within the internal buffer.
-static int _buffOff;
+    // Register updates held back while the master is reading, exposed at the end of the read.
+    uint8_t _slavePending[I2C_TOOLS_SLAVE_REGS];
+
+    // Bitmap of the registers with an update held back in _slavePending.
+    uint32_t _slaveDirty[I2C_TOOLS_SLAVE_REGS / 32];
+
+    // Flag indicating that some registers have an update held back.
+    bool _slaveHasPending;
+
+    // Number of registers of the register map.
+    uint16_t _slaveSize;
+
+    // First register the master may write.
+    uint16_t _slaveWrFirst;
+
+    // Number of registers the master may write from _slaveWrFirst.
+    uint16_t _slaveWrCount;
+
+    // Register pointer, set by the first byte of a master write and auto-incremented (saturates at _slaveSize).
+    uint16_t _slavePtr;
+
+    // Flag indicating that a master transaction addressed to the bus is in progress.
+    bool _slaveInXfer;
+
+    // Flag indicating that the master is reading in the current transaction.
+    bool _slaveReading;
+
+    // First register and number of registers written by the master in the current transaction.
+    uint8_t _slaveWrReg;
+    size_t _slaveWrLen;
+
+    // Function called when the master has written to the register map (can be NULL).
+    i2c_tools_reg_write_cb_t _slaveOnWrite;
+
+    // User argument passed to the write callback.
+    void *_slaveOnWriteArg;
+
+    // Number of master transactions served in slave mode.
+    volatile uint32_t _slaveXfers;
+};
+
+// The trace ring is indexed with a mask.
+_Static_assert((I2C_TOOLS_TRACE_SIZE & (I2C_TOOLS_TRACE_SIZE - 1)) == 0, "I2C_TOOLS_TRACE_SIZE must be a power of 2");
+
+// One bus context per hardware I2C controller (i2c0 and i2c1).
+static i2c_tools_bus_t _buses[NUM_I2CS];
 
 // Default TWI (Two-Wire Interface) clock frequency.
 static const uint32_t TWI_CLOCK = 100000;
@@ -77,6 +217,36 @@ static const uint32_t TWI_CLOCK = 100000;
 // Array to store the pin mode for each GPIO pin.
 static PinMode _pm[30];
 
+// Function called while the blocking functions are waiting for the bus.
+static void (*_idleCallback)(void);
+
+// Flag indicating whether the idle callback is currently running (prevents re-entering it).
+static bool _inIdleCallback;
+
+// Core the idle callback was registered from, it is never called from the other core.
+static uint _idleCallbackCore;
+
+// Forward declaration, used by i2c_tools_end to abort a transfer still in flight.
+static void _finishTransfer(i2c_tools_xfer_t *xfer, uint8_t result);
+
+// Forward declaration, used by the transfers to keep the presence cache up to date.
+static void _setPresent(i2c_tools_bus_t *bus, uint8_t addr, bool present);
+
+// Forward declaration, used by i2c_tools_recoverBus to wait for a target stretching the clock.
+static bool _clockStretch(int pin);
+
+// Forward declaration, used by i2c_tools_lock to keep the system serviced while queuing for the bus.
+static void _runIdleCallback(void);
+
+// Forward declaration, used by i2c_tools_poll to drive the in-flight transfer.
+static bool _pollTransfer(i2c_tools_bus_t *bus, i2c_tools_xfer_t *xfer);
+
+// Forward declaration, used by the blocking transactions to record themselves in the trace.
+static void _traceRecord(i2c_tools_bus_t *bus, uint8_t addr, uint8_t dir, size_t len, uint64_t start, uint8_t result, int attempts);
+
+// Forward declaration, used by i2c_tools_end to take the bus out of slave mode.
+static void _slaveStop(i2c_tools_bus_t *bus);
+
 #pragma region GPIO function calls (from wiring_digital.c)
 
 /**
@@ -193,22 +363,71 @@ void pinMode(int pin, int mode)
 /**
  * @brief Initializes I2C tools with the specified parameters.
  *
- * This function initializes the I2C tools with the provided I2C instance, SDA and SCL pins, and default clock frequency.
+ * This function initializes the bus context of the provided I2C instance with the SDA and SCL pins, and default clock frequency.
+ * There is one context per hardware controller, so calling this function twice with the same instance returns the same handle.
+ * If that bus is already running, it is returned untouched.
  *
- * @param i2c Pointer to the I2C instance.
+ * @param i2c Pointer to the I2C instance (i2c0 or i2c1).
  * @param sda The pin number for the I2C SDA (data) line.
  * @param scl The pin number for the I2C SCL (clock) line.
+ * @return Pointer to the I2C bus handle, to be passed to every other i2c_tools function.
  */
-void i2c_tools_init(i2c_inst_t *i2c, int sda, int scl)
+i2c_tools_bus_t *i2c_tools_init(i2c_inst_t *i2c, int sda, int scl)
 {
+    // Look up the context of the hardware controller.
+    i2c_tools_bus_t *bus = &_buses[i2c_hw_index(i2c)];
+
+    // Set up the transaction queue once, it outlives i2c_tools_end/i2c_tools_begin cycles.
+    if (!critical_section_is_initialized(&bus->_cs))
+    {
+        critical_section_init(&bus->_cs);
+        bus->_nextTicket = 0;
+        bus->_nowServing = 0;
+        bus->_lockCore = -1;
+        bus->_lockDepth = 0;
+        bus->_heldForRestart = false;
+        bus->_polling = false;
+        i2c_tools_resetLockStats(bus);
+        i2c_tools_clearTrace(bus);
+
+        // The drivers register the clock of their device once, it is kept across i2c_tools_end/i2c_tools_begin cycles too.
+        memset(bus->_devClkHz, 0, sizeof(bus->_devClkHz));
+    }
+
+    // Do not pull the pins or DMA channels from under a running bus.
+    if (bus->_running)
+    {
+        return bus;
+    }
+
     // Assign parameters to internal variables.
-    _sda = sda;
-    _scl = scl;
-    _i2c = i2c;
-    _clkHz = TWI_CLOCK;
-    _running = false;
-    _txBegun = false;
-    _buffLen = 0;
+    bus->_timeout = 500;
+    bus->_sda = sda;
+    bus->_scl = scl;
+    bus->_i2c = i2c;
+    bus->_clkHz = TWI_CLOCK;
+    bus->_running = false;
+    bus->_txBegun = false;
+    bus->_buffLen = 0;
+    bus->_txDma = -1;
+    bus->_rxDma = -1;
+    bus->_activeXfer = NULL;
+    bus->_retries = I2C_TOOLS_DEFAULT_RETRIES;
+    bus->_xferDeadlineMs = I2C_TOOLS_DEFAULT_DEADLINE_MS;
+    bus->_recoveries = 0;
+    i2c_tools_clearScanCache(bus);
+    i2c_tools_clearErrorCounts(bus);
+
+    // The register map of the slave mode is read-only and spans every register until set otherwise.
+    bus->_slave = false;
+    bus->_slaveSize = I2C_TOOLS_SLAVE_REGS;
+    bus->_slaveWrFirst = 0;
+    bus->_slaveWrCount = 0;
+    bus->_slaveOnWrite = NULL;
+    bus->_slaveOnWriteArg = NULL;
+    memset(bus->_slaveRegs, 0, sizeof(bus->_slaveRegs));
+
+    return bus;
 }
 
 /**
@@ -216,27 +435,28 @@ void i2c_tools_init(i2c_inst_t *i2c, int sda, int scl)
  *
  * This function sets the I2C SDA pin to the specified pin number if not currently running.
  *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
  * @param pin The pin number to set as the I2C SDA pin.
  * @return True if the pin is successfully set or is already set; False otherwise.
  */
-bool i2c_tools_setSDA(int pin)
+bool i2c_tools_setSDA(i2c_tools_bus_t *bus, int pin)
 {
     // Check if the provided pin is the same as the current SDA pin.
-    if (_sda == pin)
+    if (bus->_sda == pin)
     {
         // Return true as the pin is already set.
         return true;
     }
     // Check if I2C is not currently running.
-    if (!_running)
+    if (!bus->_running)
     {
         // Set the SDA pin and return true.
-        _sda = pin;
+        bus->_sda = pin;
         return true;
     }
     else
     {
-        panic("FATAL: Attempting to set Wire%s.SDA while running", i2c_hw_index(_i2c) ? "1" : "");
+        panic("FATAL: Attempting to set Wire%s.SDA while running", i2c_hw_index(bus->_i2c) ? "1" : "");
     }
 
     // Return false if setting the pin fails.
@@ -248,90 +468,165 @@ bool i2c_tools_setSDA(int pin)
  *
  * This function sets the I2C SCL pin to the specified pin number if not currently running.
  *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
  * @param pin The pin number to set as the I2C SCL pin.
  * @return True if the pin is successfully set or is already set; False otherwise.
  */
-bool i2c_tools_setSCL(int pin)
+bool i2c_tools_setSCL(i2c_tools_bus_t *bus, int pin)
 {
     // Check if the provided pin is the same as the current SCL pin.
-    if (_scl == pin)
+    if (bus->_scl == pin)
     {
         // Return true as the pin is already set.
         return true;
     }
     // Check if I2C is not currently running.
-    if (!_running)
+    if (!bus->_running)
     {
         // Set the SCL pin and return true.
-        _scl = pin;
+        bus->_scl = pin;
         return true;
     }
     else
     {
-        panic("FATAL: Attempting to set Wire%s.SCL while running", i2c_hw_index(_i2c) ? "1" : "");
+        panic("FATAL: Attempting to set Wire%s.SCL while running", i2c_hw_index(bus->_i2c) ? "1" : "");
     }
 
     // Return false if setting the pin fails.
     return false;
 }
 
+/**
+ * @brief Gets the I2C SDA (data) pin of a bus.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @return The pin number of the I2C SDA pin.
+ */
+int i2c_tools_getSDA(i2c_tools_bus_t *bus)
+{
+    return bus->_sda;
+}
+
+/**
+ * @brief Gets the I2C SCL (clock) pin of a bus.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @return The pin number of the I2C SCL pin.
+ */
+int i2c_tools_getSCL(i2c_tools_bus_t *bus)
+{
+    return bus->_scl;
+}
+
 /**
  * @brief Sets the clock frequency for I2C communication.
  *
  * This function sets the clock frequency for I2C communication.
  * If I2C is currently running, it updates the baud rate accordingly.
  *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
  * @param hz The desired clock frequency in Hertz.
  */
-void i2c_tools_setClock(uint32_t hz)
+void i2c_tools_setClock(i2c_tools_bus_t *bus, uint32_t hz)
 {
     // Set the internal clock frequency variable.
-    _clkHz = hz;
+    bus->_clkHz = hz;
 
     // Check if I2C is currently running.
-    if (_running)
+    if (bus->_running)
     {
         // Update the I2C baud rate with the new clock frequency.
-        i2c_set_baudrate(_i2c, hz);
+        i2c_set_baudrate(bus->_i2c, hz);
+        bus->_appliedHz = hz;
     }
 }
 
+/**
+ * @brief Sets the clock frequency used for the transactions with one device.
+ *
+ * Devices sharing a bus do not all support the same speed (e.g. an SMBus device limited to 100kHz next to
+ * Fast-mode devices), so each driver registers the clock of its device, usually from its begin function.
+ * Before each transfer, the controller is retimed to the clock of the addressed device, only if it differs from
+ * the clock of the previous transfer, so back-to-back transactions with the same device (or with devices sharing a clock)
+ * cost nothing extra. A transfer continuing a transaction without a Stop keeps the clock of that transaction.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param addr The 7-bit I2C address of the device.
+ * @param freqHz The clock frequency for this device in Hertz, or 0 to use the default clock of the bus again.
+ */
+void i2c_tools_setDeviceClock(i2c_tools_bus_t *bus, uint8_t addr, uint32_t freqHz)
+{
+    // The controller is retimed by the next transfer to this device, if needed.
+    bus->_devClkHz[addr & 0x7F] = freqHz;
+}
+
+/**
+ * @brief Gets the clock frequency used for the transactions with one device.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param addr The 7-bit I2C address of the device.
+ * @return The clock frequency of the device in Hertz, or the default clock of the bus if the device has none.
+ */
+uint32_t i2c_tools_getDeviceClock(i2c_tools_bus_t *bus, uint8_t addr)
+{
+    uint32_t hz = bus->_devClkHz[addr & 0x7F];
+    return hz ? hz : (uint32_t)bus->_clkHz;
+}
+
 /**
  * @brief Initializes I2C communication.
  *
  * This function initializes I2C communication, configuring the I2C instance, pins, and related settings.
  * If I2C is already running, it returns without doing anything further.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
  */
-void i2c_tools_begin()
+void i2c_tools_begin(i2c_tools_bus_t *bus)
 {
     // Check if I2C is already running.
-    if (_running)
+    if (bus->_running)
     {
         // Returns if I2C has already been initialized.
         return;
     }
 
+    // Keep the other core off the bus while the controller is being set up.
+    i2c_tools_lock(bus);
+
     // Set the I2C mode to master.
-    _slave = false;
+    bus->_slave = false;
 
     // Initialize the I2C instance with the specified clock frequency.
-    i2c_init(_i2c, _clkHz);
+    i2c_init(bus->_i2c, bus->_clkHz);
+    bus->_appliedHz = bus->_clkHz;
 
     // Set I2C to master mode with no address.
-    i2c_set_slave_mode(_i2c, false, 0);
+    i2c_set_slave_mode(bus->_i2c, false, 0);
 
     // Configure SDA pin for I2C and enable pull-up resistor.
-    gpio_set_function(_sda, GPIO_FUNC_I2C);
-    gpio_pull_up(_sda);
+    gpio_set_function(bus->_sda, GPIO_FUNC_I2C);
+    gpio_pull_up(bus->_sda);
 
     // Configure SCL pin for I2C and enable pull-up resistor.
-    gpio_set_function(_scl, GPIO_FUNC_I2C);
-    gpio_pull_up(_scl);
+    gpio_set_function(bus->_scl, GPIO_FUNC_I2C);
+    gpio_pull_up(bus->_scl);
+
+    // Claim the DMA channels used by the asynchronous transfers (i2c_init already enables the I2C DREQs).
+    if (bus->_txDma < 0)
+    {
+        bus->_txDma = dma_claim_unused_channel(true);
+    }
+    if (bus->_rxDma < 0)
+    {
+        bus->_rxDma = dma_claim_unused_channel(true);
+    }
 
     // Set internal flags to indicate that I2C is now running.
-    _running = true;
-    _txBegun = false;
-    _buffLen = 0;
+    bus->_running = true;
+    bus->_txBegun = false;
+    bus->_buffLen = 0;
+
+    i2c_tools_unlock(bus);
 }
 
 /**
@@ -339,203 +634,1122 @@ void i2c_tools_begin()
  *
  * This function ends I2C communication, deinitializing the I2C instance and setting pins to INPUT mode.
  * If I2C is not currently running, it returns without doing anything further.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
  */
-void i2c_tools_end()
+void i2c_tools_end(i2c_tools_bus_t *bus)
 {
     // Check if I2C is not currently running.
-    if (!_running)
+    if (!bus->_running)
     {
         // Returns if I2C is not running.
         return;
     }
 
+    // Wait for the transaction in progress on the other core (if any) to complete.
+    i2c_tools_lock(bus);
+
+    // Abort any transfer still in flight before pulling the controller down.
+    if (bus->_activeXfer)
+    {
+        _finishTransfer(bus->_activeXfer, 4);
+    }
+
+    // Stop answering the master if the bus is in slave mode.
+    if (bus->_slave)
+    {
+        _slaveStop(bus);
+    }
+
+    // Release the DMA channels used by the asynchronous transfers (not claimed in slave mode).
+    if (bus->_txDma >= 0)
+    {
+        dma_channel_unclaim(bus->_txDma);
+    }
+    if (bus->_rxDma >= 0)
+    {
+        dma_channel_unclaim(bus->_rxDma);
+    }
+    bus->_txDma = -1;
+    bus->_rxDma = -1;
+
     // Deinitialize the I2C instance.
-    i2c_deinit(_i2c);
+    i2c_deinit(bus->_i2c);
 
     // Set SDA pin to INPUT mode.
-    pinMode(_sda, INPUT);
+    pinMode(bus->_sda, INPUT);
 
     // Set SCL pin to INPUT mode.
-    pinMode(_scl, INPUT);
+    pinMode(bus->_scl, INPUT);
 
     // Set internal flags to indicate that I2C is no longer running.
-    _running = false;
-    _txBegun = false;
+    bus->_running = false;
+    bus->_txBegun = false;
+
+    // Devices may be swapped while the bus is down, so forget what was found on it.
+    i2c_tools_clearScanCache(bus);
+
+    // A bus held for a Restart is released by the shutdown.
+    if (bus->_heldForRestart)
+    {
+        bus->_heldForRestart = false;
+        i2c_tools_unlock(bus);
+    }
+    i2c_tools_unlock(bus);
 }
 
 #pragma endregion
 
-#pragma region I2C transmission functions
+#pragma region Bus arbitration functions (dual-core transaction queue)
+
 /**
- * @brief Starts a new transmission session to the specified address.
+ * @brief Takes the bus lock, queuing up behind the transactions already waiting for it.
  *
- * This function prepares the library to start a transmission session to the specified address.
- * If I2C is not currently running or transmission session is already in progress, it returns without doing anything further.
+ * The bus is shared by both cores, and a transaction is made of several calls (beginTransmission, write, endTransmission...)
+ * that all work on the bus context, so only one core can be in the middle of a transaction at a time.
+ * The blocking functions of this library take the lock by themselves, for the duration of one whole transaction:
+ * from i2c_tools_beginTransmission to i2c_tools_endTransmission, for i2c_tools_requestFrom and i2c_tools_write_read,
+ * and a transfer without a Stop keeps the lock until the transfer that issues the Stop.
+ * Take the lock explicitly to group several transactions (e.g. a command, a delay and a read) or
+ * to read the data received by i2c_tools_requestFrom with i2c_tools_read.
  *
- * @param addr The I2C address of the target device.
+ * Waiting transactions are served in the order they asked for the bus (ticket lock), so neither core can starve the other.
+ * The lock is recursive: the owner can take it again (e.g. a driver function calling the blocking functions), and has to
+ * release it as many times as it has taken it. While waiting, the idle callback is serviced (on the core that registered it).
+ * Not to be used from interrupt handlers.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
  */
-void i2c_tools_beginTransmission(uint8_t addr)
+void i2c_tools_lock(i2c_tools_bus_t *bus)
 {
-    // Check if I2C is not currently running or transmission has already begun.
-    if (!_running || _txBegun)
+    int core = (int)get_core_num();
+
+    // The owner taking the lock again does not queue up.
+    if (bus->_lockCore == core)
     {
-        // Returns without doing anything further if I2C is not running or a transmission is already in progress.
+        bus->_lockDepth++;
         return;
     }
 
-    // Set the target device address for transmission.
-    _addr = addr;
+    // Take a ticket, and note how many transactions are already waiting in front of this one.
+    critical_section_enter_blocking(&bus->_cs);
+    uint32_t ticket = bus->_nextTicket++;
+    uint32_t queued = ticket - bus->_nowServing;
+    critical_section_exit(&bus->_cs);
 
-    // Reset buffer length and offset.
-    _buffLen = 0;
-    _buffOff = 0;
+    // Wait for the bus to be handed over to this ticket.
+    uint64_t start = time_us_64();
+    while (bus->_nowServing != ticket)
+    {
+        _runIdleCallback();
+        tight_loop_contents();
+    }
+    uint32_t waitUs = (uint32_t)(time_us_64() - start);
 
-    // Set internal flag to indicate that a transmission session is in progress.
-    _txBegun = true;
+    bus->_lockCore = core;
+    bus->_lockDepth = 1;
+
+    // Record how long the transaction had to wait for the bus.
+    critical_section_enter_blocking(&bus->_cs);
+    bus->_lockStats.acquisitions++;
+    if (queued)
+    {
+        bus->_lockStats.contended++;
+        bus->_lockStats.totalWaitUs += waitUs;
+        if (waitUs > bus->_lockStats.maxWaitUs)
+        {
+            bus->_lockStats.maxWaitUs = waitUs;
+        }
+        if (queued > bus->_lockStats.maxQueued)
+        {
+            bus->_lockStats.maxQueued = queued;
+        }
+    }
+    critical_section_exit(&bus->_cs);
 }
 
 /**
- * @brief Requests data from an I2C device with an optional stop bit.
+ * @brief Releases the bus lock taken by i2c_tools_lock.
  *
- * This function requests data from an I2C device with the specified address.
- * It reads the specified quantity of bytes into the internal buffer, blocking until the specified absolute time is reached.
+ * Once the owner has released it as many times as it has taken it, the bus is handed over to the next transaction in the queue.
+ * Does nothing if the calling core does not own the bus.
  *
- * @param address The I2C address of the target device.
- * @param quantity The number of bytes to request and read.
- * @param stopBit Indicates whether to send a stop bit after the request.
- * @return The number of bytes read, or 0 if there was an error or invalid parameters.
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
  */
-size_t i2c_tools_requestFrom_w_stopbit(uint8_t address, size_t quantity, bool stopBit)
+void i2c_tools_unlock(i2c_tools_bus_t *bus)
 {
-    // Check if I2C is not currently running, a transmission has already begun, quantity is zero, or quantity exceeds buffer size.
-    if (!_running || _txBegun || !quantity || (quantity > sizeof(_buff)))
+    // Only the owner can release the bus.
+    if ((bus->_lockCore != (int)get_core_num()) || !bus->_lockDepth)
     {
-        // Return 0 if there is an error or invalid parameters.
-        return 0;
+        return;
     }
 
-    // Perform I2C read with optional stop bit, blocking until specified absolute time is reached.
-    _buffLen = i2c_read_blocking_until(_i2c, address, _buff, quantity, !stopBit, make_timeout_time_ms(_timeout));
-
-    // Check for read errors or timeout.
-    if ((_buffLen == PICO_ERROR_GENERIC) || (_buffLen == PICO_ERROR_TIMEOUT))
+    // Nested lock, the owner keeps the bus.
+    if (--bus->_lockDepth)
     {
-        // Reset buffer length to 0 in case of errors.
-        _buffLen = 0;
+        return;
     }
 
-    // Reset buffer offset for subsequent reads.
-    _buffOff = 0;
+    // Hand the bus over to the next ticket.
+    critical_section_enter_blocking(&bus->_cs);
+    bus->_lockCore = -1;
+    bus->_nowServing++;
+    critical_section_exit(&bus->_cs);
+}
 
-    // Return the number of bytes read.
-    return _buffLen;
+/**
+ * @brief Gets the contention statistics of the transaction queue.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param stats Pointer to the structure receiving a snapshot of the statistics.
+ */
+void i2c_tools_getLockStats(i2c_tools_bus_t *bus, i2c_tools_lock_stats_t *stats)
+{
+    critical_section_enter_blocking(&bus->_cs);
+    *stats = bus->_lockStats;
+    critical_section_exit(&bus->_cs);
 }
 
 /**
- * @brief Requests data from an I2C device with a stop bit.
+ * @brief Resets the contention statistics of the transaction queue.
  *
- * This function is a wrapper for i2c_tools_requestFrom_w_stopbit with the stopBit parameter set to true.
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ */
+void i2c_tools_resetLockStats(i2c_tools_bus_t *bus)
+{
+    i2c_tools_lock_stats_t empty = {0};
+
+    critical_section_enter_blocking(&bus->_cs);
+    bus->_lockStats = empty;
+    critical_section_exit(&bus->_cs);
+}
+
+/**
+ * @brief Checks whether the calling core owns the bus lock.
  *
- * @param address The I2C address of the target device.
- * @param quantity The number of bytes to request and read.
- * @return The number of bytes read, or 0 if there was an error or invalid parameters.
+ * @param bus Pointer to the I2C bus handle.
+ * @return True if the calling core owns the bus lock; False otherwise.
  */
-size_t i2c_tools_requestFrom(uint8_t address, size_t quantity)
+static bool _ownsLock(i2c_tools_bus_t *bus)
 {
-    // Call the i2c_tools_requestFrom_w_stopbit function with stopBit parameter set to true.
-    return i2c_tools_requestFrom_w_stopbit(address, quantity, true);
+    return (bus->_lockCore == (int)get_core_num()) && bus->_lockDepth;
 }
 
 /**
- * @brief Implements clock stretching for I2C communication.
+ * @brief Releases the lock level taken for a transaction, once the transfer has completed.
  *
- * This function performs clock stretching by waiting for the specified pin to go HIGH within a time limit.
+ * A transfer without a Stop keeps the bus (the next one begins with a Restart), so its lock level is kept
+ * until the transfer that issues the Stop, which then releases both.
  *
- * @param pin The GPIO pin used for clock stretching.
- * @return True if the pin goes HIGH within the time limit; False otherwise.
+ * @param bus Pointer to the I2C bus handle.
  */
-static bool _clockStretch(int pin)
+static void _endTransaction(i2c_tools_bus_t *bus)
 {
-    // Calculate the absolute end time for the clock stretching period (100 microseconds).
-    uint64_t end = time_us_64() + 100;
-
-    // Wait until either the specified pin goes HIGH or the time limit is reached.
-    while ((time_us_64() < end) && (!digitalRead(pin)))
+    if (bus->_i2c->restart_on_next)
     {
-        // No operation (noop) during the wait.
+        // The bus is still held, keep one lock level until the Stop goes out.
+        if (!bus->_heldForRestart)
+        {
+            bus->_heldForRestart = true;
+            return;
+        }
+    }
+    else if (bus->_heldForRestart)
+    {
+        // The Stop has gone out, also release the level kept by the transfer that held the bus.
+        bus->_heldForRestart = false;
+        i2c_tools_unlock(bus);
     }
 
-    // Return the digital state of the pin after the clock stretching period.
-    return digitalRead(pin);
+    i2c_tools_unlock(bus);
 }
+
+#pragma endregion
+
+#pragma region Asynchronous (DMA) transfer functions
+
 /**
- * @brief Probes an I2C device at the specified address using software I2C.
- *
- * This function probes an I2C device at the specified address using software I2C.
- * It checks for the presence of the device and returns true if an acknowledgment is received.
+ * @brief Maps the I2C controller's abort source register to an Arduino style error code.
  *
- * @param addr The I2C address of the device to probe.
- * @param sda The GPIO pin used for the I2C data line.
- * @param scl The GPIO pin used for the I2C clock line.
- * @param freq The desired frequency for the software I2C communication.
- * @return True if the device acknowledges the address; False otherwise.
+ * @param abortReason The value of the IC_TX_ABRT_SOURCE register.
+ * @return 2 for an address NACK, 3 for a data NACK, 4 for anything else.
  */
-static bool _probe(int addr, int sda, int scl, int freq)
+static uint8_t _abortReasonToError(uint32_t abortReason)
 {
-    // Calculate half of the delay based on the desired frequency.
-    int delay = (1000000 / freq) / 2;
-    bool ack = false;
-
-    // Set up GPIO pins and functions
-    pinMode(sda, INPUT_PULLUP);
-    pinMode(scl, INPUT_PULLUP);
-    gpio_set_function(scl, GPIO_FUNC_SIO);
-    gpio_set_function(sda, GPIO_FUNC_SIO);
+    // The target did not acknowledge its address.
+    if (abortReason & I2C_IC_TX_ABRT_SOURCE_ABRT_7B_ADDR_NOACK_BITS)
+    {
+        return 2;
+    }
+    // The target did not acknowledge one of the data bytes.
+    if (abortReason & I2C_IC_TX_ABRT_SOURCE_ABRT_TXDATA_NOACK_BITS)
+    {
+        return 3;
+    }
+    // Arbitration lost, user abort, etc.
+    return 4;
+}
 
-    // Initialize the start condition.
-    digitalWrite(sda, HIGH);
-    sleep_us(delay);
-    digitalWrite(scl, HIGH);
+/**
+ * @brief Completes the in-flight transfer and invokes its callback.
+ *
+ * On error, both DMA channels are stopped and the controller's abort state is cleared so the next transfer starts from a clean FIFO.
+ *
+ * @param xfer The transfer to complete.
+ * @param result The error code of the transfer (0 on success).
+ */
+static void _finishTransfer(i2c_tools_xfer_t *xfer, uint8_t result)
+{
+    i2c_tools_bus_t *bus = xfer->bus;
 
-    // Check for clock stretching during the start condition.
-    if (!_clockStretch(scl))
+    if (result)
     {
-        goto stop;
+        // Stop feeding/draining the FIFOs, the controller has flushed its TX FIFO and issued a Stop.
+        dma_channel_abort(bus->_txDma);
+        dma_channel_abort(bus->_rxDma);
+
+        // Reading IC_CLR_TX_ABRT releases the TX FIFO from its flushed state.
+        (void)bus->_i2c->hw->clr_tx_abrt;
     }
 
-    digitalWrite(sda, LOW);
-    sleep_us(delay);
-    digitalWrite(scl, LOW);
-    sleep_us(delay);
+    // A successful transfer without a Stop keeps the bus, so the next one has to begin with a Restart.
+    bus->_i2c->restart_on_next = !result && !xfer->stopBit;
 
-    // Send the 7-bit I2C address with MSB first.
-    for (int i = 0; i < 8; i++)
+    // Every transfer tells whether the target is there: it either acknowledged its address or not.
+    if (!result || (result == 2))
     {
-        addr <<= 1;
-        digitalWrite(sda, (addr & (1 << 7)) ? HIGH : LOW);
-        sleep_us(delay);
-        digitalWrite(scl, HIGH);
-        sleep_us(delay);
+        _setPresent(bus, xfer->addr, !result);
+    }
 
-        // Check for clock stretching during data transmission.
-        if (!_clockStretch(scl))
-        {
-            goto stop;
-        }
+    // Publish the outcome and free the bus before handing control to the callback, so it can submit the next transfer.
+    xfer->result = result;
+    xfer->state = result ? I2C_TOOLS_XFER_ERROR : I2C_TOOLS_XFER_DONE;
+    bus->_activeXfer = NULL;
 
-        digitalWrite(scl, LOW);
-        sleep_us(5); // Ensure we don't change too close to the clock edge.
+    if (xfer->callback)
+    {
+        xfer->callback(xfer, xfer->callbackArg);
     }
+}
 
-    // Release the data line and check for acknowledgment.
-    digitalWrite(sda, HIGH);
-    sleep_us(delay);
-    digitalWrite(scl, HIGH);
+/**
+ * @brief Aborts the in-flight transfer after its deadline has passed.
+ *
+ * Asks the controller to abort the transfer (which flushes the TX FIFO and issues a Stop),
+ * and waits a short, bounded time for the controller to acknowledge the request.
+ *
+ * @param bus Pointer to the I2C bus handle.
+ */
+static void _timeoutTransfer(i2c_tools_bus_t *bus)
+{
+    // Request the abort, the controller clears the bit once it has been handled.
+    bus->_i2c->hw->enable |= I2C_IC_ENABLE_ABORT_BITS;
 
-    // Check for clock stretching during acknowledgment.
-    if (!_clockStretch(scl))
+    // Do not hang forever if the target is holding SCL low.
+    uint64_t end = time_us_64() + 1000;
+    while ((bus->_i2c->hw->enable & I2C_IC_ENABLE_ABORT_BITS) && (time_us_64() < end))
     {
-        goto stop;
+        // No operation (noop) while waiting for the abort to complete.
+    }
+
+    _finishTransfer(bus->_activeXfer, 4);
+}
+
+/**
+ * @brief Starts an asynchronous transfer.
+ *
+ * Builds the data/command words for the transfer and kicks off the DMA channels.
+ *
+ * A transfer is made of an optional write phase (txLen bytes) followed by an optional read phase (rxLen bytes).
+ * When both are present, the read phase begins with a Restart, so the whole register access is a single bus transaction.
+ *
+ * @param xfer The transfer handle, with bus, addr, stopBit, txLen, rxLen and rxBuf already filled in.
+ * @param data The bytes to write during the write phase (ignored if txLen is 0).
+ * @return True if the transfer has been started; False if it was rejected (see xfer->result).
+ */
+static bool _startTransfer(i2c_tools_xfer_t *xfer, const uint8_t *data)
+{
+    i2c_tools_bus_t *bus = xfer->bus;
+    size_t len = xfer->txLen + xfer->rxLen;
+
+    // Reject the transfer if I2C is not running (or in slave mode), the bus is busy or owned by the other core, or the length does not fit in the command buffer.
+    // The check and the claim of the controller are done together, so both cores cannot start a transfer at the same time.
+    critical_section_enter_blocking(&bus->_cs);
+    bool rejected = !bus->_running || bus->_slave || bus->_activeXfer || ((bus->_lockCore >= 0) && (bus->_lockCore != (int)get_core_num())) || !len || (len > WIRE_BUFFER_SIZE);
+    if (!rejected)
+    {
+        xfer->state = I2C_TOOLS_XFER_IDLE;
+        bus->_activeXfer = xfer;
+    }
+    critical_section_exit(&bus->_cs);
+
+    if (rejected)
+    {
+        xfer->result = (len > WIRE_BUFFER_SIZE) ? 1 : 4;
+        xfer->state = I2C_TOOLS_XFER_ERROR;
+        return false;
+    }
+
+    i2c_hw_t *hw = bus->_i2c->hw;
+
+    // Build one data/command word per byte: the data bytes of the write phase, then one read command per byte of the read phase.
+    // A Restart on the first byte if the previous transfer kept the bus, a Restart when switching from writing to reading,
+    // and a Stop on the last byte if requested.
+    for (size_t i = 0; i < len; i++)
+    {
+        uint32_t cmd = (i < xfer->txLen) ? data[i] : I2C_IC_DATA_CMD_CMD_BITS;
+        if (((i == 0) && bus->_i2c->restart_on_next) || ((i == xfer->txLen) && (i != 0)))
+        {
+            cmd |= I2C_IC_DATA_CMD_RESTART_BITS;
+        }
+        if ((i == len - 1) && xfer->stopBit)
+        {
+            cmd |= I2C_IC_DATA_CMD_STOP_BITS;
+        }
+        bus->_cmdBuff[i] = cmd;
+    }
+
+    // Retime the controller if the target runs at another clock than the previous transfer,
+    // unless this transfer continues a transaction without a Stop (same target, same clock).
+    uint32_t hz = i2c_tools_getDeviceClock(bus, xfer->addr);
+    if ((hz != bus->_appliedHz) && !bus->_i2c->restart_on_next)
+    {
+        i2c_set_baudrate(bus->_i2c, hz);
+        bus->_appliedHz = hz;
+    }
+
+    // Set the target address (can only be changed while the controller is disabled).
+    hw->enable = 0;
+    hw->tar = xfer->addr;
+    hw->enable = 1;
+
+    // Clear any leftover abort/stop status from a previous transfer.
+    (void)hw->clr_tx_abrt;
+    (void)hw->clr_stop_det;
+
+    xfer->deadline = time_us_64() + (uint64_t)bus->_timeout * 1000;
+    xfer->result = 0;
+
+    // For reads, start draining the RX FIFO first, so no byte can be missed.
+    if (xfer->rxLen)
+    {
+        dma_channel_config rxConfig = dma_channel_get_default_config(bus->_rxDma);
+        channel_config_set_transfer_data_size(&rxConfig, DMA_SIZE_8);
+        channel_config_set_read_increment(&rxConfig, false);
+        channel_config_set_write_increment(&rxConfig, true);
+        channel_config_set_dreq(&rxConfig, i2c_get_dreq(bus->_i2c, false));
+        dma_channel_configure(bus->_rxDma, &rxConfig, xfer->rxBuf, &hw->data_cmd, xfer->rxLen, true);
+    }
+
+    // Feed the data/command words into the TX FIFO, paced by the TX DREQ.
+    dma_channel_config txConfig = dma_channel_get_default_config(bus->_txDma);
+    channel_config_set_transfer_data_size(&txConfig, DMA_SIZE_32);
+    channel_config_set_read_increment(&txConfig, true);
+    channel_config_set_write_increment(&txConfig, false);
+    channel_config_set_dreq(&txConfig, i2c_get_dreq(bus->_i2c, true));
+    dma_channel_configure(bus->_txDma, &txConfig, &hw->data_cmd, bus->_cmdBuff, len, true);
+
+    // Only now can i2c_tools_poll look at the transfer.
+    xfer->state = I2C_TOOLS_XFER_BUSY;
+
+    return true;
+}
+
+/**
+ * @brief Calls the idle callback, unless it is already running or this is not the core it was registered from.
+ */
+static void _runIdleCallback(void)
+{
+    if (_idleCallback && !_inIdleCallback && (get_core_num() == _idleCallbackCore))
+    {
+        _inIdleCallback = true;
+        _idleCallback();
+        _inIdleCallback = false;
+    }
+}
+
+/**
+ * @brief Blocks until the bus is free.
+ *
+ * @param bus Pointer to the I2C bus handle.
+ */
+static void _waitBusIdle(i2c_tools_bus_t *bus)
+{
+    while (i2c_tools_poll(bus))
+    {
+        _runIdleCallback();
+    }
+}
+
+/**
+ * @brief Submits a non-blocking combined write-then-read transfer to the specified address.
+ *
+ * The bytes of the write phase are sent first, then the read phase begins with a Restart (no Stop in between),
+ * so a register access (write the register address, read its contents) is a single bus transaction.
+ * The received bytes are drained by DMA straight into the caller's buffer, with no intermediate copy.
+ * Either phase can be empty, in which case this is a plain write or a plain read.
+ * Only one transfer can be in flight on the bus at a time.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param xfer Pointer to the caller-owned transfer handle.
+ * @param addr The 7-bit I2C address of the target device.
+ * @param tx Pointer to the bytes to write, copied before this function returns (can be NULL if txLen is 0).
+ * @param txLen The number of bytes to write.
+ * @param rx Pointer to the destination buffer, it must stay valid until the transfer has completed (can be NULL if rxLen is 0).
+ * @param rxLen The number of bytes to read.
+ * @param stopBit If false, master retains control of the bus at the end of the transfer (no Stop is issued),
+ *           and the next transfer will begin with a Restart rather than a Start.
+ * @param callback Optional completion callback (can be NULL).
+ * @param arg User argument passed to the completion callback.
+ * @return True if the transfer has been started; False if it was rejected (see xfer->result).
+ */
+bool i2c_tools_writeReadAsync(i2c_tools_bus_t *bus, i2c_tools_xfer_t *xfer, uint8_t addr, const uint8_t *tx, size_t txLen, uint8_t *rx, size_t rxLen, bool stopBit, i2c_tools_xfer_cb_t callback, void *arg)
+{
+    // Fill in the transfer handle.
+    xfer->bus = bus;
+    xfer->addr = addr;
+    xfer->stopBit = stopBit;
+    xfer->txLen = txLen;
+    xfer->rxLen = rxLen;
+    xfer->rxBuf = rx;
+    xfer->callback = callback;
+    xfer->callbackArg = arg;
+
+    // Build the command words and start the DMA.
+    return _startTransfer(xfer, tx);
+}
+
+/**
+ * @brief Submits a non-blocking write transfer to the specified address.
+ *
+ * The data is copied into the internal DMA command buffer, so the caller's buffer can be reused as soon as this function returns.
+ * The bytes are then fed into the I2C TX FIFO by a DMA channel paced by the I2C TX DREQ, without any involvement from the CPU.
+ * Only one transfer can be in flight on the bus at a time.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param xfer Pointer to the caller-owned transfer handle.
+ * @param addr The 7-bit I2C address of the target device.
+ * @param data Pointer to the bytes to be written.
+ * @param len The number of bytes to write (1 to WIRE_BUFFER_SIZE).
+ * @param stopBit If false, master retains control of the bus at the end of the transfer (no Stop is issued),
+ *           and the next transfer will begin with a Restart rather than a Start.
+ * @param callback Optional completion callback (can be NULL).
+ * @param arg User argument passed to the completion callback.
+ * @return True if the transfer has been started; False if it was rejected (see xfer->result).
+ */
+bool i2c_tools_writeAsync(i2c_tools_bus_t *bus, i2c_tools_xfer_t *xfer, uint8_t addr, const uint8_t *data, size_t len, bool stopBit, i2c_tools_xfer_cb_t callback, void *arg)
+{
+    // A write is a combined transfer without a read phase.
+    return i2c_tools_writeReadAsync(bus, xfer, addr, data, len, NULL, 0, stopBit, callback, arg);
+}
+
+/**
+ * @brief Submits a non-blocking read transfer from the specified address.
+ *
+ * The read commands are fed into the I2C TX FIFO by one DMA channel, while a second DMA channel paced by the I2C RX DREQ
+ * drains the received bytes straight into the caller's buffer.
+ * Only one transfer can be in flight on the bus at a time.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param xfer Pointer to the caller-owned transfer handle.
+ * @param addr The 7-bit I2C address of the target device.
+ * @param data Pointer to the destination buffer, it must stay valid until the transfer has completed.
+ * @param len The number of bytes to read (1 to WIRE_BUFFER_SIZE).
+ * @param stopBit Indicates whether to send a stop bit at the end of the transfer.
+ * @param callback Optional completion callback (can be NULL).
+ * @param arg User argument passed to the completion callback.
+ * @return True if the transfer has been started; False if it was rejected (see xfer->result).
+ */
+bool i2c_tools_readAsync(i2c_tools_bus_t *bus, i2c_tools_xfer_t *xfer, uint8_t addr, uint8_t *data, size_t len, bool stopBit, i2c_tools_xfer_cb_t callback, void *arg)
+{
+    // A read is a combined transfer without a write phase.
+    return i2c_tools_writeReadAsync(bus, xfer, addr, NULL, 0, data, len, stopBit, callback, arg);
+}
+
+/**
+ * @brief Drives the in-flight asynchronous transfer (if any).
+ *
+ * Checks the DMA channels and the I2C abort/stop status, completes the transfer and invokes its callback once it is done.
+ * This should be called regularly from the main loop (e.g. next to cyw43_arch_poll) when using completion callbacks.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @return True if a transfer is still in flight; False if the bus is idle.
+ */
+bool i2c_tools_poll(i2c_tools_bus_t *bus)
+{
+    // Only one core drives the transfer, the other one just sees it in flight.
+    critical_section_enter_blocking(&bus->_cs);
+    i2c_tools_xfer_t *xfer = bus->_activeXfer;
+    bool drive = xfer && !bus->_polling && (xfer->state == I2C_TOOLS_XFER_BUSY);
+    if (drive)
+    {
+        bus->_polling = true;
+    }
+    critical_section_exit(&bus->_cs);
+
+    // Nothing to do if the bus is idle, or the transfer is being started or driven by the other core.
+    if (!drive)
+    {
+        return xfer != NULL;
+    }
+
+    bool busy = _pollTransfer(bus, xfer);
+    bus->_polling = false;
+
+    return busy;
+}
+
+/**
+ * @brief Checks the in-flight transfer and completes it if it is done (see i2c_tools_poll).
+ *
+ * @param bus Pointer to the I2C bus handle.
+ * @param xfer The in-flight transfer.
+ * @return True if the transfer is still in flight; False if it has completed.
+ */
+static bool _pollTransfer(i2c_tools_bus_t *bus, i2c_tools_xfer_t *xfer)
+{
+    i2c_hw_t *hw = bus->_i2c->hw;
+
+    // The controller aborted the transfer (NACK, arbitration lost...).
+    uint32_t abortReason = hw->tx_abrt_source;
+    if (abortReason)
+    {
+        _finishTransfer(xfer, _abortReasonToError(abortReason));
+        return false;
+    }
+
+    // The transfer took too long, most likely the target is stretching the clock forever.
+    if (time_us_64() > xfer->deadline)
+    {
+        _timeoutTransfer(bus);
+        return false;
+    }
+
+    // The DMA channels are still moving data between memory and the FIFOs.
+    if (dma_channel_is_busy(bus->_txDma) || (xfer->rxLen && dma_channel_is_busy(bus->_rxDma)))
+    {
+        return true;
+    }
+
+    if (xfer->stopBit)
+    {
+        // Wait for the Stop to go out on the bus.
+        if (!(hw->raw_intr_stat & I2C_IC_RAW_INTR_STAT_STOP_DET_BITS))
+        {
+            return true;
+        }
+        (void)hw->clr_stop_det;
+    }
+    else if (!xfer->rxLen && !(hw->raw_intr_stat & I2C_IC_RAW_INTR_STAT_TX_EMPTY_BITS))
+    {
+        // Wait for the last byte to be shifted out and acknowledged.
+        return true;
+    }
+
+    // A NACK on the last byte is flagged together with the Stop, so check the abort status once more.
+    abortReason = hw->tx_abrt_source;
+    _finishTransfer(xfer, abortReason ? _abortReasonToError(abortReason) : 0);
+    return false;
+}
+
+/**
+ * @brief Checks whether an asynchronous transfer has completed.
+ *
+ * This function drives the in-flight transfer (see i2c_tools_poll) and then checks the state of the given handle.
+ *
+ * @param xfer Pointer to the transfer handle.
+ * @return True if the transfer is no longer in flight (done, failed or never submitted); False otherwise.
+ */
+bool i2c_tools_transferDone(i2c_tools_xfer_t *xfer)
+{
+    // A handle that was never submitted (or was rejected) is not bound to any bus.
+    if (xfer->state != I2C_TOOLS_XFER_BUSY)
+    {
+        return true;
+    }
+
+    // Drive the in-flight transfer of the handle's bus.
+    i2c_tools_poll(xfer->bus);
+
+    return xfer->state != I2C_TOOLS_XFER_BUSY;
+}
+
+/**
+ * @brief Blocks until an asynchronous transfer has completed.
+ *
+ * While waiting, the idle callback registered with i2c_tools_setIdleCallback is called repeatedly.
+ *
+ * @param xfer Pointer to the transfer handle.
+ * @return Error code:
+ *         - 0: Success
+ *         - 1: Data too long
+ *         - 2: NACK on transmit of address
+ *         - 3: NACK on transmit of data
+ *         - 4: Other error
+ */
+uint8_t i2c_tools_waitTransfer(i2c_tools_xfer_t *xfer)
+{
+    // Keep the rest of the system serviced while the DMA moves the data.
+    while (!i2c_tools_transferDone(xfer))
+    {
+        _runIdleCallback();
+    }
+
+    return xfer->result;
+}
+
+/**
+ * @brief Registers a function to be called while the blocking functions are waiting for the bus.
+ *
+ * The blocking functions (i2c_tools_requestFrom, i2c_tools_endTransmission...) are built on top of the asynchronous transfers,
+ * and call this function while the DMA is moving the data, e.g. i2c_tools_setIdleCallback(cyw43_arch_poll) keeps
+ * the network stack serviced during long sensor reads. The callback is never re-entered,
+ * and is only called on the core it was registered from (the other core busy-waits).
+ *
+ * @param idleCallback The function to call while waiting, or NULL to busy-wait.
+ */
+void i2c_tools_setIdleCallback(void (*idleCallback)(void))
+{
+    _idleCallback = idleCallback;
+    _idleCallbackCore = get_core_num();
+}
+
+#pragma endregion
+
+#pragma region Bus recovery and retry functions
+
+/**
+ * @brief Clears a stuck bus and brings the controller back to a known state.
+ *
+ * A target that was interrupted in the middle of a byte (glitch, brown-out, aborted transfer...) can keep holding SDA low,
+ * waiting for the clock pulses of the bits it still has to send, and the controller cannot issue a Start until it lets go.
+ * This function aborts the transfer in flight (if any), takes the pins away from the controller, clocks out up to 9 SCL pulses
+ * until the target releases SDA, issues a Stop, and then re-initializes the controller with the same clock frequency.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @return Error code:
+ *         - 0: Success, both lines are released
+ *         - 4: I2C is not running, or a line is still held low after the recovery
+ */
+uint8_t i2c_tools_recoverBus(i2c_tools_bus_t *bus)
+{
+    // Check if I2C is not currently running (a slave does not drive the clock, the master recovers the bus).
+    if (!bus->_running || bus->_slave)
+    {
+        return 4;
+    }
+
+    // Wait for the transaction in progress on the other core (if any), the recovery must not cut it in half.
+    i2c_tools_lock(bus);
+
+    // Abort the transfer in flight (if any), it is lost anyway.
+    if (bus->_activeXfer)
+    {
+        _timeoutTransfer(bus);
+    }
+
+    // Half of an SCL period, at the current clock frequency.
+    int delay = (1000000 / bus->_clkHz) / 2;
+
+    // Take the pins away from the controller, both lines are driven as open drain (pull low or release to the pull-up).
+    pinMode(bus->_sda, INPUT_PULLUP);
+    pinMode(bus->_scl, INPUT_PULLUP);
+    gpio_set_function(bus->_scl, GPIO_FUNC_SIO);
+    gpio_set_function(bus->_sda, GPIO_FUNC_SIO);
+
+    // Clock out the remaining bits of the interrupted byte (8 data bits and the ACK) until the target releases SDA.
+    for (int i = 0; (i < 9) && !digitalRead(bus->_sda); i++)
+    {
+        digitalWrite(bus->_scl, LOW);
+        sleep_us(delay);
+        digitalWrite(bus->_scl, HIGH);
+        sleep_us(delay);
+        _clockStretch(bus->_scl);
+    }
+
+    // Issue a Stop (SDA rising while SCL is high), so every target goes back to waiting for a Start.
+    digitalWrite(bus->_scl, LOW);
+    sleep_us(delay);
+    digitalWrite(bus->_sda, LOW);
+    sleep_us(delay);
+    digitalWrite(bus->_scl, HIGH);
+    _clockStretch(bus->_scl);
+    sleep_us(delay);
+    digitalWrite(bus->_sda, HIGH);
+    sleep_us(delay);
+
+    bool released = digitalRead(bus->_sda) && digitalRead(bus->_scl);
+
+    // Reset the controller (this also clears its FIFOs and abort state), and hand the pins back to it.
+    i2c_deinit(bus->_i2c);
+    i2c_init(bus->_i2c, bus->_clkHz);
+    bus->_appliedHz = bus->_clkHz;
+    i2c_set_slave_mode(bus->_i2c, false, 0);
+    gpio_set_function(bus->_sda, GPIO_FUNC_I2C);
+    gpio_set_function(bus->_scl, GPIO_FUNC_I2C);
+
+    bus->_recoveries++;
+
+    // The controller has been reset, so it no longer holds the bus for a Restart.
+    _endTransaction(bus);
+
+    return released ? 0 : 4;
+}
+
+/**
+ * @brief Sets the retry policy of the blocking transactions.
+ *
+ * A failed blocking transaction (i2c_tools_endTransmission, i2c_tools_requestFrom, i2c_tools_write_read) is retried
+ * up to the given number of times, as long as the deadline has not passed. If the bus looks stuck after a failure,
+ * it is recovered (see i2c_tools_recoverBus) before the next attempt.
+ * A transaction that continues a previous one without a Stop is never retried, as the first half cannot be replayed.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param retries The number of retries after the first attempt (0 to disable retrying).
+ * @param deadlineMs The deadline of the whole transaction in milliseconds, retries and recovery included.
+ */
+void i2c_tools_setRetryPolicy(i2c_tools_bus_t *bus, uint8_t retries, uint32_t deadlineMs)
+{
+    bus->_retries = retries;
+    bus->_xferDeadlineMs = deadlineMs;
+}
+
+/**
+ * @brief Gets the number of failed transactions with the device at the specified address.
+ *
+ * Every failed attempt is counted, including the ones that succeeded after a retry.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param addr The 7-bit I2C address of the device.
+ * @return The number of failed transactions (saturates at 0xFFFF).
+ */
+uint16_t i2c_tools_getErrorCount(i2c_tools_bus_t *bus, uint8_t addr)
+{
+    return bus->_errCount[addr & 0x7F];
+}
+
+/**
+ * @brief Gets the number of times the bus has been recovered.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @return The number of calls to i2c_tools_recoverBus, including the ones made by the retry policy.
+ */
+uint32_t i2c_tools_getRecoveryCount(i2c_tools_bus_t *bus)
+{
+    return bus->_recoveries;
+}
+
+/**
+ * @brief Resets the per-address error counters of the bus.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ */
+void i2c_tools_clearErrorCounts(i2c_tools_bus_t *bus)
+{
+    for (int i = 0; i < 128; i++)
+    {
+        bus->_errCount[i] = 0;
+    }
+}
+
+/**
+ * @brief Performs a blocking transaction, applying the retry policy of the bus.
+ *
+ * @param bus Pointer to the I2C bus handle.
+ * @param addr The 7-bit I2C address of the target device.
+ * @param tx Pointer to the bytes to write (can be NULL if txLen is 0).
+ * @param txLen The number of bytes to write.
+ * @param rx Pointer to the destination buffer (can be NULL if rxLen is 0).
+ * @param rxLen The number of bytes to read.
+ * @param stopBit Indicates whether to send a stop bit at the end of the transaction.
+ * @return The error code of the last attempt (same codes as i2c_tools_endTransmission).
+ */
+static uint8_t _transact(i2c_tools_bus_t *bus, uint8_t addr, const uint8_t *tx, size_t txLen, uint8_t *rx, size_t rxLen, bool stopBit)
+{
+    // Wait for any asynchronous transfer still in flight to release the bus.
+    _waitBusIdle(bus);
+
+    uint64_t start = time_us_64();
+    uint64_t deadline = start + (uint64_t)bus->_xferDeadlineMs * 1000;
+
+    // A transaction continuing one that kept the bus (no Stop) cannot be replayed on its own.
+    bool canRetry = !bus->_i2c->restart_on_next;
+
+    uint8_t ret;
+    int attempt;
+    for (attempt = 0;; attempt++)
+    {
+        i2c_tools_xfer_t xfer;
+
+        if (i2c_tools_writeReadAsync(bus, &xfer, addr, tx, txLen, rx, rxLen, stopBit, NULL, NULL))
+        {
+            // Do not let a single attempt run past the deadline of the whole transaction.
+            if (xfer.deadline > deadline)
+            {
+                xfer.deadline = deadline;
+            }
+            ret = i2c_tools_waitTransfer(&xfer);
+        }
+        else
+        {
+            ret = xfer.result;
+        }
+
+        // Success, or a request that can never succeed (too long, I2C not running).
+        if (!ret || (ret == 1) || !bus->_running)
+        {
+            break;
+        }
+
+        if (bus->_errCount[addr & 0x7F] < 0xFFFF)
+        {
+            bus->_errCount[addr & 0x7F]++;
+        }
+
+        // Timed out, lost arbitration, or a line is still held low: the bus has to be cleared before anything else can go through.
+        if ((ret == 4) || !digitalRead(bus->_sda) || !digitalRead(bus->_scl))
+        {
+            i2c_tools_recoverBus(bus);
+        }
+
+        if (!canRetry || (attempt >= bus->_retries) || (time_us_64() >= deadline))
+        {
+            break;
+        }
+    }
+
+    // Record the whole transaction (all its attempts) in the trace.
+    uint8_t dir = (txLen && rxLen) ? I2C_TOOLS_TRACE_WRITE_READ : (rxLen ? I2C_TOOLS_TRACE_READ : I2C_TOOLS_TRACE_WRITE);
+    _traceRecord(bus, addr, dir, txLen + rxLen, start, ret, attempt + 1);
+
+    return ret;
+}
+
+#pragma endregion
+
+#pragma region I2C transmission functions
+/**
+ * @brief Starts a new transmission session to the specified address.
+ *
+ * This function prepares the library to start a transmission session to the specified address.
+ * If I2C is not currently running or transmission session is already in progress, it returns without doing anything further.
+ * The calling core owns the bus (see i2c_tools_lock) until the matching i2c_tools_endTransmission.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param addr The I2C address of the target device.
+ */
+void i2c_tools_beginTransmission(i2c_tools_bus_t *bus, uint8_t addr)
+{
+    // Queue up for the bus, it is owned until the matching i2c_tools_endTransmission.
+    i2c_tools_lock(bus);
+
+    // Check if I2C is not currently running (as a master) or transmission has already begun.
+    if (!bus->_running || bus->_slave || bus->_txBegun)
+    {
+        // Returns without doing anything further if I2C is not running or a transmission is already in progress.
+        i2c_tools_unlock(bus);
+        return;
+    }
+
+    // Set the target device address for transmission.
+    bus->_addr = addr;
+
+    // Reset buffer length and offset.
+    bus->_buffLen = 0;
+    bus->_buffOff = 0;
+
+    // Set internal flag to indicate that a transmission session is in progress.
+    bus->_txBegun = true;
+}
+
+/**
+ * @brief Requests data from an I2C device with an optional stop bit.
+ *
+ * This function requests data from an I2C device with the specified address.
+ * It reads the specified quantity of bytes into the internal buffer, blocking until the transfer completes or times out.
+ * This is a thin blocking wrapper around i2c_tools_readAsync, the idle callback is serviced while waiting.
+ * A failed read is retried as per the retry policy of the bus (see i2c_tools_setRetryPolicy).
+ * When both cores use the bus, take the lock (see i2c_tools_lock) around this call and the following i2c_tools_read calls,
+ * so the other core cannot replace the received data in between.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param address The I2C address of the target device.
+ * @param quantity The number of bytes to request and read.
+ * @param stopBit Indicates whether to send a stop bit after the request.
+ * @return The number of bytes read, or 0 if there was an error or invalid parameters.
+ */
+size_t i2c_tools_requestFrom_w_stopbit(i2c_tools_bus_t *bus, uint8_t address, size_t quantity, bool stopBit)
+{
+    // Queue up for the bus, so the other core cannot touch the internal buffer during the transfer.
+    i2c_tools_lock(bus);
+
+    // Check if I2C is not currently running, a transmission has already begun, quantity is zero, or quantity exceeds buffer size.
+    if (!bus->_running || bus->_txBegun || !quantity || (quantity > sizeof(bus->_buff)))
+    {
+        // Return 0 if there is an error or invalid parameters.
+        i2c_tools_unlock(bus);
+        return 0;
+    }
+
+    // Perform I2C read with optional stop bit, waiting for the DMA to fill the internal buffer (retried as per the retry policy).
+    bus->_buffLen = 0;
+    if (_transact(bus, address, NULL, 0, bus->_buff, quantity, stopBit) == 0)
+    {
+        // Only expose the data if the whole transfer succeeded.
+        bus->_buffLen = quantity;
+    }
+
+    // Reset buffer offset for subsequent reads.
+    bus->_buffOff = 0;
+
+    // Release the bus (unless the transfer kept it for a Restart).
+    size_t ret = bus->_buffLen;
+    _endTransaction(bus);
+
+    // Return the number of bytes read.
+    return ret;
+}
+
+/**
+ * @brief Requests data from an I2C device with a stop bit.
+ *
+ * This function is a wrapper for i2c_tools_requestFrom_w_stopbit with the stopBit parameter set to true.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param address The I2C address of the target device.
+ * @param quantity The number of bytes to request and read.
+ * @return The number of bytes read, or 0 if there was an error or invalid parameters.
+ */
+size_t i2c_tools_requestFrom(i2c_tools_bus_t *bus, uint8_t address, size_t quantity)
+{
+    // Call the i2c_tools_requestFrom_w_stopbit function with stopBit parameter set to true.
+    return i2c_tools_requestFrom_w_stopbit(bus, address, quantity, true);
+}
+
+/**
+ * @brief Writes to then reads from an I2C device in a single transaction.
+ *
+ * This function sends the bytes in tx, issues a Restart and reads rxLen bytes straight into rx, followed by a Stop.
+ * This is the usual register read (tx holds the register address), done as one bus transaction, without going through
+ * the internal buffer and without any delay between the write and the read.
+ * It blocks until the transfer completes or times out, the idle callback is serviced while waiting.
+ * A failed transaction is retried as per the retry policy of the bus (see i2c_tools_setRetryPolicy).
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param addr The 7-bit I2C address of the target device.
+ * @param tx Pointer to the bytes to write (can be NULL if txLen is 0).
+ * @param txLen The number of bytes to write.
+ * @param rx Pointer to the destination buffer (can be NULL if rxLen is 0).
+ * @param rxLen The number of bytes to read.
+ * @return Error code:
+ *         - 0: Success
+ *         - 1: Data too long
+ *         - 2: NACK on transmit of address
+ *         - 3: NACK on transmit of data
+ *         - 4: Other error
+ */
+uint8_t i2c_tools_write_read(i2c_tools_bus_t *bus, uint8_t addr, const uint8_t *tx, size_t txLen, uint8_t *rx, size_t rxLen)
+{
+    // The whole transaction is done while owning the bus.
+    i2c_tools_lock(bus);
+
+    // Perform the combined transfer, waiting for the DMA to complete (retried as per the retry policy).
+    uint8_t ret = _transact(bus, addr, tx, txLen, rx, rxLen, true);
+
+    _endTransaction(bus);
+    return ret;
+}
+
+/**
+ * @brief Implements clock stretching for I2C communication.
+ *
+ * This function performs clock stretching by waiting for the specified pin to go HIGH within a time limit.
+ *
+ * @param pin The GPIO pin used for clock stretching.
+ * @return True if the pin goes HIGH within the time limit; False otherwise.
+ */
+static bool _clockStretch(int pin)
+{
+    // Calculate the absolute end time for the clock stretching period (100 microseconds).
+    uint64_t end = time_us_64() + 100;
+
+    // Wait until either the specified pin goes HIGH or the time limit is reached.
+    while ((time_us_64() < end) && (!digitalRead(pin)))
+    {
+        // No operation (noop) during the wait.
+    }
+
+    // Return the digital state of the pin after the clock stretching period.
+    return digitalRead(pin);
+}
+/**
+ * @brief Probes an I2C device at the specified address using software I2C.
+ *
+ * This function probes an I2C device at the specified address using software I2C.
+ * It checks for the presence of the device and returns true if an acknowledgment is received.
+ *
+ * @param addr The I2C address of the device to probe.
+ * @param sda The GPIO pin used for the I2C data line.
+ * @param scl The GPIO pin used for the I2C clock line.
+ * @param freq The desired frequency for the software I2C communication.
+ * @return True if the device acknowledges the address; False otherwise.
+ */
+static bool _probe(int addr, int sda, int scl, int freq)
+{
+    // Calculate half of the delay based on the desired frequency.
+    int delay = (1000000 / freq) / 2;
+    bool ack = false;
+
+    // Set up GPIO pins and functions
+    pinMode(sda, INPUT_PULLUP);
+    pinMode(scl, INPUT_PULLUP);
+    gpio_set_function(scl, GPIO_FUNC_SIO);
+    gpio_set_function(sda, GPIO_FUNC_SIO);
+
+    // Initialize the start condition.
+    digitalWrite(sda, HIGH);
+    sleep_us(delay);
+    digitalWrite(scl, HIGH);
+
+    // Check for clock stretching during the start condition.
+    if (!_clockStretch(scl))
+    {
+        goto stop;
+    }
+
+    digitalWrite(sda, LOW);
+    sleep_us(delay);
+    digitalWrite(scl, LOW);
+    sleep_us(delay);
+
+    // Send the 7-bit I2C address with MSB first.
+    for (int i = 0; i < 8; i++)
+    {
+        addr <<= 1;
+        digitalWrite(sda, (addr & (1 << 7)) ? HIGH : LOW);
+        sleep_us(delay);
+        digitalWrite(scl, HIGH);
+        sleep_us(delay);
+
+        // Check for clock stretching during data transmission.
+        if (!_clockStretch(scl))
+        {
+            goto stop;
+        }
+
+        digitalWrite(scl, LOW);
+        sleep_us(5); // Ensure we don't change too close to the clock edge.
+    }
+
+    // Release the data line and check for acknowledgment.
+    digitalWrite(sda, HIGH);
+    sleep_us(delay);
+    digitalWrite(scl, HIGH);
+
+    // Check for clock stretching during acknowledgment.
+    if (!_clockStretch(scl))
+    {
+        goto stop;
     }
 
     // Check if the device acknowledges the address.
@@ -543,225 +1757,1019 @@ static bool _probe(int addr, int sda, int scl, int freq)
     sleep_us(delay);
     digitalWrite(scl, LOW);
 
-stop:
-    // Perform stop condition.
-    sleep_us(delay);
-    digitalWrite(sda, LOW);
-    sleep_us(delay);
-    digitalWrite(scl, HIGH);
-    sleep_us(delay);
-    digitalWrite(sda, HIGH);
-    sleep_us(delay);
+stop:
+    // Perform stop condition.
+    sleep_us(delay);
+    digitalWrite(sda, LOW);
+    sleep_us(delay);
+    digitalWrite(scl, HIGH);
+    sleep_us(delay);
+    digitalWrite(sda, HIGH);
+    sleep_us(delay);
+
+    // Restore GPIO functions to I2C mode.
+    gpio_set_function(scl, GPIO_FUNC_I2C);
+    gpio_set_function(sda, GPIO_FUNC_I2C);
+
+    // Return true if acknowledgment is received; False otherwise.
+    return ack;
+}
+
+/**
+ * @brief Sends the data in the internal buffer to the target device.
+ *
+ * This function sends the data in the internal buffer to the target device.
+ * And then sets the internal session flag to indicate that the transmission has ended.
+ * This is a thin blocking wrapper around i2c_tools_writeAsync, the idle callback is serviced while waiting.
+ * A failed write is retried as per the retry policy of the bus (see i2c_tools_setRetryPolicy).
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param stopBit If false, master retains control of the bus at the end of the transfer (no Stop is issued),
+ *           and the next transfer will begin with a Restart rather than a Start.
+ * @return Error code:
+ *         - 0: Success
+ *         - 1: Data too long
+ *         - 2: NACK on transmit of address
+ *         - 3: NACK on transmit of data
+ *         - 4: Other error
+ */
+uint8_t i2c_tools_endTransmission_w_stopbit(i2c_tools_bus_t *bus, bool stopBit)
+{
+    // Check if I2C is not currently running or transmission has not begun (by this core, which then owns the bus).
+    if (!bus->_running || !bus->_txBegun || !_ownsLock(bus))
+    {
+        // Return 4 for "Other error" if I2C is not running or transmission has not begun.
+        return 4;
+    }
+
+    // Reset the transmission flag.
+    bus->_txBegun = false;
+
+    uint8_t ret;
+
+    // Check for special case of 0-length writes used for I2C probing.
+    if (!bus->_buffLen)
+    {
+        // The probe bit-bangs the pins, so make sure the controller is not using them.
+        _waitBusIdle(bus);
+        uint64_t start = time_us_64();
+
+        // Probe the I2C device at the specified address, and remember the answer for i2c_tools_isPresent.
+        bool ack = _probe(bus->_addr, bus->_sda, bus->_scl, i2c_tools_getDeviceClock(bus, bus->_addr));
+        _setPresent(bus, bus->_addr, ack);
+        ret = ack ? 0 : 2;
+        _traceRecord(bus, bus->_addr, I2C_TOOLS_TRACE_PROBE, 0, start, ret, 1);
+    }
+    else
+    {
+        // Perform I2C write with optional stop bit, waiting for the DMA to drain the internal buffer (retried as per the retry policy).
+        ret = _transact(bus, bus->_addr, bus->_buff, bus->_buffLen, NULL, 0, stopBit);
+
+        // Reset the buffer length.
+        bus->_buffLen = 0;
+    }
+
+    // Release the bus taken by i2c_tools_beginTransmission (unless the transfer kept it for a Restart).
+    _endTransaction(bus);
+
+    // Return 0 for success, 2/3 for a NACK, 4 for other errors.
+    return ret;
+}
+
+/**
+ * @brief Sends the data in the internal buffer to the target device.
+ *
+ * This function sends the data in the internal buffer to the target device.
+ * And then sets the internal session flag to indicate that the transmission has ended.
+ * This function is a wrapper for i2c_tools_endTransmission_w_stopbit with the stopBit parameter set to true.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @return Error code:
+ *         - 0: Success
+ *         - 1: Data too long
+ *         - 2: NACK on transmit of address
+ *         - 3: NACK on transmit of data
+ *         - 4: Other error
+ */
+uint8_t i2c_tools_endTransmission(i2c_tools_bus_t *bus)
+{
+    // Call i2c_tools_endTransmission_w_stopbit with stopBit parameter set to true.
+    return i2c_tools_endTransmission_w_stopbit(bus, true);
+}
+
+/**
+ * @brief Writes a byte to the I2C device.
+ *
+ * This function writes a byte to the I2C device.
+ * It adds the byte to the internal buffer if transmission has begun and the buffer is not full.
+ * In slave mode, nothing is written: the master is answered from the register map (see i2c_tools_setRegisters).
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param ucData The byte to be written to the I2C device.
+ * @return Number of bytes written (1 if successful, 0 otherwise).
+ */
+size_t i2c_tools_write(i2c_tools_bus_t *bus, uint8_t ucData)
+{
+    // Check if I2C is not currently running.
+    if (!bus->_running)
+    {
+        // Return 0 if I2C is not running.
+        return 0;
+    }
+
+    // Check if I2C is in slave mode.
+    if (bus->_slave)
+    {
+        // In slave mode, the master is answered from the register map by the interrupt handler (see i2c_tools_setRegisters),
+        // a byte pushed into the TX FIFO here would be sent in the middle of a register read.
+        return 0;
+    }
+    else
+    {
+        // In master mode, check if transmission has begun or the buffer is full.
+        if (!bus->_txBegun || (bus->_buffLen == sizeof(bus->_buff)))
+        {
+            // Return 0 if transmission has not begun or the buffer is full.
+            return 0;
+        }
+        // Add the byte to the internal buffer.
+        bus->_buff[bus->_buffLen++] = ucData;
+        return 1;
+    }
+}
+
+/**
+ * @brief Writes multiple bytes to the I2C device.
+ *
+ * This function writes an array of bytes to the I2C device using i2c_tools_write for each byte.
+ * It returns the number of bytes successfully written before encountering an error or reaching the end of the array.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param data Pointer to the array of bytes to be written.
+ * @param quantity The number of bytes to write.
+ * @return Number of bytes successfully written.
+ */
+size_t i2c_tools_write_w_quantity(i2c_tools_bus_t *bus, const uint8_t *data, size_t quantity)
+{
+    // Iterate through the array of bytes.
+    for (size_t i = 0; i < quantity; ++i)
+    {
+        // Call i2c_tools_write for each byte.
+        if (!i2c_tools_write(bus, data[i]))
+        {
+            // Return the number of bytes successfully written before encountering an error.
+            return i;
+        }
+    }
+
+    // Return the total number of bytes successfully written.
+    return quantity;
+}
+
+/**
+ * @brief Gets the number of bytes available for reading from the I2C device.
+ *
+ * This function returns the number of bytes available for reading from the I2C device.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @return The number of bytes available for reading.
+ */
+int i2c_tools_available(i2c_tools_bus_t *bus)
+{
+    // Check if I2C is currently running.
+    return bus->_running ? bus->_buffLen - bus->_buffOff : 0;
+}
+
+/**
+ * @brief Reads a byte from the I2C device.
+ *
+ * This function reads a byte from the internal buffer of the I2C device.
+ * It returns the read byte or -1 if no bytes are available (EOF).
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @return The read byte or -1 if no bytes are available (EOF).
+ */
+int i2c_tools_read(i2c_tools_bus_t *bus)
+{
+    // Check if bytes are available for reading.
+    if (i2c_tools_available(bus))
+    {
+        // Return the next byte from the internal buffer.
+        return bus->_buff[bus->_buffOff++];
+    }
+    // Return -1 if no bytes are available (EOF).
+    return -1;
+}
+
+/**
+ * @brief Peeks at the next byte in the I2C device without consuming it.
+ *
+ * This function returns the next byte in the internal buffer of the I2C device without consuming it.
+ * It returns the peeked byte or -1 if no bytes are available (EOF).
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @return The peeked byte or -1 if no bytes are available (EOF).
+ */
+int i2c_tools_peek(i2c_tools_bus_t *bus)
+{
+    // Check if bytes are available for peeking.
+    if (i2c_tools_available(bus))
+    {
+        // Return the next byte in the internal buffer without consuming it.
+        return bus->_buff[bus->_buffOff];
+    }
+    // Return -1 if no bytes are available (EOF).
+    return -1;
+}
+
+/**
+ * @brief Flushes the internal buffer of the I2C device.
+ *
+ * This function does nothing, and it is recommended to use endTransmission to force data transfer.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ */
+void i2c_tools_flush(i2c_tools_bus_t *bus)
+{
+    // Do nothing, use endTransmission(..) to force data transfer.
+}
+
+#pragma endregion
+
+#pragma region Bus scan functions
+
+/**
+ * @brief Records whether a device answered at the specified address.
+ *
+ * @param bus Pointer to the I2C bus handle.
+ * @param addr The 7-bit I2C address.
+ * @param present True if the device acknowledged its address; False otherwise.
+ */
+static void _setPresent(i2c_tools_bus_t *bus, uint8_t addr, bool present)
+{
+    uint32_t mask = 1u << (addr & 31);
+
+    bus->_probed[(addr >> 5) & 3] |= mask;
+    if (present)
+    {
+        bus->_present[(addr >> 5) & 3] |= mask;
+    }
+    else
+    {
+        bus->_present[(addr >> 5) & 3] &= ~mask;
+    }
+}
+
+/**
+ * @brief Probes an I2C device at the specified address using the hardware controller.
+ *
+ * The RP2040 controller cannot issue a zero-length write, so a single byte is read instead (and discarded).
+ * Unlike _probe, this does not bit-bang the pins, and the transfer is aborted after I2C_TOOLS_SCAN_TIMEOUT_US
+ * instead of the bus timeout, so a missing device costs a couple of hundred microseconds.
+ * The result is recorded in the presence cache by _finishTransfer.
+ *
+ * @param bus Pointer to the I2C bus handle.
+ * @param addr The 7-bit I2C address of the device to probe.
+ * @return True if the device acknowledges the address; False otherwise.
+ */
+static bool _hwProbe(i2c_tools_bus_t *bus, uint8_t addr)
+{
+    uint8_t dummy;
+    i2c_tools_xfer_t xfer;
+    bool ack = false;
+
+    // The probe is a regular transfer, so queue up for the bus and wait for the transfer in flight (if any) to complete.
+    i2c_tools_lock(bus);
+    _waitBusIdle(bus);
+
+    if (i2c_tools_readAsync(bus, &xfer, addr, &dummy, 1, true, NULL, NULL))
+    {
+        // A single byte read takes about 20 clock periods, no need to wait for the full bus timeout.
+        xfer.deadline = time_us_64() + I2C_TOOLS_SCAN_TIMEOUT_US;
+
+        ack = (i2c_tools_waitTransfer(&xfer) == 0);
+    }
+
+    _endTransaction(bus);
+    return ack;
+}
+
+/**
+ * @brief Scans the bus for devices.
+ *
+ * Every non-reserved 7-bit address (0x08 to 0x77) is probed through the hardware controller with a short deadline,
+ * and the answers are stored in the presence cache, so the following i2c_tools_isPresent calls are table lookups.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @return The number of devices that acknowledged their address, or -1 if I2C is not running.
+ */
+int i2c_tools_scan(i2c_tools_bus_t *bus)
+{
+    // Check if I2C is not currently running.
+    if (!bus->_running)
+    {
+        return -1;
+    }
+
+    int found = 0;
+
+    // Keep the bus for the whole scan, instead of queuing up again for every address.
+    i2c_tools_lock(bus);
+
+    // 0x00-0x07 and 0x78-0x7F are reserved by the I2C specification (general call, 10-bit addressing, etc).
+    for (uint8_t addr = 0x08; addr < 0x78; addr++)
+    {
+        if (_hwProbe(bus, addr))
+        {
+            found++;
+        }
+    }
+
+    i2c_tools_unlock(bus);
+    return found;
+}
+
+/**
+ * @brief Checks whether a device is present at the specified address.
+ *
+ * This is a lookup in the presence cache, filled in by i2c_tools_scan, by the zero-length probes of i2c_tools_endTransmission
+ * and by every completed transfer (an acknowledged address marks the device present, an address NACK marks it missing).
+ * If nothing is known about the address yet, it is probed once through the hardware controller.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param addr The 7-bit I2C address of the device.
+ * @return True if the device answered the last time it was addressed; False otherwise (or if I2C is not running).
+ */
+bool i2c_tools_isPresent(i2c_tools_bus_t *bus, uint8_t addr)
+{
+    uint32_t mask = 1u << (addr & 31);
+
+    // Probe the address the first time it is looked up.
+    if (!(bus->_probed[(addr >> 5) & 3] & mask))
+    {
+        if (!bus->_running)
+        {
+            return false;
+        }
+        return _hwProbe(bus, addr);
+    }
+
+    return (bus->_present[(addr >> 5) & 3] & mask) != 0;
+}
+
+/**
+ * @brief Clears the presence cache of the bus.
+ *
+ * Call this after devices have been plugged in or removed, the next i2c_tools_isPresent calls will probe the bus again.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ */
+void i2c_tools_clearScanCache(i2c_tools_bus_t *bus)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        bus->_probed[i] = 0;
+        bus->_present[i] = 0;
+    }
+}
+
+#pragma endregion
 
-    // Restore GPIO functions to I2C mode.
-    gpio_set_function(scl, GPIO_FUNC_I2C);
-    gpio_set_function(sda, GPIO_FUNC_I2C);
+#pragma region Transaction trace functions
 
-    // Return true if acknowledgment is received; False otherwise.
-    return ack;
+/**
+ * @brief Gets the histogram bucket of a transaction duration.
+ *
+ * @param durationUs The duration of the transaction in microseconds.
+ * @return The bucket index: n if the duration is less than 2^n microseconds (and at least 2^(n-1)), capped to the last bucket.
+ */
+static int _histBucket(uint32_t durationUs)
+{
+    // Bit length of the duration.
+    int bucket = durationUs ? (32 - __builtin_clz(durationUs)) : 0;
+    return (bucket < I2C_TOOLS_HIST_BUCKETS) ? bucket : (I2C_TOOLS_HIST_BUCKETS - 1);
 }
 
 /**
- * @brief Sends the data in the internal buffer to the target device.
+ * @brief Records a completed blocking transaction in the trace ring and in the latency histogram of its device.
  *
- * This function sends the data in the internal buffer to the target device.
- * And then sets the internal session flag to indicate that the transmission has ended.
+ * Only called by the core that owns the bus, so there is a single writer per bus and no lock is needed.
+ * The slot is invalidated before being rewritten, and its sequence number is published last,
+ * so a reader copying the slot in the meantime can tell it apart (see i2c_tools_getTrace).
  *
- * @param stopBit If false, master retains control of the bus at the end of the transfer (no Stop is issued),
- *           and the next transfer will begin with a Restart rather than a Start.
- * @return Error code:
- *         - 0: Success
- *         - 1: Data too long
- *         - 2: NACK on transmit of address
- *         - 3: NACK on transmit of data
- *         - 4: Other error
+ * @param bus Pointer to the I2C bus handle.
+ * @param addr The 7-bit I2C address of the target device.
+ * @param dir The kind of transaction (see i2c_tools_trace_dir_t).
+ * @param len The number of bytes written and read.
+ * @param start The time at which the transaction got the bus, in microseconds.
+ * @param result The error code of the transaction.
+ * @param attempts The number of attempts made.
  */
-uint8_t i2c_tools_endTransmission_w_stopbit(bool stopBit)
+static void _traceRecord(i2c_tools_bus_t *bus, uint8_t addr, uint8_t dir, size_t len, uint64_t start, uint8_t result, int attempts)
 {
-    // Check if I2C is not currently running or transmission has not begun.
-    if (!_running || !_txBegun)
+    uint32_t durationUs = (uint32_t)(time_us_64() - start);
+    uint32_t seq = bus->_traceHead + 1;
+    i2c_tools_trace_record_t *rec = &bus->_trace[bus->_traceHead & (I2C_TOOLS_TRACE_SIZE - 1)];
+
+    // Invalidate the slot, fill it in, then publish it.
+    rec->seq = 0;
+    __dmb();
+    rec->startUs = start;
+    rec->durationUs = durationUs;
+    rec->len = (uint16_t)len;
+    rec->addr = addr & 0x7F;
+    rec->dir = dir;
+    rec->result = result;
+    rec->attempts = (uint8_t)attempts;
+    __dmb();
+    rec->seq = seq;
+    bus->_traceHead = seq;
+    bus->_traceBusUs += durationUs;
+
+    // Look up the histogram of the device, or give it one if there is a free one left.
+    i2c_tools_latency_hist_t *hist = NULL;
+    for (int i = 0; i < bus->_histCount; i++)
     {
-        // Return 4 for "Other error" if I2C is not running or transmission has not begun.
-        return 4;
+        if (bus->_hists[i].addr == (addr & 0x7F))
+        {
+            hist = &bus->_hists[i];
+            break;
+        }
+    }
+    if (!hist && (bus->_histCount < I2C_TOOLS_TRACE_DEVICES))
+    {
+        hist = &bus->_hists[bus->_histCount];
+        memset(hist, 0, sizeof(*hist));
+        hist->addr = addr & 0x7F;
+        __dmb();
+        bus->_histCount++;
+    }
+    if (!hist)
+    {
+        return;
     }
 
-    // Reset the transmission flag.
-    _txBegun = false;
+    hist->transactions++;
+    if (result)
+    {
+        hist->errors++;
+    }
+    hist->totalUs += durationUs;
+    if (durationUs > hist->maxUs)
+    {
+        hist->maxUs = durationUs;
+    }
+    hist->buckets[_histBucket(durationUs)]++;
+}
 
-    // Check for special case of 0-length writes used for I2C probing.
-    if (!_buffLen)
+/**
+ * @brief Copies the most recent blocking transactions from the trace ring of the bus.
+ *
+ * Every blocking transaction (i2c_tools_endTransmission, i2c_tools_requestFrom and i2c_tools_write_read) is recorded
+ * once it completes, with its timing and result, into a ring of the last I2C_TOOLS_TRACE_SIZE transactions.
+ * Records are written by the core that owns the bus, and this function does not take the bus lock, so it can be called
+ * at any time (e.g. from the other core); a record overwritten while being copied is left out.
+ * Asynchronous transfers submitted by the caller and the probes of i2c_tools_scan are not recorded.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param records Pointer to the array receiving the records, oldest first.
+ * @param maxRecords The number of records the array can hold.
+ * @return The number of records copied.
+ */
+size_t i2c_tools_getTrace(i2c_tools_bus_t *bus, i2c_tools_trace_record_t *records, size_t maxRecords)
+{
+    uint32_t head = bus->_traceHead;
+    uint32_t count = (head < I2C_TOOLS_TRACE_SIZE) ? head : I2C_TOOLS_TRACE_SIZE;
+    if (count > maxRecords)
     {
-        // Probe the I2C device at the specified address.
-        return _probe(_addr, _sda, _scl, _clkHz) ? 0 : 2;
+        count = (uint32_t)maxRecords;
     }
-    else
+
+    size_t copied = 0;
+    for (uint32_t i = head - count; i != head; i++)
     {
-        // Save the length of the buffer.
-        int len = _buffLen;
+        const i2c_tools_trace_record_t *rec = &bus->_trace[i & (I2C_TOOLS_TRACE_SIZE - 1)];
+
+        // Copy the slot, and keep the copy only if the slot still holds the same transaction afterwards.
+        uint32_t seq = rec->seq;
+        __dmb();
+        records[copied] = *rec;
+        __dmb();
+        if ((seq == i + 1) && (rec->seq == seq))
+        {
+            records[copied].seq = seq;
+            copied++;
+        }
+    }
 
-        // Perform I2C write with optional stop bit, blocking until specified timeout.
-        int ret = i2c_write_blocking_until(_i2c, _addr, _buff, _buffLen, !stopBit, make_timeout_time_ms(_timeout));
+    return copied;
+}
 
-        // Reset the buffer length.
-        _buffLen = 0;
+/**
+ * @brief Gets the latency histograms of the devices addressed since the trace was last cleared.
+ *
+ * The first I2C_TOOLS_TRACE_DEVICES devices addressed get a histogram each, the transactions with any other device
+ * are only recorded in the trace ring. The histograms are updated without locking, a snapshot taken while a transaction
+ * completes may be off by that transaction.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param hists Pointer to the array receiving the histograms, in the order the devices were first addressed.
+ * @param maxHists The number of histograms the array can hold.
+ * @return The number of histograms copied.
+ */
+int i2c_tools_getLatencyHistograms(i2c_tools_bus_t *bus, i2c_tools_latency_hist_t *hists, int maxHists)
+{
+    int count = bus->_histCount;
+    if (count > maxHists)
+    {
+        count = maxHists;
+    }
 
-        // Return 0 for success, 4 for other errors.
-        return (ret == len) ? 0 : 4;
+    __dmb();
+    for (int i = 0; i < count; i++)
+    {
+        hists[i] = bus->_hists[i];
     }
+
+    return count;
 }
 
 /**
- * @brief Sends the data in the internal buffer to the target device.
+ * @brief Clears the trace ring and the latency histograms of the bus, and starts a new trace window.
  *
- * This function sends the data in the internal buffer to the target device.
- * And then sets the internal session flag to indicate that the transmission has ended.
- * This function is a wrapper for i2c_tools_endTransmission_w_stopbit with the stopBit parameter set to true.
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ */
+void i2c_tools_clearTrace(i2c_tools_bus_t *bus)
+{
+    // Only the owner of the bus writes to the trace, so nothing is recorded while it is being cleared.
+    i2c_tools_lock(bus);
+    bus->_histCount = 0;
+    bus->_traceHead = 0;
+    memset(bus->_trace, 0, sizeof(bus->_trace));
+    bus->_traceBusUs = 0;
+    bus->_traceSince = time_us_64();
+    i2c_tools_unlock(bus);
+}
+
+/**
+ * @brief Prints the trace ring and the latency histograms of the bus over stdio.
  *
- * @return Error code:
- *         - 0: Success
- *         - 1: Data too long
- *         - 2: NACK on transmit of address
- *         - 3: NACK on transmit of data
- *         - 4: Other error
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
  */
-uint8_t i2c_tools_endTransmission()
+void i2c_tools_dumpTrace(i2c_tools_bus_t *bus)
 {
-    // Call i2c_tools_endTransmission_w_stopbit with stopBit parameter set to true.
-    return i2c_tools_endTransmission_w_stopbit(true);
+    static const char *dirNames[] = {"W", "R", "WR", "PROBE"};
+    i2c_tools_trace_record_t records[I2C_TOOLS_TRACE_SIZE];
+    i2c_tools_latency_hist_t hists[I2C_TOOLS_TRACE_DEVICES];
+
+    size_t count = i2c_tools_getTrace(bus, records, I2C_TOOLS_TRACE_SIZE);
+    int histCount = i2c_tools_getLatencyHistograms(bus, hists, I2C_TOOLS_TRACE_DEVICES);
+
+    printf("I2C%u trace: %lu transactions in %llu us, %llu us on the bus\n",
+           i2c_hw_index(bus->_i2c), (unsigned long)bus->_traceHead,
+           (unsigned long long)(time_us_64() - bus->_traceSince), (unsigned long long)bus->_traceBusUs);
+
+    // Most recent transactions, oldest first.
+    printf("%8s %14s %8s %4s %5s %4s %3s %3s\n", "seq", "start_us", "dur_us", "addr", "dir", "len", "err", "try");
+    for (size_t i = 0; i < count; i++)
+    {
+        printf("%8lu %14llu %8lu 0x%02X %5s %4u %3u %3u\n",
+               (unsigned long)records[i].seq, (unsigned long long)records[i].startUs, (unsigned long)records[i].durationUs,
+               records[i].addr, dirNames[records[i].dir & 3], records[i].len, records[i].result, records[i].attempts);
+    }
+
+    // Latency histogram of each device, only the buckets that were hit.
+    for (int i = 0; i < histCount; i++)
+    {
+        printf("0x%02X: %lu transactions, %lu errors, %llu us on the bus, longest %lu us\n",
+               hists[i].addr, (unsigned long)hists[i].transactions, (unsigned long)hists[i].errors,
+               (unsigned long long)hists[i].totalUs, (unsigned long)hists[i].maxUs);
+        for (int b = 0; b < I2C_TOOLS_HIST_BUCKETS; b++)
+        {
+            if (hists[i].buckets[b])
+            {
+                printf("    %s%7lu us: %lu\n", (b == I2C_TOOLS_HIST_BUCKETS - 1) ? ">=" : " <",
+                       (b == I2C_TOOLS_HIST_BUCKETS - 1) ? (1ul << (b - 1)) : (1ul << b), (unsigned long)hists[i].buckets[b]);
+            }
+        }
+    }
 }
 
 /**
- * @brief Writes a byte to the I2C device.
+ * @brief Formats a summary of the trace window as a JSON object, e.g. to be published on a diagnostics topic.
  *
- * This function writes a byte to the I2C device.
- * It adds the byte to the internal buffer if transmission has begun and the buffer is not full.
+ * The object holds the length of the trace window and the time spent on the bus in microseconds, and for every device
+ * its transaction and error counts, bus time, longest transaction and latency histogram.
+ * Devices that do not fit in the buffer are left out, the object is always complete.
  *
- * @param ucData The byte to be written to the I2C device.
- * @return Number of bytes written (1 if successful, 0 otherwise).
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param buf Pointer to the buffer receiving the null-terminated JSON object.
+ * @param len The size of the buffer.
+ * @return The length of the JSON object, or 0 if the buffer is too small for an empty summary.
  */
-size_t i2c_tools_write(uint8_t ucData)
+size_t i2c_tools_formatDiagnostics(i2c_tools_bus_t *bus, char *buf, size_t len)
 {
-    // Check if I2C is not currently running.
-    if (!_running)
+    i2c_tools_latency_hist_t hists[I2C_TOOLS_TRACE_DEVICES];
+    int histCount = i2c_tools_getLatencyHistograms(bus, hists, I2C_TOOLS_TRACE_DEVICES);
+
+    int n = snprintf(buf, len, "{\"windowUs\":%llu,\"busUs\":%llu,\"dev\":[",
+                     (unsigned long long)(time_us_64() - bus->_traceSince), (unsigned long long)bus->_traceBusUs);
+
+    // Keep room for the closing "]}" and the null terminator.
+    if ((n < 0) || ((size_t)n + 3 > len))
     {
-        // Return 0 if I2C is not running.
+        if (len)
+        {
+            buf[0] = '\0';
+        }
         return 0;
     }
+    size_t pos = (size_t)n;
 
-    // Check if I2C is in slave mode.
-    if (_slave)
+    for (int i = 0; i < histCount; i++)
     {
-        // In slave mode, wait for a spot in the TX FIFO.
-        while (0 == (_i2c->hw->status & (1 << 1)))
+        // Large enough for a device with every counter at its maximum.
+        char entry[320];
+        int m = snprintf(entry, sizeof(entry), "%s{\"addr\":%u,\"n\":%lu,\"err\":%lu,\"busUs\":%llu,\"maxUs\":%lu,\"hist\":[",
+                         i ? "," : "", hists[i].addr, (unsigned long)hists[i].transactions, (unsigned long)hists[i].errors,
+                         (unsigned long long)hists[i].totalUs, (unsigned long)hists[i].maxUs);
+        for (int b = 0; b < I2C_TOOLS_HIST_BUCKETS; b++)
         {
-            // No operation (noop) while waiting for a spot in the TX FIFO.
+            m += snprintf(&entry[m], sizeof(entry) - m, "%s%lu", b ? "," : "", (unsigned long)hists[i].buckets[b]);
         }
-        // Send the byte to the I2C device.
-        _i2c->hw->data_cmd = ucData;
-        return 1;
+        m += snprintf(&entry[m], sizeof(entry) - m, "]}");
+
+        // Leave out the devices that do not fit.
+        if (pos + m + 3 > len)
+        {
+            break;
+        }
+        memcpy(&buf[pos], entry, m);
+        pos += m;
     }
-    else
+
+    memcpy(&buf[pos], "]}", 3);
+    return pos + 2;
+}
+
+#pragma endregion
+
+#pragma region Slave mode (register map) functions
+
+/**
+ * @brief Exposes the register updates held back during a master read.
+ *
+ * Must be called with the critical section of the bus held.
+ *
+ * @param bus Pointer to the I2C bus handle.
+ */
+static void _slaveApplyPending(i2c_tools_bus_t *bus)
+{
+    for (int w = 0; w < I2C_TOOLS_SLAVE_REGS / 32; w++)
     {
-        // In master mode, check if transmission has begun or the buffer is full.
-        if (!_txBegun || (_buffLen == sizeof(_buff)))
+        uint32_t dirty = bus->_slaveDirty[w];
+        while (dirty)
         {
-            // Return 0 if transmission has not begun or the buffer is full.
-            return 0;
+            // Copy the lowest dirty register of the word, then clear its bit.
+            int reg = w * 32 + __builtin_ctz(dirty);
+            bus->_slaveRegs[reg] = bus->_slavePending[reg];
+            dirty &= dirty - 1;
         }
-        // Add the byte to the internal buffer.
-        _buff[_buffLen++] = ucData;
-        return 1;
+        bus->_slaveDirty[w] = 0;
     }
+    bus->_slaveHasPending = false;
 }
 
 /**
- * @brief Writes multiple bytes to the I2C device.
+ * @brief I2C interrupt handler of a bus in slave mode.
  *
- * This function writes an array of bytes to the I2C device using i2c_tools_write for each byte.
- * It returns the number of bytes successfully written before encountering an error or reaching the end of the array.
+ * 1. The bytes written by the master are taken first, the first byte after the address (flagged by the controller)
+ *    sets the register pointer, the next ones are stored into the writable registers.
+ * 2. A Start, Restart or Stop ends the transaction addressed to the bus (if any): the held back register updates
+ *    are exposed, and the write callback is called for the registers written.
+ * 3. A read request of the master is answered with the register at the register pointer.
  *
- * @param data Pointer to the array of bytes to be written.
- * @param quantity The number of bytes to write.
- * @return Number of bytes successfully written.
+ * @param bus Pointer to the I2C bus handle.
  */
-size_t i2c_tools_write_w_quantity(const uint8_t *data, size_t quantity)
+static void _slaveIrq(i2c_tools_bus_t *bus)
 {
-    // Iterate through the array of bytes.
-    for (size_t i = 0; i < quantity; ++i)
+    i2c_hw_t *hw = bus->_i2c->hw;
+    uint32_t status = hw->intr_stat;
+    i2c_tools_reg_write_cb_t callback = NULL;
+    uint8_t wrReg = 0;
+    size_t wrLen = 0;
+
+    if (status == 0)
     {
-        // Call i2c_tools_write for each byte.
-        if (!i2c_tools_write(data[i]))
+        return;
+    }
+
+    // The register map is shared with the application, which may be running on the other core.
+    critical_section_enter_blocking(&bus->_cs);
+
+    // Take the bytes written by the master, before a Stop below ends their transaction.
+    while (hw->rxflr)
+    {
+        uint32_t word = hw->data_cmd;
+        uint8_t data = (uint8_t)word;
+        bus->_slaveInXfer = true;
+
+        if (word & I2C_IC_DATA_CMD_FIRST_DATA_BYTE_BITS)
         {
-            // Return the number of bytes successfully written before encountering an error.
-            return i;
+            // First byte of a write: the register pointer.
+            bus->_slavePtr = (data < bus->_slaveSize) ? data : bus->_slaveSize;
+            bus->_slaveWrLen = 0;
+        }
+        else if (bus->_slavePtr < bus->_slaveSize)
+        {
+            // Data byte: stored only into the writable registers, the others are acknowledged but dropped.
+            if ((bus->_slavePtr >= bus->_slaveWrFirst) && (bus->_slavePtr < bus->_slaveWrFirst + bus->_slaveWrCount))
+            {
+                if (!bus->_slaveWrLen)
+                {
+                    bus->_slaveWrReg = (uint8_t)bus->_slavePtr;
+                }
+                bus->_slaveRegs[bus->_slavePtr] = data;
+                bus->_slaveWrLen++;
+            }
+            bus->_slavePtr++;
         }
     }
 
-    // Return the total number of bytes successfully written.
-    return quantity;
+    // Clear the transfer abort raised when the master ends a read with data still in the TX FIFO.
+    if (status & I2C_IC_INTR_STAT_R_TX_ABRT_BITS)
+    {
+        hw->clr_tx_abrt;
+    }
+
+    // A Start / Restart / Stop (of any transaction on the bus) ends the transaction addressed to the bus, if any.
+    if (status & (I2C_IC_INTR_STAT_R_START_DET_BITS | I2C_IC_INTR_STAT_R_STOP_DET_BITS))
+    {
+        hw->clr_start_det;
+        hw->clr_stop_det;
+
+        if (bus->_slaveInXfer)
+        {
+            if (bus->_slaveHasPending)
+            {
+                _slaveApplyPending(bus);
+            }
+            if (bus->_slaveWrLen)
+            {
+                callback = bus->_slaveOnWrite;
+                wrReg = bus->_slaveWrReg;
+                wrLen = bus->_slaveWrLen;
+                bus->_slaveWrLen = 0;
+            }
+            bus->_slaveInXfer = false;
+            bus->_slaveReading = false;
+            bus->_slaveXfers++;
+        }
+    }
+
+    // Answer the read request of the master with the next register (0xFF past the end of the map).
+    if (status & I2C_IC_INTR_STAT_R_RD_REQ_BITS)
+    {
+        bus->_slaveInXfer = true;
+        bus->_slaveReading = true;
+        hw->data_cmd = (bus->_slavePtr < bus->_slaveSize) ? bus->_slaveRegs[bus->_slavePtr++] : 0xFF;
+        hw->clr_rd_req;
+    }
+
+    critical_section_exit(&bus->_cs);
+
+    // The callback may read the registers, so it is called outside of the critical section.
+    if (callback)
+    {
+        callback(bus, wrReg, wrLen, bus->_slaveOnWriteArg);
+    }
 }
 
 /**
- * @brief Gets the number of bytes available for reading from the I2C device.
+ * @brief I2C interrupt handler of i2c0 in slave mode.
+ */
+static void _slaveIrq0(void)
+{
+    _slaveIrq(&_buses[0]);
+}
+
+/**
+ * @brief I2C interrupt handler of i2c1 in slave mode.
+ */
+static void _slaveIrq1(void)
+{
+    _slaveIrq(&_buses[1]);
+}
+
+/**
+ * @brief Takes the bus out of slave mode, called by i2c_tools_end before the controller is deinitialized.
  *
- * This function returns the number of bytes available for reading from the I2C device.
+ * @param bus Pointer to the I2C bus handle.
+ */
+static void _slaveStop(i2c_tools_bus_t *bus)
+{
+    uint irqNum = I2C0_IRQ + i2c_hw_index(bus->_i2c);
+
+    // Mask the interrupts of the controller, then remove the handler.
+    bus->_i2c->hw->intr_mask = 0;
+    irq_set_enabled(irqNum, false);
+    irq_remove_handler(irqNum, (irqNum == I2C0_IRQ) ? _slaveIrq0 : _slaveIrq1);
+
+    bus->_slave = false;
+    bus->_slaveInXfer = false;
+    bus->_slaveReading = false;
+}
+
+/**
+ * @brief Initializes I2C communication in slave mode, with the specified address.
  *
- * @return The number of bytes available for reading.
+ * Port of Wire.begin(address). The bus answers a master at the specified address from its register map,
+ * the way most I2C sensors do, so another Pico can poll it with the usual master functions (e.g. i2c_tools_write_read):
+ * 1. The first byte of a master write sets the register pointer, the following bytes are stored into the writable registers.
+ * 2. A master read returns the registers from the register pointer on (0xFF past the end of the map).
+ * 3. The register pointer is auto-incremented, and kept from one transaction to the next.
+ *
+ * The transfers are handled in the I2C interrupt handler, enabled on the calling core.
+ * The register map can be set up and filled in before (see i2c_tools_setRegisterMap and i2c_tools_setRegisters).
+ * If I2C is already running, it returns without doing anything further. Call i2c_tools_end to go back to master mode.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param addr The 7-bit I2C address the bus answers to.
  */
-int i2c_tools_available(void)
+void i2c_tools_begin_w_address(i2c_tools_bus_t *bus, uint8_t addr)
 {
-    // Check if I2C is currently running.
-    return _running ? _buffLen - _buffOff : 0;
+    // Check if I2C is already running.
+    if (bus->_running)
+    {
+        // Returns if I2C has already been initialized.
+        return;
+    }
+
+    i2c_tools_lock(bus);
+
+    // Set the I2C mode to slave, with no transaction in progress.
+    bus->_slave = true;
+    bus->_slavePtr = 0;
+    bus->_slaveInXfer = false;
+    bus->_slaveReading = false;
+    bus->_slaveWrLen = 0;
+    bus->_slaveXfers = 0;
+    bus->_slaveHasPending = false;
+    memset(bus->_slaveDirty, 0, sizeof(bus->_slaveDirty));
+
+    // Initialize the I2C instance (the clock is driven by the master, the rate only sets the spike filter and hold times).
+    i2c_init(bus->_i2c, bus->_clkHz);
+    bus->_appliedHz = bus->_clkHz;
+
+    // Set I2C to slave mode with the specified address (the controller holds SCL low while its RX FIFO is full).
+    i2c_set_slave_mode(bus->_i2c, true, addr);
+
+    // Interrupt on every byte received, on read requests, and on the Start / Stop conditions.
+    i2c_hw_t *hw = bus->_i2c->hw;
+    hw->intr_mask = I2C_IC_INTR_MASK_M_RX_FULL_BITS | I2C_IC_INTR_MASK_M_RD_REQ_BITS | I2C_IC_INTR_MASK_M_TX_ABRT_BITS |
+                    I2C_IC_INTR_MASK_M_START_DET_BITS | I2C_IC_INTR_MASK_M_STOP_DET_BITS;
+
+    uint irqNum = I2C0_IRQ + i2c_hw_index(bus->_i2c);
+    irq_set_exclusive_handler(irqNum, (irqNum == I2C0_IRQ) ? _slaveIrq0 : _slaveIrq1);
+    irq_set_enabled(irqNum, true);
+
+    // Configure SDA pin for I2C and enable pull-up resistor.
+    gpio_set_function(bus->_sda, GPIO_FUNC_I2C);
+    gpio_pull_up(bus->_sda);
+
+    // Configure SCL pin for I2C and enable pull-up resistor.
+    gpio_set_function(bus->_scl, GPIO_FUNC_I2C);
+    gpio_pull_up(bus->_scl);
+
+    // Set internal flags to indicate that I2C is now running.
+    bus->_running = true;
+    bus->_txBegun = false;
+    bus->_buffLen = 0;
+
+    i2c_tools_unlock(bus);
 }
 
 /**
- * @brief Reads a byte from the I2C device.
+ * @brief Sets the size of the register map and the registers the master is allowed to write.
  *
- * This function reads a byte from the internal buffer of the I2C device.
- * It returns the read byte or -1 if no bytes are available (EOF).
+ * Writes of the master outside of the writable window are acknowledged but dropped, so the samples exposed
+ * by the application cannot be overwritten.
  *
- * @return The read byte or -1 if no bytes are available (EOF).
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param size The number of registers (1 to I2C_TOOLS_SLAVE_REGS).
+ * @param writableFirst The first register the master may write.
+ * @param writableCount The number of registers the master may write from writableFirst (0 for a read-only map).
+ * @return True if the register map has been set; False if the parameters do not fit.
  */
-int i2c_tools_read(void)
+bool i2c_tools_setRegisterMap(i2c_tools_bus_t *bus, uint16_t size, uint8_t writableFirst, uint16_t writableCount)
 {
-    // Check if bytes are available for reading.
-    if (i2c_tools_available())
+    if (!size || (size > I2C_TOOLS_SLAVE_REGS) || (writableCount && ((uint32_t)writableFirst + writableCount > size)))
     {
-        // Return the next byte from the internal buffer.
-        return _buff[_buffOff++];
+        return false;
     }
-    // Return -1 if no bytes are available (EOF).
-    return -1;
+
+    critical_section_enter_blocking(&bus->_cs);
+    bus->_slaveSize = size;
+    bus->_slaveWrFirst = writableFirst;
+    bus->_slaveWrCount = writableCount;
+    if (bus->_slavePtr > size)
+    {
+        bus->_slavePtr = size;
+    }
+    critical_section_exit(&bus->_cs);
+    return true;
 }
 
 /**
- * @brief Peeks at the next byte in the I2C device without consuming it.
+ * @brief Updates registers of the register map, e.g. with a new sensor sample.
  *
- * This function returns the next byte in the internal buffer of the I2C device without consuming it.
- * It returns the peeked byte or -1 if no bytes are available (EOF).
+ * A master read always returns a consistent snapshot: if the master is reading while the registers are updated,
+ * the new values are held back and only exposed at the end of that read, so a multi-byte sample is never torn.
+ * Update a whole sample with a single call for the same reason.
  *
- * @return The peeked byte or -1 if no bytes are available (EOF).
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param reg The first register to update.
+ * @param data Pointer to the new values.
+ * @param len The number of registers to update.
+ * @return True if the registers have been updated; False if they do not fit in the register map.
  */
-int i2c_tools_peek(void)
+bool i2c_tools_setRegisters(i2c_tools_bus_t *bus, uint8_t reg, const void *data, size_t len)
 {
-    // Check if bytes are available for peeking.
-    if (i2c_tools_available())
+    const uint8_t *src = (const uint8_t *)data;
+
+    if ((size_t)reg + len > bus->_slaveSize)
     {
-        // Return the next byte in the internal buffer without consuming it.
-        return _buff[_buffOff];
+        return false;
     }
-    // Return -1 if no bytes are available (EOF).
-    return -1;
+
+    critical_section_enter_blocking(&bus->_cs);
+    if (bus->_slaveReading)
+    {
+        // The master is reading, hold the new values back until the end of its read.
+        memcpy(&bus->_slavePending[reg], src, len);
+        for (size_t i = reg; i < reg + len; i++)
+        {
+            bus->_slaveDirty[i / 32] |= 1u << (i % 32);
+        }
+        bus->_slaveHasPending = true;
+    }
+    else
+    {
+        memcpy(&bus->_slaveRegs[reg], src, len);
+    }
+    critical_section_exit(&bus->_cs);
+    return true;
 }
 
 /**
- * @brief Flushes the internal buffer of the I2C device.
+ * @brief Reads registers of the register map, e.g. the ones written by the master.
  *
- * This function does nothing, and it is recommended to use endTransmission to force data transfer.
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param reg The first register to read.
+ * @param data Pointer to the buffer receiving the values.
+ * @param len The number of registers to read.
+ * @return True if the registers have been read; False if they do not fit in the register map.
  */
-void i2c_tools_flush(void)
+bool i2c_tools_getRegisters(i2c_tools_bus_t *bus, uint8_t reg, void *data, size_t len)
 {
-    // Do nothing, use endTransmission(..) to force data transfer.
+    if ((size_t)reg + len > bus->_slaveSize)
+    {
+        return false;
+    }
+
+    critical_section_enter_blocking(&bus->_cs);
+    memcpy(data, &bus->_slaveRegs[reg], len);
+    critical_section_exit(&bus->_cs);
+    return true;
+}
+
+/**
+ * @brief Sets the function called when the master has written to the register map (see i2c_tools_reg_write_cb_t).
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param callback The write callback (can be NULL).
+ * @param arg User argument passed to the write callback.
+ */
+void i2c_tools_onRegisterWrite(i2c_tools_bus_t *bus, i2c_tools_reg_write_cb_t callback, void *arg)
+{
+    critical_section_enter_blocking(&bus->_cs);
+    bus->_slaveOnWrite = callback;
+    bus->_slaveOnWriteArg = arg;
+    critical_section_exit(&bus->_cs);
+}
+
+/**
+ * @brief Gets the number of master transactions served by the bus in slave mode.
+ *
+ * Reads and writes are counted separately (a write of the register pointer followed by a read with a Restart counts as two),
+ * a bare address probe is not counted.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @return The number of transactions since i2c_tools_begin_w_address.
+ */
+uint32_t i2c_tools_getSlaveTransactions(i2c_tools_bus_t *bus)
+{
+    return bus->_slaveXfers;
 }
 
 #pragma endregion
@@ -5,8 +5,8 @@
 int main()
 {
     stdio_init_all();
-    i2c_tools_init(i2c0, PICO_DEFAULT_I2C_SDA_PIN, PICO_DEFAULT_I2C_SCL_PIN);
-    MLX90614_I2C_init(0x5A);
+    i2c_tools_bus_t *bus = i2c_tools_init(i2c0, PICO_DEFAULT_I2C_SDA_PIN, PICO_DEFAULT_I2C_SCL_PIN);
+    MLX90614_I2C_init(bus, 0x5A);
 
     while (NO_ERR != MLX90614_I2C_begin())
     {
@@ -0,0 +1,62 @@
+/** @file bench_as7341.c
+ *
+ * @brief AS7341 spectral sensor on the host driver bench (see driver_bench.h).
+ *
+ * A sample is what the AS7341 app reads every period: both SMUX configurations (F1-F4 and F5-F8, with Clear and NIR),
+ * each measured in SPM mode and read back in one burst.
+ */
+
+#include <stdio.h>
+#include "AS7341_Rebuilt.h"
+#include "driver_bench.h"
+
+static virtual_i2c_device_t _dev;
+static virtual_as7341_t _model;
+
+static bool _setup(i2c_tools_bus_t *bus)
+{
+    virtual_as7341_init(&_dev, &_model);
+    virtual_i2c_attach(0, &_dev);
+
+    if (AS7341_begin(bus, eSpm) != ERR_OK)
+    {
+        bench_fail("AS7341", "begin");
+        return false;
+    }
+    if (AS7341_readID() != 0x24)
+    {
+        bench_fail("AS7341", "readID");
+        return false;
+    }
+    return true;
+}
+
+static bool _sample(void)
+{
+    // Same sequence as getSensor1to4 / getSensor5to8 of the app.
+    AS7341_startMeasure(eF1F4ClearNIR);
+    AS7341_sModeOneData_t one = AS7341_readSpectralDataOne();
+    AS7341_startMeasure(eF5F8ClearNIR);
+    AS7341_sModeTwoData_t two = AS7341_readSpectralDataTwo();
+
+    if ((one.ADF1 != _model.f1f4[0]) || (one.ADF4 != _model.f1f4[3]) || (one.ADNIR != _model.f1f4[5]))
+    {
+        bench_fail("AS7341", "F1-F4 channel data");
+        return false;
+    }
+    if ((two.ADF5 != _model.f5f8[0]) || (two.ADF8 != _model.f5f8[3]) || (two.ADCLEAR != _model.f5f8[4]))
+    {
+        bench_fail("AS7341", "F5-F8 channel data");
+        return false;
+    }
+    return true;
+}
+
+const bench_sensor_t bench_as7341 = {
+    .name = "AS7341",
+    .setup = _setup,
+    .sample = _sample,
+    .faults = NULL,
+    .maxTransactions = 80, // Register by register SMUX set-up and polling of AVALID, twice.
+    .maxBytes = 182,
+};
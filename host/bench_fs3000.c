@@ -0,0 +1,77 @@
+/** @file bench_fs3000.c
+ *
+ * @brief FS3000 air velocity sensor on the host driver bench (see driver_bench.h).
+ *
+ * A sample is what the FS3000 app reads every period: the raw value, the speed in m/s and in mph.
+ */
+
+#include <stdio.h>
+#include "FS3000_Rebuilt.h"
+#include "driver_bench.h"
+
+static virtual_i2c_device_t _dev;
+static virtual_fs3000_t _model;
+
+static bool _setup(i2c_tools_bus_t *bus)
+{
+    virtual_fs3000_init(&_dev, &_model);
+    virtual_i2c_attach(0, &_dev);
+
+    if (!FS3000_begin(bus))
+    {
+        bench_fail("FS3000", "begin");
+        return false;
+    }
+    FS3000_setRange(AIRFLOW_RANGE_15_MPS);
+    return true;
+}
+
+static bool _sample(void)
+{
+    // Same readings as the app.
+    uint16_t raw = FS3000_readRaw();
+    float metersPerSec = FS3000_readMetersPerSecond();
+    float milesPerHour = FS3000_readMilesPerHour();
+
+    if (raw != _model.raw)
+    {
+        bench_fail("FS3000", "raw value");
+        return false;
+    }
+    if ((metersPerSec <= 0) || (milesPerHour <= metersPerSec))
+    {
+        bench_fail("FS3000", "m/s and mph");
+        return false;
+    }
+    return true;
+}
+
+static bool _faults(void)
+{
+    // A corrupted frame (bad checksum) is reported as an error, and the next frame is read normally.
+    uint8_t frame[5];
+    virtual_fs3000_frame(_model.raw, frame);
+    frame[2] ^= 0x10;
+    virtual_i2c_queueResponse(&_dev, frame, sizeof(frame));
+
+    if (FS3000_readRaw() != FS3000_READ_ERROR)
+    {
+        bench_fail("FS3000", "corrupted frame not detected");
+        return false;
+    }
+    if (FS3000_readRaw() != _model.raw)
+    {
+        bench_fail("FS3000", "read after a corrupted frame");
+        return false;
+    }
+    return true;
+}
+
+const bench_sensor_t bench_fs3000 = {
+    .name = "FS3000",
+    .setup = _setup,
+    .sample = _sample,
+    .faults = _faults,
+    .maxTransactions = 3, // The app reads a frame for the raw value, the m/s and the mph values.
+    .maxBytes = 18,
+};
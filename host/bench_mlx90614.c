@@ -0,0 +1,90 @@
+/** @file bench_mlx90614.c
+ *
+ * @brief MLX90614 infrared thermometer on the host driver bench (see driver_bench.h).
+ *
+ * A sample is what the MLX90614 app reads every period: the ambient and the object temperatures.
+ */
+
+#include <stdio.h>
+#include <math.h>
+#include "MLX90614_rebuilt.h"
+#include "driver_bench.h"
+
+static virtual_i2c_device_t _dev;
+static virtual_mlx90614_t _model;
+static i2c_tools_bus_t *_bus;
+
+static bool _setup(i2c_tools_bus_t *bus)
+{
+    _bus = bus;
+    virtual_mlx90614_init(&_dev, &_model);
+    virtual_i2c_attach(0, &_dev);
+
+    // Same bring-up as the app: begin (wake up + ID check), then a sleep / wake up cycle.
+    MLX90614_I2C_init(bus, VIRTUAL_MLX90614_ADDR);
+    if (MLX90614_I2C_begin() != NO_ERR)
+    {
+        bench_fail("MLX90614", "begin");
+        return false;
+    }
+    MLX90614_enterSleepMode(true);
+    sleep_ms(50);
+    MLX90614_enterSleepMode(false);
+    sleep_ms(200);
+    return true;
+}
+
+static bool _sample(void)
+{
+    float ambient = MLX90614_getAmbientTempCelsius();
+    float object = MLX90614_getObjectTempCelsius();
+
+    if (isnan(ambient) || isnan(object) || (fabsf(ambient - 24.0f) > 0.02f) || (fabsf(object - 31.5f) > 0.02f))
+    {
+        bench_fail("MLX90614", "temperatures");
+        return false;
+    }
+    return true;
+}
+
+static bool _faults(void)
+{
+    // A word with a bad PEC is read again by the driver.
+    uint16_t word = _model.words[0x06];
+    uint8_t corrupted[3] = {(uint8_t)(word & 0xFF), (uint8_t)(word >> 8), (uint8_t)(virtual_mlx90614_pec(VIRTUAL_MLX90614_ADDR, 0x06, word) ^ 0xFF)};
+    virtual_i2c_queueResponse(&_dev, corrupted, sizeof(corrupted));
+    if (isnan(MLX90614_getAmbientTempCelsius()))
+    {
+        bench_fail("MLX90614", "read after a bad PEC");
+        return false;
+    }
+
+    // A sensor that misses its address once is retried by i2c_tools, and the miss is counted.
+    uint16_t errors = i2c_tools_getErrorCount(_bus, VIRTUAL_MLX90614_ADDR);
+    virtual_i2c_nackNext(&_dev, 1);
+    if (isnan(MLX90614_getObjectTempCelsius()) || (i2c_tools_getErrorCount(_bus, VIRTUAL_MLX90614_ADDR) != errors + 1))
+    {
+        bench_fail("MLX90614", "retry after an address NACK");
+        return false;
+    }
+
+    // A sensor that is gone is reported as NAN, once the retries are used up.
+    virtual_i2c_nackNext(&_dev, 100);
+    bool gone = isnan(MLX90614_getObjectTempCelsius());
+    virtual_i2c_nackNext(&_dev, 0);
+    if (!gone)
+    {
+        bench_fail("MLX90614", "missing sensor not reported");
+        return false;
+    }
+    return true;
+}
+
+const bench_sensor_t bench_mlx90614 = {
+    .name = "MLX90614",
+    .setup = _setup,
+    .sample = _sample,
+    .faults = _faults,
+    .maxTransactions = 2, // One read word per temperature.
+    .maxBytes = 8,
+};
@@ -0,0 +1,101 @@
+/** @file bench_scd41.c
+ *
+ * @brief SCD41 CO2 sensor on the host driver bench (see driver_bench.h).
+ *
+ * A sample is what the SCD41 app does once a new measurement is due: check the data ready flag, then read the measurement.
+ */
+
+#include <stdio.h>
+#include "scd4x_i2c.h"
+#include "sensirion_common.h"
+#include "sensirion_i2c.h"
+#include "sensirion_i2c_hal.h"
+#include "driver_bench.h"
+
+static virtual_i2c_device_t _dev;
+static virtual_scd4x_t _model;
+
+static bool _setup(i2c_tools_bus_t *bus)
+{
+    uint16_t serial[3];
+
+    // The HAL joins i2c0 on its own, as in the app, rather than through the bus of the bench.
+    (void)bus;
+    virtual_scd4x_init(&_dev, &_model);
+    virtual_i2c_attach(0, &_dev);
+
+    // Same bring-up as the app (the sensor is on i2c0, set up by the HAL).
+    sensirion_i2c_hal_init();
+    scd4x_wake_up();
+    scd4x_stop_periodic_measurement();
+    scd4x_reinit();
+    if (scd4x_get_serial_number(&serial[0], &serial[1], &serial[2]) || (serial[0] != _model.serial[0]))
+    {
+        bench_fail("SCD41", "serial number");
+        return false;
+    }
+    if (scd4x_start_periodic_measurement())
+    {
+        bench_fail("SCD41", "start periodic measurement");
+        return false;
+    }
+    return true;
+}
+
+static bool _sample(void)
+{
+    bool ready = false;
+    uint16_t co2;
+    int32_t temperature;
+    int32_t humidity;
+
+    // Wait for the next measurement of the sensor.
+    uint64_t now = time_us_64();
+    if (_model.nextSample > now)
+    {
+        sleep_us(_model.nextSample - now);
+    }
+
+    if (scd4x_get_data_ready_flag(&ready) || !ready)
+    {
+        bench_fail("SCD41", "data ready flag");
+        return false;
+    }
+    if (scd4x_read_measurement(&co2, &temperature, &humidity) || (co2 != _model.co2))
+    {
+        bench_fail("SCD41", "measurement");
+        return false;
+    }
+    if ((temperature < 23400) || (temperature > 23600) || (humidity < 47900) || (humidity > 48100))
+    {
+        bench_fail("SCD41", "temperature and humidity");
+        return false;
+    }
+    return true;
+}
+
+static bool _faults(void)
+{
+    // A word with a bad CRC is reported as such.
+    uint8_t corrupted[9] = {0x02, 0x8A, 0x00, 0x66, 0x66, 0x00, 0x7A, 0xE1, 0x00};
+    uint16_t co2;
+    int32_t temperature;
+    int32_t humidity;
+
+    virtual_i2c_queueResponse(&_dev, corrupted, sizeof(corrupted));
+    if (scd4x_read_measurement(&co2, &temperature, &humidity) != CRC_ERROR)
+    {
+        bench_fail("SCD41", "bad CRC not detected");
+        return false;
+    }
+    return true;
+}
+
+const bench_sensor_t bench_scd41 = {
+    .name = "SCD41",
+    .setup = _setup,
+    .sample = _sample,
+    .faults = _faults,
+    .maxTransactions = 4, // Command then read, for the data ready flag and for the measurement.
+    .maxBytes = 16,
+};
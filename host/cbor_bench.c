@@ -0,0 +1,448 @@
+/** @file cbor_bench.c
+ *
+ * @brief Host bench of the CBOR writer (lib/cbor) and of the CBOR decoder of the host tools (cbor_json.c).
+ * Brief overview of the code:
+ * 1. Encoding: the writer gives the bytes of the examples of RFC 8949 (appendix A), in the preferred (shortest) form.
+ * 2. Overflow: a message written into a buffer too small for it never goes past the end, and is reported as such.
+ * 3. Samples: the samples of the AS7341, FS3000 and MLX90614 apps, and a sample replayed from the flash log,
+ *    are encoded and decoded back to the JSON of the app (same fields, same values).
+ * 4. Decoder: every truncated message, and a message with bytes after its item, is rejected.
+ * 5. Cost: for each sample, prints the size of the JSON and of the CBOR message, and the host CPU time to build each
+ *    (the JSON of the apps uses snprintf, and "%.2f" for the floats, the CBOR copies the values as they are).
+ *
+ * The bench exits with a non-zero status if any check fails, or if a CBOR sample is not smaller than its JSON.
+ *
+ * Usage: cbor_bench
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "cbor_writer.h"
+#include "cbor_json.h"
+
+// Number of samples built to time each encoding.
+#define BENCH_ROUNDS 100000
+
+// Size of the message buffers (the MQTT_BUFF_SIZE of the apps).
+#define BENCH_BUFF_SIZE 1025
+
+static bool _ok = true;
+
+/**
+ * @brief Prints a failed check.
+ */
+static void _fail(const char *check, const char *what)
+{
+    printf("FAIL %s: %s\n", check, what);
+    _ok = false;
+}
+
+/**
+ * @brief Gets the host CPU time, in nanoseconds.
+ */
+static uint64_t _cpuNs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+/**
+ * @brief Checks the bytes of a message against the expected ones (given in hex).
+ */
+static void _checkBytes(const char *check, const cbor_writer_t *writer, const char *hex)
+{
+    char got[2 * 64 + 1] = "";
+
+    for (size_t i = 0; (i < cbor_getLength(writer)) && (i < 64); i++)
+    {
+        sprintf(&got[2 * i], "%02x", writer->buffer[i]);
+    }
+    if (!cbor_isOk(writer) || (strcmp(got, hex) != 0))
+    {
+        _fail(check, "wrong encoding");
+        printf("     expected %s, got %s\n", hex, got);
+    }
+}
+
+#pragma region Encoding
+
+/**
+ * @brief Checks the encoding against the examples of RFC 8949, appendix A.
+ */
+static void _checkEncoding(void)
+{
+    uint8_t buffer[64];
+    cbor_writer_t writer;
+    static const struct
+    {
+        int64_t value;
+        const char *hex;
+    } ints[] = {
+        {0, "00"},
+        {1, "01"},
+        {10, "0a"},
+        {23, "17"},
+        {24, "1818"},
+        {25, "1819"},
+        {100, "1864"},
+        {1000, "1903e8"},
+        {1000000, "1a000f4240"},
+        {1000000000000, "1b000000e8d4a51000"},
+        {-1, "20"},
+        {-10, "29"},
+        {-100, "3863"},
+        {-1000, "3903e7"},
+        {INT64_MIN, "3b7fffffffffffffff"},
+    };
+
+    for (size_t i = 0; i < sizeof(ints) / sizeof(ints[0]); i++)
+    {
+        cbor_begin(&writer, buffer, sizeof(buffer), 0);
+        cbor_putInt(&writer, ints[i].value);
+        _checkBytes("encoding", &writer, ints[i].hex);
+    }
+
+    cbor_begin(&writer, buffer, sizeof(buffer), 0);
+    cbor_putUint(&writer, UINT64_MAX);
+    _checkBytes("encoding", &writer, "1bffffffffffffffff");
+
+    cbor_begin(&writer, buffer, sizeof(buffer), 0);
+    cbor_putFloat(&writer, 100000.0f);
+    _checkBytes("encoding", &writer, "fa47c35000");
+
+    cbor_begin(&writer, buffer, sizeof(buffer), 0);
+    cbor_putFloat(&writer, 3.4028234663852886e+38f);
+    _checkBytes("encoding", &writer, "fa7f7fffff");
+
+    cbor_begin(&writer, buffer, sizeof(buffer), 0);
+    cbor_putBool(&writer, false);
+    cbor_putBool(&writer, true);
+    cbor_putNull(&writer);
+    _checkBytes("encoding", &writer, "f4f5f6");
+
+    cbor_begin(&writer, buffer, sizeof(buffer), 0);
+    cbor_putText(&writer, "");
+    cbor_putText(&writer, "a");
+    cbor_putText(&writer, "IETF");
+    cbor_putBytes(&writer, "\x01\x02\x03\x04", 4);
+    _checkBytes("encoding", &writer, "60616164494554464401020304");
+
+    // [1, [2, 3], [4, 5]]
+    cbor_begin(&writer, buffer, sizeof(buffer), 0);
+    cbor_openArray(&writer, 3);
+    cbor_putUint(&writer, 1);
+    cbor_openArray(&writer, 2);
+    cbor_putUint(&writer, 2);
+    cbor_putUint(&writer, 3);
+    cbor_openArray(&writer, 2);
+    cbor_putUint(&writer, 4);
+    cbor_putUint(&writer, 5);
+    _checkBytes("encoding", &writer, "8301820203820405");
+
+    // {"a": 1, "b": [2, 3]}
+    cbor_begin(&writer, buffer, sizeof(buffer), 0);
+    cbor_openMap(&writer, 2);
+    cbor_fieldUint(&writer, "a", 1);
+    cbor_putText(&writer, "b");
+    cbor_openArray(&writer, 2);
+    cbor_putUint(&writer, 2);
+    cbor_putUint(&writer, 3);
+    _checkBytes("encoding", &writer, "a26161016162820203");
+
+    // 24 characters: the length no longer fits in the head
+    cbor_begin(&writer, buffer, sizeof(buffer), CBOR_SCHEMA(5));
+    cbor_putText(&writer, "abcdefghijklmnopqrstuvwx");
+    _checkBytes("encoding", &writer, "8578186162636465666768696a6b6c6d6e6f707172737475767778");
+
+    printf("%-9s RFC 8949 examples encoded\n", "encoding");
+}
+
+#pragma endregion
+
+#pragma region Overflow
+
+/**
+ * @brief Writes the same message into every buffer size up to its length: it must never write past the end,
+ * and must only be reported complete when the buffer holds it all.
+ */
+static void _checkOverflow(void)
+{
+    uint8_t full[64];
+    uint8_t buffer[64 + 8];
+    cbor_writer_t writer;
+
+    cbor_begin(&writer, full, sizeof(full), CBOR_SCHEMA(1));
+    cbor_openMap(&writer, 3);
+    cbor_fieldUint(&writer, "RAW", 1234);
+    cbor_fieldFloat(&writer, "metersPerSec", 1.45f);
+    cbor_fieldText(&writer, "unit", "m/s");
+    size_t len = cbor_getLength(&writer);
+
+    for (size_t size = 0; size <= len; size++)
+    {
+        memset(buffer, 0xEE, sizeof(buffer));
+        cbor_begin(&writer, buffer, size, CBOR_SCHEMA(1));
+        cbor_openMap(&writer, 3);
+        cbor_fieldUint(&writer, "RAW", 1234);
+        cbor_fieldFloat(&writer, "metersPerSec", 1.45f);
+        cbor_fieldText(&writer, "unit", "m/s");
+
+        for (size_t i = size; i < sizeof(buffer); i++)
+        {
+            if (buffer[i] != 0xEE)
+            {
+                _fail("overflow", "wrote past the end of the buffer");
+                printf("     buffer of %u bytes\n", (unsigned)size);
+                return;
+            }
+        }
+        if (cbor_isOk(&writer) != (size == len))
+        {
+            _fail("overflow", "wrong completion");
+            printf("     buffer of %u bytes, message of %u\n", (unsigned)size, (unsigned)len);
+            return;
+        }
+    }
+    if (memcmp(buffer, full, len) != 0)
+    {
+        _fail("overflow", "message differs in a buffer of its exact size");
+    }
+    printf("%-9s %u buffer sizes, never written past the end\n", "overflow", (unsigned)len + 1);
+}
+
+#pragma endregion
+
+#pragma region Samples
+
+/**
+ * @brief A sample of an app, and how it is built as JSON (as the app does) and as CBOR.
+ */
+typedef struct
+{
+    const char *name;                                                 // Topic of the sample
+    void (*json)(char *buffer, size_t size);                          // Builds the JSON of the app
+    void (*cbor)(cbor_writer_t *writer, uint8_t *buffer, size_t size); // Builds the CBOR message
+    void (*expected)(char *buffer, size_t size);                      // JSON expected from the decoder (the values of the app, unrounded)
+} bench_sample_t;
+
+// Values of the samples.
+static const uint16_t _channels[10] = {1523, 2211, 3004, 4321, 5150, 6011, 7342, 8023, 61234, 802};
+static const uint16_t _fsRaw = 1875;
+static const float _fsMetersPerSec = 7.2f;
+static const float _fsMilesPerHour = 16.105915f;
+static const float _mlxAmbient = 23.53f;
+static const float _mlxObject = 31.790001f;
+
+static void _as7341Json(char *buffer, size_t size)
+{
+    snprintf(buffer, size, "{\"F1\":%d,\"F2\":%d,\"F3\":%d,\"F4\":%d,\"F5\":%d,\"F6\":%d,\"F7\":%d,\"F8\":%d,\"Visible\":%d,\"NIR\":%d}",
+             _channels[0], _channels[1], _channels[2], _channels[3], _channels[4],
+             _channels[5], _channels[6], _channels[7], _channels[8], _channels[9]);
+}
+
+static void _as7341Cbor(cbor_writer_t *writer, uint8_t *buffer, size_t size)
+{
+    static const char *keys[10] = {"F1", "F2", "F3", "F4", "F5", "F6", "F7", "F8", "Visible", "NIR"};
+
+    cbor_begin(writer, buffer, size, CBOR_SCHEMA(1));
+    cbor_openMap(writer, 10);
+    for (int i = 0; i < 10; i++)
+    {
+        cbor_fieldUint(writer, keys[i], _channels[i]);
+    }
+}
+
+static void _fs3000Json(char *buffer, size_t size)
+{
+    snprintf(buffer, size, "{\"RAW\":%d,\"metersPerSec\":%.2f,\"milesPerHour\":%.2f}", _fsRaw, _fsMetersPerSec, _fsMilesPerHour);
+}
+
+static void _fs3000Cbor(cbor_writer_t *writer, uint8_t *buffer, size_t size)
+{
+    cbor_begin(writer, buffer, size, CBOR_SCHEMA(1));
+    cbor_openMap(writer, 3);
+    cbor_fieldUint(writer, "RAW", _fsRaw);
+    cbor_fieldFloat(writer, "metersPerSec", _fsMetersPerSec);
+    cbor_fieldFloat(writer, "milesPerHour", _fsMilesPerHour);
+}
+
+static void _fs3000Expected(char *buffer, size_t size)
+{
+    char metersPerSec[32], milesPerHour[32];
+    cbor_json_formatFloat(_fsMetersPerSec, metersPerSec, sizeof(metersPerSec));
+    cbor_json_formatFloat(_fsMilesPerHour, milesPerHour, sizeof(milesPerHour));
+    snprintf(buffer, size, "{\"RAW\":%d,\"metersPerSec\":%s,\"milesPerHour\":%s}", _fsRaw, metersPerSec, milesPerHour);
+}
+
+static void _mlx90614Json(char *buffer, size_t size)
+{
+    snprintf(buffer, size, "{\"ambientTemp\":%.2f,\"objectTemp\":%.2f}", _mlxAmbient, _mlxObject);
+}
+
+static void _mlx90614Cbor(cbor_writer_t *writer, uint8_t *buffer, size_t size)
+{
+    cbor_begin(writer, buffer, size, CBOR_SCHEMA(1));
+    cbor_openMap(writer, 2);
+    cbor_fieldFloat(writer, "ambientTemp", _mlxAmbient);
+    cbor_fieldFloat(writer, "objectTemp", _mlxObject);
+}
+
+static void _mlx90614Expected(char *buffer, size_t size)
+{
+    char ambient[32], object[32];
+    cbor_json_formatFloat(_mlxAmbient, ambient, sizeof(ambient));
+    cbor_json_formatFloat(_mlxObject, object, sizeof(object));
+    snprintf(buffer, size, "{\"ambientTemp\":%s,\"objectTemp\":%s}", ambient, object);
+}
+
+/**
+ * @brief A sample replayed from the flash log, as the apps wrap it: {"boot":3,"ms":123456,"data":<sample>}.
+ */
+static void _replayJson(char *buffer, size_t size)
+{
+    char sample[BENCH_BUFF_SIZE];
+    _as7341Json(sample, sizeof(sample));
+    snprintf(buffer, size, "{\"boot\":%u,\"ms\":%lu,\"data\":%s}", 3, 123456ul, sample);
+}
+
+static void _replayCbor(cbor_writer_t *writer, uint8_t *buffer, size_t size)
+{
+    // The sample as kept in flash (with its schema byte), then wrapped without being decoded
+    uint8_t record[BENCH_BUFF_SIZE];
+    cbor_writer_t sample;
+    _as7341Cbor(&sample, record, sizeof(record));
+
+    cbor_begin(writer, buffer, size, record[0]);
+    cbor_openMap(writer, 3);
+    cbor_fieldUint(writer, "boot", 3);
+    cbor_fieldUint(writer, "ms", 123456);
+    cbor_putText(writer, "data");
+    cbor_putRaw(writer, &record[1], cbor_getLength(&sample) - 1);
+}
+
+static const bench_sample_t _samples[] = {
+    {"AS7341", _as7341Json, _as7341Cbor, _as7341Json},
+    {"FS3000", _fs3000Json, _fs3000Cbor, _fs3000Expected},
+    {"MLX90614", _mlx90614Json, _mlx90614Cbor, _mlx90614Expected},
+    {"LOG", _replayJson, _replayCbor, _replayJson},
+};
+
+/**
+ * @brief Encodes every sample, decodes it back, and compares it with the JSON of the app. Prints the size and time of both.
+ */
+static void _checkSamples(void)
+{
+    char json[BENCH_BUFF_SIZE];
+    char expected[BENCH_BUFF_SIZE];
+    char decoded[BENCH_BUFF_SIZE];
+    uint8_t message[BENCH_BUFF_SIZE];
+    cbor_writer_t writer;
+    uint8_t schema;
+
+    printf("%-9s %-10s %10s %10s %12s %12s\n", "samples", "topic", "JSON B", "CBOR B", "JSON ns", "CBOR ns");
+    for (size_t s = 0; s < sizeof(_samples) / sizeof(_samples[0]); s++)
+    {
+        const bench_sample_t *sample = &_samples[s];
+
+        sample->json(json, sizeof(json));
+        sample->cbor(&writer, message, sizeof(message));
+        sample->expected(expected, sizeof(expected));
+        if (!cbor_isOk(&writer))
+        {
+            _fail("samples", "sample does not fit in the buffer");
+            continue;
+        }
+        if (!cbor_json_fromMessage(message, cbor_getLength(&writer), &schema, decoded, sizeof(decoded)) || (schema != 1))
+        {
+            _fail("samples", "sample could not be decoded");
+            printf("     %s\n", sample->name);
+            continue;
+        }
+        if (strcmp(decoded, expected) != 0)
+        {
+            _fail("samples", "decoded sample differs from the sample");
+            printf("     expected %s\n     got      %s\n", expected, decoded);
+        }
+        if (cbor_getLength(&writer) >= strlen(json))
+        {
+            _fail("samples", "CBOR sample not smaller than its JSON");
+        }
+
+        // Time to build each (the sink keeps the compiler from dropping the rounds)
+        volatile uint8_t sink = 0;
+        uint64_t start = _cpuNs();
+        for (int i = 0; i < BENCH_ROUNDS; i++)
+        {
+            sample->json(json, sizeof(json));
+            sink += json[1];
+        }
+        uint64_t jsonNs = _cpuNs() - start;
+        start = _cpuNs();
+        for (int i = 0; i < BENCH_ROUNDS; i++)
+        {
+            sample->cbor(&writer, message, sizeof(message));
+            sink += message[1];
+        }
+        uint64_t cborNs = _cpuNs() - start;
+        (void)sink;
+
+        printf("%-9s %-10s %10u %10u %12.1f %12.1f\n", "", sample->name, (unsigned)strlen(json), (unsigned)cbor_getLength(&writer),
+               (double)jsonNs / BENCH_ROUNDS, (double)cborNs / BENCH_ROUNDS);
+    }
+}
+
+#pragma endregion
+
+#pragma region Decoder
+
+/**
+ * @brief Every truncated message, a message with trailing bytes and JSON text must be rejected.
+ */
+static void _checkDecoder(void)
+{
+    uint8_t message[BENCH_BUFF_SIZE];
+    char decoded[BENCH_BUFF_SIZE];
+    cbor_writer_t writer;
+    uint8_t schema;
+
+    _replayCbor(&writer, message, sizeof(message));
+    size_t len = cbor_getLength(&writer);
+    for (size_t cut = 0; cut < len; cut++)
+    {
+        if (cbor_json_fromMessage(message, cut, &schema, decoded, sizeof(decoded)))
+        {
+            _fail("decoder", "truncated message accepted");
+            printf("     cut to %u bytes of %u\n", (unsigned)cut, (unsigned)len);
+            return;
+        }
+    }
+    message[len] = 0x00;
+    if (cbor_json_fromMessage(message, len + 1, &schema, decoded, sizeof(decoded)))
+    {
+        _fail("decoder", "message with trailing bytes accepted");
+    }
+    if (cbor_json_fromMessage((const uint8_t *)"{\"a\":1}", 7, &schema, decoded, sizeof(decoded)))
+    {
+        _fail("decoder", "JSON text taken for a CBOR message");
+    }
+    if (cbor_json_fromMessage(message, len, &schema, decoded, 16))
+    {
+        _fail("decoder", "JSON text larger than its buffer reported complete");
+    }
+    printf("%-9s %u truncated messages rejected\n", "decoder", (unsigned)len);
+}
+
+#pragma endregion
+
+int main(void)
+{
+    _checkEncoding();
+    _checkOverflow();
+    _checkSamples();
+    _checkDecoder();
+
+    printf("%s\n", _ok ? "PASS" : "FAIL");
+    return _ok ? 0 : 1;
+}
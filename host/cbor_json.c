@@ -0,0 +1,331 @@
+/** @file cbor_json.c
+ *
+ * @brief CBOR decoder of the host tools, see cbor_json.h.
+ * Brief overview of the code:
+ * The item is read recursively (up to CBOR_JSON_MAX_DEPTH levels of arrays and maps), and written to the JSON buffer as it goes.
+ * Every read is checked against the end of the message, so a truncated or corrupted message is rejected rather than overrun.
+ */
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cbor_json.h"
+
+// Deepest nesting of arrays and maps accepted.
+#define CBOR_JSON_MAX_DEPTH 16
+
+/**
+ * @brief Reading position in the message, and writing position in the JSON buffer.
+ */
+typedef struct
+{
+    const uint8_t *data; // Message being read
+    size_t len;          // Length of the message
+    size_t pos;          // Offset of the next byte to read
+    char *json;          // JSON buffer
+    size_t size;         // Size of the JSON buffer
+    size_t out;          // Length of the JSON text so far
+    bool ok;             // Nothing went wrong so far
+} cbor_json_t;
+
+/**
+ * @brief Appends text to the JSON buffer (printf style), marks the conversion as failed if it does not fit.
+ */
+static void _print(cbor_json_t *ctx, const char *format, ...) __attribute__((format(printf, 2, 3)));
+static void _print(cbor_json_t *ctx, const char *format, ...)
+{
+    va_list args;
+
+    if (!ctx->ok)
+    {
+        return;
+    }
+    va_start(args, format);
+    int written = vsnprintf(&ctx->json[ctx->out], ctx->size - ctx->out, format, args);
+    va_end(args);
+    if ((written < 0) || ((size_t)written >= ctx->size - ctx->out))
+    {
+        ctx->ok = false;
+        return;
+    }
+    ctx->out += written;
+}
+
+/**
+ * @brief Reads bytes from the message.
+ *
+ * @return A pointer to the bytes, NULL if the message is too short (the conversion is then marked as failed).
+ */
+static const uint8_t *_read(cbor_json_t *ctx, size_t len)
+{
+    if (!ctx->ok || (len > ctx->len - ctx->pos))
+    {
+        ctx->ok = false;
+        return NULL;
+    }
+    const uint8_t *bytes = &ctx->data[ctx->pos];
+    ctx->pos += len;
+    return bytes;
+}
+
+/**
+ * @brief Reads the argument of a head (the low 5 bits, or the 1, 2, 4 or 8 bytes that follow).
+ */
+static uint64_t _readArgument(cbor_json_t *ctx, uint8_t info)
+{
+    static const uint8_t bytesOf[4] = {1, 2, 4, 8};
+    uint64_t value = 0;
+
+    if (info < 24)
+    {
+        return info;
+    }
+    if (info > 27)
+    {
+        // Indefinite lengths (31) are not written by the sensors, 28 to 30 are reserved.
+        ctx->ok = false;
+        return 0;
+    }
+    const uint8_t *bytes = _read(ctx, bytesOf[info - 24]);
+    for (uint8_t i = 0; (bytes != NULL) && (i < bytesOf[info - 24]); i++)
+    {
+        value = (value << 8) | bytes[i];
+    }
+    return value;
+}
+
+/**
+ * @brief Writes a JSON string, escaped.
+ */
+static void _printString(cbor_json_t *ctx, const uint8_t *text, size_t len)
+{
+    _print(ctx, "\"");
+    for (size_t i = 0; i < len; i++)
+    {
+        if ((text[i] == '"') || (text[i] == '\\'))
+        {
+            _print(ctx, "\\%c", text[i]);
+        }
+        else if (text[i] < 0x20)
+        {
+            _print(ctx, "\\u%04x", text[i]);
+        }
+        else
+        {
+            _print(ctx, "%c", text[i]);
+        }
+    }
+    _print(ctx, "\"");
+}
+
+/**
+ * @brief Writes a double with the fewest digits that read back as the same double.
+ */
+static void _printDouble(cbor_json_t *ctx, double value)
+{
+    char text[32];
+
+    if (!isfinite(value))
+    {
+        _print(ctx, "null");
+        return;
+    }
+    for (int digits = 1; digits <= 17; digits++)
+    {
+        snprintf(text, sizeof(text), "%.*g", digits, value);
+        if (strtod(text, NULL) == value)
+        {
+            break;
+        }
+    }
+    _print(ctx, "%s", text);
+}
+
+void cbor_json_formatFloat(float value, char *text, size_t size)
+{
+    if (!isfinite(value))
+    {
+        snprintf(text, size, "null");
+        return;
+    }
+    for (int digits = 1; digits <= 9; digits++)
+    {
+        snprintf(text, size, "%.*g", digits, value);
+        if (strtof(text, NULL) == value)
+        {
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Converts one item (and the items it holds) to JSON.
+ */
+static void _item(cbor_json_t *ctx, int depth)
+{
+    const uint8_t *head = _read(ctx, 1);
+    if (head == NULL)
+    {
+        return;
+    }
+    uint8_t major = head[0] >> 5;
+    uint8_t info = head[0] & 0x1F;
+
+    // Floats and simple values: the argument is the value itself, not a count.
+    if (major == 7)
+    {
+        const uint8_t *bytes;
+        char text[32];
+        switch (info)
+        {
+        case 20:
+            _print(ctx, "false");
+            return;
+        case 21:
+            _print(ctx, "true");
+            return;
+        case 22:
+        case 23:
+            _print(ctx, "null"); // null and undefined
+            return;
+        case 25:
+            // Half precision: sign, 5 bits of exponent, 10 bits of mantissa.
+            if ((bytes = _read(ctx, 2)) != NULL)
+            {
+                uint16_t half = (bytes[0] << 8) | bytes[1];
+                int exponent = (half >> 10) & 0x1F;
+                double mantissa = half & 0x3FF;
+                double value = (exponent == 0) ? ldexp(mantissa, -24) : (exponent == 31) ? ((mantissa == 0) ? INFINITY : NAN) : ldexp(mantissa + 1024, exponent - 25);
+                _printDouble(ctx, (half & 0x8000) ? -value : value);
+            }
+            return;
+        case 26:
+            if ((bytes = _read(ctx, 4)) != NULL)
+            {
+                uint32_t bits = ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3];
+                float value;
+                memcpy(&value, &bits, sizeof(value));
+                cbor_json_formatFloat(value, text, sizeof(text));
+                _print(ctx, "%s", text);
+            }
+            return;
+        case 27:
+            if ((bytes = _read(ctx, 8)) != NULL)
+            {
+                uint64_t bits = 0;
+                double value;
+                for (int i = 0; i < 8; i++)
+                {
+                    bits = (bits << 8) | bytes[i];
+                }
+                memcpy(&value, &bits, sizeof(value));
+                _printDouble(ctx, value);
+            }
+            return;
+        default:
+            ctx->ok = false;
+            return;
+        }
+    }
+
+    uint64_t argument = _readArgument(ctx, info);
+    if (!ctx->ok)
+    {
+        return;
+    }
+    switch (major)
+    {
+    case 0:
+        _print(ctx, "%llu", (unsigned long long)argument);
+        break;
+    case 1:
+        // -1 - argument, which only fits in a signed 64-bit integer up to INT64_MIN.
+        if (argument > INT64_MAX)
+        {
+            ctx->ok = false;
+            break;
+        }
+        _print(ctx, "%lld", -1 - (long long)argument);
+        break;
+    case 2:
+    {
+        const uint8_t *bytes = _read(ctx, argument);
+        _print(ctx, "\"");
+        for (uint64_t i = 0; (bytes != NULL) && (i < argument); i++)
+        {
+            _print(ctx, "%02x", bytes[i]);
+        }
+        _print(ctx, "\"");
+        break;
+    }
+    case 3:
+    {
+        const uint8_t *text = _read(ctx, argument);
+        if (text != NULL)
+        {
+            _printString(ctx, text, argument);
+        }
+        break;
+    }
+    case 4:
+    case 5:
+        if (depth >= CBOR_JSON_MAX_DEPTH)
+        {
+            ctx->ok = false;
+            break;
+        }
+        _print(ctx, (major == 4) ? "[" : "{");
+        for (uint64_t i = 0; ctx->ok && (i < argument); i++)
+        {
+            if (i > 0)
+            {
+                _print(ctx, ",");
+            }
+            if (major == 5)
+            {
+                // JSON keys are strings: text keys as is, integer keys as their digits.
+                uint8_t keyMajor = (ctx->pos < ctx->len) ? (ctx->data[ctx->pos] >> 5) : 0xFF;
+                if (keyMajor == 3)
+                {
+                    _item(ctx, depth + 1);
+                }
+                else if (keyMajor <= 1)
+                {
+                    _print(ctx, "\"");
+                    _item(ctx, depth + 1);
+                    _print(ctx, "\"");
+                }
+                else
+                {
+                    ctx->ok = false;
+                    break;
+                }
+                _print(ctx, ":");
+            }
+            _item(ctx, depth + 1);
+        }
+        _print(ctx, (major == 4) ? "]" : "}");
+        break;
+    case 6:
+        // Tag: the meaning is not needed for the JSON, only the tagged item.
+        _item(ctx, depth);
+        break;
+    }
+}
+
+bool cbor_json_fromMessage(const uint8_t *message, size_t len, uint8_t *schema, char *json, size_t size)
+{
+    cbor_json_t ctx = {.data = message, .len = len, .pos = 0, .json = json, .size = size, .out = 0, .ok = (size > 0)};
+
+    // The schema byte has its top bit set (JSON text never does).
+    if ((len == 0) || !(message[0] & 0x80))
+    {
+        return false;
+    }
+    *schema = message[0] & 0x7F;
+    ctx.pos = 1;
+    _item(&ctx, 0);
+    return ctx.ok && (ctx.pos == ctx.len);
+}
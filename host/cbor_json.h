@@ -0,0 +1,41 @@
+/** @file cbor_json.h
+ *
+ * @brief Header file for the CBOR decoder of the host tools: turns the CBOR messages of the sensors back into JSON text.
+ *
+ * Brief overview of the code:
+ * A message is a schema byte followed by one CBOR item (see lib/cbor/cbor_writer.h). The item is converted to the JSON
+ * the app would have sent: maps become objects, text and byte strings become strings (bytes in hex),
+ * and floats are printed with the fewest digits that give the same float back.
+ * Indefinite lengths, and map keys other than text or integers, are not written by the sensors and are rejected.
+ */
+
+#pragma once
+#ifndef _CBOR_JSON_H_
+#define _CBOR_JSON_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Converts a CBOR message (schema byte and item) to JSON text.
+ *
+ * @param message The message.
+ * @param len The length of the message.
+ * @param schema Set to the schema number of the message (0 to 127).
+ * @param json The buffer the JSON text is written to (null terminated).
+ * @param size The size of the buffer.
+ * @return True if the message is a well-formed CBOR message, with nothing after its item, and its JSON fits in the buffer.
+ */
+bool cbor_json_fromMessage(const uint8_t *message, size_t len, uint8_t *schema, char *json, size_t size);
+
+/**
+ * @brief Formats a float with the fewest significant digits (up to 9) that read back as the same float, e.g. 1.45 or 23.
+ *
+ * @param value The value (NaN and infinities are written as null, JSON has no way to write them).
+ * @param text The buffer the text is written to (null terminated).
+ * @param size The size of the buffer.
+ */
+void cbor_json_formatFloat(float value, char *text, size_t size);
+
+#endif // _CBOR_JSON_H_
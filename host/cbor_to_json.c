@@ -0,0 +1,106 @@
+/** @file cbor_to_json.c
+ *
+ * @brief Converts the CBOR messages of the sensors back to JSON, for the dashboard or for a look at the traffic.
+ * Brief overview of the code:
+ * Reads one message per line on stdin, as "<topic> <payload in hex>", the way mosquitto_sub prints them with -F '%t %x':
+ *
+ *   mosquitto_sub -h <broker> -t '#' -v -F '%t %x' | ./build_host/cbor_to_json
+ *
+ * and prints "<topic> <JSON>" for each. CBOR messages (see lib/cbor/cbor_writer.h) are converted to the JSON the app
+ * would have sent, JSON messages are printed as they are, and a message that is neither is printed in hex, with an error.
+ *
+ * Usage: cbor_to_json [-s]
+ * With -s, CBOR messages are printed with their schema number: {"schema":<number>,"data":<JSON>}.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cbor_json.h"
+
+// Longest line read (topic and payload in hex), and longest JSON text printed.
+#define CBOR_TO_JSON_MAX_LINE 8192
+#define CBOR_TO_JSON_MAX_JSON 16384
+
+/**
+ * @brief Converts hex digits to bytes.
+ *
+ * @return The number of bytes, -1 if the text is not an even number of hex digits.
+ */
+static int _fromHex(const char *hex, uint8_t *bytes, size_t size)
+{
+    size_t len = strlen(hex);
+
+    if ((len % 2) || (len / 2 > size))
+    {
+        return -1;
+    }
+    for (size_t i = 0; i < len / 2; i++)
+    {
+        unsigned int byte;
+        if (sscanf(&hex[2 * i], "%2x", &byte) != 1)
+        {
+            return -1;
+        }
+        bytes[i] = (uint8_t)byte;
+    }
+    return (int)(len / 2);
+}
+
+int main(int argc, char *argv[])
+{
+    static char line[CBOR_TO_JSON_MAX_LINE];
+    static uint8_t message[CBOR_TO_JSON_MAX_LINE / 2];
+    static char json[CBOR_TO_JSON_MAX_JSON];
+    bool withSchema = (argc > 1) && (strcmp(argv[1], "-s") == 0);
+    int errors = 0;
+
+    while (fgets(line, sizeof(line), stdin) != NULL)
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+
+        // "<topic> <hex>", or just "<hex>"
+        char *hex = strrchr(line, ' ');
+        const char *topic = "";
+        if (hex != NULL)
+        {
+            *hex++ = '\0';
+            topic = line;
+        }
+        else
+        {
+            hex = line;
+        }
+
+        int len = _fromHex(hex, message, sizeof(message));
+        uint8_t schema;
+        if (len < 0)
+        {
+            printf("%s error: not hex: %s\n", topic, hex);
+            errors++;
+        }
+        else if ((len > 0) && !(message[0] & 0x80))
+        {
+            // JSON text (or any text payload, e.g. ONLINE), printed as is
+            printf("%s %.*s\n", topic, len, (const char *)message);
+        }
+        else if (cbor_json_fromMessage(message, len, &schema, json, sizeof(json)))
+        {
+            if (withSchema)
+            {
+                printf("%s {\"schema\":%u,\"data\":%s}\n", topic, schema, json);
+            }
+            else
+            {
+                printf("%s %s\n", topic, json);
+            }
+        }
+        else
+        {
+            printf("%s error: malformed CBOR message: %s\n", topic, hex);
+            errors++;
+        }
+        fflush(stdout);
+    }
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,174 @@
+/** @file driver_bench.c
+ *
+ * @brief Host driver bench: runs the sensor drivers of the project against the virtual sensors, and reports their bus cost.
+ * Brief overview of the code:
+ * For every sensor, the bring-up is run once, then a number of samples are taken the way the app takes them.
+ * For each step, the bench prints:
+ * 1. The number of bus transactions, and the data bytes written and read.
+ * 2. The time spent on the wire (at the clock rate of the bus).
+ * 3. The virtual time taken by the step (wire time plus every delay asked for by the driver).
+ * 4. The CPU time taken on the host (only meaningful relative to other runs on the same machine).
+ *
+ * The bench exits with a non-zero status if a sample reads wrong values, if the driver does not cope with the injected faults,
+ * or if a sample needs more transactions or bytes than its budget (an extra round-trip crept in).
+ *
+ * Usage: driver_bench [samples] [trace]
+ * With "trace", the I2C trace of every sensor (transactions and latency histograms, see i2c_tools_dumpTrace) is printed too.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pico/stdlib.h>
+#include "driver_bench.h"
+
+// Default number of samples taken per sensor.
+#define BENCH_SAMPLES 5
+
+/**
+ * @brief Bus traffic, virtual time and CPU time taken by one step.
+ */
+typedef struct
+{
+    virtual_i2c_stats_t bus; // Bus traffic of the step.
+    uint64_t simUs;          // Virtual time taken by the step.
+    uint64_t cpuNs;          // Host CPU time taken by the step.
+} bench_cost_t;
+
+// Snapshot taken at the start of the step being measured.
+static uint64_t _startSimUs;
+static uint64_t _startCpuNs;
+
+/**
+ * @brief Prints a failed check of a sensor step.
+ *
+ * @param sensor The name of the sensor.
+ * @param what What was checked.
+ */
+void bench_fail(const char *sensor, const char *what)
+{
+    printf("FAIL %s: %s\n", sensor, what);
+}
+
+/**
+ * @brief Returns the CPU time used by the process, in nanoseconds.
+ */
+static uint64_t _cpuNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * @brief Starts measuring a step.
+ */
+static void _measureBegin(void)
+{
+    virtual_i2c_resetStats(0);
+    _startSimUs = time_us_64();
+    _startCpuNs = _cpuNs();
+}
+
+/**
+ * @brief Stops measuring a step.
+ *
+ * @param cost Filled in with the cost of the step.
+ */
+static void _measureEnd(bench_cost_t *cost)
+{
+    cost->cpuNs = _cpuNs() - _startCpuNs;
+    cost->simUs = time_us_64() - _startSimUs;
+    virtual_i2c_getStats(0, &cost->bus);
+}
+
+/**
+ * @brief Prints one line of the report.
+ */
+static void _report(const char *sensor, const char *step, const bench_cost_t *cost)
+{
+    printf("%-9s %-7s %6u %6u %6u %6u %10llu %10llu %8.1f\n",
+           sensor, step,
+           cost->bus.transactions, cost->bus.bytesWritten, cost->bus.bytesRead, cost->bus.nacks,
+           (unsigned long long)cost->bus.busTimeUs, (unsigned long long)cost->simUs, cost->cpuNs / 1000.0);
+}
+
+/**
+ * @brief Runs the bring-up, the samples and the fault injection of one sensor.
+ *
+ * @param bus The I2C bus the virtual sensors are attached to.
+ * @param sensor The sensor to run.
+ * @param samples The number of samples to take.
+ * @return True if every check passed and every sample was within its budget; False otherwise.
+ */
+static bool _run(i2c_tools_bus_t *bus, const bench_sensor_t *sensor, int samples)
+{
+    bench_cost_t cost;
+    bool ok = true;
+
+    _measureBegin();
+    ok = sensor->setup(bus);
+    _measureEnd(&cost);
+    _report(sensor->name, "setup", &cost);
+    if (!ok)
+    {
+        return false;
+    }
+
+    for (int i = 0; i < samples; i++)
+    {
+        _measureBegin();
+        bool sampled = sensor->sample();
+        _measureEnd(&cost);
+        _report(sensor->name, "sample", &cost);
+        ok = ok && sampled;
+
+        uint32_t bytes = cost.bus.bytesWritten + cost.bus.bytesRead;
+        if ((cost.bus.transactions > sensor->maxTransactions) || (bytes > sensor->maxBytes))
+        {
+            printf("FAIL %s: sample over budget (%u transactions, %u bytes; budget %u transactions, %u bytes)\n",
+                   sensor->name, cost.bus.transactions, bytes, sensor->maxTransactions, sensor->maxBytes);
+            ok = false;
+        }
+    }
+
+    if (sensor->faults)
+    {
+        _measureBegin();
+        bool coped = sensor->faults();
+        _measureEnd(&cost);
+        _report(sensor->name, "faults", &cost);
+        ok = ok && coped;
+    }
+
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    const bench_sensor_t *sensors[] = {&bench_as7341, &bench_fs3000, &bench_mlx90614, &bench_scd41};
+    int samples = (argc > 1) ? atoi(argv[1]) : BENCH_SAMPLES;
+    bool trace = (argc > 2) && !strcmp(argv[2], "trace");
+    bool ok = true;
+
+    stdio_init_all();
+
+    // All the sensors share i2c0, as they each do in their own app.
+    i2c_tools_bus_t *bus = i2c_tools_init(i2c0, PICO_DEFAULT_I2C_SDA_PIN, PICO_DEFAULT_I2C_SCL_PIN);
+    i2c_tools_begin(bus);
+
+    printf("%-9s %-7s %6s %6s %6s %6s %10s %10s %8s\n", "sensor", "step", "xfers", "wr", "rd", "nacks", "bus_us", "sim_us", "cpu_us");
+    for (size_t i = 0; i < sizeof(sensors) / sizeof(sensors[0]); i++)
+    {
+        i2c_tools_clearTrace(bus);
+        ok = _run(bus, sensors[i], samples) && ok;
+        if (trace)
+        {
+            i2c_tools_dumpTrace(bus);
+        }
+    }
+
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,48 @@
+/** @file driver_bench.h
+ *
+ * @brief Header file for the host driver bench: each sensor driver of the project, run on the virtual I2C bus.
+ *
+ * Every sensor provides the same three steps, written the way its app uses the driver:
+ * 1. setup: attach the device model to the bus and bring the driver up (as the app does at boot).
+ * 2. sample: take one sample (as the app does every period), and check the values against the model.
+ * 3. faults: optional, inject scripted responses / NACKs and check the driver copes with them.
+ *
+ * The bench measures the bus traffic of every step, and fails if a sample needs more transactions or bytes than its budget.
+ */
+
+#pragma once
+#ifndef _DRIVER_BENCH_H_
+#define _DRIVER_BENCH_H_
+
+#include <pico/stdlib.h>
+#include "i2c_tools.h"
+#include "virtual_i2c.h"
+#include "virtual_devices.h"
+
+/**
+ * @brief One sensor driver under test.
+ */
+typedef struct
+{
+    const char *name;                     // Name of the sensor.
+    bool (*setup)(i2c_tools_bus_t *bus);  // Attaches the model and brings the driver up, returns false on failure.
+    bool (*sample)(void);                 // Takes one sample and checks it, returns false on failure.
+    bool (*faults)(void);                 // Injects faults and checks how the driver copes (can be NULL).
+    uint32_t maxTransactions;             // Budget of bus transactions per sample.
+    uint32_t maxBytes;                    // Budget of data bytes (written + read) per sample.
+} bench_sensor_t;
+
+extern const bench_sensor_t bench_as7341;
+extern const bench_sensor_t bench_fs3000;
+extern const bench_sensor_t bench_mlx90614;
+extern const bench_sensor_t bench_scd41;
+
+/**
+ * @brief Prints a failed check of a sensor step.
+ *
+ * @param sensor The name of the sensor.
+ * @param what What was checked.
+ */
+void bench_fail(const char *sensor, const char *what);
+
+#endif // _DRIVER_BENCH_H_
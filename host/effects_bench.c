@@ -0,0 +1,527 @@
+/** @file effects_bench.c
+ *
+ * @brief Host bench of the lighting effects of the WS2812B library (lib/ws2812b/ws2812b_effects.c), run on virtual strips (virtual_strip.h).
+ * Brief overview of the code:
+ * 1. Interpolation: every frame sent by the frame scheduler (fades, pulses, running lights, wipes) is checked LED by LED
+ *    against the timeline worked out in double precision, at the time the frame was sent: within 1 of it, and exact on the keyframes.
+ * 2. Scheduling: the frames are sent at the frame rate, never while the frame before is still on the wire,
+ *    a frame without any change is not sent again, and a timeline that has ended stops on its last colour.
+ * 3. Long runs: a looping timeline keeps its phase over 60 days (past the 49 days of a 32-bit ms count).
+ * 4. Commands: the text commands of ws2812b_effect_command, valid and invalid.
+ * 5. Cost: prints the host CPU time to render a frame of 1008 LEDs, with all the LEDs changing together and with a phase.
+ *
+ * The bench exits with a non-zero status if any check fails.
+ *
+ * Usage: effects_bench
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pico/stdlib.h>
+#include "virtual_i2c.h"
+#include "virtual_strip.h"
+#include "ws2812b_effects.h"
+
+// Frame rate of the scheduler.
+#define BENCH_FPS 50
+
+// Number of frames rendered to time each way.
+#define BENCH_ROUNDS 2000
+
+// Number of LEDs the effects arena has room for (WS2812B_EFFECTS_ARENA_SIZE, 3 bytes per LED).
+#define BENCH_ARENA_LEDS 1024
+
+// Number of LEDs of the small strip (the long one takes the rest of the arena).
+#define BENCH_STRIP_LEDS 16
+
+static bool _ok = true;
+
+/**
+ * @brief Prints a failed check.
+ */
+static void _fail(const char *check, const char *what)
+{
+    printf("FAIL %s: %s\n", check, what);
+    _ok = false;
+}
+
+/**
+ * @brief Gets the host CPU time, in nanoseconds.
+ */
+static uint64_t _cpuNs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+/**
+ * @brief Sets the colours of a strip (a gradient, so each LED starts its effect from its own colour) and shows them.
+ */
+static void _setGradient(ws2812b_strip_t *strip)
+{
+    uint8_t *frame = ws2812b_strip_get_frame(strip);
+    for (uint32_t i = 0; i < ws2812b_strip_get_led_count(strip); i++)
+    {
+        frame[i * 3] = (uint8_t)(i * 37);      /* Green */
+        frame[i * 3 + 1] = (uint8_t)(255 - i * 11); /* Red */
+        frame[i * 3 + 2] = (uint8_t)(i * 5);   /* Blue */
+    }
+    ws2812b_strip_show(strip);
+}
+
+/**
+ * @brief Works out the colour of a LED in double precision (the reference of the interpolation).
+ *
+ * @param keyframes The keyframes of the timeline.
+ * @param count The number of keyframes.
+ * @param loop Whether the timeline loops.
+ * @param from The colour of the LED when the timeline started (green, red, blue).
+ * @param t The time into the timeline of the LED, in ms (negative before it has reached the LED).
+ * @param out Set to the colour (green, red, blue).
+ */
+static void _reference(const ws2812b_keyframe_t *keyframes, uint32_t count, bool loop, const uint8_t *from, int64_t t, double *out)
+{
+    double first[3] = {from[0], from[1], from[2]};
+    const ws2812b_keyframe_t *last = &keyframes[count - 1];
+    int64_t total = 0;
+
+    for (uint32_t k = 0; k < count; k++)
+    {
+        total += keyframes[k].duration_ms;
+    }
+    if (t < 0)
+    {
+        memcpy(out, first, sizeof(first));
+        return;
+    }
+    if (t >= total)
+    {
+        if (!loop)
+        {
+            out[0] = last->g;
+            out[1] = last->r;
+            out[2] = last->b;
+            return;
+        }
+        t %= total;
+        first[0] = last->g;
+        first[1] = last->r;
+        first[2] = last->b;
+    }
+
+    int64_t start = 0;
+    for (uint32_t k = 0; k < count; k++)
+    {
+        int64_t end = start + keyframes[k].duration_ms;
+        if (t < end)
+        {
+            double to[3] = {keyframes[k].g, keyframes[k].r, keyframes[k].b};
+            double frac = (double)(t - start) / keyframes[k].duration_ms;
+            for (int j = 0; j < 3; j++)
+            {
+                out[j] = first[j] + (to[j] - first[j]) * frac;
+            }
+            return;
+        }
+        first[0] = keyframes[k].g;
+        first[1] = keyframes[k].r;
+        first[2] = keyframes[k].b;
+        start = end;
+    }
+}
+
+/**
+ * @brief Checks a frame sent against the reference, LED by LED.
+ *
+ * @return True if every LED is within 1 of the reference.
+ */
+static bool _checkFrame(const char *check, ws2812b_strip_t *strip, const ws2812b_keyframe_t *keyframes, uint32_t count, bool loop,
+                        uint32_t phaseMs, const uint8_t *from, uint64_t startUs)
+{
+    const uint8_t *shown = virtual_strip_getShown(strip);
+    int64_t t = (int64_t)((virtual_strip_getShowTime(strip) - startUs) / 1000);
+
+    for (uint32_t i = 0; i < ws2812b_strip_get_led_count(strip); i++)
+    {
+        double expected[3];
+        _reference(keyframes, count, loop, &from[i * 3], t - (int64_t)i * phaseMs, expected);
+        for (int j = 0; j < 3; j++)
+        {
+            if (fabs(shown[i * 3 + j] - expected[j]) > 1.0)
+            {
+                char what[128];
+                snprintf(what, sizeof(what), "LED %u at %lld ms: %u instead of %.2f", i, (long long)t, shown[i * 3 + j], expected[j]);
+                _fail(check, what);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Plays a timeline on a strip, and checks every frame sent against the reference, then the end of the timeline.
+ *
+ * @param runMs How long to run the effect for, in ms.
+ */
+static void _checkTimeline(const char *check, ws2812b_strip_t *strip, const ws2812b_keyframe_t *keyframes, uint32_t count, bool loop,
+                           uint32_t phaseMs, uint32_t runMs)
+{
+    uint32_t ledCount = ws2812b_strip_get_led_count(strip);
+    uint8_t from[VIRTUAL_STRIP_MAX_LEDS * 3];
+    uint64_t endUs = 0;
+
+    _setGradient(strip);
+    memcpy(from, virtual_strip_getShown(strip), ledCount * 3);
+    uint32_t shows = virtual_strip_getShowCount(strip);
+    uint32_t queued = virtual_strip_getQueuedCount(strip);
+    uint64_t startUs = time_us_64();
+    if (!ws2812b_effect_play(strip, keyframes, count, loop, phaseMs))
+    {
+        _fail(check, "not played");
+        return;
+    }
+
+    for (uint32_t ms = 0; ms < runMs; ms++)
+    {
+        sleep_ms(1);
+        if (virtual_strip_getShowCount(strip) != shows)
+        {
+            shows = virtual_strip_getShowCount(strip);
+            if (!_checkFrame(check, strip, keyframes, count, loop, phaseMs, from, startUs))
+            {
+                break;
+            }
+        }
+        if ((endUs == 0) && !ws2812b_effect_is_playing(strip))
+        {
+            endUs = time_us_64();
+        }
+    }
+
+    // A timeline that has ended stops on its last colour, exactly.
+    uint64_t timelineMs = (uint64_t)(ledCount - 1) * phaseMs;
+    for (uint32_t k = 0; k < count; k++)
+    {
+        timelineMs += keyframes[k].duration_ms;
+    }
+    if (loop || (runMs < timelineMs + 2 * 1000 / BENCH_FPS))
+    {
+        if (!ws2812b_effect_is_playing(strip))
+        {
+            _fail(check, "stopped before its end");
+        }
+    }
+    else
+    {
+        const uint8_t *shown = virtual_strip_getShown(strip);
+        const ws2812b_keyframe_t *last = &keyframes[count - 1];
+        for (uint32_t i = 0; i < ledCount; i++)
+        {
+            if ((shown[i * 3] != last->g) || (shown[i * 3 + 1] != last->r) || (shown[i * 3 + 2] != last->b))
+            {
+                _fail(check, "not on the last colour at the end");
+                break;
+            }
+        }
+        if ((endUs == 0) || (endUs - startUs > (timelineMs + 1000 / BENCH_FPS + 1) * 1000))
+        {
+            _fail(check, "not stopped at the end");
+        }
+    }
+    if (virtual_strip_getQueuedCount(strip) != queued)
+    {
+        _fail(check, "frame sent while the frame before was on the wire");
+    }
+    ws2812b_effect_stop(strip);
+}
+
+#pragma region Interpolation
+
+/**
+ * @brief Checks the frames of fades, pulses, running lights and wipes.
+ */
+static void _checkInterpolation(ws2812b_strip_t *strip, ws2812b_strip_t *longStrip)
+{
+    const ws2812b_keyframe_t fade[] = {{1000, 200, 100, 0}};
+    _checkTimeline("fade", strip, fade, 1, false, 0, 1500);
+
+    const ws2812b_keyframe_t slowFade[] = {{7777, 3, 250, 17}};
+    _checkTimeline("slow fade", strip, slowFade, 1, false, 0, 9000);
+
+    const ws2812b_keyframe_t timeline[] = {{0, 0, 0, 0}, {300, 20, 2, 0}, {0, 255, 0, 0}, {450, 0, 0, 255}, {1, 255, 255, 255}, {250, 1, 2, 3}};
+    _checkTimeline("timeline", strip, timeline, 6, false, 0, 1500);
+
+    const ws2812b_keyframe_t pulse[] = {{500, 255, 64, 10}, {500, 0, 0, 0}};
+    _checkTimeline("pulse", strip, pulse, 2, true, 0, 5500);
+
+    const ws2812b_keyframe_t running[] = {{400, 0, 255, 0}, {400, 0, 0, 0}};
+    _checkTimeline("running light", strip, running, 2, true, 100, 5000);
+
+    const ws2812b_keyframe_t wave[] = {{250, 90, 0, 200}, {333, 255, 180, 0}, {100, 7, 7, 7}};
+    _checkTimeline("wave", strip, wave, 3, false, 37, 2000);
+
+    const ws2812b_keyframe_t wipe[] = {{0, 0, 0, 255}};
+    _checkTimeline("wipe", strip, wipe, 1, false, 50, 1000);
+
+    // 1008 LEDs take 30.5 ms on the wire: every other tick (20 ms) finds a frame still being sent, and must skip it
+    _checkTimeline("long strip", longStrip, pulse, 2, true, 3, 3000);
+}
+
+/**
+ * @brief Checks the ramps: sunrise from off to its warm white, sunset down to off, each on time.
+ */
+static void _checkRamps(ws2812b_strip_t *strip)
+{
+    static const uint8_t white[3] = {220, 255, 170}; // Green, red, blue
+    static const uint8_t off[3] = {0, 0, 0};
+
+    _setGradient(strip);
+    ws2812b_effect_sunrise(strip, 4000);
+    sleep_ms(20 + 1000 / BENCH_FPS);
+    if (virtual_strip_getShown(strip)[1] > 20)
+    {
+        _fail("sunrise", "does not start from off");
+    }
+    sleep_ms(4000);
+    if (ws2812b_effect_is_playing(strip) || (memcmp(virtual_strip_getShown(strip), white, 3) != 0))
+    {
+        _fail("sunrise", "not on the warm white at the end");
+    }
+
+    ws2812b_effect_sunset(strip, 4001);
+    sleep_ms(4001 + 2 * 1000 / BENCH_FPS);
+    if (ws2812b_effect_is_playing(strip) || (memcmp(virtual_strip_getShown(strip), off, 3) != 0))
+    {
+        _fail("sunset", "not off at the end");
+    }
+}
+
+#pragma endregion
+
+#pragma region Scheduling
+
+/**
+ * @brief Checks the frame rate, and that frames without a change are not sent.
+ */
+static void _checkScheduling(ws2812b_strip_t *strip)
+{
+    char what[96];
+
+    // A fast fade changes at every tick: one frame per tick
+    ws2812b_strip_set_all_rgb(strip, 0, 0, 0);
+    ws2812b_strip_show(strip);
+    uint32_t shows = virtual_strip_getShowCount(strip);
+    ws2812b_effect_fade(strip, 255, 255, 255, 1000);
+    sleep_ms(1000);
+    uint32_t frames = virtual_strip_getShowCount(strip) - shows;
+    if ((frames < BENCH_FPS - 1) || (frames > BENCH_FPS + 1))
+    {
+        snprintf(what, sizeof(what), "%u frames in 1 s at %u fps", frames, BENCH_FPS);
+        _fail("frame rate", what);
+    }
+
+    // A slow fade only changes every 6 s: 11 frames in a minute, not 3000
+    ws2812b_strip_set_all_rgb(strip, 0, 0, 0);
+    ws2812b_strip_show(strip);
+    shows = virtual_strip_getShowCount(strip);
+    ws2812b_effect_fade(strip, 10, 0, 0, 60000);
+    sleep_ms(61000);
+    frames = virtual_strip_getShowCount(strip) - shows;
+    if (frames > 11)
+    {
+        snprintf(what, sizeof(what), "%u frames for 10 steps", frames);
+        _fail("unchanged frames", what);
+    }
+    if (ws2812b_effect_is_playing(strip) || (virtual_strip_getShown(strip)[1] != 10))
+    {
+        _fail("unchanged frames", "not on the last colour at the end");
+    }
+
+    // Stopped: the LEDs keep their colours, no more frames
+    ws2812b_effect_pulse(strip, 255, 0, 0, 1000, 0);
+    sleep_ms(1234);
+    ws2812b_effect_stop(strip);
+    shows = virtual_strip_getShowCount(strip);
+    sleep_ms(1000);
+    if (ws2812b_effect_is_playing(strip) || (virtual_strip_getShowCount(strip) != shows))
+    {
+        _fail("stop", "frames sent after the effect was stopped");
+    }
+}
+
+/**
+ * @brief Checks that a looping timeline keeps its phase over 60 days.
+ */
+static void _checkLongRun(ws2812b_strip_t *strip)
+{
+    // A day of 1000 ms ramps up and down, then 86398 s of off
+    const ws2812b_keyframe_t day[] = {{1000, 200, 0, 0}, {1000, 0, 0, 0}, {86398000, 0, 0, 0}};
+    const uint64_t dayUs = 86400000000ULL;
+
+    ws2812b_strip_set_all_rgb(strip, 0, 0, 0);
+    ws2812b_strip_show(strip);
+    uint64_t startUs = time_us_64();
+    ws2812b_effect_play(strip, day, 3, true, 0);
+    for (uint32_t days = 0; days < 60; days++)
+    {
+        // Half way up the ramp of the day (the ticks of the rest of the day are skipped)
+        host_clock_skip(startUs + days * dayUs + 450000 - time_us_64());
+        sleep_ms(50);
+        uint64_t intoDayMs = (virtual_strip_getShowTime(strip) - startUs) % dayUs / 1000;
+        double expected = 0.2 * (double)intoDayMs;
+        if ((intoDayMs >= 1000) || (fabs(virtual_strip_getShown(strip)[1] - expected) > 1.0))
+        {
+            char what[96];
+            snprintf(what, sizeof(what), "day %u at %llu ms: %u instead of %.1f", days + 1, (unsigned long long)intoDayMs,
+                     virtual_strip_getShown(strip)[1], expected);
+            _fail("long run", what);
+            break;
+        }
+    }
+    ws2812b_effect_stop(strip);
+}
+
+#pragma endregion
+
+#pragma region Commands
+
+/**
+ * @brief Checks the text commands.
+ */
+static void _checkCommands(ws2812b_strip_t *strip)
+{
+    static const char *valid[] = {
+        "stop",
+        "fade FF8800 1000",
+        "fade 00ff00 0\n",
+        "sunrise 1800000",
+        "sunset 60000",
+        "pulse FF0000 1000",
+        "pulse FF0000 1000 125",
+        "timeline 500 FF0000",
+        "timeline loop 1800000 FFDDAA 41400000 FFDDAA 1800000 000000 41400000 000000",
+        "timeline loop phase 50 400 00FF00 400 000000",
+        "timeline phase 10 0 0000FF",
+        "  timeline\t100 010203  200 040506 ",
+        "timeline 1 000001 1 000002 1 000003 1 000004 1 000005 1 000006 1 000007 1 000008",
+    };
+    static const char *invalid[] = {
+        "",
+        "   ",
+        "blink",
+        "stop now",
+        "fade FF8800",
+        "fade FF880 1000",
+        "fade GG8800 1000",
+        "fade FF8800 -5",
+        "fade FF8800 10x",
+        "fade FF8800 99999999999",
+        "sunrise",
+        "sunset 1000 2000",
+        "pulse FF0000",
+        "pulse FF0000 1000 10 10",
+        "timeline",
+        "timeline loop",
+        "timeline loop phase",
+        "timeline 500",
+        "timeline FF0000 500",
+        "timeline loop 0 FF0000",
+        "timeline 1 000001 1 000002 1 000003 1 000004 1 000005 1 000006 1 000007 1 000008 1 000009",
+        "timeline phase 4294967295 1 FF0000",
+    };
+
+    for (size_t i = 0; i < sizeof(valid) / sizeof(valid[0]); i++)
+    {
+        if (!ws2812b_effect_command(strip, valid[i]))
+        {
+            _fail("command", valid[i]);
+        }
+    }
+
+    // An invalid command leaves the effect playing alone
+    ws2812b_effect_command(strip, "pulse 0000FF 1000");
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++)
+    {
+        if (ws2812b_effect_command(strip, invalid[i]))
+        {
+            _fail("invalid command accepted", invalid[i]);
+        }
+    }
+    if (!ws2812b_effect_is_playing(strip))
+    {
+        _fail("invalid command", "stopped the effect");
+    }
+
+    // The colours of a command are on the 0-255 scale of the keyframes (not the one of hexToRGB on the Pico)
+    ws2812b_effect_command(strip, "fade 123456 0");
+    sleep_ms(2 * 1000 / BENCH_FPS);
+    const uint8_t *shown = virtual_strip_getShown(strip);
+    if ((shown[0] != 0x34) || (shown[1] != 0x12) || (shown[2] != 0x56))
+    {
+        _fail("command", "fade 123456 0 not shown");
+    }
+    if (!ws2812b_effect_command(strip, "stop") || ws2812b_effect_is_playing(strip))
+    {
+        _fail("command", "stop");
+    }
+}
+
+#pragma endregion
+
+#pragma region Cost
+
+/**
+ * @brief Prints the host CPU time to render a frame of the long strip, each way (the frames are rendered from the timer, as on the Pico).
+ */
+static void _printCost(ws2812b_strip_t *longStrip)
+{
+    const ws2812b_keyframe_t pulse[] = {{500, 255, 64, 10}, {500, 0, 0, 0}};
+    static const struct
+    {
+        const char *name;
+        uint32_t phaseMs;
+    } ways[] = {{"together", 0}, {"phase", 1}};
+
+    printf("Render of a frame of %u LEDs (host CPU time):\n", ws2812b_strip_get_led_count(longStrip));
+    for (size_t i = 0; i < sizeof(ways) / sizeof(ways[0]); i++)
+    {
+        ws2812b_effect_play(longStrip, pulse, 2, true, ways[i].phaseMs);
+        uint32_t shows = virtual_strip_getShowCount(longStrip);
+        uint64_t start = _cpuNs();
+        sleep_ms(BENCH_ROUNDS * 1000 / BENCH_FPS);
+        uint64_t ns = _cpuNs() - start;
+        uint32_t frames = virtual_strip_getShowCount(longStrip) - shows;
+        printf("  %-10s %6llu ns per frame (%u frames)\n", ways[i].name, (unsigned long long)(ns / (frames ? frames : 1)), frames);
+    }
+    ws2812b_effect_stop(longStrip);
+}
+
+#pragma endregion
+
+int main(void)
+{
+    ws2812b_strip_t *strip = virtual_strip_create(BENCH_STRIP_LEDS);
+    ws2812b_strip_t *longStrip = virtual_strip_create(BENCH_ARENA_LEDS - BENCH_STRIP_LEDS);
+    ws2812b_strip_t *extraStrip = virtual_strip_create(1);
+
+    // The effects keep a copy of the colours of each strip: the two strips take the whole arena, there is no room left for a third one
+    if (!ws2812b_effects_init(BENCH_FPS) || !ws2812b_effect_fade(strip, 0, 0, 0, 0) || !ws2812b_effect_fade(longStrip, 0, 0, 0, 0) ||
+        ws2812b_effect_fade(extraStrip, 0, 0, 0, 0))
+    {
+        _fail("init", "effects arena");
+    }
+
+    _checkInterpolation(strip, longStrip);
+    _checkRamps(strip);
+    _checkScheduling(strip);
+    _checkLongRun(strip);
+    _checkCommands(strip);
+    _printCost(longStrip);
+    printf("%s\n", _ok ? "PASS" : "FAIL");
+    return _ok ? 0 : 1;
+}
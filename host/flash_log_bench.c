@@ -0,0 +1,370 @@
+/** @file flash_log_bench.c
+ *
+ * @brief Host bench of the flash log (lib/flash_log), run against the RAM flash image of virtual_flash.h.
+ * Brief overview of the code:
+ * 1. Format: records are laid out as described in flash_log.h, survive a reboot, and are replayed once, in order.
+ * 2. Wrap: a log written over several laps keeps the newest records in order, drops the oldest ones, and wears the sectors evenly.
+ * 3. Replay rate: a long outage is replayed at the configured rate, not all at once.
+ * 4. Power loss: the power is cut at every point of an append (sector erase included) and of a replay,
+ *    the log must come back with every record that was written before, in order, and keep working.
+ *    This is done while opening a blank sector, and while reusing the oldest sector of a full log.
+ *
+ * The bench exits with a non-zero status if any check fails.
+ *
+ * Usage: flash_log_bench
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <pico/stdlib.h>
+#include "virtual_flash.h"
+#include "virtual_i2c.h"
+#include "flash_log.h"
+
+// Largest number of records collected by one replay.
+#define BENCH_MAX_RECORDS 2048
+
+/**
+ * @brief Records collected by the replay callback.
+ */
+typedef struct
+{
+    uint32_t count;                        // Number of records collected
+    uint32_t timestamps[BENCH_MAX_RECORDS]; // Timestamps of the records, in replay order
+    uint16_t boots[BENCH_MAX_RECORDS];     // Boot counts of the records
+    bool dataOk;                           // Every record held the data appended with its timestamp
+    uint32_t stopAfter;                    // Refuse the records after this many (to test a replay stopped half way)
+} bench_replay_t;
+
+static bool _ok = true;
+
+/**
+ * @brief Prints a failed check.
+ */
+static void _fail(const char *check, const char *what)
+{
+    printf("FAIL %s: %s\n", check, what);
+    _ok = false;
+}
+
+/**
+ * @brief Fills in the data of the record with the given timestamp (its length varies with the timestamp).
+ *
+ * @return The length of the data.
+ */
+static uint8_t _sampleData(uint32_t timestamp, uint8_t *data)
+{
+    uint8_t len = 8 + (timestamp * 7) % 90;
+    for (uint8_t i = 0; i < len; i++)
+    {
+        data[i] = (uint8_t)(timestamp * 31 + i);
+    }
+    return len;
+}
+
+/**
+ * @brief Appends the record with the given timestamp.
+ */
+static bool _append(uint32_t timestamp)
+{
+    uint8_t data[FLASH_LOG_MAX_DATA];
+    uint8_t len = _sampleData(timestamp, data);
+    return flash_log_append((uint8_t)(timestamp & 3), timestamp, data, len);
+}
+
+/**
+ * @brief Replay callback: collects the records and checks their data.
+ */
+static bool _collect(const flash_log_record_t *record, void *arg)
+{
+    bench_replay_t *replay = (bench_replay_t *)arg;
+    uint8_t data[FLASH_LOG_MAX_DATA];
+
+    if ((replay->count >= replay->stopAfter) || (replay->count >= BENCH_MAX_RECORDS))
+    {
+        return false;
+    }
+
+    uint8_t len = _sampleData(record->timestamp, data);
+    if ((record->len != len) || memcmp(record->data, data, len) || (record->tag != (record->timestamp & 3)))
+    {
+        replay->dataOk = false;
+    }
+    replay->timestamps[replay->count] = record->timestamp;
+    replay->boots[replay->count] = record->boot;
+    replay->count++;
+    return true;
+}
+
+/**
+ * @brief Replays every record waiting in the log (the clock is moved forward as far as the replay rate needs).
+ */
+static void _replayAll(bench_replay_t *replay, uint32_t stopAfter)
+{
+    memset(replay, 0, sizeof(*replay));
+    replay->dataOk = true;
+    replay->stopAfter = stopAfter;
+
+    flash_log_setReplayRate(1000);
+    for (int i = 0; (i < 1000) && flash_log_getPending() && (replay->count < stopAfter); i++)
+    {
+        sleep_ms(1000);
+        flash_log_replay(_collect, replay);
+    }
+    flash_log_setReplayRate(FLASH_LOG_DEFAULT_REPLAY_RATE);
+}
+
+/**
+ * @brief Checks that the replayed records are the timestamps first..last, in order (the last one can be missing if optional).
+ */
+static bool _checkSequence(const bench_replay_t *replay, uint32_t first, uint32_t last, bool lastOptional)
+{
+    uint32_t expected = last - first + 1;
+    if (!replay->dataOk)
+    {
+        return false;
+    }
+    if ((replay->count != expected) && !(lastOptional && (replay->count == expected - 1)))
+    {
+        return false;
+    }
+    for (uint32_t i = 0; i < replay->count; i++)
+    {
+        if (replay->timestamps[i] != first + i)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Appends records, reboots, checks the layout of the first record and replays everything once.
+ */
+static void _checkFormat(void)
+{
+    static bench_replay_t replay;
+
+    virtual_flash_reset();
+    if ((flash_log_begin() != 0) || (flash_log_getBoot() != 1))
+    {
+        _fail("format", "blank log");
+    }
+    for (uint32_t t = 0; t < 100; t++)
+    {
+        _append(t);
+    }
+    if (flash_log_append(0, 0, &replay, FLASH_LOG_MAX_DATA + 1))
+    {
+        _fail("format", "oversized record accepted");
+    }
+
+    // Reboot
+    if ((flash_log_begin() != 100) || (flash_log_getBoot() != 2))
+    {
+        _fail("format", "records lost over a reboot");
+    }
+
+    // First record, right after the 16 byte header of the first sector: magic, len, tag, sent, boot, crc, timestamp, data
+    const uint8_t *rec = &virtual_flash_image[FLASH_LOG_OFFSET + 16];
+    uint8_t data[FLASH_LOG_MAX_DATA];
+    uint8_t len = _sampleData(0, data);
+    if ((rec[0] != 0xA5) || (rec[1] != len) || (rec[2] != 0) || (rec[3] != 0xFF) || (rec[4] != 1) || (rec[5] != 0) ||
+        memcmp(&rec[8], "\0\0\0\0", 4) || memcmp(&rec[12], data, len))
+    {
+        _fail("format", "record layout");
+    }
+
+    _replayAll(&replay, BENCH_MAX_RECORDS);
+    if (!_checkSequence(&replay, 0, 99, false) || (replay.boots[0] != 1))
+    {
+        _fail("format", "replay order or data");
+    }
+    if (rec[3] != 0x00)
+    {
+        _fail("format", "replayed record not marked as sent");
+    }
+
+    // Nothing is replayed twice, even after a reboot
+    if (flash_log_begin() != 0)
+    {
+        _fail("format", "replayed records pending again after a reboot");
+    }
+    printf("format    100 records, replayed once and in order over reboots\n");
+}
+
+/**
+ * @brief Writes the log over several laps, and checks what is left and the wear of the sectors.
+ */
+static void _checkWrap(void)
+{
+    static bench_replay_t replay;
+    flash_log_stats_t stats;
+    const uint32_t total = 8000; // About 5 laps of the default 32 sectors
+
+    virtual_flash_reset();
+    flash_log_begin();
+    for (uint32_t t = 0; t < total; t++)
+    {
+        if (!_append(t))
+        {
+            _fail("wrap", "append failed");
+            return;
+        }
+    }
+    flash_log_getStats(&stats);
+    uint32_t pending = flash_log_getPending();
+    if ((stats.dropped == 0) || (stats.dropped + pending != total))
+    {
+        _fail("wrap", "dropped and pending records do not add up");
+    }
+
+    flash_log_begin();
+    _replayAll(&replay, BENCH_MAX_RECORDS);
+    if (!_checkSequence(&replay, total - pending, total - 1, false))
+    {
+        _fail("wrap", "newest records not replayed in order");
+    }
+
+    uint32_t minErases = UINT32_MAX;
+    uint32_t maxErases = 0;
+    for (int sector = 0; sector < FLASH_LOG_SECTORS; sector++)
+    {
+        uint32_t erases = virtual_flash_getEraseCount(FLASH_LOG_OFFSET + sector * FLASH_SECTOR_SIZE);
+        minErases = (erases < minErases) ? erases : minErases;
+        maxErases = (erases > maxErases) ? erases : maxErases;
+    }
+    if (maxErases - minErases > 1)
+    {
+        _fail("wrap", "uneven wear of the sectors");
+    }
+    printf("wrap      %u records, %u kept, %u dropped, %u-%u erases per sector\n",
+           (unsigned)total, (unsigned)pending, (unsigned)stats.dropped, (unsigned)minErases, (unsigned)maxErases);
+}
+
+/**
+ * @brief Checks that the records are replayed at the configured rate.
+ */
+static void _checkReplayRate(void)
+{
+    static bench_replay_t replay;
+
+    virtual_flash_reset();
+    flash_log_begin();
+    for (uint32_t t = 0; t < 50; t++)
+    {
+        _append(t);
+    }
+
+    memset(&replay, 0, sizeof(replay));
+    replay.dataOk = true;
+    replay.stopAfter = BENCH_MAX_RECORDS;
+    flash_log_setReplayRate(5);
+
+    // A long outage: one second worth of records at most
+    sleep_ms(60000);
+    uint32_t burst = flash_log_replay(_collect, &replay);
+    uint32_t again = flash_log_replay(_collect, &replay);
+    sleep_ms(200);
+    uint32_t next = flash_log_replay(_collect, &replay);
+    if ((burst != 5) || (again != 0) || (next != 1))
+    {
+        _fail("rate", "replay not limited to the configured rate");
+    }
+    printf("rate      5 records/s: %u after an outage, %u straight after, %u 200 ms later\n",
+           (unsigned)burst, (unsigned)again, (unsigned)next);
+}
+
+/**
+ * @brief Gets the number of records appended to a blank log before the append that erases a sector for the given time.
+ */
+static uint32_t _recordsBeforeErase(uint32_t erases)
+{
+    flash_log_stats_t stats;
+    uint32_t records = 0;
+
+    virtual_flash_reset();
+    flash_log_begin();
+    do
+    {
+        _append(records++);
+        flash_log_getStats(&stats);
+    } while (stats.erases < erases);
+    return records - 1;
+}
+
+/**
+ * @brief Cuts the power at every point of the append that opens a new sector (erase, header, record), then of a replay of 3 records.
+ *
+ * @param check The name of the check.
+ * @param records The number of records appended before, the next one opens a new sector.
+ * @param maxFirst The largest timestamp the replay can start from after the reboot (records 0 and 1 are replayed before the cut).
+ * @param step The number of bytes between two cut points.
+ */
+static void _checkPowerLoss(const char *check, uint32_t records, uint32_t maxFirst, uint32_t step)
+{
+    static bench_replay_t replay;
+    uint32_t cuts = 0;
+
+    for (uint32_t cut = 0; cut < FLASH_SECTOR_SIZE + 4 * FLASH_PAGE_SIZE; cut += step)
+    {
+        virtual_flash_reset();
+        flash_log_begin();
+        for (uint32_t t = 0; t < records; t++)
+        {
+            _append(t);
+        }
+        _replayAll(&replay, 2);
+
+        virtual_flash_cutPowerAfter(cut);
+        _append(records);
+        _replayAll(&replay, 3);
+        cuts += virtual_flash_isPowerCut() ? 1 : 0;
+
+        // Reboot
+        virtual_flash_powerOn();
+        flash_log_begin();
+        _replayAll(&replay, BENCH_MAX_RECORDS);
+
+        // The records replayed before the cut may or may not have been marked, the one being appended may or may not be there,
+        // anything else missing, duplicated or out of order is a failure
+        uint32_t first = replay.count ? replay.timestamps[0] : 0;
+        if ((replay.count == 0) || (first < 2) || (first > maxFirst) || !_checkSequence(&replay, first, records, true))
+        {
+            _fail(check, "wrong records after the reboot");
+            printf("     cut after %u bytes: %u records from %u\n", (unsigned)cut, (unsigned)replay.count, (unsigned)first);
+            return;
+        }
+
+        // The log keeps working after the reboot
+        _append(100000);
+        _append(100001);
+        _replayAll(&replay, BENCH_MAX_RECORDS);
+        if (!_checkSequence(&replay, 100000, 100001, false))
+        {
+            _fail(check, "log unusable after the reboot");
+            printf("     cut after %u bytes\n", (unsigned)cut);
+            return;
+        }
+    }
+    printf("%-9s %u power cuts, log recovered every time\n", check, (unsigned)cuts);
+}
+
+int main(void)
+{
+    stdio_init_all();
+
+    _checkFormat();
+    _checkWrap();
+    _checkReplayRate();
+
+    // Power cut while opening the second sector: nothing may be lost
+    _checkPowerLoss("power", _recordsBeforeErase(2), 5, 16);
+
+    // Power cut while reusing the oldest sector of a full log: its records are either all there or all dropped
+    uint32_t full = _recordsBeforeErase(FLASH_LOG_SECTORS + 1);
+    _checkPowerLoss("powerwrap", full, full, 64);
+
+    printf("%s\n", _ok ? "PASS" : "FAIL");
+    return _ok ? 0 : 1;
+}
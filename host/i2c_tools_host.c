@@ -0,0 +1,1563 @@
+/** @file i2c_tools_host.c
+ *
+ * @brief This file contains the host (Linux) implementation of the I2C tools library (see lib/i2c_tools/i2c_tools.h).
+ * Brief overview of the code:
+ * The drivers of this project only talk to their sensors through i2c_tools, so replacing this one library is enough
+ * to run them, unmodified, on a PC. Every transaction is handed to the virtual I2C bus (virtual_i2c.h),
+ * where the device models answer it in place of the real sensors.
+ *
+ * The behaviour seen by the drivers is kept the same as on the Pico:
+ * 1. Same error codes, same retry policy (retries, deadline, bus recovery on a stuck bus), same per-address error counters.
+ * 2. Same presence cache (filled by scans, probes and every completed transfer).
+ * 3. Same asynchronous transfers: a transfer completes once the virtual clock has reached the time it takes on the wire,
+ *    and i2c_tools_waitTransfer moves the clock there (the CPU would be waiting on the DMA in the meantime).
+ * 4. Same bus lock and restart handling (a transfer without a Stop keeps the bus), with a single core.
+ * 5. Same register map in slave mode: the bus attaches itself to its virtual bus as a device model, so another master
+ *    (e.g. a test calling virtual_i2c_transfer) reads and writes its registers over the virtual wire.
+ * The GPIO functions only record the state of the pins, the bus lines are always released (pulled up) on the host.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <pico/stdlib.h>
+#include <hardware/i2c.h>
+#include <hardware/sync.h>
+#include "i2c_tools.h"
+#include "virtual_i2c.h"
+
+/**
+ * @brief Context of one I2C bus (one per virtual controller).
+ */
+struct i2c_tools_bus
+{
+    // Timeout value for I2C operations in milliseconds.
+    int _timeout;
+
+    // I2C instance pointer.
+    i2c_inst_t *_i2c;
+
+    // GPIO pin for the I2C data line.
+    int _sda;
+
+    // GPIO pin for the I2C clock line.
+    int _scl;
+
+    // Default clock frequency for the I2C communication (devices without a clock of their own).
+    int _clkHz;
+
+    // Clock frequency the virtual controller is currently timed for, in Hertz.
+    uint32_t _appliedHz;
+
+    // Clock frequency of each 7-bit address in Hertz, 0 for the default clock of the bus (see i2c_tools_setDeviceClock).
+    uint32_t _devClkHz[128];
+
+    // Flag indicating whether I2C is currently running/initialized.
+    bool _running;
+
+    // Flag indicating whether the bus is in slave mode (see i2c_tools_begin_w_address).
+    bool _slave;
+
+    // 7-bit I2C address for the target device in master mode.
+    uint8_t _addr;
+
+    // Flag indicating whether a transmission session is in progress.
+    bool _txBegun;
+
+    // Internal buffer for storing data during I2C operations.
+    uint8_t _buff[WIRE_BUFFER_SIZE];
+
+    // Length of data in the internal buffer.
+    int _buffLen;
+
+    // Offset within the internal buffer.
+    int _buffOff;
+
+    // The asynchronous transfer currently in flight on the bus (NULL if the bus is idle).
+    i2c_tools_xfer_t *_activeXfer;
+
+    // Time at which the in-flight transfer is over on the wire, in microseconds.
+    uint64_t _xferEnd;
+
+    // Outcome of the in-flight transfer, reported once it is over.
+    uint8_t _xferResult;
+
+    // Bitmap of the 7-bit addresses whose presence is known (probed, or seen in a completed transfer).
+    uint32_t _probed[4];
+
+    // Bitmap of the 7-bit addresses that acknowledged their last probe or transfer.
+    uint32_t _present[4];
+
+    // Number of times a failed blocking transaction is retried.
+    uint8_t _retries;
+
+    // Deadline of a whole blocking transaction in milliseconds, retries and bus recovery included.
+    uint32_t _xferDeadlineMs;
+
+    // Number of failed transactions per 7-bit address (saturates at 0xFFFF).
+    uint16_t _errCount[128];
+
+    // Number of times the bus has been recovered by i2c_tools_recoverBus.
+    uint32_t _recoveries;
+
+    // Number of times the lock has been taken (the lock is recursive, there is only one core on the host).
+    uint32_t _lockDepth;
+
+    // Flag indicating that the owner keeps the lock because its last transfer did not issue a Stop.
+    bool _heldForRestart;
+
+    // Contention statistics of the transaction queue (never contended on the host).
+    i2c_tools_lock_stats_t _lockStats;
+
+    // Ring of the last blocking transactions (see i2c_tools_getTrace).
+    i2c_tools_trace_record_t _trace[I2C_TOOLS_TRACE_SIZE];
+
+    // Number of transactions recorded since the trace was cleared.
+    volatile uint32_t _traceHead;
+
+    // Latency histograms of the first devices addressed since the trace was cleared.
+    i2c_tools_latency_hist_t _hists[I2C_TOOLS_TRACE_DEVICES];
+
+    // Number of latency histograms in use.
+    volatile int _histCount;
+
+    // Total time spent in blocking transactions since the trace was cleared, in microseconds.
+    uint64_t _traceBusUs;
+
+    // Time at which the trace was last cleared (start of the trace window), in microseconds.
+    uint64_t _traceSince;
+
+    // Device model answering the master on the virtual bus in slave mode.
+    virtual_i2c_device_t _slaveDev;
+
+    // Register map answered to the master in slave mode.
+    uint8_t _slaveRegs[I2C_TOOLS_SLAVE_REGS];
+
+    // Number of registers of the register map.
+    uint16_t _slaveSize;
+
+    // First register the master may write, and number of registers it may write from there.
+    uint16_t _slaveWrFirst;
+    uint16_t _slaveWrCount;
+
+    // Register pointer, set by the first byte of a master write and auto-incremented (saturates at _slaveSize).
+    uint16_t _slavePtr;
+
+    // Function called when the master has written to the register map (can be NULL), and its user argument.
+    i2c_tools_reg_write_cb_t _slaveOnWrite;
+    void *_slaveOnWriteArg;
+
+    // Number of master transactions served in slave mode.
+    uint32_t _slaveXfers;
+};
+
+// The trace ring is indexed with a mask.
+_Static_assert((I2C_TOOLS_TRACE_SIZE & (I2C_TOOLS_TRACE_SIZE - 1)) == 0, "I2C_TOOLS_TRACE_SIZE must be a power of 2");
+
+// One bus context per virtual I2C controller (i2c0 and i2c1).
+static i2c_tools_bus_t _buses[NUM_I2CS];
+
+// Default TWI (Two-Wire Interface) clock frequency.
+static const uint32_t TWI_CLOCK = 100000;
+
+// Mode and output level of each GPIO pin.
+static PinMode _pm[30];
+static bool _pinLevel[30];
+
+// Function called while the blocking functions are waiting for the bus.
+static void (*_idleCallback)(void);
+
+// Flag indicating whether the idle callback is currently running (prevents re-entering it).
+static bool _inIdleCallback;
+
+// Forward declaration, used by i2c_tools_end to abort a transfer still in flight.
+static void _finishTransfer(i2c_tools_xfer_t *xfer, uint8_t result);
+
+// Forward declaration, used by the transfers to keep the presence cache up to date.
+static void _setPresent(i2c_tools_bus_t *bus, uint8_t addr, bool present);
+
+// Forward declaration, used by the blocking transactions to record themselves in the trace.
+static void _traceRecord(i2c_tools_bus_t *bus, uint8_t addr, uint8_t dir, size_t len, uint64_t start, uint8_t result, int attempts);
+
+#pragma region GPIO function calls (from wiring_digital.c)
+
+/**
+ * @brief Sets the digital state of a GPIO pin (recorded only, there are no pins on the host).
+ *
+ * @param pin The GPIO pin number.
+ * @param val The digital value to be set (HIGH or LOW).
+ */
+void digitalWrite(int pin, int val)
+{
+    _pinLevel[pin] = (val != LOW);
+}
+
+/**
+ * @brief Reads the digital state of a GPIO pin.
+ *
+ * A pin driven as an output reads back its level, the bus lines are otherwise released (pulled up).
+ *
+ * @param pin The GPIO pin number.
+ * @return The digital state of the pin (HIGH or LOW).
+ */
+bool digitalRead(int pin)
+{
+    switch (_pm[pin])
+    {
+    case INPUT:
+    case INPUT_PULLUP:
+        return HIGH;
+    case INPUT_PULLDOWN:
+        return LOW;
+    default:
+        return _pinLevel[pin] ? HIGH : LOW;
+    }
+}
+
+/**
+ * @brief Sets the mode of a GPIO pin (recorded only).
+ *
+ * @param pin The GPIO pin number.
+ * @param mode The mode to be set (INPUT, OUTPUT, INPUT_PULLUP, etc.).
+ */
+void pinMode(int pin, int mode)
+{
+    _pm[pin] = mode;
+}
+
+#pragma endregion
+
+#pragma region I2C init and deinit functions
+
+/**
+ * @brief Initializes the context of an I2C bus with the specified instance and pins.
+ *
+ * @param i2c Pointer to the I2C instance (i2c0 or i2c1).
+ * @param sda The GPIO pin number for the I2C data line.
+ * @param scl The GPIO pin number for the I2C clock line.
+ * @return Pointer to the bus handle.
+ */
+i2c_tools_bus_t *i2c_tools_init(i2c_inst_t *i2c, int sda, int scl)
+{
+    // Look up the context of the virtual controller.
+    i2c_tools_bus_t *bus = &_buses[i2c_hw_index(i2c)];
+
+    // Do not pull the pins from under a running bus.
+    if (bus->_running)
+    {
+        return bus;
+    }
+
+    // Assign parameters to internal variables.
+    bus->_timeout = 500;
+    bus->_sda = sda;
+    bus->_scl = scl;
+    bus->_i2c = i2c;
+    bus->_clkHz = TWI_CLOCK;
+    bus->_running = false;
+    bus->_txBegun = false;
+    bus->_buffLen = 0;
+    bus->_activeXfer = NULL;
+    bus->_retries = I2C_TOOLS_DEFAULT_RETRIES;
+    bus->_xferDeadlineMs = I2C_TOOLS_DEFAULT_DEADLINE_MS;
+    bus->_recoveries = 0;
+    i2c_tools_clearScanCache(bus);
+    i2c_tools_clearErrorCounts(bus);
+    i2c_tools_clearTrace(bus);
+
+    // The register map of the slave mode is read-only and spans every register until set otherwise.
+    bus->_slave = false;
+    bus->_slaveSize = I2C_TOOLS_SLAVE_REGS;
+    bus->_slaveWrFirst = 0;
+    bus->_slaveWrCount = 0;
+    bus->_slaveOnWrite = NULL;
+    bus->_slaveOnWriteArg = NULL;
+    memset(bus->_slaveRegs, 0, sizeof(bus->_slaveRegs));
+
+    return bus;
+}
+
+/**
+ * @brief Sets the I2C SDA (data) pin.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param pin The pin number to set as the I2C SDA pin.
+ * @return True if the pin is successfully set or is already set; False if I2C is running.
+ */
+bool i2c_tools_setSDA(i2c_tools_bus_t *bus, int pin)
+{
+    if ((bus->_sda != pin) && bus->_running)
+    {
+        return false;
+    }
+    bus->_sda = pin;
+    return true;
+}
+
+/**
+ * @brief Sets the I2C SCL (clock) pin.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param pin The pin number to set as the I2C SCL pin.
+ * @return True if the pin is successfully set or is already set; False if I2C is running.
+ */
+bool i2c_tools_setSCL(i2c_tools_bus_t *bus, int pin)
+{
+    if ((bus->_scl != pin) && bus->_running)
+    {
+        return false;
+    }
+    bus->_scl = pin;
+    return true;
+}
+
+/**
+ * @brief Gets the I2C SDA (data) pin of a bus.
+ */
+int i2c_tools_getSDA(i2c_tools_bus_t *bus)
+{
+    return bus->_sda;
+}
+
+/**
+ * @brief Gets the I2C SCL (clock) pin of a bus.
+ */
+int i2c_tools_getSCL(i2c_tools_bus_t *bus)
+{
+    return bus->_scl;
+}
+
+/**
+ * @brief Sets the clock frequency for I2C communication (used by the virtual bus to compute the wire time).
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param hz The desired clock frequency in Hertz.
+ */
+void i2c_tools_setClock(i2c_tools_bus_t *bus, uint32_t hz)
+{
+    bus->_clkHz = hz;
+    virtual_i2c_setClock(i2c_hw_index(bus->_i2c), hz);
+    bus->_appliedHz = hz;
+}
+
+/**
+ * @brief Sets the clock frequency used for the transactions with one device (0 for the default clock of the bus).
+ */
+void i2c_tools_setDeviceClock(i2c_tools_bus_t *bus, uint8_t addr, uint32_t freqHz)
+{
+    bus->_devClkHz[addr & 0x7F] = freqHz;
+}
+
+/**
+ * @brief Gets the clock frequency used for the transactions with one device.
+ */
+uint32_t i2c_tools_getDeviceClock(i2c_tools_bus_t *bus, uint8_t addr)
+{
+    uint32_t hz = bus->_devClkHz[addr & 0x7F];
+    return hz ? hz : (uint32_t)bus->_clkHz;
+}
+
+/**
+ * @brief Retimes the virtual controller for the addressed device, if it runs at another clock than the previous transfer (same as on the Pico).
+ */
+static void _applyDeviceClock(i2c_tools_bus_t *bus, uint8_t addr)
+{
+    uint32_t hz = i2c_tools_getDeviceClock(bus, addr);
+    if ((hz != bus->_appliedHz) && !bus->_i2c->restart_on_next)
+    {
+        virtual_i2c_setClock(i2c_hw_index(bus->_i2c), hz);
+        bus->_appliedHz = hz;
+    }
+}
+
+/**
+ * @brief Initializes I2C communication, the pins are handed over to the (virtual) controller.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ */
+void i2c_tools_begin(i2c_tools_bus_t *bus)
+{
+    if (bus->_running)
+    {
+        return;
+    }
+
+    i2c_tools_lock(bus);
+
+    // The controller drives the pins again, both lines are released.
+    _pm[bus->_sda] = INPUT_PULLUP;
+    _pm[bus->_scl] = INPUT_PULLUP;
+    virtual_i2c_setClock(i2c_hw_index(bus->_i2c), bus->_clkHz);
+    bus->_appliedHz = bus->_clkHz;
+    bus->_i2c->restart_on_next = false;
+
+    bus->_running = true;
+    bus->_txBegun = false;
+    bus->_buffLen = 0;
+
+    i2c_tools_unlock(bus);
+}
+
+/**
+ * @brief Ends I2C communication.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ */
+void i2c_tools_end(i2c_tools_bus_t *bus)
+{
+    if (!bus->_running)
+    {
+        return;
+    }
+
+    i2c_tools_lock(bus);
+
+    // Abort any transfer still in flight.
+    if (bus->_activeXfer)
+    {
+        _finishTransfer(bus->_activeXfer, 4);
+    }
+
+    // Stop answering the master if the bus is in slave mode.
+    if (bus->_slave)
+    {
+        virtual_i2c_detach(i2c_hw_index(bus->_i2c), &bus->_slaveDev);
+        bus->_slave = false;
+    }
+
+    pinMode(bus->_sda, INPUT);
+    pinMode(bus->_scl, INPUT);
+
+    bus->_running = false;
+    bus->_txBegun = false;
+
+    // Devices may be swapped while the bus is down, so forget what was found on it.
+    i2c_tools_clearScanCache(bus);
+
+    // A bus held for a Restart is released by the shutdown.
+    if (bus->_heldForRestart)
+    {
+        bus->_heldForRestart = false;
+        i2c_tools_unlock(bus);
+    }
+    i2c_tools_unlock(bus);
+}
+
+#pragma endregion
+
+#pragma region Bus arbitration functions
+
+/**
+ * @brief Takes the bus lock (recursive). There is a single core on the host, so the lock is never contended.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ */
+void i2c_tools_lock(i2c_tools_bus_t *bus)
+{
+    if (!bus->_lockDepth++)
+    {
+        bus->_lockStats.acquisitions++;
+    }
+}
+
+/**
+ * @brief Releases the bus lock taken by i2c_tools_lock.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ */
+void i2c_tools_unlock(i2c_tools_bus_t *bus)
+{
+    if (bus->_lockDepth)
+    {
+        bus->_lockDepth--;
+    }
+}
+
+/**
+ * @brief Gets the contention statistics of the transaction queue.
+ */
+void i2c_tools_getLockStats(i2c_tools_bus_t *bus, i2c_tools_lock_stats_t *stats)
+{
+    *stats = bus->_lockStats;
+}
+
+/**
+ * @brief Resets the contention statistics of the transaction queue.
+ */
+void i2c_tools_resetLockStats(i2c_tools_bus_t *bus)
+{
+    memset(&bus->_lockStats, 0, sizeof(bus->_lockStats));
+}
+
+/**
+ * @brief Releases the lock level taken for a transaction, keeping it while the bus is held for a Restart (same as on the Pico).
+ *
+ * @param bus Pointer to the I2C bus handle.
+ */
+static void _endTransaction(i2c_tools_bus_t *bus)
+{
+    if (bus->_i2c->restart_on_next)
+    {
+        if (!bus->_heldForRestart)
+        {
+            bus->_heldForRestart = true;
+            return;
+        }
+    }
+    else if (bus->_heldForRestart)
+    {
+        bus->_heldForRestart = false;
+        i2c_tools_unlock(bus);
+    }
+
+    i2c_tools_unlock(bus);
+}
+
+#pragma endregion
+
+#pragma region Asynchronous transfer functions
+
+/**
+ * @brief Completes the in-flight transfer and invokes its callback.
+ *
+ * @param xfer The transfer to complete.
+ * @param result The error code of the transfer (0 on success).
+ */
+static void _finishTransfer(i2c_tools_xfer_t *xfer, uint8_t result)
+{
+    i2c_tools_bus_t *bus = xfer->bus;
+
+    // A successful transfer without a Stop keeps the bus, so the next one has to begin with a Restart.
+    bus->_i2c->restart_on_next = !result && !xfer->stopBit;
+
+    // Every transfer tells whether the target is there: it either acknowledged its address or not.
+    if (!result || (result == 2))
+    {
+        _setPresent(bus, xfer->addr, !result);
+    }
+
+    xfer->result = result;
+    xfer->state = result ? I2C_TOOLS_XFER_ERROR : I2C_TOOLS_XFER_DONE;
+    bus->_activeXfer = NULL;
+
+    if (xfer->callback)
+    {
+        xfer->callback(xfer, xfer->callbackArg);
+    }
+}
+
+/**
+ * @brief Starts an asynchronous transfer on the virtual bus.
+ *
+ * The device model answers at once (the received bytes are already in place), but the transfer is only reported
+ * as completed once the virtual clock has reached the end of its time on the wire.
+ *
+ * @param xfer The transfer handle, with bus, addr, stopBit, txLen, rxLen and rxBuf already filled in.
+ * @param data The bytes to write during the write phase (ignored if txLen is 0).
+ * @return True if the transfer has been started; False if it was rejected (see xfer->result).
+ */
+static bool _startTransfer(i2c_tools_xfer_t *xfer, const uint8_t *data)
+{
+    i2c_tools_bus_t *bus = xfer->bus;
+    size_t len = xfer->txLen + xfer->rxLen;
+
+    // Reject the transfer if I2C is not running (or in slave mode), the bus is busy, or the length does not fit in the command buffer.
+    if (!bus->_running || bus->_slave || bus->_activeXfer || !len || (len > WIRE_BUFFER_SIZE))
+    {
+        xfer->result = (len > WIRE_BUFFER_SIZE) ? 1 : 4;
+        xfer->state = I2C_TOOLS_XFER_ERROR;
+        return false;
+    }
+
+    _applyDeviceClock(bus, xfer->addr);
+
+    uint32_t durationUs;
+    bus->_xferResult = virtual_i2c_transfer(i2c_hw_index(bus->_i2c), xfer->addr, data, xfer->txLen, xfer->rxBuf, xfer->rxLen, xfer->stopBit, &durationUs);
+    bus->_xferEnd = time_us_64() + durationUs;
+    bus->_activeXfer = xfer;
+
+    xfer->deadline = time_us_64() + (uint64_t)bus->_timeout * 1000;
+    xfer->result = 0;
+    xfer->state = I2C_TOOLS_XFER_BUSY;
+
+    return true;
+}
+
+/**
+ * @brief Calls the idle callback, unless it is already running.
+ */
+static void _runIdleCallback(void)
+{
+    if (_idleCallback && !_inIdleCallback)
+    {
+        _inIdleCallback = true;
+        _idleCallback();
+        _inIdleCallback = false;
+    }
+}
+
+/**
+ * @brief Moves the virtual clock to the end of the in-flight transfer (or to its deadline, if that comes first).
+ *
+ * This is the time the CPU would spend waiting for the DMA on the Pico.
+ *
+ * @param bus Pointer to the I2C bus handle.
+ */
+static void _waitXferEnd(i2c_tools_bus_t *bus)
+{
+    i2c_tools_xfer_t *xfer = bus->_activeXfer;
+    uint64_t target = (bus->_xferEnd <= xfer->deadline) ? bus->_xferEnd : xfer->deadline + 1;
+    uint64_t now = time_us_64();
+
+    if (target > now)
+    {
+        host_clock_advance(target - now);
+    }
+}
+
+/**
+ * @brief Blocks until the bus is free.
+ *
+ * @param bus Pointer to the I2C bus handle.
+ */
+static void _waitBusIdle(i2c_tools_bus_t *bus)
+{
+    while (i2c_tools_poll(bus))
+    {
+        _runIdleCallback();
+        if (bus->_activeXfer)
+        {
+            _waitXferEnd(bus);
+        }
+    }
+}
+
+/**
+ * @brief Submits a non-blocking combined write-then-read transfer to the specified address.
+ */
+bool i2c_tools_writeReadAsync(i2c_tools_bus_t *bus, i2c_tools_xfer_t *xfer, uint8_t addr, const uint8_t *tx, size_t txLen, uint8_t *rx, size_t rxLen, bool stopBit, i2c_tools_xfer_cb_t callback, void *arg)
+{
+    xfer->bus = bus;
+    xfer->addr = addr;
+    xfer->stopBit = stopBit;
+    xfer->txLen = txLen;
+    xfer->rxLen = rxLen;
+    xfer->rxBuf = rx;
+    xfer->callback = callback;
+    xfer->callbackArg = arg;
+
+    return _startTransfer(xfer, tx);
+}
+
+/**
+ * @brief Submits a non-blocking write transfer to the specified address.
+ */
+bool i2c_tools_writeAsync(i2c_tools_bus_t *bus, i2c_tools_xfer_t *xfer, uint8_t addr, const uint8_t *data, size_t len, bool stopBit, i2c_tools_xfer_cb_t callback, void *arg)
+{
+    return i2c_tools_writeReadAsync(bus, xfer, addr, data, len, NULL, 0, stopBit, callback, arg);
+}
+
+/**
+ * @brief Submits a non-blocking read transfer from the specified address.
+ */
+bool i2c_tools_readAsync(i2c_tools_bus_t *bus, i2c_tools_xfer_t *xfer, uint8_t addr, uint8_t *data, size_t len, bool stopBit, i2c_tools_xfer_cb_t callback, void *arg)
+{
+    return i2c_tools_writeReadAsync(bus, xfer, addr, NULL, 0, data, len, stopBit, callback, arg);
+}
+
+/**
+ * @brief Drives the in-flight asynchronous transfer (if any), completing it once the virtual clock has reached its end.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @return True if a transfer is still in flight; False if the bus is idle.
+ */
+bool i2c_tools_poll(i2c_tools_bus_t *bus)
+{
+    i2c_tools_xfer_t *xfer = bus->_activeXfer;
+    if (!xfer)
+    {
+        return false;
+    }
+
+    uint64_t now = time_us_64();
+
+    // Over on the wire before its deadline.
+    if ((bus->_xferEnd <= xfer->deadline) && (now >= bus->_xferEnd))
+    {
+        _finishTransfer(xfer, bus->_xferResult);
+        return false;
+    }
+
+    // Still on the wire past its deadline (e.g. a large byte latency), aborted.
+    if (now > xfer->deadline)
+    {
+        _finishTransfer(xfer, 4);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Checks whether an asynchronous transfer has completed.
+ */
+bool i2c_tools_transferDone(i2c_tools_xfer_t *xfer)
+{
+    if (xfer->state != I2C_TOOLS_XFER_BUSY)
+    {
+        return true;
+    }
+
+    i2c_tools_poll(xfer->bus);
+
+    return xfer->state != I2C_TOOLS_XFER_BUSY;
+}
+
+/**
+ * @brief Blocks until an asynchronous transfer has completed, moving the virtual clock to its end.
+ */
+uint8_t i2c_tools_waitTransfer(i2c_tools_xfer_t *xfer)
+{
+    while (!i2c_tools_transferDone(xfer))
+    {
+        _runIdleCallback();
+        if (xfer->state == I2C_TOOLS_XFER_BUSY)
+        {
+            _waitXferEnd(xfer->bus);
+        }
+    }
+
+    return xfer->result;
+}
+
+/**
+ * @brief Registers a function to be called while the blocking functions are waiting for the bus.
+ */
+void i2c_tools_setIdleCallback(void (*idleCallback)(void))
+{
+    _idleCallback = idleCallback;
+}
+
+#pragma endregion
+
+#pragma region Bus recovery and retry functions
+
+/**
+ * @brief Clears a stuck bus: aborts the transfer in flight and accounts for the 9 clock pulses and the Stop.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @return 0 once the lines are released, 4 if I2C is not running.
+ */
+uint8_t i2c_tools_recoverBus(i2c_tools_bus_t *bus)
+{
+    if (!bus->_running || bus->_slave)
+    {
+        return 4;
+    }
+
+    i2c_tools_lock(bus);
+
+    if (bus->_activeXfer)
+    {
+        _finishTransfer(bus->_activeXfer, 4);
+    }
+
+    // 9 clock pulses and a Stop, at the current clock frequency.
+    host_clock_advance((uint64_t)11 * 1000000 / bus->_clkHz);
+
+    // The controller is reset, the pins are handed back to it.
+    _pm[bus->_sda] = INPUT_PULLUP;
+    _pm[bus->_scl] = INPUT_PULLUP;
+    bus->_i2c->restart_on_next = false;
+    virtual_i2c_setClock(i2c_hw_index(bus->_i2c), bus->_clkHz);
+    bus->_appliedHz = bus->_clkHz;
+
+    bus->_recoveries++;
+
+    _endTransaction(bus);
+
+    return 0;
+}
+
+/**
+ * @brief Sets the retry policy of the blocking transactions.
+ */
+void i2c_tools_setRetryPolicy(i2c_tools_bus_t *bus, uint8_t retries, uint32_t deadlineMs)
+{
+    bus->_retries = retries;
+    bus->_xferDeadlineMs = deadlineMs;
+}
+
+/**
+ * @brief Gets the number of failed transactions with the device at the specified address.
+ */
+uint16_t i2c_tools_getErrorCount(i2c_tools_bus_t *bus, uint8_t addr)
+{
+    return bus->_errCount[addr & 0x7F];
+}
+
+/**
+ * @brief Gets the number of times the bus has been recovered.
+ */
+uint32_t i2c_tools_getRecoveryCount(i2c_tools_bus_t *bus)
+{
+    return bus->_recoveries;
+}
+
+/**
+ * @brief Resets the per-address error counters of the bus.
+ */
+void i2c_tools_clearErrorCounts(i2c_tools_bus_t *bus)
+{
+    memset(bus->_errCount, 0, sizeof(bus->_errCount));
+}
+
+/**
+ * @brief Performs a blocking transaction, applying the retry policy of the bus (same policy as on the Pico).
+ */
+static uint8_t _transact(i2c_tools_bus_t *bus, uint8_t addr, const uint8_t *tx, size_t txLen, uint8_t *rx, size_t rxLen, bool stopBit)
+{
+    _waitBusIdle(bus);
+
+    uint64_t start = time_us_64();
+    uint64_t deadline = start + (uint64_t)bus->_xferDeadlineMs * 1000;
+
+    // A transaction continuing one that kept the bus (no Stop) cannot be replayed on its own.
+    bool canRetry = !bus->_i2c->restart_on_next;
+
+    uint8_t ret;
+    int attempt;
+    for (attempt = 0;; attempt++)
+    {
+        i2c_tools_xfer_t xfer;
+
+        if (i2c_tools_writeReadAsync(bus, &xfer, addr, tx, txLen, rx, rxLen, stopBit, NULL, NULL))
+        {
+            if (xfer.deadline > deadline)
+            {
+                xfer.deadline = deadline;
+            }
+            ret = i2c_tools_waitTransfer(&xfer);
+        }
+        else
+        {
+            ret = xfer.result;
+        }
+
+        if (!ret || (ret == 1) || !bus->_running)
+        {
+            break;
+        }
+
+        if (bus->_errCount[addr & 0x7F] < 0xFFFF)
+        {
+            bus->_errCount[addr & 0x7F]++;
+        }
+
+        if ((ret == 4) || !digitalRead(bus->_sda) || !digitalRead(bus->_scl))
+        {
+            i2c_tools_recoverBus(bus);
+        }
+
+        if (!canRetry || (attempt >= bus->_retries) || (time_us_64() >= deadline))
+        {
+            break;
+        }
+    }
+
+    uint8_t dir = (txLen && rxLen) ? I2C_TOOLS_TRACE_WRITE_READ : (rxLen ? I2C_TOOLS_TRACE_READ : I2C_TOOLS_TRACE_WRITE);
+    _traceRecord(bus, addr, dir, txLen + rxLen, start, ret, attempt + 1);
+
+    return ret;
+}
+
+#pragma endregion
+
+#pragma region I2C transmission functions
+
+/**
+ * @brief Starts a new transmission session to the specified address.
+ */
+void i2c_tools_beginTransmission(i2c_tools_bus_t *bus, uint8_t addr)
+{
+    i2c_tools_lock(bus);
+
+    if (!bus->_running || bus->_slave || bus->_txBegun)
+    {
+        i2c_tools_unlock(bus);
+        return;
+    }
+
+    bus->_addr = addr;
+    bus->_buffLen = 0;
+    bus->_buffOff = 0;
+    bus->_txBegun = true;
+}
+
+/**
+ * @brief Requests data from an I2C device with an optional stop bit.
+ */
+size_t i2c_tools_requestFrom_w_stopbit(i2c_tools_bus_t *bus, uint8_t address, size_t quantity, bool stopBit)
+{
+    i2c_tools_lock(bus);
+
+    if (!bus->_running || bus->_txBegun || !quantity || (quantity > sizeof(bus->_buff)))
+    {
+        i2c_tools_unlock(bus);
+        return 0;
+    }
+
+    bus->_buffLen = 0;
+    if (_transact(bus, address, NULL, 0, bus->_buff, quantity, stopBit) == 0)
+    {
+        bus->_buffLen = quantity;
+    }
+    bus->_buffOff = 0;
+
+    size_t ret = bus->_buffLen;
+    _endTransaction(bus);
+
+    return ret;
+}
+
+/**
+ * @brief Requests data from an I2C device with a stop bit.
+ */
+size_t i2c_tools_requestFrom(i2c_tools_bus_t *bus, uint8_t address, size_t quantity)
+{
+    return i2c_tools_requestFrom_w_stopbit(bus, address, quantity, true);
+}
+
+/**
+ * @brief Writes to then reads from an I2C device in a single transaction.
+ */
+uint8_t i2c_tools_write_read(i2c_tools_bus_t *bus, uint8_t addr, const uint8_t *tx, size_t txLen, uint8_t *rx, size_t rxLen)
+{
+    i2c_tools_lock(bus);
+
+    uint8_t ret = _transact(bus, addr, tx, txLen, rx, rxLen, true);
+
+    _endTransaction(bus);
+    return ret;
+}
+
+/**
+ * @brief Ends the transmission session, sending the buffered bytes (or probing the device for a zero-length write).
+ */
+uint8_t i2c_tools_endTransmission_w_stopbit(i2c_tools_bus_t *bus, bool stopBit)
+{
+    if (!bus->_running || !bus->_txBegun || !bus->_lockDepth)
+    {
+        return 4;
+    }
+
+    bus->_txBegun = false;
+
+    uint8_t ret;
+
+    if (!bus->_buffLen)
+    {
+        // Zero-length probe: bit-banged on the Pico, an address-only transaction on the virtual bus.
+        _waitBusIdle(bus);
+        uint64_t start = time_us_64();
+
+        _applyDeviceClock(bus, bus->_addr);
+
+        uint32_t durationUs;
+        ret = virtual_i2c_transfer(i2c_hw_index(bus->_i2c), bus->_addr, NULL, 0, NULL, 0, true, &durationUs);
+        host_clock_advance(durationUs);
+        ret = ret ? 2 : 0;
+        _setPresent(bus, bus->_addr, !ret);
+        _traceRecord(bus, bus->_addr, I2C_TOOLS_TRACE_PROBE, 0, start, ret, 1);
+    }
+    else
+    {
+        ret = _transact(bus, bus->_addr, bus->_buff, bus->_buffLen, NULL, 0, stopBit);
+        bus->_buffLen = 0;
+    }
+
+    _endTransaction(bus);
+
+    return ret;
+}
+
+/**
+ * @brief Sends the data in the internal buffer to the target device, followed by a Stop.
+ */
+uint8_t i2c_tools_endTransmission(i2c_tools_bus_t *bus)
+{
+    return i2c_tools_endTransmission_w_stopbit(bus, true);
+}
+
+/**
+ * @brief Adds a byte to the internal buffer of the transmission session.
+ */
+size_t i2c_tools_write(i2c_tools_bus_t *bus, uint8_t ucData)
+{
+    if (!bus->_running || bus->_slave || !bus->_txBegun || (bus->_buffLen == sizeof(bus->_buff)))
+    {
+        return 0;
+    }
+    bus->_buff[bus->_buffLen++] = ucData;
+    return 1;
+}
+
+/**
+ * @brief Adds multiple bytes to the internal buffer of the transmission session.
+ */
+size_t i2c_tools_write_w_quantity(i2c_tools_bus_t *bus, const uint8_t *data, size_t quantity)
+{
+    for (size_t i = 0; i < quantity; ++i)
+    {
+        if (!i2c_tools_write(bus, data[i]))
+        {
+            return i;
+        }
+    }
+    return quantity;
+}
+
+/**
+ * @brief Gets the number of bytes available for reading from the internal buffer.
+ */
+int i2c_tools_available(i2c_tools_bus_t *bus)
+{
+    return bus->_running ? bus->_buffLen - bus->_buffOff : 0;
+}
+
+/**
+ * @brief Reads a byte from the internal buffer, or -1 if no bytes are available (EOF).
+ */
+int i2c_tools_read(i2c_tools_bus_t *bus)
+{
+    if (i2c_tools_available(bus))
+    {
+        return bus->_buff[bus->_buffOff++];
+    }
+    return -1;
+}
+
+/**
+ * @brief Peeks at the next byte in the internal buffer, or -1 if no bytes are available (EOF).
+ */
+int i2c_tools_peek(i2c_tools_bus_t *bus)
+{
+    if (i2c_tools_available(bus))
+    {
+        return bus->_buff[bus->_buffOff];
+    }
+    return -1;
+}
+
+/**
+ * @brief Does nothing, use endTransmission to force data transfer.
+ */
+void i2c_tools_flush(i2c_tools_bus_t *bus)
+{
+}
+
+#pragma endregion
+
+#pragma region Bus scan functions
+
+/**
+ * @brief Records whether a device answered at the specified address.
+ */
+static void _setPresent(i2c_tools_bus_t *bus, uint8_t addr, bool present)
+{
+    uint32_t mask = 1u << (addr & 31);
+
+    bus->_probed[(addr >> 5) & 3] |= mask;
+    if (present)
+    {
+        bus->_present[(addr >> 5) & 3] |= mask;
+    }
+    else
+    {
+        bus->_present[(addr >> 5) & 3] &= ~mask;
+    }
+}
+
+/**
+ * @brief Probes an I2C device with a single byte read, as the hardware probe of the Pico does.
+ */
+static bool _hwProbe(i2c_tools_bus_t *bus, uint8_t addr)
+{
+    uint8_t dummy;
+    i2c_tools_xfer_t xfer;
+    bool ack = false;
+
+    i2c_tools_lock(bus);
+    _waitBusIdle(bus);
+
+    if (i2c_tools_readAsync(bus, &xfer, addr, &dummy, 1, true, NULL, NULL))
+    {
+        xfer.deadline = time_us_64() + I2C_TOOLS_SCAN_TIMEOUT_US;
+        ack = (i2c_tools_waitTransfer(&xfer) == 0);
+    }
+
+    _endTransaction(bus);
+    return ack;
+}
+
+/**
+ * @brief Scans the bus for devices (0x08 to 0x77), filling in the presence cache.
+ */
+int i2c_tools_scan(i2c_tools_bus_t *bus)
+{
+    if (!bus->_running)
+    {
+        return -1;
+    }
+
+    int found = 0;
+
+    i2c_tools_lock(bus);
+    for (uint8_t addr = 0x08; addr < 0x78; addr++)
+    {
+        if (_hwProbe(bus, addr))
+        {
+            found++;
+        }
+    }
+    i2c_tools_unlock(bus);
+
+    return found;
+}
+
+/**
+ * @brief Checks whether a device is present at the specified address (presence cache, probed once if unknown).
+ */
+bool i2c_tools_isPresent(i2c_tools_bus_t *bus, uint8_t addr)
+{
+    uint32_t mask = 1u << (addr & 31);
+
+    if (!(bus->_probed[(addr >> 5) & 3] & mask))
+    {
+        if (!bus->_running)
+        {
+            return false;
+        }
+        return _hwProbe(bus, addr);
+    }
+
+    return (bus->_present[(addr >> 5) & 3] & mask) != 0;
+}
+
+/**
+ * @brief Clears the presence cache of the bus.
+ */
+void i2c_tools_clearScanCache(i2c_tools_bus_t *bus)
+{
+    memset(bus->_probed, 0, sizeof(bus->_probed));
+    memset(bus->_present, 0, sizeof(bus->_present));
+}
+
+#pragma endregion
+
+#pragma region Transaction trace functions
+
+/**
+ * @brief Gets the histogram bucket of a transaction duration.
+ */
+static int _histBucket(uint32_t durationUs)
+{
+    // Bit length of the duration.
+    int bucket = durationUs ? (32 - __builtin_clz(durationUs)) : 0;
+    return (bucket < I2C_TOOLS_HIST_BUCKETS) ? bucket : (I2C_TOOLS_HIST_BUCKETS - 1);
+}
+
+/**
+ * @brief Records a completed blocking transaction in the trace ring and in the latency histogram of its device (same as on the Pico).
+ */
+static void _traceRecord(i2c_tools_bus_t *bus, uint8_t addr, uint8_t dir, size_t len, uint64_t start, uint8_t result, int attempts)
+{
+    uint32_t durationUs = (uint32_t)(time_us_64() - start);
+    uint32_t seq = bus->_traceHead + 1;
+    i2c_tools_trace_record_t *rec = &bus->_trace[bus->_traceHead & (I2C_TOOLS_TRACE_SIZE - 1)];
+
+    // Invalidate the slot, fill it in, then publish it.
+    rec->seq = 0;
+    __dmb();
+    rec->startUs = start;
+    rec->durationUs = durationUs;
+    rec->len = (uint16_t)len;
+    rec->addr = addr & 0x7F;
+    rec->dir = dir;
+    rec->result = result;
+    rec->attempts = (uint8_t)attempts;
+    __dmb();
+    rec->seq = seq;
+    bus->_traceHead = seq;
+    bus->_traceBusUs += durationUs;
+
+    // Look up the histogram of the device, or give it one if there is a free one left.
+    i2c_tools_latency_hist_t *hist = NULL;
+    for (int i = 0; i < bus->_histCount; i++)
+    {
+        if (bus->_hists[i].addr == (addr & 0x7F))
+        {
+            hist = &bus->_hists[i];
+            break;
+        }
+    }
+    if (!hist && (bus->_histCount < I2C_TOOLS_TRACE_DEVICES))
+    {
+        hist = &bus->_hists[bus->_histCount];
+        memset(hist, 0, sizeof(*hist));
+        hist->addr = addr & 0x7F;
+        __dmb();
+        bus->_histCount++;
+    }
+    if (!hist)
+    {
+        return;
+    }
+
+    hist->transactions++;
+    if (result)
+    {
+        hist->errors++;
+    }
+    hist->totalUs += durationUs;
+    if (durationUs > hist->maxUs)
+    {
+        hist->maxUs = durationUs;
+    }
+    hist->buckets[_histBucket(durationUs)]++;
+}
+
+/**
+ * @brief Copies the most recent blocking transactions from the trace ring of the bus.
+ */
+size_t i2c_tools_getTrace(i2c_tools_bus_t *bus, i2c_tools_trace_record_t *records, size_t maxRecords)
+{
+    uint32_t head = bus->_traceHead;
+    uint32_t count = (head < I2C_TOOLS_TRACE_SIZE) ? head : I2C_TOOLS_TRACE_SIZE;
+    if (count > maxRecords)
+    {
+        count = (uint32_t)maxRecords;
+    }
+
+    size_t copied = 0;
+    for (uint32_t i = head - count; i != head; i++)
+    {
+        const i2c_tools_trace_record_t *rec = &bus->_trace[i & (I2C_TOOLS_TRACE_SIZE - 1)];
+
+        // Copy the slot, and keep the copy only if the slot still holds the same transaction afterwards.
+        uint32_t seq = rec->seq;
+        __dmb();
+        records[copied] = *rec;
+        __dmb();
+        if ((seq == i + 1) && (rec->seq == seq))
+        {
+            records[copied].seq = seq;
+            copied++;
+        }
+    }
+
+    return copied;
+}
+
+/**
+ * @brief Gets the latency histograms of the devices addressed since the trace was last cleared.
+ */
+int i2c_tools_getLatencyHistograms(i2c_tools_bus_t *bus, i2c_tools_latency_hist_t *hists, int maxHists)
+{
+    int count = bus->_histCount;
+    if (count > maxHists)
+    {
+        count = maxHists;
+    }
+
+    __dmb();
+    for (int i = 0; i < count; i++)
+    {
+        hists[i] = bus->_hists[i];
+    }
+
+    return count;
+}
+
+/**
+ * @brief Clears the trace ring and the latency histograms of the bus, and starts a new trace window.
+ */
+void i2c_tools_clearTrace(i2c_tools_bus_t *bus)
+{
+    // Only the owner of the bus writes to the trace, so nothing is recorded while it is being cleared.
+    i2c_tools_lock(bus);
+    bus->_histCount = 0;
+    bus->_traceHead = 0;
+    memset(bus->_trace, 0, sizeof(bus->_trace));
+    bus->_traceBusUs = 0;
+    bus->_traceSince = time_us_64();
+    i2c_tools_unlock(bus);
+}
+
+/**
+ * @brief Prints the trace ring and the latency histograms of the bus over stdio.
+ */
+void i2c_tools_dumpTrace(i2c_tools_bus_t *bus)
+{
+    static const char *dirNames[] = {"W", "R", "WR", "PROBE"};
+    i2c_tools_trace_record_t records[I2C_TOOLS_TRACE_SIZE];
+    i2c_tools_latency_hist_t hists[I2C_TOOLS_TRACE_DEVICES];
+
+    size_t count = i2c_tools_getTrace(bus, records, I2C_TOOLS_TRACE_SIZE);
+    int histCount = i2c_tools_getLatencyHistograms(bus, hists, I2C_TOOLS_TRACE_DEVICES);
+
+    printf("I2C%u trace: %lu transactions in %llu us, %llu us on the bus\n",
+           i2c_hw_index(bus->_i2c), (unsigned long)bus->_traceHead,
+           (unsigned long long)(time_us_64() - bus->_traceSince), (unsigned long long)bus->_traceBusUs);
+
+    // Most recent transactions, oldest first.
+    printf("%8s %14s %8s %4s %5s %4s %3s %3s\n", "seq", "start_us", "dur_us", "addr", "dir", "len", "err", "try");
+    for (size_t i = 0; i < count; i++)
+    {
+        printf("%8lu %14llu %8lu 0x%02X %5s %4u %3u %3u\n",
+               (unsigned long)records[i].seq, (unsigned long long)records[i].startUs, (unsigned long)records[i].durationUs,
+               records[i].addr, dirNames[records[i].dir & 3], records[i].len, records[i].result, records[i].attempts);
+    }
+
+    // Latency histogram of each device, only the buckets that were hit.
+    for (int i = 0; i < histCount; i++)
+    {
+        printf("0x%02X: %lu transactions, %lu errors, %llu us on the bus, longest %lu us\n",
+               hists[i].addr, (unsigned long)hists[i].transactions, (unsigned long)hists[i].errors,
+               (unsigned long long)hists[i].totalUs, (unsigned long)hists[i].maxUs);
+        for (int b = 0; b < I2C_TOOLS_HIST_BUCKETS; b++)
+        {
+            if (hists[i].buckets[b])
+            {
+                printf("    %s%7lu us: %lu\n", (b == I2C_TOOLS_HIST_BUCKETS - 1) ? ">=" : " <",
+                       (b == I2C_TOOLS_HIST_BUCKETS - 1) ? (1ul << (b - 1)) : (1ul << b), (unsigned long)hists[i].buckets[b]);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Formats a summary of the trace window as a JSON object, e.g. to be published on a diagnostics topic.
+ */
+size_t i2c_tools_formatDiagnostics(i2c_tools_bus_t *bus, char *buf, size_t len)
+{
+    i2c_tools_latency_hist_t hists[I2C_TOOLS_TRACE_DEVICES];
+    int histCount = i2c_tools_getLatencyHistograms(bus, hists, I2C_TOOLS_TRACE_DEVICES);
+
+    int n = snprintf(buf, len, "{\"windowUs\":%llu,\"busUs\":%llu,\"dev\":[",
+                     (unsigned long long)(time_us_64() - bus->_traceSince), (unsigned long long)bus->_traceBusUs);
+
+    // Keep room for the closing "]}" and the null terminator.
+    if ((n < 0) || ((size_t)n + 3 > len))
+    {
+        if (len)
+        {
+            buf[0] = '\0';
+        }
+        return 0;
+    }
+    size_t pos = (size_t)n;
+
+    for (int i = 0; i < histCount; i++)
+    {
+        // Large enough for a device with every counter at its maximum.
+        char entry[320];
+        int m = snprintf(entry, sizeof(entry), "%s{\"addr\":%u,\"n\":%lu,\"err\":%lu,\"busUs\":%llu,\"maxUs\":%lu,\"hist\":[",
+                         i ? "," : "", hists[i].addr, (unsigned long)hists[i].transactions, (unsigned long)hists[i].errors,
+                         (unsigned long long)hists[i].totalUs, (unsigned long)hists[i].maxUs);
+        for (int b = 0; b < I2C_TOOLS_HIST_BUCKETS; b++)
+        {
+            m += snprintf(&entry[m], sizeof(entry) - m, "%s%lu", b ? "," : "", (unsigned long)hists[i].buckets[b]);
+        }
+        m += snprintf(&entry[m], sizeof(entry) - m, "]}");
+
+        // Leave out the devices that do not fit.
+        if (pos + m + 3 > len)
+        {
+            break;
+        }
+        memcpy(&buf[pos], entry, m);
+        pos += m;
+    }
+
+    memcpy(&buf[pos], "]}", 3);
+    return pos + 2;
+}
+
+#pragma endregion
+
+#pragma region Slave mode (register map) functions
+
+/**
+ * @brief Write hook of the device model of a bus in slave mode: the register pointer, then the writable registers.
+ */
+static uint8_t _slaveWrite(virtual_i2c_device_t *dev, const uint8_t *data, size_t len)
+{
+    i2c_tools_bus_t *bus = (i2c_tools_bus_t *)dev->model;
+    size_t written = 0;
+    uint8_t first = 0;
+
+    // A bare address (probe) is acknowledged, but is not a transaction of the register map.
+    if (!len)
+    {
+        return 0;
+    }
+
+    bus->_slavePtr = (data[0] < bus->_slaveSize) ? data[0] : bus->_slaveSize;
+    for (size_t i = 1; (i < len) && (bus->_slavePtr < bus->_slaveSize); i++)
+    {
+        // Only the writable registers are stored, the other bytes are acknowledged but dropped.
+        if ((bus->_slavePtr >= bus->_slaveWrFirst) && (bus->_slavePtr < bus->_slaveWrFirst + bus->_slaveWrCount))
+        {
+            if (!written)
+            {
+                first = (uint8_t)bus->_slavePtr;
+            }
+            bus->_slaveRegs[bus->_slavePtr] = data[i];
+            written++;
+        }
+        bus->_slavePtr++;
+    }
+    bus->_slaveXfers++;
+
+    if (written && bus->_slaveOnWrite)
+    {
+        bus->_slaveOnWrite(bus, first, written, bus->_slaveOnWriteArg);
+    }
+    return 0;
+}
+
+/**
+ * @brief Read hook of the device model of a bus in slave mode: the registers from the register pointer on.
+ */
+static uint8_t _slaveRead(virtual_i2c_device_t *dev, uint8_t *data, size_t len)
+{
+    i2c_tools_bus_t *bus = (i2c_tools_bus_t *)dev->model;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        data[i] = (bus->_slavePtr < bus->_slaveSize) ? bus->_slaveRegs[bus->_slavePtr++] : 0xFF;
+    }
+    bus->_slaveXfers++;
+    return 0;
+}
+
+/**
+ * @brief Initializes I2C communication in slave mode: the bus is attached to its virtual bus as a device model.
+ *
+ * @param bus Pointer to the I2C bus handle (returned by i2c_tools_init).
+ * @param addr The 7-bit I2C address the bus answers to.
+ */
+void i2c_tools_begin_w_address(i2c_tools_bus_t *bus, uint8_t addr)
+{
+    if (bus->_running)
+    {
+        return;
+    }
+
+    i2c_tools_lock(bus);
+
+    memset(&bus->_slaveDev, 0, sizeof(bus->_slaveDev));
+    bus->_slaveDev.name = "i2c_tools slave";
+    bus->_slaveDev.addr = addr;
+    bus->_slaveDev.onWrite = _slaveWrite;
+    bus->_slaveDev.onRead = _slaveRead;
+    bus->_slaveDev.model = bus;
+    virtual_i2c_attach(i2c_hw_index(bus->_i2c), &bus->_slaveDev);
+
+    bus->_slave = true;
+    bus->_slavePtr = 0;
+    bus->_slaveXfers = 0;
+
+    _pm[bus->_sda] = INPUT_PULLUP;
+    _pm[bus->_scl] = INPUT_PULLUP;
+    bus->_running = true;
+    bus->_txBegun = false;
+    bus->_buffLen = 0;
+
+    i2c_tools_unlock(bus);
+}
+
+/**
+ * @brief Sets the size of the register map and the registers the master is allowed to write.
+ */
+bool i2c_tools_setRegisterMap(i2c_tools_bus_t *bus, uint16_t size, uint8_t writableFirst, uint16_t writableCount)
+{
+    if (!size || (size > I2C_TOOLS_SLAVE_REGS) || (writableCount && ((uint32_t)writableFirst + writableCount > size)))
+    {
+        return false;
+    }
+
+    bus->_slaveSize = size;
+    bus->_slaveWrFirst = writableFirst;
+    bus->_slaveWrCount = writableCount;
+    if (bus->_slavePtr > size)
+    {
+        bus->_slavePtr = size;
+    }
+    return true;
+}
+
+/**
+ * @brief Updates registers of the register map (a master read is never interleaved with it on the host).
+ */
+bool i2c_tools_setRegisters(i2c_tools_bus_t *bus, uint8_t reg, const void *data, size_t len)
+{
+    if ((size_t)reg + len > bus->_slaveSize)
+    {
+        return false;
+    }
+    memcpy(&bus->_slaveRegs[reg], data, len);
+    return true;
+}
+
+/**
+ * @brief Reads registers of the register map.
+ */
+bool i2c_tools_getRegisters(i2c_tools_bus_t *bus, uint8_t reg, void *data, size_t len)
+{
+    if ((size_t)reg + len > bus->_slaveSize)
+    {
+        return false;
+    }
+    memcpy(data, &bus->_slaveRegs[reg], len);
+    return true;
+}
+
+/**
+ * @brief Sets the function called when the master has written to the register map.
+ */
+void i2c_tools_onRegisterWrite(i2c_tools_bus_t *bus, i2c_tools_reg_write_cb_t callback, void *arg)
+{
+    bus->_slaveOnWrite = callback;
+    bus->_slaveOnWriteArg = arg;
+}
+
+/**
+ * @brief Gets the number of master transactions served by the bus in slave mode.
+ */
+uint32_t i2c_tools_getSlaveTransactions(i2c_tools_bus_t *bus)
+{
+    return bus->_slaveXfers;
+}
+
+#pragma endregion
+
+#pragma region miscllaneous functions
+
+/**
+ * @brief Converts a 32-bit hexadecimal number to ASCII representation and prints it.
+ */
+void hexToAscii(uint32_t n)
+{
+    printf("%c%c%c%c%c%c%c%c\n",
+           '0' + ((n) >> 28 & 0xF),
+           '0' + ((n) >> 24 & 0xF),
+           '0' + ((n) >> 20 & 0xF),
+           '0' + ((n) >> 16 & 0xF),
+           '0' + ((n) >> 12 & 0xF),
+           '0' + ((n) >> 8 & 0xF),
+           '0' + ((n) >> 4 & 0xF),
+           '0' + ((n) & 0xF));
+}
+
+#pragma endregion
@@ -0,0 +1,42 @@
+/** @file flash.h
+ *
+ * @brief Host (Linux) stand-in for hardware/flash.h, backed by the RAM flash image of virtual_flash.h.
+ *
+ * XIP_BASE points at the image, so the code reading the flash through the XIP window runs unmodified.
+ */
+
+#pragma once
+#ifndef _HOST_HARDWARE_FLASH_H_
+#define _HOST_HARDWARE_FLASH_H_
+
+#include <pico/stdlib.h>
+
+// Same geometry as the flash of the Pico W.
+#define FLASH_PAGE_SIZE (1u << 8)
+#define FLASH_SECTOR_SIZE (1u << 12)
+#define PICO_FLASH_SIZE_BYTES (2 * 1024 * 1024)
+
+// RAM image of the whole flash (see virtual_flash.h).
+extern uint8_t virtual_flash_image[PICO_FLASH_SIZE_BYTES];
+
+// Start of the flash in the address space (the XIP window on the Pico).
+#define XIP_BASE ((uintptr_t)virtual_flash_image)
+
+/**
+ * @brief Erases whole sectors of the flash image (sets them to 0xFF).
+ *
+ * @param flash_offs The offset of the first sector from the start of the flash (multiple of FLASH_SECTOR_SIZE).
+ * @param count The number of bytes to erase (multiple of FLASH_SECTOR_SIZE).
+ */
+void flash_range_erase(uint32_t flash_offs, size_t count);
+
+/**
+ * @brief Programs whole pages of the flash image (can only clear bits, like the real flash).
+ *
+ * @param flash_offs The offset of the first page from the start of the flash (multiple of FLASH_PAGE_SIZE).
+ * @param data The data to program.
+ * @param count The number of bytes to program (multiple of FLASH_PAGE_SIZE).
+ */
+void flash_range_program(uint32_t flash_offs, const uint8_t *data, size_t count);
+
+#endif // _HOST_HARDWARE_FLASH_H_
@@ -0,0 +1,40 @@
+/** @file i2c.h
+ *
+ * @brief Host (Linux) stand-in for hardware/i2c.h, only the I2C instances are needed by i2c_tools.h.
+ *
+ * The instances do not drive any hardware, the host i2c_tools routes their transactions to the virtual I2C bus (virtual_i2c.h).
+ */
+
+#pragma once
+#ifndef _HOST_HARDWARE_I2C_H_
+#define _HOST_HARDWARE_I2C_H_
+
+#include <pico/stdlib.h>
+
+// Number of I2C controllers of the RP2040.
+#define NUM_I2CS 2
+
+/**
+ * @brief I2C instance, one per (virtual) controller.
+ */
+typedef struct i2c_inst
+{
+    uint index;           // Index of the controller (0 or 1).
+    bool restart_on_next; // True if the previous transfer kept the bus (no Stop), same meaning as on the Pico SDK.
+} i2c_inst_t;
+
+extern i2c_inst_t i2c0_inst;
+extern i2c_inst_t i2c1_inst;
+
+#define i2c0 (&i2c0_inst)
+#define i2c1 (&i2c1_inst)
+
+/**
+ * @brief Returns the index of the I2C instance (0 or 1).
+ */
+static inline uint i2c_hw_index(i2c_inst_t *i2c)
+{
+    return i2c->index;
+}
+
+#endif
@@ -0,0 +1,24 @@
+/** @file rosc.h
+ *
+ * @brief Host (Linux) stand-in for the registers of the ring oscillator (hardware/structs/rosc.h), read for random bits.
+ */
+
+#pragma once
+#ifndef _HOST_HARDWARE_STRUCTS_ROSC_H_
+#define _HOST_HARDWARE_STRUCTS_ROSC_H_
+
+#include <stdint.h>
+
+/**
+ * @brief The registers of the ring oscillator (only the random bit).
+ */
+typedef struct
+{
+    uint32_t randombit; // Random bit (fixed on the host, see pico_host.c)
+} rosc_hw_t;
+
+extern rosc_hw_t host_rosc;
+
+#define rosc_hw (&host_rosc)
+
+#endif // _HOST_HARDWARE_STRUCTS_ROSC_H_
@@ -0,0 +1,37 @@
+/** @file sync.h
+ *
+ * @brief Host (Linux) stand-in for the memory barrier of hardware/sync.h used by i2c_tools,
+ * and the interrupt masking used by flash_log around flash writes.
+ */
+
+#pragma once
+#ifndef _HOST_HARDWARE_SYNC_H_
+#define _HOST_HARDWARE_SYNC_H_
+
+#include <stdint.h>
+
+/**
+ * @brief Full memory barrier (the DMB instruction on the Pico).
+ */
+static inline void __dmb(void)
+{
+    __sync_synchronize();
+}
+
+/**
+ * @brief Does nothing on the host, there are no interrupts to mask.
+ */
+static inline uint32_t save_and_disable_interrupts(void)
+{
+    return 0;
+}
+
+/**
+ * @brief Does nothing on the host, there are no interrupts to mask.
+ */
+static inline void restore_interrupts(uint32_t status)
+{
+    (void)status;
+}
+
+#endif // _HOST_HARDWARE_SYNC_H_
@@ -0,0 +1,23 @@
+/** @file mqtt_priv.h
+ *
+ * @brief Host (Linux) stand-in for the private state of the lwIP MQTT client (lwip/apps/mqtt_priv.h).
+ *
+ * Only the fields read by the MQTT library, kept up to date by the virtual broker (see virtual_mqtt.h).
+ */
+
+#pragma once
+#ifndef _HOST_LWIP_APPS_MQTT_PRIV_H_
+#define _HOST_LWIP_APPS_MQTT_PRIV_H_
+
+#include "lwip/apps/mqtt.h"
+
+/**
+ * @brief State of a client.
+ */
+struct mqtt_client_s
+{
+    u16_t keep_alive; // Keepalive interval, in seconds
+    u8_t conn_state;  // 0: TCP disconnected, 1: TCP connecting, 2: MQTT connecting, 3: MQTT connected
+};
+
+#endif // _HOST_LWIP_APPS_MQTT_PRIV_H_
@@ -0,0 +1,24 @@
+/** @file dns.h
+ *
+ * @brief Host (Linux) stand-in for the DNS client of lwIP (lwip/dns.h): every name resolves to the virtual broker (see virtual_mqtt.h).
+ */
+
+#pragma once
+#ifndef _HOST_LWIP_DNS_H_
+#define _HOST_LWIP_DNS_H_
+
+#include "lwip/ip_addr.h"
+
+/**
+ * @brief Function called once a query is over (never on the host, the address is always known straight away).
+ */
+typedef void (*dns_found_callback)(const char *name, const ip_addr_t *ipaddr, void *callback_arg);
+
+/**
+ * @brief Resolves a name.
+ *
+ * @return ERR_OK, with addr set to the address of the virtual broker.
+ */
+err_t dns_gethostbyname(const char *hostname, ip_addr_t *addr, dns_found_callback found, void *callback_arg);
+
+#endif // _HOST_LWIP_DNS_H_
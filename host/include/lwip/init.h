@@ -0,0 +1,14 @@
+/** @file init.h
+ *
+ * @brief Host (Linux) stand-in for the version of lwIP (lwip/init.h), the one shipped with the Pico SDK.
+ */
+
+#pragma once
+#ifndef _HOST_LWIP_INIT_H_
+#define _HOST_LWIP_INIT_H_
+
+#define LWIP_VERSION_MAJOR 2
+#define LWIP_VERSION_MINOR 1
+#define LWIP_VERSION_REVISION 3
+
+#endif // _HOST_LWIP_INIT_H_
@@ -0,0 +1,25 @@
+/** @file ip_addr.h
+ *
+ * @brief Host (Linux) stand-in for the IPv4 addresses of lwIP (lwip/ip_addr.h).
+ */
+
+#pragma once
+#ifndef _HOST_LWIP_IP_ADDR_H_
+#define _HOST_LWIP_IP_ADDR_H_
+
+#include "lwip/err.h"
+
+/**
+ * @brief An IPv4 address, in network byte order.
+ */
+typedef struct
+{
+    u32_t addr;
+} ip_addr_t;
+
+/**
+ * @brief Formats an address as "a.b.c.d", in a static buffer.
+ */
+char *ip4addr_ntoa(const ip_addr_t *addr);
+
+#endif // _HOST_LWIP_IP_ADDR_H_
@@ -0,0 +1,13 @@
+/** @file pbuf.h
+ *
+ * @brief Host (Linux) stand-in for lwip/pbuf.h: the MQTT library only needs the types it brings in.
+ */
+
+#pragma once
+#ifndef _HOST_LWIP_PBUF_H_
+#define _HOST_LWIP_PBUF_H_
+
+#include "lwip/err.h"
+#include "lwip/ip_addr.h"
+
+#endif // _HOST_LWIP_PBUF_H_
@@ -0,0 +1,13 @@
+/** @file tcp.h
+ *
+ * @brief Host (Linux) stand-in for lwip/tcp.h: the MQTT library only needs the types it brings in.
+ */
+
+#pragma once
+#ifndef _HOST_LWIP_TCP_H_
+#define _HOST_LWIP_TCP_H_
+
+#include "lwip/err.h"
+#include "lwip/ip_addr.h"
+
+#endif // _HOST_LWIP_TCP_H_
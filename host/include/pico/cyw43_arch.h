@@ -0,0 +1,71 @@
+/** @file cyw43_arch.h
+ *
+ * @brief Host (Linux) stand-in for the Wi-Fi chip of the Pico W (pico/cyw43_arch.h), in polling mode.
+ *
+ * The link is up as soon as joined, and cyw43_arch_poll hands the packets of the virtual broker that are due to lwIP
+ * (see virtual_mqtt.h), as the real one does in polling mode.
+ */
+
+#pragma once
+#ifndef _HOST_PICO_CYW43_ARCH_H_
+#define _HOST_PICO_CYW43_ARCH_H_
+
+#include <pico/stdlib.h>
+#include "lwip/ip_addr.h"
+
+#define CYW43_COUNTRY_SINGAPORE 0
+#define CYW43_AUTH_WPA2_AES_PSK 0x00400004
+#define CYW43_ITF_STA 0
+
+#define CYW43_LINK_DOWN 0
+#define CYW43_LINK_JOIN 1
+#define CYW43_LINK_NOIP 2
+#define CYW43_LINK_UP 3
+#define CYW43_LINK_FAIL -1
+#define CYW43_LINK_NONET -2
+#define CYW43_LINK_BADAUTH -3
+
+/**
+ * @brief A network interface (only its address).
+ */
+struct netif
+{
+    ip_addr_t ip_addr;
+};
+
+/**
+ * @brief State of the Wi-Fi chip (only its interface).
+ */
+typedef struct
+{
+    struct netif netif[1];
+} cyw43_t;
+
+extern cyw43_t cyw43_state;
+
+int cyw43_arch_init_with_country(uint32_t country);
+void cyw43_arch_enable_sta_mode(void);
+int cyw43_arch_wifi_connect_async(const char *ssid, const char *pw, uint32_t auth);
+int cyw43_tcpip_link_status(cyw43_t *self, int itf);
+int cyw43_wifi_get_rssi(cyw43_t *self, int32_t *rssi);
+
+/**
+ * @brief Hands the packets of the virtual broker that are due to lwIP, and calls the callbacks they complete.
+ */
+void cyw43_arch_poll(void);
+
+/**
+ * @brief Does nothing on the host, lwIP only runs from cyw43_arch_poll.
+ */
+static inline void cyw43_arch_lwip_begin(void)
+{
+}
+
+/**
+ * @brief Does nothing on the host, lwIP only runs from cyw43_arch_poll.
+ */
+static inline void cyw43_arch_lwip_end(void)
+{
+}
+
+#endif // _HOST_PICO_CYW43_ARCH_H_
@@ -0,0 +1,100 @@
+/** @file stdlib.h
+ *
+ * @brief Host (Linux) stand-in for the few pico/stdlib.h functions used by the sensor drivers.
+ *
+ * Time is virtual: sleep_us/sleep_ms/busy_wait_ms advance the clock returned by time_us_64 instead of blocking,
+ * and the virtual I2C bus advances it by the time each transaction would take on the wire.
+ * This keeps the host runs fast and deterministic, while still accounting for every delay the drivers ask for.
+ * The repeating timers fire as the virtual clock goes past their time (e.g. during a sleep_ms), at that exact time.
+ */
+
+#pragma once
+#ifndef _HOST_PICO_STDLIB_H_
+#define _HOST_PICO_STDLIB_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef unsigned int uint;
+
+// Generic error code of the pico-sdk functions (pico/error.h).
+#define PICO_ERROR_GENERIC (-1)
+
+// Same default pins as the Pico W board definition.
+#define PICO_DEFAULT_I2C_SDA_PIN 4
+#define PICO_DEFAULT_I2C_SCL_PIN 5
+
+/**
+ * @brief Returns the virtual time since boot, in microseconds.
+ */
+uint64_t time_us_64(void);
+
+/**
+ * @brief Advances the virtual clock by the given number of microseconds.
+ */
+void sleep_us(uint64_t us);
+
+/**
+ * @brief Advances the virtual clock by the given number of milliseconds.
+ */
+void sleep_ms(uint32_t ms);
+
+/**
+ * @brief Advances the virtual clock by the given number of microseconds (same as sleep_us on the host).
+ */
+void busy_wait_us(uint64_t us);
+
+/**
+ * @brief Advances the virtual clock by the given number of milliseconds (same as sleep_ms on the host).
+ */
+void busy_wait_ms(uint32_t ms);
+
+typedef struct repeating_timer repeating_timer_t;
+
+/**
+ * @brief Function called at every tick of a repeating timer, returns false to stop the timer.
+ */
+typedef bool (*repeating_timer_callback_t)(repeating_timer_t *rt);
+
+/**
+ * @brief A repeating timer (same fields as the pico-sdk uses).
+ */
+struct repeating_timer
+{
+    int64_t delay_us;                    // Time between the ticks (negative: from start to start, the same on the host)
+    uint64_t next_us;                    // Virtual time of the next tick
+    repeating_timer_callback_t callback; // Function called at every tick
+    void *user_data;                     // Argument of the function, as is
+    bool active;                         // The timer is running
+};
+
+/**
+ * @brief Starts a repeating timer, fired by the virtual clock (see host_clock_advance).
+ *
+ * @return False if too many timers are running.
+ */
+bool add_repeating_timer_us(int64_t delay_us, repeating_timer_callback_t callback, void *user_data, repeating_timer_t *out);
+
+/**
+ * @brief Stops a repeating timer.
+ *
+ * @return True if the timer was running.
+ */
+bool cancel_repeating_timer(repeating_timer_t *timer);
+
+/**
+ * @brief Does nothing on the host, stdio is always available.
+ */
+bool stdio_init_all(void);
+
+/**
+ * @brief Does nothing on the host.
+ */
+static inline void tight_loop_contents(void)
+{
+}
+
+#endif
@@ -0,0 +1,545 @@
+/** @file json_bench.c
+ *
+ * @brief Host bench of the JSON writer (lib/json).
+ * Brief overview of the code:
+ * 1. Numbers: the integers, fixed-point numbers and floats are written as printf writes them ("%lld", "%llu", "%.<n>f"),
+ *    floats included, over edge cases, ties and a sweep of random values.
+ * 2. Text: the commas of nested objects and arrays, the escaping of strings, and raw values.
+ * 3. Overflow: a message written into a buffer of each size up to its length never goes past the end,
+ *    is always null terminated, and is reported as such.
+ * 4. Samples: the messages of the apps (samples, DIAG, LOG) are the same as the snprintf ones they replace.
+ * 5. Cost: for each sample, prints the host CPU time to build it with snprintf, with the strcat builder the apps
+ *    used to carry (publishSensorDataFormatToJson), and with the writer.
+ *
+ * The bench exits with a non-zero status if any check fails.
+ *
+ * Usage: json_bench
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "json_writer.h"
+
+// Number of messages built to time each way.
+#define BENCH_ROUNDS 100000
+
+// Number of random floats checked against printf, for each number of decimals.
+#define BENCH_FLOATS 200000
+
+// Size of the message buffers (the MQTT_BUFF_SIZE of the apps).
+#define BENCH_BUFF_SIZE 1025
+
+static bool _ok = true;
+
+/**
+ * @brief Prints a failed check.
+ */
+static void _fail(const char *check, const char *expected, const char *got)
+{
+    printf("FAIL %s: expected %s, got %s\n", check, expected, got);
+    _ok = false;
+}
+
+/**
+ * @brief Gets the host CPU time, in nanoseconds.
+ */
+static uint64_t _cpuNs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+/**
+ * @brief Checks the text of a writer against the expected one.
+ */
+static bool _checkText(const char *check, const json_writer_t *writer, const char *expected)
+{
+    if (!json_isOk(writer) || (strcmp(writer->buffer, expected) != 0) || (json_getLength(writer) != strlen(expected)))
+    {
+        _fail(check, expected, json_isOk(writer) ? writer->buffer : "(overflow)");
+        return false;
+    }
+    return true;
+}
+
+#pragma region Numbers
+
+/**
+ * @brief Checks a float against printf, with the given number of decimals.
+ */
+static bool _checkFloat(float value, uint8_t decimals)
+{
+    char buffer[64];
+    char expected[64];
+    json_writer_t writer;
+
+    json_begin(&writer, buffer, sizeof(buffer));
+    json_putFloat(&writer, value, decimals);
+    snprintf(expected, sizeof(expected), "%.*f", decimals, value);
+    if (!_checkText("float", &writer, expected))
+    {
+        printf("     %.9g with %u decimals\n", value, decimals);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Checks the numbers against printf.
+ */
+static void _checkNumbers(void)
+{
+    char buffer[64];
+    char expected[64];
+    json_writer_t writer;
+    static const int64_t ints[] = {0, 1, -1, 9, 10, -10, 65535, 2147483647, -2147483648LL, 4294967295LL, 4294967296LL,
+                                   -4294967296LL, 999999999999LL, INT64_MAX, INT64_MIN};
+    static const uint64_t uints[] = {0, 7, 4294967295u, 4294967296u, 18446744073709551615u};
+
+    for (size_t i = 0; i < sizeof(ints) / sizeof(ints[0]); i++)
+    {
+        json_begin(&writer, buffer, sizeof(buffer));
+        json_putInt(&writer, ints[i]);
+        snprintf(expected, sizeof(expected), "%lld", (long long)ints[i]);
+        _checkText("int", &writer, expected);
+    }
+    for (size_t i = 0; i < sizeof(uints) / sizeof(uints[0]); i++)
+    {
+        json_begin(&writer, buffer, sizeof(buffer));
+        json_putUint(&writer, uints[i]);
+        snprintf(expected, sizeof(expected), "%llu", (unsigned long long)uints[i]);
+        _checkText("uint", &writer, expected);
+    }
+
+    // Fixed-point: all the decimals, and a digit before the point
+    static const struct
+    {
+        int64_t value;
+        uint8_t decimals;
+        const char *text;
+    } fixed[] = {
+        {1234, 2, "12.34"},
+        {-5, 2, "-0.05"},
+        {0, 3, "0.000"},
+        {7, 0, "7"},
+        {100, 2, "1.00"},
+        {-123456789, 9, "-0.123456789"},
+        {INT64_MIN, 2, "-92233720368547758.08"},
+        {42, 12, "0.000000042"}, // Clamped to JSON_WRITER_MAX_DECIMALS
+    };
+    for (size_t i = 0; i < sizeof(fixed) / sizeof(fixed[0]); i++)
+    {
+        json_begin(&writer, buffer, sizeof(buffer));
+        json_putFixed(&writer, fixed[i].value, fixed[i].decimals);
+        _checkText("fixed", &writer, fixed[i].text);
+    }
+
+    // Floats: edge cases and ties (printf rounds the exact value, ties to even)
+    static const float floats[] = {0.0f, -0.0f, 0.5f, 1.5f, 2.5f, -2.5f, 0.125f, 0.375f, -0.001f, 0.005f, 1.005f,
+                                   2.675f, 7.2f, 16.105915f, 23.53f, 31.790001f, 99.995f, 1e-10f, 123456.7f, 16777216.0f,
+                                   1e10f, -3.4e9f, 9.2e18f, 9.1e18f};
+    for (size_t i = 0; i < sizeof(floats) / sizeof(floats[0]); i++)
+    {
+        for (uint8_t decimals = 0; decimals <= JSON_WRITER_MAX_DECIMALS; decimals++)
+        {
+            if (fabs((double)floats[i] * pow(10, decimals)) < 9.2e18)
+            {
+                _checkFloat(floats[i], decimals);
+            }
+        }
+    }
+
+    // Floats: random values of the magnitudes of the sensors, until the first mismatch of each number of decimals
+    srand(2004);
+    for (uint8_t decimals = 0; decimals <= 4; decimals++)
+    {
+        for (int i = 0; i < BENCH_FLOATS; i++)
+        {
+            float value = ((float)rand() / RAND_MAX - 0.5f) * powf(10, rand() % 8);
+            if (!_checkFloat(value, decimals))
+            {
+                break;
+            }
+        }
+    }
+
+    // Floats that have no fixed-point text
+    static const float nulls[] = {NAN, INFINITY, -INFINITY, 1e30f};
+    for (size_t i = 0; i < sizeof(nulls) / sizeof(nulls[0]); i++)
+    {
+        json_begin(&writer, buffer, sizeof(buffer));
+        json_putFloat(&writer, nulls[i], 2);
+        _checkText("float as null", &writer, "null");
+    }
+}
+
+#pragma endregion
+
+#pragma region Text
+
+/**
+ * @brief Writes the I2C diagnostics the way i2c_tools_formatDiagnostics does (snprintf, returns 0 if it does not fit).
+ */
+static size_t _formatDiagnostics(char *buf, size_t len)
+{
+    int n = snprintf(buf, len, "{\"windowUs\":%llu,\"busUs\":%llu,\"dev\":[]}", 30000000ULL, 2250ULL);
+    return ((n < 0) || ((size_t)n >= len)) ? 0 : (size_t)n;
+}
+
+/**
+ * @brief Checks the commas, the nesting, the escaping and the raw values.
+ */
+static void _checkStructure(void)
+{
+    char buffer[256];
+    json_writer_t writer;
+    size_t room;
+
+    json_begin(&writer, buffer, sizeof(buffer));
+    json_openObject(&writer);
+    json_closeObject(&writer);
+    _checkText("empty object", &writer, "{}");
+
+    json_begin(&writer, buffer, sizeof(buffer));
+    json_openObject(&writer);
+    json_fieldInt(&writer, "a", 1);
+    json_key(&writer, "b");
+    json_openArray(&writer);
+    json_putInt(&writer, 1);
+    json_openArray(&writer);
+    json_closeArray(&writer);
+    json_openObject(&writer);
+    json_fieldString(&writer, "c", "d");
+    json_closeObject(&writer);
+    json_putBool(&writer, true);
+    json_putBool(&writer, false);
+    json_putNull(&writer);
+    json_closeArray(&writer);
+    json_key(&writer, "e");
+    json_openObject(&writer);
+    json_closeObject(&writer);
+    json_fieldFloat(&writer, "f", 1.5f, 1);
+    json_closeObject(&writer);
+    _checkText("nesting", &writer, "{\"a\":1,\"b\":[1,[],{\"c\":\"d\"},true,false,null],\"e\":{},\"f\":1.5}");
+
+    json_begin(&writer, buffer, sizeof(buffer));
+    json_putString(&writer, "say \"hi\"\\\n\t\x01 end/é");
+    _checkText("escaping", &writer, "\"say \\\"hi\\\"\\\\\\u000a\\u0009\\u0001 end/é\"");
+
+    json_begin(&writer, buffer, sizeof(buffer));
+    json_openArray(&writer);
+    json_putRaw(&writer, "{\"x\":1}", 7);
+    json_putRaw(&writer, "2", 1);
+    char *raw = json_beginRaw(&writer, &room);
+    json_endRaw(&writer, _formatDiagnostics(raw, room));
+    json_closeArray(&writer);
+    _checkText("raw", &writer, "[{\"x\":1},2,{\"windowUs\":30000000,\"busUs\":2250,\"dev\":[]}]");
+
+    // Unbalanced or too deep
+    json_begin(&writer, buffer, sizeof(buffer));
+    json_closeObject(&writer);
+    if (json_isOk(&writer))
+    {
+        _fail("unbalanced", "overflow", buffer);
+    }
+    json_begin(&writer, buffer, sizeof(buffer));
+    for (int i = 0; i <= JSON_WRITER_MAX_DEPTH; i++)
+    {
+        json_openArray(&writer);
+    }
+    if (json_isOk(&writer))
+    {
+        _fail("too deep", "overflow", buffer);
+    }
+}
+
+#pragma endregion
+
+#pragma region Samples
+
+/**
+ * @brief A message of an app, built with snprintf (as before) and with the writer (as now).
+ */
+typedef struct
+{
+    const char *name;
+    void (*snprintfMessage)(char *buffer, size_t size);
+    void (*writeMessage)(json_writer_t *writer, char *buffer, size_t size);
+} bench_sample_t;
+
+// Values of the samples (the ones of the CBOR bench)
+static const uint16_t _channels[10] = {1523, 2211, 3004, 4321, 5150, 6011, 7342, 8023, 61234, 802};
+static const uint16_t _fsRaw = 1875;
+static const float _fsMetersPerSec = 7.2f;
+static const float _fsMilesPerHour = 16.105915f;
+static const float _mlxAmbient = 23.53f;
+static const float _mlxObject = 31.790001f;
+static const uint16_t _scdCo2 = 812;
+static const int32_t _scdTemperature = 23450;
+static const int32_t _scdHumidity = 48210;
+static const uint16_t _hubCmPerSec = 1234;
+static const float _fanRpm = 1187.5f;
+static const char _replayed[] = "{\"CO2\":812,\"Temperature\":23450,\"Humidity\":48210}";
+
+static void _as7341Snprintf(char *buffer, size_t size)
+{
+    snprintf(buffer, size, "{\"F1\":%d,\"F2\":%d,\"F3\":%d,\"F4\":%d,\"F5\":%d,\"F6\":%d,\"F7\":%d,\"F8\":%d,\"Visible\":%d,\"NIR\":%d}",
+             _channels[0], _channels[1], _channels[2], _channels[3], _channels[4],
+             _channels[5], _channels[6], _channels[7], _channels[8], _channels[9]);
+}
+
+static void _as7341Write(json_writer_t *writer, char *buffer, size_t size)
+{
+    static const char *const keys[10] = {"F1", "F2", "F3", "F4", "F5", "F6", "F7", "F8", "Visible", "NIR"};
+
+    json_begin(writer, buffer, size);
+    json_openObject(writer);
+    for (int i = 0; i < 10; i++)
+    {
+        json_fieldUint(writer, keys[i], _channels[i]);
+    }
+    json_closeObject(writer);
+}
+
+static void _fs3000Snprintf(char *buffer, size_t size)
+{
+    snprintf(buffer, size, "{\"RAW\":%d,\"metersPerSec\":%.2f,\"milesPerHour\":%.2f}", _fsRaw, _fsMetersPerSec, _fsMilesPerHour);
+}
+
+static void _fs3000Write(json_writer_t *writer, char *buffer, size_t size)
+{
+    json_begin(writer, buffer, size);
+    json_openObject(writer);
+    json_fieldUint(writer, "RAW", _fsRaw);
+    json_fieldFloat(writer, "metersPerSec", _fsMetersPerSec, 2);
+    json_fieldFloat(writer, "milesPerHour", _fsMilesPerHour, 2);
+    json_closeObject(writer);
+}
+
+static void _mlx90614Snprintf(char *buffer, size_t size)
+{
+    snprintf(buffer, size, "{\"ambientTemp\":%.2f,\"objectTemp\":%.2f}", _mlxAmbient, _mlxObject);
+}
+
+static void _mlx90614Write(json_writer_t *writer, char *buffer, size_t size)
+{
+    json_begin(writer, buffer, size);
+    json_openObject(writer);
+    json_fieldFloat(writer, "ambientTemp", _mlxAmbient, 2);
+    json_fieldFloat(writer, "objectTemp", _mlxObject, 2);
+    json_closeObject(writer);
+}
+
+static void _scd41Snprintf(char *buffer, size_t size)
+{
+    snprintf(buffer, size, "{\"CO2\":%u,\"Temperature\":%d,\"Humidity\":%d}", _scdCo2, _scdTemperature, _scdHumidity);
+}
+
+static void _scd41Write(json_writer_t *writer, char *buffer, size_t size)
+{
+    json_begin(writer, buffer, size);
+    json_openObject(writer);
+    json_fieldUint(writer, "CO2", _scdCo2);
+    json_fieldInt(writer, "Temperature", _scdTemperature);
+    json_fieldInt(writer, "Humidity", _scdHumidity);
+    json_closeObject(writer);
+}
+
+static void _hubSnprintf(char *buffer, size_t size)
+{
+    snprintf(buffer, size, "{\"SEQ\":%d,\"RAW\":%d,\"metersPerSec\":%.2f}", 17, _fsRaw, _hubCmPerSec / 100.0f);
+}
+
+static void _hubWrite(json_writer_t *writer, char *buffer, size_t size)
+{
+    json_begin(writer, buffer, size);
+    json_openObject(writer);
+    json_fieldUint(writer, "SEQ", 17);
+    json_fieldUint(writer, "RAW", _fsRaw);
+    json_fieldFixed(writer, "metersPerSec", _hubCmPerSec, 2);
+    json_closeObject(writer);
+}
+
+static void _fanSnprintf(char *buffer, size_t size)
+{
+    snprintf(buffer, size, "{\"RPM\":%.2f,\"DUTYCYCLE\":%d,\"DUTYCYCLE_OVERRIDE\":%d}", _fanRpm, 40, -1);
+}
+
+static void _fanWrite(json_writer_t *writer, char *buffer, size_t size)
+{
+    json_begin(writer, buffer, size);
+    json_openObject(writer);
+    json_fieldFloat(writer, "RPM", _fanRpm, 2);
+    json_fieldInt(writer, "DUTYCYCLE", 40);
+    json_fieldInt(writer, "DUTYCYCLE_OVERRIDE", -1);
+    json_closeObject(writer);
+}
+
+static void _diagSnprintf(char *buffer, size_t size)
+{
+    char i2cJson[BENCH_BUFF_SIZE - 64];
+
+    _formatDiagnostics(i2cJson, sizeof(i2cJson));
+    snprintf(buffer, size, "{\"sensorReadUs\":%llu,\"i2c\":%s,\"rssi\":%ld,\"pingRttUs\":%lu}", 2250ULL, i2cJson, -61L, 18250UL);
+}
+
+static void _diagWrite(json_writer_t *writer, char *buffer, size_t size)
+{
+    size_t room;
+
+    json_begin(writer, buffer, size);
+    json_openObject(writer);
+    json_fieldUint(writer, "sensorReadUs", 2250);
+    json_key(writer, "i2c");
+    char *i2cJson = json_beginRaw(writer, &room);
+    json_endRaw(writer, _formatDiagnostics(i2cJson, room));
+    json_fieldInt(writer, "rssi", -61);
+    json_fieldUint(writer, "pingRttUs", 18250);
+    json_closeObject(writer);
+}
+
+static void _replaySnprintf(char *buffer, size_t size)
+{
+    snprintf(buffer, size, "{\"boot\":%u,\"ms\":%lu,\"data\":%.*s}", 3, 123456UL, (int)strlen(_replayed), _replayed);
+}
+
+static void _replayWrite(json_writer_t *writer, char *buffer, size_t size)
+{
+    json_begin(writer, buffer, size);
+    json_openObject(writer);
+    json_fieldUint(writer, "boot", 3);
+    json_fieldUint(writer, "ms", 123456);
+    json_key(writer, "data");
+    json_putRaw(writer, _replayed, strlen(_replayed));
+    json_closeObject(writer);
+}
+
+static const bench_sample_t _samples[] = {
+    {"AS7341", _as7341Snprintf, _as7341Write},
+    {"FS3000", _fs3000Snprintf, _fs3000Write},
+    {"MLX90614", _mlx90614Snprintf, _mlx90614Write},
+    {"SCD41", _scd41Snprintf, _scd41Write},
+    {"NODE", _hubSnprintf, _hubWrite},
+    {"NFA4X10", _fanSnprintf, _fanWrite},
+    {"DIAG", _diagSnprintf, _diagWrite},
+    {"LOG", _replaySnprintf, _replayWrite},
+};
+
+/**
+ * @brief The strcat builder the apps used to carry (publishSensorDataFormatToJson), without the publishing.
+ */
+static void _strcatBuilder(char *jsonMessage, char *valueNames[], char *sensorValues[], size_t numValues)
+{
+    snprintf(jsonMessage, BENCH_BUFF_SIZE, "{");
+    for (size_t i = 0; i < numValues; ++i)
+    {
+        strcat(jsonMessage, "\"");
+        strcat(jsonMessage, valueNames[i]);
+        strcat(jsonMessage, "\":\"");
+        strcat(jsonMessage, sensorValues[i]);
+        strcat(jsonMessage, "\"");
+        if (i < numValues - 1)
+        {
+            strcat(jsonMessage, ",");
+        }
+    }
+    strcat(jsonMessage, "}");
+}
+
+/**
+ * @brief Builds the AS7341 sample with the strcat builder (the values formatted first, as its callers had to).
+ */
+static void _as7341Strcat(char *buffer, size_t size)
+{
+    static char *keys[10] = {"F1", "F2", "F3", "F4", "F5", "F6", "F7", "F8", "Visible", "NIR"};
+    char values[10][8];
+    char *valuePointers[10];
+
+    for (int i = 0; i < 10; i++)
+    {
+        snprintf(values[i], sizeof(values[i]), "%d", _channels[i]);
+        valuePointers[i] = values[i];
+    }
+    _strcatBuilder(buffer, keys, valuePointers, 10);
+    (void)size;
+}
+
+/**
+ * @brief Checks the messages of the apps against the snprintf ones, in buffers of every size, and times them.
+ */
+static void _checkSamples(void)
+{
+    static char expected[BENCH_BUFF_SIZE];
+    static char buffer[BENCH_BUFF_SIZE + 1];
+    json_writer_t writer;
+
+    printf("%-9s %5s %12s %12s %12s\n", "message", "bytes", "snprintf ns", "strcat ns", "writer ns");
+    for (size_t s = 0; s < sizeof(_samples) / sizeof(_samples[0]); s++)
+    {
+        const bench_sample_t *sample = &_samples[s];
+
+        sample->snprintfMessage(expected, sizeof(expected));
+        sample->writeMessage(&writer, buffer, BENCH_BUFF_SIZE);
+        _checkText(sample->name, &writer, expected);
+
+        // Every buffer too small is reported, and never written past its end
+        size_t len = strlen(expected);
+        for (size_t size = 0; size <= len + 1; size++)
+        {
+            memset(buffer, '#', sizeof(buffer));
+            sample->writeMessage(&writer, buffer, size);
+            bool fits = (size > len);
+            if ((json_isOk(&writer) != fits) || (buffer[size] != '#') || ((size > 0) && (strlen(buffer) >= size)) ||
+                (strncmp(buffer, expected, json_getLength(&writer)) != 0))
+            {
+                char what[64];
+                snprintf(what, sizeof(what), "buffer of %zu bytes", size);
+                _fail(sample->name, what, json_isOk(&writer) ? "ok" : "overflow");
+                break;
+            }
+        }
+
+        // Cost of each way
+        uint64_t start = _cpuNs();
+        for (int i = 0; i < BENCH_ROUNDS; i++)
+        {
+            sample->snprintfMessage(buffer, BENCH_BUFF_SIZE);
+        }
+        uint64_t snprintfNs = (_cpuNs() - start) / BENCH_ROUNDS;
+
+        char strcatNs[16] = "-";
+        if (sample->writeMessage == _as7341Write)
+        {
+            start = _cpuNs();
+            for (int i = 0; i < BENCH_ROUNDS; i++)
+            {
+                _as7341Strcat(buffer, BENCH_BUFF_SIZE);
+            }
+            snprintf(strcatNs, sizeof(strcatNs), "%llu", (unsigned long long)((_cpuNs() - start) / BENCH_ROUNDS));
+        }
+
+        start = _cpuNs();
+        for (int i = 0; i < BENCH_ROUNDS; i++)
+        {
+            sample->writeMessage(&writer, buffer, BENCH_BUFF_SIZE);
+        }
+        uint64_t writerNs = (_cpuNs() - start) / BENCH_ROUNDS;
+
+        printf("%-9s %5zu %12llu %12s %12llu\n", sample->name, len, (unsigned long long)snprintfNs, strcatNs, (unsigned long long)writerNs);
+    }
+}
+
+#pragma endregion
+
+int main(void)
+{
+    _checkNumbers();
+    _checkStructure();
+    _checkSamples();
+    printf("%s\n", _ok ? "PASS" : "FAIL");
+    return _ok ? 0 : 1;
+}
@@ -0,0 +1,581 @@
+/** @file mqtt_bench.c
+ *
+ * @brief Host bench of the MQTT library (lib/mqtt_client/mqtt_Rebuilt.c), run against the virtual broker (virtual_mqtt.h).
+ * Brief overview of the code:
+ * 1. Outbound queue: a reservation (mqtt_outbox_reserve, as for the DIAG reports and the replayed samples) never drops
+ *    the messages queued, even when its bound is far above the message committed, and gives the unused room back on commit.
+ *    Queuing a copy (mqtt_outbox_enqueue) still drops the oldest messages of a full queue.
+ * 2. Delivery: once connected, every message kept in the queue reaches the broker, in order and intact.
+ * 3. Liveness: the ping round trip is the one of the link (sent to <client id>/ping and back), a main loop stalled past
+ *    the deadline of a ping does not end the session, a broker that stops answering does, and a refused connection is
+ *    reported as such by the connection callback of lwIP. The pings never reach the inbox of the app.
+ * 4. Router: a `+` matches exactly one level, up to the last level a filter can have, and a filter with more levels is refused.
+ *
+ * The bench exits with a non-zero status if any check fails.
+ *
+ * Usage: mqtt_bench
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <pico/stdlib.h>
+#include <pico/cyw43_arch.h>
+#include "lwip/apps/mqtt.h"
+#include "virtual_mqtt.h"
+#include "mqtt_Rebuilt.h"
+
+// Length of a sample, about the size of a JSON sample of the apps.
+#define BENCH_SAMPLE_LEN 100
+
+// Length of a DIAG report, and the bound the apps reserve for it.
+#define BENCH_DIAG_LEN 300
+#define BENCH_DIAG_MAX_LEN 1023
+
+// Most samples the bench queues (more than the arena holds).
+#define BENCH_MAX_SAMPLES 64
+
+// Time given to the connection, in ms.
+#define BENCH_CONNECT_MS 30000
+
+#define BENCH_SAMPLE_TOPIC "bench/SAMPLE"
+#define BENCH_DIAG_TOPIC "bench/DIAG"
+#define BENCH_LATEST_TOPIC "bench/LATEST"
+#define BENCH_PING_TOPIC "bench/ping"
+
+// Latencies of the link the ping round trip is checked at, each way, in us.
+#define BENCH_LATENCY_US 5000
+#define BENCH_SLOW_LATENCY_US 40000
+
+// Time the main loop stalls with a ping on its way, in ms (past the deadline of the ping).
+#define BENCH_STALL_MS (MQTT_LIVENESS_PING_TIMEOUT_MS + 5000)
+
+static bool _ok = true;
+
+// Number of the next sample queued.
+static uint32_t _nextSample = 0;
+
+// Messages handed to the inbox of the app.
+static uint8_t _inboxArena[256];
+static uint32_t _inboxCount = 0;
+
+// Why the latest session ended, and when (NULL: still up).
+static const char *_lostReason = NULL;
+static uint64_t _lostUs = 0;
+
+/**
+ * @brief Prints a failed check.
+ */
+static void _fail(const char *check, const char *what)
+{
+    printf("FAIL %s: %s\n", check, what);
+    _ok = false;
+}
+
+/**
+ * @brief Gets the number of messages dropped from the outbound queue since boot.
+ */
+static uint32_t _dropped(void)
+{
+    mqtt_outbox_stats_t stats;
+    mqtt_outbox_get_stats(&stats);
+    return stats.dropped;
+}
+
+/**
+ * @brief Writes sample n, BENCH_SAMPLE_LEN characters.
+ */
+static void _formatSample(char *buffer, uint32_t n)
+{
+    int len = snprintf(buffer, BENCH_SAMPLE_LEN + 1, "{\"n\":%u,\"pad\":\"", (unsigned)n);
+    memset(buffer + len, 'x', BENCH_SAMPLE_LEN - len - 2);
+    strcpy(buffer + BENCH_SAMPLE_LEN - 2, "\"}");
+}
+
+/**
+ * @brief Queues the next sample.
+ *
+ * @return The number of messages dropped to make room for it.
+ */
+static uint32_t _queueSample(void)
+{
+    char sample[BENCH_SAMPLE_LEN + 1];
+    uint32_t dropped = _dropped();
+
+    _formatSample(sample, _nextSample++);
+    if (mqtt_outbox_enqueue(BENCH_SAMPLE_TOPIC, sample) != ERR_OK)
+    {
+        _fail("enqueue", "sample refused");
+    }
+    return _dropped() - dropped;
+}
+
+/**
+ * @brief Queues samples until the queue is full (the next one drops the oldest).
+ *
+ * @return The number of samples queued.
+ */
+static uint32_t _fillQueue(void)
+{
+    uint32_t queued = 0;
+    while ((_queueSample() == 0) && (queued < BENCH_MAX_SAMPLES))
+    {
+        queued++;
+    }
+    return queued;
+}
+
+/**
+ * @brief Writes a DIAG report of BENCH_DIAG_LEN characters where the app would, in the room reserved for it.
+ *
+ * @param max_len The bound of the reservation.
+ * @return True if the report has been queued, False if nothing was reserved.
+ */
+static bool _reserveDiag(u16_t max_len)
+{
+    char *message = mqtt_outbox_reserve(BENCH_DIAG_TOPIC, max_len);
+    if (message == NULL)
+    {
+        return false;
+    }
+    memset(message, 'd', BENCH_DIAG_LEN);
+    if (mqtt_outbox_commit(BENCH_DIAG_LEN) != ERR_OK)
+    {
+        _fail("commit", "refused");
+    }
+    return true;
+}
+
+/**
+ * @brief Message callback of the inbox.
+ */
+static void _onMessage(const char *topic, const u8_t *payload, u32_t len, void *arg)
+{
+    (void)topic;
+    (void)payload;
+    (void)len;
+    (void)arg;
+    _inboxCount++;
+}
+
+/**
+ * @brief Disconnected callback of the connection.
+ */
+static void _onDisconnected(const char *reason, void *arg)
+{
+    (void)arg;
+    _lostReason = reason;
+    _lostUs = time_us_64();
+}
+
+/**
+ * @brief Runs one pass of the main loop of an app: connection, outbound queue, Wi-Fi.
+ */
+static void _loop(void)
+{
+    mqtt_conn_poll();
+    mqtt_outbox_poll();
+    cyw43_arch_poll();
+    sleep_ms(1);
+}
+
+/**
+ * @brief Runs the main loop of an app for the given time, or until the session ends.
+ */
+static void _run(uint32_t ms)
+{
+    uint64_t end = time_us_64() + (uint64_t)ms * 1000;
+    while ((time_us_64() < end) && (_lostReason == NULL))
+    {
+        _loop();
+    }
+}
+
+/**
+ * @brief Checks if the broker got a ping since the last virtual_mqtt_clearPublished.
+ */
+static bool _pingSent(void)
+{
+    for (uint32_t i = 0; i < virtual_mqtt_getPublishedCount(); i++)
+    {
+        const uint8_t *payload;
+        uint16_t len;
+        const char *topic = virtual_mqtt_getPublished(i, &payload, &len);
+        if ((topic != NULL) && !strcmp(topic, BENCH_PING_TOPIC))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Runs the main loop of an app until the queue is empty and nothing is in flight.
+ */
+static void _drain(void)
+{
+    uint64_t deadline = time_us_64() + (uint64_t)BENCH_CONNECT_MS * 1000;
+    while (((mqtt_conn_get_state() != MQTT_CONN_SUBSCRIBED) || mqtt_outbox_count() || mqtt_get_inflight_count()) &&
+           (time_us_64() < deadline))
+    {
+        _loop();
+    }
+    if (mqtt_outbox_count() || mqtt_get_inflight_count())
+    {
+        _fail("drain", "messages left in the queue");
+    }
+}
+
+/**
+ * @brief Checks the messages the broker got: the samples from first to last, in order, with the DIAG reports after the given samples.
+ *
+ * @param first The number of the first sample.
+ * @param last The number of the last sample.
+ * @param diagAfter The number of the sample each DIAG report follows (UINT32_MAX: no report).
+ */
+static void _checkPublished(uint32_t first, uint32_t last, uint32_t diagAfter)
+{
+    char expected[BENCH_SAMPLE_LEN + 1];
+    uint32_t n = first;
+    bool diag = (diagAfter == UINT32_MAX);
+
+    for (uint32_t i = 0; i < virtual_mqtt_getPublishedCount(); i++)
+    {
+        const uint8_t *payload;
+        uint16_t len;
+        const char *topic = virtual_mqtt_getPublished(i, &payload, &len);
+
+        if (!strcmp(topic, BENCH_DIAG_TOPIC))
+        {
+            if (diag || (n != diagAfter + 1) || (len != BENCH_DIAG_LEN) || (payload[0] != 'd') || (payload[len - 1] != 'd'))
+            {
+                _fail("delivery", "DIAG report out of place or damaged");
+            }
+            diag = true;
+        }
+        else if (!strcmp(topic, BENCH_SAMPLE_TOPIC))
+        {
+            _formatSample(expected, n);
+            if ((n > last) || (len != BENCH_SAMPLE_LEN) || memcmp(payload, expected, len))
+            {
+                printf("  sample %u: %.*s\n", (unsigned)n, (int)len, (const char *)payload);
+                _fail("delivery", "sample out of order or damaged");
+                return;
+            }
+            n++;
+        }
+    }
+    if ((n != last + 1) || !diag)
+    {
+        _fail("delivery", "messages missing");
+    }
+}
+
+#pragma region Outbound queue
+
+/**
+ * @brief A reservation never drops the messages queued, and only takes the room of what is committed.
+ */
+static void _checkReserve(void)
+{
+    // A full queue: the reservation of a DIAG report (bound of 1023 bytes for 300 written) is refused,
+    // rather than dropping about a quarter of the samples for room it gives back on commit.
+    uint32_t first = _nextSample;
+    uint32_t queued = _fillQueue();
+    first++; // The last sample queued pushed the oldest out
+    uint32_t count = mqtt_outbox_count();
+    uint32_t dropped = _dropped();
+    if (_reserveDiag(BENCH_DIAG_MAX_LEN))
+    {
+        _fail("reserve", "full queue gave room");
+    }
+    if ((_dropped() != dropped) || (mqtt_outbox_count() != count))
+    {
+        _fail("reserve", "messages dropped for a reservation");
+    }
+    // Same for the replay of a sample (its length plus 64 bytes of wrapping).
+    if (mqtt_outbox_reserve(BENCH_DIAG_TOPIC, BENCH_SAMPLE_LEN + 64) != NULL)
+    {
+        _fail("reserve", "full queue gave room for a replay");
+        mqtt_outbox_cancel();
+    }
+    if ((_dropped() != dropped) || (mqtt_outbox_count() != count))
+    {
+        _fail("reserve", "messages dropped for a replay");
+    }
+    virtual_mqtt_clearPublished();
+    _drain();
+    _checkPublished(first, _nextSample - 1, UINT32_MAX);
+    printf("Full queue: %u samples kept, DIAG refused without dropping any\n", (unsigned)queued);
+
+    // Half a queue: the DIAG report is reserved, and once committed takes no more room than queued as a copy.
+    // Queued as a copy, then reserved, the samples that still fit after it are the same number.
+    uint32_t fits[2];
+    for (int reserved = 0; reserved < 2; reserved++)
+    {
+        char diag[BENCH_DIAG_LEN + 1];
+        memset(diag, 'd', BENCH_DIAG_LEN);
+        diag[BENCH_DIAG_LEN] = '\0';
+
+        first = _nextSample;
+        for (uint32_t i = 0; i < queued / 2; i++)
+        {
+            _queueSample();
+        }
+        dropped = _dropped();
+        if (reserved ? !_reserveDiag(BENCH_DIAG_MAX_LEN) : (mqtt_outbox_enqueue(BENCH_DIAG_TOPIC, diag) != ERR_OK))
+        {
+            _fail("reserve", "no room in half a queue");
+        }
+        if (_dropped() != dropped)
+        {
+            _fail("reserve", "messages dropped for a DIAG report with room for it");
+        }
+        uint32_t diagAfter = _nextSample - 1;
+        fits[reserved] = _fillQueue();
+
+        virtual_mqtt_clearPublished();
+        _drain();
+        _checkPublished(first + 1, _nextSample - 1, diagAfter);
+    }
+    if (fits[0] != fits[1])
+    {
+        _fail("reserve", "unused room not given back on commit");
+    }
+    printf("Half a queue: DIAG reserved, %u samples fit after it (%u after a copy)\n", (unsigned)fits[1], (unsigned)fits[0]);
+}
+
+/**
+ * @brief A reservation that is refused leaves the messages of a KEEP_LATEST topic alone.
+ */
+static void _checkReservePolicy(void)
+{
+    uint32_t count;
+    bool latest = false;
+
+    // Behind a sample, so the one dropped by the full queue is the sample.
+    mqtt_outbox_set_policy(BENCH_LATEST_TOPIC, OUTBOX_KEEP_LATEST);
+    _queueSample();
+    mqtt_outbox_enqueue(BENCH_LATEST_TOPIC, "{\"latest\":1}");
+    _fillQueue();
+    count = mqtt_outbox_count();
+    if (mqtt_outbox_reserve(BENCH_LATEST_TOPIC, BENCH_DIAG_MAX_LEN) != NULL)
+    {
+        _fail("policy", "full queue gave room");
+        mqtt_outbox_cancel();
+    }
+    if (mqtt_outbox_count() != count)
+    {
+        _fail("policy", "refused reservation superseded the latest value");
+    }
+
+    virtual_mqtt_clearPublished();
+    _drain();
+    for (uint32_t i = 0; i < virtual_mqtt_getPublishedCount(); i++)
+    {
+        const uint8_t *payload;
+        uint16_t len;
+        latest |= !strcmp(virtual_mqtt_getPublished(i, &payload, &len), BENCH_LATEST_TOPIC);
+    }
+    if (!latest)
+    {
+        _fail("policy", "latest value not sent");
+    }
+}
+
+#pragma endregion
+
+#pragma region Router
+
+// Messages handed to the handler of the router.
+static uint32_t _routedCount = 0;
+
+/**
+ * @brief Handler of the router.
+ */
+static void _onRouted(const char *topic, const u8_t *payload, u32_t len, void *arg)
+{
+    (void)topic;
+    (void)payload;
+    (void)len;
+    (void)arg;
+    _routedCount++;
+}
+
+/**
+ * @brief Hands a message to the router.
+ *
+ * @return True if the handler got it.
+ */
+static bool _route(const char *topic)
+{
+    uint32_t count = _routedCount;
+    mqtt_router_dispatch(topic, (const u8_t *)"", 0, NULL);
+    return _routedCount != count;
+}
+
+/**
+ * @brief A `+` on the last level a filter can have matches one level, one past it is refused (not taken for a `#`).
+ */
+static void _checkRouterLevels(void)
+{
+    if (mqtt_router_add("r/1/2/3/4/5/6/7/+", _onRouted, NULL) != ERR_ARG)
+    {
+        _fail("router", "`+` past the last level accepted");
+    }
+    if (_route("r/1/2/3/4/5/6/7/x") || _route("r/1/2/3/4/5/6/7/x/y"))
+    {
+        _fail("router", "refused filter matched");
+    }
+    if (mqtt_router_add("r/1/2/3/4/5/6/+", _onRouted, NULL) != ERR_OK)
+    {
+        _fail("router", "`+` on the last level refused");
+    }
+    if (!_route("r/1/2/3/4/5/6/x") || _route("r/1/2/3/4/5/6/x/y") || _route("r/1/2/3/4/5/6"))
+    {
+        _fail("router", "`+` on the last level does not match exactly one level");
+    }
+}
+
+#pragma endregion
+
+#pragma region Liveness
+
+/**
+ * @brief Waits for the next ping to come back, and checks its round trip is the one of the link.
+ *
+ * @param latencyUs The latency of the link, each way.
+ */
+static void _checkPingRtt(uint32_t latencyUs)
+{
+    mqtt_liveness_t before;
+    mqtt_liveness_t after;
+
+    virtual_mqtt_setLatency(latencyUs);
+    mqtt_get_liveness(&before);
+    _run(MQTT_LIVENESS_PING_INTERVAL_MS + 1000);
+    mqtt_get_liveness(&after);
+
+    if (after.pings <= before.pings)
+    {
+        _fail("ping", "no ping back");
+    }
+    // Sent and received on a pass of the main loop, one pass (1 ms) at most after the link delivered it.
+    else if ((after.ping_rtt_us < 2 * latencyUs) || (after.ping_rtt_us > 2 * latencyUs + 1000))
+    {
+        _fail("ping", "round trip is not the one of the link");
+    }
+    printf("Latency %u us each way: ping round trip %u us\n", (unsigned)latencyUs, (unsigned)after.ping_rtt_us);
+}
+
+/**
+ * @brief The main loop stalling past the deadline of a ping on its way does not end the session.
+ */
+static void _checkPollGap(void)
+{
+    mqtt_liveness_t before;
+    mqtt_liveness_t after;
+
+    virtual_mqtt_clearPublished();
+    while (!_pingSent() && (_lostReason == NULL))
+    {
+        _loop();
+    }
+    mqtt_get_liveness(&before);
+    sleep_ms(BENCH_STALL_MS);
+    _run(1000);
+    mqtt_get_liveness(&after);
+
+    if (_lostReason != NULL)
+    {
+        _fail("poll gap", "session ended by a stalled main loop");
+    }
+    if ((after.pings != before.pings + 1) || (after.ping_rtt_us < (uint32_t)BENCH_STALL_MS * 1000))
+    {
+        _fail("poll gap", "ping back not counted after the stall");
+    }
+    printf("Main loop stalled %u ms: session kept, ping round trip %u us\n", (unsigned)BENCH_STALL_MS, (unsigned)after.ping_rtt_us);
+}
+
+/**
+ * @brief A broker that stops answering ends the session, once a ping is past its deadline.
+ */
+static void _checkPingTimeout(void)
+{
+    uint64_t silentUs = time_us_64();
+    mqtt_liveness_t liveness;
+
+    virtual_mqtt_setSilent(true);
+    _run(MQTT_LIVENESS_PING_INTERVAL_MS + MQTT_LIVENESS_PING_TIMEOUT_MS + 1000);
+    mqtt_get_liveness(&liveness);
+    virtual_mqtt_setSilent(false);
+
+    if ((_lostReason == NULL) || strcmp(_lostReason, "no answer to the ping"))
+    {
+        _fail("timeout", "session not ended by the lost ping");
+        return;
+    }
+    if ((_lostUs - silentUs < (uint64_t)MQTT_LIVENESS_PING_TIMEOUT_MS * 1000) || liveness.connected)
+    {
+        _fail("timeout", "session ended before the deadline of the ping");
+    }
+    printf("Broker silent: session ended after %u ms (%s)\n", (unsigned)((_lostUs - silentUs) / 1000), _lostReason);
+}
+
+/**
+ * @brief A connection refused by the broker fails at the CONNECT stage, then the next one accepted gets back to a session.
+ */
+static void _checkRefused(void)
+{
+    mqtt_conn_stats_t before;
+    mqtt_conn_stats_t after;
+    uint64_t deadline = time_us_64() + (uint64_t)BENCH_CONNECT_MS * 1000;
+
+    mqtt_conn_get_stats(&before);
+    virtual_mqtt_setConnackStatus(MQTT_CONNECT_REFUSED_NOT_AUTHORIZED_);
+    do
+    {
+        _loop();
+        mqtt_conn_get_stats(&after);
+    } while ((after.failures[MQTT_CONN_CONNECT] == before.failures[MQTT_CONN_CONNECT]) && (time_us_64() < deadline));
+
+    if ((after.failures[MQTT_CONN_CONNECT] != before.failures[MQTT_CONN_CONNECT] + 1) || (after.connected != before.connected))
+    {
+        _fail("refused", "refusal not seen at the CONNECT stage");
+    }
+
+    virtual_mqtt_setConnackStatus(MQTT_CONNECT_ACCEPTED);
+    _lostReason = NULL;
+    _drain();
+    if (mqtt_conn_get_state() != MQTT_CONN_SUBSCRIBED)
+    {
+        _fail("refused", "no session once accepted again");
+    }
+}
+
+#pragma endregion
+
+int main(void)
+{
+    set_mqtt_config("broker", 1883, "bench", "user", "pass", 0, 1, 60, "bench/status", "OFFLINE", 1, 1);
+    mqtt_client_init();
+    mqtt_inbox_set_message_callback(_inboxArena, sizeof(_inboxArena), _onMessage, NULL);
+    mqtt_conn_set_disconnected_callback(_onDisconnected, NULL);
+
+    _checkReserve();
+    _checkReservePolicy();
+    _checkRouterLevels();
+
+    _checkPingRtt(BENCH_LATENCY_US);
+    _checkPingRtt(BENCH_SLOW_LATENCY_US);
+    _checkPollGap();
+    virtual_mqtt_setLatency(BENCH_LATENCY_US);
+    _checkPingTimeout();
+    _checkRefused();
+    _checkPingRtt(BENCH_LATENCY_US);
+    if (_inboxCount != 0)
+    {
+        _fail("inbox", "pings handed to the app");
+    }
+    printf("%s\n", _ok ? "PASS" : "FAIL");
+    return _ok ? 0 : 1;
+}
@@ -0,0 +1,175 @@
+/** @file pico_host.c
+ *
+ * @brief This file contains the host (Linux) implementation of the pico SDK functions declared in include/pico and include/hardware.
+ *
+ * The clock is virtual: nothing ever blocks, every delay asked for by a driver (and every transaction on the virtual bus)
+ * moves the clock forward instead, so the host runs are fast and give the same timings on every machine.
+ */
+
+#include <pico/stdlib.h>
+#include <hardware/i2c.h>
+#include <hardware/structs/rosc.h>
+#include "virtual_i2c.h"
+
+// The two I2C controllers of the RP2040.
+i2c_inst_t i2c0_inst = {0, false};
+i2c_inst_t i2c1_inst = {1, false};
+
+// The ring oscillator, its random bit always set so the runs are the same every time.
+rosc_hw_t host_rosc = {1};
+
+// Virtual time since boot, in microseconds.
+static uint64_t _nowUs;
+
+// Most repeating timers running at once.
+#define HOST_MAX_TIMERS 4
+
+// Repeating timers running, fired by host_clock_advance.
+static repeating_timer_t *_timers[HOST_MAX_TIMERS];
+
+#pragma region Virtual clock
+
+/**
+ * @brief Advances the virtual clock (see time_us_64), firing the repeating timers due on the way, in order, at their own time.
+ *
+ * @param us The number of microseconds to advance the clock by.
+ */
+void host_clock_advance(uint64_t us)
+{
+    uint64_t target = _nowUs + us;
+
+    while (1)
+    {
+        repeating_timer_t *due = NULL;
+        for (int i = 0; i < HOST_MAX_TIMERS; i++)
+        {
+            if ((_timers[i] != NULL) && (_timers[i]->next_us <= target) && ((due == NULL) || (_timers[i]->next_us < due->next_us)))
+            {
+                due = _timers[i];
+            }
+        }
+        if (due == NULL)
+        {
+            break;
+        }
+
+        _nowUs = due->next_us;
+        due->next_us += (due->delay_us < 0) ? (uint64_t)-due->delay_us : (uint64_t)due->delay_us;
+        if (!due->callback(due))
+        {
+            cancel_repeating_timer(due);
+        }
+    }
+    _nowUs = target;
+}
+
+/**
+ * @brief Advances the virtual clock without firing the repeating timers in between (see host_clock_advance).
+ *
+ * @param us The number of microseconds to advance the clock by.
+ */
+void host_clock_skip(uint64_t us)
+{
+    _nowUs += us;
+    for (int i = 0; i < HOST_MAX_TIMERS; i++)
+    {
+        repeating_timer_t *timer = _timers[i];
+        if ((timer != NULL) && (timer->next_us < _nowUs))
+        {
+            uint64_t period = (timer->delay_us < 0) ? (uint64_t)-timer->delay_us : (uint64_t)timer->delay_us;
+            timer->next_us += (_nowUs - timer->next_us + period - 1) / period * period;
+        }
+    }
+}
+
+/**
+ * @brief Returns the virtual time since boot, in microseconds.
+ */
+uint64_t time_us_64(void)
+{
+    return _nowUs;
+}
+
+/**
+ * @brief Advances the virtual clock by the given number of microseconds.
+ */
+void sleep_us(uint64_t us)
+{
+    host_clock_advance(us);
+}
+
+/**
+ * @brief Advances the virtual clock by the given number of milliseconds.
+ */
+void sleep_ms(uint32_t ms)
+{
+    host_clock_advance((uint64_t)ms * 1000);
+}
+
+/**
+ * @brief Advances the virtual clock by the given number of microseconds (same as sleep_us on the host).
+ */
+void busy_wait_us(uint64_t us)
+{
+    host_clock_advance(us);
+}
+
+/**
+ * @brief Advances the virtual clock by the given number of milliseconds (same as sleep_ms on the host).
+ */
+void busy_wait_ms(uint32_t ms)
+{
+    host_clock_advance((uint64_t)ms * 1000);
+}
+
+/**
+ * @brief Starts a repeating timer, fired by the virtual clock (see host_clock_advance).
+ *
+ * @return False if too many timers are running.
+ */
+bool add_repeating_timer_us(int64_t delay_us, repeating_timer_callback_t callback, void *user_data, repeating_timer_t *out)
+{
+    for (int i = 0; i < HOST_MAX_TIMERS; i++)
+    {
+        if (_timers[i] == NULL)
+        {
+            out->delay_us = delay_us;
+            out->next_us = _nowUs + ((delay_us < 0) ? (uint64_t)-delay_us : (uint64_t)delay_us);
+            out->callback = callback;
+            out->user_data = user_data;
+            out->active = true;
+            _timers[i] = out;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Stops a repeating timer.
+ *
+ * @return True if the timer was running.
+ */
+bool cancel_repeating_timer(repeating_timer_t *timer)
+{
+    for (int i = 0; i < HOST_MAX_TIMERS; i++)
+    {
+        if (_timers[i] == timer)
+        {
+            _timers[i] = NULL;
+            timer->active = false;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Does nothing on the host, stdio is always available.
+ */
+bool stdio_init_all(void)
+{
+    return true;
+}
+
+#pragma endregion
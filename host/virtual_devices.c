@@ -0,0 +1,512 @@
+/** @file virtual_devices.c
+ *
+ * @brief This file contains the source code for the virtual sensor models (see virtual_devices.h).
+ *
+ * Only the behaviour the drivers of this project rely on is modelled, the register/command values come from the datasheets.
+ */
+
+#include <string.h>
+#include <pico/stdlib.h>
+#include "virtual_devices.h"
+
+#pragma region AS7341 spectral sensor
+
+// Registers of the AS7341 used by the model.
+#define AS7341_ENABLE 0x80
+#define AS7341_ATIME 0x81
+#define AS7341_ID 0x92
+#define AS7341_CH0_DATA_L 0x95
+#define AS7341_STATUS_2 0xA3
+#define AS7341_ASTEP_L 0xCA
+#define AS7341_ASTEP_H 0xCB
+
+// Bits of the ENABLE register.
+#define AS7341_ENABLE_SP_EN (1 << 1)
+#define AS7341_ENABLE_SMUXEN (1 << 4)
+
+// AVALID bit of the STATUS_2 register, set once the spectral measurement is complete.
+#define AS7341_STATUS_2_AVALID (1 << 6)
+
+/**
+ * @brief Completes the running measurement if its integration time has passed, loading the channel data registers.
+ */
+static void _as7341Update(virtual_i2c_device_t *dev)
+{
+    virtual_as7341_t *m = (virtual_as7341_t *)dev->model;
+
+    if (m->measuring && (time_us_64() >= m->measureEnd))
+    {
+        const uint16_t *ch = m->f5f8Selected ? m->f5f8 : m->f1f4;
+        for (int i = 0; i < 6; i++)
+        {
+            dev->regs[AS7341_CH0_DATA_L + i * 2] = ch[i] & 0xFF;
+            dev->regs[AS7341_CH0_DATA_L + i * 2 + 1] = ch[i] >> 8;
+        }
+        dev->regs[AS7341_STATUS_2] |= AS7341_STATUS_2_AVALID;
+        m->measuring = false;
+    }
+}
+
+/**
+ * @brief Write hook of the AS7341: register map, plus the side effects of the ENABLE register.
+ */
+static uint8_t _as7341Write(virtual_i2c_device_t *dev, const uint8_t *data, size_t len)
+{
+    virtual_as7341_t *m = (virtual_as7341_t *)dev->model;
+    uint8_t before = dev->regs[AS7341_ENABLE];
+
+    _as7341Update(dev);
+    virtual_i2c_regWrite(dev, data, len);
+
+    if ((len < 2) || (data[0] != AS7341_ENABLE))
+    {
+        return 0;
+    }
+
+    uint8_t enable = dev->regs[AS7341_ENABLE];
+
+    // The SMUX configuration is applied at once (the real one takes a few microseconds), and the bit clears itself.
+    // RAM address 0x00 holds 0x30 for the F1-F4 configuration and 0x00 for the F5-F8 one (see AS7341_F1F4_Clear_NIR).
+    if (enable & AS7341_ENABLE_SMUXEN)
+    {
+        m->f5f8Selected = (dev->regs[0x00] == 0x00);
+        dev->regs[AS7341_ENABLE] &= ~AS7341_ENABLE_SMUXEN;
+    }
+
+    // Setting SP_EN starts a measurement: (ATIME + 1) x (ASTEP + 1) x 2.78us.
+    if ((enable & AS7341_ENABLE_SP_EN) && !(before & AS7341_ENABLE_SP_EN))
+    {
+        uint32_t astep = dev->regs[AS7341_ASTEP_L] | (dev->regs[AS7341_ASTEP_H] << 8);
+        uint64_t integrationUs = ((uint64_t)(dev->regs[AS7341_ATIME] + 1) * (astep + 1) * 278) / 100;
+
+        dev->regs[AS7341_STATUS_2] &= ~AS7341_STATUS_2_AVALID;
+        m->measuring = true;
+        m->measureEnd = time_us_64() + integrationUs;
+    }
+    else if (!(enable & AS7341_ENABLE_SP_EN))
+    {
+        m->measuring = false;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Read hook of the AS7341: register map, with the measurement completed first if it is due.
+ */
+static uint8_t _as7341Read(virtual_i2c_device_t *dev, uint8_t *data, size_t len)
+{
+    _as7341Update(dev);
+    return virtual_i2c_regRead(dev, data, len);
+}
+
+/**
+ * @brief Initialises an AS7341 model (power-on register values) and binds it to the device.
+ *
+ * @param dev The device to attach to the virtual bus.
+ * @param model The state of the model, it must stay valid while the device is attached.
+ */
+void virtual_as7341_init(virtual_i2c_device_t *dev, virtual_as7341_t *model)
+{
+    memset(dev, 0, sizeof(*dev));
+    memset(model, 0, sizeof(*model));
+
+    dev->name = "AS7341";
+    dev->addr = VIRTUAL_AS7341_ADDR;
+    dev->onWrite = _as7341Write;
+    dev->onRead = _as7341Read;
+    dev->model = model;
+
+    // Power-on values: part ID, ASTEP = 999 (ATIME = 0), i.e. an integration time of 2.78ms.
+    dev->regs[AS7341_ID] = 0x24;
+    dev->regs[AS7341_ASTEP_L] = 999 & 0xFF;
+    dev->regs[AS7341_ASTEP_H] = 999 >> 8;
+
+    // Some light, with every channel telling its position apart.
+    for (int i = 0; i < 6; i++)
+    {
+        model->f1f4[i] = 1000 + i * 100;
+        model->f5f8[i] = 2000 + i * 100;
+    }
+}
+
+#pragma endregion
+
+#pragma region FS3000 air velocity sensor
+
+/**
+ * @brief Builds the 5 byte frame of the FS3000 for the given flow value (e.g. to queue a corrupted copy of it).
+ *
+ * @param raw The 12-bit flow value.
+ * @param frame Filled in with the frame.
+ */
+void virtual_fs3000_frame(uint16_t raw, uint8_t frame[5])
+{
+    // The flow value is sent twice, the checksum makes the 5 bytes add up to 0.
+    frame[1] = (raw >> 8) & 0x0F;
+    frame[2] = raw & 0xFF;
+    frame[3] = frame[1];
+    frame[4] = frame[2];
+    frame[0] = (uint8_t)(0 - (uint8_t)(frame[1] + frame[2] + frame[3] + frame[4]));
+}
+
+/**
+ * @brief Write hook of the FS3000: the sensor has no registers, whatever is written is acknowledged and ignored.
+ */
+static uint8_t _fs3000Write(virtual_i2c_device_t *dev, const uint8_t *data, size_t len)
+{
+    return 0;
+}
+
+/**
+ * @brief Read hook of the FS3000: every read returns the latest frame (zero-padded past 5 bytes).
+ */
+static uint8_t _fs3000Read(virtual_i2c_device_t *dev, uint8_t *data, size_t len)
+{
+    virtual_fs3000_t *m = (virtual_fs3000_t *)dev->model;
+    uint8_t frame[5];
+
+    virtual_fs3000_frame(m->raw, frame);
+    for (size_t i = 0; i < len; i++)
+    {
+        data[i] = (i < sizeof(frame)) ? frame[i] : 0;
+    }
+    return 0;
+}
+
+/**
+ * @brief Initialises an FS3000 model and binds it to the device.
+ *
+ * @param dev The device to attach to the virtual bus.
+ * @param model The state of the model, it must stay valid while the device is attached.
+ */
+void virtual_fs3000_init(virtual_i2c_device_t *dev, virtual_fs3000_t *model)
+{
+    memset(dev, 0, sizeof(*dev));
+
+    dev->name = "FS3000";
+    dev->addr = VIRTUAL_FS3000_ADDR;
+    dev->onWrite = _fs3000Write;
+    dev->onRead = _fs3000Read;
+    dev->model = model;
+
+    // A light breeze, in the middle of the range of both variants.
+    model->raw = 1522;
+}
+
+#pragma endregion
+
+#pragma region MLX90614 infrared thermometer
+
+// Commands of the MLX90614 used by the model.
+#define MLX90614_TA 0x06
+#define MLX90614_TOBJ1 0x07
+#define MLX90614_TOBJ2 0x08
+#define MLX90614_EMISSIVITY 0x24
+#define MLX90614_SMBUS_ADDR 0x2E
+#define MLX90614_ID_NUMBER 0x3C
+#define MLX90614_FLAGS 0xF0
+#define MLX90614_SLEEP 0xFF
+
+/**
+ * @brief CRC-8 with the polynomial 0x07 (x^8 + x^2 + x + 1), as used by the SMBus PEC.
+ */
+static uint8_t _crc8Poly07(const uint8_t *data, size_t len)
+{
+    uint8_t crc = 0x00;
+    while (len--)
+    {
+        crc ^= *data++;
+        for (int i = 0; i < 8; i++)
+        {
+            crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+/**
+ * @brief Computes the PEC of an SMBus read word, as the MLX90614 does.
+ *
+ * @param addr The 7-bit I2C address of the device.
+ * @param cmd The command (RAM/EEPROM address) that was read.
+ * @param word The word that was read.
+ * @return The PEC byte sent after the word.
+ */
+uint8_t virtual_mlx90614_pec(uint8_t addr, uint8_t cmd, uint16_t word)
+{
+    // The PEC covers every byte on the wire: address + W, command, address + R, then the word (LSB first).
+    uint8_t bytes[5] = {(uint8_t)(addr << 1), cmd, (uint8_t)((addr << 1) | 1), (uint8_t)(word & 0xFF), (uint8_t)(word >> 8)};
+    return _crc8Poly07(bytes, sizeof(bytes));
+}
+
+/**
+ * @brief Write hook of the MLX90614: the first byte is the command, EEPROM writes carry a word and its PEC.
+ */
+static uint8_t _mlx90614Write(virtual_i2c_device_t *dev, const uint8_t *data, size_t len)
+{
+    virtual_mlx90614_t *m = (virtual_mlx90614_t *)dev->model;
+
+    // A zero-length write (the end of the wake up sequence) wakes the sensor up.
+    if (!len)
+    {
+        m->sleeping = false;
+        return 0;
+    }
+
+    dev->regPtr = data[0];
+
+    if (data[0] == MLX90614_SLEEP)
+    {
+        m->sleeping = true;
+    }
+    else if ((len == 4) && (data[0] >= 0x20) && (data[0] < 0x40))
+    {
+        // EEPROM write: the word is only stored if its PEC is right (the write PEC covers address + W, command and the word).
+        uint8_t bytes[4] = {(uint8_t)(dev->addr << 1), data[0], data[1], data[2]};
+        if (_crc8Poly07(bytes, sizeof(bytes)) != data[3])
+        {
+            return 3;
+        }
+        m->words[data[0]] = data[1] | (data[2] << 8);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Read hook of the MLX90614: the word addressed by the last command, followed by its PEC.
+ */
+static uint8_t _mlx90614Read(virtual_i2c_device_t *dev, uint8_t *data, size_t len)
+{
+    virtual_mlx90614_t *m = (virtual_mlx90614_t *)dev->model;
+
+    // A sleeping sensor does not answer until it is woken up.
+    if (m->sleeping)
+    {
+        return 2;
+    }
+
+    uint16_t word = m->words[dev->regPtr];
+    uint8_t frame[3] = {(uint8_t)(word & 0xFF), (uint8_t)(word >> 8), virtual_mlx90614_pec(dev->addr, dev->regPtr, word)};
+    for (size_t i = 0; i < len; i++)
+    {
+        data[i] = (i < sizeof(frame)) ? frame[i] : 0xFF;
+    }
+    return 0;
+}
+
+/**
+ * @brief Sets the temperatures returned by the MLX90614 model.
+ *
+ * @param model The state of the model.
+ * @param ambientC The ambient temperature (TA), in degrees Celsius.
+ * @param objectC The object temperature (TOBJ1), in degrees Celsius.
+ */
+void virtual_mlx90614_setTemps(virtual_mlx90614_t *model, float ambientC, float objectC)
+{
+    // Both are in units of 0.02K.
+    model->words[MLX90614_TA] = (uint16_t)((ambientC + 273.15f) * 50.0f + 0.5f);
+    model->words[MLX90614_TOBJ1] = (uint16_t)((objectC + 273.15f) * 50.0f + 0.5f);
+    model->words[MLX90614_TOBJ2] = model->words[MLX90614_TOBJ1];
+}
+
+/**
+ * @brief Initialises an MLX90614 model and binds it to the device.
+ *
+ * @param dev The device to attach to the virtual bus.
+ * @param model The state of the model, it must stay valid while the device is attached.
+ */
+void virtual_mlx90614_init(virtual_i2c_device_t *dev, virtual_mlx90614_t *model)
+{
+    memset(dev, 0, sizeof(*dev));
+    memset(model, 0, sizeof(*model));
+
+    dev->name = "MLX90614";
+    dev->addr = VIRTUAL_MLX90614_ADDR;
+    dev->onWrite = _mlx90614Write;
+    dev->onRead = _mlx90614Read;
+    dev->model = model;
+
+    // Factory EEPROM: emissivity 1.0, SMBus address, a non-zero ID; flags: POR initialisation done.
+    model->words[MLX90614_EMISSIVITY] = 0xFFFF;
+    model->words[MLX90614_SMBUS_ADDR] = VIRTUAL_MLX90614_ADDR;
+    model->words[MLX90614_ID_NUMBER] = 0x3802;
+    model->words[MLX90614_FLAGS] = 1 << 4;
+
+    virtual_mlx90614_setTemps(model, 24.0f, 31.5f);
+}
+
+#pragma endregion
+
+#pragma region SCD4x CO2 sensor
+
+// Commands of the SCD4x used by the model.
+#define SCD4X_START_PERIODIC 0x21B1
+#define SCD4X_READ_MEASUREMENT 0xEC05
+#define SCD4X_STOP_PERIODIC 0x3F86
+#define SCD4X_GET_DATA_READY 0xE4B8
+#define SCD4X_GET_SERIAL 0x3682
+#define SCD4X_REINIT 0x3646
+#define SCD4X_WAKE_UP 0x36F6
+
+/**
+ * @brief Sensirion CRC-8 (polynomial 0x31, init 0xFF) of one word.
+ */
+static uint8_t _sensirionCrc(uint16_t word)
+{
+    uint8_t crc = 0xFF;
+    uint8_t bytes[2] = {(uint8_t)(word >> 8), (uint8_t)(word & 0xFF)};
+    for (int b = 0; b < 2; b++)
+    {
+        crc ^= bytes[b];
+        for (int i = 0; i < 8; i++)
+        {
+            crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x31) : (uint8_t)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+/**
+ * @brief Sets the response of the last command: the words, each followed by its CRC.
+ */
+static void _scd4xRespond(virtual_scd4x_t *m, const uint16_t *words, size_t count)
+{
+    m->respLen = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        m->resp[m->respLen++] = words[i] >> 8;
+        m->resp[m->respLen++] = words[i] & 0xFF;
+        m->resp[m->respLen++] = _sensirionCrc(words[i]);
+    }
+}
+
+/**
+ * @brief Makes a new sample available if the periodic measurement is running and the period has elapsed.
+ */
+static void _scd4xUpdate(virtual_scd4x_t *m)
+{
+    if (m->periodic && (time_us_64() >= m->nextSample))
+    {
+        m->dataReady = true;
+        m->nextSample += VIRTUAL_SCD4X_PERIOD_US;
+    }
+}
+
+/**
+ * @brief Write hook of the SCD4x: decodes the 16-bit command and prepares its response.
+ */
+static uint8_t _scd4xWrite(virtual_i2c_device_t *dev, const uint8_t *data, size_t len)
+{
+    virtual_scd4x_t *m = (virtual_scd4x_t *)dev->model;
+
+    _scd4xUpdate(m);
+    m->respLen = 0;
+
+    // Probe, or a truncated command.
+    if (len < 2)
+    {
+        return 0;
+    }
+
+    uint16_t cmd = (data[0] << 8) | data[1];
+    switch (cmd)
+    {
+    case SCD4X_WAKE_UP:
+        // The sensor does not acknowledge the wake up command.
+        return 3;
+    case SCD4X_START_PERIODIC:
+        m->periodic = true;
+        m->dataReady = false;
+        m->nextSample = time_us_64() + VIRTUAL_SCD4X_PERIOD_US;
+        break;
+    case SCD4X_STOP_PERIODIC:
+        m->periodic = false;
+        m->dataReady = false;
+        break;
+    case SCD4X_GET_DATA_READY:
+    {
+        uint16_t status = m->dataReady ? 0x8006 : 0x8000;
+        _scd4xRespond(m, &status, 1);
+        break;
+    }
+    case SCD4X_READ_MEASUREMENT:
+    {
+        // Reading a sample clears it, reading when none is ready gets the last one again (as the real sensor does).
+        uint16_t words[3] = {m->co2, m->tempTicks, m->humTicks};
+        _scd4xRespond(m, words, 3);
+        m->dataReady = false;
+        break;
+    }
+    case SCD4X_GET_SERIAL:
+        _scd4xRespond(m, m->serial, 3);
+        break;
+    case SCD4X_REINIT:
+    default:
+        break;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Read hook of the SCD4x: the response of the last command, or a NACK if it has none.
+ */
+static uint8_t _scd4xRead(virtual_i2c_device_t *dev, uint8_t *data, size_t len)
+{
+    virtual_scd4x_t *m = (virtual_scd4x_t *)dev->model;
+
+    if (!m->respLen)
+    {
+        return 2;
+    }
+
+    for (size_t i = 0; i < len; i++)
+    {
+        data[i] = (i < m->respLen) ? m->resp[i] : 0xFF;
+    }
+    m->respLen = 0;
+    return 0;
+}
+
+/**
+ * @brief Sets the sample returned by the SCD4x model.
+ *
+ * @param model The state of the model.
+ * @param co2 The CO2 concentration, in ppm.
+ * @param tempC The temperature, in degrees Celsius.
+ * @param humRh The relative humidity, in percent.
+ */
+void virtual_scd4x_setSample(virtual_scd4x_t *model, uint16_t co2, float tempC, float humRh)
+{
+    // T = -45 + 175 x ticks / 2^16, RH = 100 x ticks / 2^16.
+    model->co2 = co2;
+    model->tempTicks = (uint16_t)((tempC + 45.0f) * 65536.0f / 175.0f);
+    model->humTicks = (uint16_t)(humRh * 65536.0f / 100.0f);
+}
+
+/**
+ * @brief Initialises an SCD4x model and binds it to the device.
+ *
+ * @param dev The device to attach to the virtual bus.
+ * @param model The state of the model, it must stay valid while the device is attached.
+ */
+void virtual_scd4x_init(virtual_i2c_device_t *dev, virtual_scd4x_t *model)
+{
+    memset(dev, 0, sizeof(*dev));
+    memset(model, 0, sizeof(*model));
+
+    dev->name = "SCD4x";
+    dev->addr = VIRTUAL_SCD4X_ADDR;
+    dev->onWrite = _scd4xWrite;
+    dev->onRead = _scd4xRead;
+    dev->model = model;
+
+    model->serial[0] = 0xBE5F;
+    model->serial[1] = 0x7F07;
+    model->serial[2] = 0x3B3F;
+    virtual_scd4x_setSample(model, 650, 23.5f, 48.0f);
+}
+
+#pragma endregion
@@ -0,0 +1,168 @@
+/** @file virtual_devices.h
+ *
+ * @brief Header file for the virtual models of the sensors used by the project, to be attached to the virtual I2C bus.
+ *
+ * Brief overview of the code:
+ * Each model answers the driver the way the real sensor does, as far as the drivers of this project can tell:
+ * 1. AS7341 (0x39): register map, the spectral measurement completes (AVALID) after the integration time set by ATIME/ASTEP.
+ * 2. FS3000 (0x28): no registers, every read returns a 5 byte frame (checksum, then the 12-bit flow value twice).
+ * 3. MLX90614 (0x5A): SMBus read word commands (RAM/EEPROM), every word is followed by its PEC (CRC-8, polynomial 0x07).
+ * 4. SCD4x (0x62): 16-bit commands, every word read is followed by its Sensirion CRC-8 (polynomial 0x31, init 0xFF),
+ *    a new sample is ready every 5 seconds once the periodic measurement has been started.
+ *
+ * The values returned by the models can be changed at any time (see the set functions), and every model can still be driven
+ * by the scripted responses and NACKs of the virtual bus (see virtual_i2c.h).
+ */
+
+#pragma once
+#ifndef _VIRTUAL_DEVICES_H_
+#define _VIRTUAL_DEVICES_H_
+
+#include "virtual_i2c.h"
+
+#pragma region AS7341 spectral sensor
+
+// 7-bit I2C address of the AS7341.
+#define VIRTUAL_AS7341_ADDR 0x39
+
+/**
+ * @brief State of the AS7341 model.
+ */
+typedef struct
+{
+    uint16_t f1f4[6];     // Channel data of the F1-F4, Clear, NIR SMUX configuration.
+    uint16_t f5f8[6];     // Channel data of the F5-F8, Clear, NIR SMUX configuration.
+    bool f5f8Selected;    // True if the last SMUX configuration written was the F5-F8 one.
+    bool measuring;       // True while a spectral measurement is running.
+    uint64_t measureEnd;  // Time at which the running measurement completes, in microseconds.
+} virtual_as7341_t;
+
+/**
+ * @brief Initialises an AS7341 model (power-on register values) and binds it to the device.
+ *
+ * @param dev The device to attach to the virtual bus.
+ * @param model The state of the model, it must stay valid while the device is attached.
+ */
+void virtual_as7341_init(virtual_i2c_device_t *dev, virtual_as7341_t *model);
+
+#pragma endregion
+
+#pragma region FS3000 air velocity sensor
+
+// 7-bit I2C address of the FS3000.
+#define VIRTUAL_FS3000_ADDR 0x28
+
+/**
+ * @brief State of the FS3000 model.
+ */
+typedef struct
+{
+    uint16_t raw; // 12-bit flow value returned in every frame.
+} virtual_fs3000_t;
+
+/**
+ * @brief Initialises an FS3000 model and binds it to the device.
+ *
+ * @param dev The device to attach to the virtual bus.
+ * @param model The state of the model, it must stay valid while the device is attached.
+ */
+void virtual_fs3000_init(virtual_i2c_device_t *dev, virtual_fs3000_t *model);
+
+/**
+ * @brief Builds the 5 byte frame of the FS3000 for the given flow value (e.g. to queue a corrupted copy of it).
+ *
+ * @param raw The 12-bit flow value.
+ * @param frame Filled in with the frame.
+ */
+void virtual_fs3000_frame(uint16_t raw, uint8_t frame[5]);
+
+#pragma endregion
+
+#pragma region MLX90614 infrared thermometer
+
+// 7-bit I2C address of the MLX90614 (factory default).
+#define VIRTUAL_MLX90614_ADDR 0x5A
+
+/**
+ * @brief State of the MLX90614 model.
+ */
+typedef struct
+{
+    uint16_t words[256]; // RAM (0x00-0x1F), EEPROM (0x20-0x3F) and flags (0xF0) words, indexed by command.
+    bool sleeping;       // True after the sleep command, until the wake up sequence.
+} virtual_mlx90614_t;
+
+/**
+ * @brief Initialises an MLX90614 model and binds it to the device.
+ *
+ * @param dev The device to attach to the virtual bus.
+ * @param model The state of the model, it must stay valid while the device is attached.
+ */
+void virtual_mlx90614_init(virtual_i2c_device_t *dev, virtual_mlx90614_t *model);
+
+/**
+ * @brief Sets the temperatures returned by the MLX90614 model.
+ *
+ * @param model The state of the model.
+ * @param ambientC The ambient temperature (TA), in degrees Celsius.
+ * @param objectC The object temperature (TOBJ1), in degrees Celsius.
+ */
+void virtual_mlx90614_setTemps(virtual_mlx90614_t *model, float ambientC, float objectC);
+
+/**
+ * @brief Computes the PEC of an SMBus read word, as the MLX90614 does.
+ *
+ * @param addr The 7-bit I2C address of the device.
+ * @param cmd The command (RAM/EEPROM address) that was read.
+ * @param word The word that was read.
+ * @return The PEC byte sent after the word.
+ */
+uint8_t virtual_mlx90614_pec(uint8_t addr, uint8_t cmd, uint16_t word);
+
+#pragma endregion
+
+#pragma region SCD4x CO2 sensor
+
+// 7-bit I2C address of the SCD4x.
+#define VIRTUAL_SCD4X_ADDR 0x62
+
+// Interval between two samples of the periodic measurement, in microseconds.
+#define VIRTUAL_SCD4X_PERIOD_US 5000000
+
+/**
+ * @brief State of the SCD4x model.
+ */
+typedef struct
+{
+    uint16_t co2;         // CO2 concentration returned by read_measurement, in ppm.
+    uint16_t tempTicks;   // Temperature returned by read_measurement, in sensor ticks.
+    uint16_t humTicks;    // Relative humidity returned by read_measurement, in sensor ticks.
+    uint16_t serial[3];   // Serial number words.
+    bool periodic;        // True while the periodic measurement is running.
+    uint64_t nextSample;  // Time at which the next sample will be ready, in microseconds.
+    bool dataReady;       // True if a sample is waiting to be read.
+    uint8_t resp[9];      // Response to the last command, words with their CRC.
+    size_t respLen;       // Length of the response, 0 if the last command has nothing to read.
+} virtual_scd4x_t;
+
+/**
+ * @brief Initialises an SCD4x model and binds it to the device.
+ *
+ * @param dev The device to attach to the virtual bus.
+ * @param model The state of the model, it must stay valid while the device is attached.
+ */
+void virtual_scd4x_init(virtual_i2c_device_t *dev, virtual_scd4x_t *model);
+
+/**
+ * @brief Sets the sample returned by the SCD4x model.
+ *
+ * @param model The state of the model.
+ * @param co2 The CO2 concentration, in ppm.
+ * @param tempC The temperature, in degrees Celsius.
+ * @param humRh The relative humidity, in percent.
+ */
+void virtual_scd4x_setSample(virtual_scd4x_t *model, uint16_t co2, float tempC, float humRh);
+
+#pragma endregion
+
+#endif // _VIRTUAL_DEVICES_H_
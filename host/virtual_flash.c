@@ -0,0 +1,111 @@
+/** @file virtual_flash.c
+ *
+ * @brief This file contains the source code for the virtual flash (see virtual_flash.h).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "virtual_flash.h"
+#include "virtual_i2c.h"
+
+uint8_t virtual_flash_image[PICO_FLASH_SIZE_BYTES];
+
+static uint32_t _eraseCount[PICO_FLASH_SIZE_BYTES / FLASH_SECTOR_SIZE]; // Number of erases of every sector
+static bool _cutArmed = false; // A power cut is pending
+static uint32_t _bytesLeft;    // Bytes written before the power cut (if armed)
+static bool _powerCut = false; // The power is off, the writes are lost
+
+/**
+ * @brief Checks the alignment of a write, a misaligned write is a bug of the caller (the SDK does not check it either).
+ */
+static void _checkAlignment(const char *what, uint32_t offset, size_t count, uint32_t unit)
+{
+    if ((offset % unit) || (count % unit) || (offset + count > PICO_FLASH_SIZE_BYTES))
+    {
+        fprintf(stderr, "virtual_flash: misaligned %s at 0x%x (%zu bytes)\n", what, (unsigned)offset, count);
+        abort();
+    }
+}
+
+/**
+ * @brief Takes the given number of bytes from the power cut budget.
+ *
+ * @return The number of bytes actually written before the power goes.
+ */
+static size_t _powerBudget(size_t count)
+{
+    if (_powerCut)
+    {
+        return 0;
+    }
+    if (_cutArmed && (count >= _bytesLeft))
+    {
+        count = _bytesLeft;
+        _cutArmed = false;
+        _powerCut = true;
+        return count;
+    }
+    if (_cutArmed)
+    {
+        _bytesLeft -= count;
+    }
+    return count;
+}
+
+void flash_range_erase(uint32_t flash_offs, size_t count)
+{
+    _checkAlignment("erase", flash_offs, count, FLASH_SECTOR_SIZE);
+    size_t done = _powerBudget(count);
+
+    // An interrupted erase is modelled as erasing from the end of the range: the header at the start of a sector
+    // is the last thing to go, which is the worst case for the code relying on it
+    memset(&virtual_flash_image[flash_offs + count - done], 0xFF, done);
+    for (size_t offset = 0; offset < count; offset += FLASH_SECTOR_SIZE)
+    {
+        _eraseCount[(flash_offs + offset) / FLASH_SECTOR_SIZE]++;
+    }
+    host_clock_advance((uint64_t)VIRTUAL_FLASH_ERASE_US * (count / FLASH_SECTOR_SIZE));
+}
+
+void flash_range_program(uint32_t flash_offs, const uint8_t *data, size_t count)
+{
+    _checkAlignment("program", flash_offs, count, FLASH_PAGE_SIZE);
+    size_t done = _powerBudget(count);
+
+    // Programming can only clear bits
+    for (size_t i = 0; i < done; i++)
+    {
+        virtual_flash_image[flash_offs + i] &= data[i];
+    }
+    host_clock_advance((uint64_t)VIRTUAL_FLASH_PROGRAM_US * (count / FLASH_PAGE_SIZE));
+}
+
+void virtual_flash_reset(void)
+{
+    memset(virtual_flash_image, 0xFF, sizeof(virtual_flash_image));
+    memset(_eraseCount, 0, sizeof(_eraseCount));
+    virtual_flash_powerOn();
+}
+
+void virtual_flash_cutPowerAfter(uint32_t bytes)
+{
+    _cutArmed = true;
+    _bytesLeft = bytes;
+}
+
+void virtual_flash_powerOn(void)
+{
+    _cutArmed = false;
+    _powerCut = false;
+}
+
+bool virtual_flash_isPowerCut(void)
+{
+    return _powerCut;
+}
+
+uint32_t virtual_flash_getEraseCount(uint32_t flashOffset)
+{
+    return _eraseCount[flashOffset / FLASH_SECTOR_SIZE];
+}
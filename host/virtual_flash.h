@@ -0,0 +1,62 @@
+/** @file virtual_flash.h
+ *
+ * @brief Header file for the virtual flash, the host (Linux) stand-in for the QSPI flash of the Pico.
+ *
+ * Brief overview of the code:
+ * The flash is a RAM image (virtual_flash_image, the XIP_BASE of the host hardware/flash.h),
+ * written through flash_range_erase / flash_range_program with the same rules as the real flash:
+ * 1. Erases work on whole 4 KB sectors and set them to 0xFF.
+ * 2. Programs work on whole 256 byte pages and can only clear bits.
+ *
+ * A power loss can be injected in the middle of a write (see virtual_flash_cutPowerAfter):
+ * the write is cut short after a given number of bytes, and every write after it is lost until the power comes back.
+ * The virtual clock is advanced by the typical time of each erase and program.
+ */
+
+#pragma once
+#ifndef _VIRTUAL_FLASH_H_
+#define _VIRTUAL_FLASH_H_
+
+#include <pico/stdlib.h>
+#include <hardware/flash.h>
+
+// Typical time of a sector erase and of a page program, in microseconds.
+#define VIRTUAL_FLASH_ERASE_US 45000
+#define VIRTUAL_FLASH_PROGRAM_US 400
+
+/**
+ * @brief Erases the whole image (as a blank flash), resets the counters and powers the flash on.
+ */
+void virtual_flash_reset(void);
+
+/**
+ * @brief Cuts the power after the given number of bytes has been erased or programmed.
+ *
+ * The write in progress when the power goes stops half way, and the following writes are lost,
+ * until virtual_flash_powerOn is called (the reboot).
+ *
+ * @param bytes The number of bytes written before the power goes.
+ */
+void virtual_flash_cutPowerAfter(uint32_t bytes);
+
+/**
+ * @brief Powers the flash back on (cancels a pending power cut).
+ */
+void virtual_flash_powerOn(void);
+
+/**
+ * @brief Checks if the power has been cut (see virtual_flash_cutPowerAfter).
+ *
+ * @return True if the power is off.
+ */
+bool virtual_flash_isPowerCut(void);
+
+/**
+ * @brief Gets the number of times a sector has been erased since virtual_flash_reset.
+ *
+ * @param flashOffset The offset of the sector from the start of the flash.
+ * @return The number of erases of the sector.
+ */
+uint32_t virtual_flash_getEraseCount(uint32_t flashOffset);
+
+#endif // _VIRTUAL_FLASH_H_
@@ -0,0 +1,295 @@
+/** @file virtual_i2c.c
+ *
+ * @brief This file contains the source code for the virtual I2C bus (see virtual_i2c.h).
+ *
+ * The wire time of a transaction is computed from the bits that would go out on the bus at its clock rate:
+ * Start, address byte + ACK, data bytes + ACK, (Restart, address byte + ACK, data bytes + ACK), Stop.
+ * A NACK on the address ends the transaction right after the address byte.
+ */
+
+#include <string.h>
+#include <pico/stdlib.h>
+#include "virtual_i2c.h"
+
+/**
+ * @brief State of one virtual bus.
+ */
+typedef struct
+{
+    virtual_i2c_device_t *devices; // Devices attached to the bus.
+    uint32_t clkHz;                // Clock rate of the bus.
+    virtual_i2c_stats_t stats;     // Traffic counters of the bus.
+} virtual_i2c_bus_t;
+
+static virtual_i2c_bus_t _buses[VIRTUAL_I2C_NUM_BUSES] = {
+    {NULL, 100000, {0}},
+    {NULL, 100000, {0}},
+};
+
+#pragma region Bus functions
+
+/**
+ * @brief Attaches a device model to a virtual bus.
+ *
+ * @param bus Index of the bus (0 or 1, same as the I2C controller).
+ * @param dev The device model, it must stay valid while attached.
+ */
+void virtual_i2c_attach(uint bus, virtual_i2c_device_t *dev)
+{
+    // Newest first, so a device attached later shadows an older one at the same address.
+    dev->next = _buses[bus].devices;
+    _buses[bus].devices = dev;
+}
+
+/**
+ * @brief Detaches a device model from a virtual bus (the device stops answering).
+ *
+ * @param bus Index of the bus.
+ * @param dev The device model.
+ */
+void virtual_i2c_detach(uint bus, virtual_i2c_device_t *dev)
+{
+    for (virtual_i2c_device_t **p = &_buses[bus].devices; *p; p = &(*p)->next)
+    {
+        if (*p == dev)
+        {
+            *p = dev->next;
+            dev->next = NULL;
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Finds the device attached at the specified address.
+ *
+ * @param bus Index of the bus.
+ * @param addr The 7-bit I2C address.
+ * @return The device model, or NULL if no device answers at this address.
+ */
+virtual_i2c_device_t *virtual_i2c_find(uint bus, uint8_t addr)
+{
+    for (virtual_i2c_device_t *dev = _buses[bus].devices; dev; dev = dev->next)
+    {
+        if (dev->addr == addr)
+        {
+            return dev;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Sets the clock rate of a virtual bus, used to compute the wire time of the transactions.
+ *
+ * @param bus Index of the bus.
+ * @param freqHz The clock rate in Hz.
+ */
+void virtual_i2c_setClock(uint bus, uint32_t freqHz)
+{
+    _buses[bus].clkHz = freqHz ? freqHz : 100000;
+}
+
+/**
+ * @brief Converts a number of bit periods into microseconds at the clock rate of the bus (rounded up).
+ */
+static uint32_t _bitsToUs(virtual_i2c_bus_t *b, uint32_t bits)
+{
+    return (uint32_t)(((uint64_t)bits * 1000000 + b->clkHz - 1) / b->clkHz);
+}
+
+/**
+ * @brief Performs one transaction on a virtual bus.
+ *
+ * @param bus Index of the bus.
+ * @param addr The 7-bit I2C address of the target.
+ * @param tx The bytes to write (can be NULL if txLen is 0).
+ * @param txLen The number of bytes to write.
+ * @param rx The destination of the bytes to read (can be NULL if rxLen is 0).
+ * @param rxLen The number of bytes to read.
+ * @param stopBit True if the transaction ends with a Stop.
+ * @param durationUs Set to the time the transaction takes on the wire, in microseconds.
+ * @return Error code (0: success, 2: NACK on transmit of address, 3: NACK on transmit of data).
+ */
+uint8_t virtual_i2c_transfer(uint bus, uint8_t addr, const uint8_t *tx, size_t txLen, uint8_t *rx, size_t rxLen, bool stopBit, uint32_t *durationUs)
+{
+    virtual_i2c_bus_t *b = &_buses[bus];
+    virtual_i2c_device_t *dev = virtual_i2c_find(bus, addr);
+    uint8_t ret = 0;
+
+    // Start (or Restart, if the previous transaction kept the bus) and the address byte with its ACK bit.
+    uint32_t bits = 1 + 9;
+    uint32_t latencyUs = 0;
+
+    if (!dev || dev->nackNext)
+    {
+        // Nobody acknowledges the address, the master gives up right after it.
+        if (dev)
+        {
+            dev->nackNext--;
+        }
+        ret = 2;
+    }
+    else
+    {
+        // Write phase: hand the bytes to the model (an empty write is a probe, the model still sees it).
+        if (txLen || !rxLen)
+        {
+            ret = dev->onWrite ? dev->onWrite(dev, tx, txLen) : virtual_i2c_regWrite(dev, tx, txLen);
+            bits += 9 * txLen;
+            latencyUs += dev->byteLatencyUs * txLen;
+            dev->stats.bytesWritten += txLen;
+            b->stats.bytesWritten += txLen;
+        }
+
+        // Read phase, after a Restart and the address byte (again) if there was a write phase.
+        if (!ret && rxLen)
+        {
+            if (txLen)
+            {
+                bits += 1 + 9;
+            }
+
+            if (dev->scriptCount)
+            {
+                // Scripted responses take over the model.
+                size_t n = dev->scriptLen[dev->scriptHead];
+                memset(rx, 0, rxLen);
+                memcpy(rx, dev->script[dev->scriptHead], (n < rxLen) ? n : rxLen);
+                dev->scriptHead = (dev->scriptHead + 1) % VIRTUAL_I2C_SCRIPT_DEPTH;
+                dev->scriptCount--;
+            }
+            else
+            {
+                ret = dev->onRead ? dev->onRead(dev, rx, rxLen) : virtual_i2c_regRead(dev, rx, rxLen);
+            }
+
+            if (!ret)
+            {
+                bits += 9 * rxLen;
+                latencyUs += dev->byteLatencyUs * rxLen;
+                dev->stats.bytesRead += rxLen;
+                b->stats.bytesRead += rxLen;
+            }
+        }
+    }
+
+    // Stop.
+    if (stopBit || ret)
+    {
+        bits += 1;
+    }
+
+    uint32_t us = _bitsToUs(b, bits) + latencyUs;
+    *durationUs = us;
+
+    b->stats.transactions++;
+    b->stats.busTimeUs += us;
+    if (ret)
+    {
+        b->stats.nacks++;
+    }
+    if (dev)
+    {
+        dev->stats.transactions++;
+        dev->stats.busTimeUs += us;
+        if (ret)
+        {
+            dev->stats.nacks++;
+        }
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Gets the traffic counters of a virtual bus.
+ *
+ * @param bus Index of the bus.
+ * @param stats Filled in with the counters.
+ */
+void virtual_i2c_getStats(uint bus, virtual_i2c_stats_t *stats)
+{
+    *stats = _buses[bus].stats;
+}
+
+/**
+ * @brief Resets the traffic counters of a virtual bus and of every device attached to it.
+ *
+ * @param bus Index of the bus.
+ */
+void virtual_i2c_resetStats(uint bus)
+{
+    memset(&_buses[bus].stats, 0, sizeof(_buses[bus].stats));
+    for (virtual_i2c_device_t *dev = _buses[bus].devices; dev; dev = dev->next)
+    {
+        memset(&dev->stats, 0, sizeof(dev->stats));
+    }
+}
+
+#pragma endregion
+
+#pragma region Device model helpers
+
+/**
+ * @brief Default write handling: the first byte sets the register pointer, the following bytes are stored with auto-increment.
+ */
+uint8_t virtual_i2c_regWrite(virtual_i2c_device_t *dev, const uint8_t *data, size_t len)
+{
+    if (len)
+    {
+        dev->regPtr = data[0];
+    }
+    for (size_t i = 1; i < len; i++)
+    {
+        dev->regs[dev->regPtr++] = data[i];
+    }
+    return 0;
+}
+
+/**
+ * @brief Default read handling: the bytes are read from the register pointer, with auto-increment.
+ */
+uint8_t virtual_i2c_regRead(virtual_i2c_device_t *dev, uint8_t *data, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        data[i] = dev->regs[dev->regPtr++];
+    }
+    return 0;
+}
+
+/**
+ * @brief Queues a scripted response, returned as-is by the next read of the device instead of the model.
+ *
+ * @param dev The device model.
+ * @param data The bytes of the response.
+ * @param len The length of the response (up to VIRTUAL_I2C_SCRIPT_LEN bytes, the read is zero-padded).
+ * @return True if the response has been queued; False if the script queue is full.
+ */
+bool virtual_i2c_queueResponse(virtual_i2c_device_t *dev, const uint8_t *data, size_t len)
+{
+    if ((dev->scriptCount == VIRTUAL_I2C_SCRIPT_DEPTH) || (len > VIRTUAL_I2C_SCRIPT_LEN))
+    {
+        return false;
+    }
+
+    uint8_t slot = (dev->scriptHead + dev->scriptCount) % VIRTUAL_I2C_SCRIPT_DEPTH;
+    memcpy(dev->script[slot], data, len);
+    dev->scriptLen[slot] = len;
+    dev->scriptCount++;
+    return true;
+}
+
+/**
+ * @brief Makes the device ignore its address for the next transactions (as if it was busy or unplugged).
+ *
+ * @param dev The device model.
+ * @param count The number of transactions to NACK.
+ */
+void virtual_i2c_nackNext(virtual_i2c_device_t *dev, uint32_t count)
+{
+    dev->nackNext = count;
+}
+
+#pragma endregion
@@ -0,0 +1,221 @@
+/** @file virtual_i2c.h
+ *
+ * @brief Header file for the virtual I2C bus, the host (Linux) stand-in for the I2C wires and the devices hanging off them.
+ *
+ * Brief overview of the code:
+ * The host build of i2c_tools (i2c_tools_host.c) does not drive any hardware, it hands every transaction to this bus instead.
+ * The bus looks up the device model attached at the target address and lets it answer, exactly like the real device would
+ * (acknowledge or not, take the written bytes, produce the read bytes).
+ *
+ * Every device model has:
+ * 1. A 256 byte register map with an auto-incremented register pointer, used as-is by simple register based devices.
+ * 2. Optional write/read hooks, for devices that do more than a register map (command based devices, status bits that change over time...).
+ * 3. A queue of scripted responses, returned by the next reads instead of the model (to inject corrupted data, stale frames...).
+ * 4. A per byte latency, added to the wire time (clock stretching, slow EEPROM reads...).
+ *
+ * The bus also keeps the time each transaction takes on the wire (at the clock rate of the bus),
+ * and counts transactions and bytes per bus and per device, so a driver's cost per sample can be measured on the host.
+ */
+
+#pragma once
+#ifndef _VIRTUAL_I2C_H_
+#define _VIRTUAL_I2C_H_
+
+#include <pico/stdlib.h>
+
+// Number of virtual buses (one per I2C controller).
+#define VIRTUAL_I2C_NUM_BUSES 2
+
+// Maximum number of scripted responses queued on a device.
+#define VIRTUAL_I2C_SCRIPT_DEPTH 8
+
+// Maximum length of one scripted response.
+#define VIRTUAL_I2C_SCRIPT_LEN 32
+
+typedef struct virtual_i2c_device virtual_i2c_device_t;
+
+/**
+ * @brief Traffic counters of a bus or of a single device.
+ */
+typedef struct
+{
+    uint32_t transactions; // Number of transactions (Start to Stop, a write-then-read with a Restart counts as one).
+    uint32_t bytesWritten; // Number of data bytes written by the master (address bytes not included).
+    uint32_t bytesRead;    // Number of data bytes read by the master.
+    uint32_t nacks;        // Number of transactions that were not acknowledged (address or data NACK).
+    uint64_t busTimeUs;    // Time spent on the wire, in microseconds.
+} virtual_i2c_stats_t;
+
+/**
+ * @brief Write hook of a device model, called with the data bytes of the write phase of a transaction.
+ *
+ * @param dev The device being written to.
+ * @param data The bytes written by the master (can be empty, e.g. a probe).
+ * @param len The number of bytes written.
+ * @return 0 if every byte was acknowledged, 2 to NACK the address, 3 to NACK a data byte.
+ */
+typedef uint8_t (*virtual_i2c_write_fn)(virtual_i2c_device_t *dev, const uint8_t *data, size_t len);
+
+/**
+ * @brief Read hook of a device model, called to produce the bytes of the read phase of a transaction.
+ *
+ * @param dev The device being read from.
+ * @param data The destination of the bytes read by the master.
+ * @param len The number of bytes read.
+ * @return 0 if the read was acknowledged, 2 to NACK the address.
+ */
+typedef uint8_t (*virtual_i2c_read_fn)(virtual_i2c_device_t *dev, uint8_t *data, size_t len);
+
+/**
+ * @brief A device model attached to a virtual bus.
+ *
+ * Fill in name, addr (and the optional fields), then attach it with virtual_i2c_attach.
+ */
+struct virtual_i2c_device
+{
+    const char *name;             // Name of the device, used in the reports.
+    uint8_t addr;                 // 7-bit I2C address of the device.
+    uint8_t regs[256];            // Register map, used by the default write/read handling.
+    uint8_t regPtr;               // Register pointer, set by the first byte written and auto-incremented.
+    uint32_t byteLatencyUs;       // Extra time per data byte, in microseconds (clock stretching).
+    virtual_i2c_write_fn onWrite; // Write hook, NULL for a plain register map.
+    virtual_i2c_read_fn onRead;   // Read hook, NULL for a plain register map.
+    void *model;                  // Private state of the model.
+
+    uint8_t script[VIRTUAL_I2C_SCRIPT_DEPTH][VIRTUAL_I2C_SCRIPT_LEN]; // Scripted responses, returned by the next reads.
+    size_t scriptLen[VIRTUAL_I2C_SCRIPT_DEPTH];                       // Length of each scripted response.
+    uint8_t scriptHead;                                               // Index of the next scripted response.
+    uint8_t scriptCount;                                              // Number of scripted responses queued.
+    uint32_t nackNext;                                                // Number of upcoming transactions whose address is not acknowledged.
+
+    virtual_i2c_stats_t stats; // Traffic counters of the device.
+    virtual_i2c_device_t *next; // Next device attached to the same bus.
+};
+
+#pragma region Bus functions
+
+/**
+ * @brief Attaches a device model to a virtual bus.
+ *
+ * @param bus Index of the bus (0 or 1, same as the I2C controller).
+ * @param dev The device model, it must stay valid while attached.
+ */
+void virtual_i2c_attach(uint bus, virtual_i2c_device_t *dev);
+
+/**
+ * @brief Detaches a device model from a virtual bus (the device stops answering).
+ *
+ * @param bus Index of the bus.
+ * @param dev The device model.
+ */
+void virtual_i2c_detach(uint bus, virtual_i2c_device_t *dev);
+
+/**
+ * @brief Finds the device attached at the specified address.
+ *
+ * @param bus Index of the bus.
+ * @param addr The 7-bit I2C address.
+ * @return The device model, or NULL if no device answers at this address.
+ */
+virtual_i2c_device_t *virtual_i2c_find(uint bus, uint8_t addr);
+
+/**
+ * @brief Sets the clock rate of a virtual bus, used to compute the wire time of the transactions.
+ *
+ * @param bus Index of the bus.
+ * @param freqHz The clock rate in Hz.
+ */
+void virtual_i2c_setClock(uint bus, uint32_t freqHz);
+
+/**
+ * @brief Performs one transaction on a virtual bus.
+ *
+ * The write phase (if any) is handed to the target's write hook, then the read phase (if any) to its read hook.
+ * The virtual clock is not advanced, the caller decides when the transaction completes (see durationUs).
+ *
+ * @param bus Index of the bus.
+ * @param addr The 7-bit I2C address of the target.
+ * @param tx The bytes to write (can be NULL if txLen is 0).
+ * @param txLen The number of bytes to write.
+ * @param rx The destination of the bytes to read (can be NULL if rxLen is 0).
+ * @param rxLen The number of bytes to read.
+ * @param stopBit True if the transaction ends with a Stop.
+ * @param durationUs Set to the time the transaction takes on the wire, in microseconds.
+ * @return Error code (same codes as i2c_tools_endTransmission):
+ *         - 0: Success
+ *         - 2: NACK on transmit of address
+ *         - 3: NACK on transmit of data
+ */
+uint8_t virtual_i2c_transfer(uint bus, uint8_t addr, const uint8_t *tx, size_t txLen, uint8_t *rx, size_t rxLen, bool stopBit, uint32_t *durationUs);
+
+/**
+ * @brief Gets the traffic counters of a virtual bus.
+ *
+ * @param bus Index of the bus.
+ * @param stats Filled in with the counters.
+ */
+void virtual_i2c_getStats(uint bus, virtual_i2c_stats_t *stats);
+
+/**
+ * @brief Resets the traffic counters of a virtual bus and of every device attached to it.
+ *
+ * @param bus Index of the bus.
+ */
+void virtual_i2c_resetStats(uint bus);
+
+#pragma endregion
+
+#pragma region Device model helpers
+
+/**
+ * @brief Default write handling: the first byte sets the register pointer, the following bytes are stored with auto-increment.
+ *
+ * Device hooks call this to keep the register map behaviour and add their own side effects.
+ */
+uint8_t virtual_i2c_regWrite(virtual_i2c_device_t *dev, const uint8_t *data, size_t len);
+
+/**
+ * @brief Default read handling: the bytes are read from the register pointer, with auto-increment.
+ */
+uint8_t virtual_i2c_regRead(virtual_i2c_device_t *dev, uint8_t *data, size_t len);
+
+/**
+ * @brief Queues a scripted response, returned as-is by the next read of the device instead of the model.
+ *
+ * @param dev The device model.
+ * @param data The bytes of the response.
+ * @param len The length of the response (up to VIRTUAL_I2C_SCRIPT_LEN bytes, the read is zero-padded).
+ * @return True if the response has been queued; False if the script queue is full.
+ */
+bool virtual_i2c_queueResponse(virtual_i2c_device_t *dev, const uint8_t *data, size_t len);
+
+/**
+ * @brief Makes the device ignore its address for the next transactions (as if it was busy or unplugged).
+ *
+ * @param dev The device model.
+ * @param count The number of transactions to NACK.
+ */
+void virtual_i2c_nackNext(virtual_i2c_device_t *dev, uint32_t count);
+
+#pragma endregion
+
+#pragma region Virtual clock
+
+/**
+ * @brief Advances the virtual clock (see time_us_64), firing the repeating timers due on the way.
+ *
+ * @param us The number of microseconds to advance the clock by.
+ */
+void host_clock_advance(uint64_t us);
+
+/**
+ * @brief Advances the virtual clock without firing the repeating timers in between, as if their ticks had been missed
+ * (each fires next at its first tick after the new time). Lets a bench cover days of virtual time without running every tick.
+ *
+ * @param us The number of microseconds to advance the clock by.
+ */
+void host_clock_skip(uint64_t us);
+
+#pragma endregion
+
+#endif // _VIRTUAL_I2C_H_
@@ -0,0 +1,402 @@
+/** @file virtual_mqtt.c
+ *
+ * @brief This file contains the source code for the virtual broker (see virtual_mqtt.h).
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <pico/cyw43_arch.h>
+#include "lwip/dns.h"
+#include "lwip/apps/mqtt.h"
+#include "lwip/apps/mqtt_priv.h"
+#include "virtual_mqtt.h"
+
+// Address of the broker (127.0.0.1, network byte order).
+#define VIRTUAL_MQTT_BROKER_ADDR 0x0100007Fu
+
+// conn_state values of the client (as in lwIP's mqtt.c).
+#define VIRTUAL_MQTT_TCP_DISCONNECTED 0
+#define VIRTUAL_MQTT_TCP_CONNECTING 1
+#define VIRTUAL_MQTT_MQTT_CONNECTING 2
+#define VIRTUAL_MQTT_MQTT_CONNECTED 3
+
+/**
+ * @brief What a packet does once it reaches its end of the link.
+ */
+typedef enum
+{
+    PACKET_TCP_UP,  // The broker accepted the TCP connection
+    PACKET_CONNACK, // The broker accepted the MQTT connection
+    PACKET_ACK,     // The broker acknowledged a request
+    PACKET_PUBLISH  // The broker sends a message to the client
+} packet_type_t;
+
+/**
+ * @brief A packet on its way.
+ */
+typedef struct
+{
+    bool used;                                 // The entry holds a packet
+    uint32_t seq;                              // Order in which the packets were sent
+    uint64_t dueUs;                            // Time at which it arrives
+    packet_type_t type;                        // What it does
+    mqtt_request_cb_t cb;                      // Callback of the request acknowledged (PACKET_ACK)
+    void *cbArg;                               // Argument of the callback
+    char topic[VIRTUAL_MQTT_TOPIC_LEN];        // Topic of the message (PACKET_PUBLISH)
+    uint8_t payload[VIRTUAL_MQTT_MAX_PAYLOAD]; // Payload of the message
+    uint16_t len;                              // Length of the payload
+} packet_t;
+
+/**
+ * @brief A message kept by the broker.
+ */
+typedef struct
+{
+    char topic[VIRTUAL_MQTT_TOPIC_LEN];
+    uint8_t payload[VIRTUAL_MQTT_MAX_PAYLOAD];
+    uint16_t len;
+} published_t;
+
+cyw43_t cyw43_state;
+
+static struct mqtt_client_s _client;
+static uint32_t _latencyUs = 5000;
+static bool _silent = false;
+static mqtt_connection_status_t _connackStatus = MQTT_CONNECT_ACCEPTED;
+static packet_t _packets[VIRTUAL_MQTT_MAX_PACKETS];
+static uint32_t _packetSeq = 0;
+static char _subs[VIRTUAL_MQTT_MAX_SUBS][VIRTUAL_MQTT_TOPIC_LEN];
+static published_t _published[VIRTUAL_MQTT_MAX_PUBLISHED];
+static uint32_t _publishedCount = 0;
+
+static mqtt_connection_cb_t _connCb;
+static void *_connArg;
+static mqtt_incoming_publish_cb_t _pubCb;
+static mqtt_incoming_data_cb_t _dataCb;
+static void *_inArg;
+
+/**
+ * @brief Sends a packet, arriving after the given number of trips over the link.
+ *
+ * @return The packet, NULL if too many are on their way.
+ */
+static packet_t *_send(packet_type_t type, uint32_t trips)
+{
+    for (int i = 0; i < VIRTUAL_MQTT_MAX_PACKETS; i++)
+    {
+        if (!_packets[i].used)
+        {
+            packet_t *packet = &_packets[i];
+            memset(packet, 0, offsetof(packet_t, topic));
+            packet->used = true;
+            packet->seq = _packetSeq++;
+            packet->dueUs = time_us_64() + (uint64_t)_latencyUs * trips;
+            packet->type = type;
+            return packet;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Checks if the client has subscribed to a topic (exact match, no wildcards).
+ */
+static bool _isSubscribed(const char *topic)
+{
+    for (int i = 0; i < VIRTUAL_MQTT_MAX_SUBS; i++)
+    {
+        if (_subs[i][0] && !strcmp(_subs[i], topic))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Hands a packet that has arrived to the client.
+ */
+static void _deliver(packet_t *packet)
+{
+    switch (packet->type)
+    {
+    case PACKET_TCP_UP:
+        _client.conn_state = VIRTUAL_MQTT_MQTT_CONNECTING;
+        break;
+    case PACKET_CONNACK:
+        // A refused connection is closed by the client, which then reports why.
+        _client.conn_state = (_connackStatus == MQTT_CONNECT_ACCEPTED) ? VIRTUAL_MQTT_MQTT_CONNECTED : VIRTUAL_MQTT_TCP_DISCONNECTED;
+        if (_connCb)
+        {
+            _connCb(&_client, _connArg, _connackStatus);
+        }
+        break;
+    case PACKET_ACK:
+        if (packet->cb)
+        {
+            packet->cb(packet->cbArg, ERR_OK);
+        }
+        break;
+    case PACKET_PUBLISH:
+        if (_pubCb)
+        {
+            _pubCb(_inArg, packet->topic, packet->len);
+        }
+        if (_dataCb && packet->len)
+        {
+            _dataCb(_inArg, packet->payload, packet->len, MQTT_DATA_FLAG_LAST);
+        }
+        break;
+    }
+}
+
+#pragma region Virtual broker
+
+void virtual_mqtt_setLatency(uint32_t us)
+{
+    _latencyUs = us;
+}
+
+void virtual_mqtt_setSilent(bool silent)
+{
+    _silent = silent;
+}
+
+void virtual_mqtt_setConnackStatus(mqtt_connection_status_t status)
+{
+    _connackStatus = status;
+}
+
+uint32_t virtual_mqtt_getPublishedCount(void)
+{
+    return _publishedCount;
+}
+
+const char *virtual_mqtt_getPublished(uint32_t index, const uint8_t **payload, uint16_t *len)
+{
+    if ((index >= _publishedCount) || (index >= VIRTUAL_MQTT_MAX_PUBLISHED))
+    {
+        return NULL;
+    }
+    *payload = _published[index].payload;
+    *len = _published[index].len;
+    return _published[index].topic;
+}
+
+void virtual_mqtt_clearPublished(void)
+{
+    _publishedCount = 0;
+}
+
+#pragma endregion
+
+#pragma region cyw43
+
+int cyw43_arch_init_with_country(uint32_t country)
+{
+    (void)country;
+    return 0;
+}
+
+void cyw43_arch_enable_sta_mode(void)
+{
+}
+
+int cyw43_arch_wifi_connect_async(const char *ssid, const char *pw, uint32_t auth)
+{
+    (void)ssid;
+    (void)pw;
+    (void)auth;
+    return 0;
+}
+
+int cyw43_tcpip_link_status(cyw43_t *self, int itf)
+{
+    (void)itf;
+    self->netif[0].ip_addr.addr = 0x0201A8C0u; // 192.168.1.2
+    return CYW43_LINK_UP;
+}
+
+int cyw43_wifi_get_rssi(cyw43_t *self, int32_t *rssi)
+{
+    (void)self;
+    *rssi = -55;
+    return 0;
+}
+
+void cyw43_arch_poll(void)
+{
+    while (1)
+    {
+        packet_t *next = NULL;
+        for (int i = 0; i < VIRTUAL_MQTT_MAX_PACKETS; i++)
+        {
+            packet_t *packet = &_packets[i];
+            if (packet->used && (packet->dueUs <= time_us_64()) && ((next == NULL) || (packet->seq < next->seq)))
+            {
+                next = packet;
+            }
+        }
+        if (next == NULL)
+        {
+            return;
+        }
+        // Freed first, the callbacks can send the next packets.
+        next->used = false;
+        _deliver(next);
+    }
+}
+
+#pragma endregion
+
+#pragma region lwIP
+
+char *ip4addr_ntoa(const ip_addr_t *addr)
+{
+    static char text[16];
+    snprintf(text, sizeof(text), "%u.%u.%u.%u", (unsigned)(addr->addr & 0xFF), (unsigned)((addr->addr >> 8) & 0xFF),
+             (unsigned)((addr->addr >> 16) & 0xFF), (unsigned)(addr->addr >> 24));
+    return text;
+}
+
+err_t dns_gethostbyname(const char *hostname, ip_addr_t *addr, dns_found_callback found, void *callback_arg)
+{
+    (void)hostname;
+    (void)found;
+    (void)callback_arg;
+    addr->addr = VIRTUAL_MQTT_BROKER_ADDR;
+    return ERR_OK;
+}
+
+mqtt_client_t *mqtt_client_new(void)
+{
+    memset(&_client, 0, sizeof(_client));
+    return &_client;
+}
+
+err_t mqtt_client_connect(mqtt_client_t *client, const ip_addr_t *ipaddr, u16_t port, mqtt_connection_cb_t cb, void *arg,
+                          const struct mqtt_connect_client_info_t *client_info)
+{
+    (void)ipaddr;
+    (void)port;
+    if (client->conn_state != VIRTUAL_MQTT_TCP_DISCONNECTED)
+    {
+        return ERR_ISCONN;
+    }
+    client->keep_alive = client_info->keep_alive;
+    client->conn_state = VIRTUAL_MQTT_TCP_CONNECTING;
+    _connCb = cb;
+    _connArg = arg;
+    memset(_subs, 0, sizeof(_subs));
+    _send(PACKET_TCP_UP, 1);
+    _send(PACKET_CONNACK, 2);
+    return ERR_OK;
+}
+
+void mqtt_disconnect(mqtt_client_t *client)
+{
+    // The packets on their way are lost with the connection, lwIP does not call the callbacks of the requests.
+    client->conn_state = VIRTUAL_MQTT_TCP_DISCONNECTED;
+    memset(_packets, 0, sizeof(_packets));
+}
+
+u8_t mqtt_client_is_connected(mqtt_client_t *client)
+{
+    return client->conn_state == VIRTUAL_MQTT_MQTT_CONNECTED;
+}
+
+void mqtt_set_inpub_callback(mqtt_client_t *client, mqtt_incoming_publish_cb_t pub_cb, mqtt_incoming_data_cb_t data_cb, void *arg)
+{
+    (void)client;
+    _pubCb = pub_cb;
+    _dataCb = data_cb;
+    _inArg = arg;
+}
+
+err_t mqtt_sub_unsub(mqtt_client_t *client, const char *topic, u8_t qos, mqtt_request_cb_t cb, void *arg, u8_t sub)
+{
+    (void)qos;
+    if (!mqtt_client_is_connected(client))
+    {
+        return ERR_CONN;
+    }
+    if (strlen(topic) >= VIRTUAL_MQTT_TOPIC_LEN)
+    {
+        return ERR_ARG;
+    }
+    if (!_silent)
+    {
+        packet_t *ack = _send(PACKET_ACK, 2);
+        if (ack == NULL)
+        {
+            return ERR_MEM;
+        }
+        ack->cb = cb;
+        ack->cbArg = arg;
+    }
+
+    for (int i = 0; i < VIRTUAL_MQTT_MAX_SUBS; i++)
+    {
+        if (sub && (_subs[i][0] == 0))
+        {
+            strcpy(_subs[i], topic);
+            break;
+        }
+        if (!sub && !strcmp(_subs[i], topic))
+        {
+            _subs[i][0] = 0;
+        }
+    }
+    return ERR_OK;
+}
+
+err_t mqtt_publish(mqtt_client_t *client, const char *topic, const void *payload, u16_t payload_length, u8_t qos, u8_t retain,
+                   mqtt_request_cb_t cb, void *arg)
+{
+    (void)qos;
+    (void)retain;
+    if (!mqtt_client_is_connected(client))
+    {
+        return ERR_CONN;
+    }
+    if ((strlen(topic) >= VIRTUAL_MQTT_TOPIC_LEN) || (payload_length > VIRTUAL_MQTT_MAX_PAYLOAD))
+    {
+        return ERR_ARG;
+    }
+    if (_silent)
+    {
+        // Lost on the way: never acknowledged, never sent back.
+        return ERR_OK;
+    }
+    packet_t *ack = _send(PACKET_ACK, 2);
+    if (ack == NULL)
+    {
+        return ERR_MEM;
+    }
+    ack->cb = cb;
+    ack->cbArg = arg;
+
+    if (_publishedCount < VIRTUAL_MQTT_MAX_PUBLISHED)
+    {
+        published_t *kept = &_published[_publishedCount];
+        strcpy(kept->topic, topic);
+        memcpy(kept->payload, payload, payload_length);
+        kept->len = payload_length;
+    }
+    _publishedCount++;
+
+    // Sent back to the client, if it subscribed to the topic.
+    if (_isSubscribed(topic))
+    {
+        packet_t *echo = _send(PACKET_PUBLISH, 2);
+        if (echo != NULL)
+        {
+            strcpy(echo->topic, topic);
+            memcpy(echo->payload, payload, payload_length);
+            echo->len = payload_length;
+        }
+    }
+    return ERR_OK;
+}
+
+#pragma endregion
@@ -0,0 +1,81 @@
+/** @file virtual_mqtt.h
+ *
+ * @brief Header file for the virtual broker, the host (Linux) stand-in for the Wi-Fi link, lwIP and the MQTT broker behind them.
+ *
+ * Brief overview of the code:
+ * Implements the lwIP MQTT client (lwip/apps/mqtt.h), the DNS client and the cyw43 calls used by the MQTT library (lib/mqtt_client):
+ * 1. The link is always up, and every name resolves to the broker straight away.
+ * 2. Every packet takes the latency of the link (see virtual_mqtt_setLatency) each way: a connection is accepted, and a request
+ *    acknowledged, one round trip after it was made. Nothing arrives before cyw43_arch_poll is called, as in polling mode on the Pico.
+ * 3. The broker keeps the messages published, for the bench to check, and sends them back to the client if it subscribed to their topic.
+ * 4. The broker can refuse the connections (see virtual_mqtt_setConnackStatus), or stop answering (see virtual_mqtt_setSilent).
+ */
+
+#pragma once
+#ifndef _VIRTUAL_MQTT_H_
+#define _VIRTUAL_MQTT_H_
+
+#include <pico/stdlib.h>
+#include "lwip/apps/mqtt.h"
+
+// Messages kept by the broker (the ones published after them are counted, not kept).
+#define VIRTUAL_MQTT_MAX_PUBLISHED 64
+
+// Largest payload kept by the broker.
+#define VIRTUAL_MQTT_MAX_PAYLOAD 1100
+
+// Longest topic, null terminator included.
+#define VIRTUAL_MQTT_TOPIC_LEN 128
+
+// Most topics subscribed to at once.
+#define VIRTUAL_MQTT_MAX_SUBS 8
+
+// Most packets on their way at once.
+#define VIRTUAL_MQTT_MAX_PACKETS 16
+
+/**
+ * @brief Sets the latency of the link, each way (5 ms at start).
+ *
+ * @param us The latency, in microseconds.
+ */
+void virtual_mqtt_setLatency(uint32_t us);
+
+/**
+ * @brief Makes the broker stop answering, as if the link dropped every packet while the TCP connection stays up.
+ *
+ * The requests made while silent are never acknowledged, and their messages neither kept nor sent back.
+ *
+ * @param silent True to stop answering, False to answer again.
+ */
+void virtual_mqtt_setSilent(bool silent);
+
+/**
+ * @brief Sets the answer of the broker to the next connections (MQTT_CONNECT_ACCEPTED at start).
+ *
+ * @param status MQTT_CONNECT_ACCEPTED, or the reason the connections are refused (MQTT_CONNECT_REFUSED_*).
+ */
+void virtual_mqtt_setConnackStatus(mqtt_connection_status_t status);
+
+/**
+ * @brief Gets the number of messages published since the last virtual_mqtt_clearPublished.
+ *
+ * @return The number of messages.
+ */
+uint32_t virtual_mqtt_getPublishedCount(void);
+
+/**
+ * @brief Gets a message published.
+ *
+ * @param index The index of the message, in the order they were published (up to VIRTUAL_MQTT_MAX_PUBLISHED - 1).
+ * @param payload Set to the payload of the message.
+ * @param len Set to the length of the payload.
+ * @return The topic of the message, NULL if the index is past the messages kept.
+ */
+const char *virtual_mqtt_getPublished(uint32_t index, const uint8_t **payload, uint16_t *len);
+
+/**
+ * @brief Forgets the messages published so far.
+ */
+void virtual_mqtt_clearPublished(void);
+
+#endif // _VIRTUAL_MQTT_H_
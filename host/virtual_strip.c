@@ -0,0 +1,107 @@
+/** @file virtual_strip.c
+ *
+ * @brief This file contains the source code for the virtual LED strip (see virtual_strip.h).
+ */
+
+#include <string.h>
+#include "virtual_strip.h"
+
+// Time to send a byte, and to latch a frame, as on the Pico (see lib/ws2812b).
+#define VIRTUAL_STRIP_BYTE_US 10
+#define VIRTUAL_STRIP_RESET_US 300
+
+/**
+ * @brief A virtual strip.
+ */
+struct ws2812b_strip
+{
+    uint32_t ledCount;                          // Number of LEDs
+    uint8_t back[VIRTUAL_STRIP_MAX_LEDS * 3];   // Frame written by the caller
+    uint8_t shown[VIRTUAL_STRIP_MAX_LEDS * 3];  // Frame last shown
+    uint32_t showCount;                         // Number of frames shown
+    uint32_t queuedCount;                       // Number of frames shown while the frame before was on the wire
+    uint64_t showUs;                            // Time of the last frame shown
+    uint64_t idleUs;                            // Time from which the last frame has been sent and latched
+};
+
+static ws2812b_strip_t _strips[VIRTUAL_STRIP_MAX];
+static uint32_t _stripCount = 0;
+
+ws2812b_strip_t *virtual_strip_create(uint32_t ledCount)
+{
+    if ((_stripCount >= VIRTUAL_STRIP_MAX) || (ledCount == 0) || (ledCount > VIRTUAL_STRIP_MAX_LEDS))
+    {
+        return NULL;
+    }
+    ws2812b_strip_t *strip = &_strips[_stripCount++];
+    memset(strip, 0, sizeof(*strip));
+    strip->ledCount = ledCount;
+    return strip;
+}
+
+const uint8_t *virtual_strip_getShown(const ws2812b_strip_t *strip)
+{
+    return strip->shown;
+}
+
+uint32_t virtual_strip_getShowCount(const ws2812b_strip_t *strip)
+{
+    return strip->showCount;
+}
+
+uint32_t virtual_strip_getQueuedCount(const ws2812b_strip_t *strip)
+{
+    return strip->queuedCount;
+}
+
+uint64_t virtual_strip_getShowTime(const ws2812b_strip_t *strip)
+{
+    return strip->showUs;
+}
+
+#pragma region WS2812B library
+
+uint32_t ws2812b_strip_get_led_count(const ws2812b_strip_t *strip)
+{
+    return strip->ledCount;
+}
+
+void ws2812b_strip_set_all_rgb(ws2812b_strip_t *strip, uint8_t r, uint8_t g, uint8_t b)
+{
+    for (uint32_t i = 0; i < strip->ledCount * 3; i += 3)
+    {
+        strip->back[i] = g;     /* Green */
+        strip->back[i + 1] = r; /* Red */
+        strip->back[i + 2] = b; /* Blue */
+    }
+}
+
+uint8_t *ws2812b_strip_get_frame(ws2812b_strip_t *strip)
+{
+    return strip->back;
+}
+
+void ws2812b_strip_show(ws2812b_strip_t *strip)
+{
+    uint64_t now = time_us_64();
+    uint32_t size = strip->ledCount * 3;
+    uint64_t start = now;
+
+    // Sent once the frame before has been latched.
+    if (now < strip->idleUs)
+    {
+        strip->queuedCount++;
+        start = strip->idleUs;
+    }
+    memcpy(strip->shown, strip->back, size);
+    strip->showCount++;
+    strip->showUs = now;
+    strip->idleUs = start + (uint64_t)size * VIRTUAL_STRIP_BYTE_US + VIRTUAL_STRIP_RESET_US;
+}
+
+bool ws2812b_strip_is_frame_in_flight(const ws2812b_strip_t *strip)
+{
+    return time_us_64() < strip->idleUs;
+}
+
+#pragma endregion
@@ -0,0 +1,65 @@
+/** @file virtual_strip.h
+ *
+ * @brief Header file for the virtual LED strip, the host (Linux) stand-in for the strips of the WS2812B library (lib/ws2812b).
+ *
+ * Brief overview of the code:
+ * Implements the ws2812b_strip_* functions used by the effects (see ws2812b_effects.h) and their bench on frames in RAM:
+ * 1. Each strip has a back frame, written through ws2812b_strip_get_frame, and the frame last shown, as the LEDs would show it.
+ * 2. A frame shown is on the wire for as long as on the Pico (10 us per byte, plus 300 us of reset): the strip is in flight
+ *    until the virtual clock has gone past it, and a frame shown in the meantime is counted as queued.
+ */
+
+#pragma once
+#ifndef _VIRTUAL_STRIP_H_
+#define _VIRTUAL_STRIP_H_
+
+#include <pico/stdlib.h>
+#include "ws2812b_Rebuilt.h"
+
+// Most virtual strips.
+#define VIRTUAL_STRIP_MAX 8
+
+// Most LEDs of a virtual strip.
+#define VIRTUAL_STRIP_MAX_LEDS 1024
+
+/**
+ * @brief Creates a strip, all its LEDs off.
+ *
+ * @param ledCount The number of LEDs, up to VIRTUAL_STRIP_MAX_LEDS.
+ * @return The strip, NULL if VIRTUAL_STRIP_MAX strips have been created.
+ */
+ws2812b_strip_t *virtual_strip_create(uint32_t ledCount);
+
+/**
+ * @brief Gets the frame last shown by a strip (3 bytes per LED, green, red, blue), as the LEDs show it.
+ *
+ * @param strip The strip.
+ * @return The frame.
+ */
+const uint8_t *virtual_strip_getShown(const ws2812b_strip_t *strip);
+
+/**
+ * @brief Gets the number of frames shown by a strip.
+ *
+ * @param strip The strip.
+ * @return The number of frames.
+ */
+uint32_t virtual_strip_getShowCount(const ws2812b_strip_t *strip);
+
+/**
+ * @brief Gets the number of frames shown while the frame before was still on the wire.
+ *
+ * @param strip The strip.
+ * @return The number of frames.
+ */
+uint32_t virtual_strip_getQueuedCount(const ws2812b_strip_t *strip);
+
+/**
+ * @brief Gets the virtual time of the last frame shown by a strip.
+ *
+ * @param strip The strip.
+ * @return The time, in microseconds since boot.
+ */
+uint64_t virtual_strip_getShowTime(const ws2812b_strip_t *strip);
+
+#endif // _VIRTUAL_STRIP_H_
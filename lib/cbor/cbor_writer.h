@@ -0,0 +1,199 @@
+/** @file cbor_writer.h
+ *
+ * @brief This file contains the header file for the CBOR writer library.
+ *
+ * Brief overview of the code:
+ * Encodes the sensor samples as CBOR (RFC 8949) instead of JSON text: the numbers are written in binary
+ * (a float is copied bit for bit, with no printf formatting), and there are no quotes, commas or digits to send.
+ * A sample of the AS7341 (10 channels) takes 68 bytes instead of 107 of JSON, and a float 5 bytes whatever its value.
+ *
+ * A message starts with a schema byte, followed by one CBOR data item (usually a map of the fields):
+ *
+ *   | schema (1) | CBOR item |
+ *
+ * The schema byte tells the subscriber which fields to expect, and is bumped when they change (see CBOR_SCHEMA).
+ * Its top bit is always set, so a CBOR message can never be mistaken for JSON text (which starts with '{', '[', a digit...),
+ * and a subscriber can take both from the same topic.
+ *
+ * The writer never writes past the end of its buffer: once a value does not fit, the writer is marked as overflowed
+ * and ignores the following values, so the result only has to be checked once, at the end (see cbor_isOk).
+ */
+
+#pragma once
+#ifndef _CBOR_WRITER_H_
+#define _CBOR_WRITER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Schema byte of a message, for schema numbers 0 to 127 (the top bit marks the message as CBOR, see above).
+#define CBOR_SCHEMA(number) ((uint8_t)(0x80 | ((number) & 0x7F)))
+
+// Tells a CBOR message from JSON text, from its first byte.
+#define CBOR_IS_SCHEMA(firstByte) (((firstByte) & 0x80) != 0)
+
+/**
+ * @brief A CBOR message being written into a buffer.
+ */
+typedef struct
+{
+    uint8_t *buffer; // Buffer the message is written to
+    size_t size;     // Size of the buffer
+    size_t len;      // Length of the message so far
+    bool overflow;   // A value did not fit in the buffer (it and the following ones were not written)
+} cbor_writer_t;
+
+/**
+ * @brief Starts a message, with its schema byte.
+ *
+ * @param writer The writer.
+ * @param buffer The buffer the message is written to.
+ * @param size The size of the buffer.
+ * @param schema The schema byte (see CBOR_SCHEMA), 0 to write a bare CBOR item without one.
+ */
+void cbor_begin(cbor_writer_t *writer, uint8_t *buffer, size_t size, uint8_t schema);
+
+/**
+ * @brief Opens a map of the given number of key/value pairs (the pairs are written next, keys first).
+ *
+ * @param writer The writer.
+ * @param pairs The number of pairs of the map.
+ */
+void cbor_openMap(cbor_writer_t *writer, uint32_t pairs);
+
+/**
+ * @brief Opens an array of the given number of values (the values are written next).
+ *
+ * @param writer The writer.
+ * @param count The number of values of the array.
+ */
+void cbor_openArray(cbor_writer_t *writer, uint32_t count);
+
+/**
+ * @brief Writes an unsigned integer, on 1 to 9 bytes depending on its value (1 byte up to 23).
+ *
+ * @param writer The writer.
+ * @param value The value.
+ */
+void cbor_putUint(cbor_writer_t *writer, uint64_t value);
+
+/**
+ * @brief Writes a signed integer, on 1 to 9 bytes depending on its magnitude (1 byte from -24 to 23).
+ *
+ * @param writer The writer.
+ * @param value The value.
+ */
+void cbor_putInt(cbor_writer_t *writer, int64_t value);
+
+/**
+ * @brief Writes a single precision float (5 bytes), copied as is: no rounding, and no float formatting.
+ *
+ * @param writer The writer.
+ * @param value The value.
+ */
+void cbor_putFloat(cbor_writer_t *writer, float value);
+
+/**
+ * @brief Writes a boolean (1 byte).
+ *
+ * @param writer The writer.
+ * @param value The value.
+ */
+void cbor_putBool(cbor_writer_t *writer, bool value);
+
+/**
+ * @brief Writes a null (1 byte), e.g. for a value the sensor could not read.
+ *
+ * @param writer The writer.
+ */
+void cbor_putNull(cbor_writer_t *writer);
+
+/**
+ * @brief Writes a text string (UTF-8, not null terminated in the message).
+ *
+ * @param writer The writer.
+ * @param text The null-terminated string.
+ */
+void cbor_putText(cbor_writer_t *writer, const char *text);
+
+/**
+ * @brief Writes a byte string.
+ *
+ * @param writer The writer.
+ * @param data The bytes.
+ * @param len The number of bytes.
+ */
+void cbor_putBytes(cbor_writer_t *writer, const void *data, size_t len);
+
+/**
+ * @brief Copies an item that is already encoded (e.g. a sample kept in flash, without its schema byte) into the message.
+ *
+ * @param writer The writer.
+ * @param item The encoded item.
+ * @param len The length of the item.
+ */
+void cbor_putRaw(cbor_writer_t *writer, const void *item, size_t len);
+
+/**
+ * @brief Writes a key/value pair of a map, with an unsigned integer value.
+ *
+ * @param writer The writer.
+ * @param key The key (a short text, e.g. the JSON name of the field).
+ * @param value The value.
+ */
+void cbor_fieldUint(cbor_writer_t *writer, const char *key, uint64_t value);
+
+/**
+ * @brief Writes a key/value pair of a map, with a signed integer value.
+ *
+ * @param writer The writer.
+ * @param key The key.
+ * @param value The value.
+ */
+void cbor_fieldInt(cbor_writer_t *writer, const char *key, int64_t value);
+
+/**
+ * @brief Writes a key/value pair of a map, with a single precision float value.
+ *
+ * @param writer The writer.
+ * @param key The key.
+ * @param value The value.
+ */
+void cbor_fieldFloat(cbor_writer_t *writer, const char *key, float value);
+
+/**
+ * @brief Writes a key/value pair of a map, with a boolean value.
+ *
+ * @param writer The writer.
+ * @param key The key.
+ * @param value The value.
+ */
+void cbor_fieldBool(cbor_writer_t *writer, const char *key, bool value);
+
+/**
+ * @brief Writes a key/value pair of a map, with a text value.
+ *
+ * @param writer The writer.
+ * @param key The key.
+ * @param text The null-terminated string.
+ */
+void cbor_fieldText(cbor_writer_t *writer, const char *key, const char *text);
+
+/**
+ * @brief Gets the length of the message so far, schema byte included.
+ *
+ * @param writer The writer.
+ * @return The length of the message, in bytes.
+ */
+size_t cbor_getLength(const cbor_writer_t *writer);
+
+/**
+ * @brief Checks that every value written so far fitted in the buffer.
+ *
+ * @param writer The writer.
+ * @return True if the message is complete; False if the buffer was too small (the message must not be sent).
+ */
+bool cbor_isOk(const cbor_writer_t *writer);
+
+#endif // _CBOR_WRITER_H_
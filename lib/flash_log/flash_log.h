@@ -0,0 +1,151 @@
+/** @file flash_log.h
+ *
+ * @brief This file contains the header file for the flash log library.
+ *
+ * Brief overview of the code:
+ * A store-and-forward buffer for the sensor samples taken while the broker (or the access point) is unreachable.
+ * The samples are appended to a log kept in a reserved region at the end of the QSPI flash of the Pico,
+ * and replayed in order, at a limited rate, once the connection comes back (see flash_log_replay).
+ *
+ * The region is split in FLASH_LOG_SECTORS sectors of 4 KB, used one after the other as a ring:
+ * every sector is erased once per lap, so the wear is spread evenly over the whole region.
+ * Each sector starts with a header (sequence number, erase count), followed by the records:
+ *
+ *   | magic | len | tag | sent | boot (2) | crc16 (2) | timestamp (4) | data (len) | padding to 4 bytes |
+ *
+ * A record is only ever programmed once, except for its `sent` byte, which is cleared once the record has been replayed.
+ * A record cut short by a power loss fails its CRC and is ignored (along with the rest of its sector) when the log is opened again,
+ * and a sector is retired (its header cleared) before being erased, so an interrupted erase never brings old records back.
+ *
+ * Do note that the flash cannot be read while it is being written: interrupts are disabled during each write,
+ * and core 1 must not be running code from flash at that time.
+ */
+
+#pragma once
+#ifndef _FLASH_LOG_H_
+#define _FLASH_LOG_H_
+
+#include <pico/stdlib.h>
+#include <hardware/flash.h>
+
+// Number of 4 KB sectors reserved for the log, at the end of the flash (the program must not grow into them).
+#ifndef FLASH_LOG_SECTORS
+#define FLASH_LOG_SECTORS 32
+#endif
+
+// Offset of the log region from the start of the flash.
+#define FLASH_LOG_OFFSET (PICO_FLASH_SIZE_BYTES - FLASH_LOG_SECTORS * FLASH_SECTOR_SIZE)
+
+// Largest data of a record, in bytes.
+#define FLASH_LOG_MAX_DATA 240
+
+// Default number of records replayed per second (see flash_log_setReplayRate).
+#ifndef FLASH_LOG_DEFAULT_REPLAY_RATE
+#define FLASH_LOG_DEFAULT_REPLAY_RATE 5
+#endif
+
+/**
+ * @brief A record of the log, as handed to the replay callback.
+ */
+typedef struct
+{
+    uint16_t boot;       // Boot count at which the record was appended (see flash_log_getBoot)
+    uint32_t timestamp;  // Timestamp given to flash_log_append
+    uint8_t tag;         // Tag given to flash_log_append (e.g. which topic the data goes to)
+    uint8_t len;         // Length of the data
+    const uint8_t *data; // Data of the record (points into the flash, only valid during the callback)
+} flash_log_record_t;
+
+/**
+ * @brief Replay callback, called for each record waiting to be replayed, oldest first.
+ *
+ * @param record The record to replay.
+ * @param arg The user argument given to flash_log_replay.
+ * @return True if the record has been taken care of (it is marked as replayed), False to stop the replay there (it is offered again next time).
+ */
+typedef bool (*flash_log_replay_cb_t)(const flash_log_record_t *record, void *arg);
+
+/**
+ * @brief Statistics of the log since flash_log_begin.
+ */
+typedef struct
+{
+    uint32_t appended; // Number of records appended
+    uint32_t replayed; // Number of records replayed
+    uint32_t dropped;  // Number of records erased before being replayed (the log was full)
+    uint32_t torn;     // Number of records found cut short by a power loss when the log was opened
+    uint32_t erases;   // Number of sectors erased
+    uint32_t pending;  // Number of records waiting to be replayed
+} flash_log_stats_t;
+
+/**
+ * @brief Opens the log: finds the sectors in use, and where the next record goes and which record is replayed next.
+ *
+ * Records cut short by a power loss are skipped. The boot count is incremented (see flash_log_getBoot).
+ * Must be called once at start up, before any other function of the library.
+ *
+ * @return The number of records waiting to be replayed.
+ */
+uint32_t flash_log_begin(void);
+
+/**
+ * @brief Appends a record to the log.
+ *
+ * If the log is full, the oldest sector is erased to make room (its records that have not been replayed are dropped).
+ *
+ * @param tag The tag of the record (e.g. which topic the data goes to).
+ * @param timestamp The timestamp of the record (e.g. time since boot in ms, see flash_log_getBoot).
+ * @param data The data of the record.
+ * @param len The length of the data, up to FLASH_LOG_MAX_DATA bytes.
+ * @return True if the record has been written; False if it is too large or could not be written.
+ */
+bool flash_log_append(uint8_t tag, uint32_t timestamp, const void *data, uint8_t len);
+
+/**
+ * @brief Replays the records waiting in the log, oldest first, at the replay rate (see flash_log_setReplayRate).
+ *
+ * Call it regularly from the main loop once the connection is back: each call replays the records allowed since the previous one,
+ * up to one second worth of records.
+ *
+ * @param cb The callback called for each record.
+ * @param arg The user argument passed to the callback.
+ * @return The number of records replayed.
+ */
+uint32_t flash_log_replay(flash_log_replay_cb_t cb, void *arg);
+
+/**
+ * @brief Sets the number of records replayed per second, so a long outage does not flood the broker when the connection comes back.
+ *
+ * @param recordsPerSecond The number of records replayed per second (at least 1).
+ */
+void flash_log_setReplayRate(uint32_t recordsPerSecond);
+
+/**
+ * @brief Gets the number of records waiting to be replayed.
+ *
+ * @return The number of records waiting to be replayed.
+ */
+uint32_t flash_log_getPending(void);
+
+/**
+ * @brief Gets the boot count, incremented by every flash_log_begin.
+ *
+ * Stored with each record, so a timestamp relative to the boot can be told apart from the same timestamp of another boot.
+ *
+ * @return The boot count.
+ */
+uint16_t flash_log_getBoot(void);
+
+/**
+ * @brief Gets the statistics of the log since flash_log_begin.
+ *
+ * @param stats Filled in with the statistics.
+ */
+void flash_log_getStats(flash_log_stats_t *stats);
+
+/**
+ * @brief Erases the whole log.
+ */
+void flash_log_clear(void);
+
+#endif // _FLASH_LOG_H_
@@ -11,6 +11,92 @@
 
 #include "pico/stdlib.h"
 
+// Number of publish/subscribe requests that can wait for the broker at the same time (see mqtt_set_inflight_window).
+// lwIP tracks at most MQTT_REQ_MAX_IN_FLIGHT requests per client, so there is no point in having more slots than that.
+#ifndef MQTT_INFLIGHT_SLOTS
+#define MQTT_INFLIGHT_SLOTS MQTT_REQ_MAX_IN_FLIGHT
+#endif
+
+// Size of the ring arena holding the messages of the outbound queue, in bytes (see mqtt_outbox_enqueue).
+// Multiple of 4, up to 65532 (the records hold their size on 16 bits).
+#ifndef MQTT_OUTBOX_ARENA_SIZE
+#define MQTT_OUTBOX_ARENA_SIZE 4096
+#endif
+
+// Number of topics that can be given an overflow policy, and max length of those topics (null terminator included).
+#ifndef MQTT_OUTBOX_MAX_POLICIES
+#define MQTT_OUTBOX_MAX_POLICIES 8
+#endif
+#define MQTT_OUTBOX_TOPIC_LEN 64
+
+// Number of topics that can be batched, and size of the batch buffer of each, in bytes (see mqtt_batch_begin).
+// A batch is published as one message, so lwIP's MQTT_OUTPUT_RINGBUF_SIZE (lwipopts.h) must hold a full buffer.
+#ifndef MQTT_BATCH_MAX_TOPICS
+#define MQTT_BATCH_MAX_TOPICS 2
+#endif
+#ifndef MQTT_BATCH_BUFFER_SIZE
+#define MQTT_BATCH_BUFFER_SIZE 1024
+#endif
+
+// Deadline of each stage of the connection to the broker, in milliseconds (see mqtt_conn_poll).
+// A stage that takes longer is given up, and tried again after the backoff delay.
+#ifndef MQTT_CONN_WIFI_TIMEOUT_MS
+#define MQTT_CONN_WIFI_TIMEOUT_MS 30000
+#endif
+#ifndef MQTT_CONN_DNS_TIMEOUT_MS
+#define MQTT_CONN_DNS_TIMEOUT_MS 10000
+#endif
+#ifndef MQTT_CONN_TCP_TIMEOUT_MS
+#define MQTT_CONN_TCP_TIMEOUT_MS 10000
+#endif
+#ifndef MQTT_CONN_CONNECT_TIMEOUT_MS
+#define MQTT_CONN_CONNECT_TIMEOUT_MS 10000
+#endif
+#ifndef MQTT_CONN_SUBSCRIBE_TIMEOUT_MS
+#define MQTT_CONN_SUBSCRIBE_TIMEOUT_MS 10000
+#endif
+
+// Time between two pings of the liveness monitoring, sent to <client id>/ping and sent back by the broker, in milliseconds (see mqtt_get_liveness).
+#ifndef MQTT_LIVENESS_PING_INTERVAL_MS
+#define MQTT_LIVENESS_PING_INTERVAL_MS 30000
+#endif
+
+// Time a ping has to come back before the session is considered dead, in milliseconds (see mqtt_get_liveness).
+#ifndef MQTT_LIVENESS_PING_TIMEOUT_MS
+#define MQTT_LIVENESS_PING_TIMEOUT_MS 10000
+#endif
+
+// Time between two readings of the signal strength of the access point, in milliseconds.
+#ifndef MQTT_LIVENESS_RSSI_INTERVAL_MS
+#define MQTT_LIVENESS_RSSI_INTERVAL_MS 10000
+#endif
+
+// Status published (once per session) to the will topic, the will message being the offline status.
+#ifndef MQTT_ONLINE_MESSAGE
+#define MQTT_ONLINE_MESSAGE "ONLINE"
+#endif
+
+// Delay before the first retry, and largest delay between two attempts, in milliseconds (see mqtt_conn_set_backoff).
+#ifndef MQTT_CONN_BACKOFF_MIN_MS
+#define MQTT_CONN_BACKOFF_MIN_MS 1000
+#endif
+#ifndef MQTT_CONN_BACKOFF_MAX_MS
+#define MQTT_CONN_BACKOFF_MAX_MS 60000
+#endif
+
+// Number of topic filters the router can hold, and max number of levels of a filter (see mqtt_router_add).
+#ifndef MQTT_ROUTER_MAX_ROUTES
+#define MQTT_ROUTER_MAX_ROUTES 16
+#endif
+#ifndef MQTT_ROUTER_MAX_LEVELS
+#define MQTT_ROUTER_MAX_LEVELS 8
+#endif
+
+// Longest topic of an incoming message, null terminator included (messages with a longer topic are dropped, see mqtt_inbox_get_stats).
+#ifndef MQTT_INBOX_TOPIC_LEN
+#define MQTT_INBOX_TOPIC_LEN 128
+#endif
+
 typedef struct MQTT_CLIENT_T_
 {
     ip_addr_t remote_addr;
@@ -46,6 +132,163 @@ typedef enum SUB_OR_UNSUB
     SUB
 } eSubOrUnsub;
 
+/**
+ * @brief Completion callback of a publish/subscribe request.
+ *
+ * Called once the request is over: acknowledged by the broker (QoS 1/2), handed to TCP (QoS 0),
+ * timed out (ERR_TIMEOUT), or dropped with the connection (ERR_CONN).
+ *
+ * @param err - ERR_OK if the request completed, an error code otherwise.
+ * @param arg - User argument passed with the request.
+ */
+typedef void (*mqtt_request_done_cb_t)(err_t err, void *arg);
+
+/**
+ * @brief Statistics of the in-flight window (see mqtt_get_inflight_stats).
+ */
+typedef struct MQTT_INFLIGHT_STATS_T_
+{
+    u32_t completed;       // Number of requests completed successfully.
+    u32_t failed;          // Number of requests rejected by lwIP, timed out or dropped with the connection.
+    u32_t max_in_flight;   // Largest number of requests waiting for the broker at the same time.
+    u32_t max_rtt_us;      // Longest time between handing a request to lwIP and its completion, in microseconds.
+    uint64_t total_rtt_us; // Total of those times for the completed requests, in microseconds.
+} mqtt_inflight_stats_t;
+
+/**
+ * @brief Overflow policy of a topic in the outbound queue (see mqtt_outbox_set_policy).
+ */
+typedef enum OUTBOX_POLICY
+{
+    OUTBOX_DROP_OLDEST, // Keep every message, the oldest messages of the queue are dropped when it is full
+    OUTBOX_KEEP_LATEST  // Only keep the latest message of the topic, queuing a message drops the older ones
+} eOutboxPolicy;
+
+/**
+ * @brief Statistics of the outbound queue (see mqtt_outbox_get_stats).
+ */
+typedef struct MQTT_OUTBOX_STATS_T_
+{
+    u32_t enqueued;   // Number of messages queued.
+    u32_t sent;       // Number of messages handed to lwIP.
+    u32_t failed;     // Number of messages rejected by lwIP (other than for a full output buffer).
+    u32_t dropped;    // Number of messages dropped because the queue was full (or because they were larger than it).
+    u32_t replaced;   // Number of messages dropped for a more recent message of the same topic (OUTBOX_KEEP_LATEST).
+    u32_t queued;     // Number of messages waiting in the queue.
+    u32_t max_queued; // Largest number of messages waiting in the queue at the same time.
+} mqtt_outbox_stats_t;
+
+/**
+ * @brief Statistics of the batches since boot (see mqtt_batch_get_stats).
+ */
+typedef struct MQTT_BATCH_STATS_T_
+{
+    u32_t samples;       // Number of samples added to a batch.
+    u32_t messages;      // Number of batches queued for publishing (one message each).
+    u32_t flush_count;   // Number of batches flushed because they held max_samples samples.
+    u32_t flush_age;     // Number of batches flushed because their first sample was max_age_ms old.
+    u32_t flush_size;    // Number of batches flushed because the next sample did not fit.
+    u32_t dropped;       // Number of batches (or samples too large for a batch) the outbound queue had no room for.
+} mqtt_batch_stats_t;
+
+/**
+ * @brief Stage of the connection to the broker (see mqtt_conn_poll).
+ */
+typedef enum MQTT_CONN_STATE
+{
+    MQTT_CONN_BACKOFF,     // Waiting before the next attempt (at start up, or after a failure)
+    MQTT_CONN_WIFI,        // Joining the access point
+    MQTT_CONN_DNS,         // Resolving the address of the broker
+    MQTT_CONN_TCP,         // Opening the TCP connection to the broker
+    MQTT_CONN_CONNECT,     // Waiting for the broker to accept the MQTT CONNECT
+    MQTT_CONN_SUBSCRIBING, // Connected, waiting for the subscriptions made by the connected callback
+    MQTT_CONN_SUBSCRIBED   // Connected and subscribed
+} eMqttConnState;
+
+/**
+ * @brief Connected callback, called from mqtt_conn_poll every time the broker accepts the connection.
+ *
+ * This is where the topics are subscribed to (the incoming messages go to the inbox, see mqtt_inbox_set_message_callback).
+ * The online status is published by the library once the subscriptions are acknowledged (see mqtt_get_liveness).
+ * The connection only counts as up (MQTT_CONN_SUBSCRIBED) once the subscriptions made here are acknowledged.
+ *
+ * @param arg - User argument passed to mqtt_conn_set_connected_callback.
+ */
+typedef void (*mqtt_conn_connected_cb_t)(void *arg);
+
+/**
+ * @brief Disconnected callback, called from mqtt_conn_poll when a session (MQTT_CONN_SUBSCRIBED) ends.
+ *
+ * The broker publishes the will message on its own, and mqtt_conn_poll starts reconnecting after the backoff delay.
+ *
+ * @param reason - Why the session ended, for the logs.
+ * @param arg - User argument passed to mqtt_conn_set_disconnected_callback.
+ */
+typedef void (*mqtt_conn_disconnected_cb_t)(const char *reason, void *arg);
+
+/**
+ * @brief Liveness of the session (see mqtt_get_liveness).
+ */
+typedef struct MQTT_LIVENESS_T_
+{
+    bool connected;            // The session is up (MQTT_CONN_SUBSCRIBED).
+    u32_t sessions;            // Number of sessions since boot (the online status is published once per session).
+    uint64_t session_start_us; // Time at which the current (or last) session started.
+    u32_t silence_ms;          // Time since the broker was last heard from (a message, or a request acknowledged).
+    u32_t ping_rtt_us;         // Round trip of the latest ping, from lwIP taking it to the broker sending it back.
+    u32_t max_ping_rtt_us;     // Longest of those round trips since boot.
+    u32_t pings;               // Number of pings back in this session (one every MQTT_LIVENESS_PING_INTERVAL_MS).
+    int32_t rssi;              // Signal strength of the access point, in dBm.
+} mqtt_liveness_t;
+
+/**
+ * @brief Chunk callback of the inbox, called for every fragment of an incoming message as lwIP hands it over (see mqtt_inbox_set_chunk_callback).
+ *
+ * The fragments come in order, and the message is complete once offset + len == total_len.
+ * A message without payload comes as a single call with data NULL and len 0.
+ *
+ * @param topic - Topic of the message (null terminated, valid until the message is complete).
+ * @param offset - Offset of the fragment in the payload.
+ * @param data - The fragment (points into the lwIP receive buffer, only valid during the call).
+ * @param len - Length of the fragment.
+ * @param total_len - Length of the whole payload.
+ * @param arg - User argument passed to mqtt_inbox_set_chunk_callback.
+ */
+typedef void (*mqtt_inbox_chunk_cb_t)(const char *topic, u32_t offset, const u8_t *data, u16_t len, u32_t total_len, void *arg);
+
+/**
+ * @brief Message callback of the inbox, called once an incoming message has been reassembled (see mqtt_inbox_set_message_callback).
+ *
+ * @param topic - Topic of the message (null terminated).
+ * @param payload - Payload of the message, in the arena of the caller (null terminated, valid until the next message comes in).
+ * @param len - Length of the payload, null terminator excluded.
+ * @param arg - User argument passed to mqtt_inbox_set_message_callback.
+ */
+typedef void (*mqtt_inbox_message_cb_t)(const char *topic, const u8_t *payload, u32_t len, void *arg);
+
+/**
+ * @brief Statistics of the inbox since boot (see mqtt_inbox_get_stats).
+ */
+typedef struct MQTT_INBOX_STATS_T_
+{
+    u32_t messages;       // Number of messages handed to the application.
+    u32_t bytes;          // Number of payload bytes handed to the application.
+    u32_t too_large;      // Number of messages dropped because their payload did not fit in the arena.
+    u32_t topic_too_long; // Number of messages dropped because their topic is longer than MQTT_INBOX_TOPIC_LEN - 1.
+    u32_t largest;        // Largest payload received, in bytes (dropped messages included).
+} mqtt_inbox_stats_t;
+
+/**
+ * @brief Statistics of the connection to the broker (see mqtt_conn_get_stats).
+ */
+typedef struct MQTT_CONN_STATS_T_
+{
+    u32_t attempts;                            // Number of connection attempts (Wi-Fi stage entered).
+    u32_t connected;                           // Number of attempts that got to MQTT_CONN_SUBSCRIBED.
+    u32_t failures[MQTT_CONN_SUBSCRIBED + 1];  // Number of failures per stage (MQTT_CONN_SUBSCRIBED: connection lost once up).
+    u32_t last_backoff_ms;                     // Delay before the latest attempt, in milliseconds.
+} mqtt_conn_stats_t;
+
 /**
  * @brief Configures MQTT settings for connection.
  *
@@ -88,12 +331,12 @@ void set_mqtt_config(
     u8_t retain_will);
 
 /**
- * @brief Initializes the MQTT client and performs DNS lookup.
+ * @brief Initializes the MQTT client.
  *
- * This function creates a new MQTT client, allocates memory for the MQTT client state,
- * and performs a DNS lookup to resolve the server address.
+ * This function creates a new MQTT client and allocates memory for the MQTT client state.
+ * It does not wait for the network: the connection is then made by mqtt_conn_poll, called from the main loop.
  *
- * @note requires that Wi-Fi is connected and the MQTT configuration is set before calling.
+ * @note requires that the MQTT configuration is set before calling.
  */
 void mqtt_client_init();
 
@@ -107,27 +350,159 @@ void mqtt_client_init();
  *
  * @note Before calling this function, please ensure that the following has been performed in the following order:
  * @note 1. WiFi connection is established and the MQTT configuration is set. (see set_mqtt_config())
- * @note 2. mqtt_client_init() called. (for initializing the MQTT client, performing DNS lookup, etc. All the good stuff.)
+ * @note 2. mqtt_client_init() called, and the address of the broker resolved. (mqtt_conn_poll does all of that, and calls this function.)
  */
 err_t mqtt_begin_connection();
 
+/**
+ * @brief Sets the access point the connection state machine joins (see mqtt_conn_poll).
+ *
+ * Without it, the Wi-Fi stage only waits for the link to come up (e.g. joined by the application).
+ *
+ * @param ssid - SSID of the access point.
+ * @param password - Password of the access point.
+ * @param auth - Authentication type (e.g. CYW43_AUTH_WPA2_AES_PSK).
+ */
+void mqtt_conn_set_wifi(const char *ssid, const char *password, u32_t auth);
+
+/**
+ * @brief Sets the callback called every time the broker accepts the connection (see mqtt_conn_connected_cb_t).
+ *
+ * @param cb - Connected callback (can be NULL).
+ * @param arg - User argument passed to the callback.
+ */
+void mqtt_conn_set_connected_callback(mqtt_conn_connected_cb_t cb, void *arg);
+
+/**
+ * @brief Sets the callback called when the session ends (see mqtt_conn_disconnected_cb_t).
+ *
+ * @param cb - Disconnected callback (can be NULL).
+ * @param arg - User argument passed to the callback.
+ */
+void mqtt_conn_set_disconnected_callback(mqtt_conn_disconnected_cb_t cb, void *arg);
+
+/**
+ * @brief Gets the liveness of the session: whether it is up, the ping round trip, and the signal strength.
+ *
+ * Once the session is up, mqtt_conn_poll publishes the online status (MQTT_ONLINE_MESSAGE) to the will topic, once.
+ * It also sends a ping to <client id>/ping every MQTT_LIVENESS_PING_INTERVAL_MS (the client subscribes to it on connection),
+ * and ends the session early if the broker does not send it back within MQTT_LIVENESS_PING_TIMEOUT_MS.
+ * The pings stop if the subscription is refused, or the incoming messages are taken over (see set_mqtt_subscribe_callback).
+ *
+ * @param l - Filled in with the liveness of the session.
+ */
+void mqtt_get_liveness(mqtt_liveness_t *l);
+
+/**
+ * @brief Sets the delays between the connection attempts.
+ *
+ * The delay doubles with every failed attempt, from min_ms up to max_ms, and is drawn at random
+ * between half and all of it, so that a fleet of Picos losing the broker at the same time does not reconnect in lockstep.
+ *
+ * @param min_ms - Delay before the first retry, in milliseconds.
+ * @param max_ms - Largest delay between two attempts, in milliseconds.
+ */
+void mqtt_conn_set_backoff(u32_t min_ms, u32_t max_ms);
+
+/**
+ * @brief Drives the connection to the broker: Wi-Fi, DNS, TCP, MQTT CONNECT, then the subscriptions.
+ *
+ * This function never waits: call it from the main loop, next to cyw43_arch_poll. Every stage has its deadline
+ * (MQTT_CONN_*_TIMEOUT_MS); a stage that fails or times out, or a connection that is lost, closes the connection
+ * and starts again from the Wi-Fi stage after the backoff delay (see mqtt_conn_set_backoff).
+ *
+ * @return eMqttConnState - The stage of the connection.
+ */
+eMqttConnState mqtt_conn_poll();
+
+/**
+ * @brief Gets the stage of the connection to the broker.
+ *
+ * @return eMqttConnState - The stage of the connection.
+ */
+eMqttConnState mqtt_conn_get_state();
+
+/**
+ * @brief Gets the name of a stage of the connection, for the logs.
+ *
+ * @param state - The stage of the connection.
+ * @return const char* - The name of the stage.
+ */
+const char *mqtt_conn_state_name(eMqttConnState state);
+
+/**
+ * @brief Gets the statistics of the connection to the broker since boot.
+ *
+ * @param stats - Filled in with the statistics.
+ */
+void mqtt_conn_get_stats(mqtt_conn_stats_t *stats);
+
 /**
  * @brief Publishes MQTT data to the specified topic.
  *
  * This function publishes MQTT data to the specified topic using the configured MQTT client.
- * It waits for the previous pubsub operation to finish before initiating a new one.
+ * It only waits for a free slot in the in-flight window (see mqtt_set_inflight_window), not for the previous messages
+ * to be acknowledged, so several messages can be on their way to the broker at the same time.
+ * The topic and message are copied by lwIP, the buffers can be reused as soon as this function returns.
  *
  * @param topic - MQTT topic to which the data will be published.
  * @param message - Message data to be published.
- * @return err_t - ERR_OK if the publishing is successful, an error code otherwise.
+ * @return err_t - ERR_OK if the message has been queued, an error code otherwise.
  */
 err_t mqtt_publish_data(const char *topic, const char *message);
 
+/**
+ * @brief Publishes MQTT data to the specified topic, and reports its completion.
+ *
+ * Same as mqtt_publish_data, the callback is called once the message is acknowledged by the broker (QoS 1/2)
+ * or handed to TCP (QoS 0), or once it has failed.
+ *
+ * @param topic - MQTT topic to which the data will be published.
+ * @param message - Message data to be published.
+ * @param cb - Completion callback (can be NULL), only called if ERR_OK is returned.
+ * @param arg - User argument passed to the completion callback.
+ * @return err_t - ERR_OK if the message has been queued, an error code otherwise.
+ */
+err_t mqtt_publish_data_w_callback(const char *topic, const char *message, mqtt_request_done_cb_t cb, void *arg);
+
+/**
+ * @brief Sets the number of publish/subscribe requests that can wait for the broker at the same time.
+ *
+ * A window of 1 waits for every message to be acknowledged before sending the next one (one message per round trip).
+ * A larger window sends the next messages straight away, so the throughput scales with the window.
+ *
+ * @param window - Number of requests in flight, from 1 to MQTT_INFLIGHT_SLOTS (clamped).
+ * @return u8_t - The window applied.
+ */
+u8_t mqtt_set_inflight_window(u8_t window);
+
+/**
+ * @brief Gets the number of publish/subscribe requests waiting for the broker.
+ *
+ * @return u8_t - Number of requests in flight.
+ */
+u8_t mqtt_get_inflight_count();
+
+/**
+ * @brief Waits for every publish/subscribe request in flight to complete (e.g. before going to sleep).
+ *
+ * @param timeout_ms - Maximum time to wait, in milliseconds.
+ * @return `True` if no request is in flight anymore, `False` if the timeout expired first.
+ */
+bool mqtt_wait_inflight(u32_t timeout_ms);
+
+/**
+ * @brief Gets the statistics of the in-flight window since boot.
+ *
+ * @param stats - Filled in with the statistics.
+ */
+void mqtt_get_inflight_stats(mqtt_inflight_stats_t *stats);
+
 /**
  * @brief Subscribes or unsubscribes from an MQTT topic.
  *
  * This function subscribes or unsubscribes from the specified MQTT topic using the configured MQTT client.
- * It waits for the previous pubsub operation to finish before initiating a new one.
+ * It takes a slot of the in-flight window, like a publish.
  *
  * @param topic - MQTT topic to subscribe or unsubscribe from.
  * @param sub_or_unsub - Enumeration specifying whether to subscribe (SUB) or unsubscribe (UNSUB).
@@ -139,8 +514,9 @@ err_t mqtt_subscribe_topic(const char *topic, eSubOrUnsub sub_or_unsub);
  * @brief Sets the callback functions for incoming MQTT publish notifications and payloads.
  *
  * This function allows the user to set custom callback functions for processing incoming MQTT publish notifications and payloads.
- * If not set, the default callback functions will be used instead, which simply prints debug information about the incoming message.
- * Otherwise, if set, the user-defined callback functions will be used instead.
+ * If not set, the default callback functions will be used instead, which hand the incoming messages to the inbox
+ * (see mqtt_inbox_set_message_callback and mqtt_inbox_set_chunk_callback).
+ * Otherwise, if set, the user-defined callback functions will be used instead, until the next connection to the broker.
  *
  * @param pub_cb - Callback function for processing new incoming message topics and information about it's payload.
  * @param data_cb - Callback function for incoming message payload.
@@ -152,6 +528,87 @@ err_t mqtt_subscribe_topic(const char *topic, eSubOrUnsub sub_or_unsub);
  */
 void set_mqtt_subscribe_callback(mqtt_incoming_publish_cb_t pub_cb, mqtt_incoming_data_cb_t data_cb, void *arg);
 
+/**
+ * @brief Hands the incoming messages to the application fragment by fragment, without copying them.
+ *
+ * Meant for payloads too large to be held in RAM at once (e.g. streamed to the flash or straight to a LED strip).
+ * Replaces the message callback (see mqtt_inbox_set_message_callback). The callback is called from the lwIP context.
+ *
+ * @param cb - Chunk callback (NULL: incoming messages are dropped).
+ * @param arg - User argument passed to the callback.
+ */
+void mqtt_inbox_set_chunk_callback(mqtt_inbox_chunk_cb_t cb, void *arg);
+
+/**
+ * @brief Reassembles the incoming messages into an arena of the caller, and hands each of them to the application once complete.
+ *
+ * The arena holds one message at a time, so its size is the largest payload accepted plus the null terminator:
+ * larger messages are dropped (see mqtt_inbox_get_stats). Replaces the chunk callback (see mqtt_inbox_set_chunk_callback).
+ * The callback is called from the lwIP context.
+ *
+ * @param arena - Buffer the messages are reassembled into (must outlive the client).
+ * @param size - Size of the arena, in bytes.
+ * @param cb - Message callback (NULL: incoming messages are dropped).
+ * @param arg - User argument passed to the callback.
+ */
+void mqtt_inbox_set_message_callback(u8_t *arena, u32_t size, mqtt_inbox_message_cb_t cb, void *arg);
+
+/**
+ * @brief Gets the statistics of the inbox since boot.
+ *
+ * @param stats - Filled in with the statistics.
+ */
+void mqtt_inbox_get_stats(mqtt_inbox_stats_t *stats);
+
+/**
+ * @brief Registers a handler for the incoming messages whose topic matches a topic filter.
+ *
+ * The filter follows the MQTT rules: `+` matches exactly one level, and `#` (last level only) matches any number of levels,
+ * none included (e.g. `farm/+/temperature`, `farm/#`). Filters without wildcards are looked up in a hash table,
+ * the others are matched level by level on precomputed hashes of the levels, so a message costs one pass over its topic,
+ * whatever the number of filters. Every matching handler is called: the exact filters first, then the wildcard ones,
+ * each in the order they were added.
+ * The filters are subscribed to by mqtt_router_subscribe_all. Meant to be called at start up.
+ *
+ * @param filter - Topic filter (not copied, must outlive the router, e.g. a string literal or a static buffer).
+ * @param handler - Handler called with the matching messages.
+ * @param arg - User argument passed to the handler.
+ * @return err_t - ERR_OK if registered, ERR_ARG if the filter is not valid (or has more than MQTT_ROUTER_MAX_LEVELS levels),
+ * ERR_MEM if MQTT_ROUTER_MAX_ROUTES handlers are already registered.
+ */
+err_t mqtt_router_add(const char *filter, mqtt_inbox_message_cb_t handler, void *arg);
+
+/**
+ * @brief Sets the handler called with the messages that match no filter (e.g. to log them).
+ *
+ * @param handler - Handler (NULL: those messages are ignored).
+ * @param arg - User argument passed to the handler.
+ */
+void mqtt_router_set_default(mqtt_inbox_message_cb_t handler, void *arg);
+
+/**
+ * @brief Hands an incoming message to the handlers whose filter matches its topic (see mqtt_router_add).
+ *
+ * Has the signature of a message callback, so it can be given to the inbox as is:
+ * `mqtt_inbox_set_message_callback(arena, sizeof(arena), mqtt_router_dispatch, NULL)`.
+ *
+ * @param topic - Topic of the message.
+ * @param payload - Payload of the message.
+ * @param len - Length of the payload.
+ * @param arg - Unused.
+ */
+void mqtt_router_dispatch(const char *topic, const u8_t *payload, u32_t len, void *arg);
+
+/**
+ * @brief Subscribes to every filter of the router (once per filter, even if several handlers share it).
+ *
+ * Call it from the connected callback (see mqtt_conn_set_connected_callback), so the connection only counts as up
+ * once the broker has acknowledged all the subscriptions.
+ *
+ * @return err_t - ERR_OK if every subscribe request has been sent, the error of the last one that failed otherwise.
+ */
+err_t mqtt_router_subscribe_all();
+
 /**
  * @brief Gets the MQTT buffer length.
  *
@@ -165,30 +622,177 @@ int getMqttBufferLength();
  * @brief Checks if the MQTT client is ready for the next pub/sub operation.
  *
  * This function returns a boolean value indicating whether the system is ready
- * for the next publish or subscribe operation. It checks the readiness flag.
+ * for the next publish or subscribe operation, i.e. whether it would be sent without waiting.
  *
- * @return `True` if there are no currently running pub/sub operations, `False` otherwise.
+ * @return `True` if there is a free slot in the in-flight window, `False` otherwise.
  */
 bool readyForNextPubSub();
 
+/**
+ * @brief Checks if the MQTT client is connected to the broker.
+ *
+ * @return `True` if the connection to the broker is up, `False` otherwise.
+ */
+bool mqtt_is_connected();
+
+/**
+ * @brief Sets the overflow policy of a topic in the outbound queue.
+ *
+ * With OUTBOX_DROP_OLDEST (the default), every message of the topic is kept until sent, and the oldest messages
+ * of the queue are dropped when the arena is full. With OUTBOX_KEEP_LATEST, queuing a message of the topic drops
+ * the messages of that topic still waiting in the queue (e.g. a sensor reading, only the latest value matters).
+ *
+ * @param topic - MQTT topic the policy applies to (copied, up to MQTT_OUTBOX_TOPIC_LEN - 1 characters).
+ * @param policy - Overflow policy of the topic.
+ * @return `True` if the policy has been set, `False` if the topic is too long or the policy table is full.
+ */
+bool mqtt_outbox_set_policy(const char *topic, eOutboxPolicy policy);
+
+/**
+ * @brief Queues an MQTT message to be published by mqtt_outbox_poll, and returns straight away.
+ *
+ * Unlike mqtt_publish_data, this never waits for the broker, so the sampling cadence of the app does not depend on it.
+ * The topic and the message are copied into a ring arena of MQTT_OUTBOX_ARENA_SIZE bytes, so the buffers can be reused
+ * as soon as this function returns. If the arena is full, the oldest messages are dropped to make room.
+ *
+ * @param topic - MQTT topic to which the data will be published.
+ * @param message - Message data to be published.
+ * @return err_t - ERR_OK if the message has been queued, ERR_MEM if it is larger than the arena.
+ */
+err_t mqtt_outbox_enqueue(const char *topic, const char *message);
+
+/**
+ * @brief Queues a binary MQTT message (e.g. a CBOR payload, which can hold null bytes) to be published by mqtt_outbox_poll.
+ *
+ * Same as mqtt_outbox_enqueue, with the length of the message given instead of taken from a null terminator.
+ *
+ * @param topic - MQTT topic to which the data will be published.
+ * @param message - Message data to be published.
+ * @param len - Length of the message, in bytes.
+ * @return err_t - ERR_OK if the message has been queued, ERR_MEM if it is larger than the arena,
+ * ERR_INPROGRESS if a reservation is open (see mqtt_outbox_reserve).
+ */
+err_t mqtt_outbox_enqueue_w_len(const char *topic, const void *message, u16_t len);
+
+/**
+ * @brief Reserves room for a message at the tail of the outbound queue, for the app to write it there directly
+ * (e.g. with the JSON writer) instead of building it in a buffer of its own and having it copied by mqtt_outbox_enqueue.
+ *
+ * The message is not sent until mqtt_outbox_commit, and nothing else can be queued or sent in between:
+ * write the message and commit it (or cancel it) straight away. Unlike mqtt_outbox_enqueue, no message is ever dropped
+ * to make room: only the free room of the arena is taken, as max_len is usually well above the length of the message.
+ * The policy of the topic applies here: with OUTBOX_KEEP_LATEST, the older messages of the topic are dropped
+ * even if the reservation is cancelled.
+ *
+ * @param topic - MQTT topic to which the data will be published.
+ * @param max_len - Most bytes the message can take (the room reserved holds one more, for a null terminator).
+ * @return char* - Where the message goes, NULL if the free room is too small (try again once mqtt_outbox_poll has sent
+ * some messages), if it is larger than the arena, or if a reservation is already open.
+ */
+char *mqtt_outbox_reserve(const char *topic, u16_t max_len);
+
+/**
+ * @brief Queues the message written in the room reserved by mqtt_outbox_reserve, and gives the unused room back.
+ *
+ * @param len - Length of the message, in bytes (up to the max_len given to mqtt_outbox_reserve).
+ * @return err_t - ERR_OK if the message has been queued, ERR_VAL if no room is reserved or len is larger than it.
+ */
+err_t mqtt_outbox_commit(u16_t len);
+
+/**
+ * @brief Gives back the room reserved by mqtt_outbox_reserve, without queuing anything (e.g. the message did not fit).
+ */
+void mqtt_outbox_cancel();
+
+/**
+ * @brief Publishes the queued messages, as far as the in-flight window and the lwIP output buffer allow.
+ *
+ * This function never waits: it stops at the first message that cannot be handed to lwIP straight away,
+ * and leaves it at the head of the queue for the next call. Call it from the main loop, next to cyw43_arch_poll.
+ * Nothing is sent while the client is disconnected, the messages wait in the queue (or get dropped when it is full).
+ *
+ * @return u32_t - Number of messages handed to lwIP.
+ */
+u32_t mqtt_outbox_poll();
+
+/**
+ * @brief Gets the number of messages waiting in the outbound queue.
+ *
+ * @return u32_t - Number of messages queued.
+ */
+u32_t mqtt_outbox_count();
+
+/**
+ * @brief Gets the statistics of the outbound queue since boot.
+ *
+ * @param stats - Filled in with the statistics.
+ */
+void mqtt_outbox_get_stats(mqtt_outbox_stats_t *stats);
+
+/**
+ * @brief Batches the samples published to a topic, so that they go out as one message instead of one message each.
+ *
+ * The samples added to the topic (see mqtt_batch_add) accumulate in a buffer, and are queued for publishing as
+ * {"t0":<time of the first sample>,"v":[[<dt>,<sample>],[<dt>,<sample>],...]}
+ * (t0 in milliseconds since boot, dt in milliseconds since t0) once the batch holds max_samples samples,
+ * once its first sample is max_age_ms old (see mqtt_batch_poll), or when the next sample would not fit in max_bytes.
+ *
+ * @param topic - Topic to batch (not copied, must outlive the batch, e.g. a string literal or a static buffer).
+ * @param max_samples - Number of samples per message at most.
+ * @param max_age_ms - Time a sample can wait in the batch at most, in milliseconds.
+ * @param max_bytes - Size of a message at most, in bytes (up to MQTT_BATCH_BUFFER_SIZE, 0: MQTT_BATCH_BUFFER_SIZE).
+ * @return err_t - ERR_OK if the topic is batched, ERR_ARG if a parameter is not valid,
+ * ERR_MEM if MQTT_BATCH_MAX_TOPICS topics are already batched.
+ */
+err_t mqtt_batch_begin(const char *topic, u16_t max_samples, u32_t max_age_ms, u16_t max_bytes);
+
+/**
+ * @brief Adds a sample to the batch of its topic, or queues it as a message of its own if the topic is not batched.
+ *
+ * @param topic - MQTT topic of the sample.
+ * @param sample - The sample, as a JSON value (e.g. {"CO2":412,"Temperature":23}).
+ * @return err_t - ERR_OK if the sample has been added (or queued), ERR_MEM if the outbound queue had no room for it
+ * or for the batch it completed.
+ */
+err_t mqtt_batch_add(const char *topic, const char *sample);
+
+/**
+ * @brief Queues the batches whose first sample is max_age_ms old. Call it from the main loop, next to mqtt_outbox_poll.
+ *
+ * @return u32_t - Number of batches queued.
+ */
+u32_t mqtt_batch_poll();
+
+/**
+ * @brief Queues the batch of a topic straight away, whatever its thresholds (e.g. before going to sleep).
+ *
+ * @param topic - Batched topic (NULL: every batch).
+ * @return err_t - ERR_OK if queued (or empty), ERR_MEM if the outbound queue had no room for it.
+ */
+err_t mqtt_batch_flush(const char *topic);
+
+/**
+ * @brief Gets the statistics of the batches since boot.
+ *
+ * @param stats - Filled in with the statistics.
+ */
+void mqtt_batch_get_stats(mqtt_batch_stats_t *stats);
+
 /**
  * @brief Callback function for incoming MQTT publish notifications.
  *
  * When an incoming publish is received, this function is called to process information about the incoming message.
  * This includes the topic of the message, and as well as the total length of the payload.
  *
- * We then use this information to check if the incoming payload will fit in our processing buffer.
- * and if it does, we set the payload_total_len variable to the total length of the incoming payload,
- * and reset the payload_cpy_index variable to 0, which is the index of the payload buffer to copy the next incoming payload byte to.
- *
- * Otherwise, if the incoming payload does not fit in our processing buffer, we set the payload_total_len variable to 0,
- * and discard the incoming payload.
+ * We then keep a copy of the topic (lwIP only passes it here), and check if the incoming payload will fit in the arena
+ * of the reassembly mode (see mqtt_inbox_set_message_callback). If either does not fit, the message is dropped.
+ * A message without payload is handed to the application straight away.
  *
  * @param arg - Pointer to the MQTT client state structure.
  * @param topic - MQTT topic to which the incoming publish is sent.
  * @param tot_len - Total length of the incoming payload.
  *
- * @note If the incoming message does not contain a payload, mqtt_incoming_payload_cb() will not be called.
+ * @note If the incoming message does not contain a payload, mqtt_incoming_payload_cb() may not be called.
  * @note ~~
  */
 static void mqtt_incoming_notification_cb(void *arg, const char *topic, u32_t tot_len);
@@ -197,14 +801,15 @@ static void mqtt_incoming_notification_cb(void *arg, const char *topic, u32_t to
  * @brief Callback function for incoming MQTT publish payloads.
  *
  * When an incoming message is received, this function is called to process the payload of the incoming message.
- * This function copies the incoming payload byte by byte into the payload buffer.
+ * This function hands the fragment to the chunk callback, or copies it into the arena of the reassembly mode,
+ * and hands the message to the application once it is complete.
  *
  * @param arg - Pointer to the MQTT client state structure.
  * @param data - Pointer to the incoming payload data.
  * @param len - Length of the incoming payload.
  * @param flags - Flags indicating the status of the incoming payload.
  *
- * @note If the incoming message does not contain a payload, this function will not be called.
+ * @note If the incoming message does not contain a payload, this function may not be called (the message is complete on notification).
  * @note ~~
  */
 static void mqtt_incoming_payload_cb(void *arg, const u8_t *data, u16_t len, u8_t flags);
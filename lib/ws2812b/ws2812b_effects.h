@@ -0,0 +1,156 @@
+/** @file ws2812b_effects.h
+ * Lighting effects of the WS2812B LED library: keyframe timelines (sunrise and sunset ramps, cross-fades, pulses)
+ * played on the strips by a frame scheduler, without blocking the caller.
+ *
+ * Brief overview of the code:
+ * An effect is a timeline of up to WS2812B_EFFECT_MAX_KEYFRAMES keyframes: each one is a colour, reached in a given time
+ * from the colour before it (the first one from the colours the LEDs had when the effect started).
+ * A repeating timer ticks at the frame rate given to ws2812b_effects_init: at each tick, the colour of every LED of every strip
+ * playing an effect is interpolated between the two keyframes around the current time, in fixed point (16-bit fractions, no float),
+ * and the frame is handed over to be sent (see ws2812b_strip_show).
+ * The frames follow the clock, not the ticks: a tick that finds a frame still being sent skips it, and the next frame is where the effect should be by then.
+ *
+ * The effects can be driven over MQTT with text commands (see ws2812b_effect_command), so a node can run a photoperiod
+ * (e.g. a 24 hour looping timeline of sunrise, day, sunset and night) without a remote client sending every frame.
+ */
+#ifndef WS2812B_EFFECTS_H
+#define WS2812B_EFFECTS_H
+
+/* Libraries */
+
+#include "pico/stdlib.h"
+#include "ws2812b_Rebuilt.h"
+
+#define WS2812B_EFFECT_MAX_KEYFRAMES 8 // Most keyframes of an effect
+
+/**
+ * @brief A keyframe of an effect: a colour, and the time taken to reach it from the keyframe before.
+ */
+typedef struct
+{
+    uint32_t duration_ms; // Time to reach the colour from the one before, in ms (0 to jump to it)
+    uint8_t r;            // Red color component (0-255)
+    uint8_t g;            // Green color component (0-255)
+    uint8_t b;            // Blue color component (0-255)
+} ws2812b_keyframe_t;
+
+#pragma region Effect functions
+
+/**
+ * @brief Play a timeline of keyframes on a strip, starting now from the colours its LEDs have.
+ *
+ * @param strip The strip (see ws2812b_add_strip, and ws2812b_get_strip for the onboard and external LEDs).
+ * @param keyframes The keyframes, in order (copied, they need not be kept).
+ * @param count The number of keyframes (1 to WS2812B_EFFECT_MAX_KEYFRAMES).
+ * @param loop Whether to start the timeline again once it has ended (from the last colour, back to the first keyframe); otherwise the LEDs keep the last colour.
+ * @param phase_ms Delay of each LED after the one before, in ms (0: all the LEDs change together), e.g. for a running light or a wave along the strip.
+ * @return True if the effect is playing; False if the keyframes are invalid, or if no effect slot or memory is left for the strip (a message is printed).
+ *
+ * @note An effect started on a strip replaces the one it was playing, starting from the colours it had reached.
+ *       The frames are sent by the frame scheduler (see ws2812b_effects_init): the set_* functions must not be used on the strip
+ *       while the effect plays, their colours would be overwritten by the next frame (see ws2812b_effect_stop).
+ *       The first effect of a strip takes a slot (WS2812B_MAX_EFFECTS) and a copy of its colours (3 bytes per LED, from WS2812B_EFFECTS_ARENA_SIZE),
+ *       both kept for the next effects of the strip: there is no need to stop an effect to free them.
+ *       Must be called from the core that called ws2812b_effects_init (the timer interrupt renders the frames on that core).
+ *       Example usage: ws2812b_keyframe_t blink[] = {{0, 255, 0, 0}, {500, 255, 0, 0}, {0, 0, 0, 0}, {500, 0, 0, 0}};
+ *                      ws2812b_effect_play(ws2812b_get_strip(WS2812B_LED_TYPE_EXTERNAL), blink, 4, true, 0);
+ */
+bool ws2812b_effect_play(ws2812b_strip_t *strip, const ws2812b_keyframe_t *keyframes, uint32_t count, bool loop, uint32_t phase_ms);
+
+/**
+ * @brief Stop the effect playing on a strip, its LEDs keep the colours they had reached.
+ *
+ * @param strip The strip.
+ */
+void ws2812b_effect_stop(ws2812b_strip_t *strip);
+
+/**
+ * @brief Check whether an effect is playing on a strip.
+ *
+ * @param strip The strip.
+ * @return True until the effect has been stopped, or has shown its last keyframe (never for a looping effect).
+ */
+bool ws2812b_effect_is_playing(const ws2812b_strip_t *strip);
+
+/**
+ * @brief Cross-fade all the LEDs of a strip to a colour.
+ *
+ * @param strip The strip.
+ * @param r Red color component (0-255).
+ * @param g Green color component (0-255).
+ * @param b Blue color component (0-255).
+ * @param duration_ms Time to reach the colour, in ms.
+ * @return True if the effect is playing (see ws2812b_effect_play).
+ */
+bool ws2812b_effect_fade(ws2812b_strip_t *strip, uint8_t r, uint8_t g, uint8_t b, uint32_t duration_ms);
+
+/**
+ * @brief Ramp a strip up like a sunrise: from off, through deep red and orange, to a warm white.
+ *
+ * @param strip The strip.
+ * @param duration_ms Length of the ramp, in ms.
+ * @return True if the effect is playing (see ws2812b_effect_play).
+ *
+ * @note The ramp starts from off, whatever the colours of the strip, and ends at full brightness.
+ */
+bool ws2812b_effect_sunrise(ws2812b_strip_t *strip, uint32_t duration_ms);
+
+/**
+ * @brief Ramp a strip down like a sunset: the sunrise colours in reverse, from the current colours down to off.
+ *
+ * @param strip The strip.
+ * @param duration_ms Length of the ramp, in ms.
+ * @return True if the effect is playing (see ws2812b_effect_play).
+ */
+bool ws2812b_effect_sunset(ws2812b_strip_t *strip, uint32_t duration_ms);
+
+/**
+ * @brief Pulse a strip: fade to a colour and back to off, over and over.
+ *
+ * @param strip The strip.
+ * @param r Red color component (0-255).
+ * @param g Green color component (0-255).
+ * @param b Blue color component (0-255).
+ * @param period_ms Length of a pulse, in ms (half of it up, half of it down).
+ * @param phase_ms Delay of each LED after the one before, in ms (0: all the LEDs pulse together; e.g. period_ms / led count for a running light).
+ * @return True if the effect is playing (see ws2812b_effect_play).
+ */
+bool ws2812b_effect_pulse(ws2812b_strip_t *strip, uint8_t r, uint8_t g, uint8_t b, uint32_t period_ms, uint32_t phase_ms);
+
+/**
+ * @brief Start or stop an effect on a strip from a text command (e.g. the payload of an MQTT message).
+ *
+ * @param strip The strip.
+ * @param command The null-terminated command, one of:
+ *        "stop"
+ *        "fade <RRGGBB> <ms>"
+ *        "sunrise <ms>"
+ *        "sunset <ms>"
+ *        "pulse <RRGGBB> <period ms> [<phase ms>]"
+ *        "timeline [loop] [phase <ms>] <ms> <RRGGBB> [<ms> <RRGGBB> ...]" (up to WS2812B_EFFECT_MAX_KEYFRAMES keyframes, see ws2812b_effect_play)
+ * @return True if the command was valid and applied; False otherwise (a message is printed, the effect playing is left alone).
+ *
+ * @note The colours are on the 0-255 scale of the keyframes and the built-in effects, whatever the scale of the set_*_hex functions.
+ *       Example usage: ws2812b_effect_command(strip, "timeline loop 1800000 FFDDAA 41400000 FFDDAA 1800000 000000 41400000 000000")
+ *       runs a 24 hour photoperiod (30 minutes of sunrise, 11.5 hours of day, 30 minutes of sunset, 11.5 hours of night), from now.
+ */
+bool ws2812b_effect_command(ws2812b_strip_t *strip, const char *command);
+#pragma endregion
+
+#pragma region Initalization functions
+
+/**
+ * @brief Start the frame scheduler of the effects.
+ *
+ * @param fps Frames per second sent to the strips playing an effect (e.g. 30), up to 1000.
+ * @return True if the scheduler is running (or was already); False if fps is invalid or no timer is left (a message is printed).
+ *
+ * @note The frames are rendered from a repeating timer, in the timer interrupt of the calling core: the effects play on
+ *       whatever the main loop is doing (Wi-Fi, MQTT, sensors), and a tick only takes the time to interpolate the LEDs of the strips playing an effect.
+ *       A frame where no LED has changed since the frame before is not sent again (e.g. during a slow ramp).
+ *       Call it after ws2812b_init (and ws2812b_add_strip).
+ */
+bool ws2812b_effects_init(uint32_t fps);
+#pragma endregion
+
+#endif